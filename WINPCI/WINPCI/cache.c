@@ -0,0 +1,1228 @@
+/*++
+
+Module Name:
+
+    cache.c
+
+Abstract:
+
+    Contains the optional read cache. Reads of up to PCIDRV_CACHE_MAX_READ
+    bytes are served from host memory when every block they touch is
+    cached; a miss goes to the device and fills the blocks it covers
+    when it completes. Writes drop the blocks they touch both when they
+    are started and when they complete, so that a read racing with a
+    write can never leave old data behind. Range requests (deallocate and
+    write zeroes) drop their ranges the same way, piece by piece as their
+    commands complete.
+
+    The cache is split into partitions by block number, one per
+    processor, each with a lock of its own; there is no global lock on
+    the lookup path. Every partition replaces blocks with CLOCK-Pro.
+    Resident blocks are hot or cold, and cold blocks that were evicted
+    are remembered for a while as test entries without data. A cold
+    block referenced again before the cold hand comes round turns hot.
+    A test entry that is read again turns hot too and grows the share of
+    cold blocks; one that expires shrinks it. A scan thus only cycles
+    through the cold blocks and leaves the hot ones alone.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "cache.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, PciDrvCacheInitialize)
+#pragma alloc_text (PAGE, PciDrvCacheFree)
+#endif
+
+#define PCIDRV_CACHE_MAX_READ           (64 * 1024) // larger reads bypass the cache
+#define PCIDRV_CACHE_MAX_PARTITIONS     64
+#define PCIDRV_CACHE_MIN_PARTITION      64          // blocks
+
+typedef enum _PCIDRV_CACHE_STATE {
+    CacheEntryFree = 0,
+    CacheEntryHot,
+    CacheEntryCold,
+    CacheEntryTest                      // evicted, in its test period
+} PCIDRV_CACHE_STATE;
+
+typedef struct _PCIDRV_CACHE_ENTRY {
+    struct _PCIDRV_CACHE_ENTRY *Next;           // clock ring
+    struct _PCIDRV_CACHE_ENTRY *Prev;
+    struct _PCIDRV_CACHE_ENTRY *HashNext;       // bucket chain or free list
+    ULONGLONG                   Block;
+    PUCHAR                      Data;           // resident entries only
+    PIRP                        Filler;         // read filling Data, NULL once valid
+    UCHAR                       State;          // PCIDRV_CACHE_STATE
+    BOOLEAN                     Referenced;
+} PCIDRV_CACHE_ENTRY, *PPCIDRV_CACHE_ENTRY;
+
+typedef struct _PCIDRV_CACHE_PARTITION {
+    KSPIN_LOCK              Lock;
+    ULONG                   Capacity;           // resident blocks
+    ULONG                   ColdTarget;         // adaptive share of cold blocks
+    ULONG                   HotCount;
+    ULONG                   ColdCount;
+    ULONG                   TestCount;
+    PPCIDRV_CACHE_ENTRY     HandHot;
+    PPCIDRV_CACHE_ENTRY     HandCold;
+    PPCIDRV_CACHE_ENTRY     HandTest;
+    PPCIDRV_CACHE_ENTRY     FreeEntries;
+    PUCHAR                 *FreeData;           // stack of free data blocks
+    ULONG                   FreeDataCount;
+    PPCIDRV_CACHE_ENTRY    *Buckets;
+    ULONG                   BucketMask;
+    PPCIDRV_CACHE_ENTRY     Entries;            // 2 * Capacity, resident and test
+    PUCHAR                  DataArea;           // Capacity blocks
+} PCIDRV_CACHE_PARTITION, *PPCIDRV_CACHE_PARTITION;
+
+typedef struct _PCIDRV_CACHE {
+    ULONG                   BlockShift;
+    ULONG                   PartitionShift;
+    PCIDRV_CACHE_STATISTICS Statistics;         // counters are interlocked
+    PCIDRV_CACHE_PARTITION  Partitions[1];
+} PCIDRV_CACHE;
+
+
+static
+ULONGLONG
+PciDrvCacheHash(
+    __in ULONGLONG Block
+    )
+{
+    return Block * 0x9E3779B97F4A7C15ULL;
+}
+
+
+static
+PPCIDRV_CACHE_PARTITION
+PciDrvCacheGetPartition(
+    __in PPCIDRV_CACHE Cache,
+    __in ULONGLONG     Hash
+    )
+/*++
+Routine Description:
+
+    Partitions take the top bits of the hash, buckets bits 32 and up.
+
+--*/
+{
+    if (Cache->PartitionShift == 0) {
+        return &Cache->Partitions[0];
+    }
+
+    return &Cache->Partitions[Hash >> (64 - Cache->PartitionShift)];
+}
+
+
+static
+PPCIDRV_CACHE_ENTRY *
+PciDrvCacheGetBucket(
+    __in PPCIDRV_CACHE_PARTITION Partition,
+    __in ULONGLONG               Block
+    )
+{
+    return &Partition->Buckets[(ULONG)(PciDrvCacheHash(Block) >> 32) &
+                               Partition->BucketMask];
+}
+
+
+static
+PPCIDRV_CACHE_ENTRY
+PciDrvCacheFind(
+    __in PPCIDRV_CACHE_PARTITION Partition,
+    __in ULONGLONG               Block
+    )
+{
+    PPCIDRV_CACHE_ENTRY entry;
+
+    for (entry = *PciDrvCacheGetBucket(Partition, Block);
+         entry != NULL;
+         entry = entry->HashNext) {
+        if (entry->Block == Block) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+static
+VOID
+PciDrvCacheDeleteEntry(
+    __in PPCIDRV_CACHE_PARTITION Partition,
+    __in PPCIDRV_CACHE_ENTRY     Entry
+    )
+/*++
+Routine Description:
+
+    Takes an entry off the clock and its bucket and frees it together
+    with its data. Hands pointing at it move on to the next entry.
+
+--*/
+{
+    PPCIDRV_CACHE_ENTRY *link;
+    PPCIDRV_CACHE_ENTRY  next = Entry->Next;
+
+    if (next == Entry) {
+        Partition->HandHot = NULL;
+        Partition->HandCold = NULL;
+        Partition->HandTest = NULL;
+    } else {
+        Entry->Prev->Next = next;
+        next->Prev = Entry->Prev;
+        if (Partition->HandHot == Entry) {
+            Partition->HandHot = next;
+        }
+        if (Partition->HandCold == Entry) {
+            Partition->HandCold = next;
+        }
+        if (Partition->HandTest == Entry) {
+            Partition->HandTest = next;
+        }
+    }
+
+    for (link = PciDrvCacheGetBucket(Partition, Entry->Block);
+         *link != Entry;
+         link = &(*link)->HashNext) {
+        ASSERT(*link != NULL);
+    }
+    *link = Entry->HashNext;
+
+    switch (Entry->State) {
+        case CacheEntryHot:
+            Partition->HotCount--;
+            break;
+        case CacheEntryCold:
+            Partition->ColdCount--;
+            break;
+        case CacheEntryTest:
+            Partition->TestCount--;
+            break;
+    }
+
+    if (Entry->Data != NULL) {
+        Partition->FreeData[Partition->FreeDataCount++] = Entry->Data;
+        Entry->Data = NULL;
+    }
+
+    Entry->Filler = NULL;
+    Entry->State = CacheEntryFree;
+    Entry->HashNext = Partition->FreeEntries;
+    Partition->FreeEntries = Entry;
+}
+
+
+static
+VOID
+PciDrvCacheRunHandHot(
+    __in PPCIDRV_CACHE_PARTITION Partition
+    )
+/*++
+Routine Description:
+
+    One step of the hot hand: a hot block that was not referenced since
+    the last round turns cold, and a test entry it passes has run out
+    its test period.
+
+--*/
+{
+    PPCIDRV_CACHE_ENTRY entry = Partition->HandHot;
+
+    Partition->HandHot = entry->Next;
+
+    switch (entry->State) {
+        case CacheEntryHot:
+            if (entry->Referenced) {
+                entry->Referenced = FALSE;
+            } else {
+                entry->State = CacheEntryCold;
+                Partition->HotCount--;
+                Partition->ColdCount++;
+            }
+            break;
+
+        case CacheEntryTest:
+            PciDrvCacheDeleteEntry(Partition, entry);
+            if (Partition->ColdTarget > 1) {
+                Partition->ColdTarget--;
+            }
+            break;
+    }
+}
+
+
+static
+VOID
+PciDrvCacheRunHandCold(
+    __in PPCIDRV_CACHE_PARTITION Partition
+    )
+/*++
+Routine Description:
+
+    One step of the cold hand: a referenced cold block turns hot, any
+    other cold block loses its data and becomes a test entry.
+
+--*/
+{
+    PPCIDRV_CACHE_ENTRY entry = Partition->HandCold;
+
+    Partition->HandCold = entry->Next;
+
+    if (entry->State != CacheEntryCold) {
+        return;
+    }
+
+    Partition->ColdCount--;
+
+    if (entry->Referenced) {
+        entry->Referenced = FALSE;
+        entry->State = CacheEntryHot;
+        Partition->HotCount++;
+    } else {
+        Partition->FreeData[Partition->FreeDataCount++] = entry->Data;
+        entry->Data = NULL;
+        entry->Filler = NULL;
+        entry->State = CacheEntryTest;
+        Partition->TestCount++;
+    }
+}
+
+
+static
+VOID
+PciDrvCacheRunHandTest(
+    __in PPCIDRV_CACHE_PARTITION Partition
+    )
+/*++
+Routine Description:
+
+    One step of the test hand: ends the test period of the entry under
+    it.
+
+--*/
+{
+    PPCIDRV_CACHE_ENTRY entry = Partition->HandTest;
+
+    Partition->HandTest = entry->Next;
+
+    if (entry->State == CacheEntryTest) {
+        PciDrvCacheDeleteEntry(Partition, entry);
+        if (Partition->ColdTarget > 1) {
+            Partition->ColdTarget--;
+        }
+    }
+}
+
+
+static
+VOID
+PciDrvCacheMakeRoom(
+    __in PPCIDRV_CACHE_PARTITION Partition
+    )
+/*++
+Routine Description:
+
+    Runs the hands until a data block and an entry are free. The hot set
+    is kept within Capacity - ColdTarget; cold blocks are evicted first.
+
+--*/
+{
+    while (Partition->HotCount + Partition->ColdCount >= Partition->Capacity) {
+        if (Partition->ColdCount == 0 ||
+            Partition->HotCount > Partition->Capacity - Partition->ColdTarget) {
+            PciDrvCacheRunHandHot(Partition);
+        } else {
+            PciDrvCacheRunHandCold(Partition);
+        }
+    }
+
+    while (Partition->TestCount >= Partition->Capacity) {
+        PciDrvCacheRunHandTest(Partition);
+    }
+}
+
+
+static
+VOID
+PciDrvCacheReserve(
+    __in PPCIDRV_CACHE Cache,
+    __in ULONGLONG     Block,
+    __in PIRP          Irp
+    )
+/*++
+Routine Description:
+
+    Makes a block that a missed read is about to fetch resident, with the
+    read as its filler. The data becomes visible when the read completes.
+
+--*/
+{
+    PPCIDRV_CACHE_PARTITION partition;
+    PPCIDRV_CACHE_ENTRY     entry;
+    BOOLEAN                 hot = FALSE;
+
+    partition = PciDrvCacheGetPartition(Cache, PciDrvCacheHash(Block));
+
+    KeAcquireSpinLockAtDpcLevel(&partition->Lock);
+
+    entry = PciDrvCacheFind(partition, Block);
+    if (entry != NULL) {
+
+        if (entry->State != CacheEntryTest) {
+            KeReleaseSpinLockFromDpcLevel(&partition->Lock);
+            return;                                 // resident or being filled
+        }
+
+        //
+        // Read again within its test period: the cold set was too small.
+        //
+        PciDrvCacheDeleteEntry(partition, entry);
+        if (partition->ColdTarget < partition->Capacity - 1) {
+            partition->ColdTarget++;
+        }
+        hot = TRUE;
+    }
+
+    PciDrvCacheMakeRoom(partition);
+
+    entry = partition->FreeEntries;
+    partition->FreeEntries = entry->HashNext;
+
+    entry->Block = Block;
+    entry->Data = partition->FreeData[--partition->FreeDataCount];
+    entry->Filler = Irp;
+    entry->Referenced = FALSE;
+
+    if (hot) {
+        entry->State = CacheEntryHot;
+        partition->HotCount++;
+    } else {
+        entry->State = CacheEntryCold;
+        partition->ColdCount++;
+    }
+
+    entry->HashNext = *PciDrvCacheGetBucket(partition, Block);
+    *PciDrvCacheGetBucket(partition, Block) = entry;
+
+    //
+    // New entries go behind the hot hand, the last place it reaches.
+    //
+    if (partition->HandHot == NULL) {
+        entry->Next = entry;
+        entry->Prev = entry;
+        partition->HandHot = entry;
+        partition->HandCold = entry;
+        partition->HandTest = entry;
+    } else {
+        entry->Next = partition->HandHot;
+        entry->Prev = partition->HandHot->Prev;
+        entry->Prev->Next = entry;
+        partition->HandHot->Prev = entry;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&partition->Lock);
+}
+
+
+static
+BOOLEAN
+PciDrvCacheGetRange(
+    __in  PFDO_DATA  FdoData,
+    __in  PIRP       Irp,
+    __out PULONGLONG Offset,
+    __out PULONG     Length
+    )
+/*++
+Routine Description:
+
+    Returns the byte range of a read or write, or FALSE if it is not one
+    the device would accept.
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG              blockMask = (1UL << FdoData->LbaShift) - 1;
+
+    if (irpStack->Parameters.Read.ByteOffset.QuadPart < 0) {
+        return FALSE;
+    }
+
+    *Offset = (ULONGLONG)irpStack->Parameters.Read.ByteOffset.QuadPart;
+    *Length = irpStack->Parameters.Read.Length;
+
+    return (BOOLEAN)(*Length != 0 && ((*Offset | *Length) & blockMask) == 0);
+}
+
+
+static
+VOID
+PciDrvCacheEndFill(
+    __in     PPCIDRV_CACHE Cache,
+    __in     PIRP          Irp,
+    __in     ULONGLONG     Offset,
+    __in     ULONG         Length,
+    __in_opt PUCHAR        Buffer
+    )
+/*++
+Routine Description:
+
+    Ends the reservations of a read: fills the blocks still reserved for
+    it from Buffer, or drops them if Buffer is NULL.
+
+--*/
+{
+    PPCIDRV_CACHE_PARTITION partition;
+    PPCIDRV_CACHE_ENTRY     entry;
+    ULONGLONG               end, block;
+    ULONG                   blockSize = 1UL << Cache->BlockShift;
+    KIRQL                   oldIrql;
+
+    end = Offset + Length;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    for (block = (Offset + blockSize - 1) >> Cache->BlockShift;
+         ((block + 1) << Cache->BlockShift) <= end;
+         block++) {
+
+        partition = PciDrvCacheGetPartition(Cache, PciDrvCacheHash(block));
+
+        KeAcquireSpinLockAtDpcLevel(&partition->Lock);
+
+        entry = PciDrvCacheFind(partition, block);
+        if (entry != NULL && entry->Filler == Irp) {
+            if (Buffer != NULL) {
+                RtlCopyMemory(entry->Data,
+                              Buffer + ((block << Cache->BlockShift) - Offset),
+                              blockSize);
+                entry->Filler = NULL;
+                InterlockedIncrement64((PLONG64)&Cache->Statistics.Fills);
+            } else {
+                PciDrvCacheDeleteEntry(partition, entry);
+            }
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&partition->Lock);
+    }
+
+    KeLowerIrql(oldIrql);
+}
+
+
+static
+VOID
+PciDrvCacheDropRange(
+    __in PPCIDRV_CACHE Cache,
+    __in ULONGLONG     Offset,
+    __in ULONGLONG     Length
+    )
+/*++
+Routine Description:
+
+    Drops every resident block overlapping a range. Test entries hold no
+    data and keep their history. A range spanning more blocks than the
+    cache has entries is dropped by visiting the entries instead.
+
+--*/
+{
+    PPCIDRV_CACHE_PARTITION partition;
+    PPCIDRV_CACHE_ENTRY     entry;
+    ULONGLONG               block, first, last;
+    ULONG                   partitions, p, i;
+    KIRQL                   oldIrql;
+
+    first = Offset >> Cache->BlockShift;
+    last = (Offset + Length - 1) >> Cache->BlockShift;
+    partitions = 1UL << Cache->PartitionShift;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    if (last - first >= (ULONGLONG)partitions * 2 * Cache->Partitions[0].Capacity) {
+
+        for (p = 0; p < partitions; p++) {
+
+            partition = &Cache->Partitions[p];
+
+            KeAcquireSpinLockAtDpcLevel(&partition->Lock);
+
+            for (i = 0; i < 2 * partition->Capacity; i++) {
+                entry = &partition->Entries[i];
+                if ((entry->State == CacheEntryHot || entry->State == CacheEntryCold) &&
+                    entry->Block >= first && entry->Block <= last) {
+                    PciDrvCacheDeleteEntry(partition, entry);
+                    InterlockedIncrement64((PLONG64)&Cache->Statistics.Invalidations);
+                }
+            }
+
+            KeReleaseSpinLockFromDpcLevel(&partition->Lock);
+        }
+
+        KeLowerIrql(oldIrql);
+        return;
+    }
+
+    for (block = first; block <= last; block++) {
+
+        partition = PciDrvCacheGetPartition(Cache, PciDrvCacheHash(block));
+
+        KeAcquireSpinLockAtDpcLevel(&partition->Lock);
+
+        entry = PciDrvCacheFind(partition, block);
+        if (entry != NULL && entry->State != CacheEntryTest) {
+            PciDrvCacheDeleteEntry(partition, entry);
+            InterlockedIncrement64((PLONG64)&Cache->Statistics.Invalidations);
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&partition->Lock);
+    }
+
+    KeLowerIrql(oldIrql);
+}
+
+
+static
+VOID
+PciDrvCacheDropRangeList(
+    __in PPCIDRV_CACHE Cache,
+    __in PIRP          Irp
+    )
+/*++
+Routine Description:
+
+    Drops the ranges of a range request that are still on its list. What
+    is left of a copy lands right below its destination, which moves
+    down as the end of the list is copied.
+
+--*/
+{
+    PPCIDRV_RANGE_LIST list = PCIDRV_IRP_RANGE_LIST(Irp);
+    ULONGLONG          length = 0;
+    ULONG              i;
+
+    if (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_COPY_RANGES) {
+        for (i = 0; i < list->Count; i++) {
+            length += list->Ranges[i].Length;
+        }
+        if (length != 0) {
+            PciDrvCacheDropRange(Cache,
+                                 ((PPCIDRV_COPY_LIST)Irp->AssociatedIrp.SystemBuffer)->Destination - length,
+                                 length);
+        }
+        return;
+    }
+
+    for (i = 0; i < list->Count; i++) {
+        PciDrvCacheDropRange(Cache, list->Ranges[i].Offset, list->Ranges[i].Length);
+    }
+}
+
+
+static
+VOID
+PciDrvCacheDropZones(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Drops what a zone request changes: the zones an action resets,
+    finishes or takes offline, and the blocks a Zone Append was written
+    to, once it has succeeded. Opening and closing zones and reports
+    change no data.
+
+--*/
+{
+    PPCIDRV_ZONE_ACTION action;
+    PPCIDRV_ZONE_APPEND append;
+    ULONGLONG           zoneLength = FdoData->ZoneBlocks << FdoData->LbaShift;
+
+    switch (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode) {
+
+    case IOCTL_MANAGE_ZONES:
+        action = (PPCIDRV_ZONE_ACTION)Irp->AssociatedIrp.SystemBuffer;
+        if (action->Action == PCIDRV_ZONE_OPEN || action->Action == PCIDRV_ZONE_CLOSE) {
+            break;
+        }
+        if (action->AllZones) {
+            PciDrvCacheDropRange(FdoData->ReadCache, 0,
+                                 FdoData->NamespaceBlocks << FdoData->LbaShift);
+        } else {
+            PciDrvCacheDropRange(FdoData->ReadCache,
+                                 action->Offset - action->Offset % zoneLength,
+                                 zoneLength);
+        }
+        break;
+
+    case IOCTL_ZONE_APPEND:
+        if (NT_SUCCESS(Irp->IoStatus.Status)) {
+            append = (PPCIDRV_ZONE_APPEND)Irp->AssociatedIrp.SystemBuffer;
+            PciDrvCacheDropRange(FdoData->ReadCache,
+                                 append->Zone +
+                                 ((ULONGLONG)Irp->IoStatus.Information << FdoData->LbaShift),
+                                 IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+BOOLEAN
+PciDrvCacheLookup(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Serves a read from the cache if every block it touches is there. On
+    a miss the blocks the read fully covers are reserved for it.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         Read IRP
+
+Return Value:
+
+    TRUE if the data was copied, with IoStatus filled in; the caller
+    completes the IRP. FALSE if the read has to go to the device.
+
+--*/
+{
+    PPCIDRV_CACHE           cache;
+    PPCIDRV_CACHE_PARTITION partition;
+    PPCIDRV_CACHE_ENTRY     entry;
+    PUCHAR                  buffer;
+    ULONGLONG               offset, end, block, blockStart, from, to;
+    ULONGLONG               startTime, latency;
+    ULONG                   length, blockSize;
+    BOOLEAN                 hit = TRUE;
+    KIRQL                   oldIrql;
+
+    if (!ExAcquireRundownProtection(&FdoData->CacheRundown)) {
+        return FALSE;
+    }
+
+    cache = FdoData->ReadCache;
+    blockSize = 1UL << cache->BlockShift;
+
+    if (!PciDrvCacheGetRange(FdoData, Irp, &offset, &length) ||
+        length > PCIDRV_CACHE_MAX_READ) {
+        ExReleaseRundownProtection(&FdoData->CacheRundown);
+        return FALSE;
+    }
+
+    buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (buffer == NULL) {
+        ExReleaseRundownProtection(&FdoData->CacheRundown);
+        return FALSE;
+    }
+
+    startTime = KeQueryInterruptTime();
+    end = offset + length;
+
+    InterlockedIncrement64((PLONG64)&cache->Statistics.Lookups);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    for (block = offset >> cache->BlockShift;
+         (block << cache->BlockShift) < end;
+         block++) {
+
+        partition = PciDrvCacheGetPartition(cache, PciDrvCacheHash(block));
+
+        KeAcquireSpinLockAtDpcLevel(&partition->Lock);
+
+        entry = PciDrvCacheFind(partition, block);
+        if (entry == NULL || entry->Data == NULL || entry->Filler != NULL) {
+            KeReleaseSpinLockFromDpcLevel(&partition->Lock);
+            hit = FALSE;
+            break;
+        }
+
+        entry->Referenced = TRUE;
+
+        blockStart = block << cache->BlockShift;
+        from = max(offset, blockStart);
+        to = min(end, blockStart + blockSize);
+        RtlCopyMemory(buffer + (from - offset),
+                      entry->Data + (from - blockStart),
+                      (SIZE_T)(to - from));
+
+        KeReleaseSpinLockFromDpcLevel(&partition->Lock);
+    }
+
+    if (!hit) {
+        for (block = (offset + blockSize - 1) >> cache->BlockShift;
+             ((block + 1) << cache->BlockShift) <= end;
+             block++) {
+            PciDrvCacheReserve(cache, block, Irp);
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+
+    if (hit) {
+        latency = KeQueryInterruptTime() - startTime;
+        InterlockedIncrement64((PLONG64)&cache->Statistics.Hits);
+        InterlockedExchangeAdd64((PLONG64)&cache->Statistics.HitTime, (LONG64)latency);
+
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Irp->IoStatus.Information = length;
+        PciDrvRecordCompletion(Irp, latency);
+    }
+
+    ExReleaseRundownProtection(&FdoData->CacheRundown);
+
+    return hit;
+}
+
+
+VOID
+PciDrvCacheInvalidate(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Drops the cached blocks a write, a range request or a zone action is
+    about to change.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         Write IRP or range request
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONGLONG offset;
+    ULONG     length;
+
+    if (!ExAcquireRundownProtection(&FdoData->CacheRundown)) {
+        return;
+    }
+
+    if (IoGetCurrentIrpStackLocation(Irp)->MajorFunction == IRP_MJ_DEVICE_CONTROL) {
+        if (PCIDRV_IS_ZONE_IOCTL(Irp)) {
+            PciDrvCacheDropZones(FdoData, Irp);
+        } else {
+            PciDrvCacheDropRangeList(FdoData->ReadCache, Irp);
+        }
+    } else if (PciDrvCacheGetRange(FdoData, Irp, &offset, &length)) {
+        PciDrvCacheDropRange(FdoData->ReadCache, offset, length);
+    }
+
+    ExReleaseRundownProtection(&FdoData->CacheRundown);
+}
+
+
+VOID
+PciDrvCacheInvalidateRange(
+    __in PFDO_DATA FdoData,
+    __in ULONGLONG Offset,
+    __in ULONGLONG Length
+    )
+/*++
+Routine Description:
+
+    Drops the cached blocks of a byte range a range request has changed.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Offset      Start of the range
+    Length      Length of the range, not 0
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (!ExAcquireRundownProtection(&FdoData->CacheRundown)) {
+        return;
+    }
+
+    PciDrvCacheDropRange(FdoData->ReadCache, Offset, Length);
+
+    ExReleaseRundownProtection(&FdoData->CacheRundown);
+}
+
+
+VOID
+PciDrvCacheCompleteRequest(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Called with the final status of a read or write that went to the
+    device. A read fills the blocks reserved for it, or drops them if it
+    failed; a write drops its blocks again, in case a read picked up the
+    old data while it was in flight. A range request drops the ranges
+    left on its list, which it failed on, and a zone request what it
+    changed.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         Read or write IRP about to be completed
+
+Return Value:
+
+    None
+
+--*/
+{
+    PPCIDRV_CACHE           cache;
+    PUCHAR                  buffer = NULL;
+    ULONGLONG               offset;
+    ULONG                   length;
+    UCHAR                   majorFunction;
+
+    if (!ExAcquireRundownProtection(&FdoData->CacheRundown)) {
+        return;
+    }
+
+    cache = FdoData->ReadCache;
+    majorFunction = IoGetCurrentIrpStackLocation(Irp)->MajorFunction;
+
+    if (majorFunction == IRP_MJ_DEVICE_CONTROL) {
+        if (PCIDRV_IS_ZONE_IOCTL(Irp)) {
+            PciDrvCacheDropZones(FdoData, Irp);
+        } else {
+            PciDrvCacheDropRangeList(cache, Irp);
+        }
+        ExReleaseRundownProtection(&FdoData->CacheRundown);
+        return;
+    }
+
+    if ((majorFunction != IRP_MJ_READ && majorFunction != IRP_MJ_WRITE) ||
+        !PciDrvCacheGetRange(FdoData, Irp, &offset, &length)) {
+        ExReleaseRundownProtection(&FdoData->CacheRundown);
+        return;
+    }
+
+    if (majorFunction == IRP_MJ_WRITE) {
+        PciDrvCacheDropRange(cache, offset, length);
+        ExReleaseRundownProtection(&FdoData->CacheRundown);
+        return;
+    }
+
+    if (length <= PCIDRV_CACHE_MAX_READ) {
+        if (NT_SUCCESS(Irp->IoStatus.Status)) {
+            buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+        }
+        PciDrvCacheEndFill(cache, Irp, offset, length, buffer);
+    }
+
+    ExReleaseRundownProtection(&FdoData->CacheRundown);
+}
+
+
+VOID
+PciDrvCacheReleaseRequest(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Called for a read or write completed without the device: cancelled
+    or failed while it was held, or completed by cleanup. A read that
+    missed the cache gives up the blocks reserved for it, which would
+    otherwise stay unfilled until evicted. Nothing else holds blocks.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         Read or write IRP about to be completed
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONGLONG offset;
+    ULONG     length;
+
+    if (IoGetCurrentIrpStackLocation(Irp)->MajorFunction != IRP_MJ_READ) {
+        return;
+    }
+
+    if (!ExAcquireRundownProtection(&FdoData->CacheRundown)) {
+        return;
+    }
+
+    if (PciDrvCacheGetRange(FdoData, Irp, &offset, &length) &&
+        length <= PCIDRV_CACHE_MAX_READ) {
+        PciDrvCacheEndFill(FdoData->ReadCache, Irp, offset, length, NULL);
+    }
+
+    ExReleaseRundownProtection(&FdoData->CacheRundown);
+}
+
+
+NTSTATUS
+PciDrvCacheGetStatistics(
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp,
+    __out PULONG    BytesReturned
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_GET_CACHE_STATISTICS. All fields are 0 while the cache
+    is off.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    Irp             The IOCTL request
+    BytesReturned   Receives the size of the data returned
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PIO_STACK_LOCATION       irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PPCIDRV_CACHE_STATISTICS stats;
+    PPCIDRV_CACHE            cache;
+
+    *BytesReturned = 0;
+
+    if (irpStack->Parameters.DeviceIoControl.OutputBufferLength <
+        sizeof(PCIDRV_CACHE_STATISTICS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    stats = (PPCIDRV_CACHE_STATISTICS)Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(stats, sizeof(PCIDRV_CACHE_STATISTICS));
+
+    if (ExAcquireRundownProtection(&FdoData->CacheRundown)) {
+        cache = FdoData->ReadCache;
+        stats->BlockSize     = cache->Statistics.BlockSize;
+        stats->Capacity      = cache->Statistics.Capacity;
+        stats->Lookups       = InterlockedCompareExchange64((PLONG64)&cache->Statistics.Lookups, 0, 0);
+        stats->Hits          = InterlockedCompareExchange64((PLONG64)&cache->Statistics.Hits, 0, 0);
+        stats->Fills         = InterlockedCompareExchange64((PLONG64)&cache->Statistics.Fills, 0, 0);
+        stats->Invalidations = InterlockedCompareExchange64((PLONG64)&cache->Statistics.Invalidations, 0, 0);
+        stats->HitTime       = InterlockedCompareExchange64((PLONG64)&cache->Statistics.HitTime, 0, 0);
+        ExReleaseRundownProtection(&FdoData->CacheRundown);
+    }
+
+    *BytesReturned = sizeof(PCIDRV_CACHE_STATISTICS);
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+PciDrvCacheFreePartitions(
+    __in PPCIDRV_CACHE Cache,
+    __in ULONG         Count
+    )
+{
+    PPCIDRV_CACHE_PARTITION partition;
+    ULONG                   i;
+
+    for (i = 0; i < Count; i++) {
+        partition = &Cache->Partitions[i];
+        if (partition->DataArea != NULL) {
+            ExFreePoolWithTag(partition->DataArea, PCIDRV_POOL_TAG);
+        }
+        if (partition->Entries != NULL) {
+            ExFreePoolWithTag(partition->Entries, PCIDRV_POOL_TAG);
+        }
+        if (partition->Buckets != NULL) {
+            ExFreePoolWithTag(partition->Buckets, PCIDRV_POOL_TAG);
+        }
+        if (partition->FreeData != NULL) {
+            ExFreePoolWithTag(partition->FreeData, PCIDRV_POOL_TAG);
+        }
+    }
+
+    ExFreePoolWithTag(Cache, PCIDRV_POOL_TAG);
+}
+
+
+NTSTATUS
+PciDrvCacheInitialize(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Creates the read cache once the controller is up, if the registry
+    value "ReadCacheSize" (in MB) asks for one. Blocks are a page, or
+    an LBA if that is larger.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PPCIDRV_CACHE           cache;
+    PPCIDRV_CACHE_PARTITION partition;
+    ULONG                   sizeMb, blockShift, partitionShift, partitions;
+    ULONG                   capacity, buckets, i, j;
+    SIZE_T                  size;
+
+    PAGED_CODE();
+
+    if (FdoData->ReadCache != NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    sizeMb = FdoData->Parameters.ReadCacheSize;
+    if (sizeMb == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    blockShift = max(PAGE_SHIFT, FdoData->LbaShift);
+    capacity = sizeMb << (20 - blockShift);
+
+    partitionShift = 0;
+    while ((1UL << partitionShift) < KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS) &&
+           (1UL << partitionShift) < PCIDRV_CACHE_MAX_PARTITIONS &&
+           (capacity >> (partitionShift + 1)) >= PCIDRV_CACHE_MIN_PARTITION) {
+        partitionShift++;
+    }
+    partitions = 1UL << partitionShift;
+    capacity >>= partitionShift;
+
+    if (capacity < 2) {
+        return STATUS_SUCCESS;
+    }
+
+    buckets = 1;
+    while (buckets < 2 * capacity) {
+        buckets <<= 1;
+    }
+
+    size = FIELD_OFFSET(PCIDRV_CACHE, Partitions) + partitions * sizeof(PCIDRV_CACHE_PARTITION);
+    cache = ExAllocatePoolWithTag(NonPagedPool, size, PCIDRV_POOL_TAG);
+    if (cache == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(cache, size);
+
+    cache->BlockShift = blockShift;
+    cache->PartitionShift = partitionShift;
+    cache->Statistics.BlockSize = 1UL << blockShift;
+    cache->Statistics.Capacity = capacity * partitions;
+
+    for (i = 0; i < partitions; i++) {
+
+        partition = &cache->Partitions[i];
+
+        KeInitializeSpinLock(&partition->Lock);
+        partition->Capacity = capacity;
+        partition->ColdTarget = max(1, capacity / 2);
+        partition->BucketMask = buckets - 1;
+
+        partition->DataArea = ExAllocatePoolWithTag(NonPagedPool,
+                                                    (SIZE_T)capacity << blockShift,
+                                                    PCIDRV_POOL_TAG);
+        partition->Entries = ExAllocatePoolWithTag(NonPagedPool,
+                                                   2 * capacity * sizeof(PCIDRV_CACHE_ENTRY),
+                                                   PCIDRV_POOL_TAG);
+        partition->Buckets = ExAllocatePoolWithTag(NonPagedPool,
+                                                   buckets * sizeof(PPCIDRV_CACHE_ENTRY),
+                                                   PCIDRV_POOL_TAG);
+        partition->FreeData = ExAllocatePoolWithTag(NonPagedPool,
+                                                    capacity * sizeof(PUCHAR),
+                                                    PCIDRV_POOL_TAG);
+
+        if (partition->DataArea == NULL || partition->Entries == NULL ||
+            partition->Buckets == NULL || partition->FreeData == NULL) {
+            PciDrvCacheFreePartitions(cache, i + 1);
+            DebugPrint(ERROR, DBG_INIT, "Read cache of %d MB not allocated\n", sizeMb);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlZeroMemory(partition->Entries, 2 * capacity * sizeof(PCIDRV_CACHE_ENTRY));
+        RtlZeroMemory(partition->Buckets, buckets * sizeof(PPCIDRV_CACHE_ENTRY));
+
+        for (j = 0; j < 2 * capacity; j++) {
+            partition->Entries[j].HashNext = partition->FreeEntries;
+            partition->FreeEntries = &partition->Entries[j];
+        }
+
+        for (j = 0; j < capacity; j++) {
+            partition->FreeData[j] = partition->DataArea + ((SIZE_T)j << blockShift);
+        }
+        partition->FreeDataCount = capacity;
+    }
+
+    DebugPrint(INFO, DBG_INIT, "Read cache: %d MB, %d partitions of %d blocks\n",
+               sizeMb, partitions, capacity);
+
+    FdoData->ReadCache = cache;
+    ExReInitializeRundownProtection(&FdoData->CacheRundown);
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+PciDrvCacheFree(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Waits for the requests using the cache to leave it and frees it.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PPCIDRV_CACHE cache = FdoData->ReadCache;
+
+    PAGED_CODE();
+
+    if (cache == NULL) {
+        return;
+    }
+
+    ExWaitForRundownProtectionRelease(&FdoData->CacheRundown);
+
+    FdoData->ReadCache = NULL;
+    PciDrvCacheFreePartitions(cache, 1UL << cache->PartitionShift);
+}
@@ -0,0 +1,717 @@
+/*++
+
+Module Name:
+
+    hw_aer.c
+
+Abstract:
+
+    Contains the asynchronous events: Asynchronous Event Requests kept
+    outstanding on the admin queue, and the cache of the log pages they
+    name. A monitoring agent waits for events with IOCTL_WAIT_ASYNC_EVENT
+    and reads the SMART / health and error information pages from the
+    cache with IOCTL_GET_LOG_PAGE, so that polling them does not put
+    admin commands in front of the device while I/O runs.
+
+    Everything that talks to the device runs in one work item, which is
+    queued by a completed event request, by the start and by a read of a
+    cached page older than the registry value "LogPageMaxAge". It reads
+    the log page of each event, which unmasks the event type on the
+    controller, tells the waiter and sends the request out again.
+
+    Log pages too large to cache, such as the telemetry logs, are read
+    for IOCTL_READ_LOG_PAGE by the thread of the caller, in chunks that
+    the device writes straight to the locked buffer of the caller.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "hw_aer.tmh"
+#endif
+
+static IO_WORKITEM_ROUTINE HwAsyncEventWorker;
+
+static
+VOID
+HwReadLogPage(
+    __in PFDO_DATA FdoData,
+    __in UCHAR     LogPageId
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwSetupAsyncEvents)
+#pragma alloc_text (PAGE, HwFreeAsyncEvents)
+#pragma alloc_text (PAGE, HwAsyncEventWorker)
+#pragma alloc_text (PAGE, HwReadLogPage)
+#endif
+
+
+static
+VOID
+HwQueueAsyncEventWorker(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Queues the work item unless it is queued or running already; it then
+    picks up the new work before it finishes. Called with the event lock
+    held. The work item holds an outstanding I/O reference, so stop and
+    remove wait for it.
+
+--*/
+{
+    if (FdoData->AsyncEventWorkQueued || FdoData->AsyncEventWorkItem == NULL) {
+        return;
+    }
+
+    FdoData->AsyncEventWorkQueued = TRUE;
+    PciDrvIoIncrement(FdoData);
+
+    IoQueueWorkItem(FdoData->AsyncEventWorkItem,
+                    HwAsyncEventWorker,
+                    DelayedWorkQueue,
+                    FdoData);
+}
+
+
+static
+VOID
+HwSubmitAsyncEventRequest(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Sends an Asynchronous Event Request. It has no IRP and no waiter and
+    is never timed out; it completes when an event occurs, or with an
+    error when the controller is reset.
+
+--*/
+{
+    PHW_QUEUE    admin = FdoData->AdminQueue;
+    PHW_REQUEST  request;
+    NVME_COMMAND command;
+
+    request = HwAllocateRequest(admin, 0);
+    if (request == NULL) {
+        return;
+    }
+
+    request->AsyncEvent = TRUE;
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_ASYNC_EVENT_REQUEST;
+
+    if (!NT_SUCCESS(HwSubmitRequest(admin, request, &command))) {
+        HwFreeRequest(admin, request);
+    }
+}
+
+
+static
+VOID
+HwReadLogPage(
+    __in PFDO_DATA FdoData,
+    __in UCHAR     LogPageId
+    )
+/*++
+Routine Description:
+
+    Reads a log page into the log buffer with Retain Asynchronous Event
+    clear, which unmasks events of its type, and caches it if it is one
+    of the cached pages. Only the work item reads log pages, so the log
+    buffer needs no lock. A read that times out may still write the log
+    buffer, so it has the controller reset before the buffer is used
+    again.
+
+--*/
+{
+    PHW_CACHED_LOG_PAGE cached;
+    NVME_COMMAND        command;
+    LARGE_INTEGER       readTime;
+    ULONG               length;
+    KIRQL               oldIrql;
+    NTSTATUS            status;
+
+    PAGED_CODE();
+
+    switch (LogPageId) {
+    case HW_LOG_PAGE_ERROR:
+        length = FdoData->ErrorLogEntries * HW_ERROR_LOG_ENTRY_SIZE;
+        break;
+    case HW_LOG_PAGE_HEALTH:
+        length = HW_HEALTH_LOG_SIZE;
+        break;
+    default:
+        length = PAGE_SIZE;
+        break;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_GET_LOG_PAGE;
+    command.NSID = HW_LOG_PAGE_GLOBAL;
+    command.PRP1 = FdoData->LogBufferPhys.QuadPart;
+    command.u.GENERAL.CDW10 = ((length / sizeof(ULONG) - 1) << 16) | LogPageId;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_HW_ACCESS, "Get Log Page 0x%x failed 0x%x\n",
+                   LogPageId, status);
+        if (status == STATUS_IO_TIMEOUT) {
+            HwResetController(FdoData);
+        }
+        return;
+    }
+
+    if (LogPageId != HW_LOG_PAGE_ERROR && LogPageId != HW_LOG_PAGE_HEALTH) {
+        return;
+    }
+
+    cached = &FdoData->LogCache->Pages[LogPageId - 1];
+    KeQuerySystemTime(&readTime);
+
+    KeAcquireSpinLock(&FdoData->LogCache->Lock, &oldIrql);
+    RtlCopyMemory(cached->Data, FdoData->LogBuffer, length);
+    cached->Length = length;
+    cached->ReadTime = readTime;
+    cached->ReadTick = KeQueryInterruptTime();
+    KeReleaseSpinLock(&FdoData->LogCache->Lock, oldIrql);
+}
+
+
+static
+VOID
+HwAsyncEventWorker(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PVOID          Context
+    )
+/*++
+Routine Description:
+
+    Handles the events completed since it was queued and refreshes the
+    cached pages if asked to, until no work is left.
+
+--*/
+{
+    PFDO_DATA fdoData = (PFDO_DATA)Context;
+    ULONG     events[HW_AER_MAX];
+    ULONG     count, i;
+    BOOLEAN   refresh;
+    KIRQL     oldIrql;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    PAGED_CODE();
+
+    for (;;) {
+
+        KeAcquireSpinLock(&fdoData->AsyncEventLock, &oldIrql);
+
+        count = fdoData->AsyncEventsPending;
+        RtlCopyMemory(events, fdoData->PendingAsyncEvents, count * sizeof(ULONG));
+        fdoData->AsyncEventsPending = 0;
+        refresh = fdoData->LogRefreshRequested;
+        fdoData->LogRefreshRequested = FALSE;
+
+        if (count == 0 && !refresh) {
+            fdoData->AsyncEventWorkQueued = FALSE;
+            KeReleaseSpinLock(&fdoData->AsyncEventLock, oldIrql);
+            break;
+        }
+
+        KeReleaseSpinLock(&fdoData->AsyncEventLock, oldIrql);
+
+        for (i = 0; i < count; i++) {
+
+            DebugPrint(INFO, DBG_HW_ACCESS,
+                       "Asynchronous event: type %d, information 0x%x, log page 0x%x\n",
+                       HW_AER_TYPE(events[i]), HW_AER_INFO(events[i]),
+                       HW_AER_LOG_PAGE(events[i]));
+
+            HwReadLogPage(fdoData, HW_AER_LOG_PAGE(events[i]));
+
+            PciDrvNotifyAsyncEvent(fdoData,
+                                   HW_AER_TYPE(events[i]),
+                                   HW_AER_INFO(events[i]),
+                                   HW_AER_LOG_PAGE(events[i]));
+
+            if (fdoData->ControllerEnabled) {
+                HwSubmitAsyncEventRequest(fdoData);
+            }
+        }
+
+        if (refresh) {
+            HwReadLogPage(fdoData, HW_LOG_PAGE_HEALTH);
+            HwReadLogPage(fdoData, HW_LOG_PAGE_ERROR);
+        }
+    }
+
+    PciDrvIoDecrement(fdoData);
+}
+
+
+VOID
+HwSetupAsyncEvents(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Enables the asynchronous events, sends the event requests and has
+    the cached pages read. Called at every start, since a reset aborts
+    the requests and forgets the configuration. Events that cannot be
+    set up are no error; the cache then stays empty.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    NVME_COMMAND command;
+    ULONG        i;
+    KIRQL        oldIrql;
+    NTSTATUS     status;
+
+    PAGED_CODE();
+
+    if (FdoData->LogCache == NULL) {
+
+        FdoData->LogCache = ExAllocatePoolWithTag(NonPagedPool,
+                                                  sizeof(HW_LOG_CACHE),
+                                                  PCIDRV_POOL_TAG);
+        FdoData->LogBuffer = HwAllocateArenaPages(FdoData, 1, &FdoData->LogBufferPhys);
+        FdoData->AsyncEventWorkItem = IoAllocateWorkItem(FdoData->Self);
+
+        if (FdoData->LogCache == NULL ||
+            FdoData->LogBuffer == NULL ||
+            FdoData->AsyncEventWorkItem == NULL) {
+            DebugPrint(ERROR, DBG_INIT, "No memory for asynchronous events\n");
+            HwFreeAsyncEvents(FdoData);
+            return;
+        }
+
+        RtlZeroMemory(FdoData->LogCache, sizeof(HW_LOG_CACHE));
+        KeInitializeSpinLock(&FdoData->LogCache->Lock);
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_SET_FEATURES;
+    command.u.GENERAL.CDW10 = NVME_FEATURE_ASYNC_EVENT_CONFIG;
+    command.u.GENERAL.CDW11 = HW_AEC_CRITICAL_WARNINGS | FdoData->AsyncEventNotices;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Set Features (Async Event Config) failed 0x%x\n",
+                   status);
+    }
+
+    for (i = 0; i < FdoData->AsyncEventLimit; i++) {
+        HwSubmitAsyncEventRequest(FdoData);
+    }
+
+    KeAcquireSpinLock(&FdoData->AsyncEventLock, &oldIrql);
+    FdoData->LogRefreshRequested = TRUE;
+    HwQueueAsyncEventWorker(FdoData);
+    KeReleaseSpinLock(&FdoData->AsyncEventLock, oldIrql);
+
+    DebugPrint(INFO, DBG_INIT, "%d asynchronous event requests, %d error log entries\n",
+               FdoData->AsyncEventLimit, FdoData->ErrorLogEntries);
+}
+
+
+VOID
+HwFreeAsyncEvents(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Frees the log cache, the log buffer and the work item. The controller
+    must have been stopped and the work item must not be queued.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    ASSERT(!FdoData->AsyncEventWorkQueued);
+
+    if (FdoData->LogBuffer != NULL) {
+        HwFreeArenaPages(FdoData, FdoData->LogBuffer, 1);
+        FdoData->LogBuffer = NULL;
+    }
+
+    if (FdoData->LogCache != NULL) {
+        ExFreePoolWithTag(FdoData->LogCache, PCIDRV_POOL_TAG);
+        FdoData->LogCache = NULL;
+    }
+
+    if (FdoData->AsyncEventWorkItem != NULL) {
+        IoFreeWorkItem(FdoData->AsyncEventWorkItem);
+        FdoData->AsyncEventWorkItem = NULL;
+    }
+
+    FdoData->AsyncEventsPending = 0;
+    FdoData->LogRefreshRequested = FALSE;
+}
+
+
+VOID
+HwAsyncEventCompleted(
+    __in PFDO_DATA              FdoData,
+    __in PNVME_COMPLETION_ENTRY Completion
+    )
+/*++
+Routine Description:
+
+    Hands a completed Asynchronous Event Request to the work item. Called
+    at DISPATCH_LEVEL from the completion of the admin queue.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Completion  Completion entry of the request
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS status = HwCompletionStatus(Completion);
+
+    //
+    // Aborted by a reset, or one request more than the controller takes;
+    // the next start sends them again.
+    //
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(INFO, DBG_DPC, "Asynchronous Event Request ended 0x%x\n", status);
+        return;
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&FdoData->AsyncEventLock);
+
+    if (FdoData->AsyncEventsPending < HW_AER_MAX) {
+        FdoData->PendingAsyncEvents[FdoData->AsyncEventsPending++] = Completion->DW0;
+    }
+    HwQueueAsyncEventWorker(FdoData);
+
+    KeReleaseSpinLockFromDpcLevel(&FdoData->AsyncEventLock);
+}
+
+
+NTSTATUS
+HwGetCachedLogPage(
+    __in  PFDO_DATA         FdoData,
+    __in  ULONG             LogPageId,
+    __out PPCIDRV_LOG_PAGE  Page,
+    __in  ULONG             Length,
+    __out PULONG            BytesReturned
+    )
+/*++
+Routine Description:
+
+    Copies a cached log page out without touching the device. A page
+    older than "LogPageMaxAge" is still returned, and the work item is
+    asked to read it again for the next caller.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    LogPageId       PCIDRV_LOG_PAGE_xxx
+    Page            Receives the page
+    Length          Bytes at Page
+    BytesReturned   Receives the bytes written to Page
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PHW_CACHED_LOG_PAGE cached;
+    ULONGLONG           maxAge;
+    BOOLEAN             stale;
+    KIRQL               oldIrql;
+
+    *BytesReturned = 0;
+
+    if (LogPageId != HW_LOG_PAGE_ERROR && LogPageId != HW_LOG_PAGE_HEALTH) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FdoData->LogCache == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    cached = &FdoData->LogCache->Pages[LogPageId - 1];
+    maxAge = (ULONGLONG)FdoData->Parameters.LogPageMaxAge * 10000000;
+
+    KeAcquireSpinLock(&FdoData->LogCache->Lock, &oldIrql);
+
+    if (cached->ReadTime.QuadPart == 0) {
+        KeReleaseSpinLock(&FdoData->LogCache->Lock, oldIrql);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (Length < FIELD_OFFSET(PCIDRV_LOG_PAGE, Data) + cached->Length) {
+        KeReleaseSpinLock(&FdoData->LogCache->Lock, oldIrql);
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Page->LogPageId = LogPageId;
+    Page->Length = cached->Length;
+    Page->AsyncEvents = FdoData->AsyncEvents;
+    Page->Reserved = 0;
+    Page->ReadTime = cached->ReadTime;
+    RtlCopyMemory(Page->Data, cached->Data, cached->Length);
+
+    *BytesReturned = FIELD_OFFSET(PCIDRV_LOG_PAGE, Data) + cached->Length;
+    stale = (BOOLEAN)(maxAge != 0 && KeQueryInterruptTime() - cached->ReadTick > maxAge);
+
+    KeReleaseSpinLock(&FdoData->LogCache->Lock, oldIrql);
+
+    if (stale) {
+        KeAcquireSpinLock(&FdoData->AsyncEventLock, &oldIrql);
+        FdoData->LogRefreshRequested = TRUE;
+        HwQueueAsyncEventWorker(FdoData);
+        KeReleaseSpinLock(&FdoData->AsyncEventLock, oldIrql);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+HwSetLogChunk(
+    __inout PNVME_COMMAND  Command,
+    __in    PHW_ADMIN_SLOT Slot,
+    __in    ULONG          Cdw10
+    )
+/*++
+Routine Description:
+
+    Sets the Get Log Page of the chunk of a slot to the length and the
+    log page offset of the chunk. Cdw10 holds the log page id and flags.
+
+--*/
+{
+    ULONG dwords = Slot->Length / sizeof(ULONG) - 1;
+
+    Command->u.GENERAL.CDW10 = (dwords << 16) | Cdw10;
+    Command->u.GENERAL.CDW11 = dwords >> 16;
+    Command->u.GENERAL.CDW12 = (ULONG)Slot->Offset;
+    Command->u.GENERAL.CDW13 = (ULONG)(Slot->Offset >> 32);
+}
+
+
+NTSTATUS
+HwReadLogPageDirect(
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp,
+    __out PULONG    BytesReturned
+    )
+/*++
+Routine Description:
+
+    Carries out IOCTL_READ_LOG_PAGE. The output buffer is cut into chunks
+    of as much as one command moves; every slot reads a chunk at its
+    offset into the log page with a partial MDL of the buffer, and the
+    slots take turns, so that up to HW_LOG_SLOTS commands are out at a
+    time and the data is never copied.
+
+    Runs in the thread of the caller, at PASSIVE_LEVEL, and returns once
+    no command of the request is left outstanding. A command that times
+    out has the controller reset, since it may still write to the buffer
+    after the request is completed and the buffer unlocked.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    Irp             The IOCTL request
+    BytesReturned   Receives the bytes read
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PIO_STACK_LOCATION    irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PPCIDRV_LOG_PAGE_READ read = (PPCIDRV_LOG_PAGE_READ)Irp->AssociatedIrp.SystemBuffer;
+    ULONG                 length = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PMDL                  mdl = Irp->MdlAddress;
+    HW_ADMIN_SLOT         slots[HW_LOG_SLOTS];
+    PHW_ADMIN_SLOT        slot;
+    NVME_COMMAND          command;
+    PUCHAR                va;
+    ULONGLONG             startTime;
+    ULONG                 chunk, done, cdw10, slotCount, busy, next, i;
+    BOOLEAN               timedOut = FALSE;
+    NTSTATUS              status = STATUS_SUCCESS, slotStatus;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    *BytesReturned = 0;
+
+    if (read == NULL ||
+        irpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(PCIDRV_LOG_PAGE_READ) ||
+        read->LogPageId > 0xFF || read->LogSpecific > 0x7F ||
+        mdl == NULL || length == 0 || length != MmGetMdlByteCount(mdl) ||
+        ((length | (ULONG)read->Offset) & 3) != 0 || (MmGetMdlByteOffset(mdl) & 3) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!FdoData->ExtendedLogPages &&
+        (read->Offset != 0 || length > HW_LOG_LEGACY_MAX_LENGTH)) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    //
+    // Chunks are whole pages, so that every chunk starts at the page
+    // offset of the buffer and spans no more pages than a PRP list slot
+    // holds.
+    //
+    chunk = min(HW_ADMIN_CHUNK_PAGES << PAGE_SHIFT, FdoData->MaxTransferSize) & ~(PAGE_SIZE - 1);
+    if (chunk == 0) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    va = (PUCHAR)MmGetMdlVirtualAddress(mdl);
+
+    for (slotCount = 0; slotCount < HW_LOG_SLOTS; slotCount++) {
+        slot = &slots[slotCount];
+        RtlZeroMemory(slot, sizeof(HW_ADMIN_SLOT));
+        slot->Mdl = IoAllocateMdl(va, chunk, FALSE, FALSE, NULL);
+        if (slot->Mdl == NULL) {
+            break;
+        }
+        KeInitializeEvent(&slot->Event, NotificationEvent, FALSE);
+    }
+
+    if (slotCount == 0) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeFlushIoBuffers(mdl, TRUE, TRUE);
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_GET_LOG_PAGE;
+    command.NSID = HW_LOG_PAGE_GLOBAL;
+
+    cdw10 = read->LogPageId;
+    if (read->Flags & PCIDRV_LOG_PAGE_RETAIN_EVENT) {
+        cdw10 |= HW_LOG_RAE;
+    }
+
+    startTime = KeQueryInterruptTime();
+    done = 0;
+    busy = 0;
+
+    //
+    // The log specific field may have the controller capture a new log,
+    // so its chunk is read on its own, before the chunks that read what
+    // it captured.
+    //
+    if (read->LogSpecific != 0) {
+        slot = &slots[0];
+        slot->Offset = read->Offset;
+        slot->Length = min(length, chunk);
+        IoBuildPartialMdl(mdl, slot->Mdl, va, slot->Length);
+
+        HwSetLogChunk(&command, slot, cdw10 | (read->LogSpecific << HW_LOG_LSP_SHIFT));
+        status = HwSubmitSlotCommand(FdoData, slot, &command);
+        if (NT_SUCCESS(status)) {
+            status = HwWaitSlotCommand(FdoData, slot);
+            timedOut = (BOOLEAN)(status == STATUS_IO_TIMEOUT);
+        }
+        done = slot->Length;
+    }
+
+    for (next = 0; ; next = (next + 1) % slotCount) {
+
+        slot = &slots[next];
+
+        if (slot->Busy) {
+
+            slotStatus = HwWaitSlotCommand(FdoData, slot);
+            busy--;
+
+            if (NT_SUCCESS(status)) {
+                status = !NT_SUCCESS(slotStatus) ? slotStatus :
+                         Irp->Cancel ? STATUS_CANCELLED : STATUS_SUCCESS;
+            }
+
+            //
+            // The others are given up on as well; the reset ends them.
+            //
+            if (slotStatus == STATUS_IO_TIMEOUT) {
+                timedOut = TRUE;
+                for (i = 0; i < slotCount; i++) {
+                    if (slots[i].Busy) {
+                        HwDetachSlotCommand(FdoData, &slots[i]);
+                    }
+                }
+                busy = 0;
+            }
+        }
+
+        if (!NT_SUCCESS(status) || done == length) {
+            if (busy == 0) {
+                break;
+            }
+            continue;
+        }
+
+        slot->Offset = read->Offset + done;
+        slot->Length = min(length - done, chunk);
+        MmPrepareMdlForReuse(slot->Mdl);
+        IoBuildPartialMdl(mdl, slot->Mdl, va + done, slot->Length);
+
+        HwSetLogChunk(&command, slot, cdw10);
+        status = HwSubmitSlotCommand(FdoData, slot, &command);
+        if (NT_SUCCESS(status)) {
+            busy++;
+            done += slot->Length;
+        }
+    }
+
+    if (timedOut) {
+        HwResetController(FdoData);
+    }
+
+    for (next = 0; next < slotCount; next++) {
+        IoFreeMdl(slots[next].Mdl);
+    }
+
+    DebugPrint(INFO, DBG_IOCTLS,
+               "Log page 0x%x: %d bytes from %I64u in %I64u ms, %d chunks of %d bytes out at a time: 0x%x\n",
+               read->LogPageId, length, read->Offset, (KeQueryInterruptTime() - startTime) / 10000,
+               slotCount, chunk, status);
+
+    if (NT_SUCCESS(status)) {
+        *BytesReturned = length;
+    }
+
+    return status;
+}
@@ -0,0 +1,245 @@
+/*++
+
+Module Name:
+
+    hw_cmb.c
+
+Abstract:
+
+    Contains the use of the controller memory buffer (CMB): memory on the
+    device, behind one of its BARs, that the host can write to. With the
+    I/O submission queues there, the controller reads every command from
+    its own memory instead of fetching it from host memory over the bus
+    after the doorbell write, which takes a round trip off each command.
+
+    The CMB is mapped write-combined and handed out to the submission
+    queues when they are first allocated; queues that do not fit stay in
+    host memory. Completion queues always stay in host memory, which the
+    processor reads far faster than device memory.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "hw_cmb.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwMapControllerMemoryBuffer)
+#pragma alloc_text (PAGE, HwUnmapControllerMemoryBuffer)
+#pragma alloc_text (PAGE, HwAllocateCmbQueue)
+#endif
+
+
+VOID
+HwRestoreControllerMemoryBuffer(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Enables the CMB at the address its submission queues were given, if
+    the controller has to be told (CAP.CMBS). Called when the controller
+    is enabled, since a reset may have cleared CMBMSC. The high half goes
+    first so that the CMB is never enabled at a stale address.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PULONG cmbmsc = (PULONG)((PUCHAR)FdoData->controller_regs + HW_CMBMSC_OFFSET);
+
+    if (FdoData->CmbControl == 0) {
+        return;
+    }
+
+    HwWriteRegisterULong(cmbmsc + 1, (ULONG)(FdoData->CmbControl >> 32));
+    HwWriteRegisterULong(cmbmsc, (ULONG)FdoData->CmbControl);
+}
+
+
+VOID
+HwMapControllerMemoryBuffer(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Queues,
+    __in ULONG     Depth
+    )
+/*++
+Routine Description:
+
+    Maps as much of the CMB as the I/O submission queues about to be
+    allocated need, if the controller has a CMB that may hold submission
+    queues (CMBSZ.SQS). Called once, before the I/O queues are first
+    allocated. A CMB that cannot be used is no error; the queues then go
+    to host memory.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Queues      Number of I/O queues
+    Depth       Entries per I/O queue
+
+Return Value:
+
+    None
+
+--*/
+{
+    PNVME_CONTROLLER_REGISTERS             regs = FdoData->controller_regs;
+    NVME_CONTROLLER_MEMORY_BUFFER_LOCATION cmbloc;
+    NVME_CONTROLLER_MEMORY_BUFFER_SIZE     cmbsz;
+    PHW_PCI_BAR                            bar;
+    PHYSICAL_ADDRESS                       translated;
+    ULONGLONG                              unit, offset, size, needed;
+    ULONG                                  queueLength;
+    BOOLEAN                                control;
+
+    PAGED_CODE();
+
+    ASSERT(FdoData->Cmb == NULL);
+
+    //
+    // Controllers with CMBMSC report nothing in CMBLOC and CMBSZ until
+    // told to.
+    //
+    control = (BOOLEAN)((FdoData->ControllerCaps.AsUlonglong & HW_CAP_CMBS) != 0);
+    if (control) {
+        HwWriteRegisterULong((PULONG)((PUCHAR)regs + HW_CMBMSC_OFFSET), HW_CMBMSC_CRE);
+    }
+
+    cmbsz.AsUlong = HwReadRegisterULong(&regs->CMBSZ.AsUlong);
+    if (cmbsz.SZ == 0 || !cmbsz.SQS || cmbsz.SZU > HW_CMB_MAX_SZU) {
+        return;
+    }
+
+    cmbloc.AsUlong = HwReadRegisterULong(&regs->CMBLOC.AsUlong);
+
+    unit = 4096ULL << (4 * cmbsz.SZU);
+    offset = cmbloc.OFST * unit;
+    size = cmbsz.SZ * unit;
+
+    //
+    // BAR0 is mapped uncached for the registers and doorbells as a whole;
+    // a CMB in it cannot be mapped write-combined as well.
+    //
+    bar = cmbloc.BIR < PCI_TYPE0_ADDRESSES ? &FdoData->Bars[cmbloc.BIR] : NULL;
+    if (bar == NULL || cmbloc.BIR == 0 || bar->Length == 0 || offset >= bar->Length) {
+        DebugPrint(ERROR, DBG_INIT, "CMB of %I64u bytes in BAR %d not usable\n",
+                   size, cmbloc.BIR);
+        return;
+    }
+    size = min(size, bar->Length - offset);
+
+    queueLength = (ULONG)ROUND_TO_PAGES(Depth * sizeof(NVME_COMMAND));
+    needed = (ULONGLONG)Queues * queueLength;
+    size = min(size, needed) & ~((ULONGLONG)PAGE_SIZE - 1);
+    if (size < queueLength) {
+        DebugPrint(INFO, DBG_INIT, "CMB too small for a submission queue\n");
+        return;
+    }
+
+    translated.QuadPart = bar->Translated.QuadPart + offset;
+    FdoData->Cmb = MmMapIoSpace(translated, (SIZE_T)size, MmWriteCombined);
+    if (FdoData->Cmb == NULL) {
+        DebugPrint(ERROR, DBG_INIT, "MmMapIoSpace of the CMB failed\n");
+        return;
+    }
+
+    FdoData->CmbAddress.QuadPart = bar->Raw.QuadPart + offset;
+    FdoData->CmbLength = (ULONG)size;
+    FdoData->CmbUsed = 0;
+
+    if (control) {
+        FdoData->CmbControl = (ULONGLONG)FdoData->CmbAddress.QuadPart |
+                              HW_CMBMSC_CMSE | HW_CMBMSC_CRE;
+        HwRestoreControllerMemoryBuffer(FdoData);
+    }
+
+    DebugPrint(INFO, DBG_INIT, "CMB: BAR %d + 0x%I64x, %d of %I64u bytes mapped\n",
+               cmbloc.BIR, offset, FdoData->CmbLength, cmbsz.SZ * unit);
+}
+
+
+VOID
+HwUnmapControllerMemoryBuffer(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Unmaps the CMB. The queues placed in it must have been freed.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    if (FdoData->Cmb != NULL) {
+        MmUnmapIoSpace(FdoData->Cmb, FdoData->CmbLength);
+        FdoData->Cmb = NULL;
+    }
+
+    FdoData->CmbLength = 0;
+    FdoData->CmbUsed = 0;
+    FdoData->CmbControl = 0;
+}
+
+
+PVOID
+HwAllocateCmbQueue(
+    __in  PFDO_DATA         FdoData,
+    __in  ULONG             Length,
+    __out PPHYSICAL_ADDRESS Address
+    )
+/*++
+Routine Description:
+
+    Takes a page aligned ring out of the mapped CMB. Rings are never
+    given back one by one; the CMB is unmapped as a whole.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Length      Bytes of the ring
+    Address     Receives the address of the ring as the controller sees it
+
+Return Value:
+
+    The ring, or NULL if the CMB is not mapped or has no room left
+
+--*/
+{
+    PVOID buffer;
+
+    PAGED_CODE();
+
+    Length = (ULONG)ROUND_TO_PAGES(Length);
+
+    if (FdoData->Cmb == NULL || FdoData->CmbLength - FdoData->CmbUsed < Length) {
+        return NULL;
+    }
+
+    buffer = FdoData->Cmb + FdoData->CmbUsed;
+    Address->QuadPart = FdoData->CmbAddress.QuadPart + FdoData->CmbUsed;
+    FdoData->CmbUsed += Length;
+
+    return buffer;
+}
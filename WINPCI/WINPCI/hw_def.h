@@ -1,11 +1,23 @@
 #ifndef _HW_DEF_H
 #define _HW_DEF_H
 
+#include <nvme.h>
+
 //-------------------------------------------------------------------------
 // Bit Mask definitions
 //-------------------------------------------------------------------------
 #define BIT_0       0x0001
 #define BIT_1       0x0002
+#define BIT_2       0x0004
+#define BIT_5       0x0020
+#define BIT_8       0x0100
+#define BIT_9       0x0200
+#define BIT_16      0x00010000
+#define BIT_19      0x00080000
+#define BIT_26      0x04000000
+#define BIT_27      0x08000000
+#define BIT_28      0x10000000
+#define BIT_29      0x20000000
 #define BIT_30      0x40000000
 #define BIT_31      0x80000000
 
@@ -74,6 +86,550 @@ typedef struct _CTRL_REGS_IN_MEM {
 
 typedef struct _FDO_DATA FDO_DATA, *PFDO_DATA;
 
+//-------------------------------------------------------------------------
+// NVMe queue definitions
+//-------------------------------------------------------------------------
+#define HW_ADMIN_QUEUE_ID              0
+#define HW_ADMIN_QUEUE_DEPTH           32
+#define HW_IO_QUEUE_DEPTH_DEFAULT      256
+#define HW_IO_QUEUE_DEPTH_MIN          16
+#define HW_IO_QUEUE_DEPTH_MAX          4096
+#define HW_MAX_IO_QUEUES               64
+
+#define HW_DOORBELL_OFFSET             0x1000
+#define HW_PRP_LIST_SIZE               512     // PRP list slot per command id
+#define HW_METADATA_SLOT_SIZE          PAGE_SIZE // separate metadata per command id
+#define HW_INTERRUPT_VECTOR_MASK       BIT_0   // all queues share vector 0
+
+#define HW_CONTROLLER_TIMEOUT_UNIT     500     // CAP.TO granularity in ms
+#define HW_CONTROLLER_POLL_INTERVAL    10      // ms
+#define HW_ADMIN_COMMAND_TIMEOUT       5000    // ms
+
+//
+// Command timeouts. Every I/O command sits on a two level timer wheel of
+// its queue; level 0 has one slot per tick, level 1 one slot per
+// HW_WHEEL_SLOTS ticks and is cascaded into level 0 as time advances.
+//
+#define HW_TIMER_TICK                  100     // ms
+#define HW_WHEEL_SHIFT                 6
+#define HW_WHEEL_SLOTS                 (1 << HW_WHEEL_SHIFT)
+#define HW_WHEEL_MASK                  (HW_WHEEL_SLOTS - 1)
+#define HW_IO_TIMEOUT_DEFAULT          30      // s, registry "IoTimeout"
+#define HW_IO_TIMEOUT_MAX              300     // s, fits in the wheel
+#define HW_IO_TIMEOUT_TICKS(_s)        ((_s) * 1000 / HW_TIMER_TICK)
+#define HW_ABORT_GRACE                 2000    // ms an Abort gets before a reset
+
+//
+// Recent command latency of a queue: an exponentially weighted moving
+// average over the completions, each weighing 1/HW_LATENCY_EWMA_WEIGHT.
+//
+#define HW_LATENCY_EWMA_WEIGHT         8
+#define HW_LATENCY_MAX                 (10 * 1000 * 10000) // 100ns, samples are capped
+
+//
+// I/O priority classes, numbered like the QPRIO field of Create I/O
+// Submission Queue (PCIDRV_PRIORITY_xxx in public.h). With weighted round
+// robin arbitration every class gets its own submission queues; urgent
+// queues are served first and the others by the weights below. Without
+// it the queues are shared and the lower classes may only take a command
+// id while more than their reserve (in 1/16ths of the ids) is left.
+//
+#define HW_PRIORITY_CLASSES            4
+#define HW_WRR_ARBITRATION_BURST       3       // 2^3 commands per turn
+#define HW_WRR_HIGH_WEIGHT             16
+#define HW_WRR_MEDIUM_WEIGHT           4
+#define HW_WRR_LOW_WEIGHT              1
+#define HW_RESERVE_HIGH                1
+#define HW_RESERVE_MEDIUM              2
+#define HW_RESERVE_LOW                 4
+
+//
+// Protection information type (Identify Namespace DPS)
+//
+#define HW_PI_NONE                     0
+#define HW_PI_TYPE1                    1
+#define HW_PI_TYPE2                    2
+#define HW_PI_TYPE3                    3
+
+//
+// PRINFO of Read and Write, CDW12 bits 29:26
+//
+#define HW_PRINFO_PRACT                BIT_29  // controller inserts/strips PI
+#define HW_PRINFO_CHECK_GUARD          BIT_28
+#define HW_PRINFO_CHECK_APP_TAG        BIT_27
+#define HW_PRINFO_CHECK_REF_TAG        BIT_26
+
+//
+// Dataset Management (deallocate) and Write Zeroes. A Dataset Management
+// command takes a page of up to HW_DSM_MAX_RANGES ranges from the DMA
+// arena; ranges longer than HW_DSM_PIECE_BLOCKS are cut into pieces of
+// that many blocks. A Write Zeroes command covers at most
+// HW_WRITE_ZEROES_PIECE_BLOCKS blocks.
+//
+#define HW_DSM_ATTRIBUTE_DEALLOCATE    BIT_2   // CDW11 AD
+#define HW_DSM_MAX_RANGES              256
+#define HW_DSM_PIECE_BLOCKS            0x80000000
+#define HW_WRITE_ZEROES_PIECE_BLOCKS   0x10000
+
+//
+// What the last command of a range request covered, from the end of its
+// range list: whole ranges and pieces cut off the range before them.
+// Kept in IoStatus.Information until the completion path trims the list.
+//
+#define HW_RANGE_PROGRESS(_whole, _pieces)  (((ULONG_PTR)(_whole) << 16) | (_pieces))
+#define HW_RANGE_PROGRESS_WHOLE(_progress)  ((ULONG)((_progress) >> 16))
+#define HW_RANGE_PROGRESS_PIECES(_progress) ((ULONG)((_progress) & 0xFFFF))
+
+//
+// Copy (Simple Copy). The source ranges of a command go to a page from
+// the DMA arena in descriptor format 0, at most HW_COPY_MAX_RANGES of
+// them; the controller limits them further (Identify Namespace MSRC,
+// MSSRL and MCL). A copy command covers the given number of blocks from
+// the end of the range list, which is what request->Information holds.
+//
+#define HW_NVM_COMMAND_COPY            0x19
+#define HW_ONCS_COPY                   BIT_8
+#define HW_COPY_MAX_RANGES             (PAGE_SIZE / sizeof(HW_COPY_SOURCE_RANGE))
+#define HW_COPY_MAX_RANGE_BLOCKS       0x10000 // NLB is 16 bits, 0's based
+
+typedef struct _HW_COPY_SOURCE_RANGE {
+    ULONGLONG               Reserved0;
+    ULONGLONG               StartingLBA;
+    USHORT                  LogicalBlocks;      // 0's based
+    USHORT                  Reserved1[3];
+    ULONG                   InitialReferenceTag;
+    USHORT                  ApplicationTag;
+    USHORT                  ApplicationTagMask;
+} HW_COPY_SOURCE_RANGE, *PHW_COPY_SOURCE_RANGE;
+
+C_ASSERT(sizeof(HW_COPY_SOURCE_RANGE) == 32);
+
+//
+// Zoned namespaces (ZNS). The controller runs all of its I/O command sets
+// when CAP.CSS says it can; the namespace is zoned if its identification
+// descriptors name the Zoned command set. A Zone Append completes with
+// the LBA the data went to in DW0 and DW1 of the completion entry.
+//
+#define HW_CC_CSS_NVM                  0
+#define HW_CC_CSS_ALL_IO               6
+
+#define HW_IDENTIFY_CNS_NS_DESCRIPTORS 0x03
+#define HW_IDENTIFY_CNS_CSI_NAMESPACE  0x05
+#define HW_IDENTIFY_CNS_CSI_CONTROLLER 0x06
+#define HW_IDENTIFY_CSI_SHIFT          24      // CDW11
+#define HW_NID_TYPE_CSI                4
+#define HW_CSI_ZONED                   2
+
+#define HW_NVM_COMMAND_ZONE_MGMT_SEND    0x79
+#define HW_NVM_COMMAND_ZONE_MGMT_RECEIVE 0x7A
+#define HW_NVM_COMMAND_ZONE_APPEND       0x7D
+
+#define HW_ZONE_SELECT_ALL             BIT_8   // Send CDW13
+#define HW_ZONE_REPORT_ZONES           0       // Receive CDW13 ZRA
+#define HW_ZONE_REPORT_STATE_SHIFT     8       // Receive CDW13 ZRASF
+#define HW_ZONE_REPORT_PARTIAL         BIT_16  // Receive CDW13
+#define HW_ZONE_LIMIT_NONE             MAXULONG // MAR and MOR
+
+#define HW_COMPLETION_LBA(_entry)      (((ULONGLONG)(_entry)->DW1 << 32) | (_entry)->DW0)
+
+typedef struct _HW_ZNS_LBA_FORMAT_EXTENSION {
+    ULONGLONG               ZSZE;               // blocks per zone
+    UCHAR                   ZDES;
+    UCHAR                   Reserved[7];
+} HW_ZNS_LBA_FORMAT_EXTENSION, *PHW_ZNS_LBA_FORMAT_EXTENSION;
+
+typedef struct _HW_ZNS_NAMESPACE_DATA {
+    USHORT                  ZOC;
+    USHORT                  OZCS;
+    ULONG                   MAR;                // 0's based, HW_ZONE_LIMIT_NONE
+    ULONG                   MOR;                // 0's based, HW_ZONE_LIMIT_NONE
+    ULONG                   RRL;
+    ULONG                   FRL;
+    UCHAR                   Reserved0[2796];
+    HW_ZNS_LBA_FORMAT_EXTENSION LBAFE[16];
+    UCHAR                   VS[1024];
+} HW_ZNS_NAMESPACE_DATA, *PHW_ZNS_NAMESPACE_DATA;
+
+C_ASSERT(FIELD_OFFSET(HW_ZNS_NAMESPACE_DATA, LBAFE) == 2816);
+C_ASSERT(sizeof(HW_ZNS_NAMESPACE_DATA) == 4096);
+
+//
+// Write streams. A write is tagged with a directive type in CDW12 and a
+// directive specific value in CDW13: a stream id for the Streams
+// directive, a placement id for Flexible Data Placement (FDP). Streams
+// are enabled and allocated to the namespace by the driver; FDP is
+// configured on the endurance group by an administrator and only used.
+//
+#define HW_OACS_DIRECTIVES             BIT_5
+#define HW_CTRATT_FDP                  BIT_19
+
+#define HW_DIRECTIVE_TYPE_IDENTIFY     0
+#define HW_DIRECTIVE_TYPE_STREAMS      1
+#define HW_DIRECTIVE_TYPE_PLACEMENT    2
+#define HW_DIRECTIVE_TYPE_SHIFT        8       // Send/Receive CDW11, CDW12
+#define HW_DIRECTIVE_RETURN_PARAMETERS 1       // Receive DOPER, both types
+#define HW_DIRECTIVE_ENABLE            1       // Send DOPER of Identify
+#define HW_DIRECTIVE_ALLOCATE          3       // Receive DOPER of Streams
+#define HW_DIRECTIVE_ENABLE_DIRECTIVE  BIT_0   // Send CDW12 ENDIR
+
+#define HW_WRITE_DTYPE_SHIFT           20      // write CDW12
+#define HW_WRITE_DSPEC_SHIFT           16      // write CDW13
+
+#define HW_FEATURE_FDP                 0x1D
+#define HW_FDP_ENABLED                 BIT_0   // Get Features DW0
+#define HW_NVM_COMMAND_IO_MGMT_RECEIVE 0x12
+#define HW_IO_MGMT_RUH_STATUS          1       // CDW10 MO
+
+typedef struct _HW_STREAM_PARAMETERS {
+    USHORT                  MSL;                // max streams of the subsystem
+    USHORT                  NSSA;               // subsystem streams available
+    USHORT                  NSSO;               // subsystem streams open
+    UCHAR                   NSSC;
+    UCHAR                   Reserved0[9];
+    ULONG                   SWS;                // blocks
+    USHORT                  SGS;                // in SWS
+    USHORT                  NSA;                // allocated to the namespace
+    USHORT                  NSO;                // open in the namespace
+    UCHAR                   Reserved1[6];
+} HW_STREAM_PARAMETERS, *PHW_STREAM_PARAMETERS;
+
+C_ASSERT(sizeof(HW_STREAM_PARAMETERS) == 32);
+
+typedef struct _HW_RUH_STATUS_DESCRIPTOR {
+    USHORT                  PID;                // placement id to tag writes with
+    USHORT                  RUHID;
+    ULONG                   EARUTR;
+    ULONGLONG               RUAMW;
+    UCHAR                   Reserved[16];
+} HW_RUH_STATUS_DESCRIPTOR, *PHW_RUH_STATUS_DESCRIPTOR;
+
+typedef struct _HW_RUH_STATUS {
+    UCHAR                   Reserved[14];
+    USHORT                  NRUHSD;
+    HW_RUH_STATUS_DESCRIPTOR Descriptors[1];
+} HW_RUH_STATUS, *PHW_RUH_STATUS;
+
+C_ASSERT(sizeof(HW_RUH_STATUS_DESCRIPTOR) == 32);
+C_ASSERT(FIELD_OFFSET(HW_RUH_STATUS, Descriptors) == 16);
+
+//
+// Pages the controller reads command payloads other than user data from,
+// such as Dataset Management and Copy range lists, and the buffers of the
+// host copy. One contiguous allocation on the node of the device, handed
+// out in runs of contiguous pages from a bitmap of free pages. A run
+// given to a command id stays with it until the id is freed, so it is
+// not reused while the controller may still access it.
+//
+#define HW_DMA_ARENA_PAGES             64      // one bit each in FreeMap
+
+typedef struct _HW_DMA_ARENA {
+    KSPIN_LOCK              Lock;
+    PUCHAR                  Base;               // NULL until the I/O queues exist
+    PHYSICAL_ADDRESS        BasePhys;
+    ULONGLONG               FreeMap;            // bit set for a free page
+} HW_DMA_ARENA, *PHW_DMA_ARENA;
+
+//
+// Controller memory buffer (CMB). If CMBSZ.SQS is set, the I/O submission
+// queues are put in it, so that the controller does not have to fetch
+// every command over the bus. CMBLOC names the BAR and the offset in it;
+// since NVMe 1.4 the CMB has to be enabled with CMBMSC first (CAP.CMBS),
+// with the address the controller is to decode it at.
+//
+#define HW_CAP_CMBS                    (1ULL << 57)
+#define HW_CMBMSC_OFFSET               0x50
+#define HW_CMBMSC_CRE                  BIT_0   // CMBLOC and CMBSZ are valid
+#define HW_CMBMSC_CMSE                 BIT_1   // controller memory space enabled
+#define HW_CMB_MAX_SZU                 6       // 64GB units
+
+//
+// A memory BAR of the device, by BAR index; a 64-bit BAR takes the index
+// of its low half. Raw is the address on the bus.
+//
+typedef struct _HW_PCI_BAR {
+    PHYSICAL_ADDRESS        Raw;
+    PHYSICAL_ADDRESS        Translated;
+    ULONG                   Length;             // 0 if not a memory BAR
+} HW_PCI_BAR, *PHW_PCI_BAR;
+
+//
+// Host memory buffer (HMB). A controller without DRAM of its own asks in
+// Identify Controller for host memory to keep its mapping tables in:
+// HMPRE preferred, HMMIN at least, in chunks of HMMINDS or more and at
+// most HMMAXD of them. The chunks are given with Set Features as a list
+// of descriptors; the controller owns them until the buffer is disabled
+// or the controller is reset.
+//
+#define HW_HMB_UNIT                    4096    // of HMPRE, HMMIN and HMMINDS
+#define HW_HMB_MAX_CHUNK               (4 * 1024 * 1024)
+#define HW_HMB_MAX_DESCRIPTORS         ((ULONG)(PAGE_SIZE / sizeof(HW_HMB_DESCRIPTOR)))
+#define HW_HMB_ENABLE                  BIT_0   // Set Features CDW11 EHM
+#define HW_HMB_MEMORY_RETURN           BIT_1   // CDW11 MR, same chunks as before
+
+typedef struct _HW_HMB_DESCRIPTOR {
+    ULONGLONG               BADD;               // page aligned
+    ULONG                   BSIZE;              // memory pages
+    ULONG                   Reserved;
+} HW_HMB_DESCRIPTOR, *PHW_HMB_DESCRIPTOR;
+
+C_ASSERT(sizeof(HW_HMB_DESCRIPTOR) == 16);
+
+//
+// Shadow doorbells (Doorbell Buffer Config), offered mostly by emulated
+// controllers, for which every doorbell write traps. The tail and head
+// of each I/O queue are kept in a host page laid out like the doorbell
+// registers, and the register itself is written only when the new value
+// passes the event index the controller left in a second page.
+//
+#define HW_OACS_DOORBELL_BUFFER        BIT_8
+#define HW_ADMIN_COMMAND_DOORBELL_BUFFER_CONFIG 0x7C
+
+//
+// Asynchronous events. Up to AERL + 1 Asynchronous Event Requests are
+// kept outstanding on the admin queue. The controller completes one when
+// an event occurs, naming a log page in DW0, and masks further events of
+// the type until that page is read. The error information and SMART /
+// health pages read this way are cached for user mode.
+//
+#define HW_AER_MAX                     4
+#define HW_AER_TYPE(_dw0)              ((UCHAR)((_dw0) & 0x7))
+#define HW_AER_INFO(_dw0)              ((UCHAR)((_dw0) >> 8))
+#define HW_AER_LOG_PAGE(_dw0)          ((UCHAR)((_dw0) >> 16))
+#define HW_AEC_CRITICAL_WARNINGS       0xFF    // Set Features CDW11, SMART / health
+#define HW_OAES_NOTICES                (BIT_8 | BIT_9) // namespace attributes, firmware activation
+
+#define HW_LOG_PAGE_ERROR              0x01
+#define HW_LOG_PAGE_HEALTH             0x02
+#define HW_LOG_PAGE_GLOBAL             0xFFFFFFFF  // NSID of controller wide pages
+#define HW_HEALTH_LOG_SIZE             512
+#define HW_ERROR_LOG_ENTRY_SIZE        64
+#define HW_ERROR_LOG_MAX_ENTRIES       (PAGE_SIZE / HW_ERROR_LOG_ENTRY_SIZE)
+#define HW_CACHED_LOG_PAGES            2       // by log page id - 1
+
+typedef struct _HW_CACHED_LOG_PAGE {
+    LARGE_INTEGER           ReadTime;           // system time, 0 until read
+    ULONGLONG               ReadTick;           // interrupt time, for the age
+    ULONG                   Length;
+    UCHAR                   Data[PAGE_SIZE];
+} HW_CACHED_LOG_PAGE, *PHW_CACHED_LOG_PAGE;
+
+typedef struct _HW_LOG_CACHE {
+    KSPIN_LOCK              Lock;
+    HW_CACHED_LOG_PAGE      Pages[HW_CACHED_LOG_PAGES];
+} HW_LOG_CACHE, *PHW_LOG_CACHE;
+
+//
+// Steps of HwStartControllerAsync.
+//
+typedef enum _HW_START_STATE {
+    HwStartIdle = 0,
+    HwStartWaitDisabled,                // CC.EN cleared, waiting for CSTS.RDY = 0
+    HwStartWaitReady,                   // CC.EN set, waiting for CSTS.RDY = 1
+    HwStartConfigure                    // work item creates the I/O queues
+} HW_START_STATE;
+
+#define HW_PROCESSOR_NONE              ((ULONG)-1)
+#define HW_NODE_UNKNOWN                ((USHORT)-1)
+
+//
+// Where the memory of an I/O queue is placed (registry "QueueNodePlacement").
+// The admin queue and queues whose owner cannot be resolved always go to
+// the node of the device.
+//
+#define HW_NODE_PLACEMENT_PROCESSOR    0       // node of the CPU owning the queue
+#define HW_NODE_PLACEMENT_DEVICE       1       // node the device is attached to
+
+//
+// Per command id context, indexed by CID so that completion and cancel
+// find it in O(1). The array lives with its queue on the queue's NUMA
+// node. Irp, Event, Result and InUse are protected by the queue's
+// submission lock.
+//
+typedef struct _HW_REQUEST {
+    PIRP                    Irp;                // in-flight IRP, NULL otherwise
+    PKEVENT                 Event;              // waiter of a synchronous command
+    PNVME_COMPLETION_ENTRY  Result;             // receives the entry for the waiter
+    ULONG_PTR               Information;        // IoStatus.Information on success
+    ULONGLONG               StartTime;          // interrupt time of submission
+    USHORT                  CommandId;
+    USHORT                  Generation;         // bumped each time the id is handed out
+    BOOLEAN                 InUse;
+    BOOLEAN                 AbortIssued;        // an Abort was sent for this command
+    BOOLEAN                 AbortCommand;       // this command is itself an Abort
+    BOOLEAN                 TimedOut;           // the deadline passed once already
+    ULONG                   Deadline;           // wheel tick the command expires at
+    LIST_ENTRY              TimerLink;          // wheel slot of an I/O command
+    PULONGLONG              PrpList;            // PRP list slot of this command id
+    PHYSICAL_ADDRESS        PrpListPhys;
+    PUCHAR                  Metadata;           // metadata slot, if the namespace has metadata
+    PHYSICAL_ADDRESS        MetadataPhys;
+    PUCHAR                  Data;               // system address of the data, for PI
+    BOOLEAN                 VerifyProtection;   // check the PI of a read on completion
+    BOOLEAN                 ZoneAppend;         // Information is where the data went
+    BOOLEAN                 AsyncEvent;         // an Asynchronous Event Request
+    ULONGLONG               ZoneStart;          // LBA of the zone of a Zone Append
+    PUCHAR                  ArenaBuffer;        // DMA arena run, freed with the id
+    ULONG                   ArenaPages;
+} HW_REQUEST, *PHW_REQUEST;
+
+//
+// Where an in-flight IRP records its command, for the cancel routine. The
+// command id and its generation share one slot; DriverContext[2] and [3]
+// belong to the driver layer.
+//
+#define HW_IRP_QUEUE(_irp)          ((_irp)->Tail.Overlay.DriverContext[0])
+#define HW_IRP_COMMAND(_irp)        ((_irp)->Tail.Overlay.DriverContext[1])
+#define HW_MAKE_IRP_COMMAND(_cid, _generation) \
+    ((PVOID)(ULONG_PTR)(((ULONG)(_generation) << 16) | (_cid)))
+#define HW_IRP_COMMAND_ID(_irp)     ((USHORT)(ULONG_PTR)HW_IRP_COMMAND(_irp))
+#define HW_IRP_GENERATION(_irp)     ((USHORT)((ULONG_PTR)HW_IRP_COMMAND(_irp) >> 16))
+
+//
+// A submission/completion queue pair. I/O queues are owned by one CPU; the
+// rings, the PRP pool and this structure are allocated on the NUMA node
+// selected for that CPU and the completion DPC is targeted at it.
+//
+// The structure starts on a page (it comes from HwAllocateNodeMemory) and
+// is laid out by who writes it: fields set up once come first, then the
+// submission side and the completion side, each starting a cache line of
+// its own, so that submitting on one processor does not invalidate the
+// line the completion DPC works on and vice versa.
+//
+typedef struct _HW_QUEUE {
+
+    // Set up once, read-only afterwards
+    PFDO_DATA               FdoData;
+    USHORT                  QueueId;
+    USHORT                  Depth;
+    ULONG                   ProcessorIndex;     // owning CPU, HW_PROCESSOR_NONE for admin
+    PROCESSOR_NUMBER        Processor;
+    USHORT                  ProcessorNode;      // NUMA node of the owning CPU
+    USHORT                  NodeNumber;         // NUMA node the queue memory lives on
+    BOOLEAN                 Created;            // the controller knows about the queue
+    UCHAR                   Priority;           // QPRIO of the submission queue
+    BOOLEAN                 SubmissionInCmb;    // ring in the controller memory buffer
+    PNVME_COMMAND           SubmissionQueue;
+    PHYSICAL_ADDRESS        SubmissionQueuePhys;
+    PULONG                  SubmissionDoorbell;
+    PNVME_COMPLETION_ENTRY  CompletionQueue;
+    PHYSICAL_ADDRESS        CompletionQueuePhys;
+    PULONG                  CompletionDoorbell;
+    volatile ULONG          *SubmissionShadow;  // set at start, NULL without shadow doorbells
+    volatile ULONG          *SubmissionEventIndex;
+    volatile ULONG          *CompletionShadow;
+    volatile ULONG          *CompletionEventIndex;
+    PVOID                   PrpPool;
+    PHYSICAL_ADDRESS        PrpPoolPhys;
+    PVOID                   MetadataPool;       // NULL if the namespace has no metadata
+    PHYSICAL_ADDRESS        MetadataPoolPhys;
+    PHW_REQUEST             Requests;           // Depth entries, follows the structure
+    PUSHORT                 FreeIds;            // free command id stack, follows Requests
+
+    // Submission side, written under SubmissionLock
+    DECLSPEC_CACHEALIGN
+    KSPIN_LOCK              SubmissionLock;
+    USHORT                  SubmissionTail;
+    USHORT                  FreeCount;          // entries on the free id stack
+    ULONG                   WheelTick;          // current tick of the timer wheel
+    ULONGLONG               Submissions;
+    ULONGLONG               SubmissionDoorbells; // tail doorbell register writes
+    LIST_ENTRY              TimerWheel[2][HW_WHEEL_SLOTS];
+
+    // Completion side, written by the completion DPC
+    DECLSPEC_CACHEALIGN
+    KSPIN_LOCK              CompletionLock;
+    USHORT                  CompletionHead;
+    USHORT                  CompletionPhase;
+    volatile USHORT         SubmissionHead;     // last SQHD reported by the controller
+    volatile LONG           LatencyEwma;        // 100ns, of read/write commands
+    volatile ULONGLONG      LastProgress;       // last read/write completed, or the queue woke up
+    ULONGLONG               CompletionUpdates;  // head moves after reaping
+    ULONGLONG               CompletionDoorbells; // head doorbell register writes
+    KDPC                    CompletionDpc;
+} HW_QUEUE, *PHW_QUEUE;
+
+C_ASSERT(FIELD_OFFSET(HW_QUEUE, SubmissionLock) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(HW_QUEUE, CompletionLock) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+C_ASSERT(FIELD_OFFSET(HW_QUEUE, CompletionLock) - FIELD_OFFSET(HW_QUEUE, SubmissionLock) >=
+         SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(sizeof(HW_QUEUE) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);  // Requests start a line
+
+//
+// Copy done by the host when the controller has no Copy command: every
+// slot reads a chunk into a run of arena pages and writes it back out,
+// the slots in turn, so that reads and writes overlap and the data
+// never goes through user memory.
+//
+#define HW_COPY_SLOTS                  4
+#define HW_COPY_CHUNK_PAGES            16
+
+typedef struct _HW_COPY_SLOT {
+    KEVENT                  Event;
+    NVME_COMPLETION_ENTRY   Result;
+    PHW_QUEUE               Queue;
+    PHW_REQUEST             Request;
+    PUCHAR                  Buffer;             // arena run, NULL once handed to a command id
+    PHYSICAL_ADDRESS        BufferPhys;
+    ULONG                   Pages;
+    ULONGLONG               Source;             // LBA
+    ULONGLONG               Destination;        // LBA
+    ULONG                   Blocks;
+    BOOLEAN                 Busy;               // a command is outstanding
+    BOOLEAN                 Writing;
+} HW_COPY_SLOT, *PHW_COPY_SLOT;
+
+//
+// Admin commands that move the buffer of a caller in chunks: every slot
+// moves one chunk through a partial MDL of the buffer, the slots in
+// turn, so that several commands are out at a time and the data is
+// never copied. A chunk spans no more pages than a PRP list slot holds.
+//
+#define HW_ADMIN_SLOTS_MAX             8
+#define HW_ADMIN_CHUNK_PAGES           (HW_PRP_LIST_SIZE / sizeof(ULONGLONG))
+
+typedef struct _HW_ADMIN_SLOT {
+    KEVENT                  Event;
+    NVME_COMPLETION_ENTRY   Result;
+    PHW_REQUEST             Request;
+    PMDL                    Mdl;                // partial MDL of the chunk
+    ULONGLONG               Offset;             // where the chunk goes, bytes
+    ULONG                   Length;             // bytes
+    BOOLEAN                 Busy;               // a command is outstanding
+} HW_ADMIN_SLOT, *PHW_ADMIN_SLOT;
+
+//
+// Log pages read for IOCTL_READ_LOG_PAGE, such as the telemetry logs.
+// Offsets and the data of more than 4096 dwords need the extended data
+// of Identify LPA.
+//
+#define HW_LOG_SLOTS                   4
+#define HW_LOG_LEGACY_MAX_LENGTH       (0x1000 * sizeof(ULONG))
+#define HW_LPA_EXTENDED_DATA           BIT_2
+#define HW_LOG_LSP_SHIFT               8
+#define HW_LOG_RAE                     0x8000  // CDW10, retain asynchronous event
+
+//
+// Firmware images downloaded for IOCTL_UPDATE_FIRMWARE, in chunks of a
+// multiple of the update granularity (Identify FWUG), by up to
+// HW_ADMIN_SLOTS_MAX slots at a time, and then committed.
+//
+#define HW_FIRMWARE_SLOTS              4       // pipeline depth by default
+#define HW_FWUG_UNIT                   4096
+#define HW_FWUG_NONE                   0xFF    // no granularity or alignment
+#define HW_FRMW_SLOT1_READ_ONLY        BIT_0
+#define HW_FRMW_SLOTS(_frmw)           (((_frmw) >> 1) & 0x7)
+#define HW_FW_COMMIT_ACTION_SHIFT      3
+#define HW_FW_COMMIT_ACTIVATE          2       // activates without download
+#define HW_SC_FW_CONVENTIONAL_RESET    0x0B    // command specific, image needs a reset
+#define HW_SC_FW_SUBSYSTEM_RESET       0x10
+#define HW_SC_FW_CONTROLLER_RESET      0x11
+
+//
+// One id is held back so that the ring can never overflow: at most
+// Depth - 1 commands are outstanding on a queue.
+//
+#define HW_QUEUE_COMMAND_IDS(_queue)    ((USHORT)((_queue)->Depth - 1))
+
 //hw_init.c
 NTSTATUS
 HwInitializeDeviceExtension(
@@ -127,6 +683,30 @@ HwShutdown(
     __in  PFDO_DATA  FdoData
     );
 
+NTSTATUS
+HwInitializeController(
+    __in PFDO_DATA FdoData
+    );
+
+NTSTATUS
+HwStartController(
+    __in PFDO_DATA FdoData
+    );
+
+NTSTATUS
+HwStopController(
+    __in PFDO_DATA FdoData,
+    __in BOOLEAN   Shutdown
+    );
+
+VOID
+HwStartControllerAsync(
+    __in PFDO_DATA FdoData
+    );
+
+KDEFERRED_ROUTINE HwStartDpc;
+IO_WORKITEM_ROUTINE HwStartControllerWorker;
+
 NTSTATUS
 HwSetPower(
 	PFDO_DATA          FdoData ,
@@ -142,43 +722,396 @@ HwReadWriteRegister (
 	);
 
 NTSTATUS
-HwStartBusMasterWriteRead (
+HwStartReadWrite (
     __in  PFDO_DATA FdoData,
-    __in  PIRP      Irp,
-    __in  PMDL      Mdl
+    __in  PIRP      Irp
     );
 
-#if !defined(__USE_WDK_6001__)
+NTSTATUS
+HwIssueIrpCommand (
+    __in  PHW_QUEUE     Queue,
+    __in  PHW_REQUEST   Request,
+    __in  PIRP          Irp,
+    __in  PNVME_COMMAND Command
+    );
 
-DRIVER_LIST_CONTROL HwInitiateScatterGatherBusmaster;
+NTSTATUS
+HwBuildPrpList (
+    __in  PHW_REQUEST   Request,
+    __in  PMDL          Mdl,
+    __in  PNVME_COMMAND Command
+    );
+
+NTSTATUS
+HwPrepareRangeRequest (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    );
+
+NTSTATUS
+HwStartRangeCommand (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    );
+
+BOOLEAN
+HwContinueRangeRequest (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    );
+
+BOOLEAN
+HwCopyOffloaded (
+    __in  PFDO_DATA FdoData
+    );
+
+NTSTATUS
+HwCopyRangesByHost (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    );
+
+//hw_queue.c
+PVOID
+HwAllocateNodeMemory(
+    __in  SIZE_T            Size,
+    __in  USHORT            Node,
+    __out PPHYSICAL_ADDRESS PhysicalAddress
+    );
+
+NTSTATUS
+HwAllocateQueue(
+    __in  PFDO_DATA  FdoData,
+    __in  USHORT     QueueId,
+    __in  USHORT     Depth,
+    __in  ULONG      ProcessorIndex,
+    __out PHW_QUEUE *Queue
+    );
 
-#else
 VOID
-HwInitiateScatterGatherBusmaster(
-    __in struct _DEVICE_OBJECT  *DeviceObject,
-    __in struct _IRP  *Irp,
-    __in PSCATTER_GATHER_LIST  ScatterGather,
-    __in PVOID  Context
+HwFreeQueue(
+    __in PHW_QUEUE Queue
     );
 
-#endif
+VOID
+HwFreeQueues(
+    __in PFDO_DATA FdoData
+    );
+
+NTSTATUS
+HwAllocateDmaArena(
+    __in PFDO_DATA FdoData
+    );
 
 VOID
-HwKickBusMasterReadWrite (
+HwFreeDmaArena(
     __in PFDO_DATA FdoData
-);
+    );
+
+PUCHAR
+HwAllocateArenaPages(
+    __in  PFDO_DATA         FdoData,
+    __in  ULONG             Pages,
+    __out PPHYSICAL_ADDRESS PhysicalAddress
+    );
 
 VOID
-HwKickBusMaster (
-    __in PFDO_DATA        FdoData,
-    __in BOOLEAN          WriteToDevice,
-    __in PHYSICAL_ADDRESS Address,
-    __in ULONG            Length
-);
+HwFreeArenaPages(
+    __in PFDO_DATA FdoData,
+    __in PUCHAR    Buffer,
+    __in ULONG     Pages
+    );
+
+VOID
+HwResetQueue(
+    __in PHW_QUEUE Queue
+    );
+
+NTSTATUS
+HwSetupIoQueues(
+    __in PFDO_DATA FdoData
+    );
+
+PHW_REQUEST
+HwAllocateRequest(
+    __in PHW_QUEUE Queue,
+    __in USHORT    Reserve
+    );
+
+VOID
+HwFreeRequest(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request
+    );
+
+NTSTATUS
+HwSubmitRequest(
+    __in PHW_QUEUE     Queue,
+    __in PHW_REQUEST   Request,
+    __in PNVME_COMMAND Command
+    );
+
+VOID
+HwFailRequest(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request,
+    __in USHORT      Generation,
+    __in NTSTATUS    Status
+    );
+
+VOID
+HwAbortRequest(
+    __in PHW_QUEUE Queue,
+    __in USHORT    CommandId,
+    __in USHORT    Generation,
+    __in PIRP      Irp
+    );
+
+VOID
+HwCompleteOutstandingRequests(
+    __in PFDO_DATA FdoData,
+    __in NTSTATUS  Status
+    );
+
+NTSTATUS
+HwSubmitAdminCommandSync(
+    __in      PFDO_DATA              FdoData,
+    __in      PNVME_COMMAND          Command,
+    __out_opt PNVME_COMPLETION_ENTRY Completion
+    );
+
+NTSTATUS
+HwSubmitIoCommandSync(
+    __in      PFDO_DATA              FdoData,
+    __in      PNVME_COMMAND          Command,
+    __out_opt PNVME_COMPLETION_ENTRY Completion
+    );
+
+NTSTATUS
+HwSubmitSlotCommand(
+    __in    PFDO_DATA      FdoData,
+    __inout PHW_ADMIN_SLOT Slot,
+    __in    PNVME_COMMAND  Command
+    );
+
+BOOLEAN
+HwDetachSlotCommand(
+    __in    PFDO_DATA      FdoData,
+    __inout PHW_ADMIN_SLOT Slot
+    );
+
+NTSTATUS
+HwWaitSlotCommand(
+    __in    PFDO_DATA      FdoData,
+    __inout PHW_ADMIN_SLOT Slot
+    );
+
+ULONG
+HwProcessCompletionQueue(
+    __in PHW_QUEUE Queue
+    );
+
+NTSTATUS
+HwCompletionStatus(
+    __in PNVME_COMPLETION_ENTRY Completion
+    );
+
+PHW_QUEUE
+HwGetSubmissionQueue(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Priority
+    );
+
+ULONGLONG
+HwEstimateQueueWait(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Priority
+    );
+
+VOID
+HwCompleteIrp(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    );
+
+VOID
+HwDetachOutstandingRequests(
+    __in    PFDO_DATA   FdoData,
+    __inout PLIST_ENTRY Irps
+    );
+
+VOID
+HwGetDoorbellStatistics(
+    __in  PFDO_DATA                    FdoData,
+    __out PPCIDRV_DOORBELL_STATISTICS  Statistics
+    );
+
+//hw_timer.c
+VOID
+HwResetTimerWheel(
+    __in PHW_QUEUE Queue
+    );
+
+VOID
+HwArmRequestTimeout(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request
+    );
+
+VOID
+HwDisarmRequestTimeout(
+    __in PHW_REQUEST Request
+    );
+
+NTSTATUS
+HwResetController(
+    __in PFDO_DATA FdoData
+    );
+
+KDEFERRED_ROUTINE HwTimeoutDpc;
+IO_WORKITEM_ROUTINE HwResetWorker;
+
+//hw_pi.c
+VOID
+HwInitializeProtection(
+    VOID
+    );
+
+USHORT
+HwCrc16(
+    __in                  USHORT Crc,
+    __in_bcount(Length)   PVOID  Buffer,
+    __in                  SIZE_T Length
+    );
+
+VOID
+HwGenerateProtection(
+    __in PFDO_DATA   FdoData,
+    __in PHW_REQUEST Request,
+    __in ULONGLONG   Lba,
+    __in ULONG       Blocks
+    );
+
+NTSTATUS
+HwVerifyProtection(
+    __in PFDO_DATA   FdoData,
+    __in PHW_REQUEST Request,
+    __in ULONGLONG   Lba,
+    __in ULONG       Blocks
+    );
+
+//hw_zns.c
+NTSTATUS
+HwIdentifyZones(
+    __in PFDO_DATA FdoData,
+    __in ULONG     FormatIndex
+    );
+
+NTSTATUS
+HwStartZoneCommand(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    );
+
+//hw_cmb.c
+VOID
+HwMapControllerMemoryBuffer(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Queues,
+    __in ULONG     Depth
+    );
+
+VOID
+HwUnmapControllerMemoryBuffer(
+    __in PFDO_DATA FdoData
+    );
+
+VOID
+HwRestoreControllerMemoryBuffer(
+    __in PFDO_DATA FdoData
+    );
+
+PVOID
+HwAllocateCmbQueue(
+    __in  PFDO_DATA         FdoData,
+    __in  ULONG             Length,
+    __out PPHYSICAL_ADDRESS Address
+    );
+
+//hw_hmb.c
+VOID
+HwEnableHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    );
+
+VOID
+HwDisableHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    );
+
+VOID
+HwFreeHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    );
+
+//hw_aer.c
+VOID
+HwSetupAsyncEvents(
+    __in PFDO_DATA FdoData
+    );
+
+VOID
+HwFreeAsyncEvents(
+    __in PFDO_DATA FdoData
+    );
+
+VOID
+HwAsyncEventCompleted(
+    __in PFDO_DATA              FdoData,
+    __in PNVME_COMPLETION_ENTRY Completion
+    );
+
+NTSTATUS
+HwGetCachedLogPage(
+    __in  PFDO_DATA         FdoData,
+    __in  ULONG             LogPageId,
+    __out PPCIDRV_LOG_PAGE  Page,
+    __in  ULONG             Length,
+    __out PULONG            BytesReturned
+    );
+
+NTSTATUS
+HwReadLogPageDirect(
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp,
+    __out PULONG    BytesReturned
+    );
+
+//hw_fw.c
+NTSTATUS
+HwUpdateFirmware(
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp,
+    __out PULONG    BytesReturned
+    );
+
+//hw_stream.c
+VOID
+HwSetupWriteStreams(
+    __in PFDO_DATA FdoData
+    );
+
+VOID
+HwTagWriteStream(
+    __in    PFDO_DATA     FdoData,
+    __inout PNVME_COMMAND Command,
+    __in    ULONG         Stream,
+    __in    ULONG         Length
+    );
 
 //isrdpc.c
 KSERVICE_ROUTINE HwInterruptHandler;
-IO_DPC_ROUTINE HwDpcForIsr;
+KDEFERRED_ROUTINE HwCompletionDpc;
 
 
 typedef
@@ -0,0 +1,290 @@
+/*++
+
+Module Name:
+
+    hw_fw.c
+
+Abstract:
+
+    Contains the firmware update. IOCTL_UPDATE_FIRMWARE takes the whole
+    image and downloads it with Firmware Image Download commands, several
+    of them out at a time, each moving a chunk of the locked image of the
+    caller at the update granularity of the device; then it commits the
+    image with Firmware Commit. Waiters of IOCTL_WAIT_ASYNC_EVENT see the
+    download progress as events of the driver.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "hw_fw.tmh"
+#endif
+
+static
+NTSTATUS
+HwDownloadFirmware(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp,
+    __in ULONG     Depth
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwDownloadFirmware)
+#pragma alloc_text (PAGE, HwUpdateFirmware)
+#endif
+
+
+static
+NTSTATUS
+HwDownloadFirmware(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp,
+    __in ULONG     Depth
+    )
+/*++
+Routine Description:
+
+    Downloads the image in the output buffer of the IRP. Chunks are the
+    largest multiple of the update granularity one command moves; Depth
+    slots download them in turn, each through a partial MDL of the image.
+    A command that times out has the controller reset, since it may
+    still read the image after the request is completed and the image
+    unlocked.
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG              length = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PMDL               mdl = Irp->MdlAddress;
+    HW_ADMIN_SLOT      slots[HW_ADMIN_SLOTS_MAX];
+    PHW_ADMIN_SLOT     slot;
+    NVME_COMMAND       command;
+    PUCHAR             va;
+    ULONGLONG          startTime;
+    ULONG              chunk, done, written, percent, reported;
+    ULONG              slotCount, busy, next, i;
+    BOOLEAN            timedOut = FALSE;
+    NTSTATUS           status = STATUS_SUCCESS, slotStatus;
+
+    PAGED_CODE();
+
+    chunk = min(HW_ADMIN_CHUNK_PAGES << PAGE_SHIFT, FdoData->MaxTransferSize) & ~(PAGE_SIZE - 1);
+    if (FdoData->FirmwareGranularity > chunk) {
+        DebugPrint(ERROR, DBG_IOCTLS, "Firmware granularity %d over %d bytes per command\n",
+                   FdoData->FirmwareGranularity, chunk);
+        return STATUS_NOT_SUPPORTED;
+    }
+    chunk -= chunk % FdoData->FirmwareGranularity;
+
+    va = (PUCHAR)MmGetMdlVirtualAddress(mdl);
+
+    for (slotCount = 0; slotCount < Depth; slotCount++) {
+        slot = &slots[slotCount];
+        RtlZeroMemory(slot, sizeof(HW_ADMIN_SLOT));
+        slot->Mdl = IoAllocateMdl(va, chunk, FALSE, FALSE, NULL);
+        if (slot->Mdl == NULL) {
+            break;
+        }
+        KeInitializeEvent(&slot->Event, NotificationEvent, FALSE);
+    }
+
+    if (slotCount == 0) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeFlushIoBuffers(mdl, FALSE, TRUE);
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_FIRMWARE_IMAGE_DOWNLOAD;
+
+    startTime = KeQueryInterruptTime();
+    done = 0;
+    written = 0;
+    reported = 0;
+    busy = 0;
+
+    for (next = 0; ; next = (next + 1) % slotCount) {
+
+        slot = &slots[next];
+
+        if (slot->Busy) {
+
+            slotStatus = HwWaitSlotCommand(FdoData, slot);
+            busy--;
+
+            if (NT_SUCCESS(status)) {
+                status = !NT_SUCCESS(slotStatus) ? slotStatus :
+                         Irp->Cancel ? STATUS_CANCELLED : STATUS_SUCCESS;
+            }
+
+            if (NT_SUCCESS(slotStatus)) {
+                written += slot->Length;
+                percent = (ULONG)((ULONGLONG)written * 100 / length);
+                if (percent != reported) {
+                    reported = percent;
+                    PciDrvNotifyAsyncEvent(FdoData, PCIDRV_ASYNC_EVENT_FIRMWARE,
+                                           (UCHAR)percent, 0);
+                }
+            }
+
+            //
+            // The others are given up on as well; the reset ends them.
+            //
+            if (slotStatus == STATUS_IO_TIMEOUT) {
+                timedOut = TRUE;
+                for (i = 0; i < slotCount; i++) {
+                    if (slots[i].Busy) {
+                        HwDetachSlotCommand(FdoData, &slots[i]);
+                    }
+                }
+                busy = 0;
+            }
+        }
+
+        if (!NT_SUCCESS(status) || done == length) {
+            if (busy == 0) {
+                break;
+            }
+            continue;
+        }
+
+        slot->Offset = done;
+        slot->Length = min(length - done, chunk);
+        MmPrepareMdlForReuse(slot->Mdl);
+        IoBuildPartialMdl(mdl, slot->Mdl, va + done, slot->Length);
+
+        command.u.GENERAL.CDW10 = slot->Length / sizeof(ULONG) - 1;   // NUMD
+        command.u.GENERAL.CDW11 = done / sizeof(ULONG);               // OFST
+
+        status = HwSubmitSlotCommand(FdoData, slot, &command);
+        if (NT_SUCCESS(status)) {
+            busy++;
+            done += slot->Length;
+        }
+    }
+
+    if (timedOut) {
+        HwResetController(FdoData);
+    }
+
+    for (next = 0; next < slotCount; next++) {
+        IoFreeMdl(slots[next].Mdl);
+    }
+
+    DebugPrint(INFO, DBG_IOCTLS,
+               "Firmware image: %d of %d bytes in %I64u ms, %d chunks of %d bytes out at a time: 0x%x\n",
+               written, length, (KeQueryInterruptTime() - startTime) / 10000,
+               slotCount, chunk, status);
+
+    return status;
+}
+
+
+NTSTATUS
+HwUpdateFirmware(
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp,
+    __out PULONG    BytesReturned
+    )
+/*++
+Routine Description:
+
+    Carries out IOCTL_UPDATE_FIRMWARE: downloads the image, unless the
+    commit action only activates an image the device has already, and
+    commits it. Runs in the thread of the caller, at PASSIVE_LEVEL.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    Irp             The IOCTL request
+    BytesReturned   Receives the command specific status of a commit that
+                    needs a reset to activate the image, 0 otherwise
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PIO_STACK_LOCATION      irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PPCIDRV_FIRMWARE_UPDATE update = (PPCIDRV_FIRMWARE_UPDATE)Irp->AssociatedIrp.SystemBuffer;
+    ULONG                   length = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PMDL                    mdl = Irp->MdlAddress;
+    NVME_COMMAND            command;
+    NVME_COMPLETION_ENTRY   completion;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    *BytesReturned = 0;
+
+    if (update == NULL ||
+        irpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(PCIDRV_FIRMWARE_UPDATE) ||
+        update->Slot > FdoData->FirmwareSlots ||
+        update->CommitAction > PCIDRV_FIRMWARE_REPLACE_ACTIVATE_NOW ||
+        update->PipelineDepth > HW_ADMIN_SLOTS_MAX) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (update->CommitAction == HW_FW_COMMIT_ACTIVATE) {
+        length = 0;
+    } else if (mdl == NULL || length == 0 || length != MmGetMdlByteCount(mdl) ||
+               (length & 3) != 0 || (MmGetMdlByteOffset(mdl) & 3) != 0 ||
+               (update->Slot == 1 && FdoData->FirmwareSlot1ReadOnly)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (InterlockedCompareExchange(&FdoData->FirmwareUpdateActive, 1, 0) != 0) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    if (length != 0) {
+        status = HwDownloadFirmware(FdoData,
+                                    Irp,
+                                    update->PipelineDepth != 0 ?
+                                        update->PipelineDepth : HW_FIRMWARE_SLOTS);
+    }
+
+    if (NT_SUCCESS(status)) {
+
+        RtlZeroMemory(&command, sizeof(command));
+        RtlZeroMemory(&completion, sizeof(completion));
+        command.CDW0.OPC = NVME_ADMIN_COMMAND_FIRMWARE_COMMIT;
+        command.u.GENERAL.CDW10 = update->Slot |
+                                  (update->CommitAction << HW_FW_COMMIT_ACTION_SHIFT);
+
+        status = HwSubmitAdminCommandSync(FdoData, &command, &completion);
+        if (status == STATUS_IO_TIMEOUT) {
+            HwResetController(FdoData);
+        }
+
+        //
+        // The image was committed, but only a reset activates it.
+        //
+        if (!NT_SUCCESS(status) &&
+            completion.DW3.Status.SCT == NVME_STATUS_TYPE_COMMAND_SPECIFIC) {
+            switch (completion.DW3.Status.SC) {
+            case HW_SC_FW_CONVENTIONAL_RESET:
+            case HW_SC_FW_SUBSYSTEM_RESET:
+            case HW_SC_FW_CONTROLLER_RESET:
+                *BytesReturned = completion.DW3.Status.SC;
+                status = STATUS_SUCCESS;
+                break;
+            default:
+                break;
+            }
+        }
+
+        DebugPrint(INFO, DBG_IOCTLS, "Firmware Commit of slot %d, action %d: 0x%x, sc 0x%x\n",
+                   update->Slot, update->CommitAction, status, completion.DW3.Status.SC);
+    }
+
+    InterlockedExchange(&FdoData->FirmwareUpdateActive, 0);
+
+    return status;
+}
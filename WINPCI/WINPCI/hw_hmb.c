@@ -0,0 +1,321 @@
+/*++
+
+Module Name:
+
+    hw_hmb.c
+
+Abstract:
+
+    Contains the host memory buffer (HMB): host memory lent to a
+    controller without DRAM of its own, which keeps its logical to
+    physical mapping tables there instead of reading them from flash on
+    most random reads.
+
+    The chunks are allocated once, at the first start, as large as the
+    node of the device gives them contiguously, up to the size preferred
+    by the controller and the registry value "HostMemoryBufferSize". The
+    descriptor list is a page of the DMA arena. The buffer is enabled at
+    every start of the controller and disabled before it is shut down;
+    the controller gets the same chunks back after a reset or a resume
+    from D3, so it may reuse what it left in them.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "hw_hmb.tmh"
+#endif
+
+static
+BOOLEAN
+HwAllocateHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    );
+
+static
+NTSTATUS
+HwSetHostMemoryBuffer(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Flags
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwAllocateHostMemoryBuffer)
+#pragma alloc_text (PAGE, HwSetHostMemoryBuffer)
+#pragma alloc_text (PAGE, HwEnableHostMemoryBuffer)
+#pragma alloc_text (PAGE, HwDisableHostMemoryBuffer)
+#pragma alloc_text (PAGE, HwFreeHostMemoryBuffer)
+#endif
+
+
+static
+BOOLEAN
+HwAllocateHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Allocates the chunks and their descriptor list. Chunks start at
+    HW_HMB_MAX_CHUNK and are halved whenever no contiguous run that long
+    is left, down to the minimum chunk size of the controller. Less than
+    the minimum buffer size of the controller is no buffer at all.
+
+--*/
+{
+    PHYSICAL_ADDRESS chunkPhys;
+    ULONGLONG        limit;
+    ULONG            target, chunk, length;
+    PVOID            va;
+
+    PAGED_CODE();
+
+    limit = (ULONGLONG)FdoData->Parameters.HostMemoryBufferSize * 1024 * 1024;
+    target = (ULONG)min((ULONGLONG)FdoData->HmbPreferred, limit) & ~(PAGE_SIZE - 1);
+    if (target == 0 || target < FdoData->HmbMinimum) {
+        DebugPrint(INFO, DBG_INIT, "HMB: %d bytes preferred, %d minimum, %I64u allowed\n",
+                   FdoData->HmbPreferred, FdoData->HmbMinimum, limit);
+        return FALSE;
+    }
+
+    FdoData->HmbDescriptors = (PHW_HMB_DESCRIPTOR)HwAllocateArenaPages(FdoData, 1,
+                                                   &FdoData->HmbDescriptorsPhys);
+    FdoData->HmbChunks = ExAllocatePoolWithTag(PagedPool,
+                                               FdoData->HmbMaxChunks * sizeof(PVOID),
+                                               PCIDRV_POOL_TAG);
+    if (FdoData->HmbDescriptors == NULL || FdoData->HmbChunks == NULL) {
+        HwFreeHostMemoryBuffer(FdoData);
+        return FALSE;
+    }
+
+    RtlZeroMemory(FdoData->HmbDescriptors, PAGE_SIZE);
+    FdoData->HmbChunkCount = 0;
+    FdoData->HmbSize = 0;
+
+    chunk = HW_HMB_MAX_CHUNK;
+
+    while (FdoData->HmbSize < target &&
+           FdoData->HmbChunkCount < FdoData->HmbMaxChunks &&
+           chunk >= FdoData->HmbMinChunk) {
+
+        length = max(min(chunk, target - FdoData->HmbSize), FdoData->HmbMinChunk);
+
+        va = HwAllocateNodeMemory(length, FdoData->DeviceNode, &chunkPhys);
+        if (va == NULL) {
+            chunk /= 2;
+            continue;
+        }
+
+        FdoData->HmbChunks[FdoData->HmbChunkCount] = va;
+        FdoData->HmbDescriptors[FdoData->HmbChunkCount].BADD = chunkPhys.QuadPart;
+        FdoData->HmbDescriptors[FdoData->HmbChunkCount].BSIZE = length / PAGE_SIZE;
+        FdoData->HmbChunkCount++;
+        FdoData->HmbSize += length;
+    }
+
+    if (FdoData->HmbSize < FdoData->HmbMinimum) {
+        DebugPrint(ERROR, DBG_INIT, "HMB: only %d of %d bytes allocated\n",
+                   FdoData->HmbSize, target);
+        HwFreeHostMemoryBuffer(FdoData);
+        return FALSE;
+    }
+
+    DebugPrint(INFO, DBG_INIT, "HMB: %d bytes in %d chunks, %d preferred, %d minimum\n",
+               FdoData->HmbSize, FdoData->HmbChunkCount,
+               FdoData->HmbPreferred, FdoData->HmbMinimum);
+
+    return TRUE;
+}
+
+
+static
+NTSTATUS
+HwSetHostMemoryBuffer(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Flags
+    )
+/*++
+Routine Description:
+
+    Sends the Host Memory Buffer feature: with HW_HMB_ENABLE the chunks
+    of the descriptor list, without it nothing.
+
+--*/
+{
+    NVME_COMMAND command;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_SET_FEATURES;
+    command.u.GENERAL.CDW10 = NVME_FEATURE_HOST_MEMORY_BUFFER;
+    command.u.GENERAL.CDW11 = Flags;
+
+    if (Flags & HW_HMB_ENABLE) {
+        command.u.GENERAL.CDW12 = FdoData->HmbSize / PAGE_SIZE;
+        command.u.GENERAL.CDW13 = FdoData->HmbDescriptorsPhys.LowPart;
+        command.u.GENERAL.CDW14 = (ULONG)FdoData->HmbDescriptorsPhys.HighPart;
+        command.u.GENERAL.CDW15 = FdoData->HmbChunkCount;
+    }
+
+    return HwSubmitAdminCommandSync(FdoData, &command, NULL);
+}
+
+
+VOID
+HwEnableHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Gives the controller its host memory buffer, allocating it at the
+    first start. Called at every start once the DMA arena exists, since
+    a controller reset disables the buffer. A buffer that cannot be
+    given is no error; the controller then runs without it. A command
+    that times out may still have handed the buffer over, so the buffer
+    is then kept as enabled until the failed start disables the
+    controller.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS status;
+    ULONG    flags = HW_HMB_ENABLE;
+
+    PAGED_CODE();
+
+    ASSERT(!FdoData->HmbEnabled);
+
+    if (FdoData->HmbDescriptors == NULL) {
+        if (FdoData->HmbPreferred == 0 || !HwAllocateHostMemoryBuffer(FdoData)) {
+            return;
+        }
+    }
+
+    //
+    // Chunks the controller had before are returned unchanged, so it may
+    // pick up the tables it left in them.
+    //
+    if (FdoData->HmbGiven) {
+        flags |= HW_HMB_MEMORY_RETURN;
+    }
+
+    status = HwSetHostMemoryBuffer(FdoData, flags);
+    if (status == STATUS_IO_TIMEOUT) {
+        DebugPrint(ERROR, DBG_INIT, "Enabling the HMB timed out\n");
+        FdoData->HmbEnabled = TRUE;
+        FdoData->HmbGiven = FALSE;      // what it left there is unknown
+        return;
+    }
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Enabling the HMB failed 0x%x\n", status);
+        HwFreeHostMemoryBuffer(FdoData);
+        return;
+    }
+
+    FdoData->HmbEnabled = TRUE;
+    FdoData->HmbGiven = TRUE;
+}
+
+
+VOID
+HwDisableHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Takes the host memory buffer back from the controller before it is
+    shut down, so that it can first write out what it keeps there. The
+    chunks stay allocated for the next start. If the controller does not
+    give the buffer back, it keeps it until HwStopController disables it.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (!FdoData->HmbEnabled || !FdoData->ControllerEnabled) {
+        return;
+    }
+
+    status = HwSetHostMemoryBuffer(FdoData, 0);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Disabling the HMB failed 0x%x\n", status);
+        return;
+    }
+
+    FdoData->HmbEnabled = FALSE;
+}
+
+
+VOID
+HwFreeHostMemoryBuffer(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Frees the chunks and the descriptor list. The controller must have
+    been disabled or reset since it last had the buffer; if it could not
+    be, the buffer is left allocated rather than freed under it.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (FdoData->HmbEnabled) {
+        DebugPrint(ERROR, DBG_INIT, "HMB: controller still owns %d bytes, not freed\n",
+                   FdoData->HmbSize);
+        return;
+    }
+
+    if (FdoData->HmbChunks != NULL) {
+        for (i = 0; i < FdoData->HmbChunkCount; i++) {
+            MmFreeContiguousMemory(FdoData->HmbChunks[i]);
+        }
+        ExFreePoolWithTag(FdoData->HmbChunks, PCIDRV_POOL_TAG);
+        FdoData->HmbChunks = NULL;
+    }
+
+    if (FdoData->HmbDescriptors != NULL) {
+        HwFreeArenaPages(FdoData, (PUCHAR)FdoData->HmbDescriptors, 1);
+        FdoData->HmbDescriptors = NULL;
+    }
+
+    FdoData->HmbChunkCount = 0;
+    FdoData->HmbSize = 0;
+    FdoData->HmbGiven = FALSE;
+}
@@ -31,6 +31,9 @@ Environment:
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, HwInitializeDeviceExtension)
 #pragma alloc_text (PAGE, HwAllocateDeviceResources)
+#pragma alloc_text (PAGE, HwInitializeController)
+#pragma alloc_text (PAGE, HwStartControllerAsync)
+#pragma alloc_text (PAGE, HwStartControllerWorker)
 #pragma alloc_text (PAGE, HwMapHWResources)
 #pragma alloc_text (PAGE, HwUnmapHWResources)
 #pragma alloc_text (PAGE, HwGetDeviceInformation)
@@ -79,7 +82,6 @@ Return Value:
     FdoData->SwitchCount = 0;
     FdoData->PushSwitchNotifyIrp = NULL;
 
-    FdoData->ReadWriteIrp = NULL;
     FdoData->BusMasterDone = FALSE;
 
     return status;
@@ -131,6 +133,12 @@ Return Value:
             break;
         }
 
+        status = HwInitializeController(FdoData);
+        if (!NT_SUCCESS (status)){
+            DebugPrint(ERROR, DBG_INIT,"HwInitializeController failed: 0x%x\n", status);
+            break;
+        }
+
         //
         // Enable the interrupt
         //
@@ -179,6 +187,47 @@ Return Value:
 
 }
 
+static
+ULONG
+HwFindBar(
+    __in PFDO_DATA        FdoData,
+    __in PHYSICAL_ADDRESS Raw
+    )
+/*++
+Routine Description:
+
+    Returns the index of the memory BAR a raw memory resource was
+    assigned from, going by the BARs read from config space, or
+    PCI_TYPE0_ADDRESSES if none holds its address.
+
+--*/
+{
+    ULONG i, index, low, high;
+
+    for (i = 0; i < PCI_TYPE0_ADDRESSES; i++) {
+
+        low = FdoData->PciBaseAddresses[i];
+        if ((low & PCI_ADDRESS_IO_SPACE) != 0) {
+            continue;
+        }
+
+        index = i;
+        high = 0;
+        if ((low & PCI_ADDRESS_MEMORY_TYPE_MASK) == PCI_TYPE_64BIT &&
+            i + 1 < PCI_TYPE0_ADDRESSES) {
+            high = FdoData->PciBaseAddresses[++i];
+        }
+
+        if ((low & PCI_ADDRESS_MEMORY_ADDRESS_MASK) == Raw.LowPart &&
+            high == (ULONG)Raw.HighPart) {
+            return index;
+        }
+    }
+
+    return PCI_TYPE0_ADDRESSES;
+}
+
+
 NTSTATUS
 HwMapHWResources(
     __in PFDO_DATA FdoData,
@@ -231,9 +280,10 @@ Return Value:
 --*/
 {
     PCM_PARTIAL_RESOURCE_DESCRIPTOR resourceTrans;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR resourceRaw;
     PCM_PARTIAL_RESOURCE_LIST       partialResourceListTranslated;
     PIO_STACK_LOCATION              stack;
-    ULONG                           i;
+    ULONG                           i, bar;
     NTSTATUS                        status = STATUS_SUCCESS;
     BOOLEAN bResPort = FALSE, bResInterrupt = FALSE, bResMemory = FALSE;
     ULONG                           numberOfBARs = 0;
@@ -245,7 +295,8 @@ Return Value:
 
     PAGED_CODE();
 
-    if (NULL == stack->Parameters.StartDevice.AllocatedResourcesTranslated) {
+    if (NULL == stack->Parameters.StartDevice.AllocatedResourcesTranslated ||
+        NULL == stack->Parameters.StartDevice.AllocatedResources) {
         status = STATUS_DEVICE_CONFIGURATION_ERROR;
         goto End;
     }
@@ -263,9 +314,18 @@ Return Value:
 
     resourceTrans = &partialResourceListTranslated->PartialDescriptors[0];
 
+    //
+    // The raw list has the same entries in the same order; it gives the
+    // bus addresses, which tell the BARs apart.
+    //
+    resourceRaw = &stack->Parameters.StartDevice.AllocatedResources->List[0].
+                      PartialResourceList.PartialDescriptors[0];
+
+    RtlZeroMemory(FdoData->Bars, sizeof(FdoData->Bars));
+
     DebugPrint(LOUD, DBG_INIT,  "partialResourceListTranslated->Count: (%d)\n",  partialResourceListTranslated->Count);
 
-    for (i = 0; i < partialResourceListTranslated->Count; i++, resourceTrans++) {
+    for (i = 0; i < partialResourceListTranslated->Count; i++, resourceTrans++, resourceRaw++) {
 
         switch (resourceTrans->Type) {
 
@@ -314,6 +374,13 @@ Return Value:
 
             numberOfBARs++;
 
+            bar = HwFindBar(FdoData, resourceRaw->u.Memory.Start);
+            if (bar < PCI_TYPE0_ADDRESSES) {
+                FdoData->Bars[bar].Raw = resourceRaw->u.Memory.Start;
+                FdoData->Bars[bar].Translated = resourceTrans->u.Memory.Start;
+                FdoData->Bars[bar].Length = resourceTrans->u.Memory.Length;
+            }
+
             if(numberOfBARs == 1) {
                 DebugPrint(LOUD, DBG_INIT, "Memory mapped CSR:(%x:%x) Length:(%d)\n",
                                         resourceTrans->u.Memory.Start.LowPart,
@@ -322,9 +389,17 @@ Return Value:
                 //FdoData->MemPhysAddress = resourceTrans->u.Memory.Start;
 
                 // nvme Controller registermapB
+                // The doorbells follow the registers, so map the whole BAR.
+                if (resourceTrans->u.Memory.Length <= HW_DOORBELL_OFFSET) {
+                    DebugPrint(ERROR, DBG_INIT, "BAR0 too small for the doorbells\n");
+                    status = STATUS_DEVICE_CONFIGURATION_ERROR;
+                    goto End;
+                }
+
+                FdoData->RegisterLength = resourceTrans->u.Memory.Length;
                 FdoData->controller_regs = MmMapIoSpace(
                                                resourceTrans->u.Memory.Start,
-                                                     sizeof(NVME_CONTROLLER_REGISTERS),
+                                                     FdoData->RegisterLength,
                                                     MmNonCached);
 
               if(FdoData->controller_regs == NULL) {
@@ -368,10 +443,16 @@ Return Value:
                 bResPort = TRUE;
 
             } else {
-                DebugPrint(ERROR, DBG_INIT,
-                            "Memory Resources are not in the right order\n");
-                status = STATUS_DEVICE_CONFIGURATION_ERROR;
-                goto End;
+                //
+                // Further BARs, such as one holding the controller memory
+                // buffer, are only recorded; HwMapControllerMemoryBuffer
+                // maps the one CMBLOC names.
+                //
+                DebugPrint(LOUD, DBG_INIT, "Memory BAR %d: (%x:%x) Length:(%d)\n",
+                           bar,
+                           resourceTrans->u.Memory.Start.LowPart,
+                           resourceTrans->u.Memory.Start.HighPart,
+                           resourceTrans->u.Memory.Length);
             }
 
             break;
@@ -441,7 +522,8 @@ Return Value:
     // Make sure we got all the 3 resources to work with.
     //
     if (!( bResInterrupt && bResMemory)) {
-        DebugPrint(LOUD, DBG_INIT, "Failure bResInterrupt && bResMemory\n");
+        DebugPrint(LOUD, DBG_INIT, "Failure bResInterrupt && bResMemory (port %d)\n",
+                                    bResPort);
 
         status = STATUS_DEVICE_CONFIGURATION_ERROR;
         goto End;
@@ -454,8 +536,6 @@ Return Value:
    // ͎gpȂB
    // HwDisableInterrupt(FdoData);
 
-    IoInitializeDpcRequest(FdoData->Self, HwDpcForIsr);
-
   
    //Register the interrupt
    
@@ -579,18 +659,36 @@ Return Value:
    // PAGED_CODE();
 
     DebugPrint(TRACE, DBG_INIT, "--> HwUnmapHWResources\n");
-    IoDisconnectInterrupt(FdoData->Interrupt);
-    FdoData->Interrupt = NULL;
 
+    //
+    // The controller must let go of the queues before they are freed.
+    //
+    if (FdoData->AdminQueue != NULL) {
+        HwStopController(FdoData, FALSE);
+    }
+
+    if (FdoData->Interrupt) {
+        IoDisconnectInterrupt(FdoData->Interrupt);
+        FdoData->Interrupt = NULL;
+    }
+
+    HwFreeHostMemoryBuffer(FdoData);
+
+    HwFreeAsyncEvents(FdoData);
+
+    HwFreeQueues(FdoData);
+
+    HwUnmapControllerMemoryBuffer(FdoData);
 
     if (FdoData->controller_regs)
     {
-        MmUnmapIoSpace(FdoData->controller_regs, sizeof(NVME_CONTROLLER_REGISTERS));
+        MmUnmapIoSpace(FdoData->controller_regs, FdoData->RegisterLength);
         FdoData->controller_regs = NULL;
     }
 
     if (FdoData->buf_va != NULL) {
         MmFreeContiguousMemory(FdoData->buf_va);
+        FdoData->buf_va = NULL;
     }
     
 
@@ -676,6 +774,13 @@ Return Value:
     FdoData->SubVendorID = pci_config.u.type0.SubVendorID;
     FdoData->SubSystemID = pci_config.u.type0.SubSystemID;
 
+    //
+    // Kept to tell which BAR each memory resource is, see HwFindBar.
+    //
+    RtlCopyMemory(FdoData->PciBaseAddresses,
+                  pci_config.u.type0.BaseAddresses,
+                  sizeof(FdoData->PciBaseAddresses));
+
     DebugPrint(TRACE, DBG_INIT, "<-- HwGetDeviceInformation\n");
 
 
@@ -754,6 +859,13 @@ Return Value:
 {
     DebugPrint(INFO, DBG_INIT, "---> HwShutdown\n");
 
+    //
+    // Give the controller a chance to flush its caches, including what it
+    // keeps in the host memory buffer, before power goes.
+    //
+    HwDisableHostMemoryBuffer(FdoData);
+    HwStopController(FdoData, TRUE);
+
   //  if(FdoData->CSRAddress) {
         //
         // Disable interrupt and issue a full reset
@@ -767,6 +879,832 @@ Return Value:
 }
 
 
+NTSTATUS
+HwInitializeController(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Reads the controller capabilities and tunables, allocates the admin
+    queue on the node of the device and brings the controller up.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NVME_CONTROLLER_CAPABILITIES cap;
+    USHORT                       node;
+    NTSTATUS                     status;
+
+    PAGED_CODE();
+
+    cap.AsUlonglong = HwReadRegisterULong64(&FdoData->controller_regs->CAP.AsUlonglong);
+    if (cap.AsUlonglong == MAXULONGLONG) {
+        return STATUS_DEVICE_DOES_NOT_EXIST;
+    }
+
+    //
+    // Host pages are used as controller pages, so 4KB must be supported.
+    //
+    if (!cap.CSS_NVM || (PAGE_SHIFT - 12) < cap.MPSMIN ||
+        (PAGE_SHIFT - 12) > cap.MPSMAX) {
+        DebugPrint(ERROR, DBG_INIT, "Unsupported CAP 0x%I64x\n", cap.AsUlonglong);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    FdoData->ControllerCaps = cap;
+    FdoData->DoorbellStride = 4 << cap.DSTRD;
+    FdoData->MaxQueueEntries = (ULONG)cap.MQES + 1;
+
+    //
+    // Weighted round robin gives every priority class its own queues; it
+    // can be turned off with "PriorityQueues" = 0.
+    //
+    FdoData->WrrEnabled = (BOOLEAN)cap.AMS_WeightedRoundRobinWithUrgent;
+    if (FdoData->Parameters.PriorityQueues == 0) {
+        FdoData->WrrEnabled = FALSE;
+    }
+
+    if (!NT_SUCCESS(IoGetDeviceNumaNode(FdoData->UnderlyingPDO, &node))) {
+        node = HW_NODE_UNKNOWN;
+    }
+    FdoData->DeviceNode = node;
+
+    //
+    // The parameters were range checked when they were read.
+    //
+    FdoData->QueueNodePlacement = FdoData->Parameters.QueueNodePlacement;
+    FdoData->IoQueueDepth = min(FdoData->Parameters.IoQueueDepth, FdoData->MaxQueueEntries);
+    FdoData->IoTimeoutTicks = HW_IO_TIMEOUT_TICKS(FdoData->Parameters.IoTimeout);
+
+    DebugPrint(INFO, DBG_INIT,
+               "CAP 0x%I64x, device node %d, I/O queue depth %d, WRR %d\n",
+               cap.AsUlonglong, node, FdoData->IoQueueDepth, FdoData->WrrEnabled);
+
+    status = HwAllocateQueue(FdoData,
+                             HW_ADMIN_QUEUE_ID,
+                             (USHORT)min(HW_ADMIN_QUEUE_DEPTH, FdoData->MaxQueueEntries),
+                             HW_PROCESSOR_NONE,
+                             &FdoData->AdminQueue);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    //
+    // The controller itself is brought up by HwStartControllerAsync once
+    // the device has been reported started.
+    //
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+HwWaitForControllerReady(
+    __in PFDO_DATA FdoData,
+    __in BOOLEAN   Ready
+    )
+/*++
+Routine Description:
+
+    Polls CSTS.RDY until it reaches the requested value or CAP.TO runs out.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Ready       Value of CSTS.RDY to wait for
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NVME_CONTROLLER_STATUS csts;
+    LARGE_INTEGER          interval;
+    ULONG                  timeout;
+    ULONG                  elapsed;
+
+    timeout = max(1, (ULONG)FdoData->ControllerCaps.TO) * HW_CONTROLLER_TIMEOUT_UNIT;
+    interval.QuadPart = -10000LL * HW_CONTROLLER_POLL_INTERVAL;
+
+    for (elapsed = 0; ; elapsed += HW_CONTROLLER_POLL_INTERVAL) {
+
+        csts.AsUlong = HwReadRegisterULong(&FdoData->controller_regs->CSTS.AsUlong);
+
+        if (csts.AsUlong == MAXULONG) {
+            return STATUS_DEVICE_DOES_NOT_EXIST;
+        }
+        if (Ready && csts.CFS) {
+            return STATUS_IO_DEVICE_ERROR;
+        }
+        if (csts.RDY == (ULONG)Ready) {
+            return STATUS_SUCCESS;
+        }
+        if (elapsed >= timeout) {
+            DebugPrint(ERROR, DBG_INIT, "CSTS.RDY stuck at %d\n", csts.RDY);
+            return STATUS_IO_TIMEOUT;
+        }
+
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+}
+
+
+static
+NTSTATUS
+HwIdentifyController(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Reads Identify Controller and Identify Namespace 1 into the DMA buffer
+    and derives the transfer and abort limits, the LBA geometry, the
+    metadata and protection information layout used by the read/write
+    path and, for a zoned namespace, the zone geometry.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PNVME_IDENTIFY_CONTROLLER_DATA controller;
+    PNVME_IDENTIFY_NAMESPACE_DATA  ns;
+    PNVME_LBA_FORMAT               format;
+    NVME_COMMAND                   command;
+    ULONG                          maxTransfer;
+    NTSTATUS                       status;
+
+    if (FdoData->buf_va == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_IDENTIFY;
+    command.PRP1 = MmGetPhysicalAddress(FdoData->buf_va).QuadPart;
+    command.u.GENERAL.CDW10 = NVME_IDENTIFY_CNS_CONTROLLER;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Identify Controller failed 0x%x\n", status);
+        return status;
+    }
+
+    controller = (PNVME_IDENTIFY_CONTROLLER_DATA)FdoData->buf_va;
+
+    //
+    // PRP1 plus one PRP list slot bounds a transfer to this many pages
+    // even when the buffer does not start on a page boundary.
+    //
+    maxTransfer = (HW_PRP_LIST_SIZE / sizeof(ULONGLONG)) * PAGE_SIZE;
+    if (controller->MDTS != 0 &&
+        controller->MDTS + 12 + FdoData->ControllerCaps.MPSMIN < 32) {
+        maxTransfer = min(maxTransfer,
+                          1UL << (controller->MDTS + 12 + FdoData->ControllerCaps.MPSMIN));
+    }
+    FdoData->MaxTransferSize = maxTransfer;
+    FdoData->AbortLimit = (ULONG)controller->ACL + 1;
+    FdoData->DsmSupported = (BOOLEAN)controller->ONCS.DatasetManagement;
+    FdoData->WriteZeroesSupported = (BOOLEAN)controller->ONCS.WriteZeroes;
+    FdoData->CopySupported = (BOOLEAN)((*(PUSHORT)&controller->ONCS & HW_ONCS_COPY) != 0);
+    FdoData->DirectivesSupported = (BOOLEAN)((*(PUSHORT)&controller->OACS & HW_OACS_DIRECTIVES) != 0);
+    FdoData->PlacementSupported = (BOOLEAN)((*(PULONG)&controller->CTRATT & HW_CTRATT_FDP) != 0);
+    FdoData->DoorbellBufferSupported =
+        (BOOLEAN)((*(PUSHORT)&controller->OACS & HW_OACS_DOORBELL_BUFFER) != 0);
+    FdoData->AsyncEventLimit = min((ULONG)controller->AERL + 1, HW_AER_MAX);
+    FdoData->AsyncEventNotices = *(PULONG)&controller->OAES & HW_OAES_NOTICES;
+    FdoData->ErrorLogEntries = min((ULONG)controller->ELPE + 1, HW_ERROR_LOG_MAX_ENTRIES);
+    FdoData->ExtendedLogPages = (BOOLEAN)((*(PUCHAR)&controller->LPA & HW_LPA_EXTENDED_DATA) != 0);
+
+    FdoData->FirmwareSlots = HW_FRMW_SLOTS(*(PUCHAR)&controller->FRMW);
+    FdoData->FirmwareSlot1ReadOnly =
+        (BOOLEAN)((*(PUCHAR)&controller->FRMW & HW_FRMW_SLOT1_READ_ONLY) != 0);
+    if (controller->FWUG == HW_FWUG_NONE) {
+        FdoData->FirmwareGranularity = sizeof(ULONG);
+    } else if (controller->FWUG != 0) {
+        FdoData->FirmwareGranularity = controller->FWUG * HW_FWUG_UNIT;
+    } else {
+        //
+        // No granularity reported; 4 KiB pieces are what controllers
+        // without one expect.
+        //
+        FdoData->FirmwareGranularity = HW_FWUG_UNIT;
+    }
+
+    FdoData->HmbPreferred = (ULONG)min((ULONGLONG)controller->HMPRE * HW_HMB_UNIT, MAXULONG);
+    FdoData->HmbMinimum = (ULONG)min((ULONGLONG)controller->HMMIN * HW_HMB_UNIT, MAXULONG);
+    FdoData->HmbMinChunk = max(PAGE_SIZE,
+                               (ULONG)min((ULONGLONG)controller->HMMINDS * HW_HMB_UNIT,
+                                          HW_HMB_MAX_CHUNK));
+    FdoData->HmbMaxChunks = controller->HMMAXD != 0 ?
+                            min((ULONG)controller->HMMAXD, HW_HMB_MAX_DESCRIPTORS) :
+                            HW_HMB_MAX_DESCRIPTORS;
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_IDENTIFY;
+    command.NSID = 1;
+    command.PRP1 = MmGetPhysicalAddress(FdoData->buf_va).QuadPart;
+    command.u.GENERAL.CDW10 = NVME_IDENTIFY_CNS_SPECIFIC_NAMESPACE;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Identify Namespace failed 0x%x\n", status);
+        return status;
+    }
+
+    ns = (PNVME_IDENTIFY_NAMESPACE_DATA)FdoData->buf_va;
+
+    FdoData->NamespaceId = 1;
+    FdoData->NamespaceBlocks = ns->NSZE;
+    FdoData->EnduranceGroup = ns->ENDGID;
+    format = &ns->LBAF[ns->FLBAS.LbaFormatIndex];
+    FdoData->LbaShift = format->LBADS;
+
+    //
+    // Copy limits; MSRC is 0's based, and an MSSRL or MCL of 0 leaves
+    // only the limits of the command format.
+    //
+    FdoData->CopyMaxRanges = min((ULONG)ns->MSRC + 1, HW_COPY_MAX_RANGES);
+    FdoData->CopyMaxRangeBlocks = ns->MSSRL != 0 ? ns->MSSRL : HW_COPY_MAX_RANGE_BLOCKS;
+    FdoData->CopyMaxBlocks = ns->MCL != 0 ? ns->MCL : MAXULONG;
+
+    if (FdoData->LbaShift < 9 || FdoData->LbaShift > 16) {
+        DebugPrint(ERROR, DBG_INIT, "Unsupported LBA size 2^%d\n", FdoData->LbaShift);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    FdoData->MetadataSize = 0;
+    FdoData->PiType = ns->DPS.ProtectionInfoTypeEnabled;
+    FdoData->PiFirst = (BOOLEAN)ns->DPS.InfoAtBeginningOfMetadata;
+    FdoData->PiInsertStrip = FALSE;
+
+    if (FdoData->PiType > HW_PI_TYPE3 || (FdoData->PiType != HW_PI_NONE && format->MS < 8)) {
+        DebugPrint(ERROR, DBG_INIT, "Unsupported PI type %d\n", FdoData->PiType);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    if (format->MS != 0 && ns->FLBAS.MetadataInExtendedDataLBA) {
+
+        //
+        // Metadata interleaved with the data would not fit the block
+        // sized buffers of the read/write path. Metadata that is nothing
+        // but PI can be left to the controller to insert and strip.
+        //
+        if (FdoData->PiType == HW_PI_NONE || format->MS != 8) {
+            DebugPrint(ERROR, DBG_INIT, "Unsupported extended LBA, %d bytes metadata\n",
+                       format->MS);
+            return STATUS_DEVICE_CONFIGURATION_ERROR;
+        }
+        FdoData->PiInsertStrip = TRUE;
+
+    } else if (format->MS != 0) {
+
+        //
+        // Separate metadata goes to the per-command slot, which bounds the
+        // number of blocks per command.
+        //
+        if (format->MS > HW_METADATA_SLOT_SIZE ||
+            (FdoData->IoQueues != NULL && FdoData->IoQueues[0]->MetadataPool == NULL)) {
+            DebugPrint(ERROR, DBG_INIT, "Unsupported metadata size %d\n", format->MS);
+            return STATUS_DEVICE_CONFIGURATION_ERROR;
+        }
+        FdoData->MetadataSize = format->MS;
+        FdoData->MaxTransferSize = min(FdoData->MaxTransferSize,
+                                       (HW_METADATA_SLOT_SIZE / format->MS) << FdoData->LbaShift);
+    }
+
+    DebugPrint(INFO, DBG_INIT, "NS 1: %I64u blocks of %d bytes, MaxTransfer %d, ACL %d\n",
+               FdoData->NamespaceBlocks, 1 << FdoData->LbaShift,
+               FdoData->MaxTransferSize, FdoData->AbortLimit);
+    DebugPrint(INFO, DBG_INIT, "NS 1: metadata %d bytes%s, PI type %d\n",
+               format->MS, FdoData->PiInsertStrip ? " (extended LBA)" : "",
+               FdoData->PiType);
+    DebugPrint(INFO, DBG_INIT, "Dataset Management %d, Write Zeroes %d\n",
+               FdoData->DsmSupported, FdoData->WriteZeroesSupported);
+    DebugPrint(INFO, DBG_INIT, "Copy %d: %d ranges of %d blocks, %d blocks\n",
+               FdoData->CopySupported, FdoData->CopyMaxRanges,
+               FdoData->CopyMaxRangeBlocks, FdoData->CopyMaxBlocks);
+
+    return HwIdentifyZones(FdoData, ns->FLBAS.LbaFormatIndex);
+}
+
+
+static
+VOID
+HwEnableController(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Points a disabled controller at the admin queue and sets CC.EN. Does
+    not wait; may be called at DISPATCH_LEVEL.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PNVME_CONTROLLER_REGISTERS    regs = FdoData->controller_regs;
+    PHW_QUEUE                     admin = FdoData->AdminQueue;
+    NVME_ADMIN_QUEUE_ATTRIBUTES   aqa;
+    NVME_CONTROLLER_CONFIGURATION cc;
+
+    HwResetQueue(admin);
+
+    aqa.AsUlong = 0;
+    aqa.ASQS = admin->Depth - 1;
+    aqa.ACQS = admin->Depth - 1;
+    HwWriteRegisterULong(&regs->AQA.AsUlong, aqa.AsUlong);
+    HwWriteRegisterULong64(&regs->ASQ.AsUlonglong, admin->SubmissionQueuePhys.QuadPart);
+    HwWriteRegisterULong64(&regs->ACQ.AsUlonglong, admin->CompletionQueuePhys.QuadPart);
+
+    //
+    // Submission queues in the CMB need it enabled at the same address.
+    //
+    HwRestoreControllerMemoryBuffer(FdoData);
+
+    cc.AsUlong = 0;
+    cc.CSS = FdoData->ControllerCaps.CSS_MultipleIo ? HW_CC_CSS_ALL_IO : HW_CC_CSS_NVM;
+    cc.MPS = PAGE_SHIFT - 12;
+    cc.AMS = FdoData->WrrEnabled ? 1 : 0;   // weighted round robin with urgent
+    cc.IOSQES = 6;                      // 64 byte submission entries
+    cc.IOCQES = 4;                      // 16 byte completion entries
+    cc.EN = 1;
+    HwWriteRegisterULong(&regs->CC.AsUlong, cc.AsUlong);
+}
+
+
+static
+NTSTATUS
+HwConfigureController(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Second half of a start, once CSTS.RDY is set: identifies the
+    controller, creates the I/O queues, gives the controller its host
+    memory buffer, sets up the write streams and the asynchronous events
+    and starts the timeout timer.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PHW_QUEUE     admin = FdoData->AdminQueue;
+    LARGE_INTEGER dueTime;
+    NTSTATUS      status;
+
+    FdoData->CompletionDpcsPending = 0;
+    FdoData->AbortsOutstanding = 0;
+    FdoData->ControllerEnabled = TRUE;
+    admin->Created = TRUE;
+
+    status = HwIdentifyController(FdoData);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = HwSetupIoQueues(FdoData);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "HwSetupIoQueues failed 0x%x\n", status);
+        return status;
+    }
+
+    HwEnableHostMemoryBuffer(FdoData);
+
+    HwSetupWriteStreams(FdoData);
+
+    HwSetupAsyncEvents(FdoData);
+
+    //
+    // The steps above that may do without their command still leave it
+    // out if it timed out; the failed start disables the controller.
+    //
+    if (FdoData->SyncCommandTimedOut) {
+        DebugPrint(ERROR, DBG_INIT, "Admin command timed out during start\n");
+        return STATUS_IO_TIMEOUT;
+    }
+
+    dueTime.QuadPart = -10000LL * HW_TIMER_TICK;
+    KeSetTimerEx(&FdoData->TimeoutTimer, dueTime, HW_TIMER_TICK, &FdoData->TimeoutDpc);
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+HwStartController(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Resets the controller, points it at the admin queue, enables it and
+    creates the I/O queues, waiting for each step. Used on resume from D3
+    and by recovery; the first start goes through HwStartControllerAsync.
+    Queue memory allocated earlier is reused. A start that fails leaves
+    the controller disabled.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NTSTATUS status;
+
+    DebugPrint(TRACE, DBG_INIT, "--> HwStartController\n");
+
+    status = HwStopController(FdoData, FALSE);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    HwEnableController(FdoData);
+
+    status = HwWaitForControllerReady(FdoData, TRUE);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Controller enable failed 0x%x\n", status);
+        return status;
+    }
+
+    status = HwConfigureController(FdoData);
+    if (!NT_SUCCESS(status)) {
+        HwStopController(FdoData, FALSE);
+        return status;
+    }
+
+    DebugPrint(TRACE, DBG_INIT, "<-- HwStartController\n");
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+HwQueueStartWorker(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Hands the start over to HwStartControllerWorker. If no work item can
+    be allocated the poll timer simply runs again and retries.
+
+--*/
+{
+    LARGE_INTEGER dueTime;
+
+    FdoData->StartState = HwStartConfigure;
+
+    if (!NT_SUCCESS(PciDrvQueuePassiveLevelCallback(FdoData,
+                                                    HwStartControllerWorker,
+                                                    NULL,
+                                                    NULL))) {
+        dueTime.QuadPart = -10000LL * HW_CONTROLLER_POLL_INTERVAL;
+        KeSetTimer(&FdoData->StartTimer, dueTime, &FdoData->StartDpc);
+    }
+}
+
+
+VOID
+HwStartControllerAsync(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Begins bringing the controller up without waiting for it. CSTS.RDY
+    is polled from a timer DPC, so no thread is tied up for the up to
+    CAP.TO x 500ms the controller may take, and several devices can come
+    up in parallel. Once the controller is ready the remaining admin
+    commands run in a work item, which reports the outcome through
+    PciDrvControllerStartComplete. The start holds an outstanding I/O
+    reference until then, so stop and remove wait for it.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    NVME_CONTROLLER_CONFIGURATION cc;
+    LARGE_INTEGER                 dueTime;
+
+    PAGED_CODE();
+
+    ASSERT(FdoData->StartState == HwStartIdle);
+
+    PciDrvIoIncrement(FdoData);
+    KeClearEvent(&FdoData->StartIdleEvent);
+
+    FdoData->StartCancelled = FALSE;
+    FdoData->StartStatus = STATUS_PENDING;
+    FdoData->StartElapsed = 0;
+    FdoData->StartTime = KeQueryInterruptTime();
+
+    cc.AsUlong = HwReadRegisterULong(&FdoData->controller_regs->CC.AsUlong);
+    if (cc.AsUlong == MAXULONG) {
+        FdoData->StartStatus = STATUS_DEVICE_DOES_NOT_EXIST;
+        HwQueueStartWorker(FdoData);
+        return;
+    }
+
+    if (cc.EN) {
+        cc.EN = 0;
+        cc.SHN = 0;
+        HwWriteRegisterULong(&FdoData->controller_regs->CC.AsUlong, cc.AsUlong);
+        FdoData->StartState = HwStartWaitDisabled;
+    } else {
+        HwEnableController(FdoData);
+        FdoData->StartState = HwStartWaitReady;
+    }
+
+    dueTime.QuadPart = -10000LL * HW_CONTROLLER_POLL_INTERVAL;
+    KeSetTimer(&FdoData->StartTimer, dueTime, &FdoData->StartDpc);
+}
+
+
+VOID
+HwStartDpc(
+    __in     PKDPC Dpc,
+    __in_opt PVOID DeferredContext,
+    __in_opt PVOID SystemArgument1,
+    __in_opt PVOID SystemArgument2
+    )
+/*++
+Routine Description:
+
+    Poll timer of HwStartControllerAsync. Waits for CSTS.RDY to clear,
+    enables the controller, waits for CSTS.RDY to set and then queues
+    the work item that finishes the start.
+
+Arguments:
+
+    Dpc                 Not used
+    DeferredContext     Pointer to our FdoData
+    SystemArgument1/2   Not used
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA              fdoData = (PFDO_DATA)DeferredContext;
+    NVME_CONTROLLER_STATUS csts;
+    LARGE_INTEGER          dueTime;
+    ULONG                  timeout;
+    NTSTATUS               status = STATUS_PENDING;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (fdoData->StartState == HwStartConfigure) {
+        HwQueueStartWorker(fdoData);            // retry a failed work item
+        return;
+    }
+
+    csts.AsUlong = HwReadRegisterULong(&fdoData->controller_regs->CSTS.AsUlong);
+
+    if (fdoData->StartCancelled) {
+        status = STATUS_CANCELLED;
+    } else if (csts.AsUlong == MAXULONG) {
+        status = STATUS_DEVICE_DOES_NOT_EXIST;
+    } else if (fdoData->StartState == HwStartWaitDisabled) {
+        if (!csts.RDY) {
+            HwEnableController(fdoData);
+            fdoData->StartState = HwStartWaitReady;
+            fdoData->StartElapsed = 0;
+        }
+    } else if (csts.CFS) {
+        status = STATUS_IO_DEVICE_ERROR;
+    } else if (csts.RDY) {
+        fdoData->HmbEnabled = FALSE;            // enabled again, so it was reset
+        status = STATUS_SUCCESS;
+    }
+
+    if (status == STATUS_PENDING) {
+        timeout = max(1, (ULONG)fdoData->ControllerCaps.TO) * HW_CONTROLLER_TIMEOUT_UNIT;
+        fdoData->StartElapsed += HW_CONTROLLER_POLL_INTERVAL;
+        if (fdoData->StartElapsed >= timeout) {
+            DebugPrint(ERROR, DBG_INIT, "CSTS.RDY stuck at %d\n", csts.RDY);
+            status = STATUS_IO_TIMEOUT;
+        }
+    }
+
+    if (status == STATUS_PENDING) {
+        dueTime.QuadPart = -10000LL * HW_CONTROLLER_POLL_INTERVAL;
+        KeSetTimer(&fdoData->StartTimer, dueTime, &fdoData->StartDpc);
+        return;
+    }
+
+    fdoData->StartStatus = status;
+    HwQueueStartWorker(fdoData);
+}
+
+
+VOID
+HwStartControllerWorker(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PVOID          Context
+    )
+/*++
+Routine Description:
+
+    Work item that finishes an asynchronous start at PASSIVE_LEVEL and
+    reports the outcome to the PnP layer.
+
+Arguments:
+
+    DeviceObject    Pointer to our device object
+    Context         Work item context
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA            fdoData = (PFDO_DATA)DeviceObject->DeviceExtension;
+    PWORKER_ITEM_CONTEXT workItemContext = Context;
+    NTSTATUS             status;
+
+    PAGED_CODE();
+
+    KeWaitForSingleObject(&fdoData->RecoveryMutex, Executive, KernelMode, FALSE, NULL);
+
+    status = fdoData->StartStatus;
+    if (fdoData->StartCancelled) {
+        status = STATUS_CANCELLED;
+    }
+
+    if (NT_SUCCESS(status)) {
+        status = HwConfigureController(fdoData);
+    }
+
+    fdoData->StartState = HwStartIdle;
+
+    if (!NT_SUCCESS(status) && status != STATUS_CANCELLED) {
+        HwStopController(fdoData, FALSE);
+    }
+
+    fdoData->StartStatus = status;
+
+    KeReleaseMutex(&fdoData->RecoveryMutex, FALSE);
+
+    PciDrvControllerStartComplete(fdoData, status);
+
+    KeSetEvent(&fdoData->StartIdleEvent, IO_NO_INCREMENT, FALSE);
+
+    PciDrvIoDecrement(fdoData);
+
+    IoFreeWorkItem((PIO_WORKITEM)workItemContext->WorkItem);
+    PciDrvFreeToLookaside(&Globals.WorkItemPool, workItemContext);
+}
+
+
+NTSTATUS
+HwStopController(
+    __in PFDO_DATA FdoData,
+    __in BOOLEAN   Shutdown
+    )
+/*++
+Routine Description:
+
+    Disables the controller, optionally after a normal shutdown
+    notification. Afterwards the controller no longer owns any queue and
+    no completion or timeout DPC is left running.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Shutdown    TRUE to notify the controller of a shutdown first
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PNVME_CONTROLLER_REGISTERS    regs = FdoData->controller_regs;
+    NVME_CONTROLLER_CONFIGURATION cc;
+    NVME_CONTROLLER_STATUS        csts;
+    LARGE_INTEGER                 interval;
+    ULONG                         elapsed;
+    ULONG                         timeout;
+    ULONG                         i;
+    NTSTATUS                      status;
+
+    if (regs == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    KeCancelTimer(&FdoData->TimeoutTimer);
+
+    //
+    // An asynchronous start in progress gives up at its next step.
+    //
+    if (FdoData->StartState != HwStartIdle) {
+        FdoData->StartCancelled = TRUE;
+    }
+
+    if (Shutdown && FdoData->ControllerEnabled) {
+
+        cc.AsUlong = HwReadRegisterULong(&regs->CC.AsUlong);
+        cc.SHN = 1;                     // normal shutdown
+        HwWriteRegisterULong(&regs->CC.AsUlong, cc.AsUlong);
+
+        timeout = max(1, (ULONG)FdoData->ControllerCaps.TO) * HW_CONTROLLER_TIMEOUT_UNIT;
+        interval.QuadPart = -10000LL * HW_CONTROLLER_POLL_INTERVAL;
+
+        for (elapsed = 0; elapsed < timeout; elapsed += HW_CONTROLLER_POLL_INTERVAL) {
+            csts.AsUlong = HwReadRegisterULong(&regs->CSTS.AsUlong);
+            if (csts.AsUlong == MAXULONG || csts.SHST == 2) {
+                break;
+            }
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+        }
+    }
+
+    cc.AsUlong = HwReadRegisterULong(&regs->CC.AsUlong);
+    if (cc.AsUlong != MAXULONG && cc.EN) {
+        cc.EN = 0;
+        cc.SHN = 0;
+        HwWriteRegisterULong(&regs->CC.AsUlong, cc.AsUlong);
+    }
+
+    status = HwWaitForControllerReady(FdoData, FALSE);
+
+    FdoData->ControllerEnabled = FALSE;
+    FdoData->IoQueueCount = 0;
+
+    if (FdoData->AdminQueue != NULL) {
+        FdoData->AdminQueue->Created = FALSE;
+    }
+    for (i = 0; i < FdoData->IoQueuesAllocated; i++) {
+        if (FdoData->IoQueues[i] != NULL) {
+            FdoData->IoQueues[i]->Created = FALSE;
+        }
+    }
+
+    KeFlushQueuedDpcs();
+
+    //
+    // A controller that is gone cannot DMA into the queues any more.
+    //
+    if (status == STATUS_DEVICE_DOES_NOT_EXIST) {
+        status = STATUS_SUCCESS;
+    }
+
+    //
+    // Nor into the buffers of commands that timed out, nor into the host
+    // memory buffer; a reset disables it as well.
+    //
+    if (NT_SUCCESS(status)) {
+        FdoData->SyncCommandTimedOut = FALSE;
+        FdoData->HmbEnabled = FALSE;
+    }
+
+    return status;
+}
+
+
 
 
 NTSTATUS
@@ -952,12 +1890,23 @@ Return Value:
     
 #if 1
 		if( PowerDeviceD3 == newPowerState ) {
+			if (FdoData->AdminQueue != NULL) {
+				//
+				// The controller hands the host memory buffer back before
+				// the shutdown; the resume gives it the same chunks again.
+				//
+				HwDisableHostMemoryBuffer(FdoData);
+				status = HwStopController(FdoData, TRUE);
+			}
 			//ғԁSɃItB
 			//LEDۑď
 		//	FdoData->LedSaved = FdoData->CSRAddress->LedState;
 		//	FdoData->CSRAddress->LedState = 0;
 		}
 		else if( PowerDeviceD3 == oldPowerState ) {
+			if (FdoData->AdminQueue != NULL) {
+				status = HwStartController(FdoData);
+			}
 			//SɃItғԁB
 			//LED𕜋
 		//	FdoData->CSRAddress->LedState = FdoData->LedSaved;
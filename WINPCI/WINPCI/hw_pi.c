@@ -0,0 +1,433 @@
+/*++
+
+Module Name:
+
+    hw_pi.c
+
+Abstract:
+
+    Contains the end-to-end data protection of namespaces formatted with
+    protection information (PI) in a separate metadata buffer. The driver
+    generates the 8 byte PI of every block of a write and checks the PI
+    the controller returns with a read, so corruption anywhere between
+    host memory and the media is caught.
+
+    The guard is the CRC16 of T10-DIF (polynomial 0x8BB7). It is folded
+    16 bytes at a time with PCLMULQDQ where the processor has it, and
+    computed eight bytes at a time from tables otherwise.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(_M_AMD64)
+#include <intrin.h>
+#endif
+
+#if defined(EVENT_TRACING)
+#include "hw_pi.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, HwInitializeProtection)
+#endif
+
+#define HW_PI_POLYNOMIAL        0x8BB7
+#define HW_PI_SIZE              8
+
+//
+// Escape values: a block whose application tag (and, for Type 3, whose
+// reference tag) has all bits set is not checked.
+//
+#define HW_PI_APP_TAG_ESCAPE    0xFFFF
+#define HW_PI_REF_TAG_ESCAPE    0xFFFFFFFF
+
+//
+// Table i gives the CRC of a byte followed by i zero bytes.
+//
+static USHORT HwCrc16Table[8][256];
+
+#if defined(_M_AMD64)
+
+static BOOLEAN   HwCrc16UseClmul;
+
+//
+// x^k mod P for the folding distances: one 16 byte block (128, 192) and
+// four blocks (512, 576).
+//
+static ULONGLONG HwCrc16Fold1[2];
+static ULONGLONG HwCrc16Fold4[2];
+
+#endif
+
+
+static
+USHORT
+HwCrc16Table8(
+    __in                  USHORT Crc,
+    __in_bcount(Length)   PUCHAR Buffer,
+    __in                  SIZE_T Length
+    )
+{
+    while (Length >= 8) {
+        Crc ^= (USHORT)((Buffer[0] << 8) | Buffer[1]);
+        Crc = HwCrc16Table[7][Crc >> 8] ^ HwCrc16Table[6][Crc & 0xFF] ^
+              HwCrc16Table[5][Buffer[2]] ^ HwCrc16Table[4][Buffer[3]] ^
+              HwCrc16Table[3][Buffer[4]] ^ HwCrc16Table[2][Buffer[5]] ^
+              HwCrc16Table[1][Buffer[6]] ^ HwCrc16Table[0][Buffer[7]];
+        Buffer += 8;
+        Length -= 8;
+    }
+
+    while (Length-- != 0) {
+        Crc = (USHORT)(Crc << 8) ^ HwCrc16Table[0][(Crc >> 8) ^ *Buffer++];
+    }
+
+    return Crc;
+}
+
+
+#if defined(_M_AMD64)
+
+#define HW_CRC16_LOAD(_p)   _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(_p)), swap)
+
+#define HW_CRC16_FOLD(_x, _k, _next)                            \
+        _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((_x), (_k), 0x01), \
+                                    _mm_clmulepi64_si128((_x), (_k), 0x10)), \
+                      (_next))
+
+static
+USHORT
+HwCrc16Clmul(
+    __in                  USHORT Crc,
+    __in_bcount(Length)   PUCHAR Buffer,
+    __in                  SIZE_T Length
+    )
+/*++
+Routine Description:
+
+    Folds the buffer into 128 bits congruent to it modulo P, four blocks
+    in parallel while at least 64 bytes are left, and finishes the last
+    16 bytes and the tail from the tables. The CRC is not reflected, so
+    every block is byte-swapped to put the first byte in the high bits.
+    Needs at least 32 bytes.
+
+--*/
+{
+    __m128i swap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m128i fold1 = _mm_set_epi64x(HwCrc16Fold1[1], HwCrc16Fold1[0]);
+    __m128i fold4, x0, x1, x2, x3;
+    UCHAR   last[16];
+
+    //
+    // A non-zero starting CRC is the same as xoring it into the first two
+    // bytes of the message.
+    //
+    x0 = _mm_xor_si128(HW_CRC16_LOAD(Buffer), _mm_set_epi64x((ULONGLONG)Crc << 48, 0));
+    Buffer += 16;
+    Length -= 16;
+
+    if (Length >= 64) {
+
+        fold4 = _mm_set_epi64x(HwCrc16Fold4[1], HwCrc16Fold4[0]);
+        x1 = HW_CRC16_LOAD(Buffer);
+        x2 = HW_CRC16_LOAD(Buffer + 16);
+        x3 = HW_CRC16_LOAD(Buffer + 32);
+        Buffer += 48;
+        Length -= 48;
+
+        while (Length >= 64) {
+            x0 = HW_CRC16_FOLD(x0, fold4, HW_CRC16_LOAD(Buffer));
+            x1 = HW_CRC16_FOLD(x1, fold4, HW_CRC16_LOAD(Buffer + 16));
+            x2 = HW_CRC16_FOLD(x2, fold4, HW_CRC16_LOAD(Buffer + 32));
+            x3 = HW_CRC16_FOLD(x3, fold4, HW_CRC16_LOAD(Buffer + 48));
+            Buffer += 64;
+            Length -= 64;
+        }
+
+        x0 = HW_CRC16_FOLD(x0, fold1, x1);
+        x0 = HW_CRC16_FOLD(x0, fold1, x2);
+        x0 = HW_CRC16_FOLD(x0, fold1, x3);
+    }
+
+    while (Length >= 16) {
+        x0 = HW_CRC16_FOLD(x0, fold1, HW_CRC16_LOAD(Buffer));
+        Buffer += 16;
+        Length -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *)last, _mm_shuffle_epi8(x0, swap));
+
+    return HwCrc16Table8(HwCrc16Table8(0, last, sizeof(last)), Buffer, Length);
+}
+
+static
+ULONGLONG
+HwCrc16PowerModP(
+    __in ULONG Power
+    )
+{
+    ULONG remainder = 1;
+
+    while (Power-- != 0) {
+        remainder <<= 1;
+        if (remainder & 0x10000) {
+            remainder ^= 0x10000 | HW_PI_POLYNOMIAL;
+        }
+    }
+
+    return remainder;
+}
+
+#endif
+
+
+USHORT
+HwCrc16(
+    __in                  USHORT Crc,
+    __in_bcount(Length)   PVOID  Buffer,
+    __in                  SIZE_T Length
+    )
+/*++
+Routine Description:
+
+    Continues a T10-DIF CRC16 over a buffer. Start with 0.
+
+Arguments:
+
+    Crc         CRC of the data before Buffer
+    Buffer      Data
+    Length      Bytes in Buffer
+
+Return Value:
+
+    CRC including Buffer
+
+--*/
+{
+#if defined(_M_AMD64)
+    if (HwCrc16UseClmul && Length >= 32) {
+        return HwCrc16Clmul(Crc, (PUCHAR)Buffer, Length);
+    }
+#endif
+
+    return HwCrc16Table8(Crc, (PUCHAR)Buffer, Length);
+}
+
+
+VOID
+HwInitializeProtection(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Builds the CRC tables and picks the CRC kernel for this processor.
+    Called once from DriverEntry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+    USHORT crc;
+    ULONG  i, bit;
+#if defined(_M_AMD64)
+    int    cpuInfo[4];
+#endif
+
+    for (i = 0; i < 256; i++) {
+        crc = (USHORT)(i << 8);
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (USHORT)(crc << 1) ^ HW_PI_POLYNOMIAL : (USHORT)(crc << 1);
+        }
+        HwCrc16Table[0][i] = crc;
+    }
+
+    for (bit = 1; bit < 8; bit++) {
+        for (i = 0; i < 256; i++) {
+            crc = HwCrc16Table[bit - 1][i];
+            HwCrc16Table[bit][i] = (USHORT)(crc << 8) ^ HwCrc16Table[0][crc >> 8];
+        }
+    }
+
+#if defined(_M_AMD64)
+    //
+    // CPUID.1:ECX bit 1 is PCLMULQDQ, bit 9 SSSE3 (PSHUFB). XMM registers
+    // may be used freely in x64 kernel code.
+    //
+    __cpuid(cpuInfo, 1);
+    HwCrc16UseClmul = (BOOLEAN)((cpuInfo[2] & (1 << 1)) && (cpuInfo[2] & (1 << 9)));
+
+    HwCrc16Fold1[0] = HwCrc16PowerModP(192);
+    HwCrc16Fold1[1] = HwCrc16PowerModP(128);
+    HwCrc16Fold4[0] = HwCrc16PowerModP(576);
+    HwCrc16Fold4[1] = HwCrc16PowerModP(512);
+
+    DebugPrint(INFO, DBG_INIT, "PI guard CRC: %s\n",
+               HwCrc16UseClmul ? "PCLMULQDQ" : "table");
+#endif
+}
+
+
+static
+PUCHAR
+HwGetProtectionField(
+    __in PFDO_DATA   FdoData,
+    __in PHW_REQUEST Request,
+    __in ULONG       Block
+    )
+{
+    PUCHAR metadata = Request->Metadata + Block * FdoData->MetadataSize;
+
+    return FdoData->PiFirst ? metadata : metadata + FdoData->MetadataSize - HW_PI_SIZE;
+}
+
+
+static
+USHORT
+HwComputeGuard(
+    __in PFDO_DATA   FdoData,
+    __in PHW_REQUEST Request,
+    __in ULONG       Block
+    )
+/*++
+Routine Description:
+
+    The guard covers the block, and the metadata bytes in front of the PI
+    when the PI is at the end of a larger metadata area.
+
+--*/
+{
+    USHORT crc;
+
+    crc = HwCrc16(0, Request->Data + ((SIZE_T)Block << FdoData->LbaShift),
+                  (SIZE_T)1 << FdoData->LbaShift);
+
+    if (!FdoData->PiFirst && FdoData->MetadataSize > HW_PI_SIZE) {
+        crc = HwCrc16(crc, Request->Metadata + Block * FdoData->MetadataSize,
+                      FdoData->MetadataSize - HW_PI_SIZE);
+    }
+
+    return crc;
+}
+
+
+VOID
+HwGenerateProtection(
+    __in PFDO_DATA   FdoData,
+    __in PHW_REQUEST Request,
+    __in ULONGLONG   Lba,
+    __in ULONG       Blocks
+    )
+/*++
+Routine Description:
+
+    Fills the metadata slot of a write with the PI of its blocks. The
+    application tag is 0; the reference tag is the low 32 bits of the LBA
+    for Types 1 and 2 (whose initial reference tag is set to the same).
+    Fields are big-endian.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Request     Command with Data mapped
+    Lba         First block of the write
+    Blocks      Number of blocks
+
+Return Value:
+
+    None
+
+--*/
+{
+    PUCHAR pi;
+    USHORT guard;
+    ULONG  refTag;
+    ULONG  i;
+
+    RtlZeroMemory(Request->Metadata, Blocks * FdoData->MetadataSize);
+
+    for (i = 0; i < Blocks; i++) {
+
+        pi = HwGetProtectionField(FdoData, Request, i);
+        guard = HwComputeGuard(FdoData, Request, i);
+        refTag = FdoData->PiType == HW_PI_TYPE3 ? 0 : (ULONG)(Lba + i);
+
+        pi[0] = (UCHAR)(guard >> 8);
+        pi[1] = (UCHAR)guard;
+        pi[4] = (UCHAR)(refTag >> 24);
+        pi[5] = (UCHAR)(refTag >> 16);
+        pi[6] = (UCHAR)(refTag >> 8);
+        pi[7] = (UCHAR)refTag;
+    }
+}
+
+
+NTSTATUS
+HwVerifyProtection(
+    __in PFDO_DATA   FdoData,
+    __in PHW_REQUEST Request,
+    __in ULONGLONG   Lba,
+    __in ULONG       Blocks
+    )
+/*++
+Routine Description:
+
+    Checks the PI the controller returned with a read against the data.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Request     Command with Data mapped
+    Lba         First block of the read
+    Blocks      Number of blocks
+
+Return Value:
+
+    STATUS_SUCCESS, or STATUS_CRC_ERROR if a block does not match its PI
+
+--*/
+{
+    PUCHAR pi;
+    USHORT guard, appTag;
+    ULONG  refTag;
+    ULONG  i;
+
+    for (i = 0; i < Blocks; i++) {
+
+        pi = HwGetProtectionField(FdoData, Request, i);
+
+        appTag = (USHORT)((pi[2] << 8) | pi[3]);
+        refTag = ((ULONG)pi[4] << 24) | ((ULONG)pi[5] << 16) |
+                 ((ULONG)pi[6] << 8) | pi[7];
+
+        if (appTag == HW_PI_APP_TAG_ESCAPE &&
+            (FdoData->PiType != HW_PI_TYPE3 || refTag == HW_PI_REF_TAG_ESCAPE)) {
+            continue;
+        }
+
+        guard = (USHORT)((pi[0] << 8) | pi[1]);
+        if (guard != HwComputeGuard(FdoData, Request, i)) {
+            DebugPrint(ERROR, DBG_DPC, "LBA %I64u: guard 0x%04x, data 0x%04x\n",
+                       Lba + i, guard, HwComputeGuard(FdoData, Request, i));
+            return STATUS_CRC_ERROR;
+        }
+
+        if (FdoData->PiType != HW_PI_TYPE3 && refTag != (ULONG)(Lba + i)) {
+            DebugPrint(ERROR, DBG_DPC, "LBA %I64u: reference tag 0x%x\n", Lba + i, refTag);
+            return STATUS_CRC_ERROR;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,2304 @@
+/*++
+
+Module Name:
+
+    hw_queue.c
+
+Abstract:
+
+    Contains routines to allocate NVMe submission/completion queues on
+    the NUMA node of the CPU that owns them, to create the I/O queues on
+    the controller, and to submit and reap commands.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(_M_AMD64)
+#include <intrin.h>
+#endif
+
+#if defined(EVENT_TRACING)
+#include "hw_queue.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwAllocateNodeMemory)
+#pragma alloc_text (PAGE, HwAllocateQueue)
+#pragma alloc_text (PAGE, HwFreeQueue)
+#pragma alloc_text (PAGE, HwFreeQueues)
+#pragma alloc_text (PAGE, HwAllocateDmaArena)
+#pragma alloc_text (PAGE, HwFreeDmaArena)
+#endif
+
+
+static
+USHORT
+HwGetProcessorNode(
+    __in PPROCESSOR_NUMBER Processor
+    )
+/*++
+Routine Description:
+
+    Returns the NUMA node a logical processor belongs to.
+
+Arguments:
+
+    Processor   Group relative number of the processor
+
+Return Value:
+
+    Node number or HW_NODE_UNKNOWN
+
+--*/
+{
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX info[2];
+    ULONG                                   length = sizeof(info);
+
+    if (!NT_SUCCESS(KeQueryLogicalProcessorRelationship(Processor,
+                                                        RelationNumaNode,
+                                                        info,
+                                                        &length))) {
+        return HW_NODE_UNKNOWN;
+    }
+
+    return (USHORT)info[0].NumaNode.NodeNumber;
+}
+
+
+PVOID
+HwAllocateNodeMemory(
+    __in  SIZE_T            Size,
+    __in  USHORT            Node,
+    __out PPHYSICAL_ADDRESS PhysicalAddress
+    )
+/*++
+Routine Description:
+
+    Allocates zeroed, physically contiguous memory preferably from the
+    given NUMA node. Any node is accepted when the preferred one is out
+    of memory.
+
+Arguments:
+
+    Size             Number of bytes
+    Node             Preferred node or HW_NODE_UNKNOWN
+    PhysicalAddress  Receives the physical address of the allocation
+
+Return Value:
+
+    Virtual address or NULL
+
+--*/
+{
+    PHYSICAL_ADDRESS lowest, highest, boundary;
+    PVOID            va;
+
+    PAGED_CODE();
+
+    lowest.QuadPart = 0;
+    highest.QuadPart = -1;
+    boundary.QuadPart = 0;
+
+    va = MmAllocateContiguousNodeMemory(Size,
+                                        lowest,
+                                        highest,
+                                        boundary,
+                                        PAGE_READWRITE,
+                                        (Node == HW_NODE_UNKNOWN) ?
+                                            MM_ANY_NODE_OK :
+                                            (Node | MM_ANY_NODE_OK));
+    if (va == NULL) {
+        DebugPrint(ERROR, DBG_INIT,
+                   "MmAllocateContiguousNodeMemory(%Iu, node %d) failed\n",
+                   Size, Node);
+        return NULL;
+    }
+
+    RtlZeroMemory(va, Size);
+    *PhysicalAddress = MmGetPhysicalAddress(va);
+
+    return va;
+}
+
+
+NTSTATUS
+HwAllocateQueue(
+    __in  PFDO_DATA  FdoData,
+    __in  USHORT     QueueId,
+    __in  USHORT     Depth,
+    __in  ULONG      ProcessorIndex,
+    __out PHW_QUEUE *Queue
+    )
+/*++
+Routine Description:
+
+    Allocates a queue pair together with its PRP pool and command
+    contexts. The memory is placed on the node of the owning processor,
+    or on the node of the device for the admin queue, when the owner
+    cannot be resolved or when the registry asks for device placement.
+    The completion DPC of an owned queue is targeted at the owner.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    QueueId         NVMe queue identifier
+    Depth           Number of entries of both rings
+    ProcessorIndex  Owning processor or HW_PROCESSOR_NONE
+    Queue           Receives the queue
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PHW_QUEUE           queue;
+    PROCESSOR_NUMBER    processor;
+    PHYSICAL_ADDRESS    physical;
+    USHORT              processorNode = HW_NODE_UNKNOWN;
+    USHORT              node;
+    ULONG               i;
+
+    PAGED_CODE();
+
+    *Queue = NULL;
+    RtlZeroMemory(&processor, sizeof(processor));
+
+    if (ProcessorIndex != HW_PROCESSOR_NONE &&
+        NT_SUCCESS(KeGetProcessorNumberFromIndex(ProcessorIndex, &processor))) {
+        processorNode = HwGetProcessorNode(&processor);
+    }
+
+    if (processorNode == HW_NODE_UNKNOWN ||
+        FdoData->QueueNodePlacement == HW_NODE_PLACEMENT_DEVICE) {
+        node = FdoData->DeviceNode;
+    } else {
+        node = processorNode;
+    }
+
+    queue = HwAllocateNodeMemory(sizeof(HW_QUEUE) +
+                                     Depth * (sizeof(HW_REQUEST) + sizeof(USHORT)),
+                                 node,
+                                 &physical);
+    if (queue == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    queue->FdoData = FdoData;
+    queue->QueueId = QueueId;
+    queue->Depth = Depth;
+    queue->ProcessorIndex = ProcessorIndex;
+    queue->Processor = processor;
+    queue->ProcessorNode = processorNode;
+    queue->NodeNumber = node;
+    queue->Requests = (PHW_REQUEST)(queue + 1);
+    queue->FreeIds = (PUSHORT)(queue->Requests + Depth);
+
+    KeInitializeSpinLock(&queue->SubmissionLock);
+    KeInitializeSpinLock(&queue->CompletionLock);
+
+    //
+    // I/O submission queues go to the controller memory buffer while it
+    // has room.
+    //
+    if (QueueId != HW_ADMIN_QUEUE_ID) {
+        queue->SubmissionQueue = HwAllocateCmbQueue(FdoData,
+                                                    Depth * sizeof(NVME_COMMAND),
+                                                    &queue->SubmissionQueuePhys);
+        queue->SubmissionInCmb = (BOOLEAN)(queue->SubmissionQueue != NULL);
+    }
+    if (queue->SubmissionQueue == NULL) {
+        queue->SubmissionQueue = HwAllocateNodeMemory(Depth * sizeof(NVME_COMMAND),
+                                                      node,
+                                                      &queue->SubmissionQueuePhys);
+    }
+    queue->CompletionQueue = HwAllocateNodeMemory(Depth * sizeof(NVME_COMPLETION_ENTRY),
+                                                  node,
+                                                  &queue->CompletionQueuePhys);
+    queue->PrpPool = HwAllocateNodeMemory(Depth * HW_PRP_LIST_SIZE,
+                                          node,
+                                          &queue->PrpPoolPhys);
+
+    if (FdoData->MetadataSize != 0) {
+        queue->MetadataPool = HwAllocateNodeMemory(Depth * HW_METADATA_SLOT_SIZE,
+                                                   node,
+                                                   &queue->MetadataPoolPhys);
+    }
+
+    if (queue->SubmissionQueue == NULL ||
+        queue->CompletionQueue == NULL ||
+        queue->PrpPool == NULL ||
+        (FdoData->MetadataSize != 0 && queue->MetadataPool == NULL)) {
+        HwFreeQueue(queue);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // Each command id owns a fixed PRP list slot; slots never straddle a
+    // page because HW_PRP_LIST_SIZE divides PAGE_SIZE.
+    //
+    for (i = 0; i < Depth; i++) {
+        queue->Requests[i].CommandId = (USHORT)i;
+        queue->Requests[i].PrpList =
+            (PULONGLONG)((PUCHAR)queue->PrpPool + i * HW_PRP_LIST_SIZE);
+        queue->Requests[i].PrpListPhys.QuadPart =
+            queue->PrpPoolPhys.QuadPart + i * HW_PRP_LIST_SIZE;
+        if (queue->MetadataPool != NULL) {
+            queue->Requests[i].Metadata =
+                (PUCHAR)queue->MetadataPool + i * HW_METADATA_SLOT_SIZE;
+            queue->Requests[i].MetadataPhys.QuadPart =
+                queue->MetadataPoolPhys.QuadPart + i * HW_METADATA_SLOT_SIZE;
+        }
+    }
+
+    queue->SubmissionDoorbell = (PULONG)((PUCHAR)FdoData->controller_regs +
+                                         HW_DOORBELL_OFFSET +
+                                         (2 * QueueId) * FdoData->DoorbellStride);
+    queue->CompletionDoorbell = (PULONG)((PUCHAR)FdoData->controller_regs +
+                                         HW_DOORBELL_OFFSET +
+                                         (2 * QueueId + 1) * FdoData->DoorbellStride);
+
+    KeInitializeDpc(&queue->CompletionDpc, HwCompletionDpc, queue);
+    if (processorNode != HW_NODE_UNKNOWN) {
+        KeSetTargetProcessorDpcEx(&queue->CompletionDpc, &processor);
+    }
+
+    HwResetQueue(queue);
+
+    DebugPrint(INFO, DBG_INIT,
+               "Queue %d: depth %d, cpu %d (node %d), memory on node %d%s\n",
+               QueueId, Depth, (LONG)ProcessorIndex, processorNode, node,
+               queue->SubmissionInCmb ? ", SQ in CMB" : "");
+
+    *Queue = queue;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+HwFreeQueue(
+    __in PHW_QUEUE Queue
+    )
+/*++
+Routine Description:
+
+    Frees the memory of a queue. The controller must no longer own it.
+
+Arguments:
+
+    Queue       Queue to free
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    ASSERT(!Queue->Created);
+
+    //
+    // A ring in the CMB goes away with the mapping of the CMB.
+    //
+    if (Queue->SubmissionQueue != NULL && !Queue->SubmissionInCmb) {
+        MmFreeContiguousMemory(Queue->SubmissionQueue);
+    }
+    if (Queue->CompletionQueue != NULL) {
+        MmFreeContiguousMemory(Queue->CompletionQueue);
+    }
+    if (Queue->PrpPool != NULL) {
+        MmFreeContiguousMemory(Queue->PrpPool);
+    }
+    if (Queue->MetadataPool != NULL) {
+        MmFreeContiguousMemory(Queue->MetadataPool);
+    }
+
+    MmFreeContiguousMemory(Queue);
+}
+
+
+VOID
+HwFreeQueues(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Frees the admin queue, the I/O queues and the processor map.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (FdoData->IoQueues != NULL) {
+        for (i = 0; i < FdoData->IoQueuesAllocated; i++) {
+            if (FdoData->IoQueues[i] != NULL) {
+                HwFreeQueue(FdoData->IoQueues[i]);
+            }
+        }
+        ExFreePoolWithTag(FdoData->IoQueues, PCIDRV_POOL_TAG);
+        FdoData->IoQueues = NULL;
+    }
+    FdoData->IoQueuesAllocated = 0;
+    FdoData->IoQueueCount = 0;
+
+    if (FdoData->ProcessorQueueMap != NULL) {
+        ExFreePoolWithTag(FdoData->ProcessorQueueMap, PCIDRV_POOL_TAG);
+        FdoData->ProcessorQueueMap = NULL;
+    }
+    FdoData->ProcessorQueueMapSize = 0;
+
+    if (FdoData->AdminQueue != NULL) {
+        HwFreeQueue(FdoData->AdminQueue);
+        FdoData->AdminQueue = NULL;
+    }
+
+    if (FdoData->ShadowDoorbells != NULL) {
+        HwFreeArenaPages(FdoData, FdoData->ShadowDoorbells, 1);
+        HwFreeArenaPages(FdoData, FdoData->EventIndexes, 1);
+        FdoData->ShadowDoorbells = NULL;
+        FdoData->EventIndexes = NULL;
+    }
+
+    HwFreeDmaArena(FdoData);
+}
+
+
+NTSTATUS
+HwAllocateDmaArena(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Allocates the DMA arena on the node of the device, unless it exists
+    already, and marks all of its pages free.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PHW_DMA_ARENA arena = &FdoData->DmaArena;
+
+    PAGED_CODE();
+
+    if (arena->Base != NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    KeInitializeSpinLock(&arena->Lock);
+
+    arena->Base = HwAllocateNodeMemory(HW_DMA_ARENA_PAGES * PAGE_SIZE,
+                                       FdoData->DeviceNode,
+                                       &arena->BasePhys);
+    if (arena->Base == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    arena->FreeMap = MAXULONGLONG;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+HwFreeDmaArena(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Frees the DMA arena. Every page must have been freed.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PHW_DMA_ARENA arena = &FdoData->DmaArena;
+
+    PAGED_CODE();
+
+    if (arena->Base == NULL) {
+        return;
+    }
+
+    MmFreeContiguousMemory(arena->Base);
+    arena->Base = NULL;
+    arena->FreeMap = 0;
+}
+
+
+PUCHAR
+HwAllocateArenaPages(
+    __in  PFDO_DATA         FdoData,
+    __in  ULONG             Pages,
+    __out PPHYSICAL_ADDRESS PhysicalAddress
+    )
+/*++
+Routine Description:
+
+    Takes the lowest run of free contiguous pages off the DMA arena.
+
+Arguments:
+
+    FdoData          Pointer to our FdoData
+    Pages            Number of pages, 1 to HW_DMA_ARENA_PAGES / 2
+    PhysicalAddress  Receives the physical address of the run
+
+Return Value:
+
+    Virtual address of the run, or NULL if no run that long is free
+
+--*/
+{
+    PHW_DMA_ARENA arena = &FdoData->DmaArena;
+    ULONGLONG     mask = ((1ULL << Pages) - 1);
+    ULONG         page;
+    KIRQL         oldIrql;
+
+    ASSERT(Pages != 0 && Pages <= HW_DMA_ARENA_PAGES / 2);
+
+    KeAcquireSpinLock(&arena->Lock, &oldIrql);
+
+    for (page = 0; page + Pages <= HW_DMA_ARENA_PAGES; page++) {
+        if ((arena->FreeMap & (mask << page)) == (mask << page)) {
+            break;
+        }
+    }
+
+    if (arena->Base == NULL || page + Pages > HW_DMA_ARENA_PAGES) {
+        KeReleaseSpinLock(&arena->Lock, oldIrql);
+        return NULL;
+    }
+
+    arena->FreeMap &= ~(mask << page);
+
+    KeReleaseSpinLock(&arena->Lock, oldIrql);
+
+    PhysicalAddress->QuadPart = arena->BasePhys.QuadPart + (LONGLONG)page * PAGE_SIZE;
+
+    return arena->Base + page * PAGE_SIZE;
+}
+
+
+VOID
+HwFreeArenaPages(
+    __in PFDO_DATA FdoData,
+    __in PUCHAR    Buffer,
+    __in ULONG     Pages
+    )
+/*++
+Routine Description:
+
+    Returns a run of pages to the DMA arena.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Buffer      Run from HwAllocateArenaPages
+    Pages       Its number of pages
+
+Return Value:
+
+    None
+
+--*/
+{
+    PHW_DMA_ARENA arena = &FdoData->DmaArena;
+    ULONG         page = (ULONG)((Buffer - arena->Base) / PAGE_SIZE);
+    KIRQL         oldIrql;
+
+    KeAcquireSpinLock(&arena->Lock, &oldIrql);
+    arena->FreeMap |= ((1ULL << Pages) - 1) << page;
+    KeReleaseSpinLock(&arena->Lock, oldIrql);
+}
+
+
+VOID
+HwResetQueue(
+    __in PHW_QUEUE Queue
+    )
+/*++
+Routine Description:
+
+    Returns the ring indices to their power-on values before the queue is
+    (re)created on the controller and puts every command id back on the
+    free stack. No command may be outstanding; arena runs still held by
+    ids whose waiter gave up on them are freed.
+
+Arguments:
+
+    Queue       Queue to reset
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    PHW_REQUEST request;
+    USHORT      ids = HW_QUEUE_COMMAND_IDS(Queue);
+
+    Queue->SubmissionTail = 0;
+    Queue->SubmissionHead = 0;
+    Queue->CompletionHead = 0;
+    Queue->CompletionPhase = 1;
+
+    RtlZeroMemory(Queue->CompletionQueue,
+                  Queue->Depth * sizeof(NVME_COMPLETION_ENTRY));
+
+    for (i = 0; i < Queue->Depth; i++) {
+        request = &Queue->Requests[i];
+        if (request->ArenaBuffer != NULL) {
+            HwFreeArenaPages(Queue->FdoData, request->ArenaBuffer, request->ArenaPages);
+            request->ArenaBuffer = NULL;
+        }
+        request->Irp = NULL;
+        request->Event = NULL;
+        request->Result = NULL;
+        request->InUse = FALSE;
+        request->AbortIssued = FALSE;
+        request->AbortCommand = FALSE;
+        request->TimedOut = FALSE;
+        InitializeListHead(&request->TimerLink);
+    }
+
+    HwResetTimerWheel(Queue);
+
+    //
+    // Lowest ids on top, so that a lightly loaded queue keeps reusing the
+    // same few contexts and PRP slots.
+    //
+    Queue->FreeCount = ids;
+    for (i = 0; i < ids; i++) {
+        Queue->FreeIds[i] = (USHORT)(ids - 1 - i);
+    }
+}
+
+
+static
+NTSTATUS
+HwCreateIoQueue(
+    __in PFDO_DATA FdoData,
+    __in PHW_QUEUE Queue
+    )
+/*++
+Routine Description:
+
+    Creates the completion queue and then the submission queue of an
+    I/O queue pair on the controller. All completion queues use
+    interrupt vector 0.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Queue       Queue pair to create
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NVME_COMMAND command;
+    NTSTATUS     status;
+
+    HwResetQueue(Queue);
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_CREATE_IO_CQ;
+    command.PRP1 = Queue->CompletionQueuePhys.QuadPart;
+    command.u.GENERAL.CDW10 = ((ULONG)(Queue->Depth - 1) << 16) | Queue->QueueId;
+    command.u.GENERAL.CDW11 = BIT_1 | BIT_0;    // IEN, PC
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Create I/O CQ %d failed 0x%x\n",
+                   Queue->QueueId, status);
+        return status;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_CREATE_IO_SQ;
+    command.PRP1 = Queue->SubmissionQueuePhys.QuadPart;
+    command.u.GENERAL.CDW10 = ((ULONG)(Queue->Depth - 1) << 16) | Queue->QueueId;
+    command.u.GENERAL.CDW11 = ((ULONG)Queue->QueueId << 16) |          // CQID
+                              ((ULONG)Queue->Priority << 1) |          // QPRIO
+                              BIT_0;                                   // PC
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Create I/O SQ %d failed 0x%x\n",
+                   Queue->QueueId, status);
+        return status;
+    }
+
+    Queue->Created = TRUE;
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+HwSetupShadowDoorbells(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Queues
+    )
+/*++
+Routine Description:
+
+    Points the controller at the shadow doorbell and event index pages
+    and the first Queues I/O queues at their slots in them, if shadow
+    doorbells are supported and asked for. Called at every start before
+    the I/O queues are created, since a controller reset forgets the
+    pages; the shadow values start at 0 like the queues themselves.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Queues      Number of I/O queues about to be created
+
+Return Value:
+
+    None
+
+--*/
+{
+    NVME_COMMAND command;
+    PHW_QUEUE    queue;
+    ULONG        offset;
+    ULONG        i;
+    NTSTATUS     status;
+
+    FdoData->ShadowDoorbellsEnabled = FALSE;
+
+    for (i = 0; i < FdoData->IoQueuesAllocated; i++) {
+        queue = FdoData->IoQueues[i];
+        queue->SubmissionShadow = NULL;
+        queue->SubmissionEventIndex = NULL;
+        queue->CompletionShadow = NULL;
+        queue->CompletionEventIndex = NULL;
+    }
+
+    if (FdoData->Parameters.ShadowDoorbells == 0 ||
+        !FdoData->DoorbellBufferSupported ||
+        (2 * Queues + 2) * FdoData->DoorbellStride > PAGE_SIZE) {
+        return;
+    }
+
+    if (FdoData->ShadowDoorbells == NULL) {
+        FdoData->ShadowDoorbells = HwAllocateArenaPages(FdoData, 1,
+                                                        &FdoData->ShadowDoorbellsPhys);
+        FdoData->EventIndexes = HwAllocateArenaPages(FdoData, 1,
+                                                     &FdoData->EventIndexesPhys);
+        if (FdoData->ShadowDoorbells == NULL || FdoData->EventIndexes == NULL) {
+            if (FdoData->ShadowDoorbells != NULL) {
+                HwFreeArenaPages(FdoData, FdoData->ShadowDoorbells, 1);
+                FdoData->ShadowDoorbells = NULL;
+            }
+            if (FdoData->EventIndexes != NULL) {
+                HwFreeArenaPages(FdoData, FdoData->EventIndexes, 1);
+                FdoData->EventIndexes = NULL;
+            }
+            return;
+        }
+    }
+
+    RtlZeroMemory(FdoData->ShadowDoorbells, PAGE_SIZE);
+    RtlZeroMemory(FdoData->EventIndexes, PAGE_SIZE);
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = HW_ADMIN_COMMAND_DOORBELL_BUFFER_CONFIG;
+    command.PRP1 = FdoData->ShadowDoorbellsPhys.QuadPart;
+    command.PRP2 = FdoData->EventIndexesPhys.QuadPart;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Doorbell Buffer Config failed 0x%x\n", status);
+        return;
+    }
+
+    for (i = 0; i < Queues; i++) {
+        queue = FdoData->IoQueues[i];
+        offset = 2 * queue->QueueId * FdoData->DoorbellStride;
+        queue->SubmissionShadow = (PULONG)(FdoData->ShadowDoorbells + offset);
+        queue->SubmissionEventIndex = (PULONG)(FdoData->EventIndexes + offset);
+        offset += FdoData->DoorbellStride;
+        queue->CompletionShadow = (PULONG)(FdoData->ShadowDoorbells + offset);
+        queue->CompletionEventIndex = (PULONG)(FdoData->EventIndexes + offset);
+    }
+
+    FdoData->ShadowDoorbellsEnabled = TRUE;
+
+    DebugPrint(INFO, DBG_INIT, "Shadow doorbells for %d I/O queues\n", Queues);
+}
+
+
+static
+NTSTATUS
+HwBuildProcessorQueueMap(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Maps every possible processor index to the I/O queue it submits on,
+    once per priority class. Within the queues of a class a processor
+    uses the queue it owns; otherwise it is spread over the queues whose
+    owners share its NUMA node, and only when its node has no queue at
+    all does it fall back to a remote one.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PROCESSOR_NUMBER processor;
+    USHORT           node;
+    ULONG            cpu, q, matches, pick;
+    ULONG            cls, first, stride, count;
+    PUSHORT          map;
+    USHORT           queue;
+
+    if (FdoData->ProcessorQueueMap == NULL) {
+        FdoData->ProcessorQueueMapSize =
+            KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+        FdoData->ProcessorQueueMap = ExAllocatePoolWithTag(
+                                        NonPagedPool,
+                                        HW_PRIORITY_CLASSES *
+                                        FdoData->ProcessorQueueMapSize * sizeof(USHORT),
+                                        PCIDRV_POOL_TAG);
+        if (FdoData->ProcessorQueueMap == NULL) {
+            FdoData->ProcessorQueueMapSize = 0;
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    for (cls = 0; cls < FdoData->PriorityClasses; cls++) {
+
+        //
+        // Queue i belongs to class i % PriorityClasses. A class left
+        // without a queue (fewer granted on a restart) uses all of them.
+        //
+        first = cls;
+        stride = FdoData->PriorityClasses;
+        if (first >= FdoData->IoQueueCount) {
+            first = 0;
+            stride = 1;
+        }
+        count = (FdoData->IoQueueCount - first + stride - 1) / stride;
+
+        map = &FdoData->ProcessorQueueMap[cls * FdoData->ProcessorQueueMapSize];
+
+        for (cpu = 0; cpu < FdoData->ProcessorQueueMapSize; cpu++) {
+
+            queue = (USHORT)(first + stride * (cpu % count));
+
+            if (NT_SUCCESS(KeGetProcessorNumberFromIndex(cpu, &processor))) {
+
+                node = HwGetProcessorNode(&processor);
+                matches = 0;
+
+                for (q = first; q < FdoData->IoQueueCount; q += stride) {
+                    if (FdoData->IoQueues[q]->ProcessorIndex == cpu) {
+                        break;
+                    }
+                    if (FdoData->IoQueues[q]->ProcessorNode == node) {
+                        matches++;
+                    }
+                }
+
+                if (q < FdoData->IoQueueCount) {
+                    queue = (USHORT)q;
+                } else if (matches != 0) {
+                    pick = cpu % matches;
+                    for (q = first; q < FdoData->IoQueueCount; q += stride) {
+                        if (FdoData->IoQueues[q]->ProcessorNode == node &&
+                            pick-- == 0) {
+                            queue = (USHORT)q;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            map[cpu] = queue;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+HwSetupIoQueues(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Negotiates the number of I/O queues, allocates them on first use and
+    creates them on the controller. One queue per active processor and
+    priority class is requested; owners are spread evenly over the
+    processor indices so that every node gets its share when the
+    controller grants fewer. Without weighted round robin there is one
+    class and the lower priorities get a reserve on the shared queues.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NVME_COMMAND          command;
+    NVME_COMPLETION_ENTRY completion;
+    ULONG                 processors;
+    ULONG                 requested;
+    ULONG                 granted;
+    ULONG                 classes;
+    ULONG                 perClass;
+    ULONG                 i;
+    USHORT                ids;
+    NTSTATUS              status;
+
+    processors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    classes = FdoData->WrrEnabled ? HW_PRIORITY_CLASSES : 1;
+
+    if (FdoData->IoQueues != NULL) {
+        requested = FdoData->IoQueuesAllocated;
+    } else {
+        requested = min(processors * classes, HW_MAX_IO_QUEUES);
+
+        //
+        // Every queue pair needs two doorbells inside the mapped BAR.
+        //
+        granted = (FdoData->RegisterLength - HW_DOORBELL_OFFSET) /
+                  (2 * FdoData->DoorbellStride);
+        if (granted <= 1) {
+            return STATUS_DEVICE_CONFIGURATION_ERROR;
+        }
+        requested = min(requested, granted - 1);
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_SET_FEATURES;
+    command.u.GENERAL.CDW10 = NVME_FEATURE_NUMBER_OF_QUEUES;
+    command.u.GENERAL.CDW11 = ((requested - 1) << 16) | (requested - 1);
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, &completion);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Set Features (Number of Queues) failed 0x%x\n",
+                   status);
+        return status;
+    }
+
+    granted = min((completion.DW0 & 0xFFFF) + 1, (completion.DW0 >> 16) + 1);
+    granted = min(granted, requested);
+
+    DebugPrint(INFO, DBG_INIT, "I/O queues: requested %d, granted %d\n",
+               requested, granted);
+
+    if (FdoData->WrrEnabled) {
+        RtlZeroMemory(&command, sizeof(command));
+        command.CDW0.OPC = NVME_ADMIN_COMMAND_SET_FEATURES;
+        command.u.GENERAL.CDW10 = NVME_FEATURE_ARBITRATION;
+        command.u.GENERAL.CDW11 = ((HW_WRR_HIGH_WEIGHT - 1) << 24) |
+                                  ((HW_WRR_MEDIUM_WEIGHT - 1) << 16) |
+                                  ((HW_WRR_LOW_WEIGHT - 1) << 8) |
+                                  HW_WRR_ARBITRATION_BURST;
+
+        status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(ERROR, DBG_INIT, "Set Features (Arbitration) failed 0x%x\n",
+                       status);
+        }
+    }
+
+    if (FdoData->IoQueues == NULL) {
+
+        //
+        // Queue i serves class i % PriorityClasses. With fewer queues than
+        // classes they are all shared (and all urgent, which under
+        // weighted round robin is plain round robin among them).
+        //
+        FdoData->PriorityClasses = granted >= classes ? classes : 1;
+        granted -= granted % FdoData->PriorityClasses;
+        perClass = granted / FdoData->PriorityClasses;
+
+        status = HwAllocateDmaArena(FdoData);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        if (FdoData->Parameters.CmbQueues != 0) {
+            HwMapControllerMemoryBuffer(FdoData, granted, FdoData->IoQueueDepth);
+        }
+
+        FdoData->IoQueues = ExAllocatePoolWithTag(NonPagedPool,
+                                                  granted * sizeof(PHW_QUEUE),
+                                                  PCIDRV_POOL_TAG);
+        if (FdoData->IoQueues == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(FdoData->IoQueues, granted * sizeof(PHW_QUEUE));
+        FdoData->IoQueuesAllocated = granted;
+
+        for (i = 0; i < granted; i++) {
+            status = HwAllocateQueue(FdoData,
+                                     (USHORT)(i + 1),
+                                     (USHORT)FdoData->IoQueueDepth,
+                                     ((i / FdoData->PriorityClasses) * processors) / perClass,
+                                     &FdoData->IoQueues[i]);
+            if (!NT_SUCCESS(status)) {
+                return status;
+            }
+            if (FdoData->PriorityClasses > 1) {
+                FdoData->IoQueues[i]->Priority = (UCHAR)(i % FdoData->PriorityClasses);
+            }
+        }
+    }
+
+    HwSetupShadowDoorbells(FdoData, granted);
+
+    FdoData->IoQueueCount = 0;
+    for (i = 0; i < granted; i++) {
+        status = HwCreateIoQueue(FdoData, FdoData->IoQueues[i]);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+        FdoData->IoQueueCount++;
+    }
+
+    RtlZeroMemory(FdoData->PriorityReserve, sizeof(FdoData->PriorityReserve));
+    if (FdoData->PriorityClasses == 1) {
+        ids = HW_QUEUE_COMMAND_IDS(FdoData->IoQueues[0]);
+        FdoData->PriorityReserve[PCIDRV_PRIORITY_HIGH] = ids * HW_RESERVE_HIGH / 16;
+        FdoData->PriorityReserve[PCIDRV_PRIORITY_MEDIUM] = ids * HW_RESERVE_MEDIUM / 16;
+        FdoData->PriorityReserve[PCIDRV_PRIORITY_LOW] = ids * HW_RESERVE_LOW / 16;
+    }
+
+    return HwBuildProcessorQueueMap(FdoData);
+}
+
+
+PHW_REQUEST
+HwAllocateRequest(
+    __in PHW_QUEUE Queue,
+    __in USHORT    Reserve
+    )
+/*++
+Routine Description:
+
+    Pops a command id off the free stack of a queue, as long as more than
+    Reserve ids are left for higher priority requests. The caller fills in
+    Irp or Event/Result and Information before submitting.
+
+Arguments:
+
+    Queue       Queue to allocate from
+    Reserve     Ids that must stay free, 0 to allow the last one
+
+Return Value:
+
+    Command context or NULL if every id is in use
+
+--*/
+{
+    PHW_REQUEST request = NULL;
+    KIRQL       oldIrql;
+
+    KeAcquireSpinLock(&Queue->SubmissionLock, &oldIrql);
+
+    if (Queue->FreeCount > Reserve) {
+        if (Queue->FreeCount == HW_QUEUE_COMMAND_IDS(Queue)) {
+            Queue->LastProgress = KeQueryInterruptTime();
+        }
+        request = &Queue->Requests[Queue->FreeIds[--Queue->FreeCount]];
+        request->InUse = TRUE;
+        request->Generation++;
+        request->Information = 0;
+        request->VerifyProtection = FALSE;
+        request->ZoneAppend = FALSE;
+        request->AsyncEvent = FALSE;
+    }
+
+    KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+
+    return request;
+}
+
+
+static
+VOID
+HwPushFreeRequest(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request
+    )
+/*++
+Routine Description:
+
+    Returns a command id to the free stack. Called with the submission
+    lock held.
+
+--*/
+{
+    HwDisarmRequestTimeout(Request);
+
+    if (Request->ArenaBuffer != NULL) {
+        HwFreeArenaPages(Queue->FdoData, Request->ArenaBuffer, Request->ArenaPages);
+        Request->ArenaBuffer = NULL;
+    }
+
+    Request->Irp = NULL;
+    Request->Event = NULL;
+    Request->Result = NULL;
+    Request->InUse = FALSE;
+    Request->AbortIssued = FALSE;
+    Request->AbortCommand = FALSE;
+    Request->TimedOut = FALSE;
+
+    Queue->FreeIds[Queue->FreeCount++] = Request->CommandId;
+}
+
+
+VOID
+HwFreeRequest(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request
+    )
+/*++
+Routine Description:
+
+    Returns a command id that was allocated but never submitted.
+
+Arguments:
+
+    Queue       Queue the id belongs to
+    Request     Command context
+
+Return Value:
+
+    None
+
+--*/
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Queue->SubmissionLock, &oldIrql);
+    HwPushFreeRequest(Queue, Request);
+    KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+}
+
+
+static
+FORCEINLINE
+VOID
+HwRingDoorbell(
+    __in    PULONG          Doorbell,
+    __in    volatile ULONG *Shadow,
+    __in    volatile ULONG *EventIndex,
+    __in    USHORT          Value,
+    __inout PULONGLONG      Writes
+    )
+/*++
+Routine Description:
+
+    Moves a tail or head doorbell to Value. With a shadow doorbell the
+    value goes to the shadow, and the register is only written if the
+    controller's event index lies between the old value and the new one,
+    i.e. if the controller stopped polling the shadow and waits for the
+    register. The fence orders the shadow write before the event index
+    read, or both sides could miss the other.
+
+--*/
+{
+    USHORT old;
+    USHORT eventIndex;
+
+    if (Shadow != NULL) {
+        old = (USHORT)*Shadow;
+        KeMemoryBarrier();
+        *Shadow = Value;
+        KeMemoryBarrier();
+        eventIndex = (USHORT)*EventIndex;
+        if ((USHORT)(Value - eventIndex - 1) >= (USHORT)(Value - old)) {
+            return;
+        }
+    }
+
+    HwWriteRegisterULong(Doorbell, Value);
+    (*Writes)++;
+}
+
+
+static
+FORCEINLINE
+VOID
+HwCopyCommandToCmb(
+    __out PNVME_COMMAND Entry,
+    __in  PNVME_COMMAND Command
+    )
+/*++
+Routine Description:
+
+    Copies a command into a submission queue entry in the controller
+    memory buffer, which is mapped write-combined: the entry is written
+    as whole 16 byte stores, which the processor merges into a single
+    64 byte burst over the bus, and the fence makes the burst go out
+    before the doorbell write that follows.
+
+--*/
+{
+#if defined(_M_AMD64)
+    __m128i *source = (__m128i *)Command;
+    __m128i *target = (__m128i *)Entry;
+
+    C_ASSERT(sizeof(NVME_COMMAND) == 4 * sizeof(__m128i));
+
+    _mm_stream_si128(&target[0], _mm_loadu_si128(&source[0]));
+    _mm_stream_si128(&target[1], _mm_loadu_si128(&source[1]));
+    _mm_stream_si128(&target[2], _mm_loadu_si128(&source[2]));
+    _mm_stream_si128(&target[3], _mm_loadu_si128(&source[3]));
+    _mm_sfence();
+#else
+    RtlCopyMemory(Entry, Command, sizeof(NVME_COMMAND));
+    KeMemoryBarrier();
+#endif
+}
+
+
+NTSTATUS
+HwSubmitRequest(
+    __in PHW_QUEUE     Queue,
+    __in PHW_REQUEST   Request,
+    __in PNVME_COMMAND Command
+    )
+/*++
+Routine Description:
+
+    Stamps the command id of the context into the command, copies the
+    command into the submission queue and rings the doorbell. At most
+    Depth - 1 ids exist, but the ring can still be full while the head
+    the controller last reported lags behind the completions; the command
+    is then refused as on a queue that is not created.
+
+Arguments:
+
+    Queue       Submission queue
+    Request     Context allocated from the same queue
+    Command     Command to submit
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    KIRQL  oldIrql;
+    USHORT next;
+
+    Command->CDW0.CID = Request->CommandId;
+
+    KeAcquireSpinLock(&Queue->SubmissionLock, &oldIrql);
+
+    next = Queue->SubmissionTail + 1;
+    if (next == Queue->Depth) {
+        next = 0;
+    }
+
+    if (next == Queue->SubmissionHead || !Queue->Created) {
+        KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (Queue->SubmissionInCmb) {
+        HwCopyCommandToCmb(&Queue->SubmissionQueue[Queue->SubmissionTail], Command);
+    } else {
+        RtlCopyMemory(&Queue->SubmissionQueue[Queue->SubmissionTail],
+                      Command,
+                      sizeof(NVME_COMMAND));
+    }
+    Queue->SubmissionTail = next;
+
+    if (Request->Irp != NULL) {
+        HwArmRequestTimeout(Queue, Request);
+    }
+
+    Queue->Submissions++;
+    HwRingDoorbell(Queue->SubmissionDoorbell,
+                   Queue->SubmissionShadow,
+                   Queue->SubmissionEventIndex,
+                   next,
+                   &Queue->SubmissionDoorbells);
+
+    KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+HwSampleLatency(
+    __in PHW_QUEUE Queue,
+    __in ULONGLONG Latency
+    )
+/*++
+Routine Description:
+
+    Folds the latency of a read or write command into the average of its
+    queue. Called with the submission lock of the queue held.
+
+--*/
+{
+    LONG sample = (LONG)min(Latency, HW_LATENCY_MAX);
+
+    Queue->LatencyEwma += (sample - Queue->LatencyEwma) / HW_LATENCY_EWMA_WEIGHT;
+}
+
+
+static
+VOID
+HwCompleteCommand(
+    __in    PHW_QUEUE              Queue,
+    __in    PNVME_COMPLETION_ENTRY Completion,
+    __inout PLIST_ENTRY            CompletedIrps
+    )
+/*++
+Routine Description:
+
+    Looks up the context of a completion entry by its command id, wakes
+    a synchronous waiter or queues the IRP for completion, and returns
+    the id to the free stack; a read with PI to check is queued with
+    STATUS_PENDING and keeps its id. Called with the completion lock held.
+
+Arguments:
+
+    Queue          Queue the entry was reaped from
+    Completion     Copy of the completion entry
+    CompletedIrps  Receives IRPs to complete once the lock is dropped
+
+Return Value:
+
+    None
+
+--*/
+{
+    PHW_REQUEST request;
+    PIRP        irp;
+    ULONGLONG   latency;
+    NTSTATUS    status;
+
+    if (Completion->DW3.CID >= Queue->Depth) {
+        DebugPrint(ERROR, DBG_DPC, "Queue %d: bogus command id %d\n",
+                   Queue->QueueId, Completion->DW3.CID);
+        return;
+    }
+
+    request = &Queue->Requests[Completion->DW3.CID];
+
+    KeAcquireSpinLockAtDpcLevel(&Queue->SubmissionLock);
+
+    if (!request->InUse) {
+        KeReleaseSpinLockFromDpcLevel(&Queue->SubmissionLock);
+        DebugPrint(ERROR, DBG_DPC, "Queue %d: completion for idle id %d\n",
+                   Queue->QueueId, Completion->DW3.CID);
+        return;
+    }
+
+    irp = request->Irp;
+
+    if (irp != NULL) {
+        status = HwCompletionStatus(Completion);
+        if (status == STATUS_CANCELLED && request->TimedOut && !irp->Cancel) {
+            status = STATUS_IO_TIMEOUT;
+        }
+
+        //
+        // The CRC of the PI check runs over the whole transfer, so it is
+        // left to HwCheckReadProtection once the locks are dropped.
+        //
+        if (NT_SUCCESS(status) && request->VerifyProtection) {
+            status = STATUS_PENDING;
+        }
+        irp->IoStatus.Status = status;
+        irp->IoStatus.Information = NT_SUCCESS(status) ? request->Information : 0;
+        if (NT_SUCCESS(status) && request->ZoneAppend) {
+            irp->IoStatus.Information = (ULONG_PTR)(HW_COMPLETION_LBA(Completion) -
+                                                    request->ZoneStart);
+        }
+
+        //
+        // A command that timed out counts in the average too, so that a
+        // device holding several copies of the data stops reading from a
+        // controller that has to be aborted.
+        //
+        if ((NT_SUCCESS(status) || status == STATUS_IO_TIMEOUT) &&
+            IoGetCurrentIrpStackLocation(irp)->MajorFunction != IRP_MJ_DEVICE_CONTROL) {
+            latency = KeQueryInterruptTime() - request->StartTime;
+            if (status != STATUS_PENDING && status != STATUS_IO_TIMEOUT) {
+                PciDrvRecordCompletion(irp, latency);
+            }
+
+            HwSampleLatency(Queue, latency);
+            Queue->LastProgress = request->StartTime + latency;
+        }
+        InsertTailList(CompletedIrps, &irp->Tail.Overlay.ListEntry);
+    }
+
+    if (request->Event != NULL) {
+        if (request->Result != NULL) {
+            *request->Result = *Completion;
+        }
+        KeSetEvent(request->Event, IO_NO_INCREMENT, FALSE);
+    }
+
+    if (request->AbortCommand) {
+        InterlockedDecrement(&Queue->FdoData->AbortsOutstanding);
+    }
+
+    if (request->AsyncEvent) {
+        HwAsyncEventCompleted(Queue->FdoData, Completion);
+    }
+
+    //
+    // A read whose PI is still to be checked keeps its id, and with it
+    // the metadata slot holding the PI; only the IRP lets go of it, so
+    // that cancel and reset leave it alone.
+    //
+    if (irp != NULL && irp->IoStatus.Status == STATUS_PENDING) {
+        request->Irp = NULL;
+        HwDisarmRequestTimeout(request);
+    } else {
+        HwPushFreeRequest(Queue, request);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Queue->SubmissionLock);
+}
+
+
+static
+VOID
+HwCheckReadProtection(
+    __in PHW_QUEUE Queue,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Checks the PI of a read that HwCompleteCommand left pending, without
+    the queue locks held, and then returns its command id.
+
+--*/
+{
+    PFDO_DATA   fdoData = Queue->FdoData;
+    PHW_REQUEST request = &Queue->Requests[HW_IRP_COMMAND_ID(Irp)];
+    USHORT      generation = HW_IRP_GENERATION(Irp);
+    ULONGLONG   offset;
+    NTSTATUS    status;
+
+    offset = IoGetCurrentIrpStackLocation(Irp)->Parameters.Read.ByteOffset.QuadPart;
+
+    status = HwVerifyProtection(fdoData,
+                                request,
+                                offset >> fdoData->LbaShift,
+                                (ULONG)(request->Information >> fdoData->LbaShift));
+
+    Irp->IoStatus.Status = status;
+    if (NT_SUCCESS(status)) {
+        PciDrvRecordCompletion(Irp, KeQueryInterruptTime() - request->StartTime);
+    } else {
+        Irp->IoStatus.Information = 0;
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&Queue->SubmissionLock);
+    if (request->InUse && request->Generation == generation) {
+        HwPushFreeRequest(Queue, request);
+    }
+    KeReleaseSpinLockFromDpcLevel(&Queue->SubmissionLock);
+}
+
+
+VOID
+HwCompleteIrp(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Completes an IRP whose command is done. If the cancel routine already
+    started, wait for it to leave the cancel spin lock: it reads the IRP
+    only while holding that lock. The IRP leaves the list of its handle
+    first, so that cleanup can no longer pick it up for cancelling.
+
+--*/
+{
+    KIRQL cancelIrql;
+
+    PciDrvUntrackActiveRequest(Irp);
+    PciDrvCacheCompleteRequest(FdoData, Irp);
+
+    if (IoSetCancelRoutine(Irp, NULL) == NULL) {
+        IoAcquireCancelSpinLock(&cancelIrql);
+        IoReleaseCancelSpinLock(cancelIrql);
+    }
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    PciDrvIoDecrement(FdoData);
+}
+
+
+ULONG
+HwProcessCompletionQueue(
+    __in PHW_QUEUE Queue
+    )
+/*++
+Routine Description:
+
+    Reaps all new entries of a completion queue and updates its head
+    doorbell. Must be called at DISPATCH_LEVEL.
+
+Arguments:
+
+    Queue       Queue to reap
+
+Return Value:
+
+    Number of entries processed
+
+--*/
+{
+    volatile NVME_COMPLETION_ENTRY *entry;
+    NVME_COMPLETION_ENTRY           completion;
+    LIST_ENTRY                      completedIrps;
+    PIRP                            irp;
+    ULONG                           count = 0;
+
+    InitializeListHead(&completedIrps);
+
+    KeAcquireSpinLockAtDpcLevel(&Queue->CompletionLock);
+
+    for (;;) {
+
+        entry = &Queue->CompletionQueue[Queue->CompletionHead];
+        if (entry->DW3.Status.P != Queue->CompletionPhase) {
+            break;
+        }
+
+        //
+        // Read the rest of the entry only after the phase tag matched.
+        //
+        KeMemoryBarrier();
+        completion = *(PNVME_COMPLETION_ENTRY)entry;
+
+        if (++Queue->CompletionHead == Queue->Depth) {
+            Queue->CompletionHead = 0;
+            Queue->CompletionPhase ^= 1;
+        }
+
+        Queue->SubmissionHead = completion.DW2.SQHD;
+
+        HwCompleteCommand(Queue, &completion, &completedIrps);
+        count++;
+    }
+
+    if (count != 0) {
+        Queue->CompletionUpdates++;
+        HwRingDoorbell(Queue->CompletionDoorbell,
+                       Queue->CompletionShadow,
+                       Queue->CompletionEventIndex,
+                       Queue->CompletionHead,
+                       &Queue->CompletionDoorbells);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Queue->CompletionLock);
+
+    //
+    // A range request that has more commands to go goes on with the next
+    // one rather than being completed.
+    //
+    while (!IsListEmpty(&completedIrps)) {
+        irp = CONTAINING_RECORD(RemoveHeadList(&completedIrps), IRP, Tail.Overlay.ListEntry);
+        if (irp->IoStatus.Status == STATUS_PENDING) {
+            HwCheckReadProtection(Queue, irp);
+        }
+        if (!HwContinueRangeRequest(Queue->FdoData, irp)) {
+            HwCompleteIrp(Queue->FdoData, irp);
+        }
+    }
+
+    return count;
+}
+
+
+NTSTATUS
+HwCompletionStatus(
+    __in PNVME_COMPLETION_ENTRY Completion
+    )
+/*++
+Routine Description:
+
+    Translates the status field of a completion entry.
+
+Arguments:
+
+    Completion  Completion entry
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    if (Completion->DW3.Status.SCT == NVME_STATUS_TYPE_GENERIC_COMMAND) {
+        switch (Completion->DW3.Status.SC) {
+        case 0x00:      // Successful Completion
+            return STATUS_SUCCESS;
+        case 0x01:      // Invalid Command Opcode
+            return STATUS_NOT_SUPPORTED;
+        case 0x02:      // Invalid Field in Command
+            return STATUS_INVALID_PARAMETER;
+        case 0x07:      // Command Abort Requested
+        case 0x08:      // Command Aborted due to SQ Deletion
+            return STATUS_CANCELLED;
+        case 0x80:      // LBA Out of Range
+            return STATUS_NONEXISTENT_SECTOR;
+        default:
+            break;
+        }
+    } else if (Completion->DW3.Status.SCT == NVME_STATUS_TYPE_MEDIA_ERROR) {
+        switch (Completion->DW3.Status.SC) {
+        case 0x82:      // End-to-end Guard Check Error
+        case 0x83:      // End-to-end Application Tag Check Error
+        case 0x84:      // End-to-end Reference Tag Check Error
+            return STATUS_CRC_ERROR;
+        default:
+            return STATUS_DEVICE_DATA_ERROR;
+        }
+    }
+
+    return STATUS_IO_DEVICE_ERROR;
+}
+
+
+static
+NTSTATUS
+HwSubmitCommandAndWait(
+    __in      PHW_QUEUE              Queue,
+    __in      PNVME_COMMAND          Command,
+    __in      ULONG                  Timeout,
+    __out_opt PNVME_COMPLETION_ENTRY Completion
+    )
+/*++
+Routine Description:
+
+    Submits a command that has no IRP and waits for it, for at most
+    Timeout ms. If the interrupt does not show up in time the queue is
+    reaped by hand once before the command is given up.
+
+    A command given up on stays out and may still write the buffers it
+    was given, which the callers reuse. So after a timeout no command
+    without an IRP is submitted until the controller is disabled, and a
+    caller that sees STATUS_IO_TIMEOUT must have it reset or disabled:
+    the start fails and disables it, others call HwResetController.
+
+--*/
+{
+    PHW_REQUEST           request;
+    KEVENT                event;
+    NVME_COMPLETION_ENTRY result;
+    LARGE_INTEGER         timeout;
+    KIRQL                 oldIrql;
+    NTSTATUS              status;
+
+    if (Queue->FdoData->SyncCommandTimedOut) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+
+    //
+    // Ids left behind by timed out commands stay allocated until the
+    // controller answers or is reset, so the stack can run dry.
+    //
+    request = HwAllocateRequest(Queue, 0);
+    if (request == NULL) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    request->Event = &event;
+    request->Result = &result;
+    request->StartTime = KeQueryInterruptTime();
+
+    status = HwSubmitRequest(Queue, request, Command);
+    if (!NT_SUCCESS(status)) {
+        HwFreeRequest(Queue, request);
+        return status;
+    }
+
+    timeout.QuadPart = -10000LL * Timeout;
+    if (KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, &timeout)
+                == STATUS_TIMEOUT) {
+
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+        HwProcessCompletionQueue(Queue);
+        KeLowerIrql(oldIrql);
+
+        KeAcquireSpinLock(&Queue->SubmissionLock, &oldIrql);
+        if (request->InUse && request->Event == &event) {
+            request->Event = NULL;
+            request->Result = NULL;
+            Queue->FdoData->SyncCommandTimedOut = TRUE;
+            status = STATUS_IO_TIMEOUT;
+        }
+        KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(ERROR, DBG_HW_ACCESS, "Command 0x%x on queue %d timed out\n",
+                       Command->CDW0.OPC, Queue->QueueId);
+            return status;
+        }
+    }
+
+    if (Completion != NULL) {
+        *Completion = result;
+    }
+
+    return HwCompletionStatus(&result);
+}
+
+
+NTSTATUS
+HwSubmitAdminCommandSync(
+    __in      PFDO_DATA              FdoData,
+    __in      PNVME_COMMAND          Command,
+    __out_opt PNVME_COMPLETION_ENTRY Completion
+    )
+/*++
+Routine Description:
+
+    Submits an admin command and waits for it. Admin commands issued this
+    way are serialized.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Command     Command to submit; the command id is filled in here
+    Completion  Optionally receives the completion entry
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NTSTATUS status;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    ExAcquireFastMutex(&FdoData->AdminCommandMutex);
+
+    status = HwSubmitCommandAndWait(FdoData->AdminQueue,
+                                    Command,
+                                    HW_ADMIN_COMMAND_TIMEOUT,
+                                    Completion);
+
+    ExReleaseFastMutex(&FdoData->AdminCommandMutex);
+
+    return status;
+}
+
+
+NTSTATUS
+HwSubmitIoCommandSync(
+    __in      PFDO_DATA              FdoData,
+    __in      PNVME_COMMAND          Command,
+    __out_opt PNVME_COMPLETION_ENTRY Completion
+    )
+/*++
+Routine Description:
+
+    Submits an I/O command set command that has no IRP, such as one the
+    driver needs to set itself up, on the I/O queue of the current
+    processor and waits for it for at most the I/O timeout.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Command     Command to submit; the command id is filled in here
+    Completion  Optionally receives the completion entry
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PHW_QUEUE queue;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    queue = HwGetSubmissionQueue(FdoData, PCIDRV_PRIORITY_MEDIUM);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    return HwSubmitCommandAndWait(queue,
+                                  Command,
+                                  FdoData->Parameters.IoTimeout * 1000,
+                                  Completion);
+}
+
+
+NTSTATUS
+HwSubmitSlotCommand(
+    __in    PFDO_DATA      FdoData,
+    __inout PHW_ADMIN_SLOT Slot,
+    __in    PNVME_COMMAND  Command
+    )
+/*++
+Routine Description:
+
+    Submits the admin command of a slot, moving the chunk the partial MDL
+    of the slot describes. The command is waited for with
+    HwWaitSlotCommand; any number of slots may be out at a time.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Slot        Slot with the MDL and the event of the command
+    Command     Command to submit; its PRP entries are filled in here
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PHW_QUEUE   admin = FdoData->AdminQueue;
+    PHW_REQUEST request;
+    NTSTATUS    status;
+
+    request = HwAllocateRequest(admin, 0);
+    if (request == NULL) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    status = HwBuildPrpList(request, Slot->Mdl, Command);
+    if (!NT_SUCCESS(status)) {
+        HwFreeRequest(admin, request);
+        return status;
+    }
+
+    KeClearEvent(&Slot->Event);
+    request->Event = &Slot->Event;
+    request->Result = &Slot->Result;
+    request->StartTime = KeQueryInterruptTime();
+
+    status = HwSubmitRequest(admin, request, Command);
+    if (!NT_SUCCESS(status)) {
+        HwFreeRequest(admin, request);
+        return status;
+    }
+
+    Slot->Request = request;
+    Slot->Busy = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+
+BOOLEAN
+HwDetachSlotCommand(
+    __in    PFDO_DATA      FdoData,
+    __inout PHW_ADMIN_SLOT Slot
+    )
+/*++
+Routine Description:
+
+    Gives up on the command of a slot unless it completed: its id no
+    longer signals the event of the slot, which lives on the stack of
+    the caller. The controller may still move the chunk until it is
+    reset.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Slot        Slot whose command is outstanding
+
+Return Value:
+
+    TRUE if the command was given up on
+
+--*/
+{
+    PHW_QUEUE   admin = FdoData->AdminQueue;
+    PHW_REQUEST request = Slot->Request;
+    BOOLEAN     outstanding;
+    KIRQL       oldIrql;
+
+    Slot->Busy = FALSE;
+
+    KeAcquireSpinLock(&admin->SubmissionLock, &oldIrql);
+    outstanding = (BOOLEAN)(KeReadStateEvent(&Slot->Event) == 0);
+    if (outstanding && request->InUse && request->Event == &Slot->Event) {
+        request->Event = NULL;
+        request->Result = NULL;
+    }
+    KeReleaseSpinLock(&admin->SubmissionLock, oldIrql);
+
+    return outstanding;
+}
+
+
+NTSTATUS
+HwWaitSlotCommand(
+    __in    PFDO_DATA      FdoData,
+    __inout PHW_ADMIN_SLOT Slot
+    )
+/*++
+Routine Description:
+
+    Waits for the command of a slot, for at most the admin command
+    timeout. If the interrupt does not show up in time the admin queue
+    is reaped by hand once before the command is given up on.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Slot        Slot whose command is outstanding
+
+Return Value:
+
+    STATUS_IO_TIMEOUT if the command was given up on, in which case the
+    caller must reset the controller before the buffer is unlocked
+
+--*/
+{
+    LARGE_INTEGER timeout;
+    KIRQL         oldIrql;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    Slot->Busy = FALSE;
+
+    timeout.QuadPart = -10000LL * HW_ADMIN_COMMAND_TIMEOUT;
+    if (KeWaitForSingleObject(&Slot->Event, Executive, KernelMode, FALSE, &timeout)
+                == STATUS_TIMEOUT) {
+
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+        HwProcessCompletionQueue(FdoData->AdminQueue);
+        KeLowerIrql(oldIrql);
+
+        if (HwDetachSlotCommand(FdoData, Slot)) {
+            DebugPrint(ERROR, DBG_HW_ACCESS, "Admin command of the chunk at %I64u timed out\n",
+                       Slot->Offset);
+            return STATUS_IO_TIMEOUT;
+        }
+    }
+
+    return HwCompletionStatus(&Slot->Result);
+}
+
+
+PHW_QUEUE
+HwGetSubmissionQueue(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Priority
+    )
+/*++
+Routine Description:
+
+    Returns the I/O queue the current processor submits requests of a
+    priority class on.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Priority    PCIDRV_PRIORITY_URGENT to PCIDRV_PRIORITY_LOW
+
+Return Value:
+
+    Queue or NULL if no I/O queue exists
+
+--*/
+{
+    ULONG cpu;
+    ULONG cls;
+
+    if (FdoData->IoQueueCount == 0) {
+        return NULL;
+    }
+
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (cpu >= FdoData->ProcessorQueueMapSize) {
+        return FdoData->IoQueues[cpu % FdoData->IoQueueCount];
+    }
+
+    cls = min(Priority, FdoData->PriorityClasses - 1);
+
+    return FdoData->IoQueues[FdoData->ProcessorQueueMap[cls * FdoData->ProcessorQueueMapSize + cpu]];
+}
+
+
+ULONGLONG
+HwEstimateQueueWait(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Priority
+    )
+/*++
+Routine Description:
+
+    Estimates how long a command of a priority class submitted now from
+    the current processor would take: the commands outstanding on the
+    queue it would go to, plus one, times the recent latency of that
+    queue. Used to pick the least loaded of several devices holding the
+    same data. A queue that has gone longer without completing anything
+    than its commands take is held up, by a command about to time out or
+    a controller that stopped answering, and counts that long per
+    command instead. The counters are read without their locks.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Priority    PCIDRV_PRIORITY_URGENT to PCIDRV_PRIORITY_LOW
+
+Return Value:
+
+    Estimate in 100ns units, MAXULONGLONG while the device is being reset
+    or has no I/O queue
+
+--*/
+{
+    PHW_QUEUE queue;
+    ULONG     outstanding;
+    ULONGLONG latency;
+
+    if (FdoData->ResetPending) {
+        return MAXULONGLONG;
+    }
+
+    queue = HwGetSubmissionQueue(FdoData, Priority);
+    if (queue == NULL) {
+        return MAXULONGLONG;
+    }
+
+    outstanding = HW_QUEUE_COMMAND_IDS(queue) - queue->FreeCount;
+    latency = max(queue->LatencyEwma, 1);
+    if (outstanding != 0) {
+        latency = max(latency, (KeQueryInterruptTime() - queue->LastProgress) * outstanding);
+    }
+
+    return (outstanding + 1) * latency;
+}
+
+
+VOID
+HwFailRequest(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request,
+    __in USHORT      Generation,
+    __in NTSTATUS    Status
+    )
+/*++
+Routine Description:
+
+    Completes the IRP of a command that could not be submitted, unless
+    the controller was stopped under us and the IRP has already been
+    failed by HwCompleteOutstandingRequests.
+
+Arguments:
+
+    Queue       Queue the id belongs to
+    Request     Command context holding the IRP
+    Generation  Generation of the id when the IRP was attached
+    Status      Status to complete the IRP with
+
+Return Value:
+
+    None
+
+--*/
+{
+    PIRP  irp = NULL;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Queue->SubmissionLock, &oldIrql);
+
+    if (Request->InUse && Request->Generation == Generation) {
+        irp = Request->Irp;
+        HwPushFreeRequest(Queue, Request);
+    }
+
+    KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+
+    if (irp != NULL) {
+        irp->IoStatus.Status = Status;
+        irp->IoStatus.Information = 0;
+        HwCompleteIrp(Queue->FdoData, irp);
+    }
+}
+
+
+VOID
+HwAbortRequest(
+    __in PHW_QUEUE Queue,
+    __in USHORT    CommandId,
+    __in USHORT    Generation,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Asks the controller to abort the command an IRP is waiting on. The
+    IRP is not touched here; it is completed when the controller answers
+    the aborted command, with the status the controller gives it. Nothing
+    is done if the command already completed and its id was reused, if
+    an Abort is already out for it, or if the controller's Abort Command
+    Limit is used up.
+
+Arguments:
+
+    Queue       Queue the command was submitted on
+    CommandId   Command id recorded in the IRP
+    Generation  Generation of the command id recorded in the IRP
+    Irp         The IRP being cancelled
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA    fdoData = Queue->FdoData;
+    PHW_QUEUE    adminQueue = fdoData->AdminQueue;
+    PHW_REQUEST  request;
+    PHW_REQUEST  abort;
+    NVME_COMMAND command;
+    KIRQL        oldIrql;
+
+    if (CommandId >= Queue->Depth) {
+        return;
+    }
+
+    request = &Queue->Requests[CommandId];
+
+    KeAcquireSpinLock(&Queue->SubmissionLock, &oldIrql);
+
+    if (!request->InUse || request->Irp != Irp ||
+        request->Generation != Generation || request->AbortIssued) {
+        KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+        return;
+    }
+
+    if (InterlockedIncrement(&fdoData->AbortsOutstanding) >
+                (LONG)fdoData->AbortLimit) {
+        InterlockedDecrement(&fdoData->AbortsOutstanding);
+        KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+        DebugPrint(TRACE, DBG_READ, "Abort limit reached, cid %d not aborted\n",
+                   CommandId);
+        return;
+    }
+
+    request->AbortIssued = TRUE;
+
+    KeReleaseSpinLock(&Queue->SubmissionLock, oldIrql);
+
+    abort = HwAllocateRequest(adminQueue, 0);
+    if (abort == NULL) {
+        InterlockedDecrement(&fdoData->AbortsOutstanding);
+        return;
+    }
+
+    abort->AbortCommand = TRUE;
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_ABORT;
+    command.u.GENERAL.CDW10 = ((ULONG)CommandId << 16) | Queue->QueueId;
+
+    if (!NT_SUCCESS(HwSubmitRequest(adminQueue, abort, &command))) {
+        HwFreeRequest(adminQueue, abort);
+        InterlockedDecrement(&fdoData->AbortsOutstanding);
+        return;
+    }
+
+    DebugPrint(TRACE, DBG_READ, "Abort sent for SQ %d cid %d\n",
+               Queue->QueueId, CommandId);
+}
+
+
+VOID
+HwDetachOutstandingRequests(
+    __in    PFDO_DATA   FdoData,
+    __inout PLIST_ENTRY Irps
+    )
+/*++
+Routine Description:
+
+    Takes every IRP still waiting on an I/O queue off its command id and
+    links it to Irps through Tail.Overlay.ListEntry. IoStatus.Status of
+    an IRP whose command ran past its deadline is set to STATUS_IO_TIMEOUT,
+    and the time it waited goes into the latency of its queue; that of
+    the others is set to STATUS_PENDING. The controller must be stopped
+    so that nothing completes behind our back.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irps        Receives the IRPs
+
+Return Value:
+
+    None
+
+--*/
+{
+    PHW_QUEUE   queue;
+    PHW_REQUEST request;
+    KIRQL       oldIrql;
+    ULONG       q, i;
+
+    ASSERT(!FdoData->ControllerEnabled);
+
+    for (q = 0; q < FdoData->IoQueuesAllocated; q++) {
+
+        queue = FdoData->IoQueues[q];
+
+        KeAcquireSpinLock(&queue->SubmissionLock, &oldIrql);
+
+        for (i = 0; i < queue->Depth; i++) {
+            request = &queue->Requests[i];
+            if (request->InUse && request->Irp != NULL) {
+                request->Irp->IoStatus.Status =
+                    request->TimedOut ? STATUS_IO_TIMEOUT : STATUS_PENDING;
+                if (request->TimedOut &&
+                    IoGetCurrentIrpStackLocation(request->Irp)->MajorFunction !=
+                        IRP_MJ_DEVICE_CONTROL) {
+                    HwSampleLatency(queue, KeQueryInterruptTime() - request->StartTime);
+                }
+                InsertTailList(Irps, &request->Irp->Tail.Overlay.ListEntry);
+                HwPushFreeRequest(queue, request);
+            }
+        }
+
+        KeReleaseSpinLock(&queue->SubmissionLock, oldIrql);
+    }
+}
+
+
+VOID
+HwCompleteOutstandingRequests(
+    __in PFDO_DATA FdoData,
+    __in NTSTATUS  Status
+    )
+/*++
+Routine Description:
+
+    Fails every IRP still waiting on an I/O queue of a stopped controller.
+    The free stacks are refilled when the queues are reset on the next
+    start.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Status      Status the IRPs are completed with
+
+Return Value:
+
+    None
+
+--*/
+{
+    LIST_ENTRY irps;
+    PIRP       irp;
+
+    InitializeListHead(&irps);
+
+    HwDetachOutstandingRequests(FdoData, &irps);
+
+    while (!IsListEmpty(&irps)) {
+        irp = CONTAINING_RECORD(RemoveHeadList(&irps), IRP, Tail.Overlay.ListEntry);
+        irp->IoStatus.Status = Status;
+        irp->IoStatus.Information = 0;
+        HwCompleteIrp(FdoData, irp);
+    }
+}
+
+
+VOID
+HwGetDoorbellStatistics(
+    __in  PFDO_DATA                    FdoData,
+    __out PPCIDRV_DOORBELL_STATISTICS  Statistics
+    )
+/*++
+Routine Description:
+
+    Sums the doorbell counters of the I/O queues. They are read without
+    the queue locks, so the sums are approximate while I/O runs.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Statistics  Receives the sums
+
+Return Value:
+
+    None
+
+--*/
+{
+    PHW_QUEUE queue;
+    ULONG     i;
+
+    RtlZeroMemory(Statistics, sizeof(PCIDRV_DOORBELL_STATISTICS));
+    Statistics->ShadowDoorbells = FdoData->ShadowDoorbellsEnabled ? 1 : 0;
+    Statistics->Queues = FdoData->IoQueueCount;
+
+    for (i = 0; i < FdoData->IoQueuesAllocated; i++) {
+        queue = FdoData->IoQueues[i];
+        Statistics->Submissions += queue->Submissions;
+        Statistics->SubmissionDoorbells += queue->SubmissionDoorbells;
+        Statistics->CompletionUpdates += queue->CompletionUpdates;
+        Statistics->CompletionDoorbells += queue->CompletionDoorbells;
+    }
+}
@@ -93,163 +93,1078 @@ HwReadWriteRegister (
 }
 
 NTSTATUS
-HwStartBusMasterWriteRead (
-    __in PFDO_DATA FdoData,
-    __in PIRP      Irp,
-    __in PMDL      Mdl
+HwBuildPrpList (
+    __in  PHW_REQUEST   Request,
+    __in  PMDL          Mdl,
+    __in  PNVME_COMMAND Command
     )
+/*++
+Routine Description:
+
+    Describes the buffer of an MDL with PRP entries. The controller page
+    size is PAGE_SIZE, so every PFN of the MDL is one PRP entry; PRP2 is
+    either the second page or the PRP list slot of the command id.
+
+Arguments:
+
+    Request     Command context owning the PRP list slot
+    Mdl         Locked buffer
+    Command     Receives PRP1 and PRP2
+
+Return Value:
+
+    STATUS_INVALID_PARAMETER if the buffer spans more pages than a PRP
+    list slot can describe
+
+--*/
 {
-    NTSTATUS     status;
-    PIO_STACK_LOCATION irpStack;
+    PPFN_NUMBER pfns = MmGetMdlPfnArray(Mdl);
+    ULONG       offset = MmGetMdlByteOffset(Mdl);
+    ULONG       pages;
+    ULONG       i;
 
-    //NGXg̃LZvsĂȂƂmFB
-    if(Irp->Cancel){
-        status = STATUS_CANCELLED;
-        return status;
+    pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(Mdl),
+                                           MmGetMdlByteCount(Mdl));
+
+    if (pages - 1 > HW_PRP_LIST_SIZE / sizeof(ULONGLONG)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Command->PRP1 = ((ULONGLONG)pfns[0] << PAGE_SHIFT) + offset;
+    Command->PRP2 = 0;
+
+    if (pages == 2) {
+        Command->PRP2 = (ULONGLONG)pfns[1] << PAGE_SHIFT;
+    } else if (pages > 2) {
+        for (i = 1; i < pages; i++) {
+            Request->PrpList[i - 1] = (ULONGLONG)pfns[i] << PAGE_SHIFT;
+        }
+        Command->PRP2 = Request->PrpListPhys.QuadPart;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+HwIssueIrpCommand (
+    __in  PHW_QUEUE     Queue,
+    __in  PHW_REQUEST   Request,
+    __in  PIRP          Irp,
+    __in  PNVME_COMMAND Command
+    )
+/*++
+Routine Description:
+
+    Attaches an IRP to the command it waits on, makes it cancellable and
+    submits the command. The IRP is completed from the completion DPC of
+    the queue; its command id and generation are kept in the IRP so that
+    the cancel routine can find the command without a search.
+
+Arguments:
+
+    Queue       Queue the command id was allocated from
+    Request     Command context, with Information filled in
+    Irp         The IRP
+    Command     Command to submit
+
+Return Value:
+
+    STATUS_PENDING if the IRP was taken, or STATUS_CANCELLED if it was
+    cancelled already, in which case the command id is freed and the
+    caller must complete the IRP.
+
+--*/
+{
+    USHORT   generation;
+    NTSTATUS status;
+
+    Request->Irp = Irp;
+    Request->StartTime = KeQueryInterruptTime();
+    generation = Request->Generation;
+
+    HW_IRP_COMMAND(Irp) = HW_MAKE_IRP_COMMAND(Request->CommandId, Request->Generation);
+    HW_IRP_QUEUE(Irp) = Queue;
+
+    IoSetCancelRoutine(Irp, PciDrvCancelRoutineForReadIrp);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL) != NULL) {
+        HwFreeRequest(Queue, Request);
+        return STATUS_CANCELLED;
     }
 
-    //[hACgNGXgsłȂƂmFB
-    if(FdoData->ReadWriteIrp != NULL) {
-        status = STATUS_INVALID_DEVICE_REQUEST;
-        ASSERTMSG("More than one Request", FALSE);
+    //
+    // The command may complete as soon as the doorbell is rung.
+    //
+    IoMarkIrpPending(Irp);
+
+    status = HwSubmitRequest(Queue, Request, Command);
+    if (!NT_SUCCESS(status)) {
+        HwFailRequest(Queue, Request, generation, status);
+    }
+
+    return STATUS_PENDING;
+}
+
+
+NTSTATUS
+HwStartReadWrite (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Turns a read or write IRP into one NVMe command on the submission queue
+    of the current processor.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         Read or write IRP with a locked MDL
+
+Return Value:
+
+    STATUS_PENDING if the IRP was taken, in which case it is completed
+    here or by the completion path. Any other status means the caller
+    must complete the IRP.
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PMDL               mdl = Irp->MdlAddress;
+    PHW_QUEUE          queue;
+    PHW_REQUEST        request;
+    NVME_COMMAND       command;
+    ULONGLONG          lba;
+    ULONG              length;
+    ULONG              blockMask;
+    ULONG              priority;
+    ULONG              blocks;
+    ULONG              stream;
+    BOOLEAN            writeToDevice;
+    NTSTATUS           status;
+
+    //
+    // Parameters.Read and Parameters.Write have the same layout.
+    //
+    writeToDevice = (BOOLEAN)(irpStack->MajorFunction == IRP_MJ_WRITE);
+    length = irpStack->Parameters.Read.Length;
+    blockMask = (1UL << FdoData->LbaShift) - 1;
+
+    if (length != MmGetMdlByteCount(mdl) ||
+        (length & blockMask) != 0 ||
+        (irpStack->Parameters.Read.ByteOffset.QuadPart & blockMask) != 0 ||
+        irpStack->Parameters.Read.ByteOffset.QuadPart < 0 ||
+        (MmGetMdlByteOffset(mdl) & 3) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (length > FdoData->MaxTransferSize) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    lba = (ULONGLONG)irpStack->Parameters.Read.ByteOffset.QuadPart >> FdoData->LbaShift;
+    if (lba >= FdoData->NamespaceBlocks ||
+        (length >> FdoData->LbaShift) > FdoData->NamespaceBlocks - lba) {
+        return STATUS_NONEXISTENT_SECTOR;
+    }
+
+    priority = PciDrvGetRequestPriority(Irp);
+
+    queue = HwGetSubmissionQueue(FdoData, priority);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    request = HwAllocateRequest(queue, FdoData->PriorityReserve[priority]);
+    if (request == NULL) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = writeToDevice ? NVME_NVM_COMMAND_WRITE : NVME_NVM_COMMAND_READ;
+    command.NSID = FdoData->NamespaceId;
+    command.u.GENERAL.CDW10 = (ULONG)lba;
+    command.u.GENERAL.CDW11 = (ULONG)(lba >> 32);
+    blocks = length >> FdoData->LbaShift;
+    command.u.GENERAL.CDW12 = blocks - 1;
+
+    status = HwBuildPrpList(request, mdl, &command);
+    if (!NT_SUCCESS(status)) {
+        HwFreeRequest(queue, request);
         return status;
     }
 
-    {
-        //MdlA]Ώۃobt@̕y[W擾B
-        ULONG pages = 0;
-        pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES  (
-                                                    MmGetMdlVirtualAddress(Mdl),
-                                                    MmGetMdlByteCount(Mdl)
-                                                    );
-    
-        //AP[gς݃}bvWX^ȉł邱ƂmFB
-        if (pages > FdoData->AllocatedMapRegisters) {
-            DebugPrint(ERROR, DBG_INIT, "Not enough map registers: Allocated %d, Required %d\n",
-                                            FdoData->AllocatedMapRegisters, pages);
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            return status;
+    //
+    // Separate metadata always has a buffer, PI or not. The driver
+    // generates the PI of writes and checks that of reads itself, and
+    // also has the controller check guard and reference tag on the way.
+    //
+    if (FdoData->MetadataSize != 0) {
+        command.MPTR = request->MetadataPhys.QuadPart;
+    }
+
+    if (FdoData->PiType != HW_PI_NONE) {
+
+        command.u.GENERAL.CDW12 |= HW_PRINFO_CHECK_GUARD;
+        if (FdoData->PiType != HW_PI_TYPE3) {
+            command.u.GENERAL.CDW12 |= HW_PRINFO_CHECK_REF_TAG;
+            command.u.GENERAL.CDW14 = (ULONG)lba;       // initial reference tag
+        }
+
+        if (FdoData->PiInsertStrip) {
+            command.u.GENERAL.CDW12 |= HW_PRINFO_PRACT;
+        } else {
+            request->Data = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+            if (request->Data == NULL) {
+                HwFreeRequest(queue, request);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            if (writeToDevice) {
+                HwGenerateProtection(FdoData, request, lba, blocks);
+            } else {
+                request->VerifyProtection = TRUE;
+            }
         }
     }
 
-    {
-        //]擾B
-        BOOLEAN writeToDevice = FALSE;
-
-        irpStack = IoGetCurrentIrpStackLocation(Irp);
-        if (irpStack->MajorFunction == IRP_MJ_READ) {
-            writeToDevice = FALSE;
-        }
-        else if (irpStack->MajorFunction == IRP_MJ_WRITE) {
-            writeToDevice = TRUE;
-        }
-        else {
-            ASSERT(FALSE);
-        }
-    
-        //[h^CgIRPZbgB
-        FdoData->ReadWriteIrp = Irp;
-        //IRPyfBOB
-        IoMarkIrpPending(Irp);
-    
-        //obt@tbVB
-        KeFlushIoBuffers(Mdl, !writeToDevice, TRUE);
-    
-        //DMAA_v^ɓo^ĂGetScatterGatherList֐R[B
-        //XLb^MUXgA6œn
-        //HwInitiateScatterGatherBusmaster()sB
-#pragma warning(disable:4306)
-    	status = FdoData->DmaAdapterObject->DmaOperations->GetScatterGatherList (
-                                            FdoData->DmaAdapterObject,
-                                            FdoData->Self,
-                                            Mdl,
-                                            MmGetMdlVirtualAddress(Mdl),
-                                            MmGetMdlByteCount(Mdl),
-                                            HwInitiateScatterGatherBusmaster,
-                                            (PVOID)writeToDevice,
-                                            writeToDevice
-                                            );
-#pragma warning(default:4306)
-    }
-
-    if( !NT_SUCCESS(status)) {
-        FdoData->ReadWriteIrp = NULL;
-        status = STATUS_INSUFFICIENT_RESOURCES;
-    }
-    else {
-        status = STATUS_PENDING;
+    if (writeToDevice) {
+        stream = PciDrvGetRequestStream(FdoData, Irp);
+        if (stream != 0) {
+            HwTagWriteStream(FdoData, &command, stream, length);
+        }
     }
 
-    return status;
+    request->Information = length;
+
+    KeFlushIoBuffers(mdl, !writeToDevice, TRUE);
+
+    return HwIssueIrpCommand(queue, request, Irp, &command);
 }
 
 
+static
 VOID
-HwInitiateScatterGatherBusmaster(
-    __in struct _DEVICE_OBJECT  *DeviceObject,
-    __in struct _IRP  *Irp, //not used
-    __in PSCATTER_GATHER_LIST  ScatterGather,
-    __in PVOID  Context
+HwSiftDownRange (
+    __inout PPCIDRV_RANGE Ranges,
+    __in    ULONG         Root,
+    __in    ULONG         Count
     )
+/*++
+Routine Description:
+
+    Moves a range down a heap ordered by offset until it is no smaller
+    than its children.
+
+--*/
 {
-    //GetScatterGatherListƓReLXgBsłȂB
+    PCIDRV_RANGE range;
+    ULONG        child;
 
-    PFDO_DATA fdoData = (PFDO_DATA) DeviceObject->DeviceExtension;
-    BOOLEAN   writeToDevice = FALSE;
-    if (Context) {
-        writeToDevice = TRUE;
+    for (child = 2 * Root + 1; child < Count; Root = child, child = 2 * child + 1) {
+        if (child + 1 < Count && Ranges[child + 1].Offset > Ranges[child].Offset) {
+            child++;
+        }
+        if (Ranges[Root].Offset >= Ranges[child].Offset) {
+            break;
+        }
+        range = Ranges[child];
+        Ranges[child] = Ranges[Root];
+        Ranges[Root] = range;
     }
+}
+
+
+static
+VOID
+HwSortRanges (
+    __inout PPCIDRV_RANGE Ranges,
+    __in    ULONG         Count
+    )
+/*++
+Routine Description:
 
-    //XLb^MUXgւ̃|C^ۑB
-    fdoData->ScatterGather              = ScatterGather;
-    //]pۑB
-    fdoData->ScatterGatherWriteToDevice = writeToDevice;
-    //]iJE^ZbgB
-    fdoData->ScatterGatherProgress      = 0;
+    Sorts ranges by offset, in place and without allocating (heapsort).
 
-    HwKickBusMasterReadWrite(fdoData);
+--*/
+{
+    PCIDRV_RANGE range;
+    ULONG        i;
+
+    for (i = Count / 2; i-- > 0; ) {
+        HwSiftDownRange(Ranges, i, Count);
+    }
 
+    for (i = Count; i-- > 1; ) {
+        range = Ranges[0];
+        Ranges[0] = Ranges[i];
+        Ranges[i] = range;
+        HwSiftDownRange(Ranges, 0, i);
+    }
 }
 
-VOID
-HwKickBusMasterReadWrite (
-    __in PFDO_DATA FdoData
-)
+
+NTSTATUS
+HwPrepareRangeRequest (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Checks the range list of IOCTL_DEALLOCATE_RANGES or IOCTL_WRITE_ZEROES
+    and sorts and merges its ranges in place, so that overlapping and
+    adjacent ranges turn into one. The source ranges of IOCTL_COPY_RANGES
+    keep their order, which is that of the destination; only ranges that
+    continue the one before them are merged. Their destination is moved
+    to where the end of the list lands, since the copy is done from the
+    end of the list.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         The IOCTL request
+
+Return Value:
+
+    NT status code
+
+--*/
 {
-    PSCATTER_GATHER_LIST    scatterGather = FdoData->ScatterGather;
-    ULONG                   progress = FdoData->ScatterGatherProgress;
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PPCIDRV_RANGE_LIST list = PCIDRV_IRP_RANGE_LIST(Irp);
+    PPCIDRV_COPY_LIST  copy = (PPCIDRV_COPY_LIST)Irp->AssociatedIrp.SystemBuffer;
+    ULONG              inputLength = irpStack->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG              headerLength;
+    ULONGLONG          limit, end, total;
+    ULONG              blockMask, count, i;
+    BOOLEAN            supported;
+
+    switch (irpStack->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_DEALLOCATE_RANGES:
+        supported = FdoData->DsmSupported;
+        break;
+    case IOCTL_WRITE_ZEROES:
+        supported = FdoData->WriteZeroesSupported;
+        break;
+    default:
+        //
+        // The host copy cannot carry separate metadata over.
+        //
+        supported = HwCopyOffloaded(FdoData) || FdoData->MetadataSize == 0;
+        break;
+    }
+    if (!supported) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    headerLength = (ULONG)((PUCHAR)list->Ranges - (PUCHAR)Irp->AssociatedIrp.SystemBuffer);
+
+    if (Irp->AssociatedIrp.SystemBuffer == NULL || inputLength < headerLength ||
+        list->Count == 0 || list->Count > PCIDRV_MAX_RANGES ||
+        inputLength < headerLength + list->Count * sizeof(PCIDRV_RANGE)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    blockMask = (1UL << FdoData->LbaShift) - 1;
+    limit = FdoData->NamespaceBlocks << FdoData->LbaShift;
+
+    for (i = 0; i < list->Count; i++) {
+        if (list->Ranges[i].Length == 0 ||
+            ((list->Ranges[i].Offset | list->Ranges[i].Length) & blockMask) != 0) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (list->Ranges[i].Offset >= limit ||
+            list->Ranges[i].Length > limit - list->Ranges[i].Offset) {
+            return STATUS_NONEXISTENT_SECTOR;
+        }
+    }
+
+    if (irpStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_COPY_RANGES) {
+
+        count = 1;
+        total = list->Ranges[0].Length;
+        for (i = 1; i < list->Count; i++) {
+            if (list->Ranges[i].Length > limit - total) {
+                return STATUS_NONEXISTENT_SECTOR;
+            }
+            total += list->Ranges[i].Length;
+
+            end = list->Ranges[count - 1].Offset + list->Ranges[count - 1].Length;
+            if (list->Ranges[i].Offset == end) {
+                list->Ranges[count - 1].Length += list->Ranges[i].Length;
+            } else {
+                list->Ranges[count++] = list->Ranges[i];
+            }
+        }
+
+        if ((copy->Destination & blockMask) != 0) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (copy->Destination >= limit || total > limit - copy->Destination) {
+            return STATUS_NONEXISTENT_SECTOR;
+        }
+
+        end = copy->Destination + total;
+        for (i = 0; i < count; i++) {
+            if (list->Ranges[i].Offset < end &&
+                copy->Destination < list->Ranges[i].Offset + list->Ranges[i].Length) {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
 
-    //XLb^MUXgA]s镨y[W擾B
-    PSCATTER_GATHER_ELEMENT elm = &scatterGather->Elements[ progress ];
+        DebugPrint(TRACE, DBG_IOCTLS, "Copy request: %d ranges merged into %d, %I64u bytes\n",
+                   list->Count, count, total);
 
-    //]AAhXATCYɓnāA]LbNB
-    HwKickBusMaster( FdoData, FdoData->ScatterGatherWriteToDevice, elm->Address, elm->Length );
+        list->Count = count;
+        copy->Destination = end;
+
+        return STATUS_SUCCESS;
+    }
+
+    HwSortRanges(list->Ranges, list->Count);
+
+    count = 1;
+    for (i = 1; i < list->Count; i++) {
+        end = list->Ranges[count - 1].Offset + list->Ranges[count - 1].Length;
+        if (list->Ranges[i].Offset <= end) {
+            end = max(end, list->Ranges[i].Offset + list->Ranges[i].Length);
+            list->Ranges[count - 1].Length = end - list->Ranges[count - 1].Offset;
+        } else {
+            list->Ranges[count++] = list->Ranges[i];
+        }
+    }
+
+    DebugPrint(TRACE, DBG_IOCTLS, "Range request: %d ranges merged into %d\n",
+               list->Count, count);
+
+    list->Count = count;
+
+    return STATUS_SUCCESS;
 }
 
-VOID
-HwKickBusMaster (
-    __in PFDO_DATA        FdoData,
-    __in BOOLEAN          WriteToDevice,
-    __in PHYSICAL_ADDRESS Address,
-    __in ULONG            Length
-)
+
+NTSTATUS
+HwStartRangeCommand (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Submits the next command of a range request on the submission queue
+    of the current processor, taking the ranges from the end of its list.
+    A Dataset Management command takes up to HW_DSM_MAX_RANGES ranges or
+    pieces of ranges, a Write Zeroes command one piece of the last range,
+    and a Copy command as many blocks as the controller lets it, copied
+    to the end of what is left of the destination. What the command
+    covers is kept in request->Information and trimmed off the list by
+    HwContinueRangeRequest once it succeeded, so that a command replayed
+    after a reset is built again the same way.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         IOCTL request prepared by HwPrepareRangeRequest
+
+Return Value:
+
+    STATUS_PENDING if the IRP was taken, in which case it is completed
+    by the completion path. Any other status means the caller must
+    complete the IRP.
+
+--*/
 {
-    ULONG command;
-    if (WriteToDevice) {
-        command = BIT_BUSMASTER_START_READ;
+    PPCIDRV_RANGE_LIST list = PCIDRV_IRP_RANGE_LIST(Irp);
+    PPCIDRV_RANGE      range;
+    PNVME_LBA_RANGE    entries;
+    PHW_COPY_SOURCE_RANGE sources;
+    PHYSICAL_ADDRESS   entriesPhys;
+    PHW_QUEUE          queue;
+    PHW_REQUEST        request;
+    NVME_COMMAND       command;
+    ULONGLONG          lba, blocks;
+    ULONG              priority, index, whole, pieces, count, slot, piece, left;
+    ULONG              ioctl = IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode;
+
+    ASSERT(list->Count != 0);
+
+    priority = PciDrvGetRequestPriority(Irp);
+
+    queue = HwGetSubmissionQueue(FdoData, priority);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
     }
-    else {
-        command = BIT_BUSMASTER_START_WRITE;
+
+    request = HwAllocateRequest(queue, FdoData->PriorityReserve[priority]);
+    if (request == NULL) {
+        return STATUS_DEVICE_BUSY;
     }
 
-    //oX}X^䃌WX^ZbgAiPy[Ẃj]JnB
-    if(Length % 4) {
-        ASSERTMSG("HwKickBusMaster : Length % 4", FALSE);
-	}
+    RtlZeroMemory(&command, sizeof(command));
+    command.NSID = FdoData->NamespaceId;
+
+    index = list->Count;
+    whole = 0;
+    pieces = 0;
+
+    if (ioctl == IOCTL_DEALLOCATE_RANGES) {
+
+        entries = (PNVME_LBA_RANGE)HwAllocateArenaPages(FdoData, 1, &entriesPhys);
+        if (entries == NULL) {
+            HwFreeRequest(queue, request);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        request->ArenaBuffer = (PUCHAR)entries;
+        request->ArenaPages = 1;
+
+        range = &list->Ranges[index - 1];
+        blocks = range->Length >> FdoData->LbaShift;
+
+        for (count = 0; count < HW_DSM_MAX_RANGES; count++) {
+
+            RtlZeroMemory(&entries[count], sizeof(NVME_LBA_RANGE));
+            lba = range->Offset >> FdoData->LbaShift;
+
+            if (blocks > HW_DSM_PIECE_BLOCKS) {
+                blocks -= HW_DSM_PIECE_BLOCKS;
+                entries[count].StartingLBA = lba + blocks;
+                entries[count].LogicalBlockCount = HW_DSM_PIECE_BLOCKS;
+                pieces++;
+                continue;
+            }
+
+            entries[count].StartingLBA = lba;
+            entries[count].LogicalBlockCount = (ULONG)blocks;
+            whole++;
+            pieces = 0;
+
+            if (--index == 0) {
+                count++;
+                break;
+            }
+            range = &list->Ranges[index - 1];
+            blocks = range->Length >> FdoData->LbaShift;
+        }
+
+        command.CDW0.OPC = NVME_NVM_COMMAND_DATASET_MANAGEMENT;
+        command.PRP1 = entriesPhys.QuadPart;
+        command.u.GENERAL.CDW10 = count - 1;
+        command.u.GENERAL.CDW11 = HW_DSM_ATTRIBUTE_DEALLOCATE;
+
+        request->Information = HW_RANGE_PROGRESS(whole, pieces);
+
+    } else if (ioctl == IOCTL_COPY_RANGES) {
+
+        sources = (PHW_COPY_SOURCE_RANGE)HwAllocateArenaPages(FdoData, 1, &entriesPhys);
+        if (sources == NULL) {
+            HwFreeRequest(queue, request);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        request->ArenaBuffer = (PUCHAR)sources;
+        request->ArenaPages = 1;
 
-    //Kick Bus Master write/read. On Completion, see isrdcp.c.
-   // FdoData->CSRAddress->BusMasterAccessAddress = (ULONG)Address.LowPart;
-   // FdoData->CSRAddress->BusMasterAccessCount = Length / 4;
-  //  FdoData->CSRAddress->BusMasterControlStatus = command;
+        //
+        // Taken from the end of the list, the entries are filled in from
+        // the last one down and moved to the start of the page after.
+        //
+        range = &list->Ranges[index - 1];
+        blocks = range->Length >> FdoData->LbaShift;
+        left = FdoData->CopyMaxBlocks;
+        slot = FdoData->CopyMaxRanges;
+
+        for (count = 0; count < FdoData->CopyMaxRanges && left != 0; count++) {
+
+            piece = (ULONG)min(blocks, min(FdoData->CopyMaxRangeBlocks, left));
+            blocks -= piece;
+            left -= piece;
+
+            slot--;
+            RtlZeroMemory(&sources[slot], sizeof(HW_COPY_SOURCE_RANGE));
+            sources[slot].StartingLBA = (range->Offset >> FdoData->LbaShift) + blocks;
+            sources[slot].LogicalBlocks = (USHORT)(piece - 1);
+
+            if (blocks == 0) {
+                if (--index == 0) {
+                    count++;
+                    break;
+                }
+                range = &list->Ranges[index - 1];
+                blocks = range->Length >> FdoData->LbaShift;
+            }
+        }
+
+        RtlMoveMemory(sources, &sources[slot], count * sizeof(HW_COPY_SOURCE_RANGE));
+
+        lba = (((PPCIDRV_COPY_LIST)Irp->AssociatedIrp.SystemBuffer)->Destination >>
+               FdoData->LbaShift) - (FdoData->CopyMaxBlocks - left);
+
+        command.CDW0.OPC = HW_NVM_COMMAND_COPY;
+        command.PRP1 = entriesPhys.QuadPart;
+        command.u.GENERAL.CDW10 = (ULONG)lba;
+        command.u.GENERAL.CDW11 = (ULONG)(lba >> 32);
+        command.u.GENERAL.CDW12 = count - 1;    // NR; descriptor format 0
+
+        request->Information = FdoData->CopyMaxBlocks - left;
+
+    } else {
+
+        range = &list->Ranges[index - 1];
+        lba = range->Offset >> FdoData->LbaShift;
+        blocks = range->Length >> FdoData->LbaShift;
+
+        if (blocks > HW_WRITE_ZEROES_PIECE_BLOCKS) {
+            lba += blocks - HW_WRITE_ZEROES_PIECE_BLOCKS;
+            blocks = HW_WRITE_ZEROES_PIECE_BLOCKS;
+            pieces = 1;
+        } else {
+            whole = 1;
+        }
+
+        command.CDW0.OPC = NVME_NVM_COMMAND_WRITE_ZEROES;
+        command.u.GENERAL.CDW10 = (ULONG)lba;
+        command.u.GENERAL.CDW11 = (ULONG)(lba >> 32);
+        command.u.GENERAL.CDW12 = (ULONG)blocks - 1;
+
+        //
+        // The controller generates the PI of the zeroed blocks, so that
+        // reading them back passes the checks of the read path.
+        //
+        if (FdoData->PiType != HW_PI_NONE) {
+            command.u.GENERAL.CDW12 |= HW_PRINFO_PRACT;
+        }
+
+        request->Information = HW_RANGE_PROGRESS(whole, pieces);
+    }
+
+    return HwIssueIrpCommand(queue, request, Irp, &command);
 }
 
+
+BOOLEAN
+HwContinueRangeRequest (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Called by the completion path for every IRP whose command is done.
+    For a range request whose command succeeded, trims what the command
+    covered off the range list, drops what it wrote from the read cache
+    and submits the next command if ranges are left.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         IRP whose command completed
+
+Return Value:
+
+    TRUE if the IRP is waiting on its next command, FALSE if it is to be
+    completed with the status in IoStatus
+
+--*/
+{
+    PPCIDRV_RANGE_LIST list;
+    PPCIDRV_COPY_LIST  copy;
+    PPCIDRV_RANGE      range;
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG_PTR          progress = Irp->IoStatus.Information;
+    ULONGLONG          length;
+    ULONG              whole, pieceBlocks;
+    NTSTATUS           status;
+
+    if (irpStack->MajorFunction != IRP_MJ_DEVICE_CONTROL) {
+        return FALSE;
+    }
+
+    switch (irpStack->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_DEALLOCATE_RANGES:
+    case IOCTL_WRITE_ZEROES:
+    case IOCTL_COPY_RANGES:
+        break;
+    default:
+        return FALSE;
+    }
+
+    Irp->IoStatus.Information = 0;
+
+    if (!NT_SUCCESS(Irp->IoStatus.Status)) {
+        return FALSE;
+    }
+
+    list = PCIDRV_IRP_RANGE_LIST(Irp);
+
+    if (irpStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_COPY_RANGES) {
+
+        //
+        // A copy covered the given number of blocks at the end of the
+        // list and of the destination.
+        //
+        copy = (PPCIDRV_COPY_LIST)Irp->AssociatedIrp.SystemBuffer;
+        length = (ULONGLONG)progress << FdoData->LbaShift;
+        copy->Destination -= length;
+        PciDrvCacheInvalidateRange(FdoData, copy->Destination, length);
+
+        while (length != 0) {
+            range = &list->Ranges[list->Count - 1];
+            if (range->Length > length) {
+                range->Length -= length;
+                break;
+            }
+            length -= range->Length;
+            list->Count--;
+        }
+
+    } else {
+
+        pieceBlocks = irpStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_DEALLOCATE_RANGES ?
+                      HW_DSM_PIECE_BLOCKS : HW_WRITE_ZEROES_PIECE_BLOCKS;
+
+        for (whole = HW_RANGE_PROGRESS_WHOLE(progress); whole != 0; whole--) {
+            range = &list->Ranges[--list->Count];
+            PciDrvCacheInvalidateRange(FdoData, range->Offset, range->Length);
+        }
+
+        if (HW_RANGE_PROGRESS_PIECES(progress) != 0) {
+            range = &list->Ranges[list->Count - 1];
+            length = ((ULONGLONG)HW_RANGE_PROGRESS_PIECES(progress) * pieceBlocks) << FdoData->LbaShift;
+            range->Length -= length;
+            PciDrvCacheInvalidateRange(FdoData, range->Offset + range->Length, length);
+        }
+    }
+
+    if (list->Count == 0) {
+        return FALSE;
+    }
+
+    if (IoSetCancelRoutine(Irp, NULL) == NULL || Irp->Cancel) {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        return FALSE;
+    }
+
+    status = HwStartRangeCommand(FdoData, Irp);
+    if (status == STATUS_PENDING) {
+        return TRUE;
+    }
+
+    Irp->IoStatus.Status = status;
+    return FALSE;
+}
+
+
+BOOLEAN
+HwCopyOffloaded (
+    __in  PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Tells whether IOCTL_COPY_RANGES goes to the Copy command of the
+    controller. Namespaces with PI are copied by the host, which has the
+    controller strip and insert the PI and so gets the reference tags of
+    the destination right.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    TRUE if the controller copies
+
+--*/
+{
+    return (BOOLEAN)(FdoData->CopySupported && FdoData->PiType == HW_PI_NONE);
+}
+
+
+static
+NTSTATUS
+HwCopySubmit (
+    __in    PFDO_DATA     FdoData,
+    __inout PHW_COPY_SLOT Slot,
+    __in    ULONG         Priority
+    )
+/*++
+Routine Description:
+
+    Submits the read or the write of the chunk of a host copy slot on the
+    submission queue of the current processor. The data goes to or comes
+    from the arena run of the slot.
+
+--*/
+{
+    PHW_QUEUE    queue;
+    PHW_REQUEST  request;
+    NVME_COMMAND command;
+    ULONGLONG    lba = Slot->Writing ? Slot->Destination : Slot->Source;
+    ULONG        pages, i;
+    NTSTATUS     status;
+
+    queue = HwGetSubmissionQueue(FdoData, Priority);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    request = HwAllocateRequest(queue, FdoData->PriorityReserve[Priority]);
+    if (request == NULL) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = Slot->Writing ? NVME_NVM_COMMAND_WRITE : NVME_NVM_COMMAND_READ;
+    command.NSID = FdoData->NamespaceId;
+    command.u.GENERAL.CDW10 = (ULONG)lba;
+    command.u.GENERAL.CDW11 = (ULONG)(lba >> 32);
+    command.u.GENERAL.CDW12 = Slot->Blocks - 1;
+
+    //
+    // The run is physically contiguous.
+    //
+    command.PRP1 = Slot->BufferPhys.QuadPart;
+    pages = (ULONG)BYTES_TO_PAGES((ULONGLONG)Slot->Blocks << FdoData->LbaShift);
+    if (pages == 2) {
+        command.PRP2 = Slot->BufferPhys.QuadPart + PAGE_SIZE;
+    } else if (pages > 2) {
+        for (i = 1; i < pages; i++) {
+            request->PrpList[i - 1] = Slot->BufferPhys.QuadPart + (ULONGLONG)i * PAGE_SIZE;
+        }
+        command.PRP2 = request->PrpListPhys.QuadPart;
+    }
+
+    //
+    // Only namespaces whose PI the controller inserts and strips get
+    // here with PI.
+    //
+    if (FdoData->PiType != HW_PI_NONE) {
+        command.u.GENERAL.CDW12 |= HW_PRINFO_PRACT;
+        if (!Slot->Writing) {
+            command.u.GENERAL.CDW12 |= HW_PRINFO_CHECK_GUARD;
+        }
+        if (FdoData->PiType != HW_PI_TYPE3) {
+            if (!Slot->Writing) {
+                command.u.GENERAL.CDW12 |= HW_PRINFO_CHECK_REF_TAG;
+            }
+            command.u.GENERAL.CDW14 = (ULONG)lba;       // initial reference tag
+        }
+    }
+
+    KeClearEvent(&Slot->Event);
+    request->Event = &Slot->Event;
+    request->Result = &Slot->Result;
+    request->StartTime = KeQueryInterruptTime();
+
+    status = HwSubmitRequest(queue, request, &command);
+    if (!NT_SUCCESS(status)) {
+        HwFreeRequest(queue, request);
+        return status;
+    }
+
+    Slot->Queue = queue;
+    Slot->Request = request;
+    Slot->Busy = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+HwCopyWait (
+    __in    PFDO_DATA     FdoData,
+    __inout PHW_COPY_SLOT Slot
+    )
+/*++
+Routine Description:
+
+    Waits for the command of a host copy slot, for at most the I/O
+    timeout. If the interrupt does not show up in time the queue is
+    reaped by hand once before the command is given up; a command given
+    up on keeps the arena run of the slot until its id is freed, so that
+    the run is not reused while the controller may still access it.
+
+--*/
+{
+    PHW_QUEUE     queue = Slot->Queue;
+    PHW_REQUEST   request = Slot->Request;
+    LARGE_INTEGER timeout;
+    KIRQL         oldIrql;
+    NTSTATUS      status = STATUS_SUCCESS;
+
+    Slot->Busy = FALSE;
+
+    timeout.QuadPart = -10000000LL * FdoData->Parameters.IoTimeout;
+    if (KeWaitForSingleObject(&Slot->Event, Executive, KernelMode, FALSE, &timeout)
+                == STATUS_TIMEOUT) {
+
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+        HwProcessCompletionQueue(queue);
+        KeLowerIrql(oldIrql);
+
+        //
+        // An id that is no longer ours was taken back by a reset, which
+        // also stopped the controller from using the run.
+        //
+        KeAcquireSpinLock(&queue->SubmissionLock, &oldIrql);
+        if (KeReadStateEvent(&Slot->Event) == 0) {
+            if (request->InUse && request->Event == &Slot->Event) {
+                request->Event = NULL;
+                request->Result = NULL;
+                request->ArenaBuffer = Slot->Buffer;
+                request->ArenaPages = Slot->Pages;
+                Slot->Buffer = NULL;
+            }
+            status = STATUS_IO_TIMEOUT;
+        }
+        KeReleaseSpinLock(&queue->SubmissionLock, oldIrql);
+
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(ERROR, DBG_HW_ACCESS, "Copy %s of LBA %I64u timed out\n",
+                       Slot->Writing ? "write" : "read",
+                       Slot->Writing ? Slot->Destination : Slot->Source);
+            return status;
+        }
+    }
+
+    return HwCompletionStatus(&Slot->Result);
+}
+
+
+NTSTATUS
+HwCopyRangesByHost (
+    __in  PFDO_DATA FdoData,
+    __in  PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Carries out an IOCTL_COPY_RANGES request prepared by
+    HwPrepareRangeRequest when the controller does not copy itself. The
+    ranges are cut into chunks from the end of the list; every slot reads
+    a chunk into its arena run and writes it out from there, and the
+    slots take turns, so that up to HW_COPY_SLOTS commands are out at a
+    time. The range list is left as it is.
+
+    Runs in the thread of the caller, at PASSIVE_LEVEL, and returns once
+    no command of the request is left outstanding. A failed or cancelled
+    copy may have written part of the destination.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         The IOCTL request
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PPCIDRV_COPY_LIST  copy = (PPCIDRV_COPY_LIST)Irp->AssociatedIrp.SystemBuffer;
+    PPCIDRV_RANGE_LIST list = &copy->Sources;
+    HW_COPY_SLOT       slots[HW_COPY_SLOTS];
+    PHW_COPY_SLOT      slot;
+    ULONGLONG          source, blocks, destination;
+    ULONG              priority, pages, chunkBlocks, slotCount, busy, index, next;
+    NTSTATUS           status = STATUS_SUCCESS, slotStatus;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    //
+    // The chunk is the largest number of blocks a run and a command hold.
+    //
+    pages = min(HW_COPY_CHUNK_PAGES, FdoData->MaxTransferSize >> PAGE_SHIFT);
+    chunkBlocks = (pages << PAGE_SHIFT) >> FdoData->LbaShift;
+    if (chunkBlocks == 0) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    for (slotCount = 0; slotCount < HW_COPY_SLOTS; slotCount++) {
+        slot = &slots[slotCount];
+        RtlZeroMemory(slot, sizeof(HW_COPY_SLOT));
+        slot->Buffer = HwAllocateArenaPages(FdoData, pages, &slot->BufferPhys);
+        if (slot->Buffer == NULL) {
+            break;
+        }
+        slot->Pages = pages;
+        KeInitializeEvent(&slot->Event, NotificationEvent, FALSE);
+    }
+
+    if (slotCount == 0) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    priority = PciDrvGetRequestPriority(Irp);
+
+    index = list->Count;
+    source = list->Ranges[index - 1].Offset >> FdoData->LbaShift;
+    blocks = list->Ranges[index - 1].Length >> FdoData->LbaShift;
+    destination = copy->Destination >> FdoData->LbaShift;
+    busy = 0;
+
+    for (next = 0; ; next = (next + 1) % slotCount) {
+
+        slot = &slots[next];
+
+        //
+        // A slot whose read is done writes its chunk out; one whose write
+        // is done, or that never started, takes the next chunk.
+        //
+        if (slot->Busy) {
+
+            slotStatus = HwCopyWait(FdoData, slot);
+            busy--;
+
+            if (NT_SUCCESS(status)) {
+                status = !NT_SUCCESS(slotStatus) ? slotStatus :
+                         Irp->Cancel ? STATUS_CANCELLED : STATUS_SUCCESS;
+            }
+
+            if (NT_SUCCESS(status) && !slot->Writing) {
+                slot->Writing = TRUE;
+                status = HwCopySubmit(FdoData, slot, priority);
+                if (NT_SUCCESS(status)) {
+                    busy++;
+                }
+                continue;
+            }
+        }
+
+        if (!NT_SUCCESS(status) || index == 0) {
+            if (busy == 0) {
+                break;
+            }
+            continue;
+        }
+
+        slot->Blocks = (ULONG)min(blocks, chunkBlocks);
+        blocks -= slot->Blocks;
+        slot->Source = source + blocks;
+        destination -= slot->Blocks;
+        slot->Destination = destination;
+        slot->Writing = FALSE;
+
+        if (blocks == 0 && --index != 0) {
+            source = list->Ranges[index - 1].Offset >> FdoData->LbaShift;
+            blocks = list->Ranges[index - 1].Length >> FdoData->LbaShift;
+        }
+
+        status = HwCopySubmit(FdoData, slot, priority);
+        if (NT_SUCCESS(status)) {
+            busy++;
+        }
+    }
+
+    for (next = 0; next < slotCount; next++) {
+        if (slots[next].Buffer != NULL) {
+            HwFreeArenaPages(FdoData, slots[next].Buffer, slots[next].Pages);
+        }
+    }
+
+    DebugPrint(TRACE, DBG_IOCTLS, "Host copy of %d ranges with %d slots: 0x%x\n",
+               list->Count, slotCount, status);
+
+    return status;
+}
@@ -0,0 +1,318 @@
+/*++
+
+Module Name:
+
+    hw_stream.c
+
+Abstract:
+
+    Contains the write streams: tagging writes so that the device can
+    keep data written together, and likely to be overwritten together,
+    in the same erase units, which cuts its garbage collection and write
+    amplification when hot and cold data are written at once.
+
+    A handle picks a stream with IOCTL_SET_HANDLE_STREAM. The streams are
+    set up at every start of the controller, for the registry value
+    "WriteStreams": if Flexible Data Placement is enabled on the endurance
+    group of the namespace, stream n is its n-th placement handle;
+    otherwise the Streams directive is enabled and streams are allocated
+    to the namespace. A device that has neither runs without streams.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "hw_stream.tmh"
+#endif
+
+static
+BOOLEAN
+HwSetupPlacement(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Requested
+    );
+
+static
+VOID
+HwSetupStreamsDirective(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Requested
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwSetupWriteStreams)
+#pragma alloc_text (PAGE, HwSetupPlacement)
+#pragma alloc_text (PAGE, HwSetupStreamsDirective)
+#endif
+
+
+static
+BOOLEAN
+HwSetupPlacement(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Requested
+    )
+/*++
+Routine Description:
+
+    Uses the placement handles of the namespace as streams if Flexible
+    Data Placement is enabled on its endurance group. The driver does not
+    change the FDP configuration, which is only possible while the
+    endurance group holds no namespace. Overwrites the identify buffer.
+
+--*/
+{
+    PHW_RUH_STATUS        ruhStatus;
+    NVME_COMMAND          command;
+    NVME_COMPLETION_ENTRY completion;
+    ULONG                 i, count;
+    NTSTATUS              status;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_GET_FEATURES;
+    command.u.GENERAL.CDW10 = HW_FEATURE_FDP;
+    command.u.GENERAL.CDW11 = FdoData->EnduranceGroup;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, &completion);
+    if (!NT_SUCCESS(status) || (completion.DW0 & HW_FDP_ENABLED) == 0) {
+        return FALSE;
+    }
+
+    //
+    // The status of the reclaim unit handles lists the placement handles
+    // of the namespace in order, with the placement id to tag writes with.
+    //
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = HW_NVM_COMMAND_IO_MGMT_RECEIVE;
+    command.NSID = FdoData->NamespaceId;
+    command.PRP1 = MmGetPhysicalAddress(FdoData->buf_va).QuadPart;
+    command.u.GENERAL.CDW10 = HW_IO_MGMT_RUH_STATUS;
+    command.u.GENERAL.CDW11 = PAGE_SIZE / sizeof(ULONG) - 1;
+
+    status = HwSubmitIoCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Reclaim unit handle status failed 0x%x\n", status);
+        return FALSE;
+    }
+
+    ruhStatus = (PHW_RUH_STATUS)FdoData->buf_va;
+
+    count = min((ULONG)ruhStatus->NRUHSD,
+                (PAGE_SIZE - FIELD_OFFSET(HW_RUH_STATUS, Descriptors)) /
+                    sizeof(HW_RUH_STATUS_DESCRIPTOR));
+    count = min(count, Requested);
+    if (count == 0) {
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++) {
+        FdoData->PlacementIds[i] = ruhStatus->Descriptors[i].PID;
+    }
+
+    FdoData->StreamMode = PCIDRV_STREAM_MODE_PLACEMENT;
+    FdoData->Streams = count;
+
+    DebugPrint(INFO, DBG_INIT, "FDP: %d of %d placement handles used as streams\n",
+               count, ruhStatus->NRUHSD);
+
+    return TRUE;
+}
+
+
+static
+VOID
+HwSetupStreamsDirective(
+    __in PFDO_DATA FdoData,
+    __in ULONG     Requested
+    )
+/*++
+Routine Description:
+
+    Enables the Streams directive and allocates streams to the namespace,
+    unless a previous start left some allocated. Overwrites the identify
+    buffer.
+
+--*/
+{
+    PHW_STREAM_PARAMETERS parameters;
+    NVME_COMMAND          command;
+    NVME_COMPLETION_ENTRY completion;
+    ULONG                 allocated;
+    NTSTATUS              status;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_DIRECTIVE_RECEIVE;
+    command.NSID = FdoData->NamespaceId;
+    command.PRP1 = MmGetPhysicalAddress(FdoData->buf_va).QuadPart;
+    command.u.GENERAL.CDW10 = PAGE_SIZE / sizeof(ULONG) - 1;
+    command.u.GENERAL.CDW11 = (HW_DIRECTIVE_TYPE_IDENTIFY << HW_DIRECTIVE_TYPE_SHIFT) |
+                              HW_DIRECTIVE_RETURN_PARAMETERS;
+
+    //
+    // The first byte is the bitmap of the directive types supported.
+    //
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status) ||
+        (*(PUCHAR)FdoData->buf_va & (1 << HW_DIRECTIVE_TYPE_STREAMS)) == 0) {
+        DebugPrint(INFO, DBG_INIT, "Streams directive not supported\n");
+        return;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_DIRECTIVE_SEND;
+    command.NSID = FdoData->NamespaceId;
+    command.u.GENERAL.CDW11 = (HW_DIRECTIVE_TYPE_IDENTIFY << HW_DIRECTIVE_TYPE_SHIFT) |
+                              HW_DIRECTIVE_ENABLE;
+    command.u.GENERAL.CDW12 = (HW_DIRECTIVE_TYPE_STREAMS << HW_DIRECTIVE_TYPE_SHIFT) |
+                              HW_DIRECTIVE_ENABLE_DIRECTIVE;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Enabling the Streams directive failed 0x%x\n", status);
+        return;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_DIRECTIVE_RECEIVE;
+    command.NSID = FdoData->NamespaceId;
+    command.PRP1 = MmGetPhysicalAddress(FdoData->buf_va).QuadPart;
+    command.u.GENERAL.CDW10 = sizeof(HW_STREAM_PARAMETERS) / sizeof(ULONG) - 1;
+    command.u.GENERAL.CDW11 = (HW_DIRECTIVE_TYPE_STREAMS << HW_DIRECTIVE_TYPE_SHIFT) |
+                              HW_DIRECTIVE_RETURN_PARAMETERS;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Streams parameters failed 0x%x\n", status);
+        return;
+    }
+
+    parameters = (PHW_STREAM_PARAMETERS)FdoData->buf_va;
+
+    FdoData->StreamsAvailable = parameters->NSSA;
+    FdoData->StreamWriteSize = parameters->SWS << FdoData->LbaShift;
+    FdoData->StreamGranularity = parameters->SGS * FdoData->StreamWriteSize;
+    allocated = parameters->NSA;
+
+    if (allocated == 0) {
+
+        RtlZeroMemory(&command, sizeof(command));
+        command.CDW0.OPC = NVME_ADMIN_COMMAND_DIRECTIVE_RECEIVE;
+        command.NSID = FdoData->NamespaceId;
+        command.u.GENERAL.CDW11 = (HW_DIRECTIVE_TYPE_STREAMS << HW_DIRECTIVE_TYPE_SHIFT) |
+                                  HW_DIRECTIVE_ALLOCATE;
+        command.u.GENERAL.CDW12 = Requested;
+
+        status = HwSubmitAdminCommandSync(FdoData, &command, &completion);
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(ERROR, DBG_INIT, "Allocating %d streams failed 0x%x\n",
+                       Requested, status);
+            return;
+        }
+        allocated = completion.DW0 & 0xFFFF;
+    }
+
+    FdoData->Streams = min(allocated, Requested);
+    if (FdoData->Streams != 0) {
+        FdoData->StreamMode = PCIDRV_STREAM_MODE_DIRECTIVE;
+    }
+
+    DebugPrint(INFO, DBG_INIT, "Streams: %d of %d requested, %d left in the subsystem\n",
+               FdoData->Streams, Requested, FdoData->StreamsAvailable);
+    DebugPrint(INFO, DBG_INIT, "Streams: write size %d, granularity %d\n",
+               FdoData->StreamWriteSize, FdoData->StreamGranularity);
+}
+
+
+VOID
+HwSetupWriteStreams(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Sets up the write streams asked for by the device parameters. Called
+    at every start once the I/O queues exist, since a controller reset
+    disables the directives. Streams that cannot be set up are no error;
+    writes then go out untagged.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG requested = FdoData->Parameters.WriteStreams;
+
+    PAGED_CODE();
+
+    FdoData->StreamMode = PCIDRV_STREAM_MODE_NONE;
+    FdoData->Streams = 0;
+    FdoData->StreamsAvailable = 0;
+    FdoData->StreamWriteSize = 0;
+    FdoData->StreamGranularity = 0;
+
+    if (requested == 0) {
+        return;
+    }
+
+    if (FdoData->PlacementSupported && HwSetupPlacement(FdoData, requested)) {
+        return;
+    }
+
+    if (FdoData->DirectivesSupported) {
+        HwSetupStreamsDirective(FdoData, requested);
+    }
+}
+
+
+VOID
+HwTagWriteStream(
+    __in    PFDO_DATA     FdoData,
+    __inout PNVME_COMMAND Command,
+    __in    ULONG         Stream,
+    __in    ULONG         Length
+    )
+/*++
+Routine Description:
+
+    Tags a write command with a stream and accounts it to the stream.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Command     Write command being built
+    Stream      Stream id, 1 to FdoData->Streams
+    Length      Bytes written
+
+Return Value:
+
+    None
+
+--*/
+{
+    ASSERT(Stream != 0 && Stream <= FdoData->Streams);
+
+    if (FdoData->StreamMode == PCIDRV_STREAM_MODE_PLACEMENT) {
+        Command->u.GENERAL.CDW12 |= HW_DIRECTIVE_TYPE_PLACEMENT << HW_WRITE_DTYPE_SHIFT;
+        Command->u.GENERAL.CDW13 |= (ULONG)FdoData->PlacementIds[Stream - 1] << HW_WRITE_DSPEC_SHIFT;
+    } else {
+        Command->u.GENERAL.CDW12 |= HW_DIRECTIVE_TYPE_STREAMS << HW_WRITE_DTYPE_SHIFT;
+        Command->u.GENERAL.CDW13 |= Stream << HW_WRITE_DSPEC_SHIFT;
+    }
+
+    InterlockedIncrement64((PLONG64)&FdoData->StreamWrites[Stream - 1]);
+    InterlockedExchangeAdd64((PLONG64)&FdoData->StreamBytes[Stream - 1], Length);
+}
@@ -0,0 +1,495 @@
+/*++
+
+Module Name:
+
+    hw_timer.c
+
+Abstract:
+
+    Contains the per-queue timer wheels that put a deadline on every I/O
+    command, and the recovery that runs when a command misses it: first
+    the command is aborted, and if that does not help the controller is
+    reset, the queues are re-created and the commands that were in flight
+    are submitted again.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "hw_timer.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwResetController)
+#pragma alloc_text (PAGE, HwResetWorker)
+#endif
+
+//
+// Commands aborted by one tick of one queue. Anything beyond that goes
+// straight to a reset: that many commands timing out at once means the
+// controller is not going to answer Aborts either.
+//
+#define HW_ABORTS_PER_TICK      8
+
+typedef struct _HW_EXPIRED_COMMAND {
+    PIRP    Irp;
+    USHORT  CommandId;
+    USHORT  Generation;
+} HW_EXPIRED_COMMAND, *PHW_EXPIRED_COMMAND;
+
+
+VOID
+HwResetTimerWheel(
+    __in PHW_QUEUE Queue
+    )
+/*++
+Routine Description:
+
+    Empties the timer wheel of a queue. Called with no command outstanding.
+
+Arguments:
+
+    Queue       Queue owning the wheel
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    Queue->WheelTick = 0;
+
+    for (i = 0; i < HW_WHEEL_SLOTS; i++) {
+        InitializeListHead(&Queue->TimerWheel[0][i]);
+        InitializeListHead(&Queue->TimerWheel[1][i]);
+    }
+}
+
+
+static
+VOID
+HwInsertTimer(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request
+    )
+/*++
+Routine Description:
+
+    Links a command into the slot of its deadline: level 0 if it expires
+    within HW_WHEEL_SLOTS ticks, level 1 otherwise. The deadline is always
+    in the future and less than HW_WHEEL_SLOTS * HW_WHEEL_SLOTS ticks away.
+
+--*/
+{
+    ULONG delta = Request->Deadline - Queue->WheelTick;
+
+    ASSERT(delta != 0 && delta < HW_WHEEL_SLOTS * HW_WHEEL_SLOTS);
+
+    if (delta < HW_WHEEL_SLOTS) {
+        InsertTailList(&Queue->TimerWheel[0][Request->Deadline & HW_WHEEL_MASK],
+                       &Request->TimerLink);
+    } else {
+        InsertTailList(&Queue->TimerWheel[1][(Request->Deadline >> HW_WHEEL_SHIFT) & HW_WHEEL_MASK],
+                       &Request->TimerLink);
+    }
+}
+
+
+VOID
+HwArmRequestTimeout(
+    __in PHW_QUEUE   Queue,
+    __in PHW_REQUEST Request
+    )
+/*++
+Routine Description:
+
+    Starts the deadline of a command being submitted. Called with the
+    submission lock of the queue held.
+
+Arguments:
+
+    Queue       Queue the command is submitted on
+    Request     Context of the command
+
+Return Value:
+
+    None
+
+--*/
+{
+    Request->Deadline = Queue->WheelTick + Queue->FdoData->IoTimeoutTicks;
+    HwInsertTimer(Queue, Request);
+}
+
+
+VOID
+HwDisarmRequestTimeout(
+    __in PHW_REQUEST Request
+    )
+/*++
+Routine Description:
+
+    Takes a command off the wheel. Called with the submission lock of the
+    queue held; harmless if the command was never armed.
+
+Arguments:
+
+    Request     Context of the command
+
+Return Value:
+
+    None
+
+--*/
+{
+    RemoveEntryList(&Request->TimerLink);
+    InitializeListHead(&Request->TimerLink);
+}
+
+
+static
+ULONG
+HwAdvanceTimerWheel(
+    __in    PHW_QUEUE           Queue,
+    __out   PHW_EXPIRED_COMMAND Expired,
+    __inout PBOOLEAN            ResetNeeded
+    )
+/*++
+Routine Description:
+
+    Moves the wheel of a queue on by one tick. A command that misses its
+    deadline for the first time is re-armed for HW_ABORT_GRACE and
+    returned so that it can be aborted; one that misses it again asks
+    for a reset and is re-armed for the next tick, which asks again if
+    the reset could not be queued. Called with the submission lock of
+    the queue held.
+
+Arguments:
+
+    Queue          Queue owning the wheel
+    Expired        Receives up to HW_ABORTS_PER_TICK commands to abort
+    ResetNeeded    Set to TRUE if the controller has to be reset
+
+Return Value:
+
+    Number of entries returned in Expired
+
+--*/
+{
+    PHW_REQUEST request;
+    LIST_ENTRY  due;
+    PLIST_ENTRY slot;
+    ULONG       tick;
+    ULONG       count = 0;
+
+    tick = ++Queue->WheelTick;
+
+    InitializeListHead(&due);
+
+    if ((tick & HW_WHEEL_MASK) == 0) {
+        slot = &Queue->TimerWheel[1][(tick >> HW_WHEEL_SHIFT) & HW_WHEEL_MASK];
+        while (!IsListEmpty(slot)) {
+            InsertTailList(&due, RemoveHeadList(slot));
+        }
+    }
+
+    slot = &Queue->TimerWheel[0][tick & HW_WHEEL_MASK];
+    while (!IsListEmpty(slot)) {
+        InsertTailList(&due, RemoveHeadList(slot));
+    }
+
+    while (!IsListEmpty(&due)) {
+
+        request = CONTAINING_RECORD(RemoveHeadList(&due), HW_REQUEST, TimerLink);
+
+        if ((LONG)(request->Deadline - tick) > 0) {
+            HwInsertTimer(Queue, request);          // cascaded from level 1
+            continue;
+        }
+
+        if (request->TimedOut) {
+            request->Deadline = tick + 1;
+            HwInsertTimer(Queue, request);
+            *ResetNeeded = TRUE;
+            continue;
+        }
+
+        request->TimedOut = TRUE;
+        request->Deadline = tick + HW_ABORT_GRACE / HW_TIMER_TICK;
+        HwInsertTimer(Queue, request);
+
+        if (count < HW_ABORTS_PER_TICK) {
+            Expired[count].Irp = request->Irp;
+            Expired[count].Generation = request->Generation;
+            Expired[count].CommandId = request->CommandId;
+            count++;
+        } else {
+            *ResetNeeded = TRUE;
+        }
+    }
+
+    return count;
+}
+
+
+VOID
+HwTimeoutDpc(
+    __in     PKDPC Dpc,
+    __in_opt PVOID DeferredContext,
+    __in_opt PVOID SystemArgument1,
+    __in_opt PVOID SystemArgument2
+    )
+/*++
+Routine Description:
+
+    Periodic timer DPC. Advances the wheel of every I/O queue, aborts the
+    commands that just expired and queues a reset work item when an
+    Abort did not get a command back in time.
+
+Arguments:
+
+    Dpc                 Not used
+    DeferredContext     Pointer to our FdoData
+    SystemArgument1/2   Not used
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA          fdoData = (PFDO_DATA)DeferredContext;
+    HW_EXPIRED_COMMAND expired[HW_ABORTS_PER_TICK];
+    PHW_QUEUE          queue;
+    BOOLEAN            resetNeeded = FALSE;
+    ULONG              q, i, count;
+    NTSTATUS           status;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (!fdoData->ControllerEnabled) {
+        return;
+    }
+
+    for (q = 0; q < fdoData->IoQueueCount; q++) {
+
+        queue = fdoData->IoQueues[q];
+
+        KeAcquireSpinLockAtDpcLevel(&queue->SubmissionLock);
+        count = HwAdvanceTimerWheel(queue, expired, &resetNeeded);
+        KeReleaseSpinLockFromDpcLevel(&queue->SubmissionLock);
+
+        for (i = 0; i < count; i++) {
+            DebugPrint(ERROR, DBG_DPC, "SQ %d cid %d timed out\n",
+                       queue->QueueId, expired[i].CommandId);
+            HwAbortRequest(queue,
+                           expired[i].CommandId,
+                           expired[i].Generation,
+                           expired[i].Irp);
+        }
+    }
+
+    if (resetNeeded &&
+        InterlockedCompareExchange(&fdoData->ResetPending, 1, 0) == 0) {
+
+        //
+        // The work item counts as an outstanding request so that stop and
+        // remove wait for the reset to finish.
+        //
+        PciDrvIoIncrement(fdoData);
+
+        status = PciDrvQueuePassiveLevelCallback(fdoData, HwResetWorker, NULL, NULL);
+        if (!NT_SUCCESS(status)) {
+            InterlockedExchange(&fdoData->ResetPending, 0);
+            PciDrvIoDecrement(fdoData);
+        }
+    }
+}
+
+
+static
+VOID
+HwReplayRequest(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Submits the command of an IRP that was in flight when the controller
+    was reset again, unless the IRP was cancelled in the meantime. A range
+    request goes on with the command that was in flight. A Zone Append
+    is failed instead: it may have been written already, and a second
+    one would land somewhere else.
+
+--*/
+{
+    NTSTATUS status = STATUS_CANCELLED;
+    ULONG    ioctl;
+
+    if (IoSetCancelRoutine(Irp, NULL) != NULL && !Irp->Cancel) {
+        if (IoGetCurrentIrpStackLocation(Irp)->MajorFunction != IRP_MJ_DEVICE_CONTROL) {
+            status = HwStartReadWrite(FdoData, Irp);
+        } else {
+            ioctl = IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode;
+            if (ioctl == IOCTL_ZONE_APPEND) {
+                status = STATUS_IO_DEVICE_ERROR;
+            } else if (ioctl == IOCTL_REPORT_ZONES || ioctl == IOCTL_MANAGE_ZONES) {
+                status = HwStartZoneCommand(FdoData, Irp);
+            } else {
+                status = HwStartRangeCommand(FdoData, Irp);
+            }
+        }
+    }
+
+    if (status != STATUS_PENDING) {
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        HwCompleteIrp(FdoData, Irp);
+    }
+}
+
+
+NTSTATUS
+HwResetController(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Recovers from commands the controller does not answer. Completions
+    already posted are reaped, the controller is disabled and brought up
+    again with fresh queues, and the commands that were in flight are
+    submitted again. Commands that timed out themselves are failed with
+    STATUS_IO_TIMEOUT rather than replayed. New requests are held
+    meanwhile, as over a stop, and dispatched once the queues are back.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    LIST_ENTRY irps;
+    PIRP       irp;
+    KIRQL      oldIrql;
+    ULONG      q;
+    BOOLEAN    hold;
+    NTSTATUS   status;
+
+    PAGED_CODE();
+
+    KeWaitForSingleObject(&FdoData->RecoveryMutex, Executive, KernelMode, FALSE, NULL);
+
+    //
+    // Stopped or removed while the work item was queued.
+    //
+    if (!FdoData->ControllerEnabled) {
+        KeReleaseMutex(&FdoData->RecoveryMutex, FALSE);
+        return STATUS_SUCCESS;
+    }
+
+    DebugPrint(ERROR, DBG_HW_ACCESS, "Command timeout, resetting the controller\n");
+
+    hold = (BOOLEAN)(FdoData->QueueState == AllowRequests);
+    if (hold) {
+        FdoData->QueueState = HoldRequests;
+    }
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    for (q = 0; q < FdoData->IoQueueCount; q++) {
+        HwProcessCompletionQueue(FdoData->IoQueues[q]);
+    }
+    KeLowerIrql(oldIrql);
+
+    HwStopController(FdoData, FALSE);
+
+    InitializeListHead(&irps);
+    HwDetachOutstandingRequests(FdoData, &irps);
+
+    status = HwStartController(FdoData);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_HW_ACCESS, "Controller reset failed 0x%x\n", status);
+    }
+
+    while (!IsListEmpty(&irps)) {
+
+        irp = CONTAINING_RECORD(RemoveHeadList(&irps), IRP, Tail.Overlay.ListEntry);
+
+        if (NT_SUCCESS(status) && irp->IoStatus.Status == STATUS_PENDING) {
+            HwReplayRequest(FdoData, irp);
+            continue;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            irp->IoStatus.Status = status;
+        }
+        irp->IoStatus.Information = 0;
+        HwCompleteIrp(FdoData, irp);
+    }
+
+    //
+    // Unless a stop or a power down took over the queue meanwhile.
+    //
+    if (hold && FdoData->QueueState == HoldRequests &&
+        FdoData->DevicePnPState == Started &&
+        FdoData->DevicePowerState == PowerDeviceD0) {
+        FdoData->QueueState = AllowRequests;
+        PciDrvProcessQueuedRequests(FdoData);
+    }
+
+    KeReleaseMutex(&FdoData->RecoveryMutex, FALSE);
+
+    return status;
+}
+
+
+VOID
+HwResetWorker(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PVOID          Context
+    )
+/*++
+Routine Description:
+
+    Work item queued by the timeout DPC to reset the controller at
+    PASSIVE_LEVEL.
+
+Arguments:
+
+    DeviceObject    Pointer to our device object
+    Context         Work item context
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA            fdoData = (PFDO_DATA)DeviceObject->DeviceExtension;
+    PWORKER_ITEM_CONTEXT workItemContext = Context;
+
+    PAGED_CODE();
+
+    HwResetController(fdoData);
+
+    InterlockedExchange(&fdoData->ResetPending, 0);
+
+    PciDrvIoDecrement(fdoData);
+
+    IoFreeWorkItem((PIO_WORKITEM)workItemContext->WorkItem);
+    PciDrvFreeToLookaside(&Globals.WorkItemPool, workItemContext);
+}
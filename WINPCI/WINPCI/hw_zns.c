@@ -0,0 +1,352 @@
+/*++
+
+Module Name:
+
+    hw_zns.c
+
+Abstract:
+
+    Contains the support of zoned namespaces (ZNS): finding out whether
+    the namespace is zoned and its zone geometry, and the Zone Management
+    Send, Zone Management Receive and Zone Append commands behind the zone
+    IOCTLs. These run on the I/O queue of the current processor like
+    reads and writes and complete through the same path.
+
+    Zone Append is what lets many threads write one zone at once: the
+    commands carry the start of the zone instead of an LBA, the device
+    places each at the write pointer as it gets to it and reports where
+    it went, so the host does not serialize the writes of a zone.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "hw_zns.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HwIdentifyZones)
+#endif
+
+
+NTSTATUS
+HwIdentifyZones(
+    __in PFDO_DATA FdoData,
+    __in ULONG     FormatIndex
+    )
+/*++
+Routine Description:
+
+    Finds out whether the namespace is zoned and, if it is, reads its
+    zone size, its open and active zone limits and the Zone Append size
+    limit of the controller. Called at start once the namespace is
+    identified; overwrites the identify buffer.
+
+Arguments:
+
+    FdoData      Pointer to our FdoData
+    FormatIndex  LBA format the namespace is formatted with
+
+Return Value:
+
+    NT status code. A namespace that is not zoned is no error.
+
+--*/
+{
+    PHW_ZNS_NAMESPACE_DATA ns;
+    NVME_COMMAND           command;
+    PUCHAR                 descriptor, end;
+    UCHAR                  csi = 0;
+    UCHAR                  zasl;
+    NTSTATUS               status;
+
+    PAGED_CODE();
+
+    FdoData->Zoned = FALSE;
+
+    if (!FdoData->ControllerCaps.CSS_MultipleIo) {
+        return STATUS_SUCCESS;
+    }
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.CDW0.OPC = NVME_ADMIN_COMMAND_IDENTIFY;
+    command.NSID = FdoData->NamespaceId;
+    command.PRP1 = MmGetPhysicalAddress(FdoData->buf_va).QuadPart;
+    command.u.GENERAL.CDW10 = HW_IDENTIFY_CNS_NS_DESCRIPTORS;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Identify NS descriptors failed 0x%x\n", status);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Descriptors follow each other with a 4 byte header; a zero type
+    // ends the list.
+    //
+    descriptor = (PUCHAR)FdoData->buf_va;
+    end = descriptor + PAGE_SIZE;
+    while (descriptor + 4 < end && descriptor[0] != 0) {
+        if (descriptor[0] == HW_NID_TYPE_CSI && descriptor[1] >= 1) {
+            csi = descriptor[4];
+        }
+        descriptor += 4 + descriptor[1];
+    }
+
+    if (csi != HW_CSI_ZONED) {
+        return STATUS_SUCCESS;
+    }
+
+    command.u.GENERAL.CDW10 = HW_IDENTIFY_CNS_CSI_NAMESPACE;
+    command.u.GENERAL.CDW11 = HW_CSI_ZONED << HW_IDENTIFY_CSI_SHIFT;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Identify ZNS namespace failed 0x%x\n", status);
+        return status;
+    }
+
+    ns = (PHW_ZNS_NAMESPACE_DATA)FdoData->buf_va;
+
+    FdoData->ZoneBlocks = ns->LBAFE[FormatIndex].ZSZE;
+    FdoData->MaxActiveZones = ns->MAR == HW_ZONE_LIMIT_NONE ? 0 : ns->MAR + 1;
+    FdoData->MaxOpenZones = ns->MOR == HW_ZONE_LIMIT_NONE ? 0 : ns->MOR + 1;
+
+    if (FdoData->ZoneBlocks == 0 || FdoData->ZoneBlocks > FdoData->NamespaceBlocks) {
+        DebugPrint(ERROR, DBG_INIT, "Unsupported zone size %I64u\n", FdoData->ZoneBlocks);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    command.NSID = 0;
+    command.u.GENERAL.CDW10 = HW_IDENTIFY_CNS_CSI_CONTROLLER;
+
+    status = HwSubmitAdminCommandSync(FdoData, &command, NULL);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Identify ZNS controller failed 0x%x\n", status);
+        return status;
+    }
+
+    //
+    // ZASL is a power of two in units of the minimum page size, 0 for the
+    // transfer limit.
+    //
+    zasl = *(PUCHAR)FdoData->buf_va;
+    FdoData->ZoneAppendLimit = FdoData->MaxTransferSize;
+    if (zasl != 0 && zasl + 12 + FdoData->ControllerCaps.MPSMIN < 32) {
+        FdoData->ZoneAppendLimit = min(FdoData->ZoneAppendLimit,
+                                       1UL << (zasl + 12 + FdoData->ControllerCaps.MPSMIN));
+    }
+
+    FdoData->Zoned = TRUE;
+
+    DebugPrint(INFO, DBG_INIT, "NS 1: zoned, %I64u zones of %I64u blocks, append %d\n",
+               FdoData->NamespaceBlocks / FdoData->ZoneBlocks, FdoData->ZoneBlocks,
+               FdoData->ZoneAppendLimit);
+    DebugPrint(INFO, DBG_INIT, "NS 1: %d open, %d active zones (0 for no limit)\n",
+               FdoData->MaxOpenZones, FdoData->MaxActiveZones);
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+HwCheckZoneStart(
+    __in  PFDO_DATA  FdoData,
+    __in  ULONGLONG  Offset,
+    __out PULONGLONG Lba
+    )
+/*++
+Routine Description:
+
+    Turns the byte offset of the start of a zone into its LBA.
+
+--*/
+{
+    if ((Offset & ((1UL << FdoData->LbaShift) - 1)) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *Lba = Offset >> FdoData->LbaShift;
+    if (*Lba >= FdoData->NamespaceBlocks) {
+        return STATUS_NONEXISTENT_SECTOR;
+    }
+
+    if (*Lba % FdoData->ZoneBlocks != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+HwStartZoneCommand(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Checks a zone IOCTL and turns it into one command on the submission
+    queue of the current processor: Zone Management Receive for
+    IOCTL_REPORT_ZONES, Zone Management Send for IOCTL_MANAGE_ZONES and
+    Zone Append for IOCTL_ZONE_APPEND. The report goes straight to the
+    buffer of the caller, and so does the data of an append.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         The IOCTL request
+
+Return Value:
+
+    STATUS_PENDING if the IRP was taken, in which case it is completed
+    by the completion path. Any other status means the caller must
+    complete the IRP.
+
+--*/
+{
+    PIO_STACK_LOCATION          irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG                       inputLength = irpStack->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG                       outputLength = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID                       input = Irp->AssociatedIrp.SystemBuffer;
+    PMDL                        mdl = Irp->MdlAddress;
+    PPCIDRV_ZONE_REPORT_REQUEST report;
+    PPCIDRV_ZONE_ACTION         action;
+    PHW_QUEUE                   queue;
+    PHW_REQUEST                 request;
+    NVME_COMMAND                command;
+    ULONGLONG                   lba = 0;
+    ULONG                       priority;
+    NTSTATUS                    status;
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.NSID = FdoData->NamespaceId;
+
+    switch (irpStack->Parameters.DeviceIoControl.IoControlCode) {
+
+    case IOCTL_REPORT_ZONES:
+
+        report = (PPCIDRV_ZONE_REPORT_REQUEST)input;
+        if (input == NULL || inputLength < sizeof(PCIDRV_ZONE_REPORT_REQUEST) ||
+            report->State > PCIDRV_ZONE_STATE_OFFLINE ||
+            mdl == NULL || outputLength < FIELD_OFFSET(PCIDRV_ZONE_REPORT, Descriptors) ||
+            (outputLength & 3) != 0 || (MmGetMdlByteOffset(mdl) & 3) != 0) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (outputLength > FdoData->MaxTransferSize) {
+            return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        lba = report->Offset >> FdoData->LbaShift;
+        if (lba >= FdoData->NamespaceBlocks) {
+            return STATUS_NONEXISTENT_SECTOR;
+        }
+
+        command.CDW0.OPC = HW_NVM_COMMAND_ZONE_MGMT_RECEIVE;
+        command.u.GENERAL.CDW10 = (ULONG)lba;
+        command.u.GENERAL.CDW11 = (ULONG)(lba >> 32);
+        command.u.GENERAL.CDW12 = outputLength / sizeof(ULONG) - 1;
+        command.u.GENERAL.CDW13 = HW_ZONE_REPORT_ZONES |
+                                  (report->State << HW_ZONE_REPORT_STATE_SHIFT) |
+                                  HW_ZONE_REPORT_PARTIAL;
+        break;
+
+    case IOCTL_MANAGE_ZONES:
+
+        action = (PPCIDRV_ZONE_ACTION)input;
+        if (input == NULL || inputLength < sizeof(PCIDRV_ZONE_ACTION) ||
+            action->Action < PCIDRV_ZONE_CLOSE || action->Action > PCIDRV_ZONE_OFFLINE) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (action->AllZones) {
+            command.u.GENERAL.CDW13 = HW_ZONE_SELECT_ALL;
+        } else {
+            status = HwCheckZoneStart(FdoData, action->Offset, &lba);
+            if (!NT_SUCCESS(status)) {
+                return status;
+            }
+        }
+
+        command.CDW0.OPC = HW_NVM_COMMAND_ZONE_MGMT_SEND;
+        command.u.GENERAL.CDW10 = (ULONG)lba;
+        command.u.GENERAL.CDW11 = (ULONG)(lba >> 32);
+        command.u.GENERAL.CDW13 |= action->Action;
+        break;
+
+    case IOCTL_ZONE_APPEND:
+
+        //
+        // The PI reference tag of an append is not known before the device
+        // places it, so namespaces with PI take no appends.
+        //
+        if (FdoData->PiType != HW_PI_NONE) {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        if (input == NULL || inputLength < sizeof(PCIDRV_ZONE_APPEND) ||
+            mdl == NULL || outputLength == 0 || outputLength != MmGetMdlByteCount(mdl) ||
+            (outputLength & ((1UL << FdoData->LbaShift) - 1)) != 0 ||
+            (MmGetMdlByteOffset(mdl) & 3) != 0) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (outputLength > FdoData->ZoneAppendLimit) {
+            return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        status = HwCheckZoneStart(FdoData, ((PPCIDRV_ZONE_APPEND)input)->Zone, &lba);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        command.CDW0.OPC = HW_NVM_COMMAND_ZONE_APPEND;
+        command.u.GENERAL.CDW10 = (ULONG)lba;
+        command.u.GENERAL.CDW11 = (ULONG)(lba >> 32);
+        command.u.GENERAL.CDW12 = (outputLength >> FdoData->LbaShift) - 1;
+        break;
+
+    default:
+        ASSERT(FALSE);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    priority = PciDrvGetRequestPriority(Irp);
+
+    queue = HwGetSubmissionQueue(FdoData, priority);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    request = HwAllocateRequest(queue, FdoData->PriorityReserve[priority]);
+    if (request == NULL) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    if (command.CDW0.OPC != HW_NVM_COMMAND_ZONE_MGMT_SEND) {
+        status = HwBuildPrpList(request, mdl, &command);
+        if (!NT_SUCCESS(status)) {
+            HwFreeRequest(queue, request);
+            return status;
+        }
+        KeFlushIoBuffers(mdl, command.CDW0.OPC == HW_NVM_COMMAND_ZONE_MGMT_RECEIVE, TRUE);
+    }
+
+    if (command.CDW0.OPC == HW_NVM_COMMAND_ZONE_MGMT_RECEIVE) {
+        request->Information = outputLength;
+    } else if (command.CDW0.OPC == HW_NVM_COMMAND_ZONE_APPEND) {
+        if (FdoData->MetadataSize != 0) {
+            command.MPTR = request->MetadataPhys.QuadPart;
+        }
+        request->ZoneAppend = TRUE;
+        request->ZoneStart = lba;
+    }
+
+    return HwIssueIrpCommand(queue, request, Irp, &command);
+}
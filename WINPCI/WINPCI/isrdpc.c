@@ -27,6 +27,51 @@ Environment:
 #include "ISRDPC.tmh"
 #endif
 
+static
+VOID
+HwScheduleCompletionDpc(
+    __in    PFDO_DATA FdoData,
+    __in    PHW_QUEUE Queue,
+    __inout PBOOLEAN  Recognized
+    )
+/*++
+Routine Description:
+
+    Queues the completion DPC of a queue that has new entries. The
+    interrupt is masked before the first DPC is queued so that the DPC
+    which drops the pending count to zero is always the one to unmask.
+
+Arguments:
+
+    FdoData     Pointer to our adapter
+    Queue       Queue to look at
+    Recognized  Set to TRUE once the interrupt has been claimed
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (!HwQueueCompletionPending(Queue)) {
+        return;
+    }
+
+    if (!*Recognized) {
+        *Recognized = TRUE;
+        HwWriteRegisterULong(&FdoData->controller_regs->INTMS,
+                             HW_INTERRUPT_VECTOR_MASK);
+    }
+
+    InterlockedIncrement(&FdoData->CompletionDpcsPending);
+    if (!KeInsertQueueDpc(&Queue->CompletionDpc, NULL, NULL)) {
+        //
+        // Already queued; that instance accounts for this queue.
+        //
+        InterlockedDecrement(&FdoData->CompletionDpcsPending);
+    }
+}
+
 BOOLEAN
 HwInterruptHandler(
     __in PKINTERRUPT  Interupt,
@@ -35,7 +80,9 @@ HwInterruptHandler(
 /*++
 Routine Description:
 
-    Interrupt handler for the device.
+    Interrupt handler for the device. All queues share one vector, so
+    every queue is checked for new completion entries and the DPC of each
+    such queue is queued; I/O queue DPCs run on the CPU owning the queue.
 
 Arguments:
 
@@ -48,169 +95,73 @@ Return Value:
 
 --*/
 {
-   //BOOLEAN   interruptRecognized = FALSE;
-  //  PFDO_DATA fdoData = (PFDO_DATA)ServiceContext;
-   // ULONG     intStatus;
+    PFDO_DATA fdoData = (PFDO_DATA)ServiceContext;
+    BOOLEAN   interruptRecognized = FALSE;
+    ULONG     i;
 
-    BOOLEAN   interruptRecognized = TRUE;
     DebugPrint(TRACE, DBG_INTERRUPT, "--> HwInterruptHandler\n");
-#if 0
-    do
-    {
-        //
-        // If the adapter is in low power state, then it should not
-        // recognize any interrupt
-        //
-        if (fdoData->DevicePowerState > PowerDeviceD0)
-        {
-            break;
-        }
-        //
-        // We process the interrupt if it's not disabled and it's active
-        //
-
-        intStatus = HW_GET_INTERRUPT_STATUS(fdoData);
-
-        if (!HW_INTERRUPT_DISABLED(fdoData) && intStatus)
-        {
-            interruptRecognized = TRUE;
-
-            if(intStatus & BIT_INT_SWITCH)
-            {
-                LONG result;
-                result = InterlockedIncrement(&fdoData->SwitchCount);
-            }
 
-            if(intStatus & BIT_INT_BUS_MASTER)
-            {
-                fdoData->BusMasterDone = TRUE;
-            }
-
-            //
-            // Acknowledge the interrupt(s) and get the interrupt status
-            //
-
-            HW_ACK_INTERRUPT(fdoData, intStatus);
+    //
+    // If the adapter is in low power state, then it should not
+    // recognize any interrupt
+    //
+    if (fdoData->DevicePowerState > PowerDeviceD0 ||
+        !fdoData->ControllerEnabled) {
+        return FALSE;
+    }
 
-            DebugPrint(TRACE, DBG_INTERRUPT, "Requesting DPC\n");
+    HwScheduleCompletionDpc(fdoData, fdoData->AdminQueue, &interruptRecognized);
 
-            IoRequestDpc(fdoData->Self, NULL, fdoData);
+    for (i = 0; i < fdoData->IoQueueCount; i++) {
+        HwScheduleCompletionDpc(fdoData, fdoData->IoQueues[i], &interruptRecognized);
+    }
 
-        }
-    }while (FALSE);
-#endif
     DebugPrint(TRACE, DBG_INTERRUPT, "<-- HwInterruptHandler\n");
 
     return interruptRecognized;
 }
 
 VOID
-HwDpcForIsr(    //HwInterruptHandler()݃[`NDPC[`B
+HwCompletionDpc(
     PKDPC            Dpc,
-    PDEVICE_OBJECT   DeviceObject,
-    PIRP             Irp, //Unused
-    PVOID            Context
+    PVOID            DeferredContext,
+    PVOID            SystemArgument1,
+    PVOID            SystemArgument2
     )
 
 /*++
 
 Routine Description:
 
-    DPC callback for ISR.
+    Per-queue completion DPC queued by the ISR. Reaps the completion
+    queue; the last outstanding DPC unmasks the interrupt again.
 
 Arguments:
 
-    DeviceObject - Pointer to the device object.
+    Dpc - Unused.
 
-    Context - MiniportAdapterContext.
+    DeferredContext - Pointer to the HW_QUEUE.
 
-    Irp - Unused.
+    SystemArgument1 - Unused.
 
-    Context - Pointer to FDO_DATA.
+    SystemArgument2 - Unused.
 
 Return Value:
 
 --*/
 {
-    //NTSTATUS     status;
-   // PFDO_DATA FdoData = (PFDO_DATA) Context;
-   // PIRP irp;
-   // ULONG switchCount;
-
-    DebugPrint(TRACE, DBG_DPC, "--> HwDpcForIsr\n");
-
-#if 0
-    //Handle PushSwitchNotifyIrp
-    switchCount = InterlockedExchange(&FdoData->SwitchCount, 0);
-    if( switchCount ) {
-
-        irp = FdoData->PushSwitchNotifyIrp;
-
-        if(irp) {
-            if(IoSetCancelRoutine(irp, NULL)) {
-                //it's not been canceled.
-                FdoData->PushSwitchNotifyIrp = NULL;
-                irp->IoStatus.Status = STATUS_SUCCESS;
-                IoCompleteRequest(irp, IO_NO_INCREMENT);
-                PciDrvIoDecrement ( FdoData );
-            }
-        }
-    }
+    PHW_QUEUE queue = (PHW_QUEUE)DeferredContext;
+    PFDO_DATA fdoData = queue->FdoData;
+
+    DebugPrint(TRACE, DBG_DPC, "--> HwCompletionDpc %d\n", queue->QueueId);
+
+    HwProcessCompletionQueue(queue);
 
-    //oX}X^ݏB
-    if(FdoData->BusMasterDone) {
-
-        FdoData->BusMasterDone = FALSE;
-
-        //Handle it !!
-        irp = FdoData->ReadWriteIrp;
-        if (irp) {
-            //oX}X^̃A{[gXe[^XmFB
-            if(FdoData->CSRAddress->BusMasterControlStatus & BIT_BUSMASTER_ABORT_STATUS) {
-                status = STATUS_IO_DEVICE_ERROR;
-            }
-            else {
-                PSCATTER_GATHER_LIST    scatterGather = FdoData->ScatterGather;
-                ULONG                   progress      = FdoData->ScatterGatherProgress;
-
-                status = STATUS_SUCCESS;
-                //AvP[V֕Ԃ[h^Cg̊TCYXVB
-                irp->IoStatus.Information += scatterGather->Elements[ progress ].Length;
-
-                //]iJE^CNgB
-                FdoData->ScatterGatherProgress++;
-
-                //NGXg̃LZvsĂ邩mFB
-                if(irp->Cancel){
-                    status = STATUS_CANCELLED;
-                }
-                //]y[W邩mFB
-                else if (FdoData->ScatterGatherProgress < scatterGather->NumberOfElements) {
-                    //̕y[W̃oX}X^]JnB
-                    HwKickBusMasterReadWrite(FdoData);
-                    status = STATUS_PENDING;
-                }
-            }
-
-            //Sy[W̓]A܂̓G[̏ꍇB
-            if(status != STATUS_PENDING) {
-                //XLb^MUXgjB
-            	FdoData->DmaAdapterObject->DmaOperations->PutScatterGatherList(
-                                            FdoData->DmaAdapterObject,
-                                            FdoData->ScatterGather,
-                                            FdoData->ScatterGatherWriteToDevice
-                                            );
-
-                //[h^CgNGXgB
-            	FdoData->ReadWriteIrp = NULL;
-               	irp->IoStatus.Status = status;
-            	IoCompleteRequest(irp, IO_NO_INCREMENT);
-            	PciDrvIoDecrement (FdoData);
-            }
-        }
+    if (InterlockedDecrement(&fdoData->CompletionDpcsPending) == 0 &&
+        fdoData->ControllerEnabled) {
+        HwWriteRegisterULong(&fdoData->controller_regs->INTMC,
+                             HW_INTERRUPT_VECTOR_MASK);
     }
-#endif
-    DebugPrint(TRACE, DBG_DPC, "<-- HwDpcForIsr\n");
 
+    DebugPrint(TRACE, DBG_DPC, "<-- HwCompletionDpc\n");
 }
-
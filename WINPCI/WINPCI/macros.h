@@ -78,5 +78,52 @@ HwWriteRegisterULong (
     WRITE_REGISTER_ULONG (x,y);
 }
 
+//
+// 64-bit controller registers are accessed as two dwords, low part first,
+// so the same code works on 32-bit platforms.
+//
+__inline
+ULONGLONG
+HwReadRegisterULong64 (
+    __in  ULONGLONG * x
+    )
+{
+    ULARGE_INTEGER value;
+
+    value.LowPart = READ_REGISTER_ULONG ((PULONG)x);
+    value.HighPart = READ_REGISTER_ULONG ((PULONG)x + 1);
+    return value.QuadPart;
+}
+
+__inline
+VOID
+HwWriteRegisterULong64 (
+    __in  ULONGLONG * x,
+    __in  ULONGLONG   y
+    )
+{
+    ULARGE_INTEGER value;
+
+    value.QuadPart = y;
+    WRITE_REGISTER_ULONG ((PULONG)x, value.LowPart);
+    WRITE_REGISTER_ULONG ((PULONG)x + 1, value.HighPart);
+}
+
+__inline
+BOOLEAN
+HwQueueCompletionPending (
+    __in  PHW_QUEUE Queue
+    )
+{
+    volatile NVME_COMPLETION_ENTRY *entry;
+
+    if (Queue == NULL || !Queue->Created) {
+        return FALSE;
+    }
+
+    entry = &Queue->CompletionQueue[Queue->CompletionHead];
+    return (BOOLEAN)(entry->DW3.Status.P == Queue->CompletionPhase);
+}
+
 
 
@@ -0,0 +1,380 @@
+/*++
+
+Module Name:
+
+    params.c
+
+Abstract:
+
+    Contains the device parameters: the REG_DWORD tunables under the
+    "Device Parameters" key of the device. The key is enumerated once
+    when the device starts, and every value the driver knows is checked
+    against its schema entry and kept in FdoData->Parameters, so that
+    start does not open the key and query it once per tunable.
+
+    While the device is started the key stays open with a change
+    notification armed on it. When a value changes the key is read
+    again; tunables marked PCIDRV_PARAMETER_RUNTIME take effect right
+    away, the others at the next start.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "params.tmh"
+#endif
+
+//
+// How a tunable is read. Every tunable is a REG_DWORD; values out of
+// [Minimum, Maximum] are clamped.
+//
+typedef struct _PCIDRV_PARAMETER_SCHEMA {
+    PCWSTR          Name;
+    ULONG           Offset;         // of the ULONG in PCIDRV_PARAMETERS
+    ULONG           Default;
+    ULONG           Minimum;
+    ULONG           Maximum;
+    ULONG           Flags;          // PCIDRV_PARAMETER_xxx
+} PCIDRV_PARAMETER_SCHEMA, *PPCIDRV_PARAMETER_SCHEMA;
+
+#define PCIDRV_PARAMETER_RUNTIME        0x00000001  // applied without a restart
+
+#define PCIDRV_PARAMETER(_name, _default, _min, _max, _flags) \
+    { L ## #_name, FIELD_OFFSET(PCIDRV_PARAMETERS, _name), (_default), (_min), (_max), (_flags) }
+
+static const PCIDRV_PARAMETER_SCHEMA PciDrvParameterSchema[] = {
+    PCIDRV_PARAMETER(PriorityQueues, 1, 0, 1, 0),
+    PCIDRV_PARAMETER(QueueNodePlacement, HW_NODE_PLACEMENT_PROCESSOR,
+                     HW_NODE_PLACEMENT_PROCESSOR, HW_NODE_PLACEMENT_DEVICE, 0),
+    PCIDRV_PARAMETER(IoQueueDepth, HW_IO_QUEUE_DEPTH_DEFAULT,
+                     HW_IO_QUEUE_DEPTH_MIN, HW_IO_QUEUE_DEPTH_MAX, 0),
+    PCIDRV_PARAMETER(IoTimeout, HW_IO_TIMEOUT_DEFAULT, 1, HW_IO_TIMEOUT_MAX,
+                     PCIDRV_PARAMETER_RUNTIME),
+    PCIDRV_PARAMETER(ReadCacheSize, 0, 0, PCIDRV_CACHE_MAX_SIZE, 0),
+    PCIDRV_PARAMETER(StripeMembers, 0, 0, PCIDRV_STRIPE_MAX_MEMBERS, 0),
+    PCIDRV_PARAMETER(StripeIndex, 0, 0, PCIDRV_STRIPE_MAX_MEMBERS - 1, 0),
+    PCIDRV_PARAMETER(StripeSize, 128, 4, 1024, 0),
+    PCIDRV_PARAMETER(StripeMirror, 0, 0, 1, 0),
+    PCIDRV_PARAMETER(WriteStreams, 0, 0, PCIDRV_STREAM_MAX_STREAMS, 0),
+    PCIDRV_PARAMETER(CmbQueues, 1, 0, 1, 0),
+    PCIDRV_PARAMETER(HostMemoryBufferSize, 128, 0, PCIDRV_HMB_MAX_SIZE, 0),
+    PCIDRV_PARAMETER(ShadowDoorbells, 1, 0, 1, 0),
+    PCIDRV_PARAMETER(LogPageMaxAge, 60, 0, 86400, PCIDRV_PARAMETER_RUNTIME),
+};
+
+#define PCIDRV_PARAMETER_COUNT  (sizeof(PciDrvParameterSchema) / sizeof(PciDrvParameterSchema[0]))
+
+static
+ULONG
+PciDrvReadParameters(
+    __in  HANDLE             Key,
+    __out PPCIDRV_PARAMETERS Parameters
+    );
+
+static
+VOID
+PciDrvArmParameterNotification(
+    __in PFDO_DATA FdoData
+    );
+
+static WORKER_THREAD_ROUTINE PciDrvParametersChanged;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, PciDrvLoadParameters)
+#pragma alloc_text (PAGE, PciDrvUnloadParameters)
+#pragma alloc_text (PAGE, PciDrvReadParameters)
+#pragma alloc_text (PAGE, PciDrvArmParameterNotification)
+#pragma alloc_text (PAGE, PciDrvParametersChanged)
+#endif
+
+
+static
+ULONG
+PciDrvReadParameters(
+    __in  HANDLE             Key,
+    __out PPCIDRV_PARAMETERS Parameters
+    )
+/*++
+Routine Description:
+
+    Sets every tunable to its default and then enumerates the key once,
+    taking the values the schema knows. Values with other names, other
+    types or names too long for the registry buffer are skipped.
+
+Return Value:
+
+    The number of values enumerated, known or not
+
+--*/
+{
+    PKEY_VALUE_FULL_INFORMATION info;
+    UNICODE_STRING              name, schemaName;
+    NTSTATUS                    status;
+    ULONG                       index, length, value, i;
+    PULONG                      field;
+
+    PAGED_CODE();
+
+    for (i = 0; i < PCIDRV_PARAMETER_COUNT; i++) {
+        field = (PULONG)((PUCHAR)Parameters + PciDrvParameterSchema[i].Offset);
+        *field = PciDrvParameterSchema[i].Default;
+    }
+
+    if (Key == NULL) {
+        return 0;
+    }
+
+    info = PciDrvAllocateFromLookaside(&Globals.RegistryPool);
+    if (info == NULL) {
+        return 0;
+    }
+
+    for (index = 0; ; index++) {
+
+        status = ZwEnumerateValueKey(Key,
+                                     index,
+                                     KeyValueFullInformation,
+                                     info,
+                                     PCIDRV_REGISTRY_BUFFER_SIZE,
+                                     &length);
+        if (status == STATUS_BUFFER_OVERFLOW || status == STATUS_BUFFER_TOO_SMALL) {
+            continue;
+        }
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        name.Buffer = info->Name;
+        name.Length = name.MaximumLength = (USHORT)info->NameLength;
+
+        for (i = 0; i < PCIDRV_PARAMETER_COUNT; i++) {
+            RtlInitUnicodeString(&schemaName, PciDrvParameterSchema[i].Name);
+            if (RtlEqualUnicodeString(&name, &schemaName, TRUE)) {
+                break;
+            }
+        }
+        if (i == PCIDRV_PARAMETER_COUNT) {
+            continue;
+        }
+
+        if (info->Type != REG_DWORD || info->DataLength != sizeof(ULONG)) {
+            DebugPrint(ERROR, DBG_INIT, "Parameter %ws is not a REG_DWORD\n",
+                       PciDrvParameterSchema[i].Name);
+            continue;
+        }
+
+        value = *(PULONG)((PUCHAR)info + info->DataOffset);
+        if (value < PciDrvParameterSchema[i].Minimum ||
+            value > PciDrvParameterSchema[i].Maximum) {
+            DebugPrint(ERROR, DBG_INIT, "Parameter %ws = %d is out of range\n",
+                       PciDrvParameterSchema[i].Name, value);
+            value = max(value, PciDrvParameterSchema[i].Minimum);
+            value = min(value, PciDrvParameterSchema[i].Maximum);
+        }
+
+        field = (PULONG)((PUCHAR)Parameters + PciDrvParameterSchema[i].Offset);
+        *field = value;
+    }
+
+    PciDrvFreeToLookaside(&Globals.RegistryPool, info);
+
+    return index;
+}
+
+
+static
+VOID
+PciDrvArmParameterNotification(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Asks to have PciDrvParametersChanged queued when a value of the key
+    is set or deleted. Called with ParametersMutex held.
+
+--*/
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    KeClearEvent(&FdoData->ParametersIdleEvent);
+
+    ExInitializeWorkItem(&FdoData->ParametersWorkItem, PciDrvParametersChanged, FdoData);
+
+    status = ZwNotifyChangeKey(FdoData->ParametersKey,
+                               NULL,
+                               (PIO_APC_ROUTINE)&FdoData->ParametersWorkItem,
+                               (PVOID)(ULONG_PTR)DelayedWorkQueue,
+                               &FdoData->ParametersIoStatus,
+                               REG_NOTIFY_CHANGE_LAST_SET,
+                               FALSE,
+                               NULL,
+                               0,
+                               TRUE);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "ZwNotifyChangeKey failed 0x%x\n", status);
+        KeSetEvent(&FdoData->ParametersIdleEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+
+static
+VOID
+PciDrvParametersChanged(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Work item run when a value of the device key has changed, or when the
+    key was closed. Reads the key again, applies the runtime tunables and
+    arms the notification again.
+
+--*/
+{
+    PFDO_DATA         fdoData = (PFDO_DATA)Context;
+    PCIDRV_PARAMETERS parameters;
+    ULONG             i;
+    PULONG            field;
+
+    PAGED_CODE();
+
+    KeWaitForSingleObject(&fdoData->ParametersMutex, Executive, KernelMode, FALSE, NULL);
+
+    //
+    // The key is gone. Once the event is set PciDrvUnloadParameters may
+    // return and the device be deleted, so it is the last thing touched.
+    //
+    if (fdoData->ParametersKey == NULL ||
+        fdoData->ParametersIoStatus.Status == STATUS_NOTIFY_CLEANUP) {
+        KeReleaseMutex(&fdoData->ParametersMutex, FALSE);
+        KeSetEvent(&fdoData->ParametersIdleEvent, IO_NO_INCREMENT, FALSE);
+        return;
+    }
+
+    //
+    // Arm first so that a change made while we read is not missed.
+    //
+    PciDrvArmParameterNotification(fdoData);
+
+    PciDrvReadParameters(fdoData->ParametersKey, &parameters);
+
+    for (i = 0; i < PCIDRV_PARAMETER_COUNT; i++) {
+        if (PciDrvParameterSchema[i].Flags & PCIDRV_PARAMETER_RUNTIME) {
+            field = (PULONG)((PUCHAR)&fdoData->Parameters + PciDrvParameterSchema[i].Offset);
+            *field = *(PULONG)((PUCHAR)&parameters + PciDrvParameterSchema[i].Offset);
+        }
+    }
+
+    //
+    // Commands already submitted keep the deadline they were armed with.
+    //
+    fdoData->IoTimeoutTicks = HW_IO_TIMEOUT_TICKS(fdoData->Parameters.IoTimeout);
+
+    DebugPrint(INFO, DBG_INIT, "Device parameters changed, I/O timeout %ds\n",
+               fdoData->Parameters.IoTimeout);
+
+    KeReleaseMutex(&fdoData->ParametersMutex, FALSE);
+}
+
+
+VOID
+PciDrvLoadParameters(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Reads the device parameters into FdoData->Parameters and starts
+    watching the key for changes. A missing or unreadable key leaves
+    every tunable at its default. Called when the device starts.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    HANDLE    key = NULL;
+    NTSTATUS  status;
+    ULONG     values;
+    ULONGLONG start = KeQueryInterruptTime();
+
+    PAGED_CODE();
+
+    ASSERT(FdoData->ParametersKey == NULL);
+
+    status = IoOpenDeviceRegistryKey(FdoData->UnderlyingPDO,
+                                     PLUGPLAY_REGKEY_DEVICE,
+                                     KEY_READ | KEY_NOTIFY,
+                                     &key);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Couldn't open the device key 0x%x\n", status);
+        key = NULL;
+    }
+
+    KeWaitForSingleObject(&FdoData->ParametersMutex, Executive, KernelMode, FALSE, NULL);
+
+    values = PciDrvReadParameters(key, &FdoData->Parameters);
+
+    FdoData->ParametersKey = key;
+    if (key != NULL) {
+        PciDrvArmParameterNotification(FdoData);
+    }
+
+    KeReleaseMutex(&FdoData->ParametersMutex, FALSE);
+
+    //
+    // With the start-to-ready time the controller start logs, this tells
+    // what a key with many values costs the start.
+    //
+    DebugPrint(INFO, DBG_INIT, "Device parameters read in %I64d us, %d values in the key\n",
+               (KeQueryInterruptTime() - start) / 10, values);
+}
+
+
+VOID
+PciDrvUnloadParameters(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Stops watching the device key. Closing the key completes the armed
+    notification, whose work item is waited for, so that none runs once
+    the device is gone. FdoData->Parameters keeps its values.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    KeWaitForSingleObject(&FdoData->ParametersMutex, Executive, KernelMode, FALSE, NULL);
+
+    if (FdoData->ParametersKey != NULL) {
+        ZwClose(FdoData->ParametersKey);
+        FdoData->ParametersKey = NULL;
+    }
+
+    KeReleaseMutex(&FdoData->ParametersMutex, FALSE);
+
+    KeWaitForSingleObject(&FdoData->ParametersIdleEvent, Executive, KernelMode, FALSE, NULL);
+}
@@ -0,0 +1,325 @@
+/*++
+
+Module Name:
+
+    pool.c
+
+Abstract:
+
+    Contains the fixed-size pools the driver takes its small, short-lived
+    allocations from: work item contexts, handle contexts, process QoS
+    limiters and registry query buffers. Every pool is a set of lookaside
+    lists, one per processor, so that processors do not contend on one
+    list head; a block may be freed on another processor than the one
+    it was allocated on. The lookaside lists count allocations and the
+    ones that had to go to the general pool.
+
+    The read/write path itself allocates nothing: its per-command state
+    is preallocated for every command id of every queue.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "pool.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, PciDrvInitializePools)
+#pragma alloc_text (PAGE, PciDrvDeletePools)
+#pragma alloc_text (PAGE, PciDrvDeleteLookaside)
+#endif
+
+
+static
+NTSTATUS
+PciDrvInitializeLookaside(
+    __out PPCIDRV_LOOKASIDE Lookaside,
+    __in  POOL_TYPE         PoolType,
+    __in  SIZE_T            Size
+    )
+/*++
+Routine Description:
+
+    Sets up the per-processor lookaside lists of one pool.
+
+--*/
+{
+    ULONG    i;
+    NTSTATUS status;
+
+    RtlZeroMemory(Lookaside, sizeof(PCIDRV_LOOKASIDE));
+
+    Lookaside->Size = (ULONG)Size;
+    Lookaside->ListCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Lookaside->Lists = ExAllocatePoolWithTag(NonPagedPool,
+                                             Lookaside->ListCount * sizeof(LOOKASIDE_LIST_EX),
+                                             PCIDRV_POOL_TAG);
+    if (Lookaside->Lists == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < Lookaside->ListCount; i++) {
+        status = ExInitializeLookasideListEx(&Lookaside->Lists[i],
+                                             NULL,
+                                             NULL,
+                                             PoolType,
+                                             0,
+                                             Size,
+                                             PCIDRV_POOL_TAG,
+                                             0);
+        if (!NT_SUCCESS(status)) {
+            Lookaside->ListCount = i;
+            PciDrvDeleteLookaside(Lookaside);
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+PciDrvDeleteLookaside(
+    __inout PPCIDRV_LOOKASIDE Lookaside
+    )
+/*++
+Routine Description:
+
+    Frees the lookaside lists of a pool and the blocks cached on them.
+    Every block must have been freed.
+
+Arguments:
+
+    Lookaside   Pool to delete
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (Lookaside->Lists == NULL) {
+        return;
+    }
+
+    for (i = 0; i < Lookaside->ListCount; i++) {
+        ExDeleteLookasideListEx(&Lookaside->Lists[i]);
+    }
+
+    ExFreePoolWithTag(Lookaside->Lists, PCIDRV_POOL_TAG);
+    Lookaside->Lists = NULL;
+}
+
+
+PVOID
+PciDrvAllocateFromLookaside(
+    __in PPCIDRV_LOOKASIDE Lookaside
+    )
+/*++
+Routine Description:
+
+    Allocates a block from the list of the current processor. Paged pools
+    may only be used at PASSIVE_LEVEL; the thread moving to another
+    processor meanwhile is harmless.
+
+Arguments:
+
+    Lookaside   Pool to allocate from
+
+Return Value:
+
+    The block, or NULL
+
+--*/
+{
+    ULONG index = KeGetCurrentProcessorNumberEx(NULL) % Lookaside->ListCount;
+
+    return ExAllocateFromLookasideListEx(&Lookaside->Lists[index]);
+}
+
+
+VOID
+PciDrvFreeToLookaside(
+    __in PPCIDRV_LOOKASIDE Lookaside,
+    __in PVOID             Block
+    )
+/*++
+Routine Description:
+
+    Returns a block to the list of the current processor.
+
+Arguments:
+
+    Lookaside   Pool the block was allocated from
+    Block       Block to free
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG index = KeGetCurrentProcessorNumberEx(NULL) % Lookaside->ListCount;
+
+    ExFreeToLookasideListEx(&Lookaside->Lists[index], Block);
+}
+
+
+static
+VOID
+PciDrvQueryLookaside(
+    __in  PPCIDRV_LOOKASIDE     Lookaside,
+    __out PPCIDRV_POOL_COUNTERS Counters
+    )
+/*++
+Routine Description:
+
+    Sums the counters of the lists of a pool. The lists update them
+    without a lock, so the sums are approximate while the pool is in use.
+
+--*/
+{
+    ULONG i;
+
+    RtlZeroMemory(Counters, sizeof(PCIDRV_POOL_COUNTERS));
+
+    Counters->BlockSize = Lookaside->Size;
+
+    for (i = 0; i < Lookaside->ListCount; i++) {
+        Counters->Allocations += Lookaside->Lists[i].L.TotalAllocates;
+        Counters->PoolAllocations += Lookaside->Lists[i].L.AllocateMisses;
+        Counters->Frees += Lookaside->Lists[i].L.TotalFrees;
+    }
+}
+
+
+NTSTATUS
+PciDrvInitializePools(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Creates the driver-wide pools. Called once from DriverEntry.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    NTSTATUS status;
+
+    status = PciDrvInitializeLookaside(&Globals.WorkItemPool,
+                                       NonPagedPool,
+                                       sizeof(WORKER_ITEM_CONTEXT));
+    if (NT_SUCCESS(status)) {
+        status = PciDrvInitializeLookaside(&Globals.FileContextPool,
+                                           NonPagedPool,
+                                           sizeof(PCIDRV_FILE_CONTEXT));
+    }
+    if (NT_SUCCESS(status)) {
+        status = PciDrvInitializeLookaside(&Globals.QosLimiterPool,
+                                           NonPagedPool,
+                                           sizeof(PCIDRV_QOS_LIMITER));
+    }
+    if (NT_SUCCESS(status)) {
+        status = PciDrvInitializeLookaside(&Globals.RegistryPool,
+                                           PagedPool,
+                                           PCIDRV_REGISTRY_BUFFER_SIZE);
+    }
+
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(ERROR, DBG_INIT, "Couldn't create the lookaside pools 0x%x\n", status);
+        PciDrvDeletePools();
+    }
+
+    return status;
+}
+
+
+VOID
+PciDrvDeletePools(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Deletes the driver-wide pools. Called from unload, and from DriverEntry
+    if it fails.
+
+Arguments:
+
+    None
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    PciDrvDeleteLookaside(&Globals.WorkItemPool);
+    PciDrvDeleteLookaside(&Globals.FileContextPool);
+    PciDrvDeleteLookaside(&Globals.QosLimiterPool);
+    PciDrvDeleteLookaside(&Globals.RegistryPool);
+}
+
+
+NTSTATUS
+PciDrvGetPoolStatistics(
+    __in  PIRP   Irp,
+    __out PULONG BytesReturned
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_GET_POOL_STATISTICS. The counters are driver-wide.
+
+Arguments:
+
+    Irp             The IOCTL request
+    BytesReturned   Receives the size of the data returned
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PIO_STACK_LOCATION      irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PPCIDRV_POOL_STATISTICS stats;
+
+    *BytesReturned = 0;
+
+    if (irpStack->Parameters.DeviceIoControl.OutputBufferLength <
+        sizeof(PCIDRV_POOL_STATISTICS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    stats = (PPCIDRV_POOL_STATISTICS)Irp->AssociatedIrp.SystemBuffer;
+
+    PciDrvQueryLookaside(&Globals.WorkItemPool, &stats->WorkItems);
+    PciDrvQueryLookaside(&Globals.FileContextPool, &stats->FileContexts);
+    PciDrvQueryLookaside(&Globals.QosLimiterPool, &stats->QosLimiters);
+    PciDrvQueryLookaside(&Globals.RegistryPool, &stats->RegistryBuffers);
+
+    *BytesReturned = sizeof(PCIDRV_POOL_STATISTICS);
+
+    return STATUS_SUCCESS;
+}
@@ -69,5 +69,431 @@ DEFINE_GUID(GUID_DEVINTERFACE_PCIDRV,
 #define IOCTL_GET_BUS_MASTER_READ_DATA     \
     CTL_CODE (FILE_DEVICE_PCI, 0x8 , METHOD_BUFFERED, FILE_READ_ACCESS)
 
+//
+// Statistics of the handle the request is sent on. Output buffer is a
+// PCIDRV_HANDLE_STATISTICS. Latencies are in 100ns units and cover the
+// read and write requests that completed successfully.
+//
+#define IOCTL_GET_HANDLE_STATISTICS     \
+    CTL_CODE (FILE_DEVICE_PCI, 0x9 , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _PCIDRV_HANDLE_STATISTICS {
+    ULONGLONG   ReadRequests;
+    ULONGLONG   WriteRequests;
+    ULONGLONG   BytesRead;
+    ULONGLONG   BytesWritten;
+    ULONGLONG   TotalLatency;
+    ULONGLONG   MaxLatency;
+    ULONGLONG   ElapsedTime;        // since the handle was opened
+} PCIDRV_HANDLE_STATISTICS, *PPCIDRV_HANDLE_STATISTICS;
+
+//
+// I/O priority class of the handle the request is sent on. Input buffer
+// is a ULONG holding one of the PCIDRV_PRIORITY_xxx values. A handle
+// starts at PCIDRV_PRIORITY_DEFAULT, which takes the class of every read
+// and write from its I/O priority hint.
+//
+#define IOCTL_SET_HANDLE_PRIORITY       \
+    CTL_CODE (FILE_DEVICE_PCI, 0xA , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define PCIDRV_PRIORITY_URGENT          0
+#define PCIDRV_PRIORITY_HIGH            1
+#define PCIDRV_PRIORITY_MEDIUM          2
+#define PCIDRV_PRIORITY_LOW             3
+#define PCIDRV_PRIORITY_DEFAULT         4
+
+//
+// IOPS and bandwidth limits of the handle the request is sent on, or of
+// every handle its process has open on the device. Input buffer is a
+// PCIDRV_QOS_LIMITS; a limit of 0 means unlimited. Reads and writes over
+// the limit are held and released as the limit allows. Raising or
+// removing a limit needs SeIncreaseBasePriorityPrivilege.
+//
+#define IOCTL_SET_QOS_LIMITS            \
+    CTL_CODE (FILE_DEVICE_PCI, 0xB , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define PCIDRV_QOS_SCOPE_HANDLE         0
+#define PCIDRV_QOS_SCOPE_PROCESS        1
+
+typedef struct _PCIDRV_QOS_LIMITS {
+    ULONG       Scope;              // PCIDRV_QOS_SCOPE_xxx
+    ULONG       IopsLimit;          // requests per second
+    ULONG       BandwidthLimit;     // bytes per second
+} PCIDRV_QOS_LIMITS, *PPCIDRV_QOS_LIMITS;
+
+//
+// Counters of the read cache, enabled with the registry value
+// "ReadCacheSize" (MB). All 0 while the cache is off. HitTime is the
+// total time spent serving hits, in 100ns units.
+//
+#define IOCTL_GET_CACHE_STATISTICS      \
+    CTL_CODE (FILE_DEVICE_PCI, 0xC , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _PCIDRV_CACHE_STATISTICS {
+    ULONG       BlockSize;          // bytes
+    ULONG       Capacity;           // blocks
+    ULONGLONG   Lookups;
+    ULONGLONG   Hits;
+    ULONGLONG   Fills;
+    ULONGLONG   Invalidations;
+    ULONGLONG   HitTime;
+} PCIDRV_CACHE_STATISTICS, *PPCIDRV_CACHE_STATISTICS;
+
+//
+// Counters of the driver-wide fixed-size pools. PoolAllocations counts
+// the allocations the lookaside lists could not serve from their cache
+// and passed on to the general pool.
+//
+#define IOCTL_GET_POOL_STATISTICS       \
+    CTL_CODE (FILE_DEVICE_PCI, 0xD , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _PCIDRV_POOL_COUNTERS {
+    ULONG       BlockSize;
+    ULONGLONG   Allocations;
+    ULONGLONG   PoolAllocations;
+    ULONGLONG   Frees;
+} PCIDRV_POOL_COUNTERS, *PPCIDRV_POOL_COUNTERS;
+
+typedef struct _PCIDRV_POOL_STATISTICS {
+    PCIDRV_POOL_COUNTERS    WorkItems;
+    PCIDRV_POOL_COUNTERS    FileContexts;
+    PCIDRV_POOL_COUNTERS    QosLimiters;
+    PCIDRV_POOL_COUNTERS    RegistryBuffers;
+} PCIDRV_POOL_STATISTICS, *PPCIDRV_POOL_STATISTICS;
+
+//
+// Striped or mirrored volume over the controllers whose "StripeMembers"
+// parameter is set. It is opened by name rather than through the device
+// interface and takes reads and writes once every member is present; a
+// mirror goes on with one member in sync.
+//
+#define PCIDRV_STRIPE_DOS_NAME          "\\\\.\\PciDrvStripe"
+
+#define IOCTL_GET_STRIPE_INFORMATION    \
+    CTL_CODE (FILE_DEVICE_PCI, 0xE , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _PCIDRV_STRIPE_INFORMATION {
+    ULONG       Members;
+    ULONG       MembersPresent;
+    ULONG       MembersInSync;      // mirror members read from, 0 if not usable
+    BOOLEAN     Mirrored;
+    ULONG       StripeUnit;         // bytes per member and stripe, 0 if not usable
+    ULONG       BlockSize;
+    ULONGLONG   Length;             // bytes, 0 if not usable
+} PCIDRV_STRIPE_INFORMATION, *PPCIDRV_STRIPE_INFORMATION;
+
+//
+// Deallocation (TRIM) and zeroing of byte ranges of the device. The
+// input buffer is a PCIDRV_RANGE_LIST; offsets and lengths are multiples
+// of the block size. Ranges may come in any order and may overlap: the
+// driver sorts and merges them and packs them into as few commands as it
+// can. Deallocated blocks read back as whatever the device returns for
+// unwritten blocks. Both fail with STATUS_NOT_SUPPORTED if the device
+// lacks the command.
+//
+#define IOCTL_DEALLOCATE_RANGES         \
+    CTL_CODE (FILE_DEVICE_PCI, 0xF , METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define IOCTL_WRITE_ZEROES              \
+    CTL_CODE (FILE_DEVICE_PCI, 0x10, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define PCIDRV_MAX_RANGES               65536
+
+typedef struct _PCIDRV_RANGE {
+    ULONGLONG   Offset;             // bytes
+    ULONGLONG   Length;             // bytes, not 0
+} PCIDRV_RANGE, *PPCIDRV_RANGE;
+
+typedef struct _PCIDRV_RANGE_LIST {
+    ULONG           Count;          // 1 to PCIDRV_MAX_RANGES
+    ULONG           Reserved;
+    PCIDRV_RANGE    Ranges[1];
+} PCIDRV_RANGE_LIST, *PPCIDRV_RANGE_LIST;
+
+//
+// Copy of byte ranges of the device to another place on it. The input
+// buffer is a PCIDRV_COPY_LIST; the source ranges are copied back to
+// back, in list order, to the bytes starting at Destination, which may
+// not overlap any of them. The device copies the data itself if it has
+// the Copy command and the driver moves it through its own buffers
+// otherwise; either way it does not pass through the caller's memory.
+//
+#define IOCTL_COPY_RANGES               \
+    CTL_CODE (FILE_DEVICE_PCI, 0x11, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+typedef struct _PCIDRV_COPY_LIST {
+    ULONGLONG           Destination;    // bytes
+    PCIDRV_RANGE_LIST   Sources;
+} PCIDRV_COPY_LIST, *PPCIDRV_COPY_LIST;
+
+//
+// Zoned namespaces. All of these fail with STATUS_NOT_SUPPORTED unless the
+// namespace is zoned. Offsets are in bytes; the zone report is passed on
+// as the device returns it, so its zone starts, capacities and write
+// pointers are in blocks.
+//
+// IOCTL_REPORT_ZONES takes a PCIDRV_ZONE_REPORT_REQUEST and fills the
+// output buffer with a PCIDRV_ZONE_REPORT of the zones from the one
+// holding Offset on, as many as fit; Zones counts the descriptors
+// returned.
+//
+// IOCTL_MANAGE_ZONES takes a PCIDRV_ZONE_ACTION.
+//
+// IOCTL_ZONE_APPEND takes a PCIDRV_ZONE_APPEND as its input buffer and the
+// data as its output buffer, and writes the data at the write pointer of
+// the zone. Any number of appends may be outstanding on a zone at once;
+// the device decides where each one goes, and the number of bytes
+// returned is the offset, in blocks from the start of the zone, that the
+// data was written at.
+//
+#define IOCTL_GET_ZONE_INFORMATION      \
+    CTL_CODE (FILE_DEVICE_PCI, 0x12, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_REPORT_ZONES              \
+    CTL_CODE (FILE_DEVICE_PCI, 0x13, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+#define IOCTL_MANAGE_ZONES              \
+    CTL_CODE (FILE_DEVICE_PCI, 0x14, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define IOCTL_ZONE_APPEND               \
+    CTL_CODE (FILE_DEVICE_PCI, 0x15, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+typedef struct _PCIDRV_ZONE_INFORMATION {
+    ULONGLONG   ZoneSize;           // bytes
+    ULONGLONG   Zones;
+    ULONG       BlockSize;
+    ULONG       MaxAppendSize;      // bytes per IOCTL_ZONE_APPEND
+    ULONG       MaxOpenZones;       // 0 for no limit
+    ULONG       MaxActiveZones;     // 0 for no limit
+} PCIDRV_ZONE_INFORMATION, *PPCIDRV_ZONE_INFORMATION;
+
+//
+// Zone states, as the State filter of a report (0 reports every zone)
+//
+#define PCIDRV_ZONE_STATE_EMPTY             1
+#define PCIDRV_ZONE_STATE_IMPLICITLY_OPEN   2
+#define PCIDRV_ZONE_STATE_EXPLICITLY_OPEN   3
+#define PCIDRV_ZONE_STATE_CLOSED            4
+#define PCIDRV_ZONE_STATE_FULL              5
+#define PCIDRV_ZONE_STATE_READ_ONLY         6
+#define PCIDRV_ZONE_STATE_OFFLINE           7
+
+typedef struct _PCIDRV_ZONE_REPORT_REQUEST {
+    ULONGLONG   Offset;
+    ULONG       State;              // PCIDRV_ZONE_STATE_xxx, 0 for all
+    ULONG       Reserved;
+} PCIDRV_ZONE_REPORT_REQUEST, *PPCIDRV_ZONE_REPORT_REQUEST;
+
+typedef struct _PCIDRV_ZONE_DESCRIPTOR {
+    UCHAR       Type;               // 2 for sequential write required
+    UCHAR       State;              // in the high nibble, see PCIDRV_ZONE_DESCRIPTOR_STATE
+    UCHAR       Attributes;
+    UCHAR       AttributesInformation;
+    ULONG       Reserved0;
+    ULONGLONG   Capacity;           // blocks
+    ULONGLONG   Start;              // LBA
+    ULONGLONG   WritePointer;       // LBA
+    UCHAR       Reserved1[32];
+} PCIDRV_ZONE_DESCRIPTOR, *PPCIDRV_ZONE_DESCRIPTOR;
+
+//
+// State of a descriptor: the first four states have the numbers above,
+// the others these.
+//
+#define PCIDRV_ZONE_DESCRIPTOR_STATE(_descriptor)   ((_descriptor)->State >> 4)
+
+#define PCIDRV_ZONE_DESCRIPTOR_READ_ONLY    0xD
+#define PCIDRV_ZONE_DESCRIPTOR_FULL         0xE
+#define PCIDRV_ZONE_DESCRIPTOR_OFFLINE      0xF
+
+typedef struct _PCIDRV_ZONE_REPORT {
+    ULONGLONG               Zones;
+    UCHAR                   Reserved[56];
+    PCIDRV_ZONE_DESCRIPTOR  Descriptors[1];
+} PCIDRV_ZONE_REPORT, *PPCIDRV_ZONE_REPORT;
+
+//
+// Zone actions, numbered like the Zone Send Action of the device
+//
+#define PCIDRV_ZONE_CLOSE               1
+#define PCIDRV_ZONE_FINISH              2
+#define PCIDRV_ZONE_OPEN                3
+#define PCIDRV_ZONE_RESET               4
+#define PCIDRV_ZONE_OFFLINE             5
+
+typedef struct _PCIDRV_ZONE_ACTION {
+    ULONGLONG   Offset;             // start of the zone, ignored with AllZones
+    ULONG       Action;             // PCIDRV_ZONE_xxx
+    BOOLEAN     AllZones;
+} PCIDRV_ZONE_ACTION, *PPCIDRV_ZONE_ACTION;
+
+typedef struct _PCIDRV_ZONE_APPEND {
+    ULONGLONG   Zone;               // start of the zone
+} PCIDRV_ZONE_APPEND, *PPCIDRV_ZONE_APPEND;
+
+//
+// Write stream of the handle the request is sent on. Input buffer is a
+// ULONG: 0 for none, or a stream id from 1 to the Streams returned by
+// IOCTL_GET_STREAM_INFORMATION. Writes sent on the handle carry the
+// stream, so that the device keeps data written to one stream together;
+// handles writing data of different lifetimes should use different
+// streams. Writes of a stream the device no longer offers, e.g. after a
+// reset, go out untagged.
+//
+#define IOCTL_SET_HANDLE_STREAM         \
+    CTL_CODE (FILE_DEVICE_PCI, 0x16 , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Write streams of the device, set up at start for the registry value
+// "WriteStreams" with the Streams directive, or on the placement handles
+// of the namespace if Flexible Data Placement is enabled on the device.
+// Output buffer is a PCIDRV_STREAM_INFORMATION; the counters of a stream
+// are in Stream[id - 1].
+//
+#define IOCTL_GET_STREAM_INFORMATION    \
+    CTL_CODE (FILE_DEVICE_PCI, 0x17 , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define PCIDRV_STREAM_MAX_STREAMS       16
+
+#define PCIDRV_STREAM_MODE_NONE         0
+#define PCIDRV_STREAM_MODE_DIRECTIVE    1   // Streams directive
+#define PCIDRV_STREAM_MODE_PLACEMENT    2   // Flexible Data Placement
+
+typedef struct _PCIDRV_STREAM_COUNTERS {
+    ULONG       Handles;            // with the stream set
+    ULONG       Reserved;
+    ULONGLONG   Writes;             // tagged writes submitted
+    ULONGLONG   BytesWritten;
+} PCIDRV_STREAM_COUNTERS, *PPCIDRV_STREAM_COUNTERS;
+
+typedef struct _PCIDRV_STREAM_INFORMATION {
+    ULONG       Mode;               // PCIDRV_STREAM_MODE_xxx
+    ULONG       Streams;            // stream ids usable, from 1
+    ULONG       StreamsRequested;   // registry "WriteStreams"
+    ULONG       StreamsAvailable;   // left in the subsystem, Streams directive
+    ULONG       WriteSize;          // bytes, optimal write size of a stream
+    ULONG       GranularitySize;    // bytes the device allocates a stream in
+    PCIDRV_STREAM_COUNTERS Stream[PCIDRV_STREAM_MAX_STREAMS];
+} PCIDRV_STREAM_INFORMATION, *PPCIDRV_STREAM_INFORMATION;
+
+//
+// Doorbell register writes of the I/O queues since the device started.
+// With shadow doorbells, set up for the registry value "ShadowDoorbells"
+// on controllers that offer them, a doorbell register is written only
+// when the controller asks for it, so the doorbell writes per command
+// are the MMIO writes per I/O. Output buffer is a
+// PCIDRV_DOORBELL_STATISTICS.
+//
+#define IOCTL_GET_DOORBELL_STATISTICS   \
+    CTL_CODE (FILE_DEVICE_PCI, 0x18 , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _PCIDRV_DOORBELL_STATISTICS {
+    ULONG       ShadowDoorbells;    // 1 if in use since the last start
+    ULONG       Queues;
+    ULONGLONG   Submissions;        // commands submitted
+    ULONGLONG   SubmissionDoorbells;
+    ULONGLONG   CompletionUpdates;  // head moves after reaping completions
+    ULONGLONG   CompletionDoorbells;
+} PCIDRV_DOORBELL_STATISTICS, *PPCIDRV_DOORBELL_STATISTICS;
+
+//
+// Log pages kept by the driver: read from the device at start, when an
+// asynchronous event names them, and when a cached copy older than the
+// registry value "LogPageMaxAge" (s) is asked for, in which case the old
+// copy is returned and a fresh one read in the background. Input buffer
+// is a ULONG log page id, PCIDRV_LOG_PAGE_xxx; output buffer is a
+// PCIDRV_LOG_PAGE with room for the page, 512 bytes for the health
+// page and 64 per entry for the error page.
+//
+#define IOCTL_GET_LOG_PAGE              \
+    CTL_CODE (FILE_DEVICE_PCI, 0x19 , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define PCIDRV_LOG_PAGE_ERROR           0x01    // error information
+#define PCIDRV_LOG_PAGE_HEALTH          0x02    // SMART / health information
+
+typedef struct _PCIDRV_LOG_PAGE {
+    ULONG       LogPageId;
+    ULONG       Length;             // bytes of Data
+    ULONG       AsyncEvents;        // events seen when the page was returned
+    ULONG       Reserved;
+    LARGE_INTEGER ReadTime;         // system time the page was read from the device
+    UCHAR       Data[1];
+} PCIDRV_LOG_PAGE, *PPCIDRV_LOG_PAGE;
+
+//
+// Waits for an asynchronous event of the device: a SMART / health
+// critical warning, an error or a notice. Input buffer is optionally the
+// AsyncEvents of the last event seen; if a later one was seen already it
+// is returned at once. Output buffer is a PCIDRV_ASYNC_EVENT for the
+// latest event; its log page has been read into the cache by then. Any
+// number of requests may wait; the next event completes all of them.
+//
+#define IOCTL_WAIT_ASYNC_EVENT          \
+    CTL_CODE (FILE_DEVICE_PCI, 0x1A , METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _PCIDRV_ASYNC_EVENT {
+    ULONG       AsyncEvents;        // number of the event, from 1
+    UCHAR       Type;               // NVMe asynchronous event type
+    UCHAR       Information;        // NVMe asynchronous event information
+    UCHAR       LogPageId;
+    UCHAR       Reserved;
+} PCIDRV_ASYNC_EVENT, *PPCIDRV_ASYNC_EVENT;
+
+#define PCIDRV_ASYNC_EVENT_FIRMWARE     0x80    // Type of the progress of IOCTL_UPDATE_FIRMWARE
+
+//
+// Reads any log page, such as the telemetry logs of many megabytes,
+// straight into the output buffer, which gets OutputBufferLength bytes
+// of the page from Offset on; both must be multiples of 4. The device
+// writes the data to the pages of the caller in chunks, several at a
+// time, and nothing is copied. LogSpecific goes to the first chunk only,
+// which is read before the others, so that Create Telemetry Host-
+// Initiated Data captures the log the rest of the request then reads.
+// The number of bytes returned is the output buffer length.
+//
+#define IOCTL_READ_LOG_PAGE             \
+    CTL_CODE (FILE_DEVICE_PCI, 0x1B , METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+#define PCIDRV_LOG_PAGE_TELEMETRY_HOST          0x07
+#define PCIDRV_LOG_PAGE_TELEMETRY_CONTROLLER    0x08
+
+#define PCIDRV_LOG_PAGE_RETAIN_EVENT    0x01    // leave the asynchronous event masked
+
+typedef struct _PCIDRV_LOG_PAGE_READ {
+    ULONG       LogPageId;
+    ULONG       LogSpecific;        // log specific field, 0 to 0x7F
+    ULONG       Flags;              // PCIDRV_LOG_PAGE_xxx
+    ULONG       Reserved;
+    ULONGLONG   Offset;             // bytes into the page
+} PCIDRV_LOG_PAGE_READ, *PPCIDRV_LOG_PAGE_READ;
+
+//
+// Downloads a firmware image and commits it. Input buffer is a
+// PCIDRV_FIRMWARE_UPDATE; output buffer is the whole image, whose length
+// is a multiple of 4. The driver cuts the image at the update
+// granularity of the device and keeps PipelineDepth Firmware Image
+// Download commands out at a time: 0 for the default of 4, 1 for one at
+// a time, 8 at most. Slot and CommitAction go to the Firmware Commit.
+// While the image goes down, IOCTL_WAIT_ASYNC_EVENT returns events of
+// type PCIDRV_ASYNC_EVENT_FIRMWARE whose Information is the percentage
+// downloaded. The number of bytes returned is the command specific
+// status of a commit that needs a reset to activate the image, 0 if it
+// does not. One update may run at a time.
+//
+#define IOCTL_UPDATE_FIRMWARE           \
+    CTL_CODE (FILE_DEVICE_PCI, 0x1C , METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+#define PCIDRV_FIRMWARE_REPLACE         0       // commit actions
+#define PCIDRV_FIRMWARE_REPLACE_ACTIVATE 1      // at the next reset
+#define PCIDRV_FIRMWARE_ACTIVATE        2       // the image of Slot, at the next reset
+#define PCIDRV_FIRMWARE_REPLACE_ACTIVATE_NOW 3  // without a reset
+
+typedef struct _PCIDRV_FIRMWARE_UPDATE {
+    ULONG       Slot;               // 1 to 7, 0 for the device to choose
+    ULONG       CommitAction;       // PCIDRV_FIRMWARE_xxx
+    ULONG       PipelineDepth;
+    ULONG       Reserved;
+} PCIDRV_FIRMWARE_UPDATE, *PPCIDRV_FIRMWARE_UPDATE;
+
 #endif
 
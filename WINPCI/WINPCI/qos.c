@@ -0,0 +1,810 @@
+/*++
+
+Module Name:
+
+    qos.c
+
+Abstract:
+
+    Contains the IOPS and bandwidth limiter applied to reads and writes
+    in PciDrvDispatchIO. Every handle has a limiter of its own and shares
+    one with the other handles of its process; each limiter is a pair of
+    token buckets charged without a lock. Requests over a limit are not
+    failed but held on a queue that a periodic DPC releases as the
+    buckets refill.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "qos.tmh"
+#endif
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, PciDrvQosReferenceProcessLimiter)
+#pragma alloc_text (PAGE, PciDrvQosDereferenceProcessLimiter)
+#pragma alloc_text (PAGE, PciDrvQosSetLimits)
+#endif
+
+
+VOID
+PciDrvQosInitialize(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Initializes the QoS state of the device. Called from AddDevice.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    InitializeListHead(&FdoData->QosDeferredQueue);
+    InitializeListHead(&FdoData->QosProcessLimiters);
+    ExInitializeFastMutex(&FdoData->QosProcessMutex);
+    KeInitializeTimer(&FdoData->QosTimer);
+    KeInitializeDpc(&FdoData->QosDpc, PciDrvQosDpc, FdoData);
+    FdoData->QosTimerArmed = FALSE;
+    FdoData->QosPass = 0;
+}
+
+
+VOID
+PciDrvQosInitializeLimiter(
+    __out PPCIDRV_QOS_LIMITER Limiter
+    )
+/*++
+Routine Description:
+
+    Initializes a limiter without limits.
+
+--*/
+{
+    RtlZeroMemory(Limiter, sizeof(PCIDRV_QOS_LIMITER));
+    InitializeListHead(&Limiter->Link);
+}
+
+
+NTSTATUS
+PciDrvQosReferenceProcessLimiter(
+    __in  PFDO_DATA            FdoData,
+    __out PPCIDRV_QOS_LIMITER *Limiter
+    )
+/*++
+Routine Description:
+
+    Returns the limiter shared by the handles the current process has
+    open on the device, creating it for the first handle.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Limiter     Receives the referenced limiter
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PPCIDRV_QOS_LIMITER limiter;
+    PLIST_ENTRY         entry;
+    HANDLE              processId = PsGetCurrentProcessId();
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&FdoData->QosProcessMutex);
+
+    for (entry = FdoData->QosProcessLimiters.Flink;
+         entry != &FdoData->QosProcessLimiters;
+         entry = entry->Flink) {
+
+        limiter = CONTAINING_RECORD(entry, PCIDRV_QOS_LIMITER, Link);
+        if (limiter->ProcessId == processId) {
+            limiter->References++;
+            ExReleaseFastMutex(&FdoData->QosProcessMutex);
+            *Limiter = limiter;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    //
+    // Charged from the dispatch path and the release DPC.
+    //
+    limiter = PciDrvAllocateFromLookaside(&Globals.QosLimiterPool);
+    if (limiter == NULL) {
+        ExReleaseFastMutex(&FdoData->QosProcessMutex);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    PciDrvQosInitializeLimiter(limiter);
+    limiter->ProcessId = processId;
+    limiter->References = 1;
+    InsertTailList(&FdoData->QosProcessLimiters, &limiter->Link);
+
+    ExReleaseFastMutex(&FdoData->QosProcessMutex);
+
+    *Limiter = limiter;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+PciDrvQosDereferenceProcessLimiter(
+    __in PFDO_DATA           FdoData,
+    __in PPCIDRV_QOS_LIMITER Limiter
+    )
+/*++
+Routine Description:
+
+    Drops the reference a closing handle has on its process limiter and
+    frees the limiter with the last handle of the process.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Limiter     Process limiter of the handle
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&FdoData->QosProcessMutex);
+
+    if (--Limiter->References != 0) {
+        ExReleaseFastMutex(&FdoData->QosProcessMutex);
+        return;
+    }
+
+    RemoveEntryList(&Limiter->Link);
+
+    ExReleaseFastMutex(&FdoData->QosProcessMutex);
+
+    PciDrvFreeToLookaside(&Globals.QosLimiterPool, Limiter);
+}
+
+
+static
+BOOLEAN
+PciDrvQosChargeBucket(
+    __in  PPCIDRV_TOKEN_BUCKET Bucket,
+    __in  LONG64               Now,
+    __in  ULONGLONG            Units,
+    __out PLONG64              Cost
+    )
+/*++
+Routine Description:
+
+    Takes Units out of a bucket if it has any credit left. On success
+    Cost receives what has to be handed back to undo the charge.
+
+--*/
+{
+    ULONG  rate = Bucket->Rate;
+    LONG64 tat, start;
+
+    *Cost = 0;
+
+    if (rate == 0) {
+        return TRUE;
+    }
+
+    *Cost = (LONG64)(Units * 10000000 / rate);
+
+    do {
+        tat = Bucket->Tat;
+        start = max(tat, Now);
+        if (start - Now > PCIDRV_QOS_BURST) {
+            return FALSE;
+        }
+    } while (InterlockedCompareExchange64(&Bucket->Tat, start + *Cost, tat) != tat);
+
+    return TRUE;
+}
+
+
+static
+BOOLEAN
+PciDrvQosChargeLimiter(
+    __in  PPCIDRV_QOS_LIMITER Limiter,
+    __in  LONG64              Now,
+    __in  ULONG               Length,
+    __out PLONG64             IopsCost,
+    __out PLONG64             BandwidthCost
+    )
+/*++
+Routine Description:
+
+    Charges one request of Length bytes to both buckets of a limiter, or
+    to neither.
+
+--*/
+{
+    if (!PciDrvQosChargeBucket(&Limiter->Iops, Now, 1, IopsCost)) {
+        return FALSE;
+    }
+
+    if (!PciDrvQosChargeBucket(&Limiter->Bandwidth, Now, Length, BandwidthCost)) {
+        InterlockedExchangeAdd64(&Limiter->Iops.Tat, -*IopsCost);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static
+PPCIDRV_QOS_LIMITER
+PciDrvQosCharge(
+    __in PPCIDRV_FILE_CONTEXT FileContext,
+    __in PIRP                 Irp,
+    __in LONG64               Now
+    )
+/*++
+Routine Description:
+
+    Charges a read or write to the limiters of its handle and process.
+
+Return Value:
+
+    NULL if the request may go on, otherwise the limiter it is over
+
+--*/
+{
+    PPCIDRV_QOS_LIMITER processLimiter = FileContext->ProcessLimiter;
+    ULONG               length = IoGetCurrentIrpStackLocation(Irp)->Parameters.Read.Length;
+    LONG64              iopsCost, bandwidthCost;
+    LONG64              unused1, unused2;
+
+    if (!PciDrvQosChargeLimiter(&FileContext->Limiter, Now, length,
+                                &iopsCost, &bandwidthCost)) {
+        return &FileContext->Limiter;
+    }
+
+    if (processLimiter != NULL &&
+        !PciDrvQosChargeLimiter(processLimiter, Now, length, &unused1, &unused2)) {
+        InterlockedExchangeAdd64(&FileContext->Limiter.Iops.Tat, -iopsCost);
+        InterlockedExchangeAdd64(&FileContext->Limiter.Bandwidth.Tat, -bandwidthCost);
+        return processLimiter;
+    }
+
+    return NULL;
+}
+
+
+BOOLEAN
+PciDrvQosAdmitRequest(
+    __in PIRP Irp
+    )
+/*++
+Routine Description:
+
+    Decides in the dispatch path whether a read or write may be started
+    now. A handle that already has requests held keeps its order: new
+    requests queue up behind them.
+
+Arguments:
+
+    Irp         Read or write IRP
+
+Return Value:
+
+    TRUE if the request is within its limits and has been charged
+
+--*/
+{
+    PPCIDRV_FILE_CONTEXT fileContext = PciDrvGetFileContext(Irp);
+
+    if (fileContext == NULL) {
+        return TRUE;
+    }
+
+    if (fileContext->QosDeferred != 0) {
+        return FALSE;
+    }
+
+    return (BOOLEAN)(PciDrvQosCharge(fileContext, Irp,
+                                     (LONG64)KeQueryInterruptTime()) == NULL);
+}
+
+
+static
+VOID
+PciDrvQosArmTimer(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Schedules the next release pass. An armed timer counts as an
+    outstanding request so that remove waits for the DPC. Called with
+    QueueLock held.
+
+--*/
+{
+    LARGE_INTEGER dueTime;
+
+    if (!FdoData->QosTimerArmed) {
+        FdoData->QosTimerArmed = TRUE;
+        PciDrvIoIncrement(FdoData);
+    }
+
+    dueTime.QuadPart = -10000LL * PCIDRV_QOS_TICK;
+    KeSetTimer(&FdoData->QosTimer, dueTime, &FdoData->QosDpc);
+}
+
+
+NTSTATUS
+PciDrvQosDeferRequest(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Holds a read or write that is over its limit until the release DPC
+    lets it through. Like the requests in NewRequestsQueue, a held
+    request is linked to its handle and does not count as outstanding.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Irp         Read or write IRP sent on a handle
+
+Return Value:
+
+    STATUS_PENDING
+
+--*/
+{
+    PPCIDRV_FILE_CONTEXT fileContext = PciDrvGetFileContext(Irp);
+    KIRQL                oldIrql;
+
+    IoMarkIrpPending(Irp);
+
+    KeAcquireSpinLock(&FdoData->QueueLock, &oldIrql);
+
+    if (FailRequests == FdoData->QueueState) {
+        KeReleaseSpinLock(&FdoData->QueueLock, oldIrql);
+        Irp->IoStatus.Status = STATUS_NO_SUCH_DEVICE;
+        Irp->IoStatus.Information = 0;
+        PciDrvCacheReleaseRequest(FdoData, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        PciDrvIoDecrement(FdoData);
+        return STATUS_PENDING;
+    }
+
+    IoSetCancelRoutine(Irp, PciDrvQosCancelRoutine);
+
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL) != NULL) {
+        KeReleaseSpinLock(&FdoData->QueueLock, oldIrql);
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        Irp->IoStatus.Information = 0;
+        PciDrvCacheReleaseRequest(FdoData, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        PciDrvIoDecrement(FdoData);
+        return STATUS_PENDING;
+    }
+
+    //
+    // If the cancel routine already runs it removes the IRP again as soon
+    // as the lock is dropped.
+    //
+    InsertTailList(&FdoData->QosDeferredQueue, &Irp->Tail.Overlay.ListEntry);
+    InsertTailList(&fileContext->HeldRequests, PCIDRV_IRP_FILE_LINK(Irp));
+    fileContext->QosDeferred++;
+
+    PciDrvQosArmTimer(FdoData);
+
+    KeReleaseSpinLock(&FdoData->QueueLock, oldIrql);
+
+    PciDrvIoDecrement(FdoData);
+
+    return STATUS_PENDING;
+}
+
+
+static
+VOID
+PciDrvQosReleaseRequest(
+    __in PFDO_DATA FdoData,
+    __in PIRP      Irp
+    )
+/*++
+Routine Description:
+
+    Starts a held request that its limiters now let through, unless the
+    device changed state in the meantime.
+
+--*/
+{
+    PciDrvIoIncrement(FdoData);
+
+    if (Deleted == FdoData->DevicePnPState ||
+        FailRequests == FdoData->QueueState) {
+        Irp->IoStatus.Status = STATUS_NO_SUCH_DEVICE;
+        Irp->IoStatus.Information = 0;
+        PciDrvCacheReleaseRequest(FdoData, Irp);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        PciDrvIoDecrement(FdoData);
+        return;
+    }
+
+    if (HoldRequests == FdoData->QueueState) {
+        PciDrvQueueRequest(FdoData, Irp);
+        return;
+    }
+
+    PciDrvReadWrite(FdoData, Irp);
+}
+
+
+VOID
+PciDrvQosDpc(
+    __in     PKDPC Dpc,
+    __in_opt PVOID DeferredContext,
+    __in_opt PVOID SystemArgument1,
+    __in_opt PVOID SystemArgument2
+    )
+/*++
+Routine Description:
+
+    Release pass. Walks the held requests oldest first and starts those
+    whose limiters have credit again. Once a limiter runs dry, the rest
+    of its requests are skipped for this pass so that they keep their
+    order, while requests of other handles behind them still get a turn.
+
+Arguments:
+
+    Dpc                 Not used
+    DeferredContext     Pointer to our FdoData
+    SystemArgument1/2   Not used
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA            fdoData = (PFDO_DATA)DeferredContext;
+    PPCIDRV_FILE_CONTEXT fileContext;
+    PPCIDRV_QOS_LIMITER  blocked;
+    LIST_ENTRY           released;
+    PLIST_ENTRY          entry, next;
+    PIRP                 irp;
+    LONG64               now;
+    ULONG                pass;
+    BOOLEAN              disarmed = FALSE;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    InitializeListHead(&released);
+
+    KeAcquireSpinLockAtDpcLevel(&fdoData->QueueLock);
+
+    pass = ++fdoData->QosPass;
+    now = (LONG64)KeQueryInterruptTime();
+
+    for (entry = fdoData->QosDeferredQueue.Flink;
+         entry != &fdoData->QosDeferredQueue;
+         entry = next) {
+
+        next = entry->Flink;
+
+        irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+        fileContext = PciDrvGetFileContext(irp);
+
+        if (fileContext->Limiter.BlockedPass == pass ||
+            (fileContext->ProcessLimiter != NULL &&
+             fileContext->ProcessLimiter->BlockedPass == pass)) {
+            continue;
+        }
+
+        blocked = PciDrvQosCharge(fileContext, irp, now);
+        if (blocked != NULL) {
+            blocked->BlockedPass = pass;
+            fileContext->Limiter.BlockedPass = pass;
+            continue;
+        }
+
+        RemoveEntryList(entry);
+        RemoveEntryList(PCIDRV_IRP_FILE_LINK(irp));
+        InitializeListHead(PCIDRV_IRP_FILE_LINK(irp));
+
+        if (IoSetCancelRoutine(irp, NULL) == NULL) {
+            //
+            // The cancel routine is waiting for the lock; it completes the
+            // IRP and drops the count of its handle.
+            //
+            InitializeListHead(entry);
+            continue;
+        }
+
+        fileContext->QosDeferred--;
+        InsertTailList(&released, entry);
+    }
+
+    if (IsListEmpty(&fdoData->QosDeferredQueue)) {
+        //
+        // A request held while this pass was waiting for the lock set
+        // the timer again; the pass that timer brings finds the timer
+        // already disarmed.
+        //
+        disarmed = fdoData->QosTimerArmed;
+        fdoData->QosTimerArmed = FALSE;
+    } else {
+        PciDrvQosArmTimer(fdoData);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&fdoData->QueueLock);
+
+    while (!IsListEmpty(&released)) {
+        irp = CONTAINING_RECORD(RemoveHeadList(&released), IRP, Tail.Overlay.ListEntry);
+        PciDrvQosReleaseRequest(fdoData, irp);
+    }
+
+    if (disarmed) {
+        PciDrvIoDecrement(fdoData);
+    }
+}
+
+
+VOID
+PciDrvQosCancelRoutine(
+    PDEVICE_OBJECT   DeviceObject,
+    PIRP             Irp
+    )
+/*++
+Routine Description:
+
+    Cancel routine of a request held by the limiter. The cancel spin lock
+    is already acquired when this routine is called.
+
+Arguments:
+
+    DeviceObject    Pointer to our device object
+    Irp             The IRP to be cancelled
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA            fdoData = DeviceObject->DeviceExtension;
+    PPCIDRV_FILE_CONTEXT fileContext = PciDrvGetFileContext(Irp);
+    KIRQL                oldIrql;
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    KeAcquireSpinLock(&fdoData->QueueLock, &oldIrql);
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    RemoveEntryList(PCIDRV_IRP_FILE_LINK(Irp));
+    InitializeListHead(PCIDRV_IRP_FILE_LINK(Irp));
+    fileContext->QosDeferred--;
+
+    KeReleaseSpinLock(&fdoData->QueueLock, oldIrql);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    PciDrvCacheReleaseRequest(fdoData, Irp);
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+
+static
+VOID
+PciDrvQosTakeRequests(
+    __in    PFDO_DATA   FdoData,
+    __inout PLIST_ENTRY Irps
+    )
+/*++
+Routine Description:
+
+    Empties the queue of held requests into Irps and stops the release
+    timer. Requests whose cancel routine already runs are left to it.
+
+--*/
+{
+    PPCIDRV_FILE_CONTEXT fileContext;
+    PLIST_ENTRY          entry;
+    PIRP                 irp;
+    KIRQL                oldIrql;
+    BOOLEAN              disarmed = FALSE;
+
+    KeAcquireSpinLock(&FdoData->QueueLock, &oldIrql);
+
+    while (!IsListEmpty(&FdoData->QosDeferredQueue)) {
+
+        entry = RemoveHeadList(&FdoData->QosDeferredQueue);
+        irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+        fileContext = PciDrvGetFileContext(irp);
+
+        RemoveEntryList(PCIDRV_IRP_FILE_LINK(irp));
+        InitializeListHead(PCIDRV_IRP_FILE_LINK(irp));
+
+        if (IoSetCancelRoutine(irp, NULL) == NULL) {
+            InitializeListHead(entry);
+            continue;
+        }
+
+        fileContext->QosDeferred--;
+        InsertTailList(Irps, entry);
+    }
+
+    if (FdoData->QosTimerArmed && KeCancelTimer(&FdoData->QosTimer)) {
+        FdoData->QosTimerArmed = FALSE;
+        disarmed = TRUE;
+    }
+
+    KeReleaseSpinLock(&FdoData->QueueLock, oldIrql);
+
+    if (disarmed) {
+        PciDrvIoDecrement(FdoData);
+    }
+}
+
+
+VOID
+PciDrvQosWithdrawRequests(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Moves the requests held by the limiter to NewRequestsQueue while the
+    device is changing state. They are charged again when redispatched.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    LIST_ENTRY irps;
+    PIRP       irp;
+
+    InitializeListHead(&irps);
+    PciDrvQosTakeRequests(FdoData, &irps);
+
+    while (!IsListEmpty(&irps)) {
+        irp = CONTAINING_RECORD(RemoveHeadList(&irps), IRP, Tail.Overlay.ListEntry);
+
+        //
+        // Compensate for the decrement done in PciDrvQueueRequest.
+        //
+        PciDrvIoIncrement(FdoData);
+        PciDrvQueueRequest(FdoData, irp);
+    }
+}
+
+
+VOID
+PciDrvQosCancelRequests(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Fails the requests held by the limiter when the device goes away.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    LIST_ENTRY irps;
+    PIRP       irp;
+
+    InitializeListHead(&irps);
+    PciDrvQosTakeRequests(FdoData, &irps);
+
+    while (!IsListEmpty(&irps)) {
+        irp = CONTAINING_RECORD(RemoveHeadList(&irps), IRP, Tail.Overlay.ListEntry);
+        irp->IoStatus.Status = STATUS_NO_SUCH_DEVICE;
+        irp->IoStatus.Information = 0;
+        PciDrvCacheReleaseRequest(FdoData, irp);
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+}
+
+
+NTSTATUS
+PciDrvQosSetLimits(
+    __in PIRP Irp
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_SET_QOS_LIMITS. Any caller may tighten the limits of
+    its handle or process; loosening them takes the privilege to raise
+    scheduling priority.
+
+Arguments:
+
+    Irp         The IOCTL request
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PIO_STACK_LOCATION   irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PPCIDRV_FILE_CONTEXT fileContext = PciDrvGetFileContext(Irp);
+    PPCIDRV_QOS_LIMITS   limits;
+    PPCIDRV_QOS_LIMITER  limiter;
+    ULONG                iops, bandwidth;
+
+    PAGED_CODE();
+
+    if (fileContext == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (irpStack->Parameters.DeviceIoControl.InputBufferLength <
+        sizeof(PCIDRV_QOS_LIMITS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    limits = (PPCIDRV_QOS_LIMITS)Irp->AssociatedIrp.SystemBuffer;
+
+    switch (limits->Scope) {
+        case PCIDRV_QOS_SCOPE_HANDLE:
+            limiter = &fileContext->Limiter;
+            break;
+        case PCIDRV_QOS_SCOPE_PROCESS:
+            limiter = fileContext->ProcessLimiter;
+            break;
+        default:
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    iops = limiter->Iops.Rate;
+    bandwidth = limiter->Bandwidth.Rate;
+
+    if ((iops != 0 && (limits->IopsLimit == 0 || limits->IopsLimit > iops)) ||
+        (bandwidth != 0 && (limits->BandwidthLimit == 0 || limits->BandwidthLimit > bandwidth))) {
+        if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_INC_BASE_PRIORITY_PRIVILEGE),
+                                    Irp->RequestorMode)) {
+            return STATUS_PRIVILEGE_NOT_HELD;
+        }
+    }
+
+    limiter->Iops.Rate = limits->IopsLimit;
+    limiter->Bandwidth.Rate = limits->BandwidthLimit;
+
+    DebugPrint(INFO, DBG_IOCTLS, "QoS limits of %s %p: %d IOPS, %d bytes/s\n",
+               limits->Scope == PCIDRV_QOS_SCOPE_HANDLE ? "handle" : "process",
+               limiter, limits->IopsLimit, limits->BandwidthLimit);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,850 @@
+/*++
+
+Module Name:
+
+    stripe.c
+
+Abstract:
+
+    Contains the volume over several controllers: striped (RAID-0) or
+    mirrored (RAID-1). A controller joins the set when its "StripeMembers"
+    parameter is not 0; "StripeIndex" gives its place in the set,
+    "StripeMirror" = 1 makes the set a mirror of two members and
+    "StripeSize" is the KB put on one member before moving to the next
+    when striping.
+
+    The set is exposed as one control device, PCIDRV_STRIPE_DEVICE_NAME,
+    created when the first member joins and deleted when the last one
+    leaves. It takes reads and writes once every member is there: a
+    request is split at stripe unit boundaries into one child IRP per
+    piece, the children are sent to the FDOs of the members, which submit
+    them on their own queues like any other request, and the request is
+    completed when the last child is. Each member counts its children in
+    its own OutstandingIO, so PnP stop and removal of a member work as
+    for a controller used on its own.
+
+    A mirror writes every piece to both members and reads it from the
+    one whose queue for the current processor promises the shortest wait
+    (HwEstimateQueueWait). A read that fails is tried on the other member.
+    A mirror stays usable while one member in sync is left; a member that
+    misses a write, or joins while the mirror runs degraded, is stale:
+    it is written but not read from until the whole set restarts, as
+    there is no resynchronization.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "stripe.tmh"
+#endif
+
+//
+// Children still to complete and the first error, kept in the request
+// sent to the stripe device: the stripe device is the only one in its
+// stack, so the DriverContext of the IRP is ours.
+//
+#define PCIDRV_STRIPE_PENDING(_irp)   (*(PLONG)&(_irp)->Tail.Overlay.DriverContext[0])
+#define PCIDRV_STRIPE_STATUS(_irp)    (*(PLONG)&(_irp)->Tail.Overlay.DriverContext[1])
+
+//
+// A child IRP has one stack location of its own above those of the
+// member, recording the piece it carries.
+//
+#define PCIDRV_CHILD_MEMBER(_stack)   ((_stack)->Parameters.Others.Argument1)
+#define PCIDRV_CHILD_OFFSET(_stack)   ((_stack)->Parameters.Others.Argument2)
+#define PCIDRV_CHILD_TRIED(_stack)    ((_stack)->Parameters.Others.Argument3)
+
+#define PCIDRV_STRIPE_NO_MEMBER       MAXULONG
+
+static IO_COMPLETION_ROUTINE PciDrvStripeChildComplete;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, PciDrvStripeInitialize)
+#pragma alloc_text (PAGE, PciDrvStripeJoin)
+#pragma alloc_text (PAGE, PciDrvStripeLeave)
+#endif
+
+
+VOID
+PciDrvStripeInitialize(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Sets up the empty stripe set. Called once from DriverEntry.
+
+--*/
+{
+    PPCIDRV_STRIPE_SET set = &Globals.StripeSet;
+
+    RtlZeroMemory(set, sizeof(PCIDRV_STRIPE_SET));
+
+    KeInitializeMutex(&set->Mutex, 0);
+    ExInitializeRundownProtection(&set->Rundown);
+    ExWaitForRundownProtectionRelease(&set->Rundown);   // not complete yet
+}
+
+
+static
+BOOLEAN
+PciDrvStripeActivate(
+    __in PPCIDRV_STRIPE_SET Set
+    )
+/*++
+Routine Description:
+
+    Works out the layout once every member has joined. The stripe unit
+    is a power of two no smaller than a block and no larger than what
+    every member takes in one command; every member contributes the
+    same whole number of stripe units. A mirror splits requests at the
+    largest such unit only to fit the commands of its members. Called
+    with the set mutex held.
+
+--*/
+{
+    PFDO_DATA fdoData;
+    ULONGLONG memberLength;
+    ULONG     unit, maxUnit, maxTransfer, i;
+
+    maxTransfer = MAXULONG;
+    memberLength = MAXULONGLONG;
+
+    for (i = 0; i < Set->MemberCount; i++) {
+        fdoData = Set->Members[i];
+        if (fdoData->LbaShift != Set->Members[0]->LbaShift) {
+            DebugPrint(ERROR, DBG_INIT, "Stripe members have different block sizes\n");
+            return FALSE;
+        }
+        maxTransfer = min(maxTransfer, fdoData->MaxTransferSize);
+        memberLength = min(memberLength, fdoData->NamespaceBlocks << fdoData->LbaShift);
+    }
+
+    maxUnit = Set->Mirrored ? maxTransfer : Set->Members[0]->Parameters.StripeSize * 1024;
+
+    unit = 1UL << Set->Members[0]->LbaShift;
+    while ((unit << 1) <= maxUnit && (unit << 1) <= maxTransfer) {
+        unit <<= 1;
+    }
+    if (unit > maxTransfer) {
+        DebugPrint(ERROR, DBG_INIT, "Stripe members take less than a block per command\n");
+        return FALSE;
+    }
+
+    Set->LbaShift = Set->Members[0]->LbaShift;
+    Set->UnitShift = RtlFindMostSignificantBit(unit);
+    Set->MemberLength = memberLength & ~((ULONGLONG)unit - 1);
+    Set->Length = Set->Mirrored ? Set->MemberLength : Set->MemberLength * Set->MemberCount;
+
+    DebugPrint(INFO, DBG_INIT, "%s set of %d members, %d byte units, %I64d bytes\n",
+               Set->Mirrored ? "Mirror" : "Stripe",
+               Set->MemberCount, unit, Set->Length);
+
+    ExReInitializeRundownProtection(&Set->Rundown);
+    Set->Active = TRUE;
+    return TRUE;
+}
+
+
+static
+BOOLEAN
+PciDrvMirrorInSync(
+    __in PPCIDRV_STRIPE_SET Set
+    )
+/*++
+Routine Description:
+
+    Tells whether a mirror still has a member present that is not stale.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < Set->MemberCount; i++) {
+        if (Set->Members[i] != NULL && !Set->Stale[i]) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+VOID
+PciDrvStripeJoin(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Adds a started controller to the stripe set if its parameters make
+    it a member. The first member creates the stripe device; the last
+    one to join makes the set usable. A member joining a mirror that is
+    running without it is stale.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PPCIDRV_STRIPE_SET set = &Globals.StripeSet;
+    PDEVICE_OBJECT     deviceObject;
+    UNICODE_STRING     deviceName, linkName;
+    ULONG              members = FdoData->Parameters.StripeMembers;
+    ULONG              index = FdoData->Parameters.StripeIndex;
+    BOOLEAN            mirrored = (BOOLEAN)(FdoData->Parameters.StripeMirror != 0);
+    NTSTATUS           status;
+
+    PAGED_CODE();
+
+    if (members == 0 || FdoData->StripeJoined) {
+        return;
+    }
+
+    KeWaitForSingleObject(&set->Mutex, Executive, KernelMode, FALSE, NULL);
+
+    if (set->Joined != 0 && (members != set->MemberCount || mirrored != set->Mirrored)) {
+        DebugPrint(ERROR, DBG_INIT, "Stripe set is of %d members, mirror %d\n",
+                   set->MemberCount, set->Mirrored);
+        goto Exit;
+    }
+    if (index >= members || set->Members[index] != NULL ||
+        (mirrored && members != PCIDRV_MIRROR_MEMBERS)) {
+        DebugPrint(ERROR, DBG_INIT, "Stripe index %d of %d is invalid or taken\n",
+                   index, members);
+        goto Exit;
+    }
+
+    if (set->DeviceObject == NULL) {
+
+        RtlInitUnicodeString(&deviceName, PCIDRV_STRIPE_DEVICE_NAME);
+        status = IoCreateDevice(FdoData->Self->DriverObject,
+                                sizeof(ULONG),
+                                &deviceName,
+                                FILE_DEVICE_UNKNOWN,
+                                FILE_DEVICE_SECURE_OPEN,
+                                FALSE,
+                                &deviceObject);
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(ERROR, DBG_INIT, "Couldn't create the stripe device 0x%x\n", status);
+            goto Exit;
+        }
+
+        RtlInitUnicodeString(&linkName, PCIDRV_STRIPE_LINK_NAME);
+        status = IoCreateSymbolicLink(&linkName, &deviceName);
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(ERROR, DBG_INIT, "Couldn't link the stripe device 0x%x\n", status);
+            IoDeleteDevice(deviceObject);
+            goto Exit;
+        }
+
+        *(PULONG)deviceObject->DeviceExtension = PCIDRV_STRIPE_SIGNATURE;
+        deviceObject->Flags |= DO_DIRECT_IO;
+        deviceObject->AlignmentRequirement = FILE_LONG_ALIGNMENT;
+        deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
+
+        set->DeviceObject = deviceObject;
+        set->MemberCount = members;
+        set->Mirrored = mirrored;
+    }
+
+    if (set->Active) {
+
+        //
+        // Only a degraded mirror is active without all of its members.
+        // The newcomer must fit the layout in use.
+        //
+        ASSERT(set->Mirrored);
+
+        if (FdoData->LbaShift != set->LbaShift ||
+            FdoData->MaxTransferSize < (1UL << set->UnitShift) ||
+            (FdoData->NamespaceBlocks << FdoData->LbaShift) < set->MemberLength) {
+            DebugPrint(ERROR, DBG_INIT, "Controller doesn't fit the mirror\n");
+            goto Exit;
+        }
+
+        ExWaitForRundownProtectionRelease(&set->Rundown);
+        set->Stale[index] = TRUE;
+        set->Members[index] = FdoData;
+        ExReInitializeRundownProtection(&set->Rundown);
+
+        DebugPrint(ERROR, DBG_INIT, "Mirror member %d joined stale\n", index);
+
+    } else {
+        set->Stale[index] = FALSE;
+        set->Members[index] = FdoData;
+    }
+
+    set->Joined++;
+    FdoData->StripeJoined = TRUE;
+
+    DebugPrint(INFO, DBG_INIT, "Joined the stripe set as member %d of %d\n", index, members);
+
+    if (!set->Active && set->Joined == set->MemberCount) {
+        PciDrvStripeActivate(set);
+    }
+
+Exit:
+    KeReleaseMutex(&set->Mutex, FALSE);
+}
+
+
+VOID
+PciDrvStripeLeave(
+    __in PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Takes a controller out of the stripe set when it stops or goes
+    away. A stripe set stops taking requests; a mirror goes on with the
+    other member if that one is in sync. Requests already split keep
+    their children, which the member completes or fails like its own
+    requests. The last member to leave deletes the stripe device.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PPCIDRV_STRIPE_SET set = &Globals.StripeSet;
+    UNICODE_STRING     linkName;
+
+    PAGED_CODE();
+
+    if (!FdoData->StripeJoined) {
+        return;
+    }
+
+    KeWaitForSingleObject(&set->Mutex, Executive, KernelMode, FALSE, NULL);
+
+    //
+    // Once this returns no request is being split or retried any more,
+    // so no child can be sent to this member after it has left.
+    //
+    if (set->Active) {
+        ExWaitForRundownProtectionRelease(&set->Rundown);
+        set->Active = FALSE;
+    }
+
+    set->Members[FdoData->Parameters.StripeIndex] = NULL;
+    set->Joined--;
+    FdoData->StripeJoined = FALSE;
+
+    if (set->Mirrored && set->Length != 0 && PciDrvMirrorInSync(set)) {
+        DebugPrint(ERROR, DBG_INIT, "Mirror member %d left, running degraded\n",
+                   FdoData->Parameters.StripeIndex);
+        ExReInitializeRundownProtection(&set->Rundown);
+        set->Active = TRUE;
+    }
+
+    if (set->Joined == 0) {
+        RtlInitUnicodeString(&linkName, PCIDRV_STRIPE_LINK_NAME);
+        IoDeleteSymbolicLink(&linkName);
+        IoDeleteDevice(set->DeviceObject);
+        set->DeviceObject = NULL;
+        set->MemberCount = 0;
+        set->Mirrored = FALSE;
+        set->Length = 0;
+    }
+
+    KeReleaseMutex(&set->Mutex, FALSE);
+}
+
+
+static
+ULONG
+PciDrvMirrorPickMember(
+    __in PPCIDRV_STRIPE_SET Set,
+    __in ULONG              Priority,
+    __in ULONG              Exclude
+    )
+/*++
+Routine Description:
+
+    Picks the mirror member to read from: of the members in sync, not in
+    Exclude and not holding requests, the one promising the shortest
+    wait. Called with the set rundown held.
+
+--*/
+{
+    PFDO_DATA fdoData;
+    ULONGLONG wait, bestWait = MAXULONGLONG;
+    ULONG     best = PCIDRV_STRIPE_NO_MEMBER;
+    ULONG     i;
+
+    for (i = 0; i < Set->MemberCount; i++) {
+
+        fdoData = Set->Members[i];
+        if (fdoData == NULL || Set->Stale[i] || (Exclude & (1UL << i)) != 0 ||
+            fdoData->QueueState != AllowRequests) {
+            continue;
+        }
+
+        wait = HwEstimateQueueWait(fdoData, Priority);
+        if (best == PCIDRV_STRIPE_NO_MEMBER || wait < bestWait) {
+            best = i;
+            bestWait = wait;
+        }
+    }
+
+    return best;
+}
+
+
+static
+VOID
+PciDrvStripeCompleteRequest(
+    __in PIRP Irp
+    )
+/*++
+Routine Description:
+
+    Drops one reference of a split request and completes it with the
+    first error of its children once none is left.
+
+--*/
+{
+    NTSTATUS status;
+
+    if (InterlockedDecrement(&PCIDRV_STRIPE_PENDING(Irp)) != 0) {
+        return;
+    }
+
+    status = PCIDRV_STRIPE_STATUS(Irp);
+
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = NT_SUCCESS(status) ?
+        IoGetCurrentIrpStackLocation(Irp)->Parameters.Read.Length : 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+
+static
+NTSTATUS
+PciDrvStripeSendChild(
+    __in PPCIDRV_STRIPE_SET Set,
+    __in ULONG              Member,
+    __in PIRP               Irp,
+    __in ULONG              Offset,
+    __in ULONG              Length,
+    __in ULONGLONG          MemberOffset,
+    __in ULONG              Tried
+    )
+/*++
+Routine Description:
+
+    Sends the piece [Offset, Offset + Length) of the buffer of a request
+    to a member, at MemberOffset on it. Tried is the mask of the mirror
+    members the piece was already read from. Called with the set
+    rundown held.
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PIO_STACK_LOCATION childStack;
+    PFDO_DATA          fdoData = Set->Members[Member];
+    PIRP               child;
+    PMDL               mdl;
+    PUCHAR             va;
+
+    child = IoAllocateIrp(fdoData->Self->StackSize + 1, FALSE);
+    if (child == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    va = (PUCHAR)MmGetMdlVirtualAddress(Irp->MdlAddress) + Offset;
+    mdl = IoAllocateMdl(va, Length, FALSE, FALSE, NULL);
+    if (mdl == NULL) {
+        IoFreeIrp(child);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    IoBuildPartialMdl(Irp->MdlAddress, mdl, va, Length);
+
+    child->MdlAddress = mdl;
+    child->Tail.Overlay.Thread = Irp->Tail.Overlay.Thread;
+    IoSetIoPriorityHint(child, IoGetIoPriorityHint(Irp));
+
+    IoSetNextIrpStackLocation(child);
+    childStack = IoGetCurrentIrpStackLocation(child);
+    childStack->MajorFunction = irpStack->MajorFunction;
+    PCIDRV_CHILD_MEMBER(childStack) = (PVOID)(ULONG_PTR)Member;
+    PCIDRV_CHILD_OFFSET(childStack) = (PVOID)(ULONG_PTR)Offset;
+    PCIDRV_CHILD_TRIED(childStack) = (PVOID)(ULONG_PTR)Tried;
+
+    //
+    // Parameters.Read and Parameters.Write have the same layout.
+    //
+    childStack = IoGetNextIrpStackLocation(child);
+    childStack->MajorFunction = irpStack->MajorFunction;
+    childStack->Parameters.Read.Length = Length;
+    childStack->Parameters.Read.ByteOffset.QuadPart = MemberOffset;
+
+    IoSetCompletionRoutine(child, PciDrvStripeChildComplete, Irp, TRUE, TRUE, TRUE);
+
+    InterlockedIncrement(&PCIDRV_STRIPE_PENDING(Irp));
+
+    IoCallDriver(fdoData->Self, child);
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+PciDrvMirrorChildFailed(
+    __in PIRP     Irp,
+    __in PIRP     Child,
+    __in NTSTATUS Status
+    )
+/*++
+Routine Description:
+
+    Handles a failed child of a mirror. A read is sent to the other
+    member if there is one it has not been tried on. A write leaves its
+    member stale; it only fails the request if no member in sync is left.
+
+Return Value:
+
+    STATUS_SUCCESS if the failure was dealt with, or else the error the
+    request is to fail with
+
+--*/
+{
+    PPCIDRV_STRIPE_SET set = &Globals.StripeSet;
+    PIO_STACK_LOCATION childStack = IoGetCurrentIrpStackLocation(Child);
+    ULONG              member = (ULONG)(ULONG_PTR)PCIDRV_CHILD_MEMBER(childStack);
+    ULONG              offset = (ULONG)(ULONG_PTR)PCIDRV_CHILD_OFFSET(childStack);
+    ULONG              tried = (ULONG)(ULONG_PTR)PCIDRV_CHILD_TRIED(childStack) | (1UL << member);
+    ULONG              other;
+    NTSTATUS           status = Status;
+
+    if (IoGetCurrentIrpStackLocation(Irp)->MajorFunction == IRP_MJ_WRITE) {
+        if (!set->Stale[member]) {
+            DebugPrint(ERROR, DBG_IOCTLS, "Mirror member %d missed a write 0x%x, now stale\n",
+                       member, Status);
+            set->Stale[member] = TRUE;
+        }
+        return PciDrvMirrorInSync(set) ? STATUS_SUCCESS : Status;
+    }
+
+    if (!ExAcquireRundownProtection(&set->Rundown)) {
+        return Status;
+    }
+
+    other = PciDrvMirrorPickMember(set, PciDrvGetRequestPriority(Irp), tried);
+    if (other != PCIDRV_STRIPE_NO_MEMBER) {
+        status = PciDrvStripeSendChild(
+                    set,
+                    other,
+                    Irp,
+                    offset,
+                    MmGetMdlByteCount(Child->MdlAddress),
+                    IoGetCurrentIrpStackLocation(Irp)->Parameters.Read.ByteOffset.QuadPart + offset,
+                    tried);
+        if (!NT_SUCCESS(status)) {
+            status = Status;
+        }
+    }
+
+    ExReleaseRundownProtection(&set->Rundown);
+
+    return status;
+}
+
+
+static
+NTSTATUS
+PciDrvStripeChildComplete(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PIRP           Irp,
+    __in PVOID          Context
+    )
+/*++
+Routine Description:
+
+    Completion routine of a child IRP. Frees it and accounts for it in
+    the request it was split from.
+
+--*/
+{
+    PIRP     parent = (PIRP)Context;
+    NTSTATUS status = Irp->IoStatus.Status;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    if (!NT_SUCCESS(status) && Globals.StripeSet.Mirrored) {
+        status = PciDrvMirrorChildFailed(parent, Irp, status);
+    }
+    if (!NT_SUCCESS(status)) {
+        InterlockedCompareExchange(&PCIDRV_STRIPE_STATUS(parent), status, STATUS_SUCCESS);
+    }
+
+    IoFreeMdl(Irp->MdlAddress);
+    IoFreeIrp(Irp);
+
+    PciDrvStripeCompleteRequest(parent);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+
+static
+NTSTATUS
+PciDrvStripeSendPiece(
+    __in PPCIDRV_STRIPE_SET Set,
+    __in PIRP               Irp,
+    __in ULONG              Offset,
+    __in ULONG              Length,
+    __in ULONGLONG          VolumeOffset
+    )
+/*++
+Routine Description:
+
+    Sends one piece of a request, which lies within a stripe unit: to
+    the member holding it when striping, to the best member to read it
+    from or to every member when mirroring. Called with the set rundown
+    held.
+
+--*/
+{
+    ULONGLONG unitNumber = VolumeOffset >> Set->UnitShift;
+    ULONG     unitMask = (1UL << Set->UnitShift) - 1;
+    ULONG     member;
+    NTSTATUS  status;
+
+    if (!Set->Mirrored) {
+        return PciDrvStripeSendChild(
+                    Set,
+                    (ULONG)(unitNumber % Set->MemberCount),
+                    Irp,
+                    Offset,
+                    Length,
+                    ((unitNumber / Set->MemberCount) << Set->UnitShift) + (VolumeOffset & unitMask),
+                    0);
+    }
+
+    if (IoGetCurrentIrpStackLocation(Irp)->MajorFunction == IRP_MJ_READ) {
+        member = PciDrvMirrorPickMember(Set, PciDrvGetRequestPriority(Irp), 0);
+        if (member == PCIDRV_STRIPE_NO_MEMBER) {
+            return STATUS_DEVICE_NOT_READY;
+        }
+        return PciDrvStripeSendChild(Set, member, Irp, Offset, Length, VolumeOffset, 0);
+    }
+
+    status = STATUS_DEVICE_NOT_READY;
+    for (member = 0; member < Set->MemberCount; member++) {
+        if (Set->Members[member] != NULL) {
+            status = PciDrvStripeSendChild(Set, member, Irp, Offset, Length, VolumeOffset, 0);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+        }
+    }
+
+    return status;
+}
+
+
+static
+NTSTATUS
+PciDrvStripeReadWrite(
+    __in PIRP Irp
+    )
+/*++
+Routine Description:
+
+    Splits a read or write of the stripe device at stripe unit boundaries
+    and sends the pieces to the members.
+
+--*/
+{
+    PPCIDRV_STRIPE_SET set = &Globals.StripeSet;
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONGLONG          offset;
+    ULONG              length, done, piece, unitMask, blockMask;
+    NTSTATUS           status;
+
+    if (!ExAcquireRundownProtection(&set->Rundown)) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    offset = (ULONGLONG)irpStack->Parameters.Read.ByteOffset.QuadPart;
+    length = irpStack->Parameters.Read.Length;
+    unitMask = (1UL << set->UnitShift) - 1;
+    blockMask = (1UL << set->LbaShift) - 1;
+
+    if (Irp->MdlAddress == NULL || length == 0 ||
+        length != MmGetMdlByteCount(Irp->MdlAddress) ||
+        (length & blockMask) != 0 || (offset & blockMask) != 0 ||
+        irpStack->Parameters.Read.ByteOffset.QuadPart < 0) {
+        ExReleaseRundownProtection(&set->Rundown);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (offset >= set->Length || length > set->Length - offset) {
+        ExReleaseRundownProtection(&set->Rundown);
+        return STATUS_NONEXISTENT_SECTOR;
+    }
+
+    //
+    // One reference for the loop, so that children completing meanwhile
+    // cannot complete the request before every piece has been sent.
+    //
+    PCIDRV_STRIPE_PENDING(Irp) = 1;
+    PCIDRV_STRIPE_STATUS(Irp) = STATUS_SUCCESS;
+    IoMarkIrpPending(Irp);
+
+    for (done = 0; done < length; done += piece) {
+
+        piece = min(length - done, (unitMask + 1) - (ULONG)(offset & unitMask));
+
+        status = PciDrvStripeSendPiece(set, Irp, done, piece, offset);
+        if (!NT_SUCCESS(status)) {
+            InterlockedCompareExchange(&PCIDRV_STRIPE_STATUS(Irp), status, STATUS_SUCCESS);
+            break;
+        }
+
+        offset += piece;
+    }
+
+    ExReleaseRundownProtection(&set->Rundown);
+
+    PciDrvStripeCompleteRequest(Irp);
+
+    return STATUS_PENDING;
+}
+
+
+static
+NTSTATUS
+PciDrvStripeGetInformation(
+    __in  PIRP   Irp,
+    __out PULONG BytesReturned
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_GET_STRIPE_INFORMATION.
+
+--*/
+{
+    PPCIDRV_STRIPE_SET         set = &Globals.StripeSet;
+    PIO_STACK_LOCATION         irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PPCIDRV_STRIPE_INFORMATION info;
+    ULONG                      i;
+
+    *BytesReturned = 0;
+
+    if (irpStack->Parameters.DeviceIoControl.OutputBufferLength <
+        sizeof(PCIDRV_STRIPE_INFORMATION)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    info = (PPCIDRV_STRIPE_INFORMATION)Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(info, sizeof(PCIDRV_STRIPE_INFORMATION));
+
+    info->Members = set->MemberCount;
+    info->MembersPresent = set->Joined;
+    info->Mirrored = set->Mirrored;
+
+    //
+    // The layout is only valid, and only stays so, while the set is
+    // active.
+    //
+    if (ExAcquireRundownProtection(&set->Rundown)) {
+        for (i = 0; i < set->MemberCount; i++) {
+            if (set->Members[i] != NULL && !set->Stale[i]) {
+                info->MembersInSync++;
+            }
+        }
+        info->StripeUnit = 1UL << set->UnitShift;
+        info->BlockSize = 1UL << set->LbaShift;
+        info->Length = set->Length;
+        ExReleaseRundownProtection(&set->Rundown);
+    }
+
+    *BytesReturned = sizeof(PCIDRV_STRIPE_INFORMATION);
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+PciDrvStripeDispatch(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PIRP           Irp
+    )
+/*++
+Routine Description:
+
+    Dispatch routine of the stripe device, called by the dispatch
+    routines of the driver for every IRP sent to it.
+
+Arguments:
+
+    DeviceObject    The stripe device
+    Irp             The request
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG              bytesReturned = 0;
+    NTSTATUS           status;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    switch (irpStack->MajorFunction) {
+        case IRP_MJ_CREATE:
+        case IRP_MJ_CLEANUP:
+        case IRP_MJ_CLOSE:
+            status = STATUS_SUCCESS;
+            break;
+
+        case IRP_MJ_READ:
+        case IRP_MJ_WRITE:
+            status = PciDrvStripeReadWrite(Irp);
+            if (status == STATUS_PENDING) {
+                return status;
+            }
+            break;
+
+        case IRP_MJ_DEVICE_CONTROL:
+            if (irpStack->Parameters.DeviceIoControl.IoControlCode ==
+                IOCTL_GET_STRIPE_INFORMATION) {
+                status = PciDrvStripeGetInformation(Irp, &bytesReturned);
+            } else {
+                status = STATUS_INVALID_DEVICE_REQUEST;
+            }
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = bytesReturned;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
@@ -0,0 +1,1988 @@
+/*++
+
+Module Name:
+
+    bench.c
+
+Abstract:
+
+    Loads the driver on an emulated controller the way the system does
+    and drives reads and writes through it. bench.c is the bus driver,
+    whose PDO answers the PnP IRPs the driver sends down, with config
+    space and the resources of the controller, and it is the PnP and
+    I/O managers above the device: DriverEntry, AddDevice, a start,
+    handles opened, read and written through IRP_MJ_READ and
+    IRP_MJ_WRITE and closed, then query-stop, stop, restart with a
+    request held meanwhile, query-remove, remove and unload. That is
+    the default mode; the modes of modes.c compare settings on devices
+    of their own, with the same pieces.
+
+    Every thread binds to a virtual processor, opens a handle of its own
+    and keeps a fixed number of IRPs in flight, each with its own
+    buffer, reissuing an IRP from its completion routine's free list.
+    The emulated controller completes commands as the doorbell is
+    written, so the numbers are those of the driver's own path and of
+    the shim underneath it, not of any device.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "precomp.h"
+#include "harness.h"
+#include "bench.h"
+
+//
+// Device extension of a PDO of the bus driver.
+//
+typedef struct _BENCH_PDO {
+    ULONG                       Signature;  // not a stripe device
+    PEMU_CONTROLLER             Controller;
+    PNVME_CONTROLLER_REGISTERS  Registers;
+    ULONG                       RegisterLength;
+    ULONG                       Vector;
+    PVOID                       Cmb;
+    ULONG                       CmbLength;
+} BENCH_PDO, *PBENCH_PDO;
+
+//
+// The resource list of a start: the register BAR, the interrupt and the
+// BAR of the controller memory buffer, if there is one.
+//
+typedef struct _BENCH_RESOURCES {
+    CM_RESOURCE_LIST                List;
+    CM_PARTIAL_RESOURCE_DESCRIPTOR  Interrupt;
+    CM_PARTIAL_RESOURCE_DESCRIPTOR  Cmb;
+} BENCH_RESOURCES, *PBENCH_RESOURCES;
+
+C_ASSERT(FIELD_OFFSET(BENCH_RESOURCES, Interrupt) ==
+         FIELD_OFFSET(CM_RESOURCE_LIST, List[0].PartialResourceList.PartialDescriptors[1]));
+C_ASSERT(FIELD_OFFSET(BENCH_RESOURCES, Cmb) ==
+         FIELD_OFFSET(BENCH_RESOURCES, Interrupt) + sizeof(CM_PARTIAL_RESOURCE_DESCRIPTOR));
+
+BENCH_OPTIONS Options = {
+    .Mode = "io",
+    .Nodes = 1,
+    .QueueDepth = 32,
+    .BlockSize = 4096,
+    .Seconds = 5,
+    .RemoteAccessCost = 100,
+    .Hint = IoPriorityNormal,
+};
+
+static DRIVER_OBJECT    BusDriver;
+static DRIVER_OBJECT    FunctionDriver;
+static DRIVER_EXTENSION FunctionDriverExtension;
+static volatile LONG    Stopping;
+
+//
+// Tunables the next devices get in their device keys, on top of those
+// of BenchAddDevice.
+//
+static struct {
+    PCWSTR  Name;
+    ULONG   Value;
+} ParameterOverrides[BENCH_MAX_PARAMETERS];
+static ULONG ParameterOverrideCount;
+
+
+static
+BOOLEAN
+BenchIoMode(
+    VOID
+    );
+
+static const struct {
+    PCSTR   Name;
+    BOOLEAN (*Routine)(VOID);
+    PCSTR   Description;
+} Modes[] = {
+    { "io",     BenchIoMode,    "random I/O, then reset, stop, restart and remove" },
+    { "numa",   BenchNumaMode,  "queues on the CPU's node against the device's (-n 2 or more)" },
+    { "cancel", BenchCancelMode, "1024 requests in flight per queue, cancelled at random" },
+    { "timeout", BenchTimeoutMode, "dropped commands: Abort, reset and replay, with -d checks" },
+    { "start",  BenchStartMode, "time to ready of 1 and 24 controllers starting at once" },
+    { "close",  BenchCloseMode, "closing 100 handles with 100 requests in flight each" },
+    { "wrr",    BenchWrrMode,   "high priority latency under a saturating low priority load" },
+    { "qos",    BenchQosMode,   "per handle share of 6 handles of 3 processes under IOPS limits" },
+    { "zipf",   BenchZipfMode,  "Zipfian and uniform reads through the read cache" },
+    { "pi",     BenchPiMode,    "CRC16 kernel, and 4 and 128 KiB I/O with and without PI" },
+    { "share",  BenchShareMode, "false sharing among the FDO_DATA groups written on the I/O path" },
+    { "pool",   BenchPoolMode,  "pool allocations per I/O in steady state, which must be none" },
+    { "stripe", BenchStripeMode, "throughput of stripe sets of 1 to 8 controllers" },
+    { "mirror", BenchMirrorMode, "mirror reads against one controller, and failover from a hung member" },
+    { "zns",    BenchZnsMode,   "Zone Append against writes serialized on a zone lock" },
+    { "cmb",    BenchCmbMode,   "command latency with submission queues in host memory and in the CMB" },
+    { "hmb",    BenchHmbMode,   "the order the host memory buffer is given and taken back in across D3" },
+    { "shadow", BenchShadowMode, "register writes per I/O with shadow doorbells off and on" },
+    { "events", BenchEventsMode, "an asynchronous event reaching every waiter but a cancelled one" },
+    { "telemetry", BenchTelemetryMode, "time to pull a 64 MiB telemetry log" },
+    { "firmware", BenchFirmwareMode, "time to download a 32 MiB firmware image one at a time and pipelined" },
+};
+
+static
+VOID
+BenchUsage(
+    __in PCSTR Program
+    )
+{
+    ULONG i;
+
+    fprintf(stderr,
+            "usage: %s [-m mode] [-c processors] [-n nodes] [-t threads] [-q depth per thread]\n"
+            "       [-b block size] [-s seconds] [-w write percent] [-P priority hint 0-4]\n"
+            "       [-R ns per remote queue entry] [-p] polled  [-W] weighted round robin\n"
+            "       [-d] move and check data  [-v] driver debug output\n"
+            "modes:\n",
+            Program);
+    for (i = 0; i < RTL_NUMBER_OF(Modes); i++) {
+        fprintf(stderr, "  %-10s %s\n", Modes[i].Name, Modes[i].Description);
+    }
+    exit(2);
+}
+
+static
+ULONGLONG
+BenchRandom(
+    __inout PULONGLONG State
+    )
+/*++
+Routine Description:
+
+    xorshift64*.
+
+--*/
+{
+    ULONGLONG x = *State;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static
+ULONGLONG
+BenchZipf(
+    __in PBENCH_WORKER Worker
+    )
+/*++
+Routine Description:
+
+    Draws a slot, 0 the most popular, for a Zipfian workload.
+
+--*/
+{
+    PBENCH_WORKLOAD workload = &Worker->Workload;
+    double          theta = workload->ZipfTheta;
+    double          n = (double)workload->ZipfSlots;
+    double          u = (BenchRandom(&Worker->Random) >> 11) * 0x1.0p-53;
+    double          uz = u * workload->ZipfZeta;
+    double          eta;
+    ULONGLONG       slot;
+
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, theta)) {
+        return 1;
+    }
+
+    eta = (1.0 - pow(2.0 / n, 1.0 - theta)) /
+          (1.0 - (1.0 + pow(0.5, theta)) / workload->ZipfZeta);
+    slot = (ULONGLONG)(n * pow(eta * u - eta + 1.0, 1.0 / (1.0 - theta)));
+
+    return min(slot, workload->ZipfSlots - 1);
+}
+
+
+//
+// The bus driver
+//
+
+static
+VOID
+BenchReadConfig(
+    __in  PBENCH_PDO Pdo,
+    __out PVOID      Buffer,
+    __in  ULONG      Offset,
+    __in  ULONG      Length
+    )
+/*++
+Routine Description:
+
+    Reads the config space of a controller: our ids, BAR0 and BAR1 as
+    one 64 bit memory BAR at the register block, and BAR2 and BAR3 as
+    one at the controller memory buffer, if there is one.
+
+--*/
+{
+    PCI_COMMON_CONFIG config;
+    ULONGLONG         bar = (ULONG_PTR)Pdo->Registers;
+    ULONGLONG         cmb = (ULONG_PTR)Pdo->Cmb;
+
+    RtlZeroMemory(&config, sizeof(config));
+    config.VendorID = HW_PCI_VENDOR_ID;
+    config.DeviceID = HW_PCI_DEVICE_ID;
+    config.BaseClass = 0x01;            // mass storage
+    config.SubClass = 0x08;             // non-volatile memory
+    config.ProgIf = 0x02;               // NVM Express
+    config.u.type0.BaseAddresses[0] = ((ULONG)bar & PCI_ADDRESS_MEMORY_ADDRESS_MASK) |
+                                      PCI_TYPE_64BIT;
+    config.u.type0.BaseAddresses[1] = (ULONG)(bar >> 32);
+    if (cmb != 0) {
+        config.u.type0.BaseAddresses[2] = ((ULONG)cmb & PCI_ADDRESS_MEMORY_ADDRESS_MASK) |
+                                          PCI_TYPE_64BIT;
+        config.u.type0.BaseAddresses[3] = (ULONG)(cmb >> 32);
+    }
+    config.u.type0.SubVendorID = HW_PCI_VENDOR_ID;
+
+    RtlCopyMemory(Buffer, (PUCHAR)&config + Offset, Length);
+}
+
+static
+NTSTATUS
+BenchPdoDispatchPnp(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PIRP           Irp
+    )
+/*++
+Routine Description:
+
+    The PDO's end of the PnP IRPs: config space, capabilities, and
+    success for the state changes, which need nothing from a bus that
+    has no power or resources of its own to manage. Interfaces are not
+    supported.
+
+--*/
+{
+    PBENCH_PDO         pdo = (PBENCH_PDO)DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+    PDEVICE_CAPABILITIES capabilities;
+    NTSTATUS           status = Irp->IoStatus.Status;
+    ULONG              i;
+
+    switch (stack->MinorFunction) {
+
+    case IRP_MN_READ_CONFIG:
+        if (stack->Parameters.ReadWriteConfig.WhichSpace != PCI_WHICHSPACE_CONFIG ||
+            stack->Parameters.ReadWriteConfig.Offset > sizeof(PCI_COMMON_CONFIG) ||
+            stack->Parameters.ReadWriteConfig.Length >
+                sizeof(PCI_COMMON_CONFIG) - stack->Parameters.ReadWriteConfig.Offset) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        BenchReadConfig(pdo,
+                        stack->Parameters.ReadWriteConfig.Buffer,
+                        stack->Parameters.ReadWriteConfig.Offset,
+                        stack->Parameters.ReadWriteConfig.Length);
+        Irp->IoStatus.Information = stack->Parameters.ReadWriteConfig.Length;
+        status = STATUS_SUCCESS;
+        break;
+
+    case IRP_MN_WRITE_CONFIG:
+        Irp->IoStatus.Information = stack->Parameters.ReadWriteConfig.Length;
+        status = STATUS_SUCCESS;
+        break;
+
+    case IRP_MN_QUERY_CAPABILITIES:
+        capabilities = stack->Parameters.DeviceCapabilities.Capabilities;
+        capabilities->DeviceState[PowerSystemWorking] = PowerDeviceD0;
+        for (i = PowerSystemSleeping1; i < PowerSystemMaximum; i++) {
+            capabilities->DeviceState[i] = PowerDeviceD3;
+        }
+        capabilities->SystemWake = PowerSystemUnspecified;
+        capabilities->DeviceWake = PowerDeviceUnspecified;
+        capabilities->D3Latency = 100;
+        status = STATUS_SUCCESS;
+        break;
+
+    case IRP_MN_START_DEVICE:
+    case IRP_MN_QUERY_STOP_DEVICE:
+    case IRP_MN_CANCEL_STOP_DEVICE:
+    case IRP_MN_STOP_DEVICE:
+    case IRP_MN_QUERY_REMOVE_DEVICE:
+    case IRP_MN_CANCEL_REMOVE_DEVICE:
+    case IRP_MN_SURPRISE_REMOVAL:
+    case IRP_MN_REMOVE_DEVICE:
+    case IRP_MN_QUERY_PNP_DEVICE_STATE:
+        status = STATUS_SUCCESS;
+        break;
+
+    default:
+        break;
+    }
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+static
+NTSTATUS
+BenchPdoDispatchPower(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PIRP           Irp
+    )
+/*++
+Routine Description:
+
+    The bus puts the device in any power state it is asked to.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    PoStartNextPowerIrp(Irp);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+BenchPdoDispatchOther(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PIRP           Irp
+    )
+/*++
+Routine Description:
+
+    WMI IRPs and anything else reaching the bottom of the stack are left
+    as they are.
+
+--*/
+{
+    NTSTATUS status = Irp->IoStatus.Status;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+
+//
+// The I/O and PnP managers
+//
+
+static
+NTSTATUS
+BenchCallDriver(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PIRP           Irp
+    )
+/*++
+Routine Description:
+
+    Sends an IRP whose top location is set up and waits for it to come
+    back. The IRP stays the caller's.
+
+--*/
+{
+    IO_STATUS_BLOCK ioStatus;
+    KEVENT          event;
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+    Irp->UserEvent = &event;
+    Irp->UserIosb = &ioStatus;
+
+    IoCallDriver(DeviceObject, Irp);
+    KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+
+    Irp->UserEvent = NULL;
+    Irp->UserIosb = NULL;
+
+    return ioStatus.Status;
+}
+
+static
+NTSTATUS
+BenchSendPnp(
+    __in     PBENCH_DEVICE    Device,
+    __in     UCHAR            MinorFunction,
+    __in_opt PBENCH_RESOURCES Resources
+    )
+/*++
+Routine Description:
+
+    Sends a PnP IRP to the top of a device stack, with the resources of
+    a start, and waits for it.
+
+--*/
+{
+    PDEVICE_OBJECT     top = IoGetAttachedDeviceReference(Device->Pdo);
+    PIO_STACK_LOCATION stack;
+    PIRP               irp;
+    NTSTATUS           status;
+
+    irp = IoAllocateIrp(top->StackSize, FALSE);
+    if (irp == NULL) {
+        ObDereferenceObject(top);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
+
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_PNP;
+    stack->MinorFunction = MinorFunction;
+    if (Resources != NULL) {
+        stack->Parameters.StartDevice.AllocatedResources = &Resources->List;
+        stack->Parameters.StartDevice.AllocatedResourcesTranslated = &Resources->List;
+    }
+
+    status = BenchCallDriver(top, irp);
+
+    IoFreeIrp(irp);
+    ObDereferenceObject(top);
+
+    return status;
+}
+
+NTSTATUS
+BenchSendFileIrp(
+    __in PBENCH_DEVICE Device,
+    __in PFILE_OBJECT  FileObject,
+    __in UCHAR         MajorFunction
+    )
+/*++
+Routine Description:
+
+    Sends a create, cleanup or close for a handle and waits for it.
+
+--*/
+{
+    PIO_STACK_LOCATION stack;
+    PIRP               irp;
+    NTSTATUS           status;
+
+    irp = IoAllocateIrp(Device->Fdo->StackSize, FALSE);
+    if (irp == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = MajorFunction;
+    stack->FileObject = FileObject;
+
+    status = BenchCallDriver(Device->Fdo, irp);
+
+    IoFreeIrp(irp);
+
+    return status;
+}
+
+NTSTATUS
+BenchSendIoctl(
+    __in        PBENCH_DEVICE Device,
+    __in        PFILE_OBJECT  FileObject,
+    __in        ULONG         IoControlCode,
+    __inout_opt PVOID         Buffer,
+    __in        ULONG         InputLength,
+    __in        ULONG         OutputLength
+    )
+/*++
+Routine Description:
+
+    Sends a buffered IOCTL on a handle and waits for it. Buffer holds
+    the input and receives the output.
+
+--*/
+{
+    PIO_STACK_LOCATION stack;
+    PIRP               irp;
+    NTSTATUS           status;
+
+    irp = IoAllocateIrp(Device->Fdo->StackSize, FALSE);
+    if (irp == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    irp->AssociatedIrp.SystemBuffer = Buffer;
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+    stack->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+    stack->Parameters.DeviceIoControl.InputBufferLength = InputLength;
+    stack->Parameters.DeviceIoControl.OutputBufferLength = OutputLength;
+    stack->FileObject = FileObject;
+
+    status = BenchCallDriver(Device->Fdo, irp);
+
+    IoFreeIrp(irp);
+
+    return status;
+}
+
+NTSTATUS
+BenchSendDirectIoctl(
+    __in      PBENCH_DEVICE Device,
+    __in      PFILE_OBJECT  FileObject,
+    __in      ULONG         IoControlCode,
+    __in      PVOID         Input,
+    __in      ULONG         InputLength,
+    __in      PMDL          Mdl,
+    __out_opt PULONG_PTR    Information
+    )
+/*++
+Routine Description:
+
+    Sends a direct IOCTL on a handle and waits for it: Input is the
+    buffered input, Mdl the output buffer, or for METHOD_IN_DIRECT the
+    data, and Information receives what the driver returned in it.
+
+--*/
+{
+    PIO_STACK_LOCATION stack;
+    PIRP               irp;
+    NTSTATUS           status;
+
+    irp = IoAllocateIrp(Device->Fdo->StackSize, FALSE);
+    if (irp == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    irp->AssociatedIrp.SystemBuffer = Input;
+    irp->MdlAddress = Mdl;
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+    stack->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+    stack->Parameters.DeviceIoControl.InputBufferLength = InputLength;
+    stack->Parameters.DeviceIoControl.OutputBufferLength = MmGetMdlByteCount(Mdl);
+    stack->FileObject = FileObject;
+
+    status = BenchCallDriver(Device->Fdo, irp);
+    if (Information != NULL) {
+        *Information = irp->IoStatus.Information;
+    }
+
+    irp->MdlAddress = NULL;
+    IoFreeIrp(irp);
+
+    return status;
+}
+
+NTSTATUS
+BenchSendWrite(
+    __in PBENCH_DEVICE Device,
+    __in PFILE_OBJECT  FileObject,
+    __in PMDL          Mdl,
+    __in ULONGLONG     Offset
+    )
+/*++
+Routine Description:
+
+    Writes the buffer of an MDL at a byte offset through a handle and
+    waits for it.
+
+--*/
+{
+    PIO_STACK_LOCATION stack;
+    PIRP               irp;
+    NTSTATUS           status;
+
+    irp = IoAllocateIrp(Device->Fdo->StackSize, FALSE);
+    if (irp == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    irp->MdlAddress = Mdl;
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_WRITE;
+    stack->Parameters.Write.Length = MmGetMdlByteCount(Mdl);
+    stack->Parameters.Write.ByteOffset.QuadPart = (LONGLONG)Offset;
+    stack->FileObject = FileObject;
+
+    status = BenchCallDriver(Device->Fdo, irp);
+
+    irp->MdlAddress = NULL;
+    IoFreeIrp(irp);
+
+    return status;
+}
+
+NTSTATUS
+BenchOpen(
+    __in  PBENCH_DEVICE Device,
+    __out PFILE_OBJECT  FileObject
+    )
+{
+    RtlZeroMemory(FileObject, sizeof(FILE_OBJECT));
+    FileObject->Type = IO_TYPE_FILE;
+    FileObject->Size = sizeof(FILE_OBJECT);
+    FileObject->DeviceObject = Device->Fdo;
+
+    return BenchSendFileIrp(Device, FileObject, IRP_MJ_CREATE);
+}
+
+VOID
+BenchClose(
+    __in PBENCH_DEVICE Device,
+    __in PFILE_OBJECT  FileObject
+    )
+{
+    BenchSendFileIrp(Device, FileObject, IRP_MJ_CLEANUP);
+    BenchSendFileIrp(Device, FileObject, IRP_MJ_CLOSE);
+}
+
+static
+VOID
+BenchSetParameter(
+    __in PDEVICE_OBJECT Pdo,
+    __in PCWSTR         Name,
+    __in ULONG          Value
+    )
+/*++
+Routine Description:
+
+    Sets a tunable in the device key, as an INF would.
+
+--*/
+{
+    UNICODE_STRING name;
+    HANDLE         key;
+
+    if (!NT_SUCCESS(IoOpenDeviceRegistryKey(Pdo, PLUGPLAY_REGKEY_DEVICE, KEY_ALL_ACCESS, &key))) {
+        return;
+    }
+
+    RtlInitUnicodeString(&name, Name);
+    ZwSetValueKey(key, &name, 0, REG_DWORD, &Value, sizeof(Value));
+    ZwClose(key);
+}
+
+VOID
+BenchOverrideParameter(
+    __in PCWSTR Name,
+    __in ULONG  Value
+    )
+/*++
+Routine Description:
+
+    Has the devices added from now on get a tunable in their device
+    keys, or a value other than BenchAddDevice's own.
+
+--*/
+{
+    ASSERT(ParameterOverrideCount < BENCH_MAX_PARAMETERS);
+
+    ParameterOverrides[ParameterOverrideCount].Name = Name;
+    ParameterOverrides[ParameterOverrideCount].Value = Value;
+    ParameterOverrideCount++;
+}
+
+VOID
+BenchClearParameterOverrides(
+    VOID
+    )
+{
+    ParameterOverrideCount = 0;
+}
+
+VOID
+BenchDefaultConfig(
+    __out PEMU_CONFIG Config
+    )
+/*++
+Routine Description:
+
+    A controller for the options: 64 queues and a 64 GiB namespace, of
+    4 KiB blocks unless the I/O is smaller, attached to node 0.
+
+--*/
+{
+    RtlZeroMemory(Config, sizeof(EMU_CONFIG));
+    Config->MaxQueues = 64;
+    Config->LbaShift = Options.BlockSize >= 4096 ? 12 : 9;
+    Config->Blocks = BENCH_NAMESPACE_BYTES >> Config->LbaShift;
+    Config->WeightedRoundRobin = Options.WeightedRoundRobin;
+    Config->MoveData = Options.Verify;
+    Config->Node = 0;
+}
+
+NTSTATUS
+BenchAddDevice(
+    __in  PEMU_CONFIG   Config,
+    __out PBENCH_DEVICE Device
+    )
+/*++
+Routine Description:
+
+    Creates a controller and the PDO the bus reports for it, and has the
+    driver add its FDO on top, as enumeration does.
+
+--*/
+{
+    PBENCH_PDO pdo;
+    NTSTATUS   status;
+    ULONG      i;
+
+    RtlZeroMemory(Device, sizeof(BENCH_DEVICE));
+
+    Device->Controller = EmuCreateController(Config);
+    if (Device->Controller == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = IoCreateDevice(&BusDriver, sizeof(BENCH_PDO), NULL, FILE_DEVICE_CONTROLLER,
+                            FILE_DEVICE_SECURE_OPEN, FALSE, &Device->Pdo);
+    if (!NT_SUCCESS(status)) {
+        EmuDestroyController(Device->Controller);
+        return status;
+    }
+
+    pdo = (PBENCH_PDO)Device->Pdo->DeviceExtension;
+    pdo->Controller = Device->Controller;
+    EmuQueryResources(Device->Controller, &pdo->Registers, &pdo->RegisterLength, &pdo->Vector);
+    pdo->Cmb = EmuQueryControllerMemoryBuffer(Device->Controller, &pdo->CmbLength);
+    ShimSetDeviceNode(Device->Pdo, Config->Node);
+    CLEAR_FLAG(Device->Pdo->Flags, DO_DEVICE_INITIALIZING);
+
+    BenchSetParameter(Device->Pdo, L"PriorityQueues", Config->WeightedRoundRobin ? 1 : 0);
+    BenchSetParameter(Device->Pdo, L"QueueNodePlacement", HW_NODE_PLACEMENT_DEVICE);
+    BenchSetParameter(Device->Pdo, L"IoQueueDepth", 1024);
+    BenchSetParameter(Device->Pdo, L"IoTimeout", 30);
+    for (i = 0; i < ParameterOverrideCount; i++) {
+        BenchSetParameter(Device->Pdo, ParameterOverrides[i].Name, ParameterOverrides[i].Value);
+    }
+
+    status = FunctionDriver.DriverExtension->AddDevice(&FunctionDriver, Device->Pdo);
+    if (!NT_SUCCESS(status)) {
+        IoDeleteDevice(Device->Pdo);
+        EmuDestroyController(Device->Controller);
+        return status;
+    }
+
+    Device->Fdo = Device->Pdo->AttachedDevice;
+    Device->FdoData = (PFDO_DATA)Device->Fdo->DeviceExtension;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+BenchSendStart(
+    __in PBENCH_DEVICE Device
+    )
+/*++
+Routine Description:
+
+    Starts a device with the register BAR and the interrupt of its
+    controller. The start returns once the driver has begun bringing
+    the controller up.
+
+--*/
+{
+    PBENCH_PDO      pdo = (PBENCH_PDO)Device->Pdo->DeviceExtension;
+    BENCH_RESOURCES resources;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR descriptor;
+
+    RtlZeroMemory(&resources, sizeof(resources));
+    resources.List.Count = 1;
+    resources.List.List[0].InterfaceType = PCIBus;
+    resources.List.List[0].PartialResourceList.Version = 1;
+    resources.List.List[0].PartialResourceList.Revision = 1;
+    resources.List.List[0].PartialResourceList.Count = 2;
+
+    descriptor = &resources.List.List[0].PartialResourceList.PartialDescriptors[0];
+    descriptor->Type = CmResourceTypeMemory;
+    descriptor->ShareDisposition = CmResourceShareDeviceExclusive;
+    descriptor->u.Memory.Start.QuadPart = (LONGLONG)(ULONG_PTR)pdo->Registers;
+    descriptor->u.Memory.Length = pdo->RegisterLength;
+
+    descriptor = &resources.Interrupt;
+    descriptor->Type = CmResourceTypeInterrupt;
+    descriptor->ShareDisposition = CmResourceShareShared;
+    descriptor->u.Interrupt.Level = EMU_DEVICE_IRQL;
+    descriptor->u.Interrupt.Vector = pdo->Vector;
+    descriptor->u.Interrupt.Affinity = (KAFFINITY)-1;
+
+    if (pdo->Cmb != NULL) {
+        resources.List.List[0].PartialResourceList.Count = 3;
+        descriptor = &resources.Cmb;
+        descriptor->Type = CmResourceTypeMemory;
+        descriptor->ShareDisposition = CmResourceShareDeviceExclusive;
+        descriptor->u.Memory.Start.QuadPart = (LONGLONG)(ULONG_PTR)pdo->Cmb;
+        descriptor->u.Memory.Length = pdo->CmbLength;
+    }
+
+    return BenchSendPnp(Device, IRP_MN_START_DEVICE, &resources);
+}
+
+NTSTATUS
+BenchWaitForStart(
+    __in PBENCH_DEVICE Device
+    )
+/*++
+Routine Description:
+
+    Waits until the driver is done bringing the controller of a started
+    device up and tells whether it lets requests through.
+
+--*/
+{
+    KeWaitForSingleObject(&Device->FdoData->StartIdleEvent, Executive, KernelMode, FALSE, NULL);
+
+    if (!NT_SUCCESS(Device->FdoData->StartStatus)) {
+        return Device->FdoData->StartStatus;
+    }
+
+    return Device->FdoData->QueueState == AllowRequests ? STATUS_SUCCESS : STATUS_DEVICE_NOT_READY;
+}
+
+NTSTATUS
+BenchStartDevice(
+    __in PBENCH_DEVICE Device
+    )
+{
+    NTSTATUS status;
+
+    status = BenchSendStart(Device);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    return BenchWaitForStart(Device);
+}
+
+VOID
+BenchRemoveDevice(
+    __in PBENCH_DEVICE Device
+    )
+/*++
+Routine Description:
+
+    Removes a device as PnP does, after a query-remove, and deletes the
+    PDO and the controller once the FDO is gone.
+
+--*/
+{
+    if (Device->Fdo != NULL) {
+        BenchSendPnp(Device, IRP_MN_QUERY_REMOVE_DEVICE, NULL);
+        BenchSendPnp(Device, IRP_MN_REMOVE_DEVICE, NULL);
+        ASSERT(Device->Pdo->AttachedDevice == NULL);
+        Device->Fdo = NULL;
+        Device->FdoData = NULL;
+    }
+
+    IoDeleteDevice(Device->Pdo);
+    EmuDestroyController(Device->Controller);
+}
+
+
+//
+// Workers
+//
+
+static
+ULONG
+BenchHistogramBucket(
+    __in ULONGLONG Latency
+    )
+{
+    ULONG msb;
+
+    if (Latency < BENCH_HISTOGRAM_LINEAR) {
+        return (ULONG)Latency;
+    }
+
+    msb = 63 - __builtin_clzll(Latency);
+
+    return BENCH_HISTOGRAM_LINEAR + (msb - 6) * BENCH_HISTOGRAM_SUBBUCKETS +
+           (ULONG)((Latency >> (msb - 5)) & (BENCH_HISTOGRAM_SUBBUCKETS - 1));
+}
+
+static
+ULONGLONG
+BenchHistogramValue(
+    __in ULONG Bucket
+    )
+/*++
+Routine Description:
+
+    The smallest latency that falls into a bucket.
+
+--*/
+{
+    ULONG octave, sub;
+
+    if (Bucket < BENCH_HISTOGRAM_LINEAR) {
+        return Bucket;
+    }
+
+    octave = (Bucket - BENCH_HISTOGRAM_LINEAR) / BENCH_HISTOGRAM_SUBBUCKETS;
+    sub = (Bucket - BENCH_HISTOGRAM_LINEAR) % BENCH_HISTOGRAM_SUBBUCKETS;
+
+    return (ULONGLONG)(BENCH_HISTOGRAM_SUBBUCKETS + sub) << (octave + 1);
+}
+
+static
+VOID
+BenchFreeRequest(
+    __in PBENCH_WORKER  Worker,
+    __in PBENCH_REQUEST Request
+    )
+/*++
+Routine Description:
+
+    Puts a request on its worker's free list.
+
+--*/
+{
+    PBENCH_REQUEST head;
+
+    head = __atomic_load_n(&Worker->FreeList, __ATOMIC_RELAXED);
+    do {
+        Request->Next = head;
+    } while (!__atomic_compare_exchange_n(&Worker->FreeList, &head, Request,
+                                          TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        KeSetEvent(&Worker->FreeEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+static
+NTSTATUS
+BenchCompletionRoutine(
+    __in PDEVICE_OBJECT DeviceObject,
+    __in PIRP           Irp,
+    __in PVOID          Context
+    )
+/*++
+Routine Description:
+
+    Accounts for a completed request, checks what a read brought back
+    and hands the IRP back to its worker, which owns it. A request the
+    queue had no room for is only counted; the worker tries it again.
+    So is one cancelled as it was asked to be. A second completion of
+    the same issue is counted and otherwise ignored, since the request
+    may be on its way again.
+
+--*/
+{
+    PBENCH_REQUEST request = (PBENCH_REQUEST)Context;
+    PBENCH_WORKER  worker = request->Worker;
+    ULONG          lbaShift = worker->LbaShift;
+    ULONGLONG      latency;
+    ULONG          blocks, i;
+    BOOLEAN        cancelRequested;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    latency = KeQueryInterruptTime() - request->StartTime;
+
+    if (__atomic_exchange_n(&request->Outstanding, 0, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_add_fetch(&worker->DoubleCompletions, 1, __ATOMIC_RELAXED);
+        return STATUS_MORE_PROCESSING_REQUIRED;
+    }
+    cancelRequested = __atomic_load_n(&request->CancelRequested, __ATOMIC_ACQUIRE);
+
+    //
+    // Only the worker's own processor completes its requests unless
+    // threads share a queue, so the counters are updated atomically.
+    //
+    if (Irp->IoStatus.Status == STATUS_DEVICE_BUSY) {
+        __atomic_add_fetch(&worker->Busy, 1, __ATOMIC_RELAXED);
+    } else if (Irp->IoStatus.Status == STATUS_CANCELLED) {
+        __atomic_add_fetch(cancelRequested ? &worker->Cancelled : &worker->WrongCancels, 1,
+                           __ATOMIC_RELAXED);
+    } else {
+        if (cancelRequested) {
+            __atomic_add_fetch(&worker->CancelsMissed, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&worker->Completed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&worker->LatencySum, latency, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&worker->Histogram[BenchHistogramBucket(latency)], 1,
+                           __ATOMIC_RELAXED);
+        if (latency > __atomic_load_n(&worker->LatencyMax, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&worker->LatencyMax, latency, __ATOMIC_RELAXED);
+        }
+
+        if (!NT_SUCCESS(Irp->IoStatus.Status) ||
+            Irp->IoStatus.Information != worker->Workload.BlockSize) {
+            __atomic_add_fetch(&worker->Errors, 1, __ATOMIC_RELAXED);
+            if (Irp->IoStatus.Status == STATUS_IO_TIMEOUT) {
+                __atomic_add_fetch(&worker->TimedOut, 1, __ATOMIC_RELAXED);
+            }
+        } else if (Options.Verify && !request->Write) {
+            blocks = worker->Workload.BlockSize >> lbaShift;
+            for (i = 0; i < blocks; i++) {
+                if (*(PULONGLONG)(request->Buffer + (i << lbaShift)) != request->Lba + i) {
+                    __atomic_add_fetch(&worker->DataErrors, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+        }
+    }
+
+    BenchFreeRequest(worker, request);
+    __atomic_sub_fetch(&worker->InFlight, 1, __ATOMIC_RELEASE);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static
+VOID
+BenchPrepareRequest(
+    __in PBENCH_WORKER  Worker,
+    __in PBENCH_REQUEST Request,
+    __in BOOLEAN        Write,
+    __in ULONGLONG      Lba
+    )
+/*++
+Routine Description:
+
+    Sets up the IRP of a request as the I/O manager sets up a read or
+    write on the worker's handle, stamping the blocks of a write with
+    their LBAs and those of a read with none, so that a read that does
+    not run shows, and marks the request outstanding.
+
+--*/
+{
+    PIRP               irp = Request->Irp;
+    PIO_STACK_LOCATION stack;
+    ULONG              lbaShift = Worker->LbaShift;
+    ULONG              blocks = Worker->Workload.BlockSize >> lbaShift;
+    ULONG              i;
+
+    Request->Write = Write;
+    Request->Lba = Lba;
+    Request->CancelRequested = FALSE;
+    __atomic_store_n(&Request->Outstanding, 1, __ATOMIC_RELEASE);
+
+    if (Options.Verify) {
+        for (i = 0; i < blocks; i++) {
+            *(PULONGLONG)(Request->Buffer + (i << lbaShift)) = Write ? Lba + i : MAXULONGLONG;
+        }
+    }
+
+    IoReuseIrp(irp, STATUS_PENDING);
+    irp->MdlAddress = Request->Mdl;
+    IoSetIoPriorityHint(irp, Worker->Workload.Hint);
+
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = Write ? IRP_MJ_WRITE : IRP_MJ_READ;
+    stack->Parameters.Read.Length = Worker->Workload.BlockSize;
+    stack->Parameters.Read.ByteOffset.QuadPart = (LONGLONG)(Lba << lbaShift);
+    stack->FileObject = &Worker->FileObject;
+    IoSetCompletionRoutine(irp, BenchCompletionRoutine, Request, TRUE, TRUE, TRUE);
+}
+
+static
+BOOLEAN
+BenchIssue(
+    __in PBENCH_WORKER  Worker,
+    __in PBENCH_REQUEST Request
+    )
+/*++
+Routine Description:
+
+    Sends a random read or write to the target.
+
+Return Value:
+
+    FALSE if the queue had no room
+
+--*/
+{
+    ULONG     blocks = Worker->Workload.BlockSize >> Worker->LbaShift;
+    BOOLEAN   write;
+    ULONGLONG lba;
+
+    write = (BOOLEAN)(BenchRandom(&Worker->Random) % 100 < Worker->Workload.WritePercent);
+    if (Worker->Workload.ZipfTheta != 0) {
+        lba = BenchZipf(Worker) * blocks;
+    } else {
+        lba = BenchRandom(&Worker->Random) % (Worker->Blocks / blocks) * blocks;
+    }
+
+    BenchPrepareRequest(Worker, Request, write, lba);
+
+    __atomic_add_fetch(&Worker->InFlight, 1, __ATOMIC_RELAXED);
+    Request->StartTime = KeQueryInterruptTime();
+
+    //
+    // Only this worker reissues the request, so it is safe to look at
+    // the status even if the request has completed and been freed.
+    //
+    return IoCallDriver(Worker->Target, Request->Irp) != STATUS_DEVICE_BUSY;
+}
+
+ULONG
+BenchIssueAll(
+    __in PBENCH_WORKER Worker
+    )
+/*++
+Routine Description:
+
+    Issues every request on a worker's free list once, without waiting
+    for any to come back, from a thread running on the worker's
+    processor.
+
+Return Value:
+
+    The number of requests the queue had no room for
+
+--*/
+{
+    PBENCH_REQUEST list, request;
+    ULONG          busy = 0;
+
+    list = __atomic_exchange_n(&Worker->FreeList, NULL, __ATOMIC_ACQUIRE);
+    while (list != NULL) {
+        request = list;
+        list = request->Next;
+        if (!BenchIssue(Worker, request)) {
+            busy++;
+        }
+    }
+
+    return busy;
+}
+
+static
+VOID
+BenchCancel(
+    __in PBENCH_WORKER Worker
+    )
+/*++
+Routine Description:
+
+    Cancels a request in flight picked at random, or one time in four
+    forges the cancellation of one instead: an abort for its command
+    id with the next generation, and one with the right generation but
+    another IRP, as a cancel routine racing the completion and the
+    reuse of the id would send. The driver must ignore both, so the
+    request must not come back cancelled. Only this worker reissues its
+    requests, so an IRP it looks at stays put, if not in flight.
+
+--*/
+{
+    PBENCH_REQUEST request;
+    PIRP           other;
+    PHW_QUEUE      queue;
+    ULONGLONG      random = BenchRandom(&Worker->Random);
+    ULONG          index = (ULONG)(random % Worker->Workload.QueueDepth);
+
+    request = &Worker->Requests[index];
+    if (__atomic_load_n(&request->Outstanding, __ATOMIC_ACQUIRE) == 0 ||
+        request->CancelRequested) {
+        return;
+    }
+
+    if ((random >> 32) % 4 != 0) {
+        __atomic_store_n(&request->CancelRequested, TRUE, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&Worker->CancelsSent, 1, __ATOMIC_RELAXED);
+        IoCancelIrp(request->Irp);
+        return;
+    }
+
+    queue = __atomic_load_n((PHW_QUEUE *)&HW_IRP_QUEUE(request->Irp), __ATOMIC_ACQUIRE);
+    if (queue == NULL) {
+        return;
+    }
+
+    other = Worker->Requests[(index + 1) % Worker->Workload.QueueDepth].Irp;
+    HwAbortRequest(queue, HW_IRP_COMMAND_ID(request->Irp),
+                   (USHORT)(HW_IRP_GENERATION(request->Irp) + 1), request->Irp);
+    HwAbortRequest(queue, HW_IRP_COMMAND_ID(request->Irp),
+                   HW_IRP_GENERATION(request->Irp), other);
+    __atomic_add_fetch(&Worker->ForgedAborts, 2, __ATOMIC_RELAXED);
+}
+
+static
+VOID
+BenchPoll(
+    __in PBENCH_WORKER Worker
+    )
+/*++
+Routine Description:
+
+    Polled mode: reaps the queue the worker submits to, at DISPATCH_LEVEL
+    as the completion DPC would.
+
+--*/
+{
+    PHW_QUEUE queue;
+    KIRQL     oldIrql;
+
+    queue = HwGetSubmissionQueue(Worker->Device->FdoData, Worker->Priority);
+    if (queue == NULL) {
+        return;
+    }
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    HwProcessCompletionQueue(queue);
+    KeLowerIrql(oldIrql);
+}
+
+static
+VOID
+BenchWaitForCompletions(
+    __in PBENCH_WORKER Worker
+    )
+{
+    LARGE_INTEGER timeout;
+
+    if (Options.Polled) {
+        BenchPoll(Worker);
+        return;
+    }
+
+    timeout.QuadPart = -10000LL;
+    KeWaitForSingleObject(&Worker->FreeEvent, Executive, KernelMode, FALSE, &timeout);
+}
+
+static
+PVOID
+BenchWorker(
+    __in PVOID Context
+    )
+{
+    PBENCH_WORKER  worker = (PBENCH_WORKER)Context;
+    PBENCH_REQUEST list, request;
+
+    ShimBindThread(worker->Processor);
+
+    while (!__atomic_load_n(&Stopping, __ATOMIC_ACQUIRE)) {
+
+        list = __atomic_exchange_n(&worker->FreeList, NULL, __ATOMIC_ACQUIRE);
+        if (list == NULL) {
+            BenchWaitForCompletions(worker);
+            continue;
+        }
+
+        while (list != NULL) {
+            request = list;
+            list = request->Next;
+            if (worker->Workload.CancelInterval != 0 &&
+                BenchRandom(&worker->Random) % worker->Workload.CancelInterval == 0) {
+                BenchCancel(worker);
+            }
+            if (!BenchIssue(worker, request)) {
+                while (list != NULL) {
+                    request = list;
+                    list = request->Next;
+                    BenchFreeRequest(worker, request);
+                }
+                BenchWaitForCompletions(worker);
+            }
+        }
+    }
+
+    while (__atomic_load_n(&worker->InFlight, __ATOMIC_ACQUIRE) != 0) {
+        BenchWaitForCompletions(worker);
+    }
+
+    return NULL;
+}
+
+VOID
+BenchDefaultWorkload(
+    __out PBENCH_WORKLOAD Workload
+    )
+{
+    Workload->BlockSize = Options.BlockSize;
+    Workload->QueueDepth = Options.QueueDepth;
+    Workload->WritePercent = Options.WritePercent;
+    Workload->Hint = Options.Hint;
+    Workload->CancelInterval = 0;
+    Workload->ZipfTheta = 0;
+    Workload->ZipfZeta = 0;
+    Workload->ZipfSlots = 0;
+}
+
+VOID
+BenchSetZipf(
+    __inout PBENCH_WORKLOAD Workload,
+    __in    double          Theta,
+    __in    ULONGLONG       Slots
+    )
+/*++
+Routine Description:
+
+    Makes a workload draw its offsets from a Zipfian distribution of
+    skew Theta, below 1, over Slots blocks, with the method of Gray et
+    al., "Quickly generating billion-record synthetic databases". Its
+    normalization constant, the Slots-th generalized harmonic number,
+    takes one pass over the slots, so it is worked out once here.
+
+--*/
+{
+    ULONGLONG i;
+    double    zeta = 0;
+
+    for (i = 1; i <= Slots; i++) {
+        zeta += pow((double)i, -Theta);
+    }
+
+    Workload->ZipfTheta = Theta;
+    Workload->ZipfZeta = zeta;
+    Workload->ZipfSlots = Slots;
+}
+
+BOOLEAN
+BenchCreateWorker(
+    __in     ULONG           Index,
+    __in     PBENCH_DEVICE   Device,
+    __in_opt PDEVICE_OBJECT  Target,
+    __in     PBENCH_WORKLOAD Workload,
+    __out    PBENCH_WORKER   Worker
+    )
+/*++
+Routine Description:
+
+    Opens a worker's handle on a device and sets up its IRPs, each with
+    an MDL over its own page aligned buffer, all on the free list. The
+    requests go to the device unless another target is given, whose
+    geometry is then that of the device's namespace as well.
+
+--*/
+{
+    PBENCH_REQUEST     request;
+    PIO_STACK_LOCATION stack;
+    PIRP               irp;
+    ULONG              i;
+
+    RtlZeroMemory(Worker, sizeof(BENCH_WORKER));
+    Worker->Index = Index;
+    Worker->Processor = Index % Options.Processors;
+    Worker->Random = 0x9E3779B97F4A7C15ULL * (Index + 1);
+    Worker->Device = Device;
+    Worker->Target = Target != NULL ? Target : Device->Fdo;
+    Worker->LbaShift = Device->FdoData->LbaShift;
+    Worker->Blocks = Device->FdoData->NamespaceBlocks;
+    Worker->Workload = *Workload;
+    KeInitializeEvent(&Worker->FreeEvent, SynchronizationEvent, FALSE);
+
+    if (!NT_SUCCESS(BenchOpen(Device, &Worker->FileObject))) {
+        return FALSE;
+    }
+
+    Worker->Requests = ExAllocatePoolWithTag(NonPagedPool,
+                                             Workload->QueueDepth * sizeof(BENCH_REQUEST),
+                                             BENCH_POOL_TAG);
+    if (Worker->Requests == NULL) {
+        return FALSE;
+    }
+    RtlZeroMemory(Worker->Requests, Workload->QueueDepth * sizeof(BENCH_REQUEST));
+
+    for (i = 0; i < Workload->QueueDepth; i++) {
+        request = &Worker->Requests[i];
+        request->Worker = Worker;
+        request->Buffer = ExAllocatePoolWithTag(NonPagedPool, Workload->BlockSize,
+                                                BENCH_POOL_TAG);
+        request->Irp = IoAllocateIrp(Worker->Target->StackSize, FALSE);
+        if (request->Buffer == NULL || request->Irp == NULL) {
+            return FALSE;
+        }
+        RtlZeroMemory(request->Buffer, Workload->BlockSize);
+        request->Mdl = IoAllocateMdl(request->Buffer, Workload->BlockSize, FALSE, FALSE, NULL);
+        if (request->Mdl == NULL) {
+            return FALSE;
+        }
+        MmBuildMdlForNonPagedPool(request->Mdl);
+        request->Next = Worker->FreeList;
+        Worker->FreeList = request;
+    }
+
+    //
+    // The queue the requests go to, for polling, is that of the class
+    // the driver gives them.
+    //
+    irp = Worker->Requests[0].Irp;
+    IoSetIoPriorityHint(irp, Workload->Hint);
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->FileObject = &Worker->FileObject;
+    IoSetNextIrpStackLocation(irp);
+    Worker->Priority = PciDrvGetRequestPriority(irp);
+    IoReuseIrp(irp, STATUS_SUCCESS);
+
+    return TRUE;
+}
+
+VOID
+BenchDeleteWorker(
+    __in PBENCH_WORKER Worker
+    )
+{
+    PBENCH_REQUEST request;
+    ULONG          i;
+
+    if (Worker->FileObject.Type == IO_TYPE_FILE) {
+        BenchClose(Worker->Device, &Worker->FileObject);
+    }
+
+    if (Worker->Requests == NULL) {
+        return;
+    }
+
+    for (i = 0; i < Worker->Workload.QueueDepth; i++) {
+        request = &Worker->Requests[i];
+        if (request->Mdl != NULL) {
+            IoFreeMdl(request->Mdl);
+        }
+        if (request->Irp != NULL) {
+            IoFreeIrp(request->Irp);
+        }
+        if (request->Buffer != NULL) {
+            ExFreePoolWithTag(request->Buffer, BENCH_POOL_TAG);
+        }
+    }
+
+    ExFreePoolWithTag(Worker->Requests, BENCH_POOL_TAG);
+}
+
+static
+VOID
+BenchMaskInterrupts(
+    __in PBENCH_WORKER Workers,
+    __in ULONG         Count,
+    __in BOOLEAN       Mask
+    )
+/*++
+Routine Description:
+
+    Polled mode: masks the interrupts of the workers' devices for a run
+    and unmasks them after it. Admin commands the driver sends meanwhile,
+    the reads of the log pages of a start among them, wait for the
+    interrupt.
+
+--*/
+{
+    PNVME_CONTROLLER_REGISTERS registers;
+    ULONG                      i;
+
+    for (i = 0; i < Count; i++) {
+        registers = Workers[i].Device->FdoData->controller_regs;
+        HwWriteRegisterULong(Mask ? &registers->INTMS : &registers->INTMC,
+                             HW_INTERRUPT_VECTOR_MASK);
+    }
+}
+
+ULONGLONG
+BenchRunWorkers(
+    __in PBENCH_WORKER Workers,
+    __in ULONG         Count,
+    __in ULONG         Seconds
+    )
+/*++
+Routine Description:
+
+    Runs workers for a number of seconds and waits for all their
+    requests to come back.
+
+Return Value:
+
+    The time the run took, in 100ns units
+
+--*/
+{
+    ULONGLONG start, elapsed;
+    ULONG     i;
+
+    if (Options.Polled) {
+        BenchMaskInterrupts(Workers, Count, TRUE);
+    }
+
+    __atomic_store_n(&Stopping, 0, __ATOMIC_RELEASE);
+
+    start = KeQueryInterruptTime();
+    for (i = 0; i < Count; i++) {
+        pthread_create(&Workers[i].Thread, NULL, BenchWorker, &Workers[i]);
+    }
+
+    sleep(Seconds);
+    __atomic_store_n(&Stopping, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < Count; i++) {
+        pthread_join(Workers[i].Thread, NULL);
+    }
+    elapsed = KeQueryInterruptTime() - start;
+
+    if (Options.Polled) {
+        BenchMaskInterrupts(Workers, Count, FALSE);
+    }
+
+    return elapsed;
+}
+
+VOID
+BenchSummarize(
+    __in  PBENCH_WORKER Workers,
+    __in  ULONG         Count,
+    __in  ULONGLONG     Elapsed,
+    __out PBENCH_RESULT Result
+    )
+/*++
+Routine Description:
+
+    Adds up the counters and latencies of a set of workers.
+
+--*/
+{
+    ULONGLONG latencySum = 0, latencyMax = 0, seen, bucket;
+    ULONGLONG p50 = 0, p99 = 0;
+    ULONG     b, i;
+
+    RtlZeroMemory(Result, sizeof(BENCH_RESULT));
+
+    for (i = 0; i < Count; i++) {
+        Result->Completed += Workers[i].Completed;
+        Result->Errors += Workers[i].Errors;
+        Result->DataErrors += Workers[i].DataErrors;
+        Result->Busy += Workers[i].Busy;
+        Result->CancelsSent += Workers[i].CancelsSent;
+        Result->Cancelled += Workers[i].Cancelled;
+        Result->CancelsMissed += Workers[i].CancelsMissed;
+        Result->ForgedAborts += Workers[i].ForgedAborts;
+        Result->WrongCancels += Workers[i].WrongCancels;
+        Result->DoubleCompletions += Workers[i].DoubleCompletions;
+        Result->TimedOut += Workers[i].TimedOut;
+        latencySum += Workers[i].LatencySum;
+        latencyMax = max(latencyMax, Workers[i].LatencyMax);
+    }
+
+    seen = 0;
+    for (b = 0; b < BENCH_HISTOGRAM_BUCKETS && seen * 100 < Result->Completed * 99; b++) {
+        bucket = 0;
+        for (i = 0; i < Count; i++) {
+            bucket += Workers[i].Histogram[b];
+        }
+        seen += bucket;
+        if (p50 == 0 && seen * 2 >= Result->Completed) {
+            p50 = BenchHistogramValue(b);
+        }
+        if (seen * 100 >= Result->Completed * 99) {
+            p99 = BenchHistogramValue(b);
+        }
+    }
+
+    Result->Iops = Elapsed != 0 ? Result->Completed * 1e7 / Elapsed : 0.0;
+    Result->MeanUs = Result->Completed != 0 ? latencySum / 10.0 / Result->Completed : 0.0;
+    Result->P50Us = p50 / 10.0;
+    Result->P99Us = p99 / 10.0;
+    Result->MaxUs = latencyMax / 10.0;
+}
+
+BOOLEAN
+BenchWaitForRundown(
+    __in PBENCH_DEVICE Device
+    )
+/*++
+Routine Description:
+
+    Waits for the driver's count of outstanding I/O to fall back to the
+    bias of 2. The driver drops its reference only after
+    IoCompleteRequest returns, so a count taken as soon as the last
+    completion routine has run can still be one high.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&Device->FdoData->OutstandingIO, __ATOMIC_ACQUIRE) == 2) {
+            return TRUE;
+        }
+        usleep(1000);
+    }
+
+    fprintf(stderr, "%d I/Os still outstanding\n", Device->FdoData->OutstandingIO - 2);
+
+    return FALSE;
+}
+
+
+//
+// Reset, stop and restart
+//
+
+static
+NTSTATUS
+BenchSendRead(
+    __in PBENCH_WORKER Worker,
+    __in ULONGLONG     Lba
+    )
+/*++
+Routine Description:
+
+    Sends one read on a worker's handle, outside a run. The completion
+    routine accounts for it as for any other.
+
+--*/
+{
+    PBENCH_REQUEST request;
+
+    request = __atomic_exchange_n(&Worker->FreeList, NULL, __ATOMIC_ACQUIRE);
+    ASSERT(request != NULL);
+    if (request->Next != NULL) {
+        BenchFreeRequest(Worker, request->Next);
+    }
+
+    BenchPrepareRequest(Worker, request, FALSE, Lba);
+    __atomic_add_fetch(&Worker->InFlight, 1, __ATOMIC_RELAXED);
+    request->StartTime = KeQueryInterruptTime();
+
+    return IoCallDriver(Worker->Target, request->Irp);
+}
+
+static
+BOOLEAN
+BenchWaitForWorker(
+    __in PBENCH_WORKER Worker
+    )
+/*++
+Routine Description:
+
+    Waits up to a second for a worker's requests to come back.
+
+--*/
+{
+    LARGE_INTEGER timeout;
+    ULONG         i;
+
+    timeout.QuadPart = -10000LL;
+    for (i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&Worker->InFlight, __ATOMIC_ACQUIRE) == 0) {
+            return TRUE;
+        }
+        KeWaitForSingleObject(&Worker->FreeEvent, Executive, KernelMode, FALSE, &timeout);
+    }
+
+    return FALSE;
+}
+
+static
+BOOLEAN
+BenchReset(
+    __in PBENCH_WORKER Worker
+    )
+/*++
+Routine Description:
+
+    Resets the controller as the timeout DPC's work item does, with the
+    device idle, and reads through the queues it was brought up with.
+
+--*/
+{
+    NTSTATUS status;
+
+    status = HwResetController(Worker->Device->FdoData);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "reset failed 0x%x\n", status);
+        return FALSE;
+    }
+
+    BenchSendRead(Worker, 3 * (Worker->Workload.BlockSize >> Worker->LbaShift));
+    if (!BenchWaitForWorker(Worker)) {
+        fprintf(stderr, "read not completed after reset\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+BenchStopAndRestart(
+    __in PBENCH_WORKER Worker
+    )
+/*++
+Routine Description:
+
+    Stops the device as PnP does to rebalance resources, sends a read
+    while it is stopped, which the driver must hold, and starts the
+    device again, which must let the read through.
+
+--*/
+{
+    PBENCH_DEVICE device = Worker->Device;
+
+    if (!NT_SUCCESS(BenchSendPnp(device, IRP_MN_QUERY_STOP_DEVICE, NULL)) ||
+        !NT_SUCCESS(BenchSendPnp(device, IRP_MN_STOP_DEVICE, NULL))) {
+        fprintf(stderr, "stop failed\n");
+        return FALSE;
+    }
+
+    if (BenchSendRead(Worker, 7 * (Worker->Workload.BlockSize >> Worker->LbaShift))
+                != STATUS_PENDING ||
+        __atomic_load_n(&Worker->InFlight, __ATOMIC_ACQUIRE) != 1) {
+        fprintf(stderr, "read not held while stopped\n");
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS(BenchStartDevice(device))) {
+        fprintf(stderr, "restart failed\n");
+        return FALSE;
+    }
+
+    if (!BenchWaitForWorker(Worker)) {
+        fprintf(stderr, "held read not completed after restart\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+//
+// The default mode
+//
+
+static
+VOID
+BenchReport(
+    __in PBENCH_DEVICE Device,
+    __in PBENCH_WORKER Workers,
+    __in ULONGLONG     Elapsed
+    )
+{
+    PFDO_DATA                  fdoData = Device->FdoData;
+    PCIDRV_DOORBELL_STATISTICS doorbells;
+    EMU_STATISTICS             controller;
+    BENCH_RESULT               result;
+
+    BenchSummarize(Workers, Options.Threads, Elapsed, &result);
+    HwGetDoorbellStatistics(fdoData, &doorbells);
+    EmuQueryStatistics(Device->Controller, &controller);
+
+    printf("%u processors in %u nodes, %u threads x %u, %u byte I/O, %u%% writes, %s\n",
+           Options.Processors, Options.Nodes, Options.Threads, Options.QueueDepth,
+           Options.BlockSize, Options.WritePercent,
+           Options.Polled ? "polled" : "interrupts");
+    printf("  I/O queues     %u of depth %u, %u priority classes\n",
+           fdoData->IoQueueCount, fdoData->IoQueueDepth, fdoData->PriorityClasses);
+    printf("  IOPS           %.0f\n", result.Iops);
+    printf("  latency        mean %.2f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           result.MeanUs, result.P50Us, result.P99Us, result.MaxUs);
+    printf("  errors         %llu, data errors %llu (reads) %llu (writes), busy %llu\n",
+           result.Errors, result.DataErrors, controller.DataErrors, result.Busy);
+    printf("  doorbells      %llu submissions, %llu SQ tail writes, "
+           "%llu CQ head updates, %llu CQ head writes\n",
+           doorbells.Submissions, doorbells.SubmissionDoorbells,
+           doorbells.CompletionUpdates, doorbells.CompletionDoorbells);
+    printf("  controller     %llu commands, %llu interrupts, %llu completions held back\n",
+           controller.Commands, controller.Interrupts, controller.HeldCompletions);
+}
+
+static
+BOOLEAN
+BenchIoMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Random reads and writes on one device, then a reset, a stop and
+    restart with a read held across it, and a remove. Every IRP must
+    come back, the count of outstanding I/O must return to its bias, and
+    with -d every block must carry its LBA.
+
+--*/
+{
+    BENCH_DEVICE   device;
+    BENCH_WORKLOAD workload;
+    EMU_CONFIG     config;
+    PBENCH_WORKER  workers;
+    ULONGLONG      elapsed;
+    ULONG          i;
+    NTSTATUS       status;
+    BOOLEAN        success = TRUE;
+
+    BenchDefaultConfig(&config);
+
+    status = BenchAddDevice(&config, &device);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "AddDevice failed 0x%x\n", status);
+        return FALSE;
+    }
+
+    status = BenchStartDevice(&device);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "start failed 0x%x\n", status);
+        return FALSE;
+    }
+
+    workers = ExAllocatePoolWithTag(NonPagedPool, Options.Threads * sizeof(BENCH_WORKER),
+                                    BENCH_POOL_TAG);
+    if (workers == NULL) {
+        return FALSE;
+    }
+    BenchDefaultWorkload(&workload);
+    for (i = 0; i < Options.Threads; i++) {
+        if (!BenchCreateWorker(i, &device, NULL, &workload, &workers[i])) {
+            fprintf(stderr, "out of memory\n");
+            return FALSE;
+        }
+    }
+
+    elapsed = BenchRunWorkers(workers, Options.Threads, Options.Seconds);
+
+    //
+    // Every IRP is back: only the bias of 2 is left.
+    //
+    success = BenchWaitForRundown(&device);
+
+    BenchReport(&device, workers, elapsed);
+
+    if (!BenchReset(&workers[0]) || !BenchStopAndRestart(&workers[0])) {
+        success = FALSE;
+    }
+
+    for (i = 0; i < Options.Threads; i++) {
+        if (workers[i].Errors != 0 || workers[i].DataErrors != 0) {
+            success = FALSE;
+        }
+        BenchDeleteWorker(&workers[i]);
+    }
+    ExFreePoolWithTag(workers, BENCH_POOL_TAG);
+
+    if (!BenchWaitForRundown(&device)) {
+        success = FALSE;
+    }
+
+    BenchRemoveDevice(&device);
+
+    return success;
+}
+
+
+//
+// Setup
+//
+
+static
+VOID
+BenchParseOptions(
+    __in int    argc,
+    __in char **argv
+    )
+{
+    long  processors = sysconf(_SC_NPROCESSORS_ONLN);
+    ULONG i;
+    int   option;
+
+    Options.Processors = processors > 0 ? (ULONG)min(processors, MAXIMUM_PROCESSORS) : 1;
+
+    while ((option = getopt(argc, argv, "m:c:n:t:q:b:s:w:P:R:pWdv")) != -1) {
+        switch (option) {
+        case 'm': Options.Mode = optarg; break;
+        case 'c': Options.Processors = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'n': Options.Nodes = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 't': Options.Threads = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'q': Options.QueueDepth = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'b': Options.BlockSize = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 's': Options.Seconds = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'w': Options.WritePercent = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'P': Options.Hint = (IO_PRIORITY_HINT)strtoul(optarg, NULL, 0); break;
+        case 'R': Options.RemoteAccessCost = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'p': Options.Polled = TRUE; break;
+        case 'W': Options.WeightedRoundRobin = TRUE; break;
+        case 'd': Options.Verify = TRUE; break;
+        case 'v': Options.Verbose = TRUE; break;
+        default:  BenchUsage(argv[0]);
+        }
+    }
+
+    if (Options.Threads == 0) {
+        Options.Threads = Options.Processors;
+    }
+
+    for (i = 0; i < RTL_NUMBER_OF(Modes); i++) {
+        if (strcmp(Options.Mode, Modes[i].Name) == 0) {
+            break;
+        }
+    }
+
+    if (optind != argc || i == RTL_NUMBER_OF(Modes) ||
+        Options.Processors == 0 || Options.Processors > MAXIMUM_PROCESSORS ||
+        Options.Nodes == 0 || Options.Nodes > Options.Processors ||
+        Options.QueueDepth == 0 || Options.Seconds == 0 || Options.WritePercent > 100 ||
+        Options.Hint >= MaxIoPriorityTypes ||
+        Options.BlockSize < 512 || (Options.BlockSize & (Options.BlockSize - 1)) != 0 ||
+        Options.BlockSize > (HW_PRP_LIST_SIZE / sizeof(ULONGLONG)) * PAGE_SIZE) {
+        BenchUsage(argv[0]);
+    }
+}
+
+static
+VOID
+BenchLoadDriver(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Sets up the bus driver and calls the DriverEntry of the driver.
+
+--*/
+{
+    UNICODE_STRING registryPath;
+    ULONG          i;
+
+    BusDriver.Type = IO_TYPE_DRIVER;
+    BusDriver.Size = sizeof(DRIVER_OBJECT);
+    for (i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++) {
+        BusDriver.MajorFunction[i] = BenchPdoDispatchOther;
+    }
+    BusDriver.MajorFunction[IRP_MJ_PNP] = BenchPdoDispatchPnp;
+    BusDriver.MajorFunction[IRP_MJ_POWER] = BenchPdoDispatchPower;
+
+    FunctionDriver.Type = IO_TYPE_DRIVER;
+    FunctionDriver.Size = sizeof(DRIVER_OBJECT);
+    FunctionDriver.DriverExtension = &FunctionDriverExtension;
+    FunctionDriverExtension.DriverObject = &FunctionDriver;
+
+    RtlInitUnicodeString(&registryPath,
+                         L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\pcidrv");
+    if (!NT_SUCCESS(DriverEntry(&FunctionDriver, &registryPath))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        exit(1);
+    }
+}
+
+int
+main(
+    int    argc,
+    char **argv
+    )
+{
+    BOOLEAN success = FALSE;
+    ULONG   i;
+
+    BenchParseOptions(argc, argv);
+
+    ShimInitialize(Options.Processors, Options.Nodes);
+    ShimSetDebugOutput(Options.Verbose);
+
+    BenchLoadDriver();
+
+    for (i = 0; i < RTL_NUMBER_OF(Modes); i++) {
+        if (strcmp(Options.Mode, Modes[i].Name) == 0) {
+            success = Modes[i].Routine();
+            break;
+        }
+    }
+
+    FunctionDriver.DriverUnload(&FunctionDriver);
+
+    ShimShutdown();
+
+    return success ? 0 : 1;
+}
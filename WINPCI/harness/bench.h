@@ -0,0 +1,407 @@
+/*++
+
+Module Name:
+
+    bench.h
+
+Abstract:
+
+    What the modes of modes.c share with bench.c: the device stacks the
+    bus driver of bench.c builds, the workers that drive I/O through
+    them, and the results of a run. It goes after <pthread.h>, which
+    does not build after ntddk.h, and the driver's headers.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#define BENCH_NAMESPACE_BYTES       (64ULL << 30)
+#define BENCH_POOL_TAG              'nBeH'
+#define BENCH_MAX_DEVICES           24
+#define BENCH_MAX_PARAMETERS        32
+#define BENCH_DEVICE_PARAMETERS     4           // in the key of every device, see BenchAddDevice
+
+//
+// Latencies are kept in 100ns units in log-linear buckets: exact below
+// 6.4 us, then 32 buckets per power of two, within about 3%.
+//
+#define BENCH_HISTOGRAM_LINEAR      64
+#define BENCH_HISTOGRAM_SUBBUCKETS  32
+#define BENCH_HISTOGRAM_BUCKETS     (BENCH_HISTOGRAM_LINEAR + 58 * BENCH_HISTOGRAM_SUBBUCKETS)
+
+typedef struct _BENCH_OPTIONS {
+    PCSTR           Mode;
+    ULONG           Processors;
+    ULONG           Nodes;
+    ULONG           Threads;
+    ULONG           QueueDepth;         // per thread
+    ULONG           BlockSize;
+    ULONG           Seconds;
+    ULONG           WritePercent;
+    ULONG           RemoteAccessCost;   // ns, NUMA mode
+    IO_PRIORITY_HINT Hint;
+    BOOLEAN         Polled;
+    BOOLEAN         Verify;
+    BOOLEAN         WeightedRoundRobin;
+    BOOLEAN         Verbose;
+} BENCH_OPTIONS;
+
+extern BENCH_OPTIONS Options;
+
+//
+// A device stack: the PDO of the bus driver and the FDO of the driver.
+//
+typedef struct _BENCH_DEVICE {
+    PEMU_CONTROLLER     Controller;
+    PDEVICE_OBJECT      Pdo;
+    PDEVICE_OBJECT      Fdo;
+    PFDO_DATA           FdoData;
+} BENCH_DEVICE, *PBENCH_DEVICE;
+
+//
+// What a worker sends.
+//
+typedef struct _BENCH_WORKLOAD {
+    ULONG               BlockSize;
+    ULONG               QueueDepth;
+    ULONG               WritePercent;
+    IO_PRIORITY_HINT    Hint;
+    ULONG               CancelInterval;     // one issue in this many also cancels, 0 never
+
+    //
+    // Offsets drawn from a Zipfian distribution over the first ZipfSlots
+    // blocks of BlockSize, offset 0 the most popular, rather than
+    // uniformly; see BenchSetZipf.
+    //
+    double              ZipfTheta;          // 0 for uniform
+    double              ZipfZeta;
+    ULONGLONG           ZipfSlots;
+} BENCH_WORKLOAD, *PBENCH_WORKLOAD;
+
+typedef struct _BENCH_WORKER BENCH_WORKER, *PBENCH_WORKER;
+
+typedef struct _BENCH_REQUEST {
+    struct _BENCH_REQUEST * volatile Next;      // free list
+    PBENCH_WORKER           Worker;
+    PIRP                    Irp;
+    PMDL                    Mdl;                // IoReuseIrp clears MdlAddress
+    PUCHAR                  Buffer;
+    ULONGLONG               Lba;
+    BOOLEAN                 Write;
+    volatile BOOLEAN        CancelRequested;    // IoCancelIrp was called on this issue
+    volatile LONG           Outstanding;        // issued and not completed
+    ULONGLONG               StartTime;
+} BENCH_REQUEST, *PBENCH_REQUEST;
+
+struct _BENCH_WORKER {
+    ULONG                   Index;
+    ULONG                   Processor;
+    pthread_t               Thread;
+    ULONGLONG               Random;
+    PBENCH_DEVICE           Device;             // whose handle it opens and polls
+    PDEVICE_OBJECT          Target;             // the requests go to
+    ULONG                   LbaShift;           // of the target
+    ULONGLONG               Blocks;
+    BENCH_WORKLOAD          Workload;
+    ULONG                   Priority;           // PCIDRV_PRIORITY_xxx of the requests
+    FILE_OBJECT             FileObject;         // the worker's handle
+
+    PBENCH_REQUEST          Requests;
+
+    //
+    // Completed requests. Completion routines push, the worker takes
+    // the whole list at once, so there is no ABA to worry about. The
+    // event is set when the list stops being empty.
+    //
+    PBENCH_REQUEST volatile FreeList DECLSPEC_CACHEALIGN;
+    KEVENT                  FreeEvent;
+    volatile LONG           InFlight;
+
+    ULONGLONG               Completed DECLSPEC_CACHEALIGN;
+    ULONGLONG               Errors;
+    ULONGLONG               DataErrors;
+    ULONGLONG               LatencySum;         // 100ns
+    ULONGLONG               LatencyMax;
+    ULONGLONG               Busy;               // STATUS_DEVICE_BUSY, reissued
+    ULONGLONG               CancelsSent;
+    ULONGLONG               Cancelled;          // STATUS_CANCELLED after IoCancelIrp
+    ULONGLONG               CancelsMissed;      // completed anyway after IoCancelIrp
+    ULONGLONG               ForgedAborts;       // for a stale generation or another IRP
+    ULONGLONG               WrongCancels;       // STATUS_CANCELLED without IoCancelIrp
+    ULONGLONG               DoubleCompletions;
+    ULONGLONG               TimedOut;           // STATUS_IO_TIMEOUT, among the errors
+    ULONGLONG               Histogram[BENCH_HISTOGRAM_BUCKETS];
+} DECLSPEC_CACHEALIGN;
+
+typedef struct _BENCH_RESULT {
+    ULONGLONG   Completed;
+    ULONGLONG   Errors;
+    ULONGLONG   DataErrors;
+    ULONGLONG   Busy;
+    ULONGLONG   CancelsSent;
+    ULONGLONG   Cancelled;
+    ULONGLONG   CancelsMissed;
+    ULONGLONG   ForgedAborts;
+    ULONGLONG   WrongCancels;
+    ULONGLONG   DoubleCompletions;
+    ULONGLONG   TimedOut;
+    double      Iops;
+    double      MeanUs;
+    double      P50Us;
+    double      P99Us;
+    double      MaxUs;
+} BENCH_RESULT, *PBENCH_RESULT;
+
+//
+// bench.c
+//
+VOID
+BenchOverrideParameter(
+    __in PCWSTR Name,
+    __in ULONG  Value
+    );
+
+VOID
+BenchClearParameterOverrides(
+    VOID
+    );
+
+VOID
+BenchDefaultConfig(
+    __out PEMU_CONFIG Config
+    );
+
+NTSTATUS
+BenchAddDevice(
+    __in  PEMU_CONFIG   Config,
+    __out PBENCH_DEVICE Device
+    );
+
+NTSTATUS
+BenchSendStart(
+    __in PBENCH_DEVICE Device
+    );
+
+NTSTATUS
+BenchWaitForStart(
+    __in PBENCH_DEVICE Device
+    );
+
+NTSTATUS
+BenchStartDevice(
+    __in PBENCH_DEVICE Device
+    );
+
+NTSTATUS
+BenchSendFileIrp(
+    __in PBENCH_DEVICE Device,
+    __in PFILE_OBJECT  FileObject,
+    __in UCHAR         MajorFunction
+    );
+
+NTSTATUS
+BenchOpen(
+    __in  PBENCH_DEVICE Device,
+    __out PFILE_OBJECT  FileObject
+    );
+
+VOID
+BenchClose(
+    __in PBENCH_DEVICE Device,
+    __in PFILE_OBJECT  FileObject
+    );
+
+NTSTATUS
+BenchSendIoctl(
+    __in        PBENCH_DEVICE Device,
+    __in        PFILE_OBJECT  FileObject,
+    __in        ULONG         IoControlCode,
+    __inout_opt PVOID         Buffer,
+    __in        ULONG         InputLength,
+    __in        ULONG         OutputLength
+    );
+
+NTSTATUS
+BenchSendDirectIoctl(
+    __in      PBENCH_DEVICE Device,
+    __in      PFILE_OBJECT  FileObject,
+    __in      ULONG         IoControlCode,
+    __in      PVOID         Input,
+    __in      ULONG         InputLength,
+    __in      PMDL          Mdl,
+    __out_opt PULONG_PTR    Information
+    );
+
+NTSTATUS
+BenchSendWrite(
+    __in PBENCH_DEVICE Device,
+    __in PFILE_OBJECT  FileObject,
+    __in PMDL          Mdl,
+    __in ULONGLONG     Offset
+    );
+
+VOID
+BenchRemoveDevice(
+    __in PBENCH_DEVICE Device
+    );
+
+BOOLEAN
+BenchWaitForRundown(
+    __in PBENCH_DEVICE Device
+    );
+
+VOID
+BenchDefaultWorkload(
+    __out PBENCH_WORKLOAD Workload
+    );
+
+VOID
+BenchSetZipf(
+    __inout PBENCH_WORKLOAD Workload,
+    __in    double          Theta,
+    __in    ULONGLONG       Slots
+    );
+
+BOOLEAN
+BenchCreateWorker(
+    __in     ULONG           Index,
+    __in     PBENCH_DEVICE   Device,
+    __in_opt PDEVICE_OBJECT  Target,
+    __in     PBENCH_WORKLOAD Workload,
+    __out    PBENCH_WORKER   Worker
+    );
+
+VOID
+BenchDeleteWorker(
+    __in PBENCH_WORKER Worker
+    );
+
+ULONG
+BenchIssueAll(
+    __in PBENCH_WORKER Worker
+    );
+
+ULONGLONG
+BenchRunWorkers(
+    __in PBENCH_WORKER Workers,
+    __in ULONG         Count,
+    __in ULONG         Seconds
+    );
+
+VOID
+BenchSummarize(
+    __in  PBENCH_WORKER Workers,
+    __in  ULONG         Count,
+    __in  ULONGLONG     Elapsed,
+    __out PBENCH_RESULT Result
+    );
+
+//
+// modes.c
+//
+BOOLEAN
+BenchNumaMode(
+    VOID
+    );
+
+BOOLEAN
+BenchCancelMode(
+    VOID
+    );
+
+BOOLEAN
+BenchTimeoutMode(
+    VOID
+    );
+
+BOOLEAN
+BenchStartMode(
+    VOID
+    );
+
+BOOLEAN
+BenchCloseMode(
+    VOID
+    );
+
+BOOLEAN
+BenchWrrMode(
+    VOID
+    );
+
+BOOLEAN
+BenchQosMode(
+    VOID
+    );
+
+BOOLEAN
+BenchZipfMode(
+    VOID
+    );
+
+BOOLEAN
+BenchPiMode(
+    VOID
+    );
+
+BOOLEAN
+BenchShareMode(
+    VOID
+    );
+
+BOOLEAN
+BenchPoolMode(
+    VOID
+    );
+
+BOOLEAN
+BenchStripeMode(
+    VOID
+    );
+
+BOOLEAN
+BenchMirrorMode(
+    VOID
+    );
+
+BOOLEAN
+BenchZnsMode(
+    VOID
+    );
+
+BOOLEAN
+BenchCmbMode(
+    VOID
+    );
+
+BOOLEAN
+BenchHmbMode(
+    VOID
+    );
+
+BOOLEAN
+BenchShadowMode(
+    VOID
+    );
+
+BOOLEAN
+BenchEventsMode(
+    VOID
+    );
+
+BOOLEAN
+BenchTelemetryMode(
+    VOID
+    );
+
+BOOLEAN
+BenchFirmwareMode(
+    VOID
+    );
+
+#endif // _BENCH_H_
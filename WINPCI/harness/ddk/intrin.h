@@ -0,0 +1,15 @@
+#pragma once
+/* The SSE intrinsics, and __cpuid as MSVC has it. The harness defines _M_AMD64 on x86-64 only. */
+#pragma push_macro("__inline")
+#undef __inline
+#include <immintrin.h>
+#include <cpuid.h>
+#pragma pop_macro("__inline")
+
+static inline void HarnessCpuid(int Info[4], int Leaf)
+{
+    __cpuid_count(Leaf, 0, Info[0], Info[1], Info[2], Info[3]);
+}
+
+#undef __cpuid
+#define __cpuid(Info, Leaf) HarnessCpuid((Info), (Leaf))
@@ -0,0 +1,696 @@
+/*++
+
+Module Name:
+
+    ntddk.h
+
+Abstract:
+
+    The part of the WDK the driver core is built against in the user-mode
+    harness. Types keep the layout the driver code relies on; the kernel
+    services declared at the end are implemented on pthreads in shim.c,
+    and the register accessors go to the emulated controller in emu.c.
+    Services the core does not call are only declared.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#pragma once
+#include <stddef.h>
+#include <stdarg.h>
+#include <assert.h>
+#define __in
+#define __out
+#define __in_opt
+#define __out_opt
+#define __inout
+#define __inout_opt
+#define _In_
+#define _Out_
+#define _In_opt_
+#define _Inout_
+#define IN
+#define OUT
+#define OPTIONAL
+#define __inline static inline
+#define FORCEINLINE inline __attribute__((always_inline))
+#define __forceinline static inline
+#define __drv_dispatchType(x)
+#define _Use_decl_annotations_
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN DECLSPEC_ALIGN(64)
+#define __declspec(x)
+#define NTAPI
+#define NTKERNELAPI
+#define DUMMYSTRUCTNAME
+#define DUMMYUNIONNAME
+#define C_ASSERT(e) _Static_assert(e, #e)
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+#define TRUE 1
+#define FALSE 0
+#define VOID void
+#define CONST const
+#if DBG
+#define ASSERT(x) assert(x)
+#define ASSERTMSG(m,x) assert((m) && (x))
+#define NT_ASSERT(x) assert(x)
+#define PAGED_CODE() assert(KeGetCurrentIrql() <= APC_LEVEL)
+#else
+#define ASSERT(x) ((void)sizeof(x))
+#define ASSERTMSG(m,x) ((void)sizeof((m) && (x)))
+#define NT_ASSERT(x) ((void)sizeof(x))
+#define PAGED_CODE() ((void)0)
+#endif
+#define KdPrint(x) DbgPrint x
+#define MAXULONG 0xffffffffUL
+#define MAXUSHORT 0xffff
+#define MAXLONG 0x7fffffffL
+#define MAXULONGLONG 0xffffffffffffffffULL
+#define MAXUCHAR 0xff
+#define PAGE_SIZE 0x1000
+#define PAGE_SHIFT 12
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#define ANSI_NULL ((CHAR)0)
+#define UNICODE_NULL ((WCHAR)0)
+typedef void *PVOID, **PPVOID;
+typedef char CHAR, *PCHAR, CCHAR, *PCCHAR, *PSTR;
+typedef const char *PCSTR;
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN, BYTE;
+typedef short SHORT, CSHORT;
+typedef unsigned short USHORT, *PUSHORT, WCHAR, *PWCHAR, *PWSTR;
+typedef const unsigned short *PCWSTR;
+typedef int LONG32, INT;
+typedef int LONG, *PLONG;
+typedef unsigned int ULONG, *PULONG, ULONG32;
+typedef long long LONGLONG, LONG64, *PLONG64, *PLONGLONG;
+typedef unsigned long long ULONGLONG, ULONG64, *PULONG64, *PULONGLONG, DWORD64;
+typedef unsigned long ULONG_PTR, *PULONG_PTR, SIZE_T, *PSIZE_T, KAFFINITY, *PKAFFINITY;
+typedef long LONG_PTR;
+typedef unsigned int DWORD;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+typedef ULONG ACCESS_MASK;
+typedef PVOID HANDLE, *PHANDLE;
+typedef ULONG LOGICAL;
+typedef struct _GUID { ULONG Data1; USHORT Data2, Data3; UCHAR Data4[8]; } GUID, *LPGUID;
+typedef const GUID *LPCGUID;
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) static const GUID name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+typedef union _LARGE_INTEGER { struct { ULONG LowPart; LONG HighPart; }; struct { ULONG LowPart; LONG HighPart; } u; LONGLONG QuadPart; } LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+typedef union _ULARGE_INTEGER { struct { ULONG LowPart; ULONG HighPart; }; ULONGLONG QuadPart; } ULARGE_INTEGER;
+typedef struct _LIST_ENTRY { struct _LIST_ENTRY *Flink, *Blink; } LIST_ENTRY, *PLIST_ENTRY;
+typedef struct _SINGLE_LIST_ENTRY { struct _SINGLE_LIST_ENTRY *Next; } SINGLE_LIST_ENTRY, *PSINGLE_LIST_ENTRY, SLIST_ENTRY, *PSLIST_ENTRY;
+typedef union _SLIST_HEADER { ULONGLONG Alignment[2]; } SLIST_HEADER, *PSLIST_HEADER;
+typedef struct _UNICODE_STRING { USHORT Length, MaximumLength; PWSTR Buffer; } UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+#define RTL_CONSTANT_STRING(s) { sizeof(s)-sizeof((s)[0]), sizeof(s), (PWSTR)(s) }
+#define CONTAINING_RECORD(address, type, field) ((type *)((PCHAR)(address) - offsetof(type, field)))
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define RTL_FIELD_SIZE(type, field) (sizeof(((type *)0)->field))
+#define RTL_NUMBER_OF(A) (sizeof(A)/sizeof((A)[0]))
+#define ARRAYSIZE(A) RTL_NUMBER_OF(A)
+#define ALIGN_UP_BY(length, alignment) (((ULONG_PTR)(length) + (alignment) - 1) & ~((ULONG_PTR)(alignment) - 1))
+#define ALIGN_DOWN_BY(length, alignment) ((ULONG_PTR)(length) & ~((ULONG_PTR)(alignment) - 1))
+#define ROUND_TO_PAGES(Size) (((ULONG_PTR)(Size) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define BYTES_TO_PAGES(Size) (((Size) >> PAGE_SHIFT) + (((Size) & (PAGE_SIZE - 1)) != 0))
+#define BYTE_OFFSET(Va) ((ULONG)((LONG_PTR)(Va) & (PAGE_SIZE - 1)))
+#define PAGE_ALIGN(Va) ((PVOID)((ULONG_PTR)(Va) & ~(PAGE_SIZE - 1)))
+#define ADDRESS_AND_SIZE_TO_SPAN_PAGES(Va,Size) ((ULONG)((((ULONG_PTR)(Va) & (PAGE_SIZE -1)) + (Size) + (PAGE_SIZE - 1)) >> PAGE_SHIFT))
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#define NT_SUCCESS(s) (((NTSTATUS)(s)) >= 0)
+#define STATUS_SUCCESS ((NTSTATUS)0)
+#define STATUS_PENDING ((NTSTATUS)0x103)
+#define STATUS_TIMEOUT ((NTSTATUS)0x102)
+#define STATUS_MORE_PROCESSING_REQUIRED ((NTSTATUS)0xC0000016L)
+#define STATUS_CONTINUE_COMPLETION STATUS_SUCCESS
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE ((NTSTATUS)0xC000000EL)
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED ((NTSTATUS)0xC0000120L)
+#define STATUS_DEVICE_CONFIGURATION_ERROR ((NTSTATUS)0xC0000182L)
+#define STATUS_DEVICE_DOES_NOT_EXIST ((NTSTATUS)0xC00000C0L)
+#define STATUS_IO_DEVICE_ERROR ((NTSTATUS)0xC0000185L)
+#define STATUS_NONEXISTENT_SECTOR ((NTSTATUS)0xC0000015L)
+#define STATUS_IO_TIMEOUT ((NTSTATUS)0xC00000B5L)
+#define STATUS_DEVICE_NOT_READY ((NTSTATUS)0xC00000A3L)
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005L)
+#define STATUS_INVALID_BUFFER_SIZE ((NTSTATUS)0xC0000206L)
+#define STATUS_DEVICE_BUSY ((NTSTATUS)0x80000011L)
+#define STATUS_DEVICE_NOT_CONNECTED ((NTSTATUS)0xC000009DL)
+#define STATUS_DEVICE_DATA_ERROR ((NTSTATUS)0xC000009CL)
+#define STATUS_CRC_ERROR ((NTSTATUS)0xC000003FL)
+#define STATUS_DATA_ERROR ((NTSTATUS)0xC000003EL)
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#define STATUS_OBJECT_NAME_EXISTS ((NTSTATUS)0x40000000L)
+#define STATUS_RETRY ((NTSTATUS)0xC000022DL)
+#define STATUS_INVALID_DEVICE_STATE ((NTSTATUS)0xC0000184L)
+#define STATUS_QUOTA_EXCEEDED ((NTSTATUS)0xC0000044L)
+#define STATUS_ALREADY_REGISTERED ((NTSTATUS)0xC0000718L)
+#define STATUS_NO_MORE_ENTRIES ((NTSTATUS)0x8000001AL)
+#define STATUS_NOTIFY_CLEANUP ((NTSTATUS)0x0000010BL)
+#define STATUS_OBJECT_NAME_NOT_FOUND ((NTSTATUS)0xC0000034L)
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#define STATUS_DISK_FULL ((NTSTATUS)0xC000007FL)
+#define STATUS_ACCESS_DENIED ((NTSTATUS)0xC0000022L)
+#define STATUS_REQUEST_ABORTED ((NTSTATUS)0xC0000240L)
+#define STATUS_INTEGER_OVERFLOW ((NTSTATUS)0xC0000095L)
+#define STATUS_WMI_GUID_NOT_FOUND ((NTSTATUS)0xC0000295L)
+#define STATUS_WMI_INSTANCE_NOT_FOUND ((NTSTATUS)0xC0000296L)
+#define STATUS_WMI_READ_ONLY ((NTSTATUS)0xC00002C6L)
+#define STATUS_INVALID_DEVICE_OBJECT_PARAMETER ((NTSTATUS)0xC0000369L)
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+#define HIGH_LEVEL 15
+#define IO_NO_INCREMENT 0
+#define IO_DISK_INCREMENT 1
+#define PAGE_READWRITE 0x04
+#define PAGE_NOCACHE 0x200
+#define PAGE_WRITECOMBINE 0x400
+#define MM_ANY_NODE_OK 0x80000000
+#define MM_DONT_ZERO_ALLOCATION 0x1
+#define MM_ALLOCATE_REQUIRE_CONTIGUOUS_CHUNKS 0x20
+#define MM_ALLOCATE_FULLY_REQUIRED 0x4
+#define KEY_READ 0x20019
+#define KEY_ALL_ACCESS 0xF003F
+#define KEY_NOTIFY 0x0010
+#define STANDARD_RIGHTS_ALL 0x001F0000L
+#define REG_BINARY 3
+#define REG_DWORD 4
+#define REG_NOTIFY_CHANGE_LAST_SET 0x4
+#define PLUGPLAY_REGKEY_DEVICE 1
+#define PLUGPLAY_REGKEY_DRIVER 2
+#define OBJ_KERNEL_HANDLE 0x200
+#define OBJ_CASE_INSENSITIVE 0x40
+#define ALL_PROCESSOR_GROUPS 0xffff
+#define MAXIMUM_PROCESSORS 64
+#define ANY_SIZE 1
+#define IO_TYPE_DEVICE 3
+#define IO_TYPE_DRIVER 4
+#define IO_TYPE_FILE 5
+#define DO_DIRECT_IO 0x10
+#define DO_BUFFERED_IO 0x4
+#define DO_POWER_PAGABLE 0x2000
+#define DO_POWER_INRUSH 0x4000
+#define DO_DEVICE_INITIALIZING 0x80
+#define FILE_DEVICE_CONTROLLER 0x04
+#define FILE_DEVICE_UNKNOWN 0x22
+#define FILE_DEVICE_SECURE_OPEN 0x100
+#define METHOD_BUFFERED 0
+#define METHOD_IN_DIRECT 1
+#define METHOD_OUT_DIRECT 2
+#define METHOD_NEITHER 3
+#define FILE_ANY_ACCESS 0
+#define FILE_READ_ACCESS 1
+#define FILE_WRITE_ACCESS 2
+#define CTL_CODE(t,f,m,a) (((t)<<16)|((a)<<14)|((f)<<2)|(m))
+#define IRP_MJ_CREATE 0x00
+#define IRP_MJ_CLOSE 0x02
+#define IRP_MJ_READ 0x03
+#define IRP_MJ_WRITE 0x04
+#define IRP_MJ_FLUSH_BUFFERS 0x09
+#define IRP_MJ_DEVICE_CONTROL 0x0e
+#define IRP_MJ_CLEANUP 0x12
+#define IRP_MJ_POWER 0x16
+#define IRP_MJ_SYSTEM_CONTROL 0x17
+#define IRP_MJ_PNP 0x1b
+#define IRP_MJ_MAXIMUM_FUNCTION 0x1b
+#define IRP_MN_START_DEVICE 0x00
+#define IRP_MN_QUERY_REMOVE_DEVICE 0x01
+#define IRP_MN_REMOVE_DEVICE 0x02
+#define IRP_MN_CANCEL_REMOVE_DEVICE 0x03
+#define IRP_MN_STOP_DEVICE 0x04
+#define IRP_MN_QUERY_STOP_DEVICE 0x05
+#define IRP_MN_CANCEL_STOP_DEVICE 0x06
+#define IRP_MN_QUERY_DEVICE_RELATIONS 0x07
+#define IRP_MN_QUERY_INTERFACE 0x08
+#define IRP_MN_QUERY_CAPABILITIES 0x09
+#define IRP_MN_QUERY_RESOURCES 0x0A
+#define IRP_MN_QUERY_RESOURCE_REQUIREMENTS 0x0B
+#define IRP_MN_QUERY_DEVICE_TEXT 0x0C
+#define IRP_MN_FILTER_RESOURCE_REQUIREMENTS 0x0D
+#define IRP_MN_READ_CONFIG 0x0F
+#define IRP_MN_WRITE_CONFIG 0x10
+#define IRP_MN_EJECT 0x11
+#define IRP_MN_SET_LOCK 0x12
+#define IRP_MN_QUERY_ID 0x13
+#define IRP_MN_QUERY_PNP_DEVICE_STATE 0x14
+#define IRP_MN_QUERY_BUS_INFORMATION 0x15
+#define IRP_MN_DEVICE_USAGE_NOTIFICATION 0x16
+#define IRP_MN_SURPRISE_REMOVAL 0x17
+#define IRP_MN_QUERY_LEGACY_BUS_INFORMATION 0x18
+#define IRP_MN_WAIT_WAKE 0x00
+#define IRP_MN_POWER_SEQUENCE 0x01
+#define IRP_MN_SET_POWER 0x02
+#define IRP_MN_QUERY_POWER 0x03
+#define IRP_MN_QUERY_ALL_DATA 0x00
+#define IRP_MN_QUERY_SINGLE_INSTANCE 0x01
+#define IRP_MN_CHANGE_SINGLE_INSTANCE 0x02
+#define IRP_MN_CHANGE_SINGLE_ITEM 0x03
+#define IRP_MN_ENABLE_EVENTS 0x04
+#define IRP_MN_DISABLE_EVENTS 0x05
+#define IRP_MN_ENABLE_COLLECTION 0x06
+#define IRP_MN_DISABLE_COLLECTION 0x07
+#define IRP_MN_REGINFO 0x08
+#define IRP_MN_EXECUTE_METHOD 0x09
+#define PCI_WHICHSPACE_CONFIG 0
+#define CM_RESOURCE_INTERRUPT_LATCHED 1
+#define CM_RESOURCE_INTERRUPT_MESSAGE 2
+#define CmResourceTypePort 1
+#define CmResourceTypeInterrupt 2
+#define CmResourceTypeMemory 3
+#define CmResourceTypeMemoryLarge 7
+#define CmResourceShareDeviceExclusive 1
+#define CmResourceShareShared 3
+#define POWER_STATE_D0 0
+#define DEVICE_DESCRIPTION_VERSION 0
+#define DEVICE_DESCRIPTION_VERSION3 3
+#define CONNECT_FULLY_SPECIFIED 1
+#define CONNECT_LINE_BASED 2
+#define CONNECT_MESSAGE_BASED 3
+#define PCI_TYPE0_ADDRESSES 6
+#define InterlockedIncrement(p) __sync_add_and_fetch((p),1)
+#define InterlockedDecrement(p) __sync_sub_and_fetch((p),1)
+#define InterlockedExchange(p,v) __sync_lock_test_and_set((p),(v))
+#define InterlockedExchangeAdd(p,v) __sync_fetch_and_add((p),(v))
+#define InterlockedExchangeAdd64(p,v) __sync_fetch_and_add((p),(v))
+#define InterlockedAdd(p,v) __sync_add_and_fetch((p),(v))
+#define InterlockedAdd64(p,v) __sync_add_and_fetch((p),(v))
+#define InterlockedIncrement64(p) __sync_add_and_fetch((p),1)
+#define InterlockedDecrement64(p) __sync_sub_and_fetch((p),1)
+#define InterlockedCompareExchange(p,x,c) __sync_val_compare_and_swap((p),(c),(x))
+#define InterlockedCompareExchange64(p,x,c) __sync_val_compare_and_swap((p),(c),(x))
+#define InterlockedCompareExchangePointer(p,x,c) __sync_val_compare_and_swap((p),(c),(x))
+#define InterlockedExchangePointer(p,v) __sync_lock_test_and_set((p),(v))
+#define InterlockedOr(p,v) __sync_fetch_and_or((p),(v))
+#define InterlockedAnd(p,v) __sync_fetch_and_and((p),(v))
+#define InterlockedIncrement16(p) __sync_add_and_fetch((p),1)
+#define InterlockedDecrement16(p) __sync_sub_and_fetch((p),1)
+#define InterlockedExchange16(p,v) __sync_lock_test_and_set((p),(v))
+#define InterlockedCompareExchange16(p,x,c) __sync_val_compare_and_swap((p),(c),(x))
+#define ReadNoFence(p) (*(volatile LONG*)(p))
+#define ReadULongNoFence(p) (*(volatile ULONG*)(p))
+#define ReadAcquire(p) (*(volatile LONG*)(p))
+#define WriteRelease(p,v) (*(volatile LONG*)(p)=(v))
+#define ReadULong64NoFence(p) (*(volatile ULONG64*)(p))
+#define ReadPointerAcquire(p) (*(PVOID volatile*)(p))
+#define KeMemoryBarrier() __sync_synchronize()
+#define _ReadWriteBarrier() __sync_synchronize()
+#define MemoryBarrier() __sync_synchronize()
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor() __builtin_ia32_pause()
+#else
+#define YieldProcessor() ((void)0)
+#endif
+#define BitScanForward(i,m) ((*(i)=__builtin_ctzl(m)),(m)!=0)
+#define BitScanReverse(i,m) ((*(i)=63-__builtin_clzl(m)),(m)!=0)
+#define BitScanForward64(i,m) ((*(i)=__builtin_ctzll(m)),(m)!=0)
+#define RtlZeroMemory(d,l) memset((d),0,(l))
+#define RtlFillMemory(d,l,f) memset((d),(f),(l))
+#define RtlCopyMemory(d,s,l) memcpy((d),(s),(l))
+#define RtlMoveMemory(d,s,l) memmove((d),(s),(l))
+#define RtlCompareMemory(a,b,l) ((SIZE_T)(memcmp((a),(b),(l))==0?(l):0))
+#define RtlEqualMemory(a,b,l) (memcmp((a),(b),(l))==0)
+void *memset(void*,int,size_t); void *memcpy(void*,const void*,size_t); void *memmove(void*,const void*,size_t); int memcmp(const void*,const void*,size_t);
+#define RtlUlongByteSwap(x) __builtin_bswap32(x)
+#define RtlUshortByteSwap(x) __builtin_bswap16(x)
+#define RtlUlonglongByteSwap(x) __builtin_bswap64(x)
+#define _byteswap_ulong(x) __builtin_bswap32(x)
+#define _byteswap_ushort(x) __builtin_bswap16(x)
+#define _byteswap_uint64(x) __builtin_bswap64(x)
+#define SET_FLAG_STUB
+typedef enum _POOL_TYPE { NonPagedPool, PagedPool, NonPagedPoolNx = 512, NonPagedPoolCacheAligned = 4 } POOL_TYPE;
+typedef enum _EX_POOL_PRIORITY { LowPoolPriority, NormalPoolPriority = 16, HighPoolPriority = 32 } EX_POOL_PRIORITY;
+typedef enum _MEMORY_CACHING_TYPE { MmNonCached, MmCached, MmWriteCombined } MEMORY_CACHING_TYPE;
+typedef enum _KINTERRUPT_MODE { LevelSensitive, Latched } KINTERRUPT_MODE;
+typedef enum _EVENT_TYPE { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum _TIMER_TYPE { NotificationTimer, SynchronizationTimer } TIMER_TYPE;
+typedef enum _KWAIT_REASON { Executive } KWAIT_REASON;
+typedef enum _MODE { KernelMode, UserMode } KPROCESSOR_MODE, MODE;
+typedef enum _LOCK_OPERATION { IoReadAccess, IoWriteAccess, IoModifyAccess } LOCK_OPERATION;
+typedef enum _WORK_QUEUE_TYPE { CriticalWorkQueue, DelayedWorkQueue, HyperCriticalWorkQueue } WORK_QUEUE_TYPE;
+typedef enum _KDPC_IMPORTANCE { LowImportance, MediumImportance, HighImportance, MediumHighImportance } KDPC_IMPORTANCE;
+typedef enum _INTERFACE_TYPE { Internal, Isa, PCIBus = 5 } INTERFACE_TYPE;
+typedef enum _DMA_WIDTH { Width8Bits, Width16Bits, Width32Bits, Width64Bits } DMA_WIDTH;
+typedef enum _DMA_SPEED { Compatible } DMA_SPEED;
+typedef enum _SYSTEM_POWER_STATE { PowerSystemUnspecified = 0, PowerSystemWorking, PowerSystemSleeping1, PowerSystemSleeping2, PowerSystemSleeping3, PowerSystemHibernate, PowerSystemShutdown, PowerSystemMaximum } SYSTEM_POWER_STATE, *PSYSTEM_POWER_STATE;
+typedef enum _DEVICE_POWER_STATE { PowerDeviceUnspecified = 0, PowerDeviceD0, PowerDeviceD1, PowerDeviceD2, PowerDeviceD3, PowerDeviceMaximum } DEVICE_POWER_STATE, *PDEVICE_POWER_STATE;
+typedef enum _POWER_STATE_TYPE { SystemPowerState, DevicePowerState } POWER_STATE_TYPE;
+typedef enum _POWER_ACTION { PowerActionNone, PowerActionReserved, PowerActionSleep, PowerActionHibernate, PowerActionShutdown, PowerActionShutdownReset, PowerActionShutdownOff, PowerActionWarmEject } POWER_ACTION;
+typedef union _POWER_STATE { SYSTEM_POWER_STATE SystemState; DEVICE_POWER_STATE DeviceState; } POWER_STATE;
+typedef enum _KEY_VALUE_INFORMATION_CLASS { KeyValueBasicInformation, KeyValueFullInformation, KeyValuePartialInformation } KEY_VALUE_INFORMATION_CLASS;
+typedef enum _KEY_INFORMATION_CLASS { KeyBasicInformation, KeyNodeInformation, KeyFullInformation } KEY_INFORMATION_CLASS;
+typedef enum _LOGICAL_PROCESSOR_RELATIONSHIP { RelationProcessorCore, RelationNumaNode, RelationCache, RelationProcessorPackage, RelationGroup, RelationAll = 0xffff } LOGICAL_PROCESSOR_RELATIONSHIP;
+typedef enum _IO_PRIORITY_HINT { IoPriorityVeryLow = 0, IoPriorityLow, IoPriorityNormal, IoPriorityHigh, IoPriorityCritical, MaxIoPriorityTypes } IO_PRIORITY_HINT;
+typedef enum _WORK_QUEUE_ITEM_STUB { WqStub } WQSTUB;
+typedef struct _KEY_VALUE_FULL_INFORMATION { ULONG TitleIndex, Type, DataOffset, DataLength, NameLength; WCHAR Name[1]; } KEY_VALUE_FULL_INFORMATION, *PKEY_VALUE_FULL_INFORMATION;
+typedef struct _KEY_VALUE_PARTIAL_INFORMATION { ULONG TitleIndex, Type, DataLength; UCHAR Data[1]; } KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
+typedef struct _KEY_FULL_INFORMATION { LARGE_INTEGER LastWriteTime; ULONG TitleIndex, ClassOffset, ClassLength, SubKeys, MaxNameLen, MaxClassLen, Values, MaxValueNameLen, MaxValueDataLen; WCHAR Class[1]; } KEY_FULL_INFORMATION, *PKEY_FULL_INFORMATION;
+typedef struct _GROUP_AFFINITY { KAFFINITY Mask; USHORT Group; USHORT Reserved[3]; } GROUP_AFFINITY, *PGROUP_AFFINITY;
+typedef struct _PROCESSOR_NUMBER { USHORT Group; UCHAR Number; UCHAR Reserved; } PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+typedef struct _NUMA_NODE_RELATIONSHIP { ULONG NodeNumber; UCHAR Reserved[20]; GROUP_AFFINITY GroupMask; } NUMA_NODE_RELATIONSHIP;
+typedef struct _SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX { LOGICAL_PROCESSOR_RELATIONSHIP Relationship; ULONG Size; union { NUMA_NODE_RELATIONSHIP NumaNode; }; } SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX, *PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX;
+typedef struct _DISPATCHER_HEADER { UCHAR Type, Signalling, Size, Reserved1; volatile LONG SignalState; LIST_ENTRY WaitListHead; } DISPATCHER_HEADER;
+typedef struct _KEVENT { DISPATCHER_HEADER Header; } KEVENT, *PKEVENT, *PRKEVENT;
+typedef struct _KMUTANT { DISPATCHER_HEADER Header; PVOID OwnerThread; LONG RecursionCount; } KMUTEX, *PKMUTEX, *PRKMUTEX;
+void KeInitializeMutex(PRKMUTEX, ULONG);
+LONG KeReleaseMutex(PRKMUTEX, BOOLEAN);
+typedef struct _KSEMAPHORE { LONG Header[8]; } KSEMAPHORE, *PKSEMAPHORE;
+typedef struct _KTIMER { DISPATCHER_HEADER Header; ULARGE_INTEGER DueTime; LIST_ENTRY TimerListEntry; struct _KDPC *Dpc; LONG Period; } KTIMER, *PKTIMER;
+typedef struct _FAST_MUTEX { volatile LONG Count; PVOID Owner; ULONG Contention; ULONG OldIrql; } FAST_MUTEX, *PFAST_MUTEX;
+typedef struct _ERESOURCE { LONG Opaque[32]; } ERESOURCE, *PERESOURCE;
+typedef struct _EX_RUNDOWN_REF { ULONG_PTR Count; } EX_RUNDOWN_REF, *PEX_RUNDOWN_REF;
+typedef struct _KLOCK_QUEUE_HANDLE { PVOID LockQueue[2]; KIRQL OldIrql; } KLOCK_QUEUE_HANDLE, *PKLOCK_QUEUE_HANDLE;
+typedef struct _KDPC *PKDPC, *PRKDPC;
+typedef void KDEFERRED_ROUTINE(struct _KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+typedef struct _KDPC { UCHAR Type, Importance; volatile USHORT Number; LIST_ENTRY DpcListEntry; PKDEFERRED_ROUTINE DeferredRoutine; PVOID DeferredContext; PVOID SystemArgument1; PVOID SystemArgument2; PVOID volatile DpcData; } KDPC;
+typedef struct _KINTERRUPT *PKINTERRUPT;
+typedef BOOLEAN KSERVICE_ROUTINE(PKINTERRUPT Interrupt, PVOID ServiceContext);
+typedef KSERVICE_ROUTINE *PKSERVICE_ROUTINE;
+typedef BOOLEAN KMESSAGE_SERVICE_ROUTINE(PKINTERRUPT Interrupt, PVOID ServiceContext, ULONG MessageID);
+typedef KMESSAGE_SERVICE_ROUTINE *PKMESSAGE_SERVICE_ROUTINE;
+typedef BOOLEAN KSYNCHRONIZE_ROUTINE(PVOID SynchronizeContext);
+typedef KSYNCHRONIZE_ROUTINE *PKSYNCHRONIZE_ROUTINE;
+typedef struct _IO_STATUS_BLOCK { union { NTSTATUS Status; PVOID Pointer; }; ULONG_PTR Information; } IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+typedef VOID (*PIO_APC_ROUTINE)(PVOID, PIO_STATUS_BLOCK, ULONG);
+typedef VOID WORKER_THREAD_ROUTINE(PVOID);
+typedef WORKER_THREAD_ROUTINE *PWORKER_THREAD_ROUTINE;
+typedef struct _MDL { struct _MDL *Next; CSHORT Size; CSHORT MdlFlags; PVOID MappedSystemVa; PVOID StartVa; ULONG ByteCount; ULONG ByteOffset; } MDL, *PMDL;
+typedef ULONG_PTR PFN_NUMBER, *PPFN_NUMBER;
+#define MmGetMdlPfnArray(m) ((PPFN_NUMBER)((m) + 1))
+#define MmGetMdlVirtualAddress(m) ((PVOID)((PCHAR)((m)->StartVa) + (m)->ByteOffset))
+#define MmGetMdlByteCount(m) ((m)->ByteCount)
+#define MmGetMdlByteOffset(m) ((m)->ByteOffset)
+#define MmGetSystemAddressForMdlSafe(m,p) ((m)->MappedSystemVa)
+#define MdlMappingNoExecute 0x40000000
+#define MdlMappingNoWrite 0x80000000
+typedef struct _DEVICE_OBJECT *PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT *PDRIVER_OBJECT;
+typedef struct _FILE_OBJECT { CSHORT Type, Size; PDEVICE_OBJECT DeviceObject; PVOID Vpb; PVOID FsContext; PVOID FsContext2; } FILE_OBJECT, *PFILE_OBJECT;
+typedef struct _IRP *PIRP;
+typedef NTSTATUS DRIVER_DISPATCH(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+typedef DRIVER_DISPATCH *PDRIVER_DISPATCH;
+typedef void DRIVER_CANCEL(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+typedef DRIVER_CANCEL *PDRIVER_CANCEL;
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+typedef NTSTATUS DRIVER_ADD_DEVICE(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT PhysicalDeviceObject);
+typedef void DRIVER_UNLOAD(PDRIVER_OBJECT DriverObject);
+typedef NTSTATUS IO_COMPLETION_ROUTINE(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
+typedef IO_COMPLETION_ROUTINE *PIO_COMPLETION_ROUTINE;
+typedef void IO_WORKITEM_ROUTINE(PDEVICE_OBJECT DeviceObject, PVOID Context);
+typedef IO_WORKITEM_ROUTINE *PIO_WORKITEM_ROUTINE;
+typedef void IO_DPC_ROUTINE(PKDPC Dpc, PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
+typedef void IO_TIMER_ROUTINE(PDEVICE_OBJECT DeviceObject, PVOID Context);
+typedef void CALLBACK_FUNCTION(PVOID CallbackContext, PVOID Argument1, PVOID Argument2);
+typedef struct _IO_WORKITEM *PIO_WORKITEM;
+typedef struct _CALLBACK_OBJECT *PCALLBACK_OBJECT;
+typedef struct _KTHREAD *PKTHREAD, *PETHREAD;
+typedef struct _KPROCESS *PEPROCESS;
+typedef struct _DEVICE_CAPABILITIES { USHORT Size, Version; ULONG DeviceD1:1, DeviceD2:1, LockSupported:1, EjectSupported:1, Removable:1, DockDevice:1, UniqueID:1, SilentInstall:1, RawDeviceOK:1, SurpriseRemovalOK:1, WakeFromD0:1, WakeFromD1:1, WakeFromD2:1, WakeFromD3:1, HardwareDisabled:1, NonDynamic:1, WarmEjectSupported:1, NoDisplayInUI:1, Reserved:14; ULONG Address, UINumber; DEVICE_POWER_STATE DeviceState[PowerSystemMaximum]; SYSTEM_POWER_STATE SystemWake; DEVICE_POWER_STATE DeviceWake; ULONG D1Latency, D2Latency, D3Latency; } DEVICE_CAPABILITIES, *PDEVICE_CAPABILITIES;
+typedef struct _INTERFACE { USHORT Size, Version; PVOID Context; PVOID InterfaceReference, InterfaceDereference; } INTERFACE, *PINTERFACE;
+typedef ULONG (*PGET_SET_DEVICE_DATA)(PVOID Context, ULONG DataType, PVOID Buffer, ULONG Offset, ULONG Length);
+typedef struct _BUS_INTERFACE_STANDARD { USHORT Size, Version; PVOID Context; PVOID InterfaceReference, InterfaceDereference, TranslateBusAddress, GetDmaAdapter; PGET_SET_DEVICE_DATA SetBusData; PGET_SET_DEVICE_DATA GetBusData; } BUS_INTERFACE_STANDARD, *PBUS_INTERFACE_STANDARD;
+typedef struct _CM_PARTIAL_RESOURCE_DESCRIPTOR { UCHAR Type, ShareDisposition; USHORT Flags; union { struct { PHYSICAL_ADDRESS Start; ULONG Length; } Generic, Port, Memory; struct { ULONG Level, Vector; KAFFINITY Affinity; } Interrupt; struct { union { struct { USHORT Reserved; USHORT MessageCount; ULONG Vector; KAFFINITY Affinity; } Raw; struct { ULONG Level, Vector; KAFFINITY Affinity; } Translated; }; } MessageInterrupt; struct { PHYSICAL_ADDRESS Start; ULONG Length40; } Memory40; struct { PHYSICAL_ADDRESS Start; ULONG Length48; } Memory48; struct { PHYSICAL_ADDRESS Start; ULONG Length64; } Memory64; } u; } CM_PARTIAL_RESOURCE_DESCRIPTOR, *PCM_PARTIAL_RESOURCE_DESCRIPTOR;
+typedef struct _CM_PARTIAL_RESOURCE_LIST { USHORT Version, Revision; ULONG Count; CM_PARTIAL_RESOURCE_DESCRIPTOR PartialDescriptors[1]; } CM_PARTIAL_RESOURCE_LIST, *PCM_PARTIAL_RESOURCE_LIST;
+typedef struct _CM_FULL_RESOURCE_DESCRIPTOR { INTERFACE_TYPE InterfaceType; ULONG BusNumber; CM_PARTIAL_RESOURCE_LIST PartialResourceList; } CM_FULL_RESOURCE_DESCRIPTOR;
+typedef struct _CM_RESOURCE_LIST { ULONG Count; CM_FULL_RESOURCE_DESCRIPTOR List[1]; } CM_RESOURCE_LIST, *PCM_RESOURCE_LIST;
+ULONGLONG RtlCmDecodeMemIoResource(PCM_PARTIAL_RESOURCE_DESCRIPTOR Descriptor, PULONGLONG Start);
+typedef struct _PCI_COMMON_CONFIG { USHORT VendorID, DeviceID, Command, Status; UCHAR RevisionID, ProgIf, SubClass, BaseClass, CacheLineSize, LatencyTimer, HeaderType, BIST; union { struct { ULONG BaseAddresses[PCI_TYPE0_ADDRESSES]; ULONG CIS; USHORT SubVendorID, SubSystemID; ULONG ROMBaseAddress; UCHAR CapabilitiesPtr; UCHAR Reserved1[3]; ULONG Reserved2; UCHAR InterruptLine, InterruptPin, MinimumGrant, MaximumLatency; } type0; } u; UCHAR DeviceSpecific[192]; } PCI_COMMON_CONFIG, *PPCI_COMMON_CONFIG;
+typedef struct _SCATTER_GATHER_ELEMENT { PHYSICAL_ADDRESS Address; ULONG Length; ULONG_PTR Reserved; } SCATTER_GATHER_ELEMENT, *PSCATTER_GATHER_ELEMENT;
+typedef struct _SCATTER_GATHER_LIST { ULONG NumberOfElements; ULONG_PTR Reserved; SCATTER_GATHER_ELEMENT Elements[1]; } SCATTER_GATHER_LIST, *PSCATTER_GATHER_LIST;
+typedef void DRIVER_LIST_CONTROL(struct _DEVICE_OBJECT *DeviceObject, struct _IRP *Irp, PSCATTER_GATHER_LIST ScatterGather, PVOID Context);
+typedef DRIVER_LIST_CONTROL *PDRIVER_LIST_CONTROL;
+struct _DMA_ADAPTER;
+typedef struct _DMA_OPERATIONS { ULONG Size; void (*PutDmaAdapter)(struct _DMA_ADAPTER*); PVOID (*AllocateCommonBuffer)(struct _DMA_ADAPTER*, ULONG, PPHYSICAL_ADDRESS, BOOLEAN); void (*FreeCommonBuffer)(struct _DMA_ADAPTER*, ULONG, PHYSICAL_ADDRESS, PVOID, BOOLEAN); NTSTATUS (*GetScatterGatherList)(struct _DMA_ADAPTER*, PDEVICE_OBJECT, PMDL, PVOID, ULONG, PDRIVER_LIST_CONTROL, PVOID, BOOLEAN); void (*PutScatterGatherList)(struct _DMA_ADAPTER*, PSCATTER_GATHER_LIST, BOOLEAN); } DMA_OPERATIONS;
+typedef struct _DMA_ADAPTER { USHORT Version, Size; DMA_OPERATIONS *DmaOperations; } DMA_ADAPTER, *PDMA_ADAPTER;
+typedef struct _DEVICE_DESCRIPTION { ULONG Version; BOOLEAN Master, ScatterGather, DemandMode, AutoInitialize, Dma32BitAddresses, IgnoreCount, Reserved1, Dma64BitAddresses; ULONG BusNumber, DmaChannel; INTERFACE_TYPE InterfaceType; DMA_WIDTH DmaWidth; DMA_SPEED DmaSpeed; ULONG MaximumLength, DmaPort; } DEVICE_DESCRIPTION, *PDEVICE_DESCRIPTION;
+typedef struct _IO_STACK_LOCATION { UCHAR MajorFunction, MinorFunction, Flags, Control; union { struct { ULONG Length; ULONG Key; LARGE_INTEGER ByteOffset; } Read; struct { ULONG Length; ULONG Key; LARGE_INTEGER ByteOffset; } Write; struct { ULONG OutputBufferLength; ULONG InputBufferLength; ULONG IoControlCode; PVOID Type3InputBuffer; } DeviceIoControl; struct { PCM_RESOURCE_LIST AllocatedResources, AllocatedResourcesTranslated; } StartDevice; struct { ULONG WhichSpace; PVOID Buffer; ULONG Offset; ULONG Length; } ReadWriteConfig; struct { const GUID *InterfaceType; USHORT Size, Version; PINTERFACE Interface; PVOID InterfaceSpecificData; } QueryInterface; struct { PDEVICE_CAPABILITIES Capabilities; } DeviceCapabilities; struct { ULONG SystemContext; POWER_STATE_TYPE Type; POWER_STATE State; POWER_ACTION ShutdownType; } Power; struct { ULONG_PTR ProviderId; PVOID DataPath; ULONG BufferSize; PVOID Buffer; } WMI; struct { PVOID Argument1, Argument2, Argument3, Argument4; } Others; } Parameters; PDEVICE_OBJECT DeviceObject; PFILE_OBJECT FileObject; PIO_COMPLETION_ROUTINE CompletionRoutine; PVOID Context; } IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+typedef struct _IRP { CSHORT Type; USHORT Size; PMDL MdlAddress; ULONG Flags; union { struct _IRP *MasterIrp; LONG IrpCount; PVOID SystemBuffer; } AssociatedIrp; LIST_ENTRY ThreadListEntry; IO_STATUS_BLOCK IoStatus; KPROCESSOR_MODE RequestorMode; BOOLEAN PendingReturned; CHAR StackCount, CurrentLocation; BOOLEAN Cancel; KIRQL CancelIrql; CCHAR ApcEnvironment; UCHAR AllocationFlags; PIO_STATUS_BLOCK UserIosb; PKEVENT UserEvent; PDRIVER_CANCEL volatile CancelRoutine; IO_PRIORITY_HINT PriorityHint; PVOID UserBuffer; union { struct { union { PVOID DriverContext[4]; }; PETHREAD Thread; PCHAR AuxiliaryBuffer; struct { LIST_ENTRY ListEntry; union { struct _IO_STACK_LOCATION *CurrentStackLocation; ULONG PacketType; }; }; PFILE_OBJECT OriginalFileObject; } Overlay; } Tail; } IRP;
+typedef struct _DRIVER_EXTENSION { PDRIVER_OBJECT DriverObject; DRIVER_ADD_DEVICE *AddDevice; } DRIVER_EXTENSION;
+typedef struct _DRIVER_OBJECT { CSHORT Type, Size; PDEVICE_OBJECT DeviceObject; ULONG Flags; DRIVER_EXTENSION *DriverExtension; DRIVER_UNLOAD *DriverUnload; PDRIVER_DISPATCH MajorFunction[IRP_MJ_MAXIMUM_FUNCTION + 1]; } DRIVER_OBJECT;
+typedef struct _DEVICE_OBJECT { CSHORT Type; USHORT Size; PDRIVER_OBJECT DriverObject; struct _DEVICE_OBJECT *NextDevice; struct _DEVICE_OBJECT *AttachedDevice; ULONG Flags; PVOID DeviceExtension; ULONG DeviceType; CCHAR StackSize; ULONG AlignmentRequirement; } DEVICE_OBJECT;
+typedef struct _IO_CONNECT_INTERRUPT_PARAMETERS { ULONG Version; union { struct { PDEVICE_OBJECT PhysicalDeviceObject; PKINTERRUPT *InterruptObject; PKSERVICE_ROUTINE ServiceRoutine; PVOID ServiceContext; PKSPIN_LOCK SpinLock; KIRQL SynchronizeIrql; BOOLEAN FloatingSave; BOOLEAN ShareVector; ULONG Vector; KIRQL Irql; KINTERRUPT_MODE InterruptMode; KAFFINITY ProcessorEnableMask; USHORT Group; } FullySpecified; struct { PDEVICE_OBJECT PhysicalDeviceObject; PKINTERRUPT *InterruptObject; PKSERVICE_ROUTINE ServiceRoutine; PVOID ServiceContext; PKSPIN_LOCK SpinLock; KIRQL SynchronizeIrql; BOOLEAN FloatingSave; } LineBased; struct { PDEVICE_OBJECT PhysicalDeviceObject; union { PVOID *Generic; PVOID *InterruptMessageTable; PKINTERRUPT *InterruptObject; } ConnectionContext; PKMESSAGE_SERVICE_ROUTINE MessageServiceRoutine; PVOID ServiceContext; PKSPIN_LOCK SpinLock; KIRQL SynchronizeIrql; BOOLEAN FloatingSave; PKSERVICE_ROUTINE FallBackServiceRoutine; } MessageBased; }; } IO_CONNECT_INTERRUPT_PARAMETERS, *PIO_CONNECT_INTERRUPT_PARAMETERS;
+typedef struct _OBJECT_ATTRIBUTES { ULONG Length; HANDLE RootDirectory; PUNICODE_STRING ObjectName; ULONG Attributes; PVOID SecurityDescriptor, SecurityQualityOfService; } OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+#define InitializeObjectAttributes(p,n,a,r,s) { (p)->Length = sizeof(OBJECT_ATTRIBUTES); (p)->RootDirectory = r; (p)->Attributes = a; (p)->ObjectName = n; (p)->SecurityDescriptor = s; (p)->SecurityQualityOfService = NULL; }
+typedef struct _WORK_QUEUE_ITEM { LIST_ENTRY List; PVOID WorkerRoutine; PVOID Parameter; } WORK_QUEUE_ITEM, *PWORK_QUEUE_ITEM;
+typedef void WORKER_THREAD_ROUTINE(PVOID Parameter);
+#define ExInitializeWorkItem(i,r,p) ((i)->WorkerRoutine=(PVOID)(r),(i)->Parameter=(p))
+typedef struct _NPAGED_LOOKASIDE_LIST { SLIST_HEADER ListHead; USHORT Depth, MaximumDepth; ULONG TotalAllocates, AllocateMisses, TotalFrees, FreeMisses; POOL_TYPE Type; ULONG Tag; ULONG Size; } NPAGED_LOOKASIDE_LIST, *PNPAGED_LOOKASIDE_LIST;
+typedef struct _PAGED_LOOKASIDE_LIST { SLIST_HEADER ListHead; ULONG Size; } PAGED_LOOKASIDE_LIST, *PPAGED_LOOKASIDE_LIST;
+typedef struct _IO_REMOVE_LOCK { LONG Opaque[8]; } IO_REMOVE_LOCK;
+typedef struct _KBUGCHECK_STUB { int x; } KBUGCHECK_STUB;
+typedef ULONG NODE_REQUIREMENT;
+typedef LONG KPRIORITY;
+typedef ULONG SECURITY_INFORMATION;
+typedef struct _XSTATE_SAVE { ULONG64 Opaque[8]; } XSTATE_SAVE, *PXSTATE_SAVE;
+#define XSTATE_MASK_LEGACY 3
+typedef struct _WAIT_CONTEXT_BLOCK { int x; } WAIT_CONTEXT_BLOCK;
+typedef struct _KE_PROCESSOR_CHANGE_NOTIFY_CONTEXT { int x; } KE_PROCESSOR_CHANGE_NOTIFY_CONTEXT;
+typedef struct _IO_INTERRUPT_MESSAGE_INFO_ENTRY { PHYSICAL_ADDRESS MessageAddress; KAFFINITY TargetProcessorSet; PKINTERRUPT InterruptObject; ULONG MessageData, Vector; KIRQL Irql; KINTERRUPT_MODE Mode; ULONG Polarity; } IO_INTERRUPT_MESSAGE_INFO_ENTRY;
+typedef struct _IO_INTERRUPT_MESSAGE_INFO { KIRQL UnifiedIrql; ULONG MessageCount; IO_INTERRUPT_MESSAGE_INFO_ENTRY MessageInfo[1]; } IO_INTERRUPT_MESSAGE_INFO, *PIO_INTERRUPT_MESSAGE_INFO;
+typedef struct _IO_WORKITEM_STUB { int x; } IO_WORKITEM_STUB;
+typedef struct _KPROCESSOR_STATE_STUB { int x; } KPS;
+/* API */
+PVOID ExAllocatePoolWithTag(POOL_TYPE, SIZE_T, ULONG);
+PVOID ExAllocatePoolWithTagPriority(POOL_TYPE, SIZE_T, ULONG, EX_POOL_PRIORITY);
+PVOID ExAllocatePool(POOL_TYPE, SIZE_T);
+void ExFreePool(PVOID);
+void ExFreePoolWithTag(PVOID, ULONG);
+void ExInitializeNPagedLookasideList(PNPAGED_LOOKASIDE_LIST, PVOID, PVOID, ULONG, SIZE_T, ULONG, USHORT);
+void ExDeleteNPagedLookasideList(PNPAGED_LOOKASIDE_LIST);
+PVOID ExAllocateFromNPagedLookasideList(PNPAGED_LOOKASIDE_LIST);
+void ExFreeToNPagedLookasideList(PNPAGED_LOOKASIDE_LIST, PVOID);
+void ExInitializeSListHead(PSLIST_HEADER);
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER, PSLIST_ENTRY);
+PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER);
+PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER);
+PSLIST_ENTRY ExInterlockedPushEntrySList(PSLIST_HEADER, PSLIST_ENTRY, PKSPIN_LOCK);
+PSLIST_ENTRY ExInterlockedPopEntrySList(PSLIST_HEADER, PKSPIN_LOCK);
+USHORT ExQueryDepthSList(PSLIST_HEADER);
+void ExInitializeFastMutex(PFAST_MUTEX); void ExAcquireFastMutex(PFAST_MUTEX); void ExReleaseFastMutex(PFAST_MUTEX);
+void ExInitializeRundownProtection(PEX_RUNDOWN_REF); BOOLEAN ExAcquireRundownProtection(PEX_RUNDOWN_REF); void ExReleaseRundownProtection(PEX_RUNDOWN_REF); void ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF); void ExReInitializeRundownProtection(PEX_RUNDOWN_REF);
+void ExQueueWorkItem(PWORK_QUEUE_ITEM, WORK_QUEUE_TYPE);
+NTSTATUS ExCreateCallback(PCALLBACK_OBJECT*, POBJECT_ATTRIBUTES, BOOLEAN, BOOLEAN);
+PVOID ExRegisterCallback(PCALLBACK_OBJECT, CALLBACK_FUNCTION*, PVOID);
+void ExUnregisterCallback(PVOID);
+ULONG ExGetPreviousMode(void);
+void KeInitializeSpinLock(PKSPIN_LOCK);
+void KeAcquireSpinLock(PKSPIN_LOCK, PKIRQL);
+void KeReleaseSpinLock(PKSPIN_LOCK, KIRQL);
+void KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK);
+void KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK);
+void KeAcquireInStackQueuedSpinLock(PKSPIN_LOCK, PKLOCK_QUEUE_HANDLE);
+void KeReleaseInStackQueuedSpinLock(PKLOCK_QUEUE_HANDLE);
+void KeAcquireInStackQueuedSpinLockAtDpcLevel(PKSPIN_LOCK, PKLOCK_QUEUE_HANDLE);
+void KeReleaseInStackQueuedSpinLockFromDpcLevel(PKLOCK_QUEUE_HANDLE);
+KIRQL KeAcquireInterruptSpinLock(PKINTERRUPT); void KeReleaseInterruptSpinLock(PKINTERRUPT, KIRQL);
+KIRQL KeGetCurrentIrql(void); void KeRaiseIrql(KIRQL, PKIRQL); void KeLowerIrql(KIRQL);
+KIRQL KeRaiseIrqlToDpcLevel(void);
+void KeInitializeEvent(PRKEVENT, EVENT_TYPE, BOOLEAN);
+LONG KeSetEvent(PRKEVENT, KPRIORITY, BOOLEAN);
+void KeClearEvent(PRKEVENT);
+LONG KeResetEvent(PRKEVENT);
+LONG KeReadStateEvent(PRKEVENT);
+NTSTATUS KeWaitForSingleObject(PVOID, KWAIT_REASON, KPROCESSOR_MODE, BOOLEAN, PLARGE_INTEGER);
+NTSTATUS KeWaitForMultipleObjects(ULONG, PVOID[], int, KWAIT_REASON, KPROCESSOR_MODE, BOOLEAN, PLARGE_INTEGER, PVOID);
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE, BOOLEAN, PLARGE_INTEGER);
+void KeStallExecutionProcessor(ULONG);
+void KeInitializeTimer(PKTIMER); void KeInitializeTimerEx(PKTIMER, TIMER_TYPE);
+BOOLEAN KeSetTimer(PKTIMER, LARGE_INTEGER, PKDPC); BOOLEAN KeSetTimerEx(PKTIMER, LARGE_INTEGER, LONG, PKDPC); BOOLEAN KeCancelTimer(PKTIMER);
+void KeInitializeDpc(PRKDPC, PKDEFERRED_ROUTINE, PVOID);
+void KeInitializeThreadedDpc(PRKDPC, PKDEFERRED_ROUTINE, PVOID);
+BOOLEAN KeInsertQueueDpc(PRKDPC, PVOID, PVOID);
+BOOLEAN KeRemoveQueueDpc(PRKDPC);
+void KeFlushQueuedDpcs(void);
+void KeSetImportanceDpc(PRKDPC, KDPC_IMPORTANCE);
+NTSTATUS KeSetTargetProcessorDpcEx(PKDPC, PPROCESSOR_NUMBER);
+void KeInitializeSemaphore(PKSEMAPHORE, LONG, LONG);
+LONG KeReleaseSemaphore(PKSEMAPHORE, KPRIORITY, LONG, BOOLEAN);
+ULONG KeQueryActiveProcessorCountEx(USHORT);
+ULONG KeQueryMaximumProcessorCountEx(USHORT);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER);
+ULONG KeGetCurrentProcessorNumber(void);
+NTSTATUS KeGetProcessorNumberFromIndex(ULONG, PPROCESSOR_NUMBER);
+ULONG KeGetProcessorIndexFromNumber(PPROCESSOR_NUMBER);
+USHORT KeQueryHighestNodeNumber(void);
+USHORT KeGetCurrentNodeNumber(void);
+void KeQueryNodeActiveAffinity(USHORT, PGROUP_AFFINITY, PUSHORT);
+NTSTATUS KeQueryLogicalProcessorRelationship(PPROCESSOR_NUMBER, LOGICAL_PROCESSOR_RELATIONSHIP, PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX, PULONG);
+void KeSetSystemGroupAffinityThread(PGROUP_AFFINITY, PGROUP_AFFINITY);
+void KeRevertToUserGroupAffinityThread(PGROUP_AFFINITY);
+ULONGLONG KeQueryInterruptTime(void);
+ULONGLONG KeQueryInterruptTimePrecise(PULONG64);
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER);
+void KeQuerySystemTime(PLARGE_INTEGER);
+ULONG KeQueryTimeIncrement(void);
+void KeQueryTickCount(PLARGE_INTEGER);
+BOOLEAN KeSynchronizeExecution(PKINTERRUPT, PKSYNCHRONIZE_ROUTINE, PVOID);
+NTSTATUS KeSaveExtendedProcessorState(ULONG64, PXSTATE_SAVE); void KeRestoreExtendedProcessorState(PXSTATE_SAVE);
+PKTHREAD KeGetCurrentThread(void);
+void KeFlushIoBuffers(PMDL, BOOLEAN, BOOLEAN);
+void KeBugCheckEx(ULONG, ULONG_PTR, ULONG_PTR, ULONG_PTR, ULONG_PTR);
+PEPROCESS IoGetCurrentProcess(void);
+PEPROCESS PsGetCurrentProcess(void);
+HANDLE PsGetCurrentProcessId(void);
+HANDLE PsGetProcessId(PEPROCESS);
+PEPROCESS IoGetRequestorProcess(PIRP);
+ULONG IoGetRequestorProcessId(PIRP);
+IO_PRIORITY_HINT IoGetIoPriorityHint(PIRP);
+NTSTATUS IoSetIoPriorityHint(PIRP, IO_PRIORITY_HINT);
+PVOID MmMapIoSpace(PHYSICAL_ADDRESS, SIZE_T, MEMORY_CACHING_TYPE);
+PVOID MmMapIoSpaceEx(PHYSICAL_ADDRESS, SIZE_T, ULONG);
+void MmUnmapIoSpace(PVOID, SIZE_T);
+PVOID MmAllocateContiguousMemory(SIZE_T, PHYSICAL_ADDRESS);
+PVOID MmAllocateContiguousMemorySpecifyCache(SIZE_T, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, MEMORY_CACHING_TYPE);
+PVOID MmAllocateContiguousNodeMemory(SIZE_T, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, ULONG, NODE_REQUIREMENT);
+void MmFreeContiguousMemory(PVOID);
+PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID);
+PVOID MmGetVirtualForPhysical(PHYSICAL_ADDRESS);
+PVOID MmLockPagableCodeSection(PVOID);
+void MmUnlockPagableImageSection(PVOID);
+PMDL IoAllocateMdl(PVOID, ULONG, BOOLEAN, BOOLEAN, PIRP);
+void IoFreeMdl(PMDL);
+void IoBuildPartialMdl(PMDL, PMDL, PVOID, ULONG);
+void MmBuildMdlForNonPagedPool(PMDL);
+void MmProbeAndLockPages(PMDL, KPROCESSOR_MODE, LOCK_OPERATION);
+void MmUnlockPages(PMDL);
+PVOID MmMapLockedPagesSpecifyCache(PMDL, KPROCESSOR_MODE, MEMORY_CACHING_TYPE, PVOID, ULONG, ULONG);
+void MmUnmapLockedPages(PVOID, PMDL);
+SIZE_T MmSizeOfMdl(PVOID, SIZE_T);
+void MmPrepareMdlForReuse(PMDL);
+PMDL MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, SIZE_T, MEMORY_CACHING_TYPE, ULONG);
+PMDL MmAllocateNodePagesForMdlEx(PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, PHYSICAL_ADDRESS, SIZE_T, MEMORY_CACHING_TYPE, ULONG, ULONG);
+void MmFreePagesFromMdl(PMDL);
+NTSTATUS IoCreateDevice(PDRIVER_OBJECT, ULONG, PUNICODE_STRING, ULONG, ULONG, BOOLEAN, PDEVICE_OBJECT*);
+void IoDeleteDevice(PDEVICE_OBJECT);
+NTSTATUS IoCreateSymbolicLink(PUNICODE_STRING, PUNICODE_STRING);
+NTSTATUS IoDeleteSymbolicLink(PUNICODE_STRING);
+PDEVICE_OBJECT IoAttachDeviceToDeviceStack(PDEVICE_OBJECT, PDEVICE_OBJECT);
+void IoDetachDevice(PDEVICE_OBJECT);
+PDEVICE_OBJECT IoGetAttachedDeviceReference(PDEVICE_OBJECT);
+void ObDereferenceObject(PVOID);
+void ObReferenceObject(PVOID);
+NTSTATUS IoCallDriver(PDEVICE_OBJECT, PIRP);
+void IoCompleteRequest(PIRP, CCHAR);
+PIRP IoAllocateIrp(CCHAR, BOOLEAN);
+void IoFreeIrp(PIRP);
+void IoReuseIrp(PIRP, NTSTATUS);
+void IoInitializeIrp(PIRP, USHORT, CCHAR);
+USHORT IoSizeOfIrp(CCHAR);
+PIRP IoBuildSynchronousFsdRequest(ULONG, PDEVICE_OBJECT, PVOID, ULONG, PLARGE_INTEGER, PKEVENT, PIO_STATUS_BLOCK);
+PIRP IoBuildAsynchronousFsdRequest(ULONG, PDEVICE_OBJECT, PVOID, ULONG, PLARGE_INTEGER, PIO_STATUS_BLOCK);
+PIRP IoBuildDeviceIoControlRequest(ULONG, PDEVICE_OBJECT, PVOID, ULONG, PVOID, ULONG, BOOLEAN, PKEVENT, PIO_STATUS_BLOCK);
+#define FILE_LONG_ALIGNMENT 0x00000003
+#define SL_PENDING_RETURNED 0x01
+#define SL_INVOKE_ON_CANCEL 0x20
+#define SL_INVOKE_ON_SUCCESS 0x40
+#define SL_INVOKE_ON_ERROR 0x80
+static inline PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP Irp) { return Irp->Tail.Overlay.CurrentStackLocation; }
+static inline PIO_STACK_LOCATION IoGetNextIrpStackLocation(PIRP Irp) { return Irp->Tail.Overlay.CurrentStackLocation - 1; }
+static inline void IoSkipCurrentIrpStackLocation(PIRP Irp) { Irp->CurrentLocation++; Irp->Tail.Overlay.CurrentStackLocation++; }
+static inline void IoSetNextIrpStackLocation(PIRP Irp) { Irp->CurrentLocation--; Irp->Tail.Overlay.CurrentStackLocation--; }
+static inline void IoCopyCurrentIrpStackLocationToNext(PIRP Irp) { PIO_STACK_LOCATION Next = IoGetNextIrpStackLocation(Irp); memcpy(Next, IoGetCurrentIrpStackLocation(Irp), offsetof(IO_STACK_LOCATION, CompletionRoutine)); Next->Control = 0; }
+static inline void IoSetCompletionRoutine(PIRP Irp, PIO_COMPLETION_ROUTINE Routine, PVOID Context, BOOLEAN InvokeOnSuccess, BOOLEAN InvokeOnError, BOOLEAN InvokeOnCancel) { PIO_STACK_LOCATION Next = IoGetNextIrpStackLocation(Irp); Next->CompletionRoutine = Routine; Next->Context = Context; Next->Control = (InvokeOnSuccess ? SL_INVOKE_ON_SUCCESS : 0) | (InvokeOnError ? SL_INVOKE_ON_ERROR : 0) | (InvokeOnCancel ? SL_INVOKE_ON_CANCEL : 0); }
+static inline void IoMarkIrpPending(PIRP Irp) { IoGetCurrentIrpStackLocation(Irp)->Control |= SL_PENDING_RETURNED; }
+static inline PDRIVER_CANCEL IoSetCancelRoutine(PIRP Irp, PDRIVER_CANCEL Routine) { return __atomic_exchange_n(&Irp->CancelRoutine, Routine, __ATOMIC_SEQ_CST); }
+CCHAR RtlFindMostSignificantBit(ULONGLONG);
+void IoAcquireCancelSpinLock(PKIRQL);
+void IoReleaseCancelSpinLock(KIRQL);
+BOOLEAN IoCancelIrp(PIRP);
+NTSTATUS IoRegisterDeviceInterface(PDEVICE_OBJECT, const GUID*, PUNICODE_STRING, PUNICODE_STRING);
+NTSTATUS IoSetDeviceInterfaceState(PUNICODE_STRING, BOOLEAN);
+NTSTATUS IoOpenDeviceRegistryKey(PDEVICE_OBJECT, ULONG, ACCESS_MASK, PHANDLE);
+NTSTATUS IoConnectInterrupt(PKINTERRUPT*, PKSERVICE_ROUTINE, PVOID, PKSPIN_LOCK, ULONG, KIRQL, KIRQL, KINTERRUPT_MODE, BOOLEAN, KAFFINITY, BOOLEAN);
+void IoDisconnectInterrupt(PKINTERRUPT);
+NTSTATUS IoConnectInterruptEx(PIO_CONNECT_INTERRUPT_PARAMETERS);
+void IoInitializeDpcRequest(PDEVICE_OBJECT, IO_DPC_ROUTINE*);
+void IoRequestDpc(PDEVICE_OBJECT, PIRP, PVOID);
+PIO_WORKITEM IoAllocateWorkItem(PDEVICE_OBJECT);
+void IoFreeWorkItem(PIO_WORKITEM);
+void IoQueueWorkItem(PIO_WORKITEM, PIO_WORKITEM_ROUTINE, WORK_QUEUE_TYPE, PVOID);
+ULONG IoSizeofWorkItem(void);
+void IoInitializeWorkItem(PVOID, PIO_WORKITEM);
+void IoUninitializeWorkItem(PIO_WORKITEM);
+PDMA_ADAPTER IoGetDmaAdapter(PDEVICE_OBJECT, PDEVICE_DESCRIPTION, PULONG);
+NTSTATUS IoGetDeviceNumaNode(PDEVICE_OBJECT, PUSHORT);
+NTSTATUS IoInitializeTimer(PDEVICE_OBJECT, IO_TIMER_ROUTINE*, PVOID);
+void IoStartTimer(PDEVICE_OBJECT); void IoStopTimer(PDEVICE_OBJECT);
+NTSTATUS IoWMIRegistrationControl(PDEVICE_OBJECT, ULONG);
+NTSTATUS IoWMIWriteEvent(PVOID);
+void IoInvalidateDeviceState(PDEVICE_OBJECT);
+NTSTATUS IoCsqInitialize(PVOID, ...);
+NTSTATUS PoSetPowerState(PDEVICE_OBJECT, POWER_STATE_TYPE, POWER_STATE);
+void PoStartNextPowerIrp(PIRP);
+NTSTATUS PoCallDriver(PDEVICE_OBJECT, PIRP);
+typedef void REQUEST_POWER_COMPLETE(PDEVICE_OBJECT DeviceObject, UCHAR MinorFunction, POWER_STATE PowerState, PVOID Context, PIO_STATUS_BLOCK IoStatus);
+typedef REQUEST_POWER_COMPLETE *PREQUEST_POWER_COMPLETE;
+NTSTATUS PoRequestPowerIrp(PDEVICE_OBJECT, UCHAR, POWER_STATE, PREQUEST_POWER_COMPLETE, PVOID, PIRP*);
+void RtlInitUnicodeString(PUNICODE_STRING, PCWSTR);
+void RtlCopyUnicodeString(PUNICODE_STRING, PCUNICODE_STRING);
+void RtlFreeUnicodeString(PUNICODE_STRING);
+LONG RtlCompareUnicodeString(PCUNICODE_STRING, PCUNICODE_STRING, BOOLEAN);
+BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING, PCUNICODE_STRING, BOOLEAN);
+NTSTATUS RtlUnicodeStringToInteger(PCUNICODE_STRING, ULONG, PULONG);
+ULONG RtlRandomEx(PULONG);
+ULONG RtlComputeCrc32(ULONG, const void*, ULONG);
+NTSTATUS ZwQueryValueKey(HANDLE, PUNICODE_STRING, KEY_VALUE_INFORMATION_CLASS, PVOID, ULONG, PULONG);
+NTSTATUS ZwSetValueKey(HANDLE, PUNICODE_STRING, ULONG, ULONG, PVOID, ULONG);
+NTSTATUS ZwEnumerateValueKey(HANDLE, ULONG, KEY_VALUE_INFORMATION_CLASS, PVOID, ULONG, PULONG);
+NTSTATUS ZwQueryKey(HANDLE, KEY_INFORMATION_CLASS, PVOID, ULONG, PULONG);
+NTSTATUS ZwNotifyChangeKey(HANDLE, HANDLE, PVOID, PVOID, PIO_STATUS_BLOCK, ULONG, BOOLEAN, PVOID, ULONG, BOOLEAN);
+NTSTATUS ZwClose(HANDLE);
+NTSTATUS ZwOpenKey(PHANDLE, ACCESS_MASK, POBJECT_ATTRIBUTES);
+typedef struct _WORK_QUEUE_ITEM_ASYNC { int x; } WQIA;
+#define WORK_QUEUE_ITEM_ASYNC_STUB 1
+#define IO_TYPE_STUB 1
+ULONG DbgPrint(PCSTR, ...);
+NTSTATUS RtlStringCbVPrintfA(PCHAR, size_t, PCSTR, va_list);
+NTSTATUS RtlStringCbPrintfA(PCHAR, size_t, PCSTR, ...);
+NTSTATUS RtlStringCchPrintfW(PWSTR, size_t, PCWSTR, ...);
+UCHAR READ_REGISTER_UCHAR(volatile UCHAR*); USHORT READ_REGISTER_USHORT(volatile USHORT*);
+ULONG READ_REGISTER_ULONG(volatile ULONG*); ULONG64 READ_REGISTER_ULONG64(volatile ULONG64*);
+void WRITE_REGISTER_ULONG(volatile ULONG*, ULONG); void WRITE_REGISTER_ULONG64(volatile ULONG64*, ULONG64);
+void WRITE_REGISTER_USHORT(volatile USHORT*, USHORT); void WRITE_REGISTER_UCHAR(volatile UCHAR*, UCHAR);
+void WRITE_REGISTER_BUFFER_ULONG(volatile ULONG*, PULONG, ULONG);
+void WRITE_REGISTER_BUFFER_ULONG64(volatile ULONG64*, PULONG64, ULONG);
+void READ_REGISTER_BUFFER_ULONG(volatile ULONG*, PULONG, ULONG);
+ULONG READ_PORT_ULONG(PULONG); void WRITE_PORT_ULONG(PULONG, ULONG);
+void _mm_sfence(void); void _mm_mfence(void); void _mm_lfence(void);
+static inline void InitializeListHead(PLIST_ENTRY ListHead) { ListHead->Flink = ListHead->Blink = ListHead; }
+static inline BOOLEAN IsListEmpty(const LIST_ENTRY *ListHead) { return (BOOLEAN)(ListHead->Flink == ListHead); }
+static inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry) { PLIST_ENTRY Flink = Entry->Flink, Blink = Entry->Blink; Blink->Flink = Flink; Flink->Blink = Blink; return (BOOLEAN)(Flink == Blink); }
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead) { PLIST_ENTRY Entry = ListHead->Flink; RemoveEntryList(Entry); return Entry; }
+static inline PLIST_ENTRY RemoveTailList(PLIST_ENTRY ListHead) { PLIST_ENTRY Entry = ListHead->Blink; RemoveEntryList(Entry); return Entry; }
+static inline void InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry) { PLIST_ENTRY Blink = ListHead->Blink; Entry->Flink = ListHead; Entry->Blink = Blink; Blink->Flink = Entry; ListHead->Blink = Entry; }
+static inline void InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry) { PLIST_ENTRY Flink = ListHead->Flink; Entry->Flink = Flink; Entry->Blink = ListHead; Flink->Blink = Entry; ListHead->Flink = Entry; }
+static inline PSINGLE_LIST_ENTRY PopEntryList(PSINGLE_LIST_ENTRY ListHead) { PSINGLE_LIST_ENTRY First = ListHead->Next; if (First != NULL) { ListHead->Next = First->Next; } return First; }
+static inline void PushEntryList(PSINGLE_LIST_ENTRY ListHead, PSINGLE_LIST_ENTRY Entry) { Entry->Next = ListHead->Next; ListHead->Next = Entry; }
+#define PNP_DEVICE_FAILED 0x00000004
+typedef struct _LUID { ULONG LowPart; LONG HighPart; } LUID, *PLUID;
+LUID RtlConvertLongToLuid(LONG);
+BOOLEAN SeSinglePrivilegeCheck(LUID, KPROCESSOR_MODE);
+#define SE_INC_BASE_PRIORITY_PRIVILEGE (14L)
+#define STATUS_PRIVILEGE_NOT_HELD ((NTSTATUS)0xC0000061L)
+typedef enum _MM_PAGE_PRIORITY { LowPagePriority, NormalPagePriority = 16, HighPagePriority = 32 } MM_PAGE_PRIORITY;
+#define __in_bcount(x)
+typedef struct _GENERAL_LOOKASIDE_POOL { SLIST_HEADER ListHead; USHORT Depth; USHORT MaximumDepth; ULONG TotalAllocates; union { ULONG AllocateMisses; ULONG AllocateHits; }; ULONG TotalFrees; union { ULONG FreeMisses; ULONG FreeHits; }; POOL_TYPE Type; ULONG Tag; ULONG Size; } GENERAL_LOOKASIDE_POOL;
+typedef struct _LOOKASIDE_LIST_EX { GENERAL_LOOKASIDE_POOL L; } LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+NTSTATUS ExInitializeLookasideListEx(PLOOKASIDE_LIST_EX, PVOID, PVOID, POOL_TYPE, ULONG, SIZE_T, ULONG, USHORT);
+void ExDeleteLookasideListEx(PLOOKASIDE_LIST_EX);
+PVOID ExAllocateFromLookasideListEx(PLOOKASIDE_LIST_EX);
+void ExFreeToLookasideListEx(PLOOKASIDE_LIST_EX, PVOID);
+#define PCI_ADDRESS_IO_SPACE                0x00000001
+#define PCI_ADDRESS_MEMORY_TYPE_MASK        0x00000006
+#define PCI_TYPE_64BIT                      4
+#define PCI_ADDRESS_MEMORY_ADDRESS_MASK     0xfffffff0
@@ -0,0 +1,34 @@
+#pragma once
+/* Subset of the WDK nvme.h the driver core uses. */
+typedef union { struct { ULONGLONG MQES:16; ULONGLONG CQR:1; ULONGLONG AMS_WeightedRoundRobinWithUrgent:1; ULONGLONG AMS_VendorSpecific:1; ULONGLONG Reserved0:5; ULONGLONG TO:8; ULONGLONG DSTRD:4; ULONGLONG NSSRS:1; ULONGLONG CSS_NVM:1; ULONGLONG CSS_Reserved0:1; ULONGLONG CSS_Reserved1:1; ULONGLONG CSS_Reserved2:1; ULONGLONG CSS_Reserved3:1; ULONGLONG CSS_Reserved4:1; ULONGLONG CSS_MultipleIo:1; ULONGLONG CSS_AdminOnly:1; ULONGLONG Reserved2:3; ULONGLONG MPSMIN:4; ULONGLONG MPSMAX:4; ULONGLONG Reserved3:8; }; ULONGLONG AsUlonglong; } NVME_CONTROLLER_CAPABILITIES, *PNVME_CONTROLLER_CAPABILITIES;
+typedef union { struct { ULONG TER:8; ULONG MNR:8; ULONG MJR:16; }; ULONG AsUlong; } NVME_VERSION;
+typedef union { struct { ULONG EN:1; ULONG Reserved0:3; ULONG CSS:3; ULONG MPS:4; ULONG AMS:3; ULONG SHN:2; ULONG IOSQES:4; ULONG IOCQES:4; ULONG Reserved1:8; }; ULONG AsUlong; } NVME_CONTROLLER_CONFIGURATION;
+typedef union { struct { ULONG RDY:1; ULONG CFS:1; ULONG SHST:2; ULONG NSSRO:1; ULONG PP:1; ULONG Reserved0:26; }; ULONG AsUlong; } NVME_CONTROLLER_STATUS;
+typedef struct { ULONG NSSRC; } NVME_NVM_SUBSYSTEM_RESET;
+typedef union { struct { ULONG ASQS:12; ULONG Reserved0:4; ULONG ACQS:12; ULONG Reserved1:4; }; ULONG AsUlong; } NVME_ADMIN_QUEUE_ATTRIBUTES;
+typedef union { struct { ULONGLONG Reserved0:12; ULONGLONG ASQB:52; }; ULONGLONG AsUlonglong; } NVME_ADMIN_SUBMISSION_QUEUE_BASE_ADDRESS;
+typedef union { struct { ULONGLONG Reserved0:12; ULONGLONG ACQB:52; }; ULONGLONG AsUlonglong; } NVME_ADMIN_COMPLETION_QUEUE_BASE_ADDRESS;
+typedef union { struct { ULONG BIR:3; ULONG Reserved:9; ULONG OFST:20; }; ULONG AsUlong; } NVME_CONTROLLER_MEMORY_BUFFER_LOCATION;
+typedef union { struct { ULONG SQS:1; ULONG CQS:1; ULONG LISTS:1; ULONG RDS:1; ULONG WDS:1; ULONG Reserved:3; ULONG SZU:4; ULONG SZ:20; }; ULONG AsUlong; } NVME_CONTROLLER_MEMORY_BUFFER_SIZE;
+typedef struct { NVME_CONTROLLER_CAPABILITIES CAP; NVME_VERSION VS; ULONG INTMS; ULONG INTMC; NVME_CONTROLLER_CONFIGURATION CC; ULONG Reserved0; NVME_CONTROLLER_STATUS CSTS; NVME_NVM_SUBSYSTEM_RESET NSSR; NVME_ADMIN_QUEUE_ATTRIBUTES AQA; NVME_ADMIN_SUBMISSION_QUEUE_BASE_ADDRESS ASQ; NVME_ADMIN_COMPLETION_QUEUE_BASE_ADDRESS ACQ; NVME_CONTROLLER_MEMORY_BUFFER_LOCATION CMBLOC; NVME_CONTROLLER_MEMORY_BUFFER_SIZE CMBSZ; ULONG Reserved2[944]; ULONG Reserved3[64]; ULONG Doorbells[0]; } NVME_CONTROLLER_REGISTERS, *PNVME_CONTROLLER_REGISTERS;
+typedef union { struct { USHORT P:1; USHORT SC:8; USHORT SCT:3; USHORT Reserved:2; USHORT M:1; USHORT DNR:1; }; USHORT AsUshort; } NVME_COMMAND_STATUS;
+typedef struct { ULONG DW0; ULONG DW1; union { struct { USHORT SQHD; USHORT SQID; }; ULONG AsUlong; } DW2; union { struct { USHORT CID; NVME_COMMAND_STATUS Status; }; ULONG AsUlong; } DW3; } NVME_COMPLETION_ENTRY, *PNVME_COMPLETION_ENTRY;
+typedef union { struct { ULONG OPC:8; ULONG FUSE:2; ULONG Reserved0:5; ULONG PSDT:1; ULONG CID:16; }; ULONG AsUlong; } NVME_COMMAND_DWORD0;
+typedef struct { NVME_COMMAND_DWORD0 CDW0; ULONG NSID; ULONG Reserved0[2]; ULONGLONG MPTR; ULONGLONG PRP1; ULONGLONG PRP2; union { struct { ULONG CDW10; ULONG CDW11; ULONG CDW12; ULONG CDW13; ULONG CDW14; ULONG CDW15; } GENERAL; } u; } NVME_COMMAND, *PNVME_COMMAND;
+typedef enum { NVME_ADMIN_COMMAND_DELETE_IO_SQ = 0x00, NVME_ADMIN_COMMAND_CREATE_IO_SQ = 0x01, NVME_ADMIN_COMMAND_GET_LOG_PAGE = 0x02, NVME_ADMIN_COMMAND_DELETE_IO_CQ = 0x04, NVME_ADMIN_COMMAND_CREATE_IO_CQ = 0x05, NVME_ADMIN_COMMAND_IDENTIFY = 0x06, NVME_ADMIN_COMMAND_ABORT = 0x08, NVME_ADMIN_COMMAND_SET_FEATURES = 0x09, NVME_ADMIN_COMMAND_GET_FEATURES = 0x0A, NVME_ADMIN_COMMAND_ASYNC_EVENT_REQUEST = 0x0C, NVME_ADMIN_COMMAND_FIRMWARE_ACTIVATE = 0x10, NVME_ADMIN_COMMAND_FIRMWARE_COMMIT = 0x10, NVME_ADMIN_COMMAND_FIRMWARE_IMAGE_DOWNLOAD = 0x11, NVME_ADMIN_COMMAND_DIRECTIVE_SEND = 0x19, NVME_ADMIN_COMMAND_DIRECTIVE_RECEIVE = 0x1A, NVME_ADMIN_COMMAND_DOORBELL_BUFFER_CONFIG = 0x7C } NVME_ADMIN_COMMANDS;
+typedef enum { NVME_NVM_COMMAND_FLUSH = 0x00, NVME_NVM_COMMAND_WRITE = 0x01, NVME_NVM_COMMAND_READ = 0x02, NVME_NVM_COMMAND_WRITE_UNCORRECTABLE = 0x04, NVME_NVM_COMMAND_COMPARE = 0x05, NVME_NVM_COMMAND_WRITE_ZEROES = 0x08, NVME_NVM_COMMAND_DATASET_MANAGEMENT = 0x09 } NVME_NVM_COMMANDS;
+typedef enum { NVME_FEATURE_ARBITRATION = 0x01, NVME_FEATURE_POWER_MANAGEMENT = 0x02, NVME_FEATURE_LBA_RANGE_TYPE = 0x03, NVME_FEATURE_TEMPERATURE_THRESHOLD = 0x04, NVME_FEATURE_ERROR_RECOVERY = 0x05, NVME_FEATURE_VOLATILE_WRITE_CACHE = 0x06, NVME_FEATURE_NUMBER_OF_QUEUES = 0x07, NVME_FEATURE_INTERRUPT_COALESCING = 0x08, NVME_FEATURE_INTERRUPT_VECTOR_CONFIG = 0x09, NVME_FEATURE_WRITE_ATOMICITY = 0x0A, NVME_FEATURE_ASYNC_EVENT_CONFIG = 0x0B, NVME_FEATURE_AUTONOMOUS_POWER_STATE_TRANSITION = 0x0C, NVME_FEATURE_HOST_MEMORY_BUFFER = 0x0D } NVME_FEATURES;
+typedef enum { NVME_IDENTIFY_CNS_SPECIFIC_NAMESPACE = 0, NVME_IDENTIFY_CNS_CONTROLLER = 1, NVME_IDENTIFY_CNS_ACTIVE_NAMESPACES = 2 } NVME_IDENTIFY_CNS_CODES;
+typedef enum { NVME_STATUS_TYPE_GENERIC_COMMAND = 0, NVME_STATUS_TYPE_COMMAND_SPECIFIC = 1, NVME_STATUS_TYPE_MEDIA_ERROR = 2, NVME_STATUS_TYPE_VENDOR_SPECIFIC = 7 } NVME_STATUS_TYPES;
+typedef struct { USHORT MP; UCHAR Reserved0; UCHAR MPS:1; UCHAR NOPS:1; UCHAR Reserved1:6; ULONG ENLAT; ULONG EXLAT; UCHAR RRT:5; UCHAR Reserved2:3; UCHAR RRL:5; UCHAR Reserved3:3; UCHAR RWT:5; UCHAR Reserved4:3; UCHAR RWL:5; UCHAR Reserved5:3; USHORT IDLP; UCHAR Reserved6:6; UCHAR IPS:2; UCHAR Reserved7; USHORT ACTP; UCHAR APW:3; UCHAR Reserved8:3; UCHAR APS:2; UCHAR Reserved9[9]; } NVME_POWER_STATE_DESC;
+typedef struct {
+  USHORT VID; USHORT SSVID; UCHAR SN[20]; UCHAR MN[40]; UCHAR FR[8]; UCHAR RAB; UCHAR IEEE[3]; UCHAR CMIC; UCHAR MDTS; USHORT CNTLID; ULONG VER; ULONG RTD3R; ULONG RTD3E; ULONG OAES; ULONG CTRATT; UCHAR Reserved0[156];
+  USHORT OACS; UCHAR ACL; UCHAR AERL; UCHAR FRMW; UCHAR LPA; UCHAR ELPE; UCHAR NPSS; UCHAR AVSCC; UCHAR APSTA; USHORT WCTEMP; USHORT CCTEMP; USHORT MTFA; ULONG HMPRE; ULONG HMMIN; UCHAR TNVMCAP[16]; UCHAR UNVMCAP[16]; ULONG RPMBS; USHORT EDSTT; UCHAR DSTO; UCHAR FWUG; USHORT KAS; USHORT HCTMA; USHORT MNTMT; USHORT MXTMT; ULONG SANICAP; ULONG HMMINDS; USHORT HMMAXD; UCHAR Reserved4[174];
+  UCHAR SQES; UCHAR CQES; USHORT MAXCMD; ULONG NN; struct { USHORT Compare:1; USHORT WriteUncorrectable:1; USHORT DatasetManagement:1; USHORT WriteZeroes:1; USHORT FeatureField:1; USHORT Reservations:1; USHORT Timestamp:1; USHORT Verify:1; USHORT Reserved:8; } ONCS; USHORT FUSES; UCHAR FNA; UCHAR VWC; USHORT AWUN; USHORT AWUPF; UCHAR NVSCC; UCHAR NWPC; USHORT ACWU; UCHAR Reserved6[2]; ULONG SGLS; UCHAR Reserved7[228]; UCHAR SUBNQN[256]; UCHAR Reserved8[768]; UCHAR Reserved9[256]; NVME_POWER_STATE_DESC PDS[32]; UCHAR VS[1024];
+} NVME_IDENTIFY_CONTROLLER_DATA, *PNVME_IDENTIFY_CONTROLLER_DATA;
+typedef union { struct { USHORT MS; UCHAR LBADS; UCHAR RP:2; UCHAR Reserved0:6; }; ULONG AsUlong; } NVME_LBA_FORMAT, *PNVME_LBA_FORMAT;
+typedef struct {
+  ULONGLONG NSZE; ULONGLONG NCAP; ULONGLONG NUSE; UCHAR NSFEAT; UCHAR NLBAF; struct { UCHAR LbaFormatIndex:4; UCHAR MetadataInExtendedDataLBA:1; UCHAR Reserved:3; } FLBAS; struct { UCHAR MetadataInExtendedDataLBA:1; UCHAR MetadataInSeparateBuffer:1; UCHAR Reserved:6; } MC; struct { UCHAR ProtectionInfoType1:1; UCHAR ProtectionInfoType2:1; UCHAR ProtectionInfoType3:1; UCHAR InfoAtBeginningOfMetadata:1; UCHAR InfoAtEndOfMetadata:1; UCHAR Reserved:3; } DPC; struct { UCHAR ProtectionInfoTypeEnabled:3; UCHAR InfoAtBeginningOfMetadata:1; UCHAR Reserved:4; } DPS; UCHAR NMIC; UCHAR RESCAP; UCHAR FPI; UCHAR DLFEAT; USHORT NAWUN; USHORT NAWUPF; USHORT NACWU; USHORT NABSN; USHORT NABO; USHORT NABSPF; USHORT NOIOB; UCHAR NVMCAP[16]; USHORT NPWG; USHORT NPWA; USHORT NPDG; USHORT NPDA; USHORT NOWS; USHORT MSSRL; ULONG MCL; UCHAR MSRC; UCHAR Reserved2[11]; ULONG ANAGRPID; UCHAR Reserved3[3]; UCHAR NSATTR; USHORT NVMSETID; USHORT ENDGID; UCHAR NGUID[16]; UCHAR EUI64[8]; NVME_LBA_FORMAT LBAF[16]; UCHAR Reserved4[192]; UCHAR VS[3712];
+} NVME_IDENTIFY_NAMESPACE_DATA, *PNVME_IDENTIFY_NAMESPACE_DATA;
+
+typedef struct { ULONG Attributes; ULONG LogicalBlockCount; ULONGLONG StartingLBA; } NVME_LBA_RANGE, *PNVME_LBA_RANGE;
@@ -0,0 +1,5 @@
+/*
+ * The driver includes "pcidrv.h"; the file is PCIDRV.H, which only a
+ * case insensitive file system finds under that name.
+ */
+#include "../../WINPCI/PCIDRV.H"
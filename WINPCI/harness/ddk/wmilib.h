@@ -0,0 +1,18 @@
+#pragma once
+typedef struct _WMIGUIDREGINFO { LPCGUID Guid; ULONG InstanceCount; ULONG Flags; } WMIGUIDREGINFO, *PWMIGUIDREGINFO;
+typedef NTSTATUS WMI_QUERY_REGINFO_CALLBACK(PDEVICE_OBJECT DeviceObject, PULONG RegFlags, PUNICODE_STRING InstanceName, PUNICODE_STRING *RegistryPath, PUNICODE_STRING MofResourceName, PDEVICE_OBJECT *Pdo);
+typedef NTSTATUS WMI_QUERY_DATABLOCK_CALLBACK(PDEVICE_OBJECT DeviceObject, PIRP Irp, ULONG GuidIndex, ULONG InstanceIndex, ULONG InstanceCount, PULONG InstanceLengthArray, ULONG BufferAvail, PUCHAR Buffer);
+typedef NTSTATUS WMI_SET_DATABLOCK_CALLBACK(PDEVICE_OBJECT DeviceObject, PIRP Irp, ULONG GuidIndex, ULONG InstanceIndex, ULONG BufferSize, PUCHAR Buffer);
+typedef NTSTATUS WMI_SET_DATAITEM_CALLBACK(PDEVICE_OBJECT DeviceObject, PIRP Irp, ULONG GuidIndex, ULONG InstanceIndex, ULONG DataItemId, ULONG BufferSize, PUCHAR Buffer);
+typedef NTSTATUS WMI_EXECUTE_METHOD_CALLBACK(PDEVICE_OBJECT DeviceObject, PIRP Irp, ULONG GuidIndex, ULONG InstanceIndex, ULONG MethodId, ULONG InBufferSize, ULONG OutBufferSize, PUCHAR Buffer);
+typedef enum { IrpForward, WmiFunctionControl_stub } WMIENABLEDISABLECONTROL;
+typedef NTSTATUS WMI_FUNCTION_CONTROL_CALLBACK(PDEVICE_OBJECT DeviceObject, PIRP Irp, ULONG GuidIndex, WMIENABLEDISABLECONTROL Function, BOOLEAN Enable);
+typedef struct _WMILIB_CONTEXT { ULONG GuidCount; PWMIGUIDREGINFO GuidList; WMI_QUERY_REGINFO_CALLBACK *QueryWmiRegInfo; WMI_QUERY_DATABLOCK_CALLBACK *QueryWmiDataBlock; WMI_SET_DATABLOCK_CALLBACK *SetWmiDataBlock; WMI_SET_DATAITEM_CALLBACK *SetWmiDataItem; WMI_EXECUTE_METHOD_CALLBACK *ExecuteWmiMethod; WMI_FUNCTION_CONTROL_CALLBACK *WmiFunctionControl; } WMILIB_CONTEXT, *PWMILIB_CONTEXT;
+typedef enum { IrpProcessed, IrpNotCompleted, IrpNotWmi, IrpForwardDisp } SYSCTL_IRP_DISPOSITION, *PSYSCTL_IRP_DISPOSITION;
+NTSTATUS WmiSystemControl(PWMILIB_CONTEXT, PDEVICE_OBJECT, PIRP, PSYSCTL_IRP_DISPOSITION);
+NTSTATUS WmiCompleteRequest(PDEVICE_OBJECT, PIRP, NTSTATUS, ULONG, CCHAR);
+NTSTATUS WmiFireEvent(PDEVICE_OBJECT, LPCGUID, ULONG, ULONG, PVOID);
+#define WMIREG_FLAG_INSTANCE_PDO 0x20
+#define WMIREG_ACTION_REGISTER 1
+#define WMIREG_ACTION_DEREGISTER 2
+#define WMIREG_FLAG_EVENT_ONLY_GUID 0x40
@@ -0,0 +1,2 @@
+#pragma once
+/* Nothing the harness build needs. */
@@ -0,0 +1,3704 @@
+/*++
+
+Module Name:
+
+    emu.c
+
+Abstract:
+
+    NVMe controllers in memory, behind the register accessors of the
+    driver. A write to a submission queue tail doorbell runs the new
+    commands right away, in the writing thread, and posts their
+    completions; the controller then interrupts on the same thread if
+    the vector is not masked. No time passes inside a controller, so
+    what a benchmark measures on top of it is the driver's own path.
+
+    Unless a controller is given a completion delay: then a thread of
+    the controller runs the commands of its I/O queues that much later,
+    posts their completions and interrupts. Only then is there anything
+    in flight for an Abort to find, or for a reset to lose; without a
+    delay, Abort always answers that the command was not aborted. A
+    controller can also be made to drop every so many I/O commands,
+    which then never run nor complete, and to take a while to become
+    ready once enabled.
+
+    Or a service time: then the I/O commands stay in their submission
+    queues until a thread of the controller fetches them, one per service
+    time, in the order the arbitration mechanism CC.AMS selects gives:
+    round robin over the queues, or weighted round robin with an urgent
+    class, by the QPRIO of each queue and the weights of the Arbitration
+    feature. Only then does it matter which queue a command is on. The
+    Arbitration Burst is not modelled; a queue gives one command a turn.
+
+    Each controller has a register block of its own, which the register
+    accessors find it by, and one interrupt vector, its index, which
+    IoConnectInterrupt connects. That vector serves all queues, with
+    INTMS and INTMC masking it, as the driver expects. Namespace 1 has
+    no backing store: reads stamp every block with its LBA, and writes
+    are checked for the same stamp, which is enough to tell whether the
+    PRPs point at the right memory.
+
+    A controller sits on a NUMA node. Queue entries it fetches or posts
+    in memory of another node, and entries the host writes or reads in
+    memory of a node other than its processor's, as the doorbells tell,
+    are counted and can be charged a cost each, spinning, so that queue
+    placement shows in what a benchmark measures. Asynchronous event requests are held
+    until a reset or an event a benchmark raises; log pages read as zeros,
+    but for the Telemetry Host-Initiated log, of a given size, whose data
+    carries the capture it is from and where it lies.
+
+    Namespace 1 can be zoned, with sequential write required zones of a
+    given size and no limit on open or active zones: each zone has a
+    state and a write pointer, writes must land at it, and Zone Appends
+    are placed at it, in the order the controller runs them.
+
+    A controller can have a memory buffer behind BAR 2 that holds
+    submission queues. Fetching an entry from a queue in host memory
+    can be given a cost, which one in the buffer does not pay.
+
+    A controller can ask for a host memory buffer. It checks the
+    descriptor list it is given, stamps the chunks, and expects them back
+    unchanged with Memory Return; what happened to the buffer is
+    recorded for a benchmark to check the order of.
+
+    A controller can offer shadow doorbells. Once Doorbell Buffer Config
+    gives it the pages, it reads the I/O queue tails and heads from the
+    shadows whenever it is busy anyway, and through the event indexes
+    asks for a register write only to be woken: with a service time, as
+    the arbiter thread goes idle, and for a completion head, while
+    completions are held back. Every register write is counted, so that
+    a benchmark can tell how many a command costs.
+
+    A controller can take firmware updates of up to a given size, into
+    two slots. Firmware Image Download commands can be given a delay,
+    after which the completion thread copies their piece in, several at
+    a time; Firmware Commit then checks that the pieces make one whole
+    image and keeps it for a benchmark to compare.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include <ntddk.h>
+#include <nvme.h>
+#include "harness.h"
+
+//
+// hw_pi.c of the driver, standing in for the CRC engine of the controller.
+//
+USHORT
+HwCrc16(
+    __in                  USHORT Crc,
+    __in_bcount(Length)   PVOID  Buffer,
+    __in                  SIZE_T Length
+    );
+
+#define EMU_MAX_CONTROLLERS         32
+#define EMU_MAX_QUEUES              64
+#define EMU_MAX_QUEUE_ENTRIES       4096
+#define EMU_MAX_SEGMENTS            512
+#define EMU_MAX_ASYNC_EVENTS        4           // AERL + 1
+#define EMU_DOORBELL_OFFSET         0x1000
+#define EMU_VECTOR_MASK             0x1         // the only interrupt vector
+#define EMU_QUEUE_CONTIGUOUS        0x1         // CDW11.PC of the create commands
+#define EMU_QUEUE_INTERRUPTS        0x2         // CDW11.IEN of Create I/O CQ
+#define EMU_ERROR_LOG_ENTRIES       64          // ELPE + 1
+#define EMU_POOL_TAG                'umEH'
+
+#define EMU_PRIORITY_URGENT         0           // QPRIO of Create I/O SQ
+#define EMU_PRIORITY_HIGH           1
+#define EMU_PRIORITY_LOW            3
+#define EMU_PRIORITY_ANY            4           // round robin over all queues
+#define EMU_WEIGHTED_CLASSES        3           // high, medium and low
+
+#define EMU_STATUS(Type, Code)      ((USHORT)(((Type) << 8) | (Code)))
+#define EMU_STATUS_INVALID_OPCODE           EMU_STATUS(NVME_STATUS_TYPE_GENERIC_COMMAND, 0x01)
+#define EMU_STATUS_INVALID_FIELD            EMU_STATUS(NVME_STATUS_TYPE_GENERIC_COMMAND, 0x02)
+#define EMU_STATUS_ABORT_REQUESTED          EMU_STATUS(NVME_STATUS_TYPE_GENERIC_COMMAND, 0x07)
+#define EMU_STATUS_INVALID_NAMESPACE        EMU_STATUS(NVME_STATUS_TYPE_GENERIC_COMMAND, 0x0B)
+#define EMU_STATUS_COMMAND_SEQUENCE_ERROR   EMU_STATUS(NVME_STATUS_TYPE_GENERIC_COMMAND, 0x0C)
+#define EMU_STATUS_LBA_OUT_OF_RANGE         EMU_STATUS(NVME_STATUS_TYPE_GENERIC_COMMAND, 0x80)
+#define EMU_STATUS_GUARD_CHECK_ERROR        EMU_STATUS(NVME_STATUS_TYPE_MEDIA_ERROR, 0x82)
+#define EMU_STATUS_REF_TAG_CHECK_ERROR      EMU_STATUS(NVME_STATUS_TYPE_MEDIA_ERROR, 0x84)
+
+//
+// PRINFO of Read and Write, CDW12 bits 29:26, and the PI of a block in
+// the separate metadata.
+//
+#define EMU_PRINFO_PRACT                    (1 << 29)
+#define EMU_PRINFO_CHECK_GUARD              (1 << 28)
+#define EMU_PRINFO_CHECK_REF_TAG            (1 << 26)
+#define EMU_PI_SIZE                         8
+#define EMU_STATUS_INVALID_COMPLETION_QUEUE EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0x00)
+#define EMU_STATUS_INVALID_QUEUE_ID         EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0x01)
+#define EMU_STATUS_INVALID_QUEUE_SIZE       EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0x02)
+#define EMU_STATUS_AER_LIMIT_EXCEEDED       EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0x05)
+#define EMU_STATUS_INVALID_FIRMWARE_SLOT    EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0x06)
+#define EMU_STATUS_INVALID_FIRMWARE_IMAGE   EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0x07)
+#define EMU_STATUS_INVALID_LOG_PAGE         EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0x09)
+#define EMU_STATUS_ZONE_BOUNDARY_ERROR      EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0xB8)
+#define EMU_STATUS_ZONE_FULL                EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0xB9)
+#define EMU_STATUS_ZONE_READ_ONLY           EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0xBA)
+#define EMU_STATUS_ZONE_OFFLINE             EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0xBB)
+#define EMU_STATUS_ZONE_INVALID_WRITE       EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0xBC)
+#define EMU_STATUS_ZONE_INVALID_TRANSITION  EMU_STATUS(NVME_STATUS_TYPE_COMMAND_SPECIFIC, 0xBF)
+
+//
+// Host Memory Buffer feature: the descriptor list and the stamp the
+// controller leaves at the start of every chunk it was given.
+//
+#define EMU_HMB_UNIT                        4096        // of HMPRE, HMMIN and BSIZE
+#define EMU_HMB_DESCRIPTOR_SIZE             16          // BADD, BSIZE
+#define EMU_HMB_MAX_CHUNKS                  (PAGE_SIZE / EMU_HMB_DESCRIPTOR_SIZE)
+#define EMU_HMB_STAMP                       0x424D48554D45ULL
+
+//
+// Doorbell Buffer Config: a page of shadow doorbells and a page of
+// event indexes, each slot where the doorbell register is, for DSTRD 0.
+//
+#define EMU_OACS_DOORBELL_BUFFER            (1 << 8)
+#define EMU_ADMIN_COMMAND_DOORBELL_BUFFER_CONFIG 0x7C
+
+//
+// The Telemetry Host-Initiated log page: a header block giving the last
+// block of each data area, then the data. Data areas 1 to 3 end within
+// 32 MiB; data area 4, with its 32 bit last block, takes a larger log.
+//
+#define EMU_LPA_EXTENDED_DATA               (1 << 2)
+#define EMU_LPA_TELEMETRY                   (1 << 3)
+#define EMU_LPA_DATA_AREA_4                 (1 << 6)
+#define EMU_LOG_PAGE_TELEMETRY_HOST         0x07
+#define EMU_LOG_SPECIFIC_SHIFT              8           // CDW10.LSP
+#define EMU_TELEMETRY_CREATE                0x1         // LSP: capture a new log
+#define EMU_TELEMETRY_BLOCK                 512
+#define EMU_TELEMETRY_AREA_1_OFFSET         8           // USHORT last blocks of areas 1 to 3
+#define EMU_TELEMETRY_AREA_4_OFFSET         16          // ULONG
+
+//
+// Firmware Image Download and Firmware Commit, into two slots.
+//
+#define EMU_OACS_FIRMWARE                   (1 << 2)
+#define EMU_FIRMWARE_SLOTS                  2           // FRMW bits 3:1
+#define EMU_FIRMWARE_GRANULARITY            4096        // FWUG of 1
+#define EMU_COMMIT_SLOT_MASK                0x7         // CDW10.FS
+#define EMU_COMMIT_ACTION_SHIFT             3           // CDW10.CA
+#define EMU_COMMIT_ACTIVATE                 2           // the image of the slot, no download
+
+//
+// Zoned namespaces: the Zoned command set, its Identify data and its
+// commands. Zone states are numbered as in a zone descriptor, in the
+// high nibble of its second byte.
+//
+#define EMU_CSS_ALL_IO                      6           // CC.CSS
+#define EMU_IDENTIFY_CNS_NS_DESCRIPTORS     0x03
+#define EMU_IDENTIFY_CNS_CSI_NAMESPACE      0x05
+#define EMU_IDENTIFY_CNS_CSI_CONTROLLER     0x06
+#define EMU_CSI_ZONED                       2
+#define EMU_NID_TYPE_CSI                    4
+#define EMU_ZNS_MAR_OFFSET                  4           // in the ZNS Identify Namespace
+#define EMU_ZNS_MOR_OFFSET                  8
+#define EMU_ZNS_LBAFE_OFFSET                2816
+#define EMU_NVM_COMMAND_ZONE_MGMT_SEND      0x79
+#define EMU_NVM_COMMAND_ZONE_MGMT_RECEIVE   0x7A
+#define EMU_NVM_COMMAND_ZONE_APPEND         0x7D
+#define EMU_ZONE_SELECT_ALL                 (1 << 8)    // Send CDW13
+#define EMU_ZONE_PARTIAL_REPORT             (1 << 16)   // Receive CDW13
+#define EMU_ZONE_DESCRIPTOR_SIZE            64
+#define EMU_ZONE_TYPE_SEQUENTIAL            2
+
+#define EMU_ZONE_EMPTY                      0x1
+#define EMU_ZONE_IMPLICITLY_OPEN            0x2
+#define EMU_ZONE_EXPLICITLY_OPEN            0x3
+#define EMU_ZONE_CLOSED                     0x4
+#define EMU_ZONE_READ_ONLY                  0xD
+#define EMU_ZONE_FULL                       0xE
+#define EMU_ZONE_OFFLINE                    0xF
+
+#define EMU_ZONE_CLOSE                      1           // Zone Send Action
+#define EMU_ZONE_FINISH                     2
+#define EMU_ZONE_OPEN                       3
+#define EMU_ZONE_RESET                      4
+#define EMU_ZONE_SET_OFFLINE                5
+
+#define EMU_NO_STATUS               ((USHORT)-1)    // held, no completion yet
+
+//
+// A submission queue and the completion queue of the same id. The
+// locks are taken in the order admin submission queue, then the
+// arbiter of the controller, then I/O submission queue, then the
+// delayed commands of the controller, then completion queue.
+//
+typedef struct _EMU_QUEUE {
+    volatile LONG           SubmissionLock;
+    PNVME_COMMAND           SubmissionQueue;
+    USHORT                  SubmissionSize;
+    volatile USHORT         SubmissionHead;     // read by completions without the lock
+    volatile USHORT         SubmissionTail;     // last tail doorbell, with a service time
+    UCHAR                   SubmissionPriority; // QPRIO
+    USHORT                  CompletionQueueId;
+    USHORT                  SubmissionNode;     // of the ring memory
+    BOOLEAN                 SubmissionValid;
+    BOOLEAN                 SubmissionInCmb;    // ring in the controller memory buffer
+
+    volatile LONG           CompletionLock;
+    PNVME_COMPLETION_ENTRY  CompletionQueue;
+    USHORT                  CompletionSize;
+    USHORT                  CompletionTail;
+    volatile USHORT         CompletionHead;     // last head doorbell value
+    UCHAR                   CompletionPhase;
+    USHORT                  CompletionNode;
+    BOOLEAN                 CompletionValid;
+    BOOLEAN                 InterruptsEnabled;
+    PNVME_COMPLETION_ENTRY  Held;               // EMU_MAX_QUEUE_ENTRIES, used as a ring
+                                                // of CompletionSize
+    ULONG                   HeldFirst;
+    ULONG                   HeldCount;
+} DECLSPEC_CACHEALIGN EMU_QUEUE, *PEMU_QUEUE;
+
+//
+// An I/O command waiting for its time to run and complete.
+//
+typedef struct _EMU_DELAYED_COMMAND {
+    ULONGLONG       Due;                // interrupt time
+    NVME_COMMAND    Command;
+    USHORT          CompletionQueueId;
+    USHORT          SubmissionQueueId;
+    BOOLEAN         Discarded;          // aborted, or its queue is gone
+} EMU_DELAYED_COMMAND, *PEMU_DELAYED_COMMAND;
+
+//
+// A chunk of the host memory buffer, as its descriptor gave it.
+//
+typedef struct _EMU_HMB_CHUNK {
+    ULONGLONG       Address;            // BADD
+    ULONG           Pages;              // BSIZE
+} EMU_HMB_CHUNK, *PEMU_HMB_CHUNK;
+
+//
+// A zone of a zoned namespace, under the zone lock of the controller.
+//
+typedef struct _EMU_ZONE {
+    ULONGLONG       WritePointer;       // LBA
+    UCHAR           State;              // EMU_ZONE_xxx
+} EMU_ZONE, *PEMU_ZONE;
+
+//
+// Pieces of host memory a PRP walk yields.
+//
+typedef struct _EMU_SEGMENT {
+    PUCHAR  Buffer;
+    ULONG   Length;
+} EMU_SEGMENT, *PEMU_SEGMENT;
+
+typedef struct _EMU_CONTROLLER {
+    ULONG                       Index;          // also the interrupt vector
+    PNVME_CONTROLLER_REGISTERS  Registers;
+    ULONG                       RegisterLength;
+    PUCHAR                      Cmb;            // BAR 2, Config.CmbSize bytes
+    EMU_CONFIG                  Config;
+
+    EMU_QUEUE                   Queues[EMU_MAX_QUEUES + 1];
+
+    //
+    // Command ids of the asynchronous event requests outstanding, under
+    // the admin submission queue lock.
+    //
+    USHORT                      AsyncEvents[EMU_MAX_ASYNC_EVENTS];
+    ULONG                       AsyncEventCount;
+
+    volatile ULONG              InterruptMask;
+    volatile LONG               InterruptLock;
+    PKINTERRUPT                 Interrupt;      // connected, if not NULL
+
+    volatile ULONGLONG          ReadyTime;      // interrupt time CSTS.RDY sets, 0 if not pending
+
+    //
+    // With a completion delay, the I/O commands submitted, and with a
+    // firmware delay, the Firmware Image Download commands, oldest first
+    // in a ring under DelayedLock, and the thread running them. One due
+    // sooner than one ahead of it, of the other kind, waits for it. The
+    // sequence is bumped when the ring stops being empty and on stopping.
+    //
+    volatile LONG               DelayedLock;
+    PEMU_DELAYED_COMMAND        Delayed;
+    ULONG                       DelayedSize;
+    ULONG                       DelayedFirst;
+    ULONG                       DelayedCount;
+    volatile LONG               DelayedSequence;
+    volatile LONG               DelayedStopping;
+    pthread_t                   DelayedThread;
+    BOOLEAN                     DelayedThreadStarted;
+
+    //
+    // With a service time, the thread fetching the I/O commands and the
+    // state of the arbitration, under ArbiterLock: the queue each round
+    // robin served last, the weighted class whose turn it is and the
+    // commands each class has left in this round. The sequence is bumped
+    // by every I/O tail doorbell and on stopping; Waiting is set while
+    // the thread waits for one.
+    //
+    volatile LONG               ArbiterLock;
+    BOOLEAN                     WeightedArbitration;    // CC.AMS at enable
+    USHORT                      ArbiterWeights[EMU_WEIGHTED_CLASSES];
+    USHORT                      ArbiterLast[EMU_PRIORITY_ANY + 1];
+    ULONG                       ArbiterClass;
+    ULONG                       ArbiterCredits[EMU_WEIGHTED_CLASSES];
+    volatile LONG               ArbiterSequence;
+    volatile LONG               ArbiterWaiting;
+    volatile LONG               ArbiterStopping;
+    pthread_t                   ArbiterThread;
+    BOOLEAN                     ArbiterThreadStarted;
+
+    //
+    // The zones of namespace 1, if it is zoned. One lock for all of them,
+    // taken last, stands for the write pointer logic of a controller.
+    //
+    volatile LONG               ZoneLock;
+    PEMU_ZONE                   Zones;
+    ULONGLONG                   ZoneCount;
+
+    //
+    // The host memory buffer: whether the controller has it, the chunks
+    // it was last given, which a Memory Return must give back unchanged,
+    // and what happened to it, in order.
+    //
+    volatile LONG               HmbLock;
+    BOOLEAN                     HmbEnabled;
+    ULONG                       HmbPages;
+    ULONG                       HmbChunkCount;
+    EMU_HMB_CHUNK               HmbChunks[EMU_HMB_MAX_CHUNKS];
+    ULONG                       HmbEventCount;
+    EMU_HMB_EVENT               HmbEvents[EMU_MAX_HMB_EVENTS];
+
+    //
+    // The pages Doorbell Buffer Config gave, or NULL; a reset forgets
+    // them. Only the I/O queues use their slots.
+    //
+    volatile ULONG * volatile   ShadowDoorbells;
+    volatile ULONG * volatile   EventIndexes;
+
+    //
+    // Captures of the telemetry log so far, under the admin submission
+    // queue lock; the low byte stamps the data of the last one.
+    //
+    ULONG                       TelemetryGeneration;
+
+    //
+    // With a firmware size, the image Firmware Image Download commands
+    // put together, under FirmwareLock: how many bytes came and where the
+    // furthest ends, which Firmware Commit checks for a whole image and
+    // clears. The image stays that of the slot it was committed to until
+    // the next download writes over it.
+    //
+    volatile LONG               FirmwareLock;
+    PUCHAR                      FirmwareImage;
+    ULONG                       FirmwareReceived;
+    ULONG                       FirmwareEnd;
+    ULONG                       FirmwareSlot;       // committed to, 0 for none
+    ULONG                       FirmwareLength;
+
+    volatile ULONGLONG          Commands;
+    volatile ULONGLONG          Interrupts;
+    volatile ULONGLONG          DataErrors;
+    volatile ULONGLONG          HeldCompletions;
+    volatile ULONGLONG          RemoteDeviceAccesses;
+    volatile ULONGLONG          RemoteHostAccesses;
+    volatile ULONGLONG          HostFetches;
+    volatile ULONGLONG          IoCommands;
+    volatile ULONGLONG          Dropped;
+    volatile ULONGLONG          AbortCommands;
+    volatile ULONGLONG          Aborts;
+    volatile ULONGLONG          Discarded;
+    volatile ULONGLONG          Resets;
+    volatile ULONGLONG          ProtectionErrors;
+    volatile ULONGLONG          ZoneErrors;
+    volatile ULONGLONG          MmioWrites;
+} EMU_CONTROLLER;
+
+//
+// What IoConnectInterrupt hands out.
+//
+struct _KINTERRUPT {
+    PKSERVICE_ROUTINE   ServiceRoutine;
+    PVOID               ServiceContext;
+    PEMU_CONTROLLER     Controller;
+};
+
+static struct {
+    volatile LONG       Lock;                   // creating and destroying
+    volatile LONG       Generation;             // bumped when a controller is destroyed
+    PEMU_CONTROLLER     Controllers[EMU_MAX_CONTROLLERS];
+} Emu;
+
+//
+// The controller the calling thread touched last, which is nearly always
+// the one it touches next, as long as no controller has been destroyed
+// since: other threads than the one destroying it may have it cached.
+//
+static __thread PEMU_CONTROLLER EmuLastController;
+static __thread LONG            EmuLastGeneration;
+
+
+static
+VOID
+EmuSpin(
+    __in ULONGLONG Nanoseconds
+    )
+/*++
+Routine Description:
+
+    Keeps the calling thread busy for a while, as a controller is that
+    waits on the bus.
+
+--*/
+{
+    struct timespec now;
+    LONGLONG        deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now.tv_sec * 1000000000LL + now.tv_nsec + (LONGLONG)Nanoseconds;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec * 1000000000LL + now.tv_nsec < deadline);
+}
+
+static
+VOID
+EmuChargeRemoteAccess(
+    __in    PEMU_CONTROLLER     Controller,
+    __inout volatile ULONGLONG *Counter,
+    __in    USHORT              From,
+    __in    USHORT              To,
+    __in    ULONG               Entries
+    )
+/*++
+Routine Description:
+
+    Counts queue entries accessed from node From in memory of node To,
+    if the two differ, and spins for their cost.
+
+--*/
+{
+    if (From == To || From == SHIM_NODE_NONE || To == SHIM_NODE_NONE || Entries == 0) {
+        return;
+    }
+
+    __atomic_add_fetch(Counter, Entries, __ATOMIC_RELAXED);
+
+    if (Controller->Config.RemoteAccessCost != 0) {
+        EmuSpin((ULONGLONG)Entries * Controller->Config.RemoteAccessCost);
+    }
+}
+
+static
+BOOLEAN
+EmuReadShadowDoorbell(
+    __in  PEMU_CONTROLLER Controller,
+    __in  ULONG           Index,
+    __out PUSHORT         Value
+    )
+/*++
+Routine Description:
+
+    Reads the shadow of doorbell Index, 2y for the tail of submission
+    queue y and 2y + 1 for the head of completion queue y.
+
+Return Value:
+
+    FALSE, leaving Value alone, if the host gave no shadow doorbells or
+    the doorbell is one of the admin queues
+
+--*/
+{
+    volatile ULONG *shadows = __atomic_load_n(&Controller->ShadowDoorbells, __ATOMIC_ACQUIRE);
+
+    if (shadows == NULL || Index < 2) {
+        return FALSE;
+    }
+
+    *Value = (USHORT)__atomic_load_n(&shadows[Index], __ATOMIC_ACQUIRE);
+    return TRUE;
+}
+
+static
+VOID
+EmuWriteEventIndex(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Index,
+    __in USHORT          Value
+    )
+/*++
+Routine Description:
+
+    Asks the host to write doorbell Index once its value moves past
+    Value. The host writes the shadow, fences and reads the event index;
+    the fence here orders the event index before the shadow read that
+    must follow, so that one side or the other sees the move.
+
+--*/
+{
+    volatile ULONG *indexes = __atomic_load_n(&Controller->EventIndexes, __ATOMIC_ACQUIRE);
+
+    if (indexes != NULL) {
+        __atomic_store_n(&indexes[Index], Value, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static
+BOOLEAN
+EmuCompletionPending(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    Tells whether any completion queue that interrupts holds entries
+    the host has not consumed.
+
+--*/
+{
+    PEMU_QUEUE queue;
+    USHORT     head;
+    ULONG      i;
+
+    for (i = 0; i <= Controller->Config.MaxQueues; i++) {
+        queue = &Controller->Queues[i];
+        if (!EmuReadShadowDoorbell(Controller, 2 * i + 1, &head)) {
+            head = __atomic_load_n(&queue->CompletionHead, __ATOMIC_ACQUIRE);
+        }
+        if (queue->CompletionValid && queue->InterruptsEnabled &&
+            __atomic_load_n(&queue->CompletionTail, __ATOMIC_ACQUIRE) != head) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static
+VOID
+EmuSignalInterrupt(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    Raises the interrupt if it is connected and unmasked and a completion
+    is pending, by calling the service routine at device IRQL on the
+    calling thread. The routine runs under the interrupt lock, which
+    stands in for the interrupt spin lock. The fence orders the queue and
+    mask updates that led here before the checks.
+
+--*/
+{
+    PKINTERRUPT interrupt;
+    KIRQL       oldIrql;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&Controller->Interrupt, __ATOMIC_ACQUIRE) == NULL ||
+        (__atomic_load_n(&Controller->InterruptMask, __ATOMIC_ACQUIRE) & EMU_VECTOR_MASK) != 0 ||
+        !EmuCompletionPending(Controller)) {
+        return;
+    }
+
+    KeRaiseIrql(EMU_DEVICE_IRQL, &oldIrql);
+    ShimAcquireRawLock(&Controller->InterruptLock);
+
+    interrupt = Controller->Interrupt;
+    if (interrupt != NULL &&
+        (__atomic_load_n(&Controller->InterruptMask, __ATOMIC_ACQUIRE) & EMU_VECTOR_MASK) == 0 &&
+        EmuCompletionPending(Controller)) {
+        __atomic_add_fetch(&Controller->Interrupts, 1, __ATOMIC_RELAXED);
+        interrupt->ServiceRoutine(interrupt, interrupt->ServiceContext);
+    }
+
+    ShimReleaseRawLock(&Controller->InterruptLock);
+    KeLowerIrql(oldIrql);
+}
+
+static
+BOOLEAN
+EmuWriteCompletion(
+    __in PEMU_QUEUE             Queue,
+    __in PNVME_COMPLETION_ENTRY Completion
+    )
+/*++
+Routine Description:
+
+    Writes a completion entry if the queue has room, with the completion
+    lock held. The dword holding the phase tag goes last and with release
+    semantics, so that a host seeing the new phase sees the whole entry.
+
+--*/
+{
+    volatile NVME_COMPLETION_ENTRY *entry;
+    NVME_COMPLETION_ENTRY           completion = *Completion;
+    USHORT                          tail;
+
+    tail = Queue->CompletionTail + 1;
+    if (tail == Queue->CompletionSize) {
+        tail = 0;
+    }
+    if (tail == Queue->CompletionHead) {
+        return FALSE;
+    }
+
+    entry = &Queue->CompletionQueue[Queue->CompletionTail];
+    completion.DW3.Status.P = Queue->CompletionPhase;
+
+    entry->DW0 = completion.DW0;
+    entry->DW1 = completion.DW1;
+    entry->DW2.AsUlong = completion.DW2.AsUlong;
+    __atomic_store_n(&entry->DW3.AsUlong, completion.DW3.AsUlong, __ATOMIC_RELEASE);
+
+    if (tail == 0) {
+        Queue->CompletionPhase ^= 1;
+    }
+    __atomic_store_n(&Queue->CompletionTail, tail, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+static
+VOID
+EmuWriteHeldCompletions(
+    __in PEMU_QUEUE Queue
+    )
+/*++
+Routine Description:
+
+    Posts the completions held back, in order, for as much room as the
+    queue has, with the completion lock held.
+
+--*/
+{
+    while (Queue->HeldCount != 0 && EmuWriteCompletion(Queue, &Queue->Held[Queue->HeldFirst])) {
+        Queue->HeldFirst = (Queue->HeldFirst + 1) % Queue->CompletionSize;
+        Queue->HeldCount--;
+    }
+}
+
+static
+VOID
+EmuPollCompletionHead(
+    __in PEMU_CONTROLLER Controller,
+    __in USHORT          QueueId
+    )
+/*++
+Routine Description:
+
+    With shadow doorbells, takes the head of a completion queue that has
+    completions held back from its shadow, with the completion lock
+    held. While some are still held, the event index asks for the head
+    doorbell as soon as the head moves. Otherwise the controller has no
+    use for the doorbell, and the host writes it only when its head
+    passes the event index last set, once a lap at most.
+
+--*/
+{
+    PEMU_QUEUE queue = &Controller->Queues[QueueId];
+    USHORT     head, last;
+
+    if (!EmuReadShadowDoorbell(Controller, 2 * QueueId + 1, &head)) {
+        return;
+    }
+
+    while (head < queue->CompletionSize) {
+        __atomic_store_n(&queue->CompletionHead, head, __ATOMIC_RELEASE);
+        EmuWriteHeldCompletions(queue);
+        if (queue->HeldCount == 0) {
+            return;
+        }
+        EmuWriteEventIndex(Controller, 2 * QueueId + 1, head);
+        last = head;
+        EmuReadShadowDoorbell(Controller, 2 * QueueId + 1, &head);
+        if (head == last) {
+            return;
+        }
+    }
+}
+
+static
+VOID
+EmuPostCompletion(
+    __in PEMU_CONTROLLER Controller,
+    __in USHORT          CompletionQueueId,
+    __in USHORT          SubmissionQueueId,
+    __in USHORT          CommandId,
+    __in USHORT          Status,
+    __in ULONGLONG       Result
+    )
+/*++
+Routine Description:
+
+    Posts the completion of a command, with Result in DW0 and DW1, or
+    holds it back while the queue
+    is full as far as the last head doorbell tells. The driver frees a
+    command id as it reaps the entry but writes the head doorbell only
+    after the whole batch, so a reused id can complete before the host
+    has given the slot back; a controller then waits, and so does this
+    one, in order. The entry carries the head of the submission queue as
+    it is now, not as it was when the command was fetched: delayed and
+    aborted commands complete out of order, and a head going back would
+    make the host think entries it had given back still in use.
+
+--*/
+{
+    PEMU_QUEUE            queue = &Controller->Queues[CompletionQueueId];
+    NVME_COMPLETION_ENTRY completion;
+
+    RtlZeroMemory(&completion, sizeof(completion));
+    completion.DW0 = (ULONG)Result;
+    completion.DW1 = (ULONG)(Result >> 32);
+    completion.DW2.SQID = SubmissionQueueId;
+    completion.DW3.CID = CommandId;
+    completion.DW3.Status.AsUshort = (USHORT)(Status << 1);
+
+    EmuChargeRemoteAccess(Controller, &Controller->RemoteDeviceAccesses,
+                          Controller->Config.Node, queue->CompletionNode, 1);
+
+    ShimAcquireRawLock(&queue->CompletionLock);
+
+    //
+    // Read under the lock, so that the entries of a queue carry heads
+    // that only go forward.
+    //
+    completion.DW2.SQHD = __atomic_load_n(&Controller->Queues[SubmissionQueueId].SubmissionHead,
+                                          __ATOMIC_ACQUIRE);
+
+    if (!queue->CompletionValid) {
+        //
+        // Deleted or reset meanwhile; the completion is lost, as it
+        // would be on a controller.
+        //
+    } else if (queue->HeldCount != 0 || !EmuWriteCompletion(queue, &completion)) {
+        //
+        // No more commands than entries can be outstanding.
+        //
+        ASSERT(queue->HeldCount < queue->CompletionSize);
+        queue->Held[(queue->HeldFirst + queue->HeldCount) % queue->CompletionSize] = completion;
+        queue->HeldCount++;
+        __atomic_add_fetch(&Controller->HeldCompletions, 1, __ATOMIC_RELAXED);
+        EmuPollCompletionHead(Controller, CompletionQueueId);
+    }
+
+    ShimReleaseRawLock(&queue->CompletionLock);
+}
+
+static
+VOID
+EmuUpdateCompletionHead(
+    __in PEMU_CONTROLLER Controller,
+    __in USHORT          QueueId,
+    __in USHORT          Head
+    )
+/*++
+Routine Description:
+
+    Takes a new head doorbell value and posts the completions that were
+    held back for the room it gives. With shadow doorbells the write
+    only tells the controller to read the shadow, which may have moved
+    on since.
+
+--*/
+{
+    PEMU_QUEUE queue = &Controller->Queues[QueueId];
+    ULONG      consumed;
+
+    ShimAcquireRawLock(&queue->CompletionLock);
+
+    EmuReadShadowDoorbell(Controller, 2 * QueueId + 1, &Head);
+
+    if (!queue->CompletionValid || Head >= queue->CompletionSize) {
+        ShimReleaseRawLock(&queue->CompletionLock);
+        return;
+    }
+
+    consumed = (Head + queue->CompletionSize - queue->CompletionHead) % queue->CompletionSize;
+    EmuChargeRemoteAccess(Controller, &Controller->RemoteHostAccesses,
+                          ShimQueryCurrentNode(), queue->CompletionNode, consumed);
+
+    __atomic_store_n(&queue->CompletionHead, Head, __ATOMIC_RELEASE);
+
+    EmuWriteHeldCompletions(queue);
+    if (queue->HeldCount != 0) {
+        EmuPollCompletionHead(Controller, QueueId);
+    }
+
+    ShimReleaseRawLock(&queue->CompletionLock);
+
+    EmuSignalInterrupt(Controller);
+}
+
+
+//
+// Delayed commands
+//
+
+static
+VOID
+EmuFutexWake(
+    __in volatile LONG *Address
+    )
+{
+    syscall(SYS_futex, Address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static
+VOID
+EmuFutexWait(
+    __in     volatile LONG *Address,
+    __in     LONG           Value,
+    __in_opt ULONGLONG      Interval
+    )
+/*++
+Routine Description:
+
+    Waits for a futex to move off Value, for at most Interval 100ns
+    units if that is not zero.
+
+--*/
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = Interval / 10000000;
+    timeout.tv_nsec = (Interval % 10000000) * 100;
+
+    syscall(SYS_futex, Address, FUTEX_WAIT_PRIVATE, Value,
+            Interval != 0 ? &timeout : NULL, NULL, 0);
+}
+
+static
+USHORT
+EmuComputeGuard(
+    __in PEMU_SEGMENT Segments,
+    __in ULONG        Offset,
+    __in ULONG        Length
+    )
+/*++
+Routine Description:
+
+    The CRC16 of Length bytes at Offset into a transfer, which may span
+    segments. The CRC engine of the controller is the driver's HwCrc16;
+    the pi mode checks that against a bitwise CRC.
+
+--*/
+{
+    USHORT crc = 0;
+    ULONG  chunk;
+
+    while (Offset >= Segments->Length) {
+        Offset -= Segments->Length;
+        Segments++;
+    }
+
+    while (Length != 0) {
+        chunk = min(Length, Segments->Length - Offset);
+        crc = HwCrc16(crc, Segments->Buffer + Offset, chunk);
+        Length -= chunk;
+        Offset = 0;
+        Segments++;
+    }
+
+    return crc;
+}
+
+static
+USHORT
+EmuProtectTransfer(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command,
+    __in PEMU_SEGMENT    Segments,
+    __in ULONG           Blocks
+    )
+/*++
+Routine Description:
+
+    Does what a controller with end-to-end protection does with the
+    separate metadata of a read or write: returns the PI of the blocks
+    read, and checks the guard and reference tag of the blocks written
+    as PRINFO asks. The reference tag of Types 1 and 2 starts at the
+    initial reference tag of CDW14; that of Type 3 is 0. The application
+    tag is 0. Fields are big-endian.
+
+--*/
+{
+    PUCHAR pi = (PUCHAR)(ULONG_PTR)Command->MPTR;
+    ULONG  prinfo = Command->u.GENERAL.CDW12;
+    ULONG  blockSize = 1U << Controller->Config.LbaShift;
+    ULONG  refTag, i;
+    USHORT guard;
+
+    if (pi == NULL || (prinfo & EMU_PRINFO_PRACT)) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    for (i = 0; i < Blocks; i++, pi += EMU_PI_SIZE) {
+
+        guard = EmuComputeGuard(Segments, i * blockSize, blockSize);
+        refTag = Controller->Config.ProtectionType == 3 ? 0 : Command->u.GENERAL.CDW14 + i;
+
+        if (Command->CDW0.OPC == NVME_NVM_COMMAND_READ) {
+            pi[0] = (UCHAR)(guard >> 8);
+            pi[1] = (UCHAR)guard;
+            pi[2] = 0;
+            pi[3] = 0;
+            pi[4] = (UCHAR)(refTag >> 24);
+            pi[5] = (UCHAR)(refTag >> 16);
+            pi[6] = (UCHAR)(refTag >> 8);
+            pi[7] = (UCHAR)refTag;
+            continue;
+        }
+
+        if ((prinfo & EMU_PRINFO_CHECK_GUARD) && guard != ((pi[0] << 8) | pi[1])) {
+            __atomic_add_fetch(&Controller->ProtectionErrors, 1, __ATOMIC_RELAXED);
+            return EMU_STATUS_GUARD_CHECK_ERROR;
+        }
+
+        if ((prinfo & EMU_PRINFO_CHECK_REF_TAG) &&
+            refTag != (((ULONG)pi[4] << 24) | ((ULONG)pi[5] << 16) |
+                       ((ULONG)pi[6] << 8) | pi[7])) {
+            __atomic_add_fetch(&Controller->ProtectionErrors, 1, __ATOMIC_RELAXED);
+            return EMU_STATUS_REF_TAG_CHECK_ERROR;
+        }
+    }
+
+    return 0;
+}
+
+static
+USHORT
+EmuRunIoCommand(
+    __in  PEMU_CONTROLLER Controller,
+    __in  PNVME_COMMAND   Command,
+    __out PULONGLONG      Result
+    );
+
+static
+USHORT
+EmuDownloadFirmware(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    );
+
+static
+USHORT
+EmuRunDelayedCommand(
+    __in  PEMU_CONTROLLER Controller,
+    __in  PNVME_COMMAND   Command,
+    __in  USHORT          SubmissionQueueId,
+    __out PULONGLONG      Result
+    )
+{
+    if (SubmissionQueueId == 0) {
+        *Result = 0;
+        return EmuDownloadFirmware(Controller, Command);
+    }
+
+    return EmuRunIoCommand(Controller, Command, Result);
+}
+
+static
+VOID
+EmuDelayCommand(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command,
+    __in USHORT          CompletionQueueId,
+    __in USHORT          SubmissionQueueId,
+    __in ULONG           Delay
+    )
+/*++
+Routine Description:
+
+    Hands an I/O command, or a Firmware Image Download, to the completion
+    thread, to be run and completed once Delay us have passed. The ring
+    has room for as many commands as all queues together can hold;
+    should aborted ones that have not come up yet fill it, the command
+    runs now.
+
+--*/
+{
+    PEMU_DELAYED_COMMAND delayed;
+    ULONGLONG            result;
+    USHORT               status;
+    BOOLEAN              wasEmpty;
+
+    ShimAcquireRawLock(&Controller->DelayedLock);
+
+    if (Controller->DelayedCount == Controller->DelayedSize) {
+        ShimReleaseRawLock(&Controller->DelayedLock);
+        status = EmuRunDelayedCommand(Controller, Command, SubmissionQueueId, &result);
+        EmuPostCompletion(Controller, CompletionQueueId, SubmissionQueueId,
+                          (USHORT)Command->CDW0.CID, status, result);
+        return;
+    }
+
+    delayed = &Controller->Delayed[(Controller->DelayedFirst + Controller->DelayedCount) %
+                                   Controller->DelayedSize];
+    delayed->Due = KeQueryInterruptTime() + (ULONGLONG)Delay * 10;
+    delayed->Command = *Command;
+    delayed->CompletionQueueId = CompletionQueueId;
+    delayed->SubmissionQueueId = SubmissionQueueId;
+    delayed->Discarded = FALSE;
+
+    wasEmpty = (BOOLEAN)(Controller->DelayedCount++ == 0);
+
+    ShimReleaseRawLock(&Controller->DelayedLock);
+
+    if (wasEmpty) {
+        __atomic_add_fetch(&Controller->DelayedSequence, 1, __ATOMIC_SEQ_CST);
+        EmuFutexWake(&Controller->DelayedSequence);
+    }
+}
+
+static
+BOOLEAN
+EmuAbortDelayedCommand(
+    __in PEMU_CONTROLLER Controller,
+    __in USHORT          SubmissionQueueId,
+    __in USHORT          CommandId
+    )
+/*++
+Routine Description:
+
+    Aborts a command that is still waiting: it completes now with
+    Command Abort Requested, without having run. A command the thread
+    took already is past aborting, and so is one that was dropped.
+
+--*/
+{
+    PEMU_DELAYED_COMMAND delayed;
+    ULONG                i;
+    BOOLEAN              aborted = FALSE;
+
+    ShimAcquireRawLock(&Controller->DelayedLock);
+
+    for (i = 0; i < Controller->DelayedCount; i++) {
+        delayed = &Controller->Delayed[(Controller->DelayedFirst + i) % Controller->DelayedSize];
+        if (!delayed->Discarded &&
+            delayed->SubmissionQueueId == SubmissionQueueId &&
+            delayed->Command.CDW0.CID == CommandId) {
+            delayed->Discarded = TRUE;
+            EmuPostCompletion(Controller, delayed->CompletionQueueId, SubmissionQueueId,
+                              CommandId, EMU_STATUS_ABORT_REQUESTED, 0);
+            __atomic_add_fetch(&Controller->Aborts, 1, __ATOMIC_RELAXED);
+            aborted = TRUE;
+            break;
+        }
+    }
+
+    ShimReleaseRawLock(&Controller->DelayedLock);
+
+    return aborted;
+}
+
+static
+VOID
+EmuDiscardDelayedCommands(
+    __in PEMU_CONTROLLER Controller,
+    __in USHORT          SubmissionQueueId
+    )
+/*++
+Routine Description:
+
+    Drops the waiting commands of a deleted submission queue, or of all
+    of them for 0, on a reset; they never run. Once this returns, the
+    thread will not complete any of them into a queue created again
+    with the same id.
+
+--*/
+{
+    PEMU_DELAYED_COMMAND delayed;
+    ULONG                i;
+
+    if (Controller->Delayed == NULL) {
+        return;
+    }
+
+    ShimAcquireRawLock(&Controller->DelayedLock);
+
+    for (i = 0; i < Controller->DelayedCount; i++) {
+        delayed = &Controller->Delayed[(Controller->DelayedFirst + i) % Controller->DelayedSize];
+        if (!delayed->Discarded &&
+            (SubmissionQueueId == 0 || delayed->SubmissionQueueId == SubmissionQueueId)) {
+            delayed->Discarded = TRUE;
+            __atomic_add_fetch(&Controller->Discarded, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    ShimReleaseRawLock(&Controller->DelayedLock);
+}
+
+static
+PVOID
+EmuDelayedCommandThread(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Runs the delayed commands as they fall due, posts their completions
+    and interrupts for them, and sleeps until the next one is due or one
+    is queued. The commands run with the lock held, so that a reset or
+    a queue deletion that discarded them has nothing left behind it. The
+    thread belongs to no processor, like a controller.
+
+--*/
+{
+    PEMU_CONTROLLER      controller = (PEMU_CONTROLLER)Context;
+    PEMU_DELAYED_COMMAND delayed;
+    ULONGLONG            now, wait, result;
+    LONG                 sequence;
+    USHORT               status;
+    BOOLEAN              posted;
+
+    while (!__atomic_load_n(&controller->DelayedStopping, __ATOMIC_ACQUIRE)) {
+
+        sequence = __atomic_load_n(&controller->DelayedSequence, __ATOMIC_SEQ_CST);
+        now = KeQueryInterruptTime();
+        wait = 0;
+        posted = FALSE;
+
+        ShimAcquireRawLock(&controller->DelayedLock);
+
+        while (controller->DelayedCount != 0) {
+            delayed = &controller->Delayed[controller->DelayedFirst];
+            if (!delayed->Discarded) {
+                if (delayed->Due > now) {
+                    wait = delayed->Due - now;
+                    break;
+                }
+                status = EmuRunDelayedCommand(controller, &delayed->Command,
+                                              delayed->SubmissionQueueId, &result);
+                EmuPostCompletion(controller, delayed->CompletionQueueId,
+                                  delayed->SubmissionQueueId,
+                                  (USHORT)delayed->Command.CDW0.CID, status, result);
+                posted = TRUE;
+            }
+            controller->DelayedFirst = (controller->DelayedFirst + 1) % controller->DelayedSize;
+            controller->DelayedCount--;
+        }
+
+        ShimReleaseRawLock(&controller->DelayedLock);
+
+        if (posted) {
+            EmuSignalInterrupt(controller);
+        } else {
+            EmuFutexWait(&controller->DelayedSequence, sequence, wait);
+        }
+    }
+
+    return NULL;
+}
+
+//
+// Arbitration
+//
+
+static
+BOOLEAN
+EmuDropCommand(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    Tells whether the I/O command just fetched is one of those the
+    controller drops, counting it.
+
+--*/
+{
+    ULONG interval = __atomic_load_n(&Controller->Config.DropInterval, __ATOMIC_RELAXED);
+
+    if (interval == 0 ||
+        __atomic_add_fetch(&Controller->IoCommands, 1, __ATOMIC_RELAXED) % interval != 0) {
+        return FALSE;
+    }
+
+    __atomic_add_fetch(&Controller->Dropped, 1, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+static
+BOOLEAN
+EmuSubmissionPending(
+    __in PEMU_QUEUE Queue
+    )
+{
+    return (BOOLEAN)(Queue->SubmissionValid &&
+                     __atomic_load_n(&Queue->SubmissionTail, __ATOMIC_ACQUIRE) !=
+                         Queue->SubmissionHead);
+}
+
+static
+BOOLEAN
+EmuAnyPending(
+    __in PEMU_CONTROLLER Controller
+    )
+{
+    ULONG i;
+
+    for (i = 1; i <= Controller->Config.MaxQueues; i++) {
+        if (EmuSubmissionPending(&Controller->Queues[i])) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static
+USHORT
+EmuNextQueue(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Priority
+    )
+/*++
+Routine Description:
+
+    Round robin over the I/O submission queues of a priority, or over all
+    of them for EMU_PRIORITY_ANY: the first queue after the one served
+    last that has a command to fetch.
+
+Return Value:
+
+    The queue id, or 0 if no queue has a command
+
+--*/
+{
+    ULONG      count = Controller->Config.MaxQueues;
+    USHORT     queueId = Controller->ArbiterLast[Priority];
+    PEMU_QUEUE queue;
+    ULONG      i;
+
+    for (i = 0; i < count; i++) {
+        queueId = (USHORT)(queueId % count + 1);
+        queue = &Controller->Queues[queueId];
+        if ((Priority == EMU_PRIORITY_ANY || queue->SubmissionPriority == Priority) &&
+            EmuSubmissionPending(queue)) {
+            Controller->ArbiterLast[Priority] = queueId;
+            return queueId;
+        }
+    }
+
+    return 0;
+}
+
+static
+USHORT
+EmuArbitrate(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    Picks the queue to fetch the next I/O command from. With weighted
+    round robin, urgent queues go first; then the high, medium and low
+    classes take turns, each giving as many commands a round as its
+    weight, or fewer if it runs out, round robin among its queues.
+
+Return Value:
+
+    The queue id, or 0 if no queue has a command
+
+--*/
+{
+    USHORT queueId;
+    ULONG  turn, weighted;
+
+    if (!Controller->WeightedArbitration) {
+        return EmuNextQueue(Controller, EMU_PRIORITY_ANY);
+    }
+
+    queueId = EmuNextQueue(Controller, EMU_PRIORITY_URGENT);
+    if (queueId != 0) {
+        return queueId;
+    }
+
+    for (turn = 0; turn < 2 * EMU_WEIGHTED_CLASSES; turn++) {
+        weighted = Controller->ArbiterClass;
+        if (Controller->ArbiterCredits[weighted] != 0) {
+            queueId = EmuNextQueue(Controller, EMU_PRIORITY_HIGH + weighted);
+            if (queueId != 0) {
+                Controller->ArbiterCredits[weighted]--;
+                return queueId;
+            }
+        }
+        if (++Controller->ArbiterClass == EMU_WEIGHTED_CLASSES) {
+            Controller->ArbiterClass = 0;
+            for (weighted = 0; weighted < EMU_WEIGHTED_CLASSES; weighted++) {
+                Controller->ArbiterCredits[weighted] = Controller->ArbiterWeights[weighted];
+            }
+        }
+    }
+
+    return 0;
+}
+
+static
+BOOLEAN
+EmuFetchCommand(
+    __in  PEMU_CONTROLLER Controller,
+    __in  USHORT          QueueId,
+    __out PNVME_COMMAND   Command,
+    __out PUSHORT         CompletionQueueId
+    )
+/*++
+Routine Description:
+
+    Takes the command at the head of a submission queue, unless the
+    queue went away meanwhile or the command is dropped.
+
+--*/
+{
+    PEMU_QUEUE queue = &Controller->Queues[QueueId];
+
+    ShimAcquireRawLock(&queue->SubmissionLock);
+
+    if (!queue->SubmissionValid || queue->SubmissionHead == queue->SubmissionTail) {
+        ShimReleaseRawLock(&queue->SubmissionLock);
+        return FALSE;
+    }
+
+    *Command = queue->SubmissionQueue[queue->SubmissionHead];
+    *CompletionQueueId = queue->CompletionQueueId;
+    __atomic_store_n(&queue->SubmissionHead,
+                     (USHORT)((queue->SubmissionHead + 1) % queue->SubmissionSize),
+                     __ATOMIC_RELEASE);
+
+    ShimReleaseRawLock(&queue->SubmissionLock);
+
+    __atomic_add_fetch(&Controller->Commands, 1, __ATOMIC_RELAXED);
+
+    return (BOOLEAN)!EmuDropCommand(Controller);
+}
+
+static
+VOID
+EmuSleep(
+    __in ULONGLONG Nanoseconds
+    )
+{
+    struct timespec interval;
+
+    interval.tv_sec = Nanoseconds / 1000000000;
+    interval.tv_nsec = Nanoseconds % 1000000000;
+    nanosleep(&interval, NULL);
+}
+
+static
+VOID
+EmuChargeFetch(
+    __in PEMU_CONTROLLER Controller,
+    __in PEMU_QUEUE      Queue,
+    __in ULONG           Entries
+    )
+/*++
+Routine Description:
+
+    Charges the controller for the submission entries a tail move made
+    it fetch. Entries in host memory take it a read over the bus each;
+    those in its own memory buffer are already there.
+
+--*/
+{
+    EmuChargeRemoteAccess(Controller, &Controller->RemoteDeviceAccesses,
+                          Controller->Config.Node, Queue->SubmissionNode, Entries);
+
+    if (!Queue->SubmissionInCmb && Entries != 0) {
+        __atomic_add_fetch(&Controller->HostFetches, Entries, __ATOMIC_RELAXED);
+        if (Controller->Config.FetchCost != 0) {
+            EmuSpin((ULONGLONG)Entries * Controller->Config.FetchCost);
+        }
+    }
+}
+
+static
+VOID
+EmuPollSubmissionTails(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    With shadow doorbells, takes the tails of the I/O submission queues
+    from their shadows, with the arbiter lock held.
+
+--*/
+{
+    PEMU_QUEUE queue;
+    USHORT     tail;
+    ULONG      i;
+
+    for (i = 1; i <= Controller->Config.MaxQueues; i++) {
+        queue = &Controller->Queues[i];
+        if (!queue->SubmissionValid) {
+            continue;
+        }
+        ShimAcquireRawLock(&queue->SubmissionLock);
+        if (!EmuReadShadowDoorbell(Controller, 2 * i, &tail)) {
+            ShimReleaseRawLock(&queue->SubmissionLock);
+            return;
+        }
+        if (queue->SubmissionValid && tail < queue->SubmissionSize &&
+            tail != queue->SubmissionTail) {
+            EmuChargeFetch(Controller, queue,
+                           (tail + queue->SubmissionSize - queue->SubmissionTail) %
+                               queue->SubmissionSize);
+            __atomic_store_n(&queue->SubmissionTail, tail, __ATOMIC_RELEASE);
+        }
+        ShimReleaseRawLock(&queue->SubmissionLock);
+    }
+}
+
+static
+BOOLEAN
+EmuArmSubmissionTails(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    With shadow doorbells, asks the host for a tail doorbell write past
+    the tail the controller has of every I/O submission queue, as the
+    arbiter goes idle, with the arbiter lock held. The shadows must be
+    read again after, in case the host moved one meanwhile; one fence
+    after all the event indexes does for all of them.
+
+Return Value:
+
+    FALSE if the host gave no shadow doorbells
+
+--*/
+{
+    volatile ULONG *indexes = __atomic_load_n(&Controller->EventIndexes, __ATOMIC_ACQUIRE);
+    PEMU_QUEUE      queue;
+    ULONG           i;
+
+    if (indexes == NULL) {
+        return FALSE;
+    }
+
+    for (i = 1; i <= Controller->Config.MaxQueues; i++) {
+        queue = &Controller->Queues[i];
+        if (queue->SubmissionValid) {
+            __atomic_store_n(&indexes[2 * i],
+                             __atomic_load_n(&queue->SubmissionTail, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return TRUE;
+}
+
+static
+PVOID
+EmuArbiterThread(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Fetches the I/O commands one per service time, in arbitration order,
+    runs them and posts their completions, and interrupts once for all
+    it completed. The time the controller is busy until is kept in ns;
+    the thread completes what is due by now and sleeps until the next
+    command is, or until a doorbell if there is none. With shadow
+    doorbells it reads the shadow tails before every pass, so that the
+    host need write a tail doorbell only to wake it. The commands run
+    with the lock held, so that a reset or a queue deletion that synced
+    with it has nothing left behind it. The thread belongs to no
+    processor, like a controller.
+
+--*/
+{
+    PEMU_CONTROLLER controller = (PEMU_CONTROLLER)Context;
+    ULONGLONG       serviceTime = controller->Config.ServiceTime;
+    ULONGLONG       busyUntil = 0, now, result;
+    NVME_COMMAND    command;
+    USHORT          queueId, completionQueueId;
+    USHORT          status;
+    LONG            sequence;
+    BOOLEAN         posted, idle = TRUE;
+
+    //
+    // Sleeps of a few us, rather than the default slack of 50.
+    //
+    prctl(PR_SET_TIMERSLACK, 1000UL, 0, 0, 0);
+
+    while (!__atomic_load_n(&controller->ArbiterStopping, __ATOMIC_ACQUIRE)) {
+
+        sequence = __atomic_load_n(&controller->ArbiterSequence, __ATOMIC_SEQ_CST);
+        now = KeQueryInterruptTime() * 100;
+        if (idle) {
+            busyUntil = max(busyUntil, now);
+        }
+        posted = FALSE;
+
+        ShimAcquireRawLock(&controller->ArbiterLock);
+
+        EmuPollSubmissionTails(controller);
+
+        while (busyUntil + serviceTime <= now &&
+               (queueId = EmuArbitrate(controller)) != 0) {
+            busyUntil += serviceTime;
+            if (!EmuFetchCommand(controller, queueId, &command, &completionQueueId)) {
+                continue;
+            }
+            if (controller->Config.CompletionDelay != 0) {
+                EmuDelayCommand(controller, &command, completionQueueId, queueId,
+                                controller->Config.CompletionDelay);
+            } else {
+                status = EmuRunIoCommand(controller, &command, &result);
+                EmuPostCompletion(controller, completionQueueId, queueId,
+                                  (USHORT)command.CDW0.CID, status, result);
+                posted = TRUE;
+            }
+        }
+
+        idle = (BOOLEAN)!EmuAnyPending(controller);
+        if (idle && EmuArmSubmissionTails(controller)) {
+            EmuPollSubmissionTails(controller);
+            idle = (BOOLEAN)!EmuAnyPending(controller);
+        }
+
+        ShimReleaseRawLock(&controller->ArbiterLock);
+
+        if (posted) {
+            EmuSignalInterrupt(controller);
+        }
+
+        if (!idle) {
+            EmuSleep(busyUntil + serviceTime - min(now, busyUntil + serviceTime));
+        } else {
+            __atomic_store_n(&controller->ArbiterWaiting, 1, __ATOMIC_SEQ_CST);
+            EmuFutexWait(&controller->ArbiterSequence, sequence, 0);
+            __atomic_store_n(&controller->ArbiterWaiting, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+static
+VOID
+EmuSyncArbiter(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    Waits for the command the arbiter thread may be running to be
+    completed, after a queue it came from went away.
+
+--*/
+{
+    if (Controller->ArbiterThreadStarted) {
+        ShimAcquireRawLock(&Controller->ArbiterLock);
+        ShimReleaseRawLock(&Controller->ArbiterLock);
+    }
+}
+
+static
+VOID
+EmuResetArbitration(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    The arbitration state after a reset: every weight 1, the default of
+    the Arbitration feature.
+
+--*/
+{
+    ULONG i;
+
+    ShimAcquireRawLock(&Controller->ArbiterLock);
+    Controller->WeightedArbitration = (BOOLEAN)(Controller->Registers->CC.AMS == 1);
+    Controller->ArbiterClass = 0;
+    for (i = 0; i < EMU_WEIGHTED_CLASSES; i++) {
+        Controller->ArbiterWeights[i] = 1;
+        Controller->ArbiterCredits[i] = 1;
+    }
+    ShimReleaseRawLock(&Controller->ArbiterLock);
+}
+
+
+//
+// Walking PRPs
+//
+
+static
+ULONG
+EmuWalkPrps(
+    __in  PNVME_COMMAND Command,
+    __in  ULONG         Length,
+    __out PEMU_SEGMENT  Segments
+    )
+/*++
+Routine Description:
+
+    Turns the PRP entries of a command into the pieces of memory they
+    describe. A list entry in the last slot of a list page points at
+    the next list page if more than one page remains.
+
+Return Value:
+
+    Number of segments, 0 if the PRPs do not describe Length bytes
+
+--*/
+{
+    ULONGLONG  address = Command->PRP1;
+    PULONGLONG list;
+    ULONG      count = 0;
+    ULONG      chunk;
+
+    chunk = min(Length, PAGE_SIZE - (ULONG)(address & (PAGE_SIZE - 1)));
+    Segments[count].Buffer = (PUCHAR)(ULONG_PTR)address;
+    Segments[count].Length = chunk;
+    count++;
+    Length -= chunk;
+
+    if (Length == 0) {
+        return count;
+    }
+
+    if (Length <= PAGE_SIZE) {
+        Segments[count].Buffer = (PUCHAR)(ULONG_PTR)Command->PRP2;
+        Segments[count].Length = Length;
+        return count + 1;
+    }
+
+    list = (PULONGLONG)(ULONG_PTR)Command->PRP2;
+    while (Length != 0) {
+        if (count == EMU_MAX_SEGMENTS || (*list & (PAGE_SIZE - 1)) != 0) {
+            return 0;
+        }
+        if (((ULONG_PTR)(list + 1) & (PAGE_SIZE - 1)) == 0 && Length > PAGE_SIZE) {
+            list = (PULONGLONG)(ULONG_PTR)*list;
+            continue;
+        }
+        chunk = min(Length, PAGE_SIZE);
+        Segments[count].Buffer = (PUCHAR)(ULONG_PTR)*list++;
+        Segments[count].Length = chunk;
+        count++;
+        Length -= chunk;
+    }
+
+    return count;
+}
+
+static
+BOOLEAN
+EmuCopyToHost(
+    __in     PNVME_COMMAND Command,
+    __in_opt PVOID         Data,
+    __in     ULONG         Length
+    )
+/*++
+Routine Description:
+
+    Writes Length bytes of controller data, or zeros if Data is NULL, to
+    the host memory the PRPs of a command describe.
+
+--*/
+{
+    EMU_SEGMENT segments[EMU_MAX_SEGMENTS];
+    PUCHAR      data = Data;
+    ULONG       count, i;
+
+    count = EmuWalkPrps(Command, Length, segments);
+    if (count == 0) {
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (data != NULL) {
+            RtlCopyMemory(segments[i].Buffer, data, segments[i].Length);
+            data += segments[i].Length;
+        } else {
+            RtlZeroMemory(segments[i].Buffer, segments[i].Length);
+        }
+    }
+
+    return TRUE;
+}
+
+
+//
+// Admin commands
+//
+
+static
+USHORT
+EmuCreateCompletionQueue(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+{
+    USHORT     queueId = (USHORT)(Command->u.GENERAL.CDW10 & 0xFFFF);
+    ULONG      size = (Command->u.GENERAL.CDW10 >> 16) + 1;
+    PEMU_QUEUE queue;
+
+    if (queueId == 0 || queueId > Controller->Config.MaxQueues ||
+        Controller->Queues[queueId].CompletionValid) {
+        return EMU_STATUS_INVALID_QUEUE_ID;
+    }
+    if (size < 2 || size > Controller->Registers->CAP.MQES + 1u) {
+        return EMU_STATUS_INVALID_QUEUE_SIZE;
+    }
+    if ((Command->u.GENERAL.CDW11 & EMU_QUEUE_CONTIGUOUS) == 0) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    queue = &Controller->Queues[queueId];
+
+    ShimAcquireRawLock(&queue->CompletionLock);
+    queue->CompletionQueue = (PNVME_COMPLETION_ENTRY)(ULONG_PTR)Command->PRP1;
+    queue->CompletionSize = (USHORT)size;
+    queue->CompletionTail = 0;
+    queue->CompletionHead = 0;
+    queue->CompletionPhase = 1;
+    queue->HeldFirst = 0;
+    queue->HeldCount = 0;
+    queue->InterruptsEnabled = (BOOLEAN)((Command->u.GENERAL.CDW11 & EMU_QUEUE_INTERRUPTS) != 0);
+    queue->CompletionNode = ShimQueryMemoryNode(queue->CompletionQueue);
+    queue->CompletionValid = TRUE;
+    ShimReleaseRawLock(&queue->CompletionLock);
+
+    return 0;
+}
+
+static
+USHORT
+EmuCreateSubmissionQueue(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+{
+    USHORT     queueId = (USHORT)(Command->u.GENERAL.CDW10 & 0xFFFF);
+    ULONG      size = (Command->u.GENERAL.CDW10 >> 16) + 1;
+    USHORT     completionQueueId = (USHORT)(Command->u.GENERAL.CDW11 >> 16);
+    PEMU_QUEUE queue;
+
+    if (queueId == 0 || queueId > Controller->Config.MaxQueues ||
+        Controller->Queues[queueId].SubmissionValid) {
+        return EMU_STATUS_INVALID_QUEUE_ID;
+    }
+    if (size < 2 || size > Controller->Registers->CAP.MQES + 1u) {
+        return EMU_STATUS_INVALID_QUEUE_SIZE;
+    }
+    if (completionQueueId == 0 || completionQueueId > Controller->Config.MaxQueues ||
+        !Controller->Queues[completionQueueId].CompletionValid) {
+        return EMU_STATUS_INVALID_COMPLETION_QUEUE;
+    }
+    if ((Command->u.GENERAL.CDW11 & EMU_QUEUE_CONTIGUOUS) == 0) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    queue = &Controller->Queues[queueId];
+
+    ShimAcquireRawLock(&queue->SubmissionLock);
+    queue->SubmissionQueue = (PNVME_COMMAND)(ULONG_PTR)Command->PRP1;
+    queue->SubmissionSize = (USHORT)size;
+    queue->SubmissionHead = 0;
+    queue->SubmissionTail = 0;
+    queue->SubmissionPriority = (UCHAR)((Command->u.GENERAL.CDW11 >> 1) & 3);
+    queue->CompletionQueueId = completionQueueId;
+    queue->SubmissionNode = ShimQueryMemoryNode(queue->SubmissionQueue);
+    queue->SubmissionInCmb =
+        (BOOLEAN)(Controller->Cmb != NULL &&
+                  Command->PRP1 - (ULONG_PTR)Controller->Cmb < Controller->Config.CmbSize);
+    queue->SubmissionValid = TRUE;
+    ShimReleaseRawLock(&queue->SubmissionLock);
+
+    return 0;
+}
+
+static
+USHORT
+EmuIdentify(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+/*++
+Routine Description:
+
+    Identify Controller and Identify Namespace for namespace 1, which
+    has a single LBA format, and metadata only for protection
+    information. A zoned namespace also has its identification
+    descriptors, which name the Zoned command set, and the Identify data
+    of that command set: its zone size, no limit on open or active
+    zones, and Zone Appends as large as any transfer. Other CNS values
+    are not supported.
+
+--*/
+{
+    PNVME_IDENTIFY_CONTROLLER_DATA controller;
+    PNVME_IDENTIFY_NAMESPACE_DATA  ns;
+    PUCHAR                         data;
+    UCHAR                          csi = (UCHAR)(Command->u.GENERAL.CDW11 >> 24);
+    USHORT                         status = 0;
+
+    C_ASSERT(sizeof(NVME_IDENTIFY_CONTROLLER_DATA) == PAGE_SIZE);
+    C_ASSERT(sizeof(NVME_IDENTIFY_NAMESPACE_DATA) == PAGE_SIZE);
+
+    data = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, EMU_POOL_TAG);
+    if (data == NULL) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+    RtlZeroMemory(data, PAGE_SIZE);
+
+    switch (Command->u.GENERAL.CDW10 & 0xFF) {
+
+    case NVME_IDENTIFY_CNS_CONTROLLER:
+        controller = (PNVME_IDENTIFY_CONTROLLER_DATA)data;
+        controller->VID = 0x14A4;
+        controller->SSVID = 0x14A4;
+        RtlCopyMemory(controller->MN, "Emulated NVMe", sizeof("Emulated NVMe") - 1);
+        controller->CNTLID = (USHORT)Controller->Index;
+        controller->VER = Controller->Registers->VS.AsUlong;
+        controller->ACL = 3;
+        controller->AERL = EMU_MAX_ASYNC_EVENTS - 1;
+        controller->ELPE = EMU_ERROR_LOG_ENTRIES - 1;
+        controller->SQES = 0x66;
+        controller->CQES = 0x44;
+        controller->NN = 1;
+        controller->HMPRE = Controller->Config.HmbSize / EMU_HMB_UNIT;
+        controller->HMMIN = Controller->Config.HmbSize / EMU_HMB_UNIT;
+        if (Controller->Config.ShadowDoorbells) {
+            controller->OACS |= EMU_OACS_DOORBELL_BUFFER;
+        }
+        if (Controller->Config.TelemetrySize != 0) {
+            controller->LPA = EMU_LPA_EXTENDED_DATA | EMU_LPA_TELEMETRY | EMU_LPA_DATA_AREA_4;
+        }
+        if (Controller->Config.FirmwareSize != 0) {
+            controller->OACS |= EMU_OACS_FIRMWARE;
+            *(PUCHAR)&controller->FRMW = EMU_FIRMWARE_SLOTS << 1;
+            controller->FWUG = EMU_FIRMWARE_GRANULARITY / 4096;
+        }
+        break;
+
+    case NVME_IDENTIFY_CNS_SPECIFIC_NAMESPACE:
+        if (Command->NSID != 1) {
+            status = EMU_STATUS_INVALID_NAMESPACE;
+            break;
+        }
+        ns = (PNVME_IDENTIFY_NAMESPACE_DATA)data;
+        ns->NSZE = Controller->Config.Blocks;
+        ns->NCAP = Controller->Config.Blocks;
+        ns->NUSE = Controller->Config.Blocks;
+        ns->NLBAF = 0;
+        ns->LBAF[0].LBADS = (UCHAR)Controller->Config.LbaShift;
+        if (Controller->Config.ProtectionType != 0) {
+            ns->LBAF[0].MS = EMU_PI_SIZE;
+            ns->MC.MetadataInSeparateBuffer = 1;
+            ns->DPC.ProtectionInfoType1 = 1;
+            ns->DPC.ProtectionInfoType2 = 1;
+            ns->DPC.ProtectionInfoType3 = 1;
+            ns->DPC.InfoAtEndOfMetadata = 1;
+            ns->DPS.ProtectionInfoTypeEnabled = Controller->Config.ProtectionType;
+        }
+        break;
+
+    case EMU_IDENTIFY_CNS_NS_DESCRIPTORS:
+        if (Command->NSID != 1) {
+            status = EMU_STATUS_INVALID_NAMESPACE;
+            break;
+        }
+        data[0] = EMU_NID_TYPE_CSI;
+        data[1] = 1;
+        data[4] = Controller->Zones != NULL ? EMU_CSI_ZONED : 0;
+        break;
+
+    case EMU_IDENTIFY_CNS_CSI_NAMESPACE:
+        if (Command->NSID != 1 || csi != EMU_CSI_ZONED || Controller->Zones == NULL) {
+            status = EMU_STATUS_INVALID_FIELD;
+            break;
+        }
+        *(PULONG)(data + EMU_ZNS_MAR_OFFSET) = MAXULONG;
+        *(PULONG)(data + EMU_ZNS_MOR_OFFSET) = MAXULONG;
+        *(PULONGLONG)(data + EMU_ZNS_LBAFE_OFFSET) = Controller->Config.ZoneBlocks;
+        break;
+
+    case EMU_IDENTIFY_CNS_CSI_CONTROLLER:
+        if (csi != EMU_CSI_ZONED || Controller->Zones == NULL) {
+            status = EMU_STATUS_INVALID_FIELD;
+        }
+        break;                          // ZASL 0, the transfer limit
+
+    default:
+        status = EMU_STATUS_INVALID_FIELD;
+        break;
+    }
+
+    if (status == 0 && !EmuCopyToHost(Command, data, PAGE_SIZE)) {
+        status = EMU_STATUS_INVALID_FIELD;
+    }
+
+    ExFreePoolWithTag(data, EMU_POOL_TAG);
+
+    return status;
+}
+
+static
+VOID
+EmuReadTelemetry(
+    __in  PEMU_CONTROLLER Controller,
+    __in  ULONGLONG       Offset,
+    __out PUCHAR          Buffer,
+    __in  ULONG           Length
+    )
+/*++
+Routine Description:
+
+    Fills Buffer with Length bytes of the Telemetry Host-Initiated log
+    from Offset on, both multiples of 4. Past the header block, every
+    dword holds the generation of the capture in its top byte and its
+    own dword index into the log below, so that a reader can tell that
+    it got every byte where it belongs, and all from one capture.
+
+--*/
+{
+    UCHAR  header[EMU_TELEMETRY_BLOCK];
+    ULONG  lastBlock = Controller->Config.TelemetrySize / EMU_TELEMETRY_BLOCK - 1;
+    ULONG  generation = Controller->TelemetryGeneration & 0xFF;
+    PULONG data;
+    ULONG  length, i;
+
+    if (Offset < EMU_TELEMETRY_BLOCK) {
+        RtlZeroMemory(header, sizeof(header));
+        header[0] = EMU_LOG_PAGE_TELEMETRY_HOST;
+        for (i = 0; i < 3; i++) {
+            ((PUSHORT)&header[EMU_TELEMETRY_AREA_1_OFFSET])[i] = (USHORT)min(lastBlock, 0xFFFF);
+        }
+        *(PULONG)&header[EMU_TELEMETRY_AREA_4_OFFSET] = lastBlock;
+
+        length = min(Length, EMU_TELEMETRY_BLOCK - (ULONG)Offset);
+        RtlCopyMemory(Buffer, &header[Offset], length);
+        Buffer += length;
+        Offset += length;
+        Length -= length;
+    }
+
+    data = (PULONG)Buffer;
+    for (i = 0; i < Length / sizeof(ULONG); i++) {
+        data[i] = (generation << 24) | (ULONG)((Offset / sizeof(ULONG) + i) & 0xFFFFFF);
+    }
+}
+
+static
+USHORT
+EmuGetLogPage(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+/*++
+Routine Description:
+
+    The error and health pages the driver reads are all zeros: no error
+    logged, no warning raised. A controller with a telemetry log gives
+    any part of it, at the offset of the command, and captures a new one
+    first if the log specific field asks to.
+
+--*/
+{
+    EMU_SEGMENT segments[EMU_MAX_SEGMENTS];
+    UCHAR       logPage = (UCHAR)(Command->u.GENERAL.CDW10 & 0xFF);
+    UCHAR       specific = (UCHAR)((Command->u.GENERAL.CDW10 >> EMU_LOG_SPECIFIC_SHIFT) & 0x7F);
+    ULONG       dwords = ((Command->u.GENERAL.CDW10 >> 16) | (Command->u.GENERAL.CDW11 << 16)) + 1;
+    ULONGLONG   offset = Command->u.GENERAL.CDW12 | ((ULONGLONG)Command->u.GENERAL.CDW13 << 32);
+    ULONG       count, i;
+
+    if (logPage == EMU_LOG_PAGE_TELEMETRY_HOST && Controller->Config.TelemetrySize != 0) {
+        if (dwords > EMU_MAX_SEGMENTS * (PAGE_SIZE / sizeof(ULONG)) || (offset & 3) != 0 ||
+            offset + dwords * sizeof(ULONG) > Controller->Config.TelemetrySize) {
+            return EMU_STATUS_INVALID_FIELD;
+        }
+        count = EmuWalkPrps(Command, dwords * sizeof(ULONG), segments);
+        if (count == 0) {
+            return EMU_STATUS_INVALID_FIELD;
+        }
+        if (specific & EMU_TELEMETRY_CREATE) {
+            Controller->TelemetryGeneration++;
+        }
+        for (i = 0; i < count; i++) {
+            EmuReadTelemetry(Controller, offset, segments[i].Buffer, segments[i].Length);
+            offset += segments[i].Length;
+        }
+        return 0;
+    }
+
+    if (logPage == 0 || logPage > 0x03) {
+        return EMU_STATUS_INVALID_LOG_PAGE;
+    }
+    if (dwords > EMU_MAX_SEGMENTS * (PAGE_SIZE / sizeof(ULONG)) ||
+        !EmuCopyToHost(Command, NULL, dwords * sizeof(ULONG))) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    return 0;
+}
+
+static
+VOID
+EmuLogHostMemoryBuffer(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Flags,
+    __in USHORT          Status,
+    __in ULONG           Pages,
+    __in ULONG           Chunks
+    )
+/*++
+Routine Description:
+
+    Records what happened to the host memory buffer, with the HMB lock
+    held. Events past EMU_MAX_HMB_EVENTS are counted, not kept.
+
+--*/
+{
+    PEMU_HMB_EVENT event;
+
+    if (Controller->HmbEventCount < EMU_MAX_HMB_EVENTS) {
+        event = &Controller->HmbEvents[Controller->HmbEventCount];
+        event->Flags = Flags;
+        event->Enabled = Controller->HmbEnabled;
+        event->Status = Status;
+        event->Pages = Pages;
+        event->Chunks = Chunks;
+    }
+    Controller->HmbEventCount++;
+}
+
+static
+USHORT
+EmuCheckHostMemoryBuffer(
+    __in  PEMU_CONTROLLER Controller,
+    __in  PNVME_COMMAND   Command,
+    __out PEMU_HMB_CHUNK  Chunks
+    )
+/*++
+Routine Description:
+
+    Checks the descriptor list of a Set Features that enables the host
+    memory buffer: at least one chunk, each page aligned, none empty,
+    none overlapping another, together the size given and at least the
+    minimum the controller asked for. With Memory Return, the chunks
+    must be those it had before, each still starting with the stamp it
+    left there.
+
+--*/
+{
+    ULONG               pages = Command->u.GENERAL.CDW12;
+    ULONGLONG           list = ((ULONGLONG)Command->u.GENERAL.CDW14 << 32) |
+                               Command->u.GENERAL.CDW13;
+    ULONG               count = Command->u.GENERAL.CDW15;
+    PUCHAR              descriptor = (PUCHAR)(ULONG_PTR)list;
+    ULONGLONG           total = 0;
+    ULONG               i, j;
+
+    if (list == 0 || (list & 0xF) != 0 || count == 0 || count > EMU_HMB_MAX_CHUNKS ||
+        (ULONGLONG)pages * EMU_HMB_UNIT < Controller->Config.HmbSize) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    for (i = 0; i < count; i++) {
+        Chunks[i].Address = *(PULONGLONG)(descriptor + i * EMU_HMB_DESCRIPTOR_SIZE);
+        Chunks[i].Pages = *(PULONG)(descriptor + i * EMU_HMB_DESCRIPTOR_SIZE + 8);
+        if (Chunks[i].Pages == 0 || (Chunks[i].Address & (EMU_HMB_UNIT - 1)) != 0) {
+            return EMU_STATUS_INVALID_FIELD;
+        }
+        for (j = 0; j < i; j++) {
+            if (Chunks[i].Address < Chunks[j].Address + Chunks[j].Pages * EMU_HMB_UNIT &&
+                Chunks[j].Address < Chunks[i].Address + Chunks[i].Pages * EMU_HMB_UNIT) {
+                return EMU_STATUS_INVALID_FIELD;
+            }
+        }
+        total += Chunks[i].Pages;
+    }
+
+    if (total != pages) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    if (Command->u.GENERAL.CDW11 & EMU_HMB_MEMORY_RETURN) {
+        if (count != Controller->HmbChunkCount || pages != Controller->HmbPages ||
+            !RtlEqualMemory(Chunks, Controller->HmbChunks, count * sizeof(EMU_HMB_CHUNK))) {
+            return EMU_STATUS_INVALID_FIELD;
+        }
+        for (i = 0; i < count; i++) {
+            if (*(PULONGLONG)(ULONG_PTR)Chunks[i].Address != (EMU_HMB_STAMP ^ Chunks[i].Address)) {
+                return EMU_STATUS_INVALID_FIELD;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static
+USHORT
+EmuSetHostMemoryBuffer(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+/*++
+Routine Description:
+
+    Set Features, Host Memory Buffer: takes the chunks of the descriptor
+    list and stamps them, or gives them back. Enabling a buffer that is
+    enabled is a command sequence error.
+
+--*/
+{
+    EMU_HMB_CHUNK chunks[EMU_HMB_MAX_CHUNKS];
+    ULONG         flags = Command->u.GENERAL.CDW11;
+    ULONG         i;
+    USHORT        status = 0;
+
+    ShimAcquireRawLock(&Controller->HmbLock);
+
+    if (flags & EMU_HMB_ENABLE) {
+        if (Controller->HmbEnabled) {
+            status = EMU_STATUS_COMMAND_SEQUENCE_ERROR;
+        } else {
+            status = EmuCheckHostMemoryBuffer(Controller, Command, chunks);
+        }
+        EmuLogHostMemoryBuffer(Controller, flags, status,
+                               Command->u.GENERAL.CDW12, Command->u.GENERAL.CDW15);
+        if (status == 0) {
+            Controller->HmbChunkCount = Command->u.GENERAL.CDW15;
+            Controller->HmbPages = Command->u.GENERAL.CDW12;
+            RtlCopyMemory(Controller->HmbChunks, chunks,
+                          Controller->HmbChunkCount * sizeof(EMU_HMB_CHUNK));
+            for (i = 0; i < Controller->HmbChunkCount; i++) {
+                *(PULONGLONG)(ULONG_PTR)chunks[i].Address = EMU_HMB_STAMP ^ chunks[i].Address;
+            }
+            Controller->HmbEnabled = TRUE;
+        }
+    } else {
+        EmuLogHostMemoryBuffer(Controller, flags, 0, 0, 0);
+        Controller->HmbEnabled = FALSE;
+    }
+
+    ShimReleaseRawLock(&Controller->HmbLock);
+
+    return status;
+}
+
+static
+USHORT
+EmuDownloadFirmware(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+/*++
+Routine Description:
+
+    Runs a Firmware Image Download: copies its piece of the image, at an
+    offset of the update granularity, into the image being put together.
+    With a firmware delay, this is once the delay has passed.
+
+--*/
+{
+    EMU_SEGMENT segments[EMU_MAX_SEGMENTS];
+    ULONGLONG   length = ((ULONGLONG)Command->u.GENERAL.CDW10 + 1) * sizeof(ULONG);
+    ULONGLONG   offset = (ULONGLONG)Command->u.GENERAL.CDW11 * sizeof(ULONG);
+    PUCHAR      image;
+    ULONG       count, i;
+
+    if (Controller->FirmwareImage == NULL) {
+        return EMU_STATUS_INVALID_OPCODE;
+    }
+    if (offset % EMU_FIRMWARE_GRANULARITY != 0 ||
+        offset + length > Controller->Config.FirmwareSize) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+    count = EmuWalkPrps(Command, (ULONG)length, segments);
+    if (count == 0) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    ShimAcquireRawLock(&Controller->FirmwareLock);
+
+    image = Controller->FirmwareImage + offset;
+    for (i = 0; i < count; i++) {
+        RtlCopyMemory(image, segments[i].Buffer, segments[i].Length);
+        image += segments[i].Length;
+    }
+    Controller->FirmwareReceived += (ULONG)length;
+    Controller->FirmwareEnd = max(Controller->FirmwareEnd, (ULONG)(offset + length));
+
+    ShimReleaseRawLock(&Controller->FirmwareLock);
+
+    return 0;
+}
+
+static
+USHORT
+EmuCommitFirmware(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+/*++
+Routine Description:
+
+    Runs a Firmware Commit. The image downloaded since the last commit
+    goes to the slot, the first if the command leaves the choice to the
+    controller, if every byte of it came exactly once; activating the
+    image a slot has needs no download. Activation itself is not
+    modelled: every action succeeds without asking for a reset.
+
+--*/
+{
+    ULONG  slot = Command->u.GENERAL.CDW10 & EMU_COMMIT_SLOT_MASK;
+    ULONG  action = (Command->u.GENERAL.CDW10 >> EMU_COMMIT_ACTION_SHIFT) & 0x7;
+    USHORT status = 0;
+
+    if (Controller->FirmwareImage == NULL) {
+        return EMU_STATUS_INVALID_OPCODE;
+    }
+    if (slot > EMU_FIRMWARE_SLOTS || action > 3) {
+        return EMU_STATUS_INVALID_FIRMWARE_SLOT;
+    }
+
+    ShimAcquireRawLock(&Controller->FirmwareLock);
+
+    if (action == EMU_COMMIT_ACTIVATE) {
+        if (slot != Controller->FirmwareSlot) {
+            status = EMU_STATUS_INVALID_FIRMWARE_SLOT;
+        }
+    } else if (Controller->FirmwareEnd == 0 ||
+               Controller->FirmwareReceived != Controller->FirmwareEnd) {
+        status = EMU_STATUS_INVALID_FIRMWARE_IMAGE;
+    } else {
+        Controller->FirmwareSlot = slot != 0 ? slot : 1;
+        Controller->FirmwareLength = Controller->FirmwareEnd;
+    }
+    Controller->FirmwareReceived = 0;
+    Controller->FirmwareEnd = 0;
+
+    ShimReleaseRawLock(&Controller->FirmwareLock);
+
+    return status;
+}
+
+static
+USHORT
+EmuRunAdminCommand(
+    __in  PEMU_CONTROLLER Controller,
+    __in  PNVME_COMMAND   Command,
+    __out PULONG          Dw0
+    )
+/*++
+Routine Description:
+
+    Runs an admin command, with the admin submission queue lock held.
+
+Return Value:
+
+    The status to complete the command with, or EMU_NO_STATUS if it is
+    held without a completion for now
+
+--*/
+{
+    USHORT     queueId = (USHORT)(Command->u.GENERAL.CDW10 & 0xFFFF);
+    ULONG      granted;
+    PEMU_QUEUE queue;
+
+    switch (Command->CDW0.OPC) {
+
+    case NVME_ADMIN_COMMAND_CREATE_IO_CQ:
+        return EmuCreateCompletionQueue(Controller, Command);
+
+    case NVME_ADMIN_COMMAND_CREATE_IO_SQ:
+        return EmuCreateSubmissionQueue(Controller, Command);
+
+    case NVME_ADMIN_COMMAND_DELETE_IO_SQ:
+        if (queueId == 0 || queueId > Controller->Config.MaxQueues ||
+            !Controller->Queues[queueId].SubmissionValid) {
+            return EMU_STATUS_INVALID_QUEUE_ID;
+        }
+        queue = &Controller->Queues[queueId];
+        ShimAcquireRawLock(&queue->SubmissionLock);
+        queue->SubmissionValid = FALSE;
+        ShimReleaseRawLock(&queue->SubmissionLock);
+        EmuSyncArbiter(Controller);
+        EmuDiscardDelayedCommands(Controller, queueId);
+        return 0;
+
+    case NVME_ADMIN_COMMAND_DELETE_IO_CQ:
+        if (queueId == 0 || queueId > Controller->Config.MaxQueues ||
+            !Controller->Queues[queueId].CompletionValid) {
+            return EMU_STATUS_INVALID_QUEUE_ID;
+        }
+        queue = &Controller->Queues[queueId];
+        ShimAcquireRawLock(&queue->CompletionLock);
+        queue->CompletionValid = FALSE;
+        ShimReleaseRawLock(&queue->CompletionLock);
+        return 0;
+
+    case NVME_ADMIN_COMMAND_IDENTIFY:
+        return EmuIdentify(Controller, Command);
+
+    case NVME_ADMIN_COMMAND_GET_LOG_PAGE:
+        return EmuGetLogPage(Controller, Command);
+
+    case NVME_ADMIN_COMMAND_SET_FEATURES:
+        switch (Command->u.GENERAL.CDW10 & 0xFF) {
+        case NVME_FEATURE_NUMBER_OF_QUEUES:
+            granted = Controller->Config.MaxQueues - 1;
+            *Dw0 = (granted << 16) | granted;
+            return 0;
+        case NVME_FEATURE_ARBITRATION:
+            ShimAcquireRawLock(&Controller->ArbiterLock);
+            Controller->ArbiterWeights[0] = (USHORT)((Command->u.GENERAL.CDW11 >> 24) + 1);
+            Controller->ArbiterWeights[1] = (USHORT)(((Command->u.GENERAL.CDW11 >> 16) & 0xFF) + 1);
+            Controller->ArbiterWeights[2] = (USHORT)(((Command->u.GENERAL.CDW11 >> 8) & 0xFF) + 1);
+            ShimReleaseRawLock(&Controller->ArbiterLock);
+            return 0;
+        case NVME_FEATURE_ASYNC_EVENT_CONFIG:
+            return 0;
+        case NVME_FEATURE_HOST_MEMORY_BUFFER:
+            return EmuSetHostMemoryBuffer(Controller, Command);
+        default:
+            return EMU_STATUS_INVALID_FIELD;
+        }
+
+    case NVME_ADMIN_COMMAND_ASYNC_EVENT_REQUEST:
+        if (Controller->AsyncEventCount == EMU_MAX_ASYNC_EVENTS) {
+            return EMU_STATUS_AER_LIMIT_EXCEEDED;
+        }
+        Controller->AsyncEvents[Controller->AsyncEventCount++] = (USHORT)Command->CDW0.CID;
+        return EMU_NO_STATUS;
+
+    case EMU_ADMIN_COMMAND_DOORBELL_BUFFER_CONFIG:
+        if (!Controller->Config.ShadowDoorbells) {
+            return EMU_STATUS_INVALID_OPCODE;
+        }
+        if (Command->PRP1 == 0 || Command->PRP2 == 0 ||
+            ((Command->PRP1 | Command->PRP2) & (PAGE_SIZE - 1)) != 0) {
+            return EMU_STATUS_INVALID_FIELD;
+        }
+        __atomic_store_n(&Controller->EventIndexes,
+                         (volatile ULONG *)(ULONG_PTR)Command->PRP2, __ATOMIC_RELEASE);
+        __atomic_store_n(&Controller->ShadowDoorbells,
+                         (volatile ULONG *)(ULONG_PTR)Command->PRP1, __ATOMIC_RELEASE);
+        return 0;
+
+    case NVME_ADMIN_COMMAND_FIRMWARE_IMAGE_DOWNLOAD:
+        return EmuDownloadFirmware(Controller, Command);
+
+    case NVME_ADMIN_COMMAND_FIRMWARE_COMMIT:
+        return EmuCommitFirmware(Controller, Command);
+
+    case NVME_ADMIN_COMMAND_ABORT:
+        //
+        // Only a delayed command can be aborted; the others completed
+        // as they were submitted, or were dropped. Bit 0 of DW0 set
+        // tells that the command was not aborted.
+        //
+        __atomic_add_fetch(&Controller->AbortCommands, 1, __ATOMIC_RELAXED);
+        *Dw0 = EmuAbortDelayedCommand(Controller, queueId,
+                                      (USHORT)(Command->u.GENERAL.CDW10 >> 16)) ? 0 : 1;
+        return 0;
+
+    default:
+        return EMU_STATUS_INVALID_OPCODE;
+    }
+}
+
+
+//
+// I/O commands
+//
+
+static
+VOID
+EmuAccessTransfer(
+    __in    PEMU_SEGMENT Segments,
+    __in    ULONG        Offset,
+    __inout PULONGLONG   Value,
+    __in    BOOLEAN      Store
+    )
+/*++
+Routine Description:
+
+    Reads or writes the eight bytes at Offset into a transfer, which may
+    straddle two segments.
+
+--*/
+{
+    PUCHAR bytes = (PUCHAR)Value;
+    ULONG  i;
+
+    for (i = 0; i < sizeof(ULONGLONG); i++, Offset++) {
+        while (Offset >= Segments->Length) {
+            Offset -= Segments->Length;
+            Segments++;
+        }
+        if (Store) {
+            Segments->Buffer[Offset] = bytes[i];
+        } else {
+            bytes[i] = Segments->Buffer[Offset];
+        }
+    }
+}
+
+static
+USHORT
+EmuWriteZone(
+    __in    PEMU_CONTROLLER Controller,
+    __in    BOOLEAN         Append,
+    __inout PULONGLONG      Lba,
+    __in    ULONG           Blocks
+    )
+/*++
+Routine Description:
+
+    Moves the write pointer of a zone past a write, which must start at
+    it, or past a Zone Append, which names the start of the zone and
+    goes wherever the write pointer is; Lba is then set to that. Writes
+    open a zone that is not, and fill it up.
+
+--*/
+{
+    ULONGLONG zoneStart = *Lba - *Lba % Controller->Config.ZoneBlocks;
+    PEMU_ZONE zone = &Controller->Zones[*Lba / Controller->Config.ZoneBlocks];
+    USHORT    status = 0;
+
+    ShimAcquireRawLock(&Controller->ZoneLock);
+
+    switch (zone->State) {
+    case EMU_ZONE_FULL:
+        status = EMU_STATUS_ZONE_FULL;
+        break;
+    case EMU_ZONE_READ_ONLY:
+        status = EMU_STATUS_ZONE_READ_ONLY;
+        break;
+    case EMU_ZONE_OFFLINE:
+        status = EMU_STATUS_ZONE_OFFLINE;
+        break;
+    default:
+        if (Append && *Lba != zoneStart) {
+            status = EMU_STATUS_INVALID_FIELD;
+        } else if (!Append && *Lba != zone->WritePointer) {
+            status = EMU_STATUS_ZONE_INVALID_WRITE;
+        } else if (Blocks > zoneStart + Controller->Config.ZoneBlocks - zone->WritePointer) {
+            status = EMU_STATUS_ZONE_BOUNDARY_ERROR;
+        }
+        break;
+    }
+
+    if (status == 0) {
+        *Lba = zone->WritePointer;
+        zone->WritePointer += Blocks;
+        if (zone->WritePointer == zoneStart + Controller->Config.ZoneBlocks) {
+            zone->State = EMU_ZONE_FULL;
+        } else if (zone->State != EMU_ZONE_EXPLICITLY_OPEN) {
+            zone->State = EMU_ZONE_IMPLICITLY_OPEN;
+        }
+    }
+
+    ShimReleaseRawLock(&Controller->ZoneLock);
+
+    if (status != 0) {
+        __atomic_add_fetch(&Controller->ZoneErrors, 1, __ATOMIC_RELAXED);
+    }
+
+    return status;
+}
+
+static
+BOOLEAN
+EmuChangeZone(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONGLONG       Index,
+    __in ULONG           Action
+    )
+/*++
+Routine Description:
+
+    Applies a Zone Send Action to a zone, with the zone lock held.
+
+Return Value:
+
+    FALSE if the zone is in a state the action does not apply to
+
+--*/
+{
+    PEMU_ZONE zone = &Controller->Zones[Index];
+    ULONGLONG start = Index * Controller->Config.ZoneBlocks;
+    UCHAR     state = zone->State;
+
+    switch (Action) {
+
+    case EMU_ZONE_CLOSE:
+        if (state == EMU_ZONE_CLOSED) {
+            return TRUE;
+        }
+        if (state != EMU_ZONE_IMPLICITLY_OPEN && state != EMU_ZONE_EXPLICITLY_OPEN) {
+            return FALSE;
+        }
+        zone->State = zone->WritePointer == start ? EMU_ZONE_EMPTY : EMU_ZONE_CLOSED;
+        return TRUE;
+
+    case EMU_ZONE_FINISH:
+        if (state == EMU_ZONE_READ_ONLY || state == EMU_ZONE_OFFLINE) {
+            return FALSE;
+        }
+        zone->State = EMU_ZONE_FULL;
+        zone->WritePointer = start + Controller->Config.ZoneBlocks;
+        return TRUE;
+
+    case EMU_ZONE_OPEN:
+        if (state == EMU_ZONE_FULL || state == EMU_ZONE_READ_ONLY ||
+            state == EMU_ZONE_OFFLINE) {
+            return FALSE;
+        }
+        zone->State = EMU_ZONE_EXPLICITLY_OPEN;
+        return TRUE;
+
+    case EMU_ZONE_RESET:
+        if (state == EMU_ZONE_READ_ONLY || state == EMU_ZONE_OFFLINE) {
+            return FALSE;
+        }
+        zone->State = EMU_ZONE_EMPTY;
+        zone->WritePointer = start;
+        return TRUE;
+
+    case EMU_ZONE_SET_OFFLINE:
+        if (state != EMU_ZONE_READ_ONLY && state != EMU_ZONE_OFFLINE) {
+            return FALSE;
+        }
+        zone->State = EMU_ZONE_OFFLINE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static
+USHORT
+EmuManageZones(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+/*++
+Routine Description:
+
+    Zone Management Send: an action on the zone starting at the SLBA, or
+    with Select All on every zone it applies to.
+
+--*/
+{
+    ULONGLONG lba = ((ULONGLONG)Command->u.GENERAL.CDW11 << 32) | Command->u.GENERAL.CDW10;
+    ULONG     action = Command->u.GENERAL.CDW13 & 0xFF;
+    ULONGLONG i;
+    USHORT    status = 0;
+
+    if (action < EMU_ZONE_CLOSE || action > EMU_ZONE_SET_OFFLINE) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    if (Command->u.GENERAL.CDW13 & EMU_ZONE_SELECT_ALL) {
+        ShimAcquireRawLock(&Controller->ZoneLock);
+        for (i = 0; i < Controller->ZoneCount; i++) {
+            if (Controller->Zones[i].State != EMU_ZONE_EMPTY || action == EMU_ZONE_OPEN) {
+                EmuChangeZone(Controller, i, action);
+            }
+        }
+        ShimReleaseRawLock(&Controller->ZoneLock);
+        return 0;
+    }
+
+    if (lba >= Controller->Config.Blocks || lba % Controller->Config.ZoneBlocks != 0) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    ShimAcquireRawLock(&Controller->ZoneLock);
+    if (!EmuChangeZone(Controller, lba / Controller->Config.ZoneBlocks, action)) {
+        status = EMU_STATUS_ZONE_INVALID_TRANSITION;
+    }
+    ShimReleaseRawLock(&Controller->ZoneLock);
+
+    return status;
+}
+
+static
+USHORT
+EmuReportZones(
+    __in PEMU_CONTROLLER Controller,
+    __in PNVME_COMMAND   Command
+    )
+/*++
+Routine Description:
+
+    Zone Management Receive, Report Zones: a header with the number of
+    zones from the one holding the SLBA on that are in the state asked
+    for, or with Partial Report of those whose descriptors fit, then the
+    descriptors.
+
+--*/
+{
+    static const UCHAR States[] = {
+        0, EMU_ZONE_EMPTY, EMU_ZONE_IMPLICITLY_OPEN, EMU_ZONE_EXPLICITLY_OPEN,
+        EMU_ZONE_CLOSED, EMU_ZONE_FULL, EMU_ZONE_READ_ONLY, EMU_ZONE_OFFLINE,
+    };
+    ULONGLONG lba = ((ULONGLONG)Command->u.GENERAL.CDW11 << 32) | Command->u.GENERAL.CDW10;
+    ULONG     length = (Command->u.GENERAL.CDW12 + 1) * sizeof(ULONG);
+    ULONG     filter = (Command->u.GENERAL.CDW13 >> 8) & 0xFF;
+    ULONGLONG matching = 0, i;
+    ULONG     fit, returned = 0;
+    PUCHAR    data, descriptor;
+    USHORT    status = 0;
+
+    if ((Command->u.GENERAL.CDW13 & 0xFF) != 0 || filter >= ARRAYSIZE(States) ||
+        length < EMU_ZONE_DESCRIPTOR_SIZE ||
+        length > EMU_MAX_SEGMENTS * PAGE_SIZE) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+    if (lba >= Controller->Config.Blocks) {
+        return EMU_STATUS_LBA_OUT_OF_RANGE;
+    }
+
+    data = ExAllocatePoolWithTag(NonPagedPool, length, EMU_POOL_TAG);
+    if (data == NULL) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+    RtlZeroMemory(data, length);
+    fit = length / EMU_ZONE_DESCRIPTOR_SIZE - 1;
+
+    ShimAcquireRawLock(&Controller->ZoneLock);
+    for (i = lba / Controller->Config.ZoneBlocks; i < Controller->ZoneCount; i++) {
+        if (filter != 0 && Controller->Zones[i].State != States[filter]) {
+            continue;
+        }
+        matching++;
+        if (returned < fit) {
+            descriptor = data + (returned + 1) * EMU_ZONE_DESCRIPTOR_SIZE;
+            descriptor[0] = EMU_ZONE_TYPE_SEQUENTIAL;
+            descriptor[1] = (UCHAR)(Controller->Zones[i].State << 4);
+            *(PULONGLONG)(descriptor + 8) = Controller->Config.ZoneBlocks;
+            *(PULONGLONG)(descriptor + 16) = i * Controller->Config.ZoneBlocks;
+            *(PULONGLONG)(descriptor + 24) = Controller->Zones[i].WritePointer;
+            returned++;
+        }
+    }
+    ShimReleaseRawLock(&Controller->ZoneLock);
+
+    *(PULONGLONG)data = (Command->u.GENERAL.CDW13 & EMU_ZONE_PARTIAL_REPORT) ? returned : matching;
+
+    if (!EmuCopyToHost(Command, data, length)) {
+        status = EMU_STATUS_INVALID_FIELD;
+    }
+
+    ExFreePoolWithTag(data, EMU_POOL_TAG);
+
+    return status;
+}
+
+static
+USHORT
+EmuRunIoCommand(
+    __in  PEMU_CONTROLLER Controller,
+    __in  PNVME_COMMAND   Command,
+    __out PULONGLONG      Result
+    )
+/*++
+Routine Description:
+
+    Runs an I/O command. Result receives what the completion carries in
+    DW0 and DW1: the LBA a Zone Append went to.
+
+--*/
+{
+    ULONGLONG   lba;
+    ULONG       blocks, length, i, count;
+    ULONGLONG   stamp;
+    USHORT      status;
+    EMU_SEGMENT segments[EMU_MAX_SEGMENTS];
+
+    *Result = 0;
+
+    switch (Command->CDW0.OPC) {
+
+    case NVME_NVM_COMMAND_FLUSH:
+        return 0;
+
+    case NVME_NVM_COMMAND_READ:
+    case NVME_NVM_COMMAND_WRITE:
+        break;
+
+    case EMU_NVM_COMMAND_ZONE_APPEND:
+    case EMU_NVM_COMMAND_ZONE_MGMT_SEND:
+    case EMU_NVM_COMMAND_ZONE_MGMT_RECEIVE:
+        if (Controller->Zones == NULL) {
+            return EMU_STATUS_INVALID_OPCODE;
+        }
+        break;
+
+    default:
+        return EMU_STATUS_INVALID_OPCODE;
+    }
+
+    if (Command->NSID != 1) {
+        return EMU_STATUS_INVALID_NAMESPACE;
+    }
+
+    if (Command->CDW0.OPC == EMU_NVM_COMMAND_ZONE_MGMT_SEND) {
+        return EmuManageZones(Controller, Command);
+    }
+    if (Command->CDW0.OPC == EMU_NVM_COMMAND_ZONE_MGMT_RECEIVE) {
+        return EmuReportZones(Controller, Command);
+    }
+
+    lba = ((ULONGLONG)Command->u.GENERAL.CDW11 << 32) | Command->u.GENERAL.CDW10;
+    blocks = (Command->u.GENERAL.CDW12 & 0xFFFF) + 1;
+    if (lba >= Controller->Config.Blocks || blocks > Controller->Config.Blocks - lba) {
+        return EMU_STATUS_LBA_OUT_OF_RANGE;
+    }
+
+    if (Controller->Zones != NULL && Command->CDW0.OPC != NVME_NVM_COMMAND_READ) {
+        status = EmuWriteZone(Controller,
+                              (BOOLEAN)(Command->CDW0.OPC == EMU_NVM_COMMAND_ZONE_APPEND),
+                              &lba,
+                              blocks);
+        if (status != 0) {
+            return status;
+        }
+        if (Command->CDW0.OPC == EMU_NVM_COMMAND_ZONE_APPEND) {
+            *Result = lba;
+        }
+    }
+
+    if (!Controller->Config.MoveData && Controller->Config.ProtectionType == 0) {
+        return 0;
+    }
+
+    length = blocks << Controller->Config.LbaShift;
+    count = EmuWalkPrps(Command, length, segments);
+    if (count == 0) {
+        return EMU_STATUS_INVALID_FIELD;
+    }
+
+    //
+    // A read returns the PI of what the host buffer holds once the data
+    // is in it, so the stamps go first. The host does not know where a
+    // Zone Append goes, so it cannot stamp the data.
+    //
+    for (i = 0; i < blocks && Controller->Config.MoveData &&
+                Command->CDW0.OPC != EMU_NVM_COMMAND_ZONE_APPEND; i++) {
+        if (Command->CDW0.OPC == NVME_NVM_COMMAND_READ) {
+            stamp = lba + i;
+            EmuAccessTransfer(segments, i << Controller->Config.LbaShift, &stamp, TRUE);
+        } else {
+            EmuAccessTransfer(segments, i << Controller->Config.LbaShift, &stamp, FALSE);
+            if (stamp != lba + i) {
+                __atomic_add_fetch(&Controller->DataErrors, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    if (Controller->Config.ProtectionType != 0) {
+        return EmuProtectTransfer(Controller, Command, segments, blocks);
+    }
+
+    return 0;
+}
+
+
+//
+// Registers
+//
+
+static
+VOID
+EmuRingSubmissionDoorbell(
+    __in PEMU_CONTROLLER Controller,
+    __in USHORT          QueueId,
+    __in ULONG           Tail
+    )
+/*++
+Routine Description:
+
+    Runs the commands between the head of a submission queue and the new
+    tail, posting each completion with the head just past the command;
+    or leaves I/O commands to the completion thread, or drops them. With
+    a service time, the I/O commands wait on the queue for the arbiter
+    thread instead. With shadow doorbells the write only tells the
+    controller to read the shadow tail, which may have moved on since,
+    and the controller reads it again once it has caught up.
+
+--*/
+{
+    PEMU_QUEUE    queue = &Controller->Queues[QueueId];
+    NVME_COMMAND  command;
+    USHORT        status;
+    ULONG         dw0;
+    ULONGLONG     result;
+    ULONG         entries;
+    USHORT        shadow = 0;
+    BOOLEAN       shadowed;
+
+    ShimAcquireRawLock(&queue->SubmissionLock);
+
+    shadowed = EmuReadShadowDoorbell(Controller, 2 * QueueId, &shadow);
+    if (shadowed) {
+        Tail = shadow;
+    }
+
+    if (!queue->SubmissionValid || Tail >= queue->SubmissionSize) {
+        ShimReleaseRawLock(&queue->SubmissionLock);
+        return;
+    }
+
+    entries = (Tail + queue->SubmissionSize - queue->SubmissionHead) % queue->SubmissionSize;
+    EmuChargeRemoteAccess(Controller, &Controller->RemoteHostAccesses,
+                          ShimQueryCurrentNode(), queue->SubmissionNode, entries);
+    EmuChargeFetch(Controller, queue, entries);
+
+    if (QueueId != 0 && Controller->ArbiterThreadStarted) {
+        __atomic_store_n(&queue->SubmissionTail, (USHORT)Tail, __ATOMIC_RELEASE);
+        ShimReleaseRawLock(&queue->SubmissionLock);
+        __atomic_add_fetch(&Controller->ArbiterSequence, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&Controller->ArbiterWaiting, __ATOMIC_SEQ_CST)) {
+            EmuFutexWake(&Controller->ArbiterSequence);
+        }
+        return;
+    }
+
+    for (;;) {
+
+        while (queue->SubmissionHead != Tail) {
+
+            command = queue->SubmissionQueue[queue->SubmissionHead];
+            __atomic_store_n(&queue->SubmissionHead,
+                             (USHORT)((queue->SubmissionHead + 1) % queue->SubmissionSize),
+                             __ATOMIC_RELEASE);
+
+            __atomic_add_fetch(&Controller->Commands, 1, __ATOMIC_RELAXED);
+
+            dw0 = 0;
+            if (QueueId == 0 && Controller->Config.FirmwareDelay != 0 &&
+                command.CDW0.OPC == NVME_ADMIN_COMMAND_FIRMWARE_IMAGE_DOWNLOAD) {
+                EmuDelayCommand(Controller, &command, 0, 0, Controller->Config.FirmwareDelay);
+                continue;
+            } else if (QueueId == 0) {
+                status = EmuRunAdminCommand(Controller, &command, &dw0);
+                result = dw0;
+            } else if (EmuDropCommand(Controller)) {
+                continue;
+            } else if (Controller->Config.CompletionDelay != 0) {
+                EmuDelayCommand(Controller, &command, queue->CompletionQueueId, QueueId,
+                                Controller->Config.CompletionDelay);
+                continue;
+            } else {
+                status = EmuRunIoCommand(Controller, &command, &result);
+            }
+
+            if (status == EMU_NO_STATUS) {
+                continue;
+            }
+
+            EmuPostCompletion(Controller,
+                              queue->CompletionQueueId,
+                              QueueId,
+                              (USHORT)command.CDW0.CID,
+                              status,
+                              result);
+        }
+
+        //
+        // Caught up: a tail doorbell write past this tail wakes the
+        // controller again, unless the host moved the shadow meanwhile.
+        //
+        if (!shadowed) {
+            break;
+        }
+        EmuWriteEventIndex(Controller, 2 * QueueId, (USHORT)Tail);
+        if (!EmuReadShadowDoorbell(Controller, 2 * QueueId, &shadow) ||
+            shadow == Tail || shadow >= queue->SubmissionSize) {
+            break;
+        }
+        EmuChargeFetch(Controller, queue,
+                       (shadow + queue->SubmissionSize - Tail) % queue->SubmissionSize);
+        Tail = shadow;
+    }
+
+    ShimReleaseRawLock(&queue->SubmissionLock);
+
+    EmuSignalInterrupt(Controller);
+}
+
+static
+VOID
+EmuEnable(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    CC.EN going to 1: the admin queues come from AQA, ASQ and ACQ. The
+    controller is ready right away, or once the ready delay has passed,
+    as the next read of CSTS after that tells.
+
+--*/
+{
+    PNVME_CONTROLLER_REGISTERS registers = Controller->Registers;
+    PEMU_QUEUE                 admin = &Controller->Queues[0];
+
+    ShimAcquireRawLock(&admin->SubmissionLock);
+    admin->SubmissionQueue = (PNVME_COMMAND)(ULONG_PTR)(registers->ASQ.AsUlonglong & ~(ULONGLONG)(PAGE_SIZE - 1));
+    admin->SubmissionSize = (USHORT)(registers->AQA.ASQS + 1);
+    admin->SubmissionHead = 0;
+    admin->CompletionQueueId = 0;
+    admin->SubmissionValid = TRUE;
+    Controller->AsyncEventCount = 0;
+    ShimReleaseRawLock(&admin->SubmissionLock);
+
+    EmuResetArbitration(Controller);
+
+    ShimAcquireRawLock(&admin->CompletionLock);
+    admin->CompletionQueue = (PNVME_COMPLETION_ENTRY)(ULONG_PTR)(registers->ACQ.AsUlonglong & ~(ULONGLONG)(PAGE_SIZE - 1));
+    admin->CompletionSize = (USHORT)(registers->AQA.ACQS + 1);
+    admin->CompletionTail = 0;
+    admin->CompletionHead = 0;
+    admin->CompletionPhase = 1;
+    admin->HeldFirst = 0;
+    admin->HeldCount = 0;
+    admin->InterruptsEnabled = TRUE;
+    admin->CompletionValid = TRUE;
+    ShimReleaseRawLock(&admin->CompletionLock);
+
+    if (Controller->Config.ReadyDelay != 0) {
+        __atomic_store_n(&Controller->ReadyTime,
+                         KeQueryInterruptTime() + Controller->Config.ReadyDelay * 10000ULL,
+                         __ATOMIC_RELEASE);
+        return;
+    }
+
+    __atomic_store_n(&registers->CSTS.AsUlong, 1, __ATOMIC_RELEASE);
+}
+
+static
+VOID
+EmuReset(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    CC.EN going to 0: every queue is gone, with the commands held on
+    them and those still delayed, the shadow doorbells are forgotten
+    and the controller is not ready.
+
+--*/
+{
+    PEMU_QUEUE queue;
+    ULONG      i;
+
+    for (i = 0; i <= EMU_MAX_QUEUES; i++) {
+        queue = &Controller->Queues[i];
+        ShimAcquireRawLock(&queue->SubmissionLock);
+        queue->SubmissionValid = FALSE;
+        if (i == 0) {
+            Controller->AsyncEventCount = 0;
+        }
+        ShimReleaseRawLock(&queue->SubmissionLock);
+        ShimAcquireRawLock(&queue->CompletionLock);
+        queue->CompletionValid = FALSE;
+        queue->HeldCount = 0;
+        ShimReleaseRawLock(&queue->CompletionLock);
+    }
+    EmuSyncArbiter(Controller);
+    EmuDiscardDelayedCommands(Controller, 0);
+
+    __atomic_store_n(&Controller->ShadowDoorbells, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&Controller->EventIndexes, NULL, __ATOMIC_RELEASE);
+
+    ShimAcquireRawLock(&Controller->HmbLock);
+    EmuLogHostMemoryBuffer(Controller, EMU_HMB_RESET, 0, 0, 0);
+    Controller->HmbEnabled = FALSE;
+    ShimReleaseRawLock(&Controller->HmbLock);
+
+    __atomic_add_fetch(&Controller->Resets, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&Controller->ReadyTime, 0, __ATOMIC_RELEASE);
+    Controller->InterruptMask = 0;
+
+    __atomic_store_n(&Controller->Registers->CSTS.AsUlong, 0, __ATOMIC_RELEASE);
+}
+
+static
+VOID
+EmuWriteConfiguration(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Value
+    )
+{
+    NVME_CONTROLLER_CONFIGURATION old, cc;
+    NVME_CONTROLLER_STATUS        csts;
+
+    old.AsUlong = Controller->Registers->CC.AsUlong;
+    cc.AsUlong = Value;
+    Controller->Registers->CC.AsUlong = Value;
+
+    if (cc.EN && !old.EN) {
+        EmuEnable(Controller);
+    } else if (!cc.EN && old.EN) {
+        EmuReset(Controller);
+    }
+
+    if (cc.SHN != 0) {
+        csts.AsUlong = Controller->Registers->CSTS.AsUlong;
+        csts.SHST = 2;
+        __atomic_store_n(&Controller->Registers->CSTS.AsUlong, csts.AsUlong, __ATOMIC_RELEASE);
+    }
+}
+
+static
+PEMU_CONTROLLER
+EmuFindController(
+    __in volatile VOID *Register
+    )
+/*++
+Routine Description:
+
+    Returns the controller whose register block holds an address, or
+    NULL for memory that is not a register.
+
+--*/
+{
+    PEMU_CONTROLLER controller = EmuLastController;
+    LONG            generation = __atomic_load_n(&Emu.Generation, __ATOMIC_ACQUIRE);
+    ULONG           i;
+
+    if (controller != NULL && EmuLastGeneration == generation &&
+        (ULONG_PTR)Register - (ULONG_PTR)controller->Registers < controller->RegisterLength) {
+        return controller;
+    }
+
+    for (i = 0; i < EMU_MAX_CONTROLLERS; i++) {
+        controller = __atomic_load_n(&Emu.Controllers[i], __ATOMIC_ACQUIRE);
+        if (controller != NULL &&
+            (ULONG_PTR)Register - (ULONG_PTR)controller->Registers < controller->RegisterLength) {
+            EmuLastController = controller;
+            EmuLastGeneration = generation;
+            return controller;
+        }
+    }
+
+    return NULL;
+}
+
+ULONG
+READ_REGISTER_ULONG(
+    volatile ULONG *Register
+    )
+{
+    PEMU_CONTROLLER controller = EmuFindController(Register);
+    ULONG_PTR       offset;
+    ULONGLONG       readyTime;
+
+    if (controller != NULL) {
+        offset = (ULONG_PTR)Register - (ULONG_PTR)controller->Registers;
+        if (offset == FIELD_OFFSET(NVME_CONTROLLER_REGISTERS, INTMS) ||
+            offset == FIELD_OFFSET(NVME_CONTROLLER_REGISTERS, INTMC)) {
+            return __atomic_load_n(&controller->InterruptMask, __ATOMIC_ACQUIRE);
+        }
+        if (offset == FIELD_OFFSET(NVME_CONTROLLER_REGISTERS, CSTS)) {
+            readyTime = __atomic_load_n(&controller->ReadyTime, __ATOMIC_ACQUIRE);
+            if (readyTime != 0 && KeQueryInterruptTime() >= readyTime &&
+                __atomic_compare_exchange_n(&controller->ReadyTime, &readyTime, 0, FALSE,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                __atomic_or_fetch(&controller->Registers->CSTS.AsUlong, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    return __atomic_load_n(Register, __ATOMIC_ACQUIRE);
+}
+
+VOID
+WRITE_REGISTER_ULONG(
+    volatile ULONG *Register,
+    ULONG           Value
+    )
+{
+    PEMU_CONTROLLER controller = EmuFindController(Register);
+    ULONG_PTR       offset;
+    ULONG           index;
+    USHORT          queueId;
+
+    if (controller == NULL) {
+        *Register = Value;
+        return;
+    }
+
+    offset = (ULONG_PTR)Register - (ULONG_PTR)controller->Registers;
+    __atomic_add_fetch(&controller->MmioWrites, 1, __ATOMIC_RELAXED);
+
+    if (offset >= EMU_DOORBELL_OFFSET) {
+        index = (ULONG)(offset - EMU_DOORBELL_OFFSET) / sizeof(ULONG);
+        queueId = (USHORT)(index / 2);
+        if (queueId > controller->Config.MaxQueues) {
+            return;
+        }
+        if (index & 1) {
+            EmuUpdateCompletionHead(controller, queueId, (USHORT)Value);
+        } else {
+            EmuRingSubmissionDoorbell(controller, queueId, Value);
+        }
+        return;
+    }
+
+    switch (offset) {
+
+    case FIELD_OFFSET(NVME_CONTROLLER_REGISTERS, INTMS):
+        __atomic_or_fetch(&controller->InterruptMask, Value, __ATOMIC_SEQ_CST);
+        break;
+
+    case FIELD_OFFSET(NVME_CONTROLLER_REGISTERS, INTMC):
+        __atomic_and_fetch(&controller->InterruptMask, ~Value, __ATOMIC_SEQ_CST);
+        EmuSignalInterrupt(controller);
+        break;
+
+    case FIELD_OFFSET(NVME_CONTROLLER_REGISTERS, CC):
+        EmuWriteConfiguration(controller, Value);
+        break;
+
+    default:
+        *Register = Value;
+        break;
+    }
+}
+
+
+//
+// Interrupts
+//
+
+NTSTATUS
+IoConnectInterrupt(
+    PKINTERRUPT       *InterruptObject,
+    PKSERVICE_ROUTINE  ServiceRoutine,
+    PVOID              ServiceContext,
+    PKSPIN_LOCK        SpinLock,
+    ULONG              Vector,
+    KIRQL              Irql,
+    KIRQL              SynchronizeIrql,
+    KINTERRUPT_MODE    InterruptMode,
+    BOOLEAN            ShareVector,
+    KAFFINITY          ProcessorEnableMask,
+    BOOLEAN            FloatingSave
+    )
+/*++
+Routine Description:
+
+    Connects the vector of a controller, which is its index. A vector
+    has one service routine at a time.
+
+--*/
+{
+    PEMU_CONTROLLER controller;
+    PKINTERRUPT     interrupt;
+
+    UNREFERENCED_PARAMETER(SpinLock);
+    UNREFERENCED_PARAMETER(SynchronizeIrql);
+    UNREFERENCED_PARAMETER(InterruptMode);
+    UNREFERENCED_PARAMETER(ShareVector);
+    UNREFERENCED_PARAMETER(ProcessorEnableMask);
+    UNREFERENCED_PARAMETER(FloatingSave);
+
+    if (Vector >= EMU_MAX_CONTROLLERS || Irql != EMU_DEVICE_IRQL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    controller = Emu.Controllers[Vector];
+    if (controller == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    interrupt = ExAllocatePoolWithTag(NonPagedPool, sizeof(*interrupt), EMU_POOL_TAG);
+    if (interrupt == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    interrupt->ServiceRoutine = ServiceRoutine;
+    interrupt->ServiceContext = ServiceContext;
+    interrupt->Controller = controller;
+
+    ShimAcquireRawLock(&controller->InterruptLock);
+    if (controller->Interrupt != NULL) {
+        ShimReleaseRawLock(&controller->InterruptLock);
+        ExFreePoolWithTag(interrupt, EMU_POOL_TAG);
+        return STATUS_INVALID_PARAMETER;
+    }
+    __atomic_store_n(&controller->Interrupt, interrupt, __ATOMIC_RELEASE);
+    ShimReleaseRawLock(&controller->InterruptLock);
+
+    *InterruptObject = interrupt;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+IoDisconnectInterrupt(
+    PKINTERRUPT InterruptObject
+    )
+/*++
+Routine Description:
+
+    Disconnects a vector. The service routine is not running and will
+    not run once this returns.
+
+--*/
+{
+    PEMU_CONTROLLER controller = InterruptObject->Controller;
+
+    ShimAcquireRawLock(&controller->InterruptLock);
+    __atomic_store_n(&controller->Interrupt, NULL, __ATOMIC_RELEASE);
+    ShimReleaseRawLock(&controller->InterruptLock);
+
+    ExFreePoolWithTag(InterruptObject, EMU_POOL_TAG);
+}
+
+
+//
+// Controllers
+//
+
+PEMU_CONTROLLER
+EmuCreateController(
+    __in PEMU_CONFIG Config
+    )
+/*++
+Routine Description:
+
+    Creates a controller in the first free slot. Its register block
+    stands in for the mapped BAR; doorbells have no stride.
+
+--*/
+{
+    PEMU_CONTROLLER controller;
+    PNVME_CONTROLLER_REGISTERS registers;
+    ULONG           length;
+    ULONG           i;
+
+    ASSERT(Config->MaxQueues != 0 && Config->MaxQueues <= EMU_MAX_QUEUES);
+
+    controller = ExAllocatePoolWithTag(NonPagedPool, sizeof(EMU_CONTROLLER), EMU_POOL_TAG);
+    if (controller == NULL) {
+        return NULL;
+    }
+    RtlZeroMemory(controller, sizeof(EMU_CONTROLLER));
+    controller->Config = *Config;
+
+    length = EMU_DOORBELL_OFFSET + (Config->MaxQueues + 1) * 2 * sizeof(ULONG);
+    registers = ExAllocatePoolWithTag(NonPagedPool, ROUND_TO_PAGES(length), EMU_POOL_TAG);
+    if (registers == NULL) {
+        ExFreePoolWithTag(controller, EMU_POOL_TAG);
+        return NULL;
+    }
+    RtlZeroMemory(registers, ROUND_TO_PAGES(length));
+    controller->Registers = registers;
+    controller->RegisterLength = length;
+
+    if (Config->CmbSize != 0) {
+        ASSERT(Config->CmbSize % PAGE_SIZE == 0);
+        controller->Cmb = ExAllocatePoolWithTag(NonPagedPool, Config->CmbSize, EMU_POOL_TAG);
+        if (controller->Cmb == NULL) {
+            ExFreePoolWithTag(registers, EMU_POOL_TAG);
+            ExFreePoolWithTag(controller, EMU_POOL_TAG);
+            return NULL;
+        }
+        RtlZeroMemory(controller->Cmb, Config->CmbSize);
+    }
+
+    for (i = 0; i <= EMU_MAX_QUEUES; i++) {
+        controller->Queues[i].Held =
+            ExAllocatePoolWithTag(NonPagedPool,
+                                  EMU_MAX_QUEUE_ENTRIES * sizeof(NVME_COMPLETION_ENTRY),
+                                  EMU_POOL_TAG);
+        if (controller->Queues[i].Held == NULL) {
+            controller->Index = EMU_MAX_CONTROLLERS;
+            EmuDestroyController(controller);
+            return NULL;
+        }
+    }
+
+    if (Config->FirmwareSize != 0) {
+        controller->FirmwareImage = ExAllocatePoolWithTag(NonPagedPool, Config->FirmwareSize,
+                                                          EMU_POOL_TAG);
+        if (controller->FirmwareImage == NULL) {
+            controller->Index = EMU_MAX_CONTROLLERS;
+            EmuDestroyController(controller);
+            return NULL;
+        }
+    }
+
+    if (Config->CompletionDelay != 0 || Config->FirmwareDelay != 0) {
+        controller->DelayedSize = (Config->MaxQueues + 1) * EMU_MAX_QUEUE_ENTRIES;
+        controller->Delayed =
+            ExAllocatePoolWithTag(NonPagedPool,
+                                  controller->DelayedSize * sizeof(EMU_DELAYED_COMMAND),
+                                  EMU_POOL_TAG);
+        if (controller->Delayed == NULL ||
+            pthread_create(&controller->DelayedThread, NULL,
+                           EmuDelayedCommandThread, controller) != 0) {
+            controller->Index = EMU_MAX_CONTROLLERS;
+            EmuDestroyController(controller);
+            return NULL;
+        }
+        controller->DelayedThreadStarted = TRUE;
+    }
+
+    if (Config->ZoneBlocks != 0) {
+        ASSERT(Config->Blocks % Config->ZoneBlocks == 0);
+        controller->ZoneCount = Config->Blocks / Config->ZoneBlocks;
+        controller->Zones = ExAllocatePoolWithTag(NonPagedPool,
+                                                  controller->ZoneCount * sizeof(EMU_ZONE),
+                                                  EMU_POOL_TAG);
+        if (controller->Zones == NULL) {
+            controller->Index = EMU_MAX_CONTROLLERS;
+            EmuDestroyController(controller);
+            return NULL;
+        }
+        for (i = 0; i < controller->ZoneCount; i++) {
+            controller->Zones[i].WritePointer = i * Config->ZoneBlocks;
+            controller->Zones[i].State = EMU_ZONE_EMPTY;
+        }
+    }
+
+    if (Config->ServiceTime != 0) {
+        if (pthread_create(&controller->ArbiterThread, NULL,
+                           EmuArbiterThread, controller) != 0) {
+            controller->Index = EMU_MAX_CONTROLLERS;
+            EmuDestroyController(controller);
+            return NULL;
+        }
+        controller->ArbiterThreadStarted = TRUE;
+    }
+
+    registers->CAP.MQES = EMU_MAX_QUEUE_ENTRIES - 1;
+    registers->CAP.CQR = 1;
+    registers->CAP.AMS_WeightedRoundRobinWithUrgent = Config->WeightedRoundRobin ? 1 : 0;
+    registers->CAP.TO = min(Config->ReadyDelay / 500 + 1, 255);
+    registers->CAP.DSTRD = 0;
+    registers->CAP.CSS_NVM = 1;
+    registers->CAP.CSS_MultipleIo = Config->ZoneBlocks != 0;
+    registers->CAP.MPSMIN = 0;
+    registers->CAP.MPSMAX = 0;
+    registers->VS.AsUlong = 0x00010400;
+
+    //
+    // The CMB is all of BAR 2, in 4 KiB units, for submission queues only.
+    //
+    if (Config->CmbSize != 0) {
+        registers->CMBLOC.BIR = 2;
+        registers->CMBLOC.OFST = 0;
+        registers->CMBSZ.SQS = 1;
+        registers->CMBSZ.SZU = 0;
+        registers->CMBSZ.SZ = Config->CmbSize / PAGE_SIZE;
+    }
+
+    ShimAcquireRawLock(&Emu.Lock);
+    for (i = 0; i < EMU_MAX_CONTROLLERS && Emu.Controllers[i] != NULL; i++) {
+    }
+    controller->Index = i;
+    if (i < EMU_MAX_CONTROLLERS) {
+        __atomic_store_n(&Emu.Controllers[i], controller, __ATOMIC_RELEASE);
+    }
+    ShimReleaseRawLock(&Emu.Lock);
+
+    if (i == EMU_MAX_CONTROLLERS) {
+        EmuDestroyController(controller);
+        return NULL;
+    }
+
+    return controller;
+}
+
+VOID
+EmuDestroyController(
+    __in PEMU_CONTROLLER Controller
+    )
+/*++
+Routine Description:
+
+    Destroys a controller no driver uses any more.
+
+--*/
+{
+    ULONG i;
+
+    ASSERT(Controller->Interrupt == NULL);
+
+    if (Controller->Index < EMU_MAX_CONTROLLERS) {
+        ShimAcquireRawLock(&Emu.Lock);
+        __atomic_store_n(&Emu.Controllers[Controller->Index], NULL, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&Emu.Generation, 1, __ATOMIC_RELEASE);
+        ShimReleaseRawLock(&Emu.Lock);
+    }
+
+    if (Controller->ArbiterThreadStarted) {
+        __atomic_store_n(&Controller->ArbiterStopping, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&Controller->ArbiterSequence, 1, __ATOMIC_SEQ_CST);
+        EmuFutexWake(&Controller->ArbiterSequence);
+        pthread_join(Controller->ArbiterThread, NULL);
+    }
+    if (Controller->DelayedThreadStarted) {
+        __atomic_store_n(&Controller->DelayedStopping, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&Controller->DelayedSequence, 1, __ATOMIC_SEQ_CST);
+        EmuFutexWake(&Controller->DelayedSequence);
+        pthread_join(Controller->DelayedThread, NULL);
+    }
+    if (Controller->Delayed != NULL) {
+        ExFreePoolWithTag(Controller->Delayed, EMU_POOL_TAG);
+    }
+    if (Controller->FirmwareImage != NULL) {
+        ExFreePoolWithTag(Controller->FirmwareImage, EMU_POOL_TAG);
+    }
+    if (Controller->Zones != NULL) {
+        ExFreePoolWithTag(Controller->Zones, EMU_POOL_TAG);
+    }
+
+    for (i = 0; i <= EMU_MAX_QUEUES; i++) {
+        if (Controller->Queues[i].Held != NULL) {
+            ExFreePoolWithTag(Controller->Queues[i].Held, EMU_POOL_TAG);
+        }
+    }
+
+    if (Controller->Cmb != NULL) {
+        ExFreePoolWithTag(Controller->Cmb, EMU_POOL_TAG);
+    }
+    ExFreePoolWithTag(Controller->Registers, EMU_POOL_TAG);
+    ExFreePoolWithTag(Controller, EMU_POOL_TAG);
+}
+
+VOID
+EmuQueryResources(
+    __in  PEMU_CONTROLLER             Controller,
+    __out PNVME_CONTROLLER_REGISTERS *Registers,
+    __out PULONG                      RegisterLength,
+    __out PULONG                      Vector
+    )
+/*++
+Routine Description:
+
+    Tells what the bus assigns the controller: the register block, at
+    the same address raw and translated, and the interrupt vector.
+
+--*/
+{
+    *Registers = Controller->Registers;
+    *RegisterLength = Controller->RegisterLength;
+    *Vector = Controller->Index;
+}
+
+ULONG
+EmuQueryHostMemoryBuffer(
+    __in  PEMU_CONTROLLER Controller,
+    __out PEMU_HMB_EVENT  Events,
+    __in  ULONG           Count
+    )
+/*++
+Routine Description:
+
+    Copies out what happened to the host memory buffer so far, oldest
+    first: the Set Features of the Host Memory Buffer feature and the
+    controller resets.
+
+Return Value:
+
+    The number of events there were, which may be more than were kept
+    or than fit
+
+--*/
+{
+    ULONG count;
+
+    ShimAcquireRawLock(&Controller->HmbLock);
+    count = Controller->HmbEventCount;
+    RtlCopyMemory(Events, Controller->HmbEvents,
+                  min(min(count, Count), EMU_MAX_HMB_EVENTS) * sizeof(EMU_HMB_EVENT));
+    ShimReleaseRawLock(&Controller->HmbLock);
+
+    return count;
+}
+
+PVOID
+EmuQueryControllerMemoryBuffer(
+    __in  PEMU_CONTROLLER Controller,
+    __out PULONG          Length
+    )
+/*++
+Routine Description:
+
+    Tells where the controller memory buffer is, which the bus assigns
+    as BAR 2, raw and translated alike.
+
+Return Value:
+
+    The CMB, or NULL if the controller has none
+
+--*/
+{
+    *Length = Controller->Config.CmbSize;
+
+    return Controller->Cmb;
+}
+
+VOID
+EmuSetDropInterval(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Interval
+    )
+/*++
+Routine Description:
+
+    Changes how many I/O commands the controller fetches per command it
+    drops, from the next one on; 1 has it answer no I/O command at all.
+
+--*/
+{
+    __atomic_store_n(&Controller->Config.DropInterval, Interval, __ATOMIC_RELAXED);
+}
+
+BOOLEAN
+EmuRaiseAsyncEvent(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Dw0
+    )
+/*++
+Routine Description:
+
+    Completes the oldest Asynchronous Event Request outstanding with an
+    event, Dw0 giving its type, information and log page. The masking of
+    the type until the log page is read is not modelled.
+
+Return Value:
+
+    FALSE if no request is outstanding
+
+--*/
+{
+    PEMU_QUEUE admin = &Controller->Queues[0];
+    USHORT     commandId;
+
+    ShimAcquireRawLock(&admin->SubmissionLock);
+
+    if (!admin->SubmissionValid || Controller->AsyncEventCount == 0) {
+        ShimReleaseRawLock(&admin->SubmissionLock);
+        return FALSE;
+    }
+
+    commandId = Controller->AsyncEvents[0];
+    Controller->AsyncEventCount--;
+    RtlMoveMemory(&Controller->AsyncEvents[0], &Controller->AsyncEvents[1],
+                  Controller->AsyncEventCount * sizeof(USHORT));
+    EmuPostCompletion(Controller, 0, 0, commandId, 0, Dw0);
+
+    ShimReleaseRawLock(&admin->SubmissionLock);
+
+    EmuSignalInterrupt(Controller);
+
+    return TRUE;
+}
+
+BOOLEAN
+EmuCompareFirmware(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Slot,
+    __in PVOID           Image,
+    __in ULONG           Length
+    )
+/*++
+Routine Description:
+
+    Tells whether Image is what the last Firmware Commit put in Slot,
+    and no download has written over it since.
+
+--*/
+{
+    BOOLEAN same;
+
+    if (Controller->FirmwareImage == NULL) {
+        return FALSE;
+    }
+
+    ShimAcquireRawLock(&Controller->FirmwareLock);
+
+    same = (BOOLEAN)(Controller->FirmwareSlot == Slot &&
+                     Controller->FirmwareLength == Length &&
+                     Controller->FirmwareReceived == 0 &&
+                     RtlCompareMemory(Controller->FirmwareImage, Image, Length) == Length);
+
+    ShimReleaseRawLock(&Controller->FirmwareLock);
+
+    return same;
+}
+
+static
+ULONGLONG
+EmuThreadTime(
+    __in pthread_t Thread
+    )
+{
+    clockid_t       clock;
+    struct timespec now;
+
+    if (pthread_getcpuclockid(Thread, &clock) != 0 || clock_gettime(clock, &now) != 0) {
+        return 0;
+    }
+
+    return (ULONGLONG)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+VOID
+EmuQueryStatistics(
+    __in  PEMU_CONTROLLER Controller,
+    __out PEMU_STATISTICS Statistics
+    )
+{
+    Statistics->Commands = __atomic_load_n(&Controller->Commands, __ATOMIC_RELAXED);
+    Statistics->Interrupts = __atomic_load_n(&Controller->Interrupts, __ATOMIC_RELAXED);
+    Statistics->DataErrors = __atomic_load_n(&Controller->DataErrors, __ATOMIC_RELAXED);
+    Statistics->HeldCompletions = __atomic_load_n(&Controller->HeldCompletions, __ATOMIC_RELAXED);
+    Statistics->RemoteDeviceAccesses =
+        __atomic_load_n(&Controller->RemoteDeviceAccesses, __ATOMIC_RELAXED);
+    Statistics->RemoteHostAccesses =
+        __atomic_load_n(&Controller->RemoteHostAccesses, __ATOMIC_RELAXED);
+    Statistics->HostFetches = __atomic_load_n(&Controller->HostFetches, __ATOMIC_RELAXED);
+    Statistics->Dropped = __atomic_load_n(&Controller->Dropped, __ATOMIC_RELAXED);
+    Statistics->AbortCommands = __atomic_load_n(&Controller->AbortCommands, __ATOMIC_RELAXED);
+    Statistics->Aborts = __atomic_load_n(&Controller->Aborts, __ATOMIC_RELAXED);
+    Statistics->Discarded = __atomic_load_n(&Controller->Discarded, __ATOMIC_RELAXED);
+    Statistics->Resets = __atomic_load_n(&Controller->Resets, __ATOMIC_RELAXED);
+    Statistics->ProtectionErrors =
+        __atomic_load_n(&Controller->ProtectionErrors, __ATOMIC_RELAXED);
+    Statistics->ZoneErrors = __atomic_load_n(&Controller->ZoneErrors, __ATOMIC_RELAXED);
+    Statistics->MmioWrites = __atomic_load_n(&Controller->MmioWrites, __ATOMIC_RELAXED);
+
+    Statistics->ThreadTime = 0;
+    if (Controller->DelayedThreadStarted) {
+        Statistics->ThreadTime += EmuThreadTime(Controller->DelayedThread);
+    }
+    if (Controller->ArbiterThreadStarted) {
+        Statistics->ThreadTime += EmuThreadTime(Controller->ArbiterThread);
+    }
+}
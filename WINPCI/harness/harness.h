@@ -0,0 +1,251 @@
+/*++
+
+Module Name:
+
+    harness.h
+
+Abstract:
+
+    Declarations shared by the parts of the user-mode harness: the kernel
+    services of shim.c and shimio.c and the emulated controllers of
+    emu.c, as used by bench.c.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#pragma once
+
+//
+// IRQL the emulated controller interrupts at.
+//
+#define EMU_DEVICE_IRQL             11
+
+//
+// IRP allocation flag: IoCompleteRequest frees the IRP and its MDL once
+// it has signalled UserEvent, as the I/O manager does for the IRPs of
+// IoBuildSynchronousFsdRequest.
+//
+#define SHIM_IRP_FREE_ON_COMPLETION 0x80
+
+//
+// No node, what IoGetDeviceNumaNode and ShimQueryMemoryNode tell about
+// devices and memory placed nowhere in particular.
+//
+#define SHIM_NODE_NONE              ((USHORT)-1)
+
+//
+// What the kernel has handed out and completed since ShimInitialize.
+//
+typedef struct _SHIM_STATISTICS {
+    ULONGLONG   PoolAllocations;    // ExAllocatePoolWithTag calls, lookaside misses among them
+    ULONGLONG   IrpAllocations;
+    ULONGLONG   MdlAllocations;
+    ULONGLONG   Completions;        // IoCompleteRequest calls
+} SHIM_STATISTICS, *PSHIM_STATISTICS;
+
+//
+// shim.c
+//
+VOID
+ShimInitialize(
+    __in ULONG Processors,
+    __in ULONG Nodes
+    );
+
+VOID
+ShimShutdown(
+    VOID
+    );
+
+VOID
+ShimBindThread(
+    __in ULONG Processor
+    );
+
+VOID
+ShimAcquireRawLock(
+    __inout volatile LONG *Lock
+    );
+
+VOID
+ShimReleaseRawLock(
+    __inout volatile LONG *Lock
+    );
+
+VOID
+ShimSetCurrentProcess(
+    __in HANDLE ProcessId
+    );
+
+USHORT
+ShimQueryMemoryNode(
+    __in PVOID Address
+    );
+
+USHORT
+ShimQueryCurrentNode(
+    VOID
+    );
+
+VOID
+ShimQueryStatistics(
+    __out PSHIM_STATISTICS Statistics
+    );
+
+//
+// shimio.c
+//
+VOID
+ShimStartWorkerThreads(
+    VOID
+    );
+
+VOID
+ShimStopWorkerThreads(
+    VOID
+    );
+
+VOID
+ShimSetDebugOutput(
+    __in BOOLEAN Enable
+    );
+
+VOID
+ShimSetDeviceNode(
+    __in PDEVICE_OBJECT Pdo,
+    __in USHORT         Node
+    );
+
+PDEVICE_OBJECT
+ShimReferenceDeviceByName(
+    __in PCWSTR Name
+    );
+
+ULONG
+ShimQueryInvalidatedStates(
+    VOID
+    );
+
+//
+// emu.c
+//
+typedef struct _EMU_CONFIG {
+    ULONG       MaxQueues;          // I/O queues the controller grants
+    ULONG       LbaShift;
+    ULONGLONG   Blocks;             // namespace 1 size
+    BOOLEAN     WeightedRoundRobin;
+    BOOLEAN     MoveData;           // walk the PRPs of reads and writes
+    USHORT      Node;               // NUMA node the controller is attached to
+    ULONG       RemoteAccessCost;   // ns per queue entry accessed across nodes
+    ULONG       CompletionDelay;    // us I/O commands take to complete, 0 for none
+    ULONG       DropInterval;       // every Nth I/O command never completes, 0 for none
+    ULONG       ReadyDelay;         // ms from CC.EN set to CSTS.RDY set
+    ULONG       ServiceTime;        // ns the controller takes to fetch each I/O command, 0 for none
+    UCHAR       ProtectionType;     // PI type of namespace 1, in 8 bytes of separate metadata; 0 for none
+    ULONGLONG   ZoneBlocks;         // namespace 1 zoned with zones of this many blocks, 0 for not zoned
+    ULONG       CmbSize;            // bytes of memory buffer for submission queues in BAR 2, 0 for none
+    ULONG       FetchCost;          // ns to fetch a submission entry from host memory, 0 for none
+    ULONG       HmbSize;            // bytes of host memory buffer asked for, at least and at most; 0 for none
+    BOOLEAN     ShadowDoorbells;    // offers Doorbell Buffer Config
+    ULONG       TelemetrySize;      // bytes of Telemetry Host-Initiated log, header block included; 0 for none
+    ULONG       FirmwareSize;       // bytes of firmware image the controller takes, 0 for no firmware update
+    ULONG       FirmwareDelay;      // us Firmware Image Download commands take to complete, 0 for none
+} EMU_CONFIG, *PEMU_CONFIG;
+
+typedef struct _EMU_STATISTICS {
+    ULONGLONG   Commands;
+    ULONGLONG   Interrupts;
+    ULONGLONG   DataErrors;         // written blocks not stamped with their LBA
+    ULONGLONG   HeldCompletions;    // posted late, completion queue full
+    ULONGLONG   RemoteDeviceAccesses;   // queue entries the controller reached across nodes
+    ULONGLONG   RemoteHostAccesses;     // and the host
+    ULONGLONG   HostFetches;        // submission entries fetched from host memory
+    ULONGLONG   Dropped;            // I/O commands never completed
+    ULONGLONG   AbortCommands;
+    ULONGLONG   Aborts;             // commands aborted by an Abort command
+    ULONGLONG   Discarded;          // delayed commands a reset or SQ deletion lost
+    ULONGLONG   Resets;             // CC.EN going to 0
+    ULONGLONG   ProtectionErrors;   // written blocks whose PI did not check
+    ULONGLONG   ThreadTime;         // ns of CPU the controller's own threads used
+    ULONGLONG   ZoneErrors;         // writes and appends a zone refused
+    ULONGLONG   MmioWrites;         // register writes, doorbells among them
+} EMU_STATISTICS, *PEMU_STATISTICS;
+
+//
+// Something that happened to the host memory buffer of a controller: a
+// Set Features of the Host Memory Buffer feature, or a reset.
+//
+#define EMU_HMB_ENABLE          0x1         // CDW11 EHM
+#define EMU_HMB_MEMORY_RETURN   0x2         // CDW11 MR
+#define EMU_HMB_RESET           0x80000000
+#define EMU_MAX_HMB_EVENTS      32          // kept of a controller
+
+typedef struct _EMU_HMB_EVENT {
+    ULONG       Flags;              // CDW11 of the Set Features, or EMU_HMB_RESET
+    BOOLEAN     Enabled;            // the controller had the buffer before
+    USHORT      Status;             // of the command, 0 for success
+    ULONG       Pages;              // given, 4 KiB each
+    ULONG       Chunks;
+} EMU_HMB_EVENT, *PEMU_HMB_EVENT;
+
+typedef struct _EMU_CONTROLLER *PEMU_CONTROLLER;
+
+PEMU_CONTROLLER
+EmuCreateController(
+    __in PEMU_CONFIG Config
+    );
+
+VOID
+EmuDestroyController(
+    __in PEMU_CONTROLLER Controller
+    );
+
+VOID
+EmuQueryResources(
+    __in  PEMU_CONTROLLER             Controller,
+    __out PNVME_CONTROLLER_REGISTERS *Registers,
+    __out PULONG                      RegisterLength,
+    __out PULONG                      Vector
+    );
+
+ULONG
+EmuQueryHostMemoryBuffer(
+    __in  PEMU_CONTROLLER Controller,
+    __out PEMU_HMB_EVENT  Events,
+    __in  ULONG           Count
+    );
+
+PVOID
+EmuQueryControllerMemoryBuffer(
+    __in  PEMU_CONTROLLER Controller,
+    __out PULONG          Length
+    );
+
+VOID
+EmuQueryStatistics(
+    __in  PEMU_CONTROLLER Controller,
+    __out PEMU_STATISTICS Statistics
+    );
+
+VOID
+EmuSetDropInterval(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Interval
+    );
+
+BOOLEAN
+EmuRaiseAsyncEvent(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Dw0
+    );
+
+BOOLEAN
+EmuCompareFirmware(
+    __in PEMU_CONTROLLER Controller,
+    __in ULONG           Slot,
+    __in PVOID           Image,
+    __in ULONG           Length
+    );
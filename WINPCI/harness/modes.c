@@ -0,0 +1,3786 @@
+/*++
+
+Module Name:
+
+    modes.c
+
+Abstract:
+
+    The comparison modes of bench.c. Each builds the devices it needs on
+    emulated controllers, runs workers against them in the settings it
+    compares, prints a table and tears everything down again. A mode
+    fails if any request fails or the driver is left with requests
+    outstanding.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "precomp.h"
+#include "harness.h"
+#include "bench.h"
+
+
+static
+int
+BenchCompareTimes(
+    const void *Left,
+    const void *Right
+    )
+{
+    ULONGLONG left = *(const ULONGLONG *)Left;
+    ULONGLONG right = *(const ULONGLONG *)Right;
+
+    return left < right ? -1 : left > right;
+}
+
+static
+BOOLEAN
+BenchSetUpDevice(
+    __in  PEMU_CONFIG   Config,
+    __out PBENCH_DEVICE Device
+    )
+/*++
+Routine Description:
+
+    Adds and starts a device, telling why if it does not start.
+
+--*/
+{
+    NTSTATUS status;
+
+    status = BenchAddDevice(Config, Device);
+    if (NT_SUCCESS(status)) {
+        status = BenchStartDevice(Device);
+        if (!NT_SUCCESS(status)) {
+            BenchRemoveDevice(Device);
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "device not started 0x%x\n", status);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+BenchRunDevice(
+    __in  PEMU_CONFIG     Config,
+    __in  PBENCH_WORKLOAD Workload,
+    __out PBENCH_RESULT   Result,
+    __out PEMU_STATISTICS Statistics,
+    __in_opt VOID       (*Inspect)(PBENCH_DEVICE, PVOID),
+    __in_opt PVOID        Context
+    )
+/*++
+Routine Description:
+
+    Adds and starts a device, runs Options.Threads workers of a workload
+    on it for Options.Seconds, and removes it, with the parameter
+    overrides in effect. Inspect, if given, looks at the device before
+    it goes. Requests may fail only by timing out, and only as many as
+    the controller dropped commands; none may complete twice.
+
+--*/
+{
+    BENCH_DEVICE  device;
+    PBENCH_WORKER workers;
+    ULONGLONG     elapsed;
+    ULONG         i;
+    BOOLEAN       success;
+
+    RtlZeroMemory(Result, sizeof(BENCH_RESULT));
+    RtlZeroMemory(Statistics, sizeof(EMU_STATISTICS));
+
+    if (!BenchSetUpDevice(Config, &device)) {
+        return FALSE;
+    }
+
+    workers = ExAllocatePoolWithTag(NonPagedPool, Options.Threads * sizeof(BENCH_WORKER),
+                                    BENCH_POOL_TAG);
+    success = (BOOLEAN)(workers != NULL);
+    for (i = 0; success && i < Options.Threads; i++) {
+        success = BenchCreateWorker(i, &device, NULL, Workload, &workers[i]);
+    }
+
+    if (success) {
+        elapsed = BenchRunWorkers(workers, Options.Threads, Options.Seconds);
+        success = BenchWaitForRundown(&device);
+        BenchSummarize(workers, Options.Threads, elapsed, Result);
+        EmuQueryStatistics(device.Controller, Statistics);
+        if (Inspect != NULL) {
+            Inspect(&device, Context);
+        }
+        if (Result->Errors != Result->TimedOut || Result->TimedOut > Statistics->Dropped ||
+            Result->DataErrors != 0 || Statistics->DataErrors != 0 ||
+            Result->DoubleCompletions != 0) {
+            success = FALSE;
+        }
+    } else {
+        fprintf(stderr, "out of memory\n");
+    }
+
+    while (i-- != 0) {
+        BenchDeleteWorker(&workers[i]);
+    }
+    if (workers != NULL) {
+        ExFreePoolWithTag(workers, BENCH_POOL_TAG);
+    }
+
+    BenchRemoveDevice(&device);
+
+    return success;
+}
+
+
+//
+// NUMA placement
+//
+
+typedef struct _BENCH_NUMA_PLACEMENT {
+    ULONG   LocalToProcessor;       // I/O queues on the node of their CPU
+    ULONG   LocalToDevice;          // on the node of the device
+    ULONG   Queues;
+} BENCH_NUMA_PLACEMENT, *PBENCH_NUMA_PLACEMENT;
+
+static
+VOID
+BenchCountPlacement(
+    __in PBENCH_DEVICE Device,
+    __in PVOID         Context
+    )
+{
+    PBENCH_NUMA_PLACEMENT placement = (PBENCH_NUMA_PLACEMENT)Context;
+    PFDO_DATA             fdoData = Device->FdoData;
+    PHW_QUEUE             queue;
+    ULONG                 i;
+
+    RtlZeroMemory(placement, sizeof(BENCH_NUMA_PLACEMENT));
+
+    for (i = 0; i < fdoData->IoQueueCount; i++) {
+        queue = fdoData->IoQueues[i];
+        placement->Queues++;
+        if (queue->NodeNumber == queue->ProcessorNode) {
+            placement->LocalToProcessor++;
+        }
+        if (queue->NodeNumber == fdoData->DeviceNode) {
+            placement->LocalToDevice++;
+        }
+    }
+}
+
+BOOLEAN
+BenchNumaMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    The device sits on node 0 and the workers run on every processor of
+    every node. First the driver puts each queue on the node of the
+    processor owning it, so the processors of the other nodes reach
+    their queues locally and the controller reaches them across nodes;
+    then on the device's node, so it is the other way around for those
+    processors. Each queue entry accessed across nodes costs -R ns, on
+    top of which only the driver's path runs.
+
+--*/
+{
+    static const struct {
+        ULONG   Placement;
+        PCSTR   Name;
+    } runs[] = {
+        { HW_NODE_PLACEMENT_PROCESSOR,  "CPU node" },
+        { HW_NODE_PLACEMENT_DEVICE,     "device node" },
+    };
+    BENCH_NUMA_PLACEMENT placement;
+    BENCH_WORKLOAD       workload;
+    BENCH_RESULT         result;
+    EMU_STATISTICS       statistics;
+    EMU_CONFIG           config;
+    ULONG                i;
+    BOOLEAN              success = TRUE;
+
+    if (Options.Nodes < 2) {
+        fprintf(stderr, "numa: needs -n 2 or more\n");
+        return FALSE;
+    }
+
+    BenchDefaultConfig(&config);
+    config.RemoteAccessCost = Options.RemoteAccessCost;
+    BenchDefaultWorkload(&workload);
+
+    printf("%u processors in %u nodes, device on node 0, %u threads x %u, %u byte I/O, "
+           "%u ns per remote queue entry\n",
+           Options.Processors, Options.Nodes, Options.Threads, workload.QueueDepth,
+           workload.BlockSize, Options.RemoteAccessCost);
+    printf("  %-12s %10s %9s %9s %9s %12s %12s %10s\n",
+           "queues on", "IOPS", "mean us", "p99 us", "max us",
+           "remote host", "remote dev", "CPU-local");
+
+    for (i = 0; i < RTL_NUMBER_OF(runs); i++) {
+
+        BenchClearParameterOverrides();
+        BenchOverrideParameter(L"QueueNodePlacement", runs[i].Placement);
+
+        RtlZeroMemory(&placement, sizeof(placement));
+        if (!BenchRunDevice(&config, &workload, &result, &statistics,
+                            BenchCountPlacement, &placement)) {
+            success = FALSE;
+        }
+
+        printf("  %-12s %10.0f %9.2f %9.1f %9.1f %12.2f %12.2f %7u/%-2u\n",
+               runs[i].Name, result.Iops, result.MeanUs, result.P99Us, result.MaxUs,
+               result.Completed != 0 ?
+                   (double)statistics.RemoteHostAccesses / result.Completed : 0.0,
+               result.Completed != 0 ?
+                   (double)statistics.RemoteDeviceAccesses / result.Completed : 0.0,
+               placement.LocalToProcessor, placement.Queues);
+    }
+
+    printf("  remote host and remote dev are queue entries reached across nodes per I/O\n");
+
+    BenchClearParameterOverrides();
+
+    return success;
+}
+
+
+//
+// Cancellation
+//
+
+typedef struct _BENCH_CANCEL_CHECK {
+    ULONG   LeakedIds;              // command ids of the I/O queues not free
+    LONG    AbortsOutstanding;
+} BENCH_CANCEL_CHECK, *PBENCH_CANCEL_CHECK;
+
+static
+VOID
+BenchCheckCommandIds(
+    __in PBENCH_DEVICE Device,
+    __in PVOID         Context
+    )
+/*++
+Routine Description:
+
+    Counts the command ids of the I/O queues that are not free once every
+    request is back, and the Aborts the driver still waits for. Both go
+    to zero as the DPCs retire the last completions, which may be just
+    after the last request is back, so they get a second to.
+
+--*/
+{
+    PBENCH_CANCEL_CHECK check = (PBENCH_CANCEL_CHECK)Context;
+    PFDO_DATA           fdoData = Device->FdoData;
+    PHW_QUEUE           queue;
+    ULONG               i, wait;
+
+    for (wait = 0; wait < 1000; wait++) {
+        check->LeakedIds = 0;
+        for (i = 0; i < fdoData->IoQueueCount; i++) {
+            queue = fdoData->IoQueues[i];
+            check->LeakedIds += HW_QUEUE_COMMAND_IDS(queue) -
+                                __atomic_load_n(&queue->FreeCount, __ATOMIC_ACQUIRE);
+        }
+        check->AbortsOutstanding = __atomic_load_n(&fdoData->AbortsOutstanding,
+                                                   __ATOMIC_ACQUIRE);
+        if (check->LeakedIds == 0 && check->AbortsOutstanding == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+}
+
+BOOLEAN
+BenchCancelMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Keeps 1024 requests in flight on each queue of a controller whose
+    commands take a millisecond, and has every worker cancel one of its
+    requests at random for about one issue in 16, or forge aborts for
+    it that the driver must ignore. Each request must complete exactly
+    once; it comes back cancelled exactly when the controller aborted
+    its command, which only a real cancellation may cause; and every
+    command id and Abort slot is given back in the end.
+
+--*/
+{
+    BENCH_CANCEL_CHECK check;
+    BENCH_WORKLOAD     workload;
+    BENCH_RESULT       result;
+    EMU_STATISTICS     statistics;
+    EMU_CONFIG         config;
+    BOOLEAN            success;
+
+    BenchDefaultConfig(&config);
+    config.CompletionDelay = 1000;
+    BenchDefaultWorkload(&workload);
+    workload.QueueDepth = 1024;
+    workload.CancelInterval = 16;
+
+    BenchClearParameterOverrides();
+    BenchOverrideParameter(L"IoQueueDepth", workload.QueueDepth + 1);
+
+    printf("%u processors, %u threads x %u, %u us per command, a cancel per %u issues\n",
+           Options.Processors, Options.Threads, workload.QueueDepth,
+           config.CompletionDelay, workload.CancelInterval);
+
+    RtlZeroMemory(&check, sizeof(check));
+    success = BenchRunDevice(&config, &workload, &result, &statistics,
+                             BenchCheckCommandIds, &check);
+
+    printf("  %10s %9s %9s %9s %9s %9s %9s\n",
+           "IOPS", "cancels", "cancelled", "missed", "aborted", "forged", "p99 us");
+    printf("  %10.0f %9llu %9llu %9llu %9llu %9llu %9.1f\n",
+           result.Iops, result.CancelsSent, result.Cancelled, result.CancelsMissed,
+           statistics.Aborts, result.ForgedAborts, result.P99Us);
+    printf("  missed completed before an Abort got to them or found the Abort limit\n"
+           "  used up; forged aborts were for a stale generation or another IRP\n");
+
+    if (result.DoubleCompletions != 0) {
+        fprintf(stderr, "cancel: %llu requests completed twice\n", result.DoubleCompletions);
+        success = FALSE;
+    }
+    if (result.WrongCancels != 0) {
+        fprintf(stderr, "cancel: %llu requests cancelled without IoCancelIrp\n",
+                result.WrongCancels);
+        success = FALSE;
+    }
+    if (result.Cancelled != statistics.Aborts) {
+        fprintf(stderr, "cancel: %llu requests cancelled, %llu commands aborted\n",
+                result.Cancelled, statistics.Aborts);
+        success = FALSE;
+    }
+    if (result.Cancelled == 0) {
+        fprintf(stderr, "cancel: no command was aborted\n");
+        success = FALSE;
+    }
+    if (check.LeakedIds != 0 || check.AbortsOutstanding != 0) {
+        fprintf(stderr, "cancel: %u command ids leaked, %d Aborts outstanding\n",
+                check.LeakedIds, check.AbortsOutstanding);
+        success = FALSE;
+    }
+
+    BenchClearParameterOverrides();
+
+    return success;
+}
+
+
+//
+// Timeouts
+//
+
+BOOLEAN
+BenchTimeoutMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Runs half reads, half writes, with data checking, against a
+    controller whose commands take 10 ms and which drops one I/O command
+    in 20000, with a one second I/O timeout. A dropped command times
+    out; the Abort sent for it finds nothing to abort, and the controller
+    is reset after the grace period, losing the commands in flight, which
+    the driver submits again on the new queues; the commands take long
+    enough to be in flight still, as new requests wait for the reset.
+    Every request must complete exactly once: those whose own command
+    was dropped with STATUS_IO_TIMEOUT, unless a reset for another came
+    first and replayed them, and all others successfully, the reads with
+    the data of their blocks.
+
+--*/
+{
+    BENCH_WORKLOAD workload;
+    BENCH_RESULT   result;
+    EMU_STATISTICS statistics;
+    EMU_CONFIG     config;
+    BOOLEAN        verify = Options.Verify;
+    ULONG          seconds = Options.Seconds;
+    BOOLEAN        success;
+
+    if (Options.Polled) {
+        fprintf(stderr, "timeout: the reset waits for admin interrupts, not with -p\n");
+        return FALSE;
+    }
+
+    //
+    // A reset comes about three seconds after the drop, the timeout and
+    // the grace period of the Abort, and must find requests in flight.
+    //
+    Options.Verify = TRUE;
+    Options.Seconds = max(Options.Seconds, 6);
+
+    BenchDefaultConfig(&config);
+    config.CompletionDelay = 10000;
+    config.DropInterval = 20000;
+    BenchDefaultWorkload(&workload);
+    workload.WritePercent = 50;
+
+    BenchClearParameterOverrides();
+    BenchOverrideParameter(L"IoTimeout", 1);
+
+    printf("%u processors, %u threads x %u, %u us per command, one in %u dropped, "
+           "1 s timeout, %u s\n",
+           Options.Processors, Options.Threads, workload.QueueDepth,
+           config.CompletionDelay, config.DropInterval, Options.Seconds);
+
+    success = BenchRunDevice(&config, &workload, &result, &statistics, NULL, NULL);
+
+    printf("  %10s %9s %9s %9s %9s %9s %9s\n",
+           "IOPS", "dropped", "aborts", "resets", "replayed", "timed out", "max us");
+    printf("  %10.0f %9llu %9llu %9llu %9llu %9llu %9.0f\n",
+           result.Iops, statistics.Dropped, statistics.AbortCommands, statistics.Resets,
+           statistics.Discarded, result.TimedOut, result.MaxUs);
+    printf("  replayed are the commands a reset lost, submitted again\n");
+
+    if (statistics.Dropped == 0 || statistics.Resets == 0 ||
+        statistics.AbortCommands == 0 || statistics.Discarded == 0) {
+        fprintf(stderr, "timeout: a drop, Abort, reset or replay did not happen\n");
+        success = FALSE;
+    }
+    if (result.TimedOut == 0) {
+        fprintf(stderr, "timeout: no request timed out\n");
+        success = FALSE;
+    }
+
+    BenchClearParameterOverrides();
+    Options.Verify = verify;
+    Options.Seconds = seconds;
+
+    return success;
+}
+
+
+//
+// Start
+//
+
+#define BENCH_START_REPEATS     51
+
+//
+// What, with the 4 tunables every bench device has, makes up a key of
+// 30 values: the other tunables at their defaults, and values the driver
+// does not know, as an INF may leave behind.
+//
+static const struct {
+    PCWSTR  Name;
+    ULONG   Value;
+} BenchStartValues[] = {
+    { L"ReadCacheSize", 0 },        { L"StripeMembers", 0 },
+    { L"StripeIndex", 0 },          { L"StripeSize", 128 },
+    { L"StripeMirror", 0 },         { L"WriteStreams", 0 },
+    { L"CmbQueues", 1 },            { L"HostMemoryBufferSize", 128 },
+    { L"ShadowDoorbells", 1 },      { L"LogPageMaxAge", 60 },
+    { L"Vendor00", 0 }, { L"Vendor01", 1 }, { L"Vendor02", 2 }, { L"Vendor03", 3 },
+    { L"Vendor04", 4 }, { L"Vendor05", 5 }, { L"Vendor06", 6 }, { L"Vendor07", 7 },
+    { L"Vendor08", 8 }, { L"Vendor09", 9 }, { L"Vendor10", 10 }, { L"Vendor11", 11 },
+    { L"Vendor12", 12 }, { L"Vendor13", 13 }, { L"Vendor14", 14 }, { L"Vendor15", 15 },
+};
+
+static
+BOOLEAN
+BenchTimeStarts(
+    __in  PEMU_CONFIG Config,
+    __in  ULONG       Values,
+    __out PULONGLONG  Started,
+    __out PULONGLONG  Ready
+    )
+/*++
+Routine Description:
+
+    Starts a device BENCH_START_REPEATS times with the first Values of
+    BenchStartValues in its key, and gives the medians from the start to
+    the start IRP coming back, where the driver reads the key, and to
+    the device being ready.
+
+--*/
+{
+    BENCH_DEVICE device;
+    ULONGLONG    started[BENCH_START_REPEATS];
+    ULONGLONG    ready[BENCH_START_REPEATS];
+    ULONGLONG    sent;
+    ULONG        i;
+    NTSTATUS     status;
+
+    BenchClearParameterOverrides();
+    for (i = 0; i < Values; i++) {
+        BenchOverrideParameter(BenchStartValues[i].Name, BenchStartValues[i].Value);
+    }
+
+    for (i = 0; i < BENCH_START_REPEATS; i++) {
+
+        status = BenchAddDevice(Config, &device);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "start: AddDevice failed 0x%x\n", status);
+            break;
+        }
+
+        sent = KeQueryInterruptTime();
+        status = BenchSendStart(&device);
+        started[i] = KeQueryInterruptTime() - sent;
+        if (NT_SUCCESS(status)) {
+            status = BenchWaitForStart(&device);
+        }
+        ready[i] = KeQueryInterruptTime() - sent;
+
+        BenchRemoveDevice(&device);
+
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "start: start failed 0x%x\n", status);
+            break;
+        }
+    }
+
+    BenchClearParameterOverrides();
+
+    if (i < BENCH_START_REPEATS) {
+        return FALSE;
+    }
+
+    qsort(started, BENCH_START_REPEATS, sizeof(ULONGLONG), BenchCompareTimes);
+    qsort(ready, BENCH_START_REPEATS, sizeof(ULONGLONG), BenchCompareTimes);
+    *Started = started[BENCH_START_REPEATS / 2];
+    *Ready = ready[BENCH_START_REPEATS / 2];
+
+    return TRUE;
+}
+
+BOOLEAN
+BenchStartMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Starts one controller, then 24 at once, as at boot, each taking
+    100 ms from being enabled to being ready, and times each device from
+    its start to the driver letting requests through, and all of them
+    from the first start to the last device ready. The start only kicks
+    off HwStartControllerAsync, so the devices come up side by side
+    rather than one after the other. Then times the start of a device
+    with the 4 values every bench device has in its key, and with 30.
+
+--*/
+{
+    static const ULONG counts[] = { 1, BENCH_MAX_DEVICES };
+    BENCH_DEVICE devices[BENCH_MAX_DEVICES];
+    ULONGLONG    sent[BENCH_MAX_DEVICES];
+    ULONGLONG    ready[BENCH_MAX_DEVICES];
+    ULONGLONG    start, last, sum, longest, now;
+    EMU_CONFIG   config;
+    ULONG        c, i, count, added, pending, wait;
+    NTSTATUS     status;
+    BOOLEAN      success = TRUE;
+
+    BenchDefaultConfig(&config);
+    config.ReadyDelay = 100;
+
+    BenchClearParameterOverrides();
+
+    printf("%u processors, %u ms from CC.EN to CSTS.RDY\n",
+           Options.Processors, config.ReadyDelay);
+    printf("  %-8s %9s %9s %12s %12s\n",
+           "devices", "mean ms", "max ms", "all ready ms", "one by one");
+
+    for (c = 0; c < RTL_NUMBER_OF(counts); c++) {
+
+        count = counts[c];
+
+        for (added = 0; added < count; added++) {
+            status = BenchAddDevice(&config, &devices[added]);
+            if (!NT_SUCCESS(status)) {
+                fprintf(stderr, "start: AddDevice failed 0x%x\n", status);
+                success = FALSE;
+                break;
+            }
+        }
+
+        start = KeQueryInterruptTime();
+        for (i = 0; i < added; i++) {
+            sent[i] = KeQueryInterruptTime();
+            ready[i] = 0;
+            status = BenchSendStart(&devices[i]);
+            if (!NT_SUCCESS(status)) {
+                fprintf(stderr, "start: start failed 0x%x\n", status);
+                ready[i] = sent[i];
+                success = FALSE;
+            }
+        }
+
+        //
+        // Note when each is done, to within 100 us, for up to 10 s.
+        //
+        for (wait = 0, pending = added; pending != 0 && wait < 100000; wait++) {
+            now = KeQueryInterruptTime();
+            for (i = 0, pending = 0; i < added; i++) {
+                if (ready[i] == 0) {
+                    if (KeReadStateEvent(&devices[i].FdoData->StartIdleEvent)) {
+                        ready[i] = now;
+                    } else {
+                        pending++;
+                    }
+                }
+            }
+            if (pending != 0) {
+                usleep(100);
+            }
+        }
+
+        sum = longest = last = 0;
+        for (i = 0; i < added; i++) {
+            status = BenchWaitForStart(&devices[i]);
+            if (!NT_SUCCESS(status) || ready[i] == 0) {
+                fprintf(stderr, "start: device %u not ready 0x%x\n", i, status);
+                success = FALSE;
+                continue;
+            }
+            sum += ready[i] - sent[i];
+            longest = max(longest, ready[i] - sent[i]);
+            last = max(last, ready[i]);
+        }
+
+        printf("  %-8u %9.1f %9.1f %12.1f %12.1f\n",
+               added, added != 0 ? sum / 1e4 / added : 0.0, longest / 1e4,
+               last > start ? (last - start) / 1e4 : 0.0, sum / 1e4);
+
+        while (added-- != 0) {
+            BenchRemoveDevice(&devices[added]);
+        }
+    }
+
+    printf("  one by one adds up the times of the devices, as starts waiting for\n"
+           "  the controller would take\n");
+
+    //
+    // What the values in the key cost, with a controller that is ready
+    // at once so that only the driver's time is left.
+    //
+    config.ReadyDelay = 0;
+    printf("one device, ready at once, median of %u starts\n", BENCH_START_REPEATS);
+    printf("  %-14s %14s %14s\n", "values in key", "start IRP us", "ready us");
+
+    for (c = 0; success && c < 2; c++) {
+        count = c == 0 ? 0 : RTL_NUMBER_OF(BenchStartValues);
+        if (!BenchTimeStarts(&config, count, &start, &last)) {
+            success = FALSE;
+            break;
+        }
+        printf("  %-14u %14.1f %14.1f\n", BENCH_DEVICE_PARAMETERS + count, start / 10.0,
+               last / 10.0);
+    }
+
+    return success;
+}
+
+
+//
+// Close
+//
+
+#define BENCH_CLOSE_HANDLES     100
+#define BENCH_CLOSE_REQUESTS    100     // in flight on each handle
+
+typedef struct _BENCH_CLOSE_FILL {
+    PBENCH_WORKER   Workers;
+    ULONG           Processor;
+    ULONG           Busy;
+    pthread_t       Thread;
+} BENCH_CLOSE_FILL, *PBENCH_CLOSE_FILL;
+
+static
+PVOID
+BenchFillHandles(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Issues all the requests of the handles of one processor.
+
+--*/
+{
+    PBENCH_CLOSE_FILL fill = (PBENCH_CLOSE_FILL)Context;
+    ULONG             i;
+
+    ShimBindThread(fill->Processor);
+
+    for (i = 0; i < BENCH_CLOSE_HANDLES; i++) {
+        if (fill->Workers[i].Processor == fill->Processor) {
+            fill->Busy += BenchIssueAll(&fill->Workers[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static
+VOID
+BenchPrintTimes(
+    __in PCSTR      Name,
+    __in PULONGLONG Times,
+    __in double     Unit
+    )
+/*++
+Routine Description:
+
+    Prints the mean, p50, p99 and max of the times of the handles, in
+    100ns units, divided by Unit, sorting them.
+
+--*/
+{
+    ULONGLONG sum = 0;
+    ULONG     i;
+
+    qsort(Times, BENCH_CLOSE_HANDLES, sizeof(ULONGLONG), BenchCompareTimes);
+    for (i = 0; i < BENCH_CLOSE_HANDLES; i++) {
+        sum += Times[i];
+    }
+
+    printf("  %-12s %9.1f %9.1f %9.1f %9.1f\n", Name,
+           sum / Unit / BENCH_CLOSE_HANDLES,
+           Times[BENCH_CLOSE_HANDLES / 2 - 1] / Unit,
+           Times[(BENCH_CLOSE_HANDLES * 99 + 99) / 100 - 1] / Unit,
+           Times[BENCH_CLOSE_HANDLES - 1] / Unit);
+}
+
+static
+BOOLEAN
+BenchCloseHandles(
+    __in  PBENCH_DEVICE   Device,
+    __in  PBENCH_WORKER   Workers,
+    __out PULONGLONG      Cleanup,
+    __out PULONGLONG      Drained
+    )
+/*++
+Routine Description:
+
+    Puts every request of the handles in flight and closes the handles
+    one after the other, timing the cleanup of each and the time from it
+    to the last request of the handle coming back.
+
+--*/
+{
+    BENCH_CLOSE_FILL fills[MAXIMUM_PROCESSORS];
+    ULONGLONG        closed[BENCH_CLOSE_HANDLES];
+    ULONGLONG        start, now;
+    ULONG            i, j, p, pending, wait, busy, inFlight;
+    BOOLEAN          success = TRUE;
+
+    //
+    // Fill the queues from the processors of the handles.
+    //
+    start = KeQueryInterruptTime();
+    for (p = 0; p < Options.Processors; p++) {
+        fills[p].Workers = Workers;
+        fills[p].Processor = p;
+        fills[p].Busy = 0;
+        pthread_create(&fills[p].Thread, NULL, BenchFillHandles, &fills[p]);
+    }
+    busy = 0;
+    for (p = 0; p < Options.Processors; p++) {
+        pthread_join(fills[p].Thread, NULL);
+        busy += fills[p].Busy;
+    }
+
+    inFlight = 0;
+    for (i = 0; i < BENCH_CLOSE_HANDLES; i++) {
+        inFlight += __atomic_load_n(&Workers[i].InFlight, __ATOMIC_ACQUIRE);
+    }
+    if (busy != 0 || inFlight != BENCH_CLOSE_HANDLES * BENCH_CLOSE_REQUESTS) {
+        fprintf(stderr, "close: %u requests in flight, %u found the queue full, "
+                "after %.1f ms\n", inFlight, busy, (KeQueryInterruptTime() - start) / 1e4);
+        success = FALSE;
+    }
+
+    //
+    // The requests of a handle are marked just before it is closed, so
+    // that one of a handle still open coming back cancelled shows.
+    //
+    for (i = 0; i < BENCH_CLOSE_HANDLES; i++) {
+        for (j = 0; j < BENCH_CLOSE_REQUESTS; j++) {
+            __atomic_store_n(&Workers[i].Requests[j].CancelRequested, TRUE, __ATOMIC_RELEASE);
+        }
+        closed[i] = KeQueryInterruptTime();
+        BenchSendFileIrp(Device, &Workers[i].FileObject, IRP_MJ_CLEANUP);
+        Cleanup[i] = KeQueryInterruptTime() - closed[i];
+        Drained[i] = 0;
+    }
+
+    //
+    // Note when the last request of each handle is back, to within 50 us,
+    // for up to 10 s.
+    //
+    for (wait = 0, pending = BENCH_CLOSE_HANDLES; pending != 0 && wait < 200000; wait++) {
+        now = KeQueryInterruptTime();
+        for (i = 0, pending = 0; i < BENCH_CLOSE_HANDLES; i++) {
+            if (Drained[i] == 0) {
+                if (__atomic_load_n(&Workers[i].InFlight, __ATOMIC_ACQUIRE) == 0) {
+                    Drained[i] = max(now - closed[i], 1);
+                } else {
+                    pending++;
+                }
+            }
+        }
+        if (pending != 0) {
+            usleep(50);
+        }
+    }
+    if (pending != 0) {
+        fprintf(stderr, "close: %u handles still have requests in flight\n", pending);
+        success = FALSE;
+    }
+
+    for (i = 0; i < BENCH_CLOSE_HANDLES; i++) {
+        BenchSendFileIrp(Device, &Workers[i].FileObject, IRP_MJ_CLOSE);
+        Workers[i].FileObject.Type = 0;
+    }
+
+    return success;
+}
+
+BOOLEAN
+BenchCloseMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Opens 100 handles on a controller whose commands take half a second,
+    puts 100 requests in flight on each, 10000 in all, and then closes
+    the handles one after the other. The cleanup of a handle finds its
+    requests through the handle rather than among all 10000 and cancels
+    them. Every request must come back exactly once, and cancelled only
+    if its own handle was closed.
+
+--*/
+{
+    BENCH_DEVICE     device;
+    BENCH_WORKLOAD   workload;
+    BENCH_RESULT     result;
+    EMU_STATISTICS   statistics;
+    EMU_CONFIG       config;
+    PBENCH_WORKER    workers;
+    ULONGLONG        cleanup[BENCH_CLOSE_HANDLES];
+    ULONGLONG        drained[BENCH_CLOSE_HANDLES];
+    ULONGLONG        start;
+    ULONG            i;
+    BOOLEAN          success;
+
+    if (Options.Processors * (HW_IO_QUEUE_DEPTH_MAX - 1) <
+            BENCH_CLOSE_HANDLES * BENCH_CLOSE_REQUESTS) {
+        fprintf(stderr, "close: needs -c %u or more\n",
+                BENCH_CLOSE_HANDLES * BENCH_CLOSE_REQUESTS / (HW_IO_QUEUE_DEPTH_MAX - 1) + 1);
+        return FALSE;
+    }
+
+    BenchDefaultConfig(&config);
+    config.CompletionDelay = 500000;
+    BenchDefaultWorkload(&workload);
+    workload.QueueDepth = BENCH_CLOSE_REQUESTS;
+
+    BenchClearParameterOverrides();
+    BenchOverrideParameter(L"IoQueueDepth", HW_IO_QUEUE_DEPTH_MAX);
+
+    printf("%u processors, %u handles x %u requests, %u byte I/O, %u ms per command\n",
+           Options.Processors, BENCH_CLOSE_HANDLES, BENCH_CLOSE_REQUESTS,
+           workload.BlockSize, config.CompletionDelay / 1000);
+
+    if (!BenchSetUpDevice(&config, &device)) {
+        BenchClearParameterOverrides();
+        return FALSE;
+    }
+
+    workers = ExAllocatePoolWithTag(NonPagedPool, BENCH_CLOSE_HANDLES * sizeof(BENCH_WORKER),
+                                    BENCH_POOL_TAG);
+    success = (BOOLEAN)(workers != NULL);
+    for (i = 0; success && i < BENCH_CLOSE_HANDLES; i++) {
+        success = BenchCreateWorker(i, &device, NULL, &workload, &workers[i]);
+    }
+
+    if (success) {
+        start = KeQueryInterruptTime();
+        success = BenchCloseHandles(&device, workers, cleanup, drained);
+        if (!BenchWaitForRundown(&device)) {
+            success = FALSE;
+        }
+        BenchSummarize(workers, BENCH_CLOSE_HANDLES, KeQueryInterruptTime() - start, &result);
+        EmuQueryStatistics(device.Controller, &statistics);
+
+        printf("  %-12s %9s %9s %9s %9s\n", "", "mean", "p50", "p99", "max");
+        BenchPrintTimes("cleanup us", cleanup, 10.0);
+        BenchPrintTimes("drained ms", drained, 1e4);
+        printf("  %llu requests cancelled, %llu completed, %llu commands aborted\n",
+               result.Cancelled, result.Completed, statistics.Aborts);
+        printf("  drained is from the cleanup to the last request of the handle back; the\n"
+               "  controller takes %u Aborts at a time, the other requests finish their command\n",
+               device.FdoData->AbortLimit);
+
+        if (result.DoubleCompletions != 0) {
+            fprintf(stderr, "close: %llu requests completed twice\n", result.DoubleCompletions);
+            success = FALSE;
+        }
+        if (result.WrongCancels != 0) {
+            fprintf(stderr, "close: %llu requests cancelled before their handle was closed\n",
+                    result.WrongCancels);
+            success = FALSE;
+        }
+        if (result.Errors != 0 || result.Busy != 0 ||
+            result.Cancelled + result.Completed != BENCH_CLOSE_HANDLES * BENCH_CLOSE_REQUESTS) {
+            fprintf(stderr, "close: %llu cancelled, %llu completed, %llu failed, %llu busy\n",
+                    result.Cancelled, result.Completed, result.Errors, result.Busy);
+            success = FALSE;
+        }
+        if (result.Cancelled != statistics.Aborts) {
+            fprintf(stderr, "close: %llu requests cancelled, %llu commands aborted\n",
+                    result.Cancelled, statistics.Aborts);
+            success = FALSE;
+        }
+    } else {
+        fprintf(stderr, "out of memory\n");
+    }
+
+    while (i-- != 0) {
+        BenchDeleteWorker(&workers[i]);
+    }
+    if (workers != NULL) {
+        ExFreePoolWithTag(workers, BENCH_POOL_TAG);
+    }
+
+    BenchRemoveDevice(&device);
+    BenchClearParameterOverrides();
+
+    return success;
+}
+
+//
+// Weighted round robin
+//
+
+#define BENCH_WRR_SERVICE_TIME  10000   // ns, 100k commands a second
+#define BENCH_WRR_LOW_DEPTH     256     // per low priority worker
+
+static
+BOOLEAN
+BenchRunPriorities(
+    __in  BOOLEAN       WeightedRoundRobin,
+    __out PBENCH_RESULT High,
+    __out PBENCH_RESULT Low
+    )
+/*++
+Routine Description:
+
+    Runs a high priority worker at depth 1 and a low priority one at
+    depth 256 on each processor, against a controller that fetches a
+    command every 10 us and so is saturated by the low priority ones,
+    arbitrating with weighted round robin or plain round robin.
+
+--*/
+{
+    BENCH_DEVICE    device;
+    BENCH_WORKLOAD  high, low;
+    EMU_CONFIG      config;
+    PBENCH_WORKER   workers;
+    ULONGLONG       elapsed;
+    ULONG           count = 2 * Options.Processors;
+    ULONG           i;
+    BOOLEAN         success;
+
+    RtlZeroMemory(High, sizeof(BENCH_RESULT));
+    RtlZeroMemory(Low, sizeof(BENCH_RESULT));
+
+    BenchDefaultConfig(&config);
+    config.WeightedRoundRobin = WeightedRoundRobin;
+    config.ServiceTime = BENCH_WRR_SERVICE_TIME;
+
+    BenchDefaultWorkload(&high);
+    high.QueueDepth = 1;
+    high.Hint = IoPriorityHigh;
+    low = high;
+    low.QueueDepth = BENCH_WRR_LOW_DEPTH;
+    low.Hint = IoPriorityLow;
+
+    if (!BenchSetUpDevice(&config, &device)) {
+        return FALSE;
+    }
+
+    workers = ExAllocatePoolWithTag(NonPagedPool, count * sizeof(BENCH_WORKER),
+                                    BENCH_POOL_TAG);
+    success = (BOOLEAN)(workers != NULL);
+    for (i = 0; success && i < count; i++) {
+        success = BenchCreateWorker(i, &device, NULL,
+                                    i < Options.Processors ? &high : &low, &workers[i]);
+    }
+
+    if (success) {
+        elapsed = BenchRunWorkers(workers, count, Options.Seconds);
+        success = BenchWaitForRundown(&device);
+        BenchSummarize(workers, Options.Processors, elapsed, High);
+        BenchSummarize(workers + Options.Processors, Options.Processors, elapsed, Low);
+        if (High->Errors + Low->Errors != 0 ||
+            High->DoubleCompletions + Low->DoubleCompletions != 0) {
+            fprintf(stderr, "wrr: %llu requests failed, %llu completed twice\n",
+                    High->Errors + Low->Errors,
+                    High->DoubleCompletions + Low->DoubleCompletions);
+            success = FALSE;
+        }
+    } else {
+        fprintf(stderr, "out of memory\n");
+    }
+
+    while (i-- != 0) {
+        BenchDeleteWorker(&workers[i]);
+    }
+    if (workers != NULL) {
+        ExFreePoolWithTag(workers, BENCH_POOL_TAG);
+    }
+
+    BenchRemoveDevice(&device);
+
+    return success;
+}
+
+BOOLEAN
+BenchWrrMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    The latency of high priority requests under a low priority load that
+    saturates the controller: with weighted round robin, where each
+    class has queues of its own and the controller fetches 16 high
+    priority commands for each low priority one, against shared queues,
+    where the driver only holds back some command ids from the low
+    priority requests and the high priority ones then wait in line
+    behind them. Weighted round robin must give the lower p99.
+
+--*/
+{
+    static const struct {
+        PCSTR   Name;
+        BOOLEAN WeightedRoundRobin;
+    } Settings[] = {
+        { "WRR",            TRUE },
+        { "shared queues",  FALSE },
+    };
+    BENCH_RESULT high[ARRAYSIZE(Settings)];
+    BENCH_RESULT low[ARRAYSIZE(Settings)];
+    ULONG        i;
+
+    printf("%u processors, %u s, %u ns per command; per processor 1 high priority\n"
+           "request and %u low priority ones in flight\n",
+           Options.Processors, Options.Seconds, BENCH_WRR_SERVICE_TIME, BENCH_WRR_LOW_DEPTH);
+    printf("  %-14s %-5s %10s %9s %9s %9s\n", "", "class", "IOPS", "p50 us", "p99 us", "max us");
+
+    for (i = 0; i < ARRAYSIZE(Settings); i++) {
+        if (!BenchRunPriorities(Settings[i].WeightedRoundRobin, &high[i], &low[i])) {
+            return FALSE;
+        }
+        printf("  %-14s %-5s %10.0f %9.1f %9.1f %9.1f\n", Settings[i].Name, "high",
+               high[i].Iops, high[i].P50Us, high[i].P99Us, high[i].MaxUs);
+        printf("  %-14s %-5s %10.0f %9.1f %9.1f %9.1f\n", "", "low",
+               low[i].Iops, low[i].P50Us, low[i].P99Us, low[i].MaxUs);
+    }
+
+    if (high[0].P99Us >= high[1].P99Us) {
+        fprintf(stderr, "wrr: high priority p99 %.1f us with WRR, %.1f us without\n",
+                high[0].P99Us, high[1].P99Us);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// QoS
+//
+
+#define BENCH_QOS_CHARGE_TIME   5000000     // 100ns, per setting of the charge loop
+#define BENCH_QOS_CHARGE_PROCESS 400
+
+typedef struct _BENCH_QOS_HANDLE {
+    ULONG       Process;
+    ULONG       HandleIops;         // limit, 0 for none
+    ULONG       ProcessIops;        // of the process, set on its first handle
+    ULONG       Expected;           // IOPS the limits allow, 0 for whatever is left
+} BENCH_QOS_HANDLE;
+
+//
+// Three processes: one limited as a whole, with a handle limited on its
+// own as well, one with two limited handles and one without limits,
+// which takes what the device has left.
+//
+static const BENCH_QOS_HANDLE BenchQosHandles[] = {
+    { 100, 0,      200000, 150000 },
+    { 100, 50000,  0,      50000 },
+    { 200, 150000, 0,      150000 },
+    { 200, 100000, 0,      100000 },
+    { 300, 0,      0,      0 },
+    { 300, 0,      0,      0 },
+};
+
+typedef struct _BENCH_QOS_CHARGE {
+    BENCH_WORKER    Worker;             // a handle, which sends no I/O
+    PIRP            Irp;
+    ULONGLONG       Charges;
+    ULONGLONG       Admitted;
+    ULONGLONG       CpuTime;            // ns
+    pthread_t       Thread;
+} BENCH_QOS_CHARGE, *PBENCH_QOS_CHARGE;
+
+static
+NTSTATUS
+BenchSetQosLimit(
+    __in PBENCH_WORKER Worker,
+    __in ULONG         Scope,
+    __in ULONG         Iops
+    )
+{
+    PCIDRV_QOS_LIMITS limits;
+
+    limits.Scope = Scope;
+    limits.IopsLimit = Iops;
+    limits.BandwidthLimit = 0;
+
+    return BenchSendIoctl(Worker->Device, &Worker->FileObject, IOCTL_SET_QOS_LIMITS,
+                          &limits, sizeof(limits), 0);
+}
+
+static
+ULONGLONG
+BenchThreadCpuTime(
+    VOID
+    )
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static
+PVOID
+BenchChargeLoop(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Has the limiters of a handle admit a 4 KiB read over and over, on
+    the processor of the handle, for BENCH_QOS_CHARGE_TIME.
+
+--*/
+{
+    PBENCH_QOS_CHARGE charge = (PBENCH_QOS_CHARGE)Context;
+    ULONGLONG         deadline, cpuTime;
+    ULONG             i;
+
+    ShimBindThread(charge->Worker.Processor);
+
+    cpuTime = BenchThreadCpuTime();
+    deadline = KeQueryInterruptTime() + BENCH_QOS_CHARGE_TIME;
+
+    while (KeQueryInterruptTime() < deadline) {
+        for (i = 0; i < 1024; i++) {
+            charge->Admitted += PciDrvQosAdmitRequest(charge->Irp);
+        }
+        charge->Charges += 1024;
+    }
+
+    charge->CpuTime = BenchThreadCpuTime() - cpuTime;
+
+    return NULL;
+}
+
+static
+BOOLEAN
+BenchMeasureCharges(
+    __in PBENCH_DEVICE Device
+    )
+/*++
+Routine Description:
+
+    Times the charge a read takes in the dispatch path, from one thread
+    per processor on a handle each of one process, against no limits,
+    against a limit of each handle and against those and a limit of the
+    process all threads charge. The limits are high enough for every
+    charge to go through, so that each is a compare-exchange of a bucket
+    or two.
+
+--*/
+{
+    static const struct {
+        PCSTR   Name;
+        ULONG   HandleIops;
+        ULONG   ProcessIops;
+    } Settings[] = {
+        { "no limits",         0,          0 },
+        { "handle",            MAXULONG,   0 },
+        { "handle + process",  MAXULONG,   MAXULONG },
+    };
+    PBENCH_QOS_CHARGE  charges;
+    BENCH_WORKLOAD     workload;
+    PBENCH_WORKER      worker;
+    PIO_STACK_LOCATION stack;
+    ULONGLONG          total, admitted, cpuTime;
+    ULONG              count = Options.Processors;
+    ULONG              created, setting, i;
+    BOOLEAN            success;
+
+    BenchDefaultWorkload(&workload);
+    workload.QueueDepth = 1;
+
+    charges = ExAllocatePoolWithTag(NonPagedPool, count * sizeof(BENCH_QOS_CHARGE),
+                                    BENCH_POOL_TAG);
+    if (charges == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return FALSE;
+    }
+    RtlZeroMemory(charges, count * sizeof(BENCH_QOS_CHARGE));
+
+    success = TRUE;
+    ShimSetCurrentProcess((HANDLE)BENCH_QOS_CHARGE_PROCESS);
+    for (created = 0; success && created < count; created++) {
+        worker = &charges[created].Worker;
+        success = BenchCreateWorker(created, Device, NULL, &workload, worker);
+        charges[created].Irp = IoAllocateIrp(worker->Target->StackSize, FALSE);
+        if (!success || charges[created].Irp == NULL) {
+            success = FALSE;
+            break;
+        }
+        stack = IoGetNextIrpStackLocation(charges[created].Irp);
+        stack->MajorFunction = IRP_MJ_READ;
+        stack->Parameters.Read.Length = workload.BlockSize;
+        stack->FileObject = &worker->FileObject;
+        IoSetNextIrpStackLocation(charges[created].Irp);
+    }
+    ShimSetCurrentProcess((HANDLE)4);
+
+    printf("  %-18s %12s %10s %14s\n", "charge", "charges/s", "ns each", "CPU at 1M IOPS");
+
+    for (setting = 0; success && setting < ARRAYSIZE(Settings); setting++) {
+        for (i = 0; i < count; i++) {
+            worker = &charges[i].Worker;
+            if (!NT_SUCCESS(BenchSetQosLimit(worker, PCIDRV_QOS_SCOPE_HANDLE,
+                                             Settings[setting].HandleIops)) ||
+                !NT_SUCCESS(BenchSetQosLimit(worker, PCIDRV_QOS_SCOPE_PROCESS,
+                                             Settings[setting].ProcessIops))) {
+                fprintf(stderr, "qos: limits not set\n");
+                success = FALSE;
+            }
+            charges[i].Charges = charges[i].Admitted = charges[i].CpuTime = 0;
+        }
+        for (i = 0; success && i < count; i++) {
+            success = (BOOLEAN)(pthread_create(&charges[i].Thread, NULL,
+                                               BenchChargeLoop, &charges[i]) == 0);
+        }
+        while (i-- != 0) {
+            pthread_join(charges[i].Thread, NULL);
+        }
+        if (!success) {
+            break;
+        }
+
+        total = admitted = cpuTime = 0;
+        for (i = 0; i < count; i++) {
+            total += charges[i].Charges;
+            admitted += charges[i].Admitted;
+            cpuTime += charges[i].CpuTime;
+        }
+        printf("  %-18s %12.0f %10.1f %13.2f%%\n", Settings[setting].Name,
+               total * 1e7 / BENCH_QOS_CHARGE_TIME, (double)cpuTime / total,
+               (double)cpuTime / total / 10);
+        if (admitted != total) {
+            fprintf(stderr, "qos: %llu of %llu charges refused\n", total - admitted, total);
+            success = FALSE;
+        }
+    }
+
+    for (i = 0; i < count && i <= created; i++) {
+        if (charges[i].Irp != NULL) {
+            IoFreeIrp(charges[i].Irp);
+        }
+        BenchDeleteWorker(&charges[i].Worker);
+    }
+    ExFreePoolWithTag(charges, BENCH_POOL_TAG);
+
+    return success;
+}
+
+BOOLEAN
+BenchQosMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Six handles of three processes, each reading at depth 32 with some
+    IOPS limits on the handles and one on a process, share the device:
+    the limited handles get up to their limits and the others what the
+    device has left. No handle or process may go over its limit by more
+    than a burst. Then the cost of a charge of the limiters, which the
+    dispatch path pays for every read and write, and what it comes to
+    at 1M IOPS.
+
+--*/
+{
+    BENCH_DEVICE     device;
+    BENCH_WORKLOAD   workload;
+    BENCH_RESULT     result, total;
+    EMU_CONFIG       config;
+    BENCH_WORKER     workers[ARRAYSIZE(BenchQosHandles)];
+    double           iops[ARRAYSIZE(BenchQosHandles)];
+    double           allowance, processIops;
+    ULONGLONG        elapsed;
+    ULONG            i, j;
+    BOOLEAN          success;
+
+    BenchDefaultConfig(&config);
+    BenchDefaultWorkload(&workload);
+
+    printf("%u processors, %u s, %u byte reads, %u handles in 3 processes, depth %u each\n",
+           Options.Processors, Options.Seconds, workload.BlockSize,
+           (ULONG)ARRAYSIZE(BenchQosHandles), workload.QueueDepth);
+
+    if (!BenchSetUpDevice(&config, &device)) {
+        return FALSE;
+    }
+
+    success = TRUE;
+    for (i = 0; success && i < ARRAYSIZE(BenchQosHandles); i++) {
+        ShimSetCurrentProcess((HANDLE)(ULONG_PTR)BenchQosHandles[i].Process);
+        success = BenchCreateWorker(i, &device, NULL, &workload, &workers[i]);
+        if (success && BenchQosHandles[i].HandleIops != 0) {
+            success = NT_SUCCESS(BenchSetQosLimit(&workers[i], PCIDRV_QOS_SCOPE_HANDLE,
+                                                  BenchQosHandles[i].HandleIops));
+        }
+        if (success && BenchQosHandles[i].ProcessIops != 0) {
+            success = NT_SUCCESS(BenchSetQosLimit(&workers[i], PCIDRV_QOS_SCOPE_PROCESS,
+                                                  BenchQosHandles[i].ProcessIops));
+        }
+    }
+    ShimSetCurrentProcess((HANDLE)4);
+
+    if (success) {
+        elapsed = BenchRunWorkers(workers, ARRAYSIZE(BenchQosHandles), Options.Seconds);
+        success = BenchWaitForRundown(&device);
+        BenchSummarize(workers, ARRAYSIZE(BenchQosHandles), elapsed, &total);
+
+        //
+        // A limit lets a handle or a process go over it by one burst, in
+        // the whole run, and the run is timed from the worker threads.
+        //
+        allowance = (elapsed + PCIDRV_QOS_BURST) * 1.02 / elapsed;
+
+        printf("  %-8s %-8s %10s %10s %8s %9s\n",
+               "process", "handle", "expected", "IOPS", "share", "p99 us");
+        for (i = 0; i < ARRAYSIZE(BenchQosHandles); i++) {
+            BenchSummarize(&workers[i], 1, elapsed, &result);
+            iops[i] = result.Iops;
+            printf("  %-8u %-8u %10u %10.0f %7.1f%% %9.1f\n",
+                   BenchQosHandles[i].Process, i, BenchQosHandles[i].Expected,
+                   result.Iops, 100.0 * result.Iops / total.Iops, result.P99Us);
+            if (BenchQosHandles[i].HandleIops != 0 &&
+                result.Iops > BenchQosHandles[i].HandleIops * allowance) {
+                fprintf(stderr, "qos: handle %u at %.0f IOPS, limited to %u\n",
+                        i, result.Iops, BenchQosHandles[i].HandleIops);
+                success = FALSE;
+            }
+        }
+        for (i = 0; i < ARRAYSIZE(BenchQosHandles); i++) {
+            if (BenchQosHandles[i].ProcessIops == 0) {
+                continue;
+            }
+            processIops = 0;
+            for (j = 0; j < ARRAYSIZE(BenchQosHandles); j++) {
+                if (BenchQosHandles[j].Process == BenchQosHandles[i].Process) {
+                    processIops += iops[j];
+                }
+            }
+            if (processIops > BenchQosHandles[i].ProcessIops * allowance) {
+                fprintf(stderr, "qos: process %u at %.0f IOPS, limited to %u\n",
+                        BenchQosHandles[i].Process, processIops,
+                        BenchQosHandles[i].ProcessIops);
+                success = FALSE;
+            }
+        }
+        printf("  %-17s %10s %10.0f\n", "device", "", total.Iops);
+
+        if (total.Errors != 0 || total.DoubleCompletions != 0) {
+            fprintf(stderr, "qos: %llu requests failed, %llu completed twice\n",
+                    total.Errors, total.DoubleCompletions);
+            success = FALSE;
+        }
+
+        if (success && !BenchMeasureCharges(&device)) {
+            success = FALSE;
+        }
+    } else {
+        fprintf(stderr, "qos: handles not set up\n");
+    }
+
+    while (i-- != 0) {
+        BenchDeleteWorker(&workers[i]);
+    }
+
+    BenchRemoveDevice(&device);
+
+    return success;
+}
+
+//
+// Read cache
+//
+
+#define BENCH_ZIPF_THETA        0.99
+#define BENCH_ZIPF_DELAY        100         // us a command takes
+
+static
+VOID
+BenchQueryCache(
+    __in PBENCH_DEVICE Device,
+    __in PVOID         Context
+    )
+{
+    PPCIDRV_CACHE_STATISTICS statistics = (PPCIDRV_CACHE_STATISTICS)Context;
+    FILE_OBJECT              fileObject;
+
+    RtlZeroMemory(statistics, sizeof(PCIDRV_CACHE_STATISTICS));
+
+    if (NT_SUCCESS(BenchOpen(Device, &fileObject))) {
+        BenchSendIoctl(Device, &fileObject, IOCTL_GET_CACHE_STATISTICS,
+                       statistics, 0, sizeof(PCIDRV_CACHE_STATISTICS));
+        BenchClose(Device, &fileObject);
+    }
+}
+
+BOOLEAN
+BenchZipfMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Random reads of a controller whose commands take 100 us, uniform and
+    Zipfian with a skew of 0.99 over the namespace, without the read
+    cache and with caches of 64 and 256 MB. A hit costs a copy, so with
+    the skewed reads the cache must serve most of them, and bring the
+    median latency down.
+
+--*/
+{
+    static const struct {
+        BOOLEAN Zipf;
+        ULONG   CacheSize;      // MB
+    } Runs[] = {
+        { FALSE, 0 },
+        { FALSE, 256 },
+        { TRUE,  0 },
+        { TRUE,  64 },
+        { TRUE,  256 },
+    };
+    PCIDRV_CACHE_STATISTICS cache[ARRAYSIZE(Runs)];
+    BENCH_RESULT            results[ARRAYSIZE(Runs)];
+    BENCH_WORKLOAD          uniform, zipf;
+    EMU_STATISTICS          statistics;
+    EMU_CONFIG              config;
+    ULONG                   i;
+    BOOLEAN                 success = TRUE;
+
+    BenchDefaultConfig(&config);
+    config.CompletionDelay = BENCH_ZIPF_DELAY;
+    BenchDefaultWorkload(&uniform);
+    uniform.WritePercent = 0;
+    zipf = uniform;
+    BenchSetZipf(&zipf, BENCH_ZIPF_THETA,
+                 config.Blocks / (zipf.BlockSize >> config.LbaShift));
+
+    printf("%u processors, %u threads x %u, %u byte reads of a %llu GB namespace, "
+           "%u us per command\n",
+           Options.Processors, Options.Threads, uniform.QueueDepth, uniform.BlockSize,
+           BENCH_NAMESPACE_BYTES >> 30, BENCH_ZIPF_DELAY);
+    printf("  %-12s %-6s %10s %8s %10s %9s %9s\n",
+           "reads", "cache", "IOPS", "hits", "hit us", "p50 us", "p99 us");
+
+    for (i = 0; i < ARRAYSIZE(Runs); i++) {
+        BenchClearParameterOverrides();
+        BenchOverrideParameter(L"ReadCacheSize", Runs[i].CacheSize);
+
+        if (!BenchRunDevice(&config, Runs[i].Zipf ? &zipf : &uniform, &results[i],
+                            &statistics, BenchQueryCache, &cache[i])) {
+            success = FALSE;
+            break;
+        }
+
+        printf("  %-12s %3u MB %10.0f %7.1f%% %10.2f %9.1f %9.1f\n",
+               Runs[i].Zipf ? "Zipf 0.99" : "uniform", Runs[i].CacheSize,
+               results[i].Iops,
+               cache[i].Lookups != 0 ? 100.0 * cache[i].Hits / cache[i].Lookups : 0.0,
+               cache[i].Hits != 0 ? cache[i].HitTime / 10.0 / cache[i].Hits : 0.0,
+               results[i].P50Us, results[i].P99Us);
+    }
+
+    BenchClearParameterOverrides();
+
+    if (success &&
+        (cache[4].Hits * 2 < cache[4].Lookups || results[4].P50Us >= results[2].P50Us)) {
+        fprintf(stderr, "zipf: %llu hits of %llu with 256 MB, p50 %.1f us against %.1f\n",
+                cache[4].Hits, cache[4].Lookups, results[4].P50Us, results[2].P50Us);
+        success = FALSE;
+    }
+
+    return success;
+}
+
+
+//
+// End-to-end protection
+//
+
+#define BENCH_PI_POLYNOMIAL     0x8BB7
+#define BENCH_PI_CHECK          0xD0DB      // CRC16 T10-DIF of "123456789"
+#define BENCH_PI_BLOCK          4096
+#define BENCH_PI_MAX_LOSS       5.0         // %
+
+static
+USHORT
+BenchCrc16Bitwise(
+    __in USHORT Crc,
+    __in PUCHAR Buffer,
+    __in SIZE_T Length
+    )
+{
+    ULONG bit;
+
+    while (Length-- != 0) {
+        Crc ^= (USHORT)(*Buffer++ << 8);
+        for (bit = 0; bit < 8; bit++) {
+            Crc = (Crc & 0x8000) ? (USHORT)(Crc << 1) ^ BENCH_PI_POLYNOMIAL : (USHORT)(Crc << 1);
+        }
+    }
+
+    return Crc;
+}
+
+static
+BOOLEAN
+BenchCheckCrc16(
+    __in PUCHAR Buffer,
+    __in ULONG  Length
+    )
+/*++
+Routine Description:
+
+    Checks HwCrc16, with whichever kernel it picked, against the bitwise
+    CRC: every length up to 1 KiB at every alignment within 16 bytes, and
+    split in two at every offset up to 256 bytes.
+
+--*/
+{
+    ULONG  length, offset;
+    USHORT crc;
+
+    if (HwCrc16(0, "123456789", 9) != BENCH_PI_CHECK) {
+        fprintf(stderr, "pi: CRC16 of the check string is 0x%04x\n",
+                HwCrc16(0, "123456789", 9));
+        return FALSE;
+    }
+
+    for (length = 0; length <= 1024 && length + 16 <= Length; length++) {
+        for (offset = 0; offset < 16; offset++) {
+            crc = BenchCrc16Bitwise(0, Buffer + offset, length);
+            if (HwCrc16(0, Buffer + offset, length) != crc ||
+                (length <= 256 &&
+                 HwCrc16(HwCrc16(0, Buffer, offset), Buffer + offset, length) !=
+                 BenchCrc16Bitwise(0, Buffer, offset + length))) {
+                fprintf(stderr, "pi: CRC16 wrong for %u bytes at %u\n", length, offset);
+                return FALSE;
+            }
+        }
+    }
+
+    if (HwCrc16(0, Buffer, Length) != BenchCrc16Bitwise(0, Buffer, Length)) {
+        fprintf(stderr, "pi: CRC16 wrong for %u bytes\n", Length);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+double
+BenchTimeCrc16(
+    __in PUCHAR Buffer,
+    __in ULONG  Length
+    )
+/*++
+Routine Description:
+
+    GB/s of HwCrc16 over a buffer a block at a time, as the driver runs
+    it over a transfer, for about half a second. The clock is read once
+    per MiB, so that reading it does not count.
+
+--*/
+{
+    ULONGLONG start, elapsed, bytes = 0;
+    ULONG     offset, batch;
+    volatile USHORT crc;
+
+    start = BenchThreadCpuTime();
+    do {
+        for (batch = 0; batch < (1 << 20); batch += Length) {
+            for (offset = 0; offset < Length; offset += BENCH_PI_BLOCK) {
+                crc = HwCrc16(0, Buffer + offset, BENCH_PI_BLOCK);
+            }
+        }
+        bytes += batch;
+        elapsed = BenchThreadCpuTime() - start;
+    } while (elapsed < 500000000ULL);
+
+    (VOID)crc;
+
+    return (double)bytes / elapsed;
+}
+
+static
+ULONGLONG
+BenchProcessCpuTime(
+    VOID
+    )
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static
+VOID
+BenchQueryProtection(
+    __in PBENCH_DEVICE Device,
+    __in PVOID         Context
+    )
+{
+    *(PUCHAR)Context = Device->FdoData->PiType;
+}
+
+BOOLEAN
+BenchPiMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    What Type 1 protection information costs. First HwCrc16 is checked
+    against a bitwise CRC and timed over 4 and 128 KiB. Then reads and
+    writes of 4 and 128 KiB go to a namespace of 4 KiB blocks, without PI
+    and with 8 bytes of it in separate metadata, which the driver
+    generates for writes and checks for reads and the controller checks
+    and returns. The controller takes 8 us to fetch a 4 KiB command and
+    40 us a 128 KiB one, as a drive whose media is the bound would, so
+    the processors have the headroom PI needs. PI must cost less than 5%
+    of the I/O rate; the host CPU time per I/O, which excludes that of
+    the controller's threads, shows what it costs the processors.
+
+--*/
+{
+    static const struct {
+        ULONG   BlockSize;
+        ULONG   ServiceTime;    // ns
+    } Sizes[] = {
+        { 4096,   8000 },
+        { 131072, 40000 },
+    };
+    BENCH_RESULT   results[2];
+    BENCH_WORKLOAD workload;
+    EMU_STATISTICS statistics;
+    EMU_CONFIG     config;
+    ULONGLONG      cpu[2];
+    PUCHAR         buffer;
+    double         rate[ARRAYSIZE(Sizes)];     // GB/s of HwCrc16
+    double         loss;
+    ULONG          i, type, length;
+    UCHAR          piType;
+    BOOLEAN        success = TRUE;
+
+    length = Sizes[ARRAYSIZE(Sizes) - 1].BlockSize + 16;
+    buffer = ExAllocatePoolWithTag(NonPagedPool, length, BENCH_POOL_TAG);
+    if (buffer == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return FALSE;
+    }
+    for (i = 0; i < length; i++) {
+        buffer[i] = (UCHAR)(i * 2654435761U >> 24);
+    }
+
+    if (!BenchCheckCrc16(buffer, length)) {
+        ExFreePoolWithTag(buffer, BENCH_POOL_TAG);
+        return FALSE;
+    }
+
+    printf("CRC16 T10-DIF, %s kernel, checked against the bitwise CRC\n",
+#if defined(_M_AMD64)
+           __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3") ?
+           "PCLMULQDQ" : "table");
+#else
+           "table");
+#endif
+    for (i = 0; i < ARRAYSIZE(Sizes); i++) {
+        rate[i] = BenchTimeCrc16(buffer, Sizes[i].BlockSize);
+        printf("  %3u KiB: %5.2f GB/s\n", Sizes[i].BlockSize >> 10, rate[i]);
+    }
+    ExFreePoolWithTag(buffer, BENCH_POOL_TAG);
+
+    BenchDefaultConfig(&config);
+    config.LbaShift = 12;
+    config.Blocks = BENCH_NAMESPACE_BYTES >> config.LbaShift;
+    BenchDefaultWorkload(&workload);
+    workload.WritePercent = 50;
+
+    printf("%u processors, %u threads x %u, half writes, 4 KiB blocks\n",
+           Options.Processors, Options.Threads, workload.QueueDepth);
+    printf("  %-8s %-4s %8s %10s %10s %9s %12s\n",
+           "size", "PI", "fetch us", "IOPS", "MB/s", "p99 us", "host us/IO");
+
+    for (i = 0; success && i < ARRAYSIZE(Sizes); i++) {
+
+        config.ServiceTime = Sizes[i].ServiceTime;
+        workload.BlockSize = Sizes[i].BlockSize;
+
+        for (type = 0; type < 2; type++) {
+
+            config.ProtectionType = (UCHAR)type;
+            piType = 0xFF;
+            cpu[type] = BenchProcessCpuTime();
+
+            if (!BenchRunDevice(&config, &workload, &results[type], &statistics,
+                                BenchQueryProtection, &piType) ||
+                piType != type || statistics.ProtectionErrors != 0) {
+                fprintf(stderr, "pi: run failed, PI type %u, %llu PI errors\n",
+                        piType, statistics.ProtectionErrors);
+                success = FALSE;
+                break;
+            }
+
+            cpu[type] = BenchProcessCpuTime() - cpu[type] - statistics.ThreadTime;
+
+            printf("  %3u KiB  %-4s %8.1f %10.0f %10.0f %9.1f %12.2f\n",
+                   Sizes[i].BlockSize >> 10, type != 0 ? "on" : "off",
+                   Sizes[i].ServiceTime / 1000.0, results[type].Iops,
+                   results[type].Iops * Sizes[i].BlockSize / 1e6, results[type].P99Us,
+                   cpu[type] / 1000.0 / results[type].Completed);
+        }
+
+        if (success) {
+            loss = 100.0 * (1.0 - results[1].Iops / results[0].Iops);
+            printf("  %3u KiB  PI costs %.1f%% of the I/O rate, %+.2f us of host CPU per I/O "
+                   "(the CRC %.2f us)\n",
+                   Sizes[i].BlockSize >> 10, loss,
+                   (cpu[1] / (double)results[1].Completed - cpu[0] / (double)results[0].Completed) /
+                   1000.0,
+                   Sizes[i].BlockSize / rate[i] / 1000.0);
+            if (loss >= BENCH_PI_MAX_LOSS) {
+                fprintf(stderr, "pi: %.1f%% fewer IOPS with PI at %u KiB\n",
+                        loss, Sizes[i].BlockSize >> 10);
+                success = FALSE;
+            }
+        }
+    }
+
+    return success;
+}
+
+
+//
+// False sharing
+//
+
+#define BENCH_SHARE_WRITERS     3
+#define BENCH_SHARE_SECONDS     1
+
+//
+// The three groups as they were laid out before they were fenced: on one
+// line, as neighbours in the extension.
+//
+typedef struct _BENCH_SHARED_GROUPS {
+    ULONG       OutstandingIO;
+    LONG        CompletionDpcsPending;
+    LONG        AbortsOutstanding;
+    KSPIN_LOCK  QueueLock;
+} DECLSPEC_CACHEALIGN BENCH_SHARED_GROUPS;
+
+typedef struct _BENCH_SHARE_WRITER {
+    ULONG               Index;
+    pthread_t           Thread;
+    volatile LONG       *Counter;       // writers 0 and 1
+    PKSPIN_LOCK         Lock;           // writer 2
+    volatile BOOLEAN    *Stop;
+    ULONGLONG           Operations;
+} BENCH_SHARE_WRITER, *PBENCH_SHARE_WRITER;
+
+static
+PVOID
+BenchShareLoop(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    What the I/O path does to one group, as fast as it can: a reference
+    taken and dropped, a DPC counted in and out, or the queue lock taken
+    and released.
+
+--*/
+{
+    PBENCH_SHARE_WRITER writer = (PBENCH_SHARE_WRITER)Context;
+    ULONGLONG           operations = 0;
+    KIRQL               oldIrql;
+    ULONG               i;
+
+    ShimBindThread(writer->Index % Options.Processors);
+
+    while (!*writer->Stop) {
+        for (i = 0; i < 1024; i++) {
+            if (writer->Lock != NULL) {
+                KeAcquireSpinLock(writer->Lock, &oldIrql);
+                KeReleaseSpinLock(writer->Lock, oldIrql);
+            } else {
+                InterlockedIncrement(writer->Counter);
+                InterlockedDecrement(writer->Counter);
+            }
+        }
+        operations += i;
+    }
+
+    writer->Operations = operations;
+
+    return NULL;
+}
+
+static
+double
+BenchShareGroups(
+    __in volatile LONG *OutstandingIO,
+    __in volatile LONG *CompletionDpcsPending,
+    __in PKSPIN_LOCK    QueueLock,
+    __out double       *PerWriter
+    )
+/*++
+Routine Description:
+
+    Runs one writer per group on processors of their own for a second,
+    and returns the operations per microsecond of all of them.
+
+--*/
+{
+    BENCH_SHARE_WRITER writers[BENCH_SHARE_WRITERS];
+    volatile BOOLEAN   stop = FALSE;
+    ULONGLONG          total = 0;
+    ULONG              i;
+
+    RtlZeroMemory(writers, sizeof(writers));
+    writers[0].Counter = OutstandingIO;
+    writers[1].Counter = CompletionDpcsPending;
+    writers[2].Lock = QueueLock;
+
+    for (i = 0; i < BENCH_SHARE_WRITERS; i++) {
+        writers[i].Index = i;
+        writers[i].Stop = &stop;
+        pthread_create(&writers[i].Thread, NULL, BenchShareLoop, &writers[i]);
+    }
+
+    sleep(BENCH_SHARE_SECONDS);
+    stop = TRUE;
+
+    for (i = 0; i < BENCH_SHARE_WRITERS; i++) {
+        pthread_join(writers[i].Thread, NULL);
+        PerWriter[i] = writers[i].Operations / (BENCH_SHARE_SECONDS * 1e6);
+        total += writers[i].Operations;
+    }
+
+    return total / (BENCH_SHARE_SECONDS * 1e6);
+}
+
+BOOLEAN
+BenchShareMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    What the padding around the groups of FDO_DATA written on the I/O
+    path buys. A writer per group (OutstandingIO, CompletionDpcsPending,
+    QueueLock) works it from a processor of its own: first with the three
+    groups on one cache line, then in an FDO_DATA placed 8 bytes past a
+    line, as an extension after a device object may be. False sharing
+    needs the writers on different host processors (-c 3 or more on a
+    host with 3 or more); on one, both runs should match.
+
+--*/
+{
+    BENCH_SHARED_GROUPS *shared;
+    PFDO_DATA           fdoData;
+    PUCHAR              allocation;
+    double              perWriter[2][BENCH_SHARE_WRITERS];
+    double              total[2];
+    ULONG               i;
+    BOOLEAN             success = TRUE;
+
+    allocation = ExAllocatePoolWithTag(NonPagedPool,
+                                       sizeof(BENCH_SHARED_GROUPS) + sizeof(FDO_DATA) +
+                                       2 * SYSTEM_CACHE_ALIGNMENT_SIZE,
+                                       BENCH_POOL_TAG);
+    if (allocation == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return FALSE;
+    }
+    RtlZeroMemory(allocation, sizeof(BENCH_SHARED_GROUPS) + sizeof(FDO_DATA) +
+                  2 * SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    shared = (BENCH_SHARED_GROUPS *)(((ULONG_PTR)allocation + SYSTEM_CACHE_ALIGNMENT_SIZE - 1) &
+                                     ~(ULONG_PTR)(SYSTEM_CACHE_ALIGNMENT_SIZE - 1));
+    fdoData = (PFDO_DATA)((PUCHAR)(shared + 1) + 8);
+    KeInitializeSpinLock(&shared->QueueLock);
+    KeInitializeSpinLock(&fdoData->QueueLock);
+
+    total[0] = BenchShareGroups((volatile LONG *)&shared->OutstandingIO,
+                                &shared->CompletionDpcsPending, &shared->QueueLock,
+                                perWriter[0]);
+    total[1] = BenchShareGroups((volatile LONG *)&fdoData->OutstandingIO,
+                                &fdoData->CompletionDpcsPending, &fdoData->QueueLock,
+                                perWriter[1]);
+
+    printf("%ld host processors, a writer per group, operations per us\n",
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  %-20s %14s %14s %10s %10s\n",
+           "groups", "OutstandingIO", "DpcsPending", "QueueLock", "total");
+    for (i = 0; i < 2; i++) {
+        printf("  %-20s %14.1f %14.1f %10.1f %10.1f\n",
+               i == 0 ? "one line" : "FDO_DATA, line + 8",
+               perWriter[i][0], perWriter[i][1], perWriter[i][2], total[i]);
+    }
+    printf("  padded/one line: %.2fx\n", total[1] / total[0]);
+
+    if (shared->OutstandingIO != 0 || shared->CompletionDpcsPending != 0 ||
+        fdoData->OutstandingIO != 0 || fdoData->CompletionDpcsPending != 0) {
+        fprintf(stderr, "share: counters left at %u %d %u %d\n",
+                shared->OutstandingIO, shared->CompletionDpcsPending,
+                fdoData->OutstandingIO, fdoData->CompletionDpcsPending);
+        success = FALSE;
+    }
+
+    ExFreePoolWithTag(allocation, BENCH_POOL_TAG);
+
+    return success;
+}
+
+
+//
+// Pool allocations
+//
+
+#define BENCH_POOL_WARMUP       500         // ms before counting
+#define BENCH_POOL_MARGIN       250         // ms left after counting
+
+typedef struct _BENCH_POOL_SAMPLE {
+    pthread_t       Thread;
+    ULONG           Window;                 // ms counted
+    SHIM_STATISTICS Start;
+    SHIM_STATISTICS End;
+} BENCH_POOL_SAMPLE, *PBENCH_POOL_SAMPLE;
+
+static
+PVOID
+BenchSamplePool(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Counts what the kernel hands out while the workers are running,
+    leaving out their start, where handles are opened, and their stop.
+
+--*/
+{
+    PBENCH_POOL_SAMPLE sample = (PBENCH_POOL_SAMPLE)Context;
+
+    usleep(BENCH_POOL_WARMUP * 1000);
+    ShimQueryStatistics(&sample->Start);
+    usleep(sample->Window * 1000);
+    ShimQueryStatistics(&sample->End);
+
+    return NULL;
+}
+
+static
+BOOLEAN
+BenchCountAllocations(
+    __in  PEMU_CONFIG        Config,
+    __in  PBENCH_WORKLOAD    Workload,
+    __out PBENCH_RESULT      Result,
+    __out PBENCH_POOL_SAMPLE Sample
+    )
+/*++
+Routine Description:
+
+    BenchRunDevice, with the kernel's counters sampled in the middle of
+    the run.
+
+--*/
+{
+    BENCH_DEVICE   device;
+    EMU_STATISTICS statistics;
+    PBENCH_WORKER  workers;
+    ULONGLONG      elapsed;
+    ULONG          i;
+    BOOLEAN        success;
+
+    RtlZeroMemory(Result, sizeof(BENCH_RESULT));
+    RtlZeroMemory(Sample, sizeof(BENCH_POOL_SAMPLE));
+    Sample->Window = Options.Seconds * 1000 - BENCH_POOL_WARMUP - BENCH_POOL_MARGIN;
+
+    if (!BenchSetUpDevice(Config, &device)) {
+        return FALSE;
+    }
+
+    workers = ExAllocatePoolWithTag(NonPagedPool, Options.Threads * sizeof(BENCH_WORKER),
+                                    BENCH_POOL_TAG);
+    success = (BOOLEAN)(workers != NULL);
+    for (i = 0; success && i < Options.Threads; i++) {
+        success = BenchCreateWorker(i, &device, NULL, Workload, &workers[i]);
+    }
+
+    if (success && pthread_create(&Sample->Thread, NULL, BenchSamplePool, Sample) == 0) {
+        elapsed = BenchRunWorkers(workers, Options.Threads, Options.Seconds);
+        pthread_join(Sample->Thread, NULL);
+        success = BenchWaitForRundown(&device);
+        BenchSummarize(workers, Options.Threads, elapsed, Result);
+        EmuQueryStatistics(device.Controller, &statistics);
+        if (Result->Errors != 0 || Result->DataErrors != 0 || statistics.DataErrors != 0 ||
+            statistics.ProtectionErrors != 0 || Result->DoubleCompletions != 0) {
+            success = FALSE;
+        }
+    } else {
+        fprintf(stderr, "out of memory\n");
+        success = FALSE;
+    }
+
+    while (i-- != 0) {
+        BenchDeleteWorker(&workers[i]);
+    }
+    if (workers != NULL) {
+        ExFreePoolWithTag(workers, BENCH_POOL_TAG);
+    }
+
+    BenchRemoveDevice(&device);
+
+    return success;
+}
+
+BOOLEAN
+BenchPoolMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Pool allocations per I/O once the driver is running: reads and writes
+    of 4 and 128 KiB, polled, through the read cache and with PI. All of
+    the driver's per-command state is allocated with the queues and its
+    small blocks come from lookaside lists, so none of them may allocate
+    at all; an IRP or MDL allocated per I/O fails the mode too.
+
+--*/
+{
+    static const struct {
+        PCSTR   Name;
+        ULONG   BlockSize;
+        BOOLEAN Polled;
+        ULONG   CacheSize;      // MB
+        UCHAR   ProtectionType;
+    } Runs[] = {
+        { "4 KiB",          4096,   FALSE, 0,  0 },
+        { "128 KiB",        131072, FALSE, 0,  0 },
+        { "4 KiB polled",   4096,   TRUE,  0,  0 },
+        { "4 KiB cache",    4096,   FALSE, 64, 0 },
+        { "4 KiB PI",       4096,   FALSE, 0,  1 },
+    };
+    BENCH_POOL_SAMPLE sample;
+    BENCH_WORKLOAD    workload;
+    BENCH_RESULT      result;
+    EMU_CONFIG        config;
+    ULONGLONG         completions, allocations;
+    BOOLEAN           polled = Options.Polled;
+    ULONG             i;
+    BOOLEAN           success = TRUE;
+
+    if (Options.Seconds * 1000 <= BENCH_POOL_WARMUP + BENCH_POOL_MARGIN) {
+        fprintf(stderr, "pool: needs -s 1 or more\n");
+        return FALSE;
+    }
+
+    BenchDefaultConfig(&config);
+    config.LbaShift = 12;
+    config.Blocks = BENCH_NAMESPACE_BYTES >> config.LbaShift;
+    BenchDefaultWorkload(&workload);
+    workload.WritePercent = 50;
+
+    printf("%u processors, %u threads x %u, half writes, counted over %u ms of each run\n",
+           Options.Processors, Options.Threads, workload.QueueDepth,
+           Options.Seconds * 1000 - BENCH_POOL_WARMUP - BENCH_POOL_MARGIN);
+    printf("  %-14s %10s %10s %8s %10s %10s\n",
+           "I/O", "IOPS", "completed", "pool", "IRPs+MDLs", "pool/IO");
+
+    for (i = 0; i < ARRAYSIZE(Runs); i++) {
+
+        BenchClearParameterOverrides();
+        BenchOverrideParameter(L"ReadCacheSize", Runs[i].CacheSize);
+        Options.Polled = Runs[i].Polled;
+        config.ProtectionType = Runs[i].ProtectionType;
+        workload.BlockSize = Runs[i].BlockSize;
+
+        if (!BenchCountAllocations(&config, &workload, &result, &sample)) {
+            success = FALSE;
+            break;
+        }
+
+        completions = sample.End.Completions - sample.Start.Completions;
+        allocations = sample.End.PoolAllocations - sample.Start.PoolAllocations;
+
+        printf("  %-14s %10.0f %10llu %8llu %10llu %10.6f\n",
+               Runs[i].Name, result.Iops, completions, allocations,
+               (sample.End.IrpAllocations - sample.Start.IrpAllocations) +
+               (sample.End.MdlAllocations - sample.Start.MdlAllocations),
+               completions != 0 ? (double)allocations / completions : 0.0);
+
+        if (completions == 0 || allocations != 0 ||
+            sample.End.IrpAllocations != sample.Start.IrpAllocations ||
+            sample.End.MdlAllocations != sample.Start.MdlAllocations) {
+            fprintf(stderr, "pool: %llu pool, %llu IRP and %llu MDL allocations in %llu I/Os\n",
+                    allocations, sample.End.IrpAllocations - sample.Start.IrpAllocations,
+                    sample.End.MdlAllocations - sample.Start.MdlAllocations, completions);
+            success = FALSE;
+        }
+    }
+
+    BenchClearParameterOverrides();
+    Options.Polled = polled;
+
+    return success;
+}
+
+
+//
+// Stripe scaling
+//
+
+#define BENCH_STRIPE_SERVICE_TIME   100000      // ns per command, one stripe unit
+
+static
+BOOLEAN
+BenchRunStripe(
+    __in  PEMU_CONFIG     Config,
+    __in  ULONG           Members,
+    __in  PBENCH_WORKLOAD Workload,
+    __out PBENCH_RESULT   Result,
+    __out PULONGLONG      Irps
+    )
+/*++
+Routine Description:
+
+    BenchRunDevice on a stripe set of Members controllers: the workers
+    open their handles on the first member and send their requests to
+    the stripe device. Irps is the number of IRPs allocated while they
+    ran, the children the requests were split into.
+
+--*/
+{
+    BENCH_DEVICE    devices[PCIDRV_STRIPE_MAX_MEMBERS];
+    EMU_STATISTICS  statistics;
+    SHIM_STATISTICS start, end;
+    PDEVICE_OBJECT  stripe;
+    PBENCH_WORKER   workers = NULL;
+    ULONGLONG       elapsed;
+    ULONG           added, member, i = 0;
+    BOOLEAN         success = TRUE;
+
+    RtlZeroMemory(Result, sizeof(BENCH_RESULT));
+    *Irps = 0;
+
+    for (added = 0; success && added < Members; added++) {
+        BenchClearParameterOverrides();
+        BenchOverrideParameter(L"StripeMembers", Members);
+        BenchOverrideParameter(L"StripeIndex", added);
+        if (!BenchSetUpDevice(Config, &devices[added])) {
+            success = FALSE;
+            break;
+        }
+    }
+    BenchClearParameterOverrides();
+
+    stripe = success ? ShimReferenceDeviceByName(PCIDRV_STRIPE_DEVICE_NAME) : NULL;
+    if (success && stripe == NULL) {
+        fprintf(stderr, "stripe: no stripe device with %u members\n", Members);
+        success = FALSE;
+    }
+
+    if (success) {
+        workers = ExAllocatePoolWithTag(NonPagedPool, Options.Threads * sizeof(BENCH_WORKER),
+                                        BENCH_POOL_TAG);
+        success = (BOOLEAN)(workers != NULL);
+        for (i = 0; success && i < Options.Threads; i++) {
+            success = BenchCreateWorker(i, &devices[0], stripe, Workload, &workers[i]);
+        }
+        if (!success) {
+            fprintf(stderr, "out of memory\n");
+        }
+    }
+
+    if (success) {
+        ShimQueryStatistics(&start);
+        elapsed = BenchRunWorkers(workers, Options.Threads, Options.Seconds);
+        ShimQueryStatistics(&end);
+        *Irps = end.IrpAllocations - start.IrpAllocations;
+        BenchSummarize(workers, Options.Threads, elapsed, Result);
+        for (member = 0; member < Members; member++) {
+            success &= BenchWaitForRundown(&devices[member]);
+            EmuQueryStatistics(devices[member].Controller, &statistics);
+            if (statistics.DataErrors != 0) {
+                success = FALSE;
+            }
+        }
+        if (Result->Errors != 0 || Result->DataErrors != 0 || Result->DoubleCompletions != 0) {
+            success = FALSE;
+        }
+    }
+
+    while (i-- != 0) {
+        BenchDeleteWorker(&workers[i]);
+    }
+    if (workers != NULL) {
+        ExFreePoolWithTag(workers, BENCH_POOL_TAG);
+    }
+
+    while (added-- != 0) {
+        BenchRemoveDevice(&devices[added]);
+    }
+
+    return success;
+}
+
+BOOLEAN
+BenchStripeMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Throughput of a stripe set of 1 to 8 controllers, with 1 MiB reads
+    and writes split into eight 128 KiB stripe units. Each controller
+    takes BENCH_STRIPE_SERVICE_TIME per command, so one alone is bound
+    by the device and a set of N should move close to N times as much;
+    the mode fails below three quarters of that.
+
+--*/
+{
+    BENCH_WORKLOAD workload;
+    BENCH_RESULT   result;
+    EMU_CONFIG     config;
+    ULONGLONG      irps;
+    double         single = 0, bandwidth;
+    ULONG          members;
+    BOOLEAN        success = TRUE;
+
+    BenchDefaultConfig(&config);
+    config.LbaShift = 12;
+    config.Blocks = BENCH_NAMESPACE_BYTES >> config.LbaShift;
+    config.ServiceTime = BENCH_STRIPE_SERVICE_TIME;
+    BenchDefaultWorkload(&workload);
+    workload.BlockSize = 1 << 20;
+    workload.QueueDepth = 8;
+    workload.WritePercent = 50;
+
+    printf("%u processors, %u threads x %u, 1 MiB, half writes, 128 KiB stripe unit,"
+           " %u us per command\n",
+           Options.Processors, Options.Threads, workload.QueueDepth,
+           BENCH_STRIPE_SERVICE_TIME / 1000);
+    printf("  %-8s %8s %10s %8s %10s %10s %10s\n",
+           "members", "IOPS", "MB/s", "scaling", "mean us", "p99 us", "IRPs/IO");
+
+    for (members = 1; members <= PCIDRV_STRIPE_MAX_MEMBERS; members++) {
+
+        if (!BenchRunStripe(&config, members, &workload, &result, &irps)) {
+            success = FALSE;
+            break;
+        }
+
+        bandwidth = result.Iops * workload.BlockSize / 1e6;
+        if (members == 1) {
+            single = bandwidth;
+        }
+
+        printf("  %-8u %8.0f %10.0f %7.2fx %10.0f %10.0f %10.2f\n",
+               members, result.Iops, bandwidth, single != 0 ? bandwidth / single : 0.0,
+               result.MeanUs, result.P99Us,
+               result.Completed != 0 ? (double)irps / result.Completed : 0.0);
+
+        if (bandwidth < 0.75 * members * single) {
+            fprintf(stderr, "stripe: %u members move %.0f MB/s, one alone %.0f\n",
+                    members, bandwidth, single);
+            success = FALSE;
+        }
+    }
+
+    return success;
+}
+
+
+//
+// Mirror reads and failover
+//
+
+#define BENCH_MIRROR_SERVICE_TIME   50000       // ns per command
+#define BENCH_MIRROR_INTERVAL       100         // ms per throughput sample
+#define BENCH_MIRROR_HANG           1000        // ms into the run member 1 stops answering
+#define BENCH_MIRROR_SAMPLES        64
+
+typedef struct _BENCH_MIRROR_SAMPLE {
+    pthread_t       Thread;
+    PBENCH_WORKER   Workers;
+    PEMU_CONTROLLER Hang;                       // stops answering, NULL for none
+    ULONG           Count;
+    ULONGLONG       Completed[BENCH_MIRROR_SAMPLES];
+} BENCH_MIRROR_SAMPLE, *PBENCH_MIRROR_SAMPLE;
+
+static
+PVOID
+BenchSampleMirror(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Counts the requests completed in each interval of a run, and has the
+    controller to hang stop answering once BENCH_MIRROR_HANG has passed.
+
+--*/
+{
+    PBENCH_MIRROR_SAMPLE sample = (PBENCH_MIRROR_SAMPLE)Context;
+    ULONGLONG            completed, last = 0;
+    ULONG                i, n = min(Options.Seconds * 1000 / BENCH_MIRROR_INTERVAL,
+                                    BENCH_MIRROR_SAMPLES);
+
+    for (sample->Count = 0; sample->Count < n; sample->Count++) {
+        if (sample->Hang != NULL &&
+            sample->Count == BENCH_MIRROR_HANG / BENCH_MIRROR_INTERVAL) {
+            EmuSetDropInterval(sample->Hang, 1);
+        }
+        usleep(BENCH_MIRROR_INTERVAL * 1000);
+        for (i = 0, completed = 0; i < Options.Threads; i++) {
+            completed += __atomic_load_n(&sample->Workers[i].Completed, __ATOMIC_RELAXED);
+        }
+        sample->Completed[sample->Count] = completed - last;
+        last = completed;
+    }
+
+    return NULL;
+}
+
+static
+BOOLEAN
+BenchRunMirror(
+    __in  PEMU_CONFIG          Config,
+    __in  PBENCH_WORKLOAD      Workload,
+    __in  BOOLEAN              Hang,
+    __out PBENCH_RESULT        Result,
+    __out PBENCH_MIRROR_SAMPLE Sample,
+    __out PULONGLONG           Dropped
+    )
+/*++
+Routine Description:
+
+    BenchRunDevice on a mirror of two controllers, the workers sending
+    their requests to the stripe device, with the throughput sampled
+    over the run. If Hang is set, member 1 stops answering
+    BENCH_MIRROR_HANG into the run; Dropped is the number of commands
+    it left unanswered.
+
+--*/
+{
+    BENCH_DEVICE   devices[PCIDRV_MIRROR_MEMBERS];
+    EMU_STATISTICS statistics;
+    PDEVICE_OBJECT mirror;
+    PBENCH_WORKER  workers = NULL;
+    ULONGLONG      elapsed;
+    ULONG          added, member, i = 0;
+    BOOLEAN        success = TRUE;
+
+    RtlZeroMemory(Result, sizeof(BENCH_RESULT));
+    RtlZeroMemory(Sample, sizeof(BENCH_MIRROR_SAMPLE));
+    *Dropped = 0;
+
+    for (added = 0; added < PCIDRV_MIRROR_MEMBERS; added++) {
+        BenchClearParameterOverrides();
+        BenchOverrideParameter(L"StripeMembers", PCIDRV_MIRROR_MEMBERS);
+        BenchOverrideParameter(L"StripeIndex", added);
+        BenchOverrideParameter(L"StripeMirror", 1);
+        BenchOverrideParameter(L"IoTimeout", 1);
+        if (!BenchSetUpDevice(Config, &devices[added])) {
+            success = FALSE;
+            break;
+        }
+    }
+    BenchClearParameterOverrides();
+
+    mirror = success ? ShimReferenceDeviceByName(PCIDRV_STRIPE_DEVICE_NAME) : NULL;
+    if (success && mirror == NULL) {
+        fprintf(stderr, "mirror: no mirror device\n");
+        success = FALSE;
+    }
+
+    if (success) {
+        workers = ExAllocatePoolWithTag(NonPagedPool, Options.Threads * sizeof(BENCH_WORKER),
+                                        BENCH_POOL_TAG);
+        success = (BOOLEAN)(workers != NULL);
+        for (i = 0; success && i < Options.Threads; i++) {
+            success = BenchCreateWorker(i, &devices[0], mirror, Workload, &workers[i]);
+        }
+        if (!success) {
+            fprintf(stderr, "out of memory\n");
+        }
+    }
+
+    Sample->Workers = workers;
+    Sample->Hang = Hang ? devices[1].Controller : NULL;
+
+    if (success && pthread_create(&Sample->Thread, NULL, BenchSampleMirror, Sample) == 0) {
+        elapsed = BenchRunWorkers(workers, Options.Threads, Options.Seconds);
+        pthread_join(Sample->Thread, NULL);
+        BenchSummarize(workers, Options.Threads, elapsed, Result);
+        for (member = 0; member < PCIDRV_MIRROR_MEMBERS; member++) {
+            EmuSetDropInterval(devices[member].Controller, 0);
+            success &= BenchWaitForRundown(&devices[member]);
+            EmuQueryStatistics(devices[member].Controller, &statistics);
+            if (statistics.DataErrors != 0) {
+                success = FALSE;
+            }
+            *Dropped += statistics.Dropped;
+        }
+        if (Result->Errors != 0 || Result->DataErrors != 0 || Result->DoubleCompletions != 0) {
+            success = FALSE;
+        }
+    } else if (success) {
+        fprintf(stderr, "out of memory\n");
+        success = FALSE;
+    }
+
+    while (i-- != 0) {
+        BenchDeleteWorker(&workers[i]);
+    }
+    if (workers != NULL) {
+        ExFreePoolWithTag(workers, BENCH_POOL_TAG);
+    }
+
+    while (added-- != 0) {
+        BenchRemoveDevice(&devices[added]);
+    }
+
+    return success;
+}
+
+BOOLEAN
+BenchMirrorMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    4 KiB reads from one controller and from a mirror of two, each
+    controller taking BENCH_MIRROR_SERVICE_TIME per command, so that
+    the mirror should read close to twice as fast; the mode fails below
+    1.8 times. Then the mirror again with member 1 no longer answering
+    after BENCH_MIRROR_HANG, with a one second I/O timeout: reads must
+    go on at the pace of member 0 alone, failing below half of it in
+    any BENCH_MIRROR_INTERVAL, and those member 1 held must be read
+    from member 0 once they time out, none failing.
+
+--*/
+{
+    BENCH_MIRROR_SAMPLE sample;
+    BENCH_WORKLOAD      workload;
+    BENCH_RESULT        single, result;
+    EMU_STATISTICS      statistics;
+    EMU_CONFIG          config;
+    ULONGLONG           dropped, low;
+    ULONG               seconds = Options.Seconds;
+    ULONG               i, first;
+    BOOLEAN             success;
+
+    BenchDefaultConfig(&config);
+    config.ServiceTime = BENCH_MIRROR_SERVICE_TIME;
+    BenchDefaultWorkload(&workload);
+    workload.BlockSize = 4096;
+    workload.WritePercent = 0;
+
+    printf("%u processors, %u threads x %u, 4 KiB reads, %u us per command\n",
+           Options.Processors, Options.Threads, workload.QueueDepth,
+           BENCH_MIRROR_SERVICE_TIME / 1000);
+    printf("  %-22s %10s %10s %10s %10s\n", "", "IOPS", "scaling", "p99 us", "max us");
+
+    BenchClearParameterOverrides();
+    success = BenchRunDevice(&config, &workload, &single, &statistics, NULL, NULL);
+    if (success) {
+        printf("  %-22s %10.0f %9.2fx %10.0f %10.0f\n", "one controller",
+               single.Iops, 1.0, single.P99Us, single.MaxUs);
+    }
+
+    if (success && BenchRunMirror(&config, &workload, FALSE, &result, &sample, &dropped)) {
+        printf("  %-22s %10.0f %9.2fx %10.0f %10.0f\n", "mirror",
+               result.Iops, result.Iops / single.Iops, result.P99Us, result.MaxUs);
+        if (result.Iops < 1.8 * single.Iops) {
+            fprintf(stderr, "mirror: %.0f IOPS, one controller %.0f\n",
+                    result.Iops, single.Iops);
+            success = FALSE;
+        }
+    } else {
+        success = FALSE;
+    }
+
+    //
+    // The reads member 1 holds time out after a second, and it is reset
+    // after the two seconds its Abort gets on top.
+    //
+    Options.Seconds = max(Options.Seconds, 5);
+
+    if (success && BenchRunMirror(&config, &workload, TRUE, &result, &sample, &dropped)) {
+
+        first = BENCH_MIRROR_HANG / BENCH_MIRROR_INTERVAL + 1;
+        low = MAXULONGLONG;
+        for (i = first; i < sample.Count; i++) {
+            low = min(low, sample.Completed[i]);
+        }
+        low = low * 1000 / BENCH_MIRROR_INTERVAL;
+
+        printf("  %-22s %10.0f %9.2fx %10.0f %10.0f\n", "member 1 hung",
+               result.Iops, result.Iops / single.Iops, result.P99Us, result.MaxUs);
+        printf("  after the hang: %llu IOPS in the slowest %u ms, %llu commands unanswered\n",
+               low, BENCH_MIRROR_INTERVAL, dropped);
+        printf("  IOPS per %u ms:", BENCH_MIRROR_INTERVAL);
+        for (i = 0; i < sample.Count; i++) {
+            printf("%s%llu", i % 10 == 0 ? "\n   " : " ",
+                   sample.Completed[i] * 1000 / BENCH_MIRROR_INTERVAL);
+        }
+        printf("\n");
+
+        if (low < single.Iops / 2 || dropped == 0) {
+            fprintf(stderr, "mirror: reads stalled or member 1 did not hang\n");
+            success = FALSE;
+        }
+    } else {
+        success = FALSE;
+    }
+
+    Options.Seconds = seconds;
+
+    return success;
+}
+
+
+//
+// Zone Append
+//
+
+#define BENCH_ZNS_ZONE_BLOCKS   4096        // 16 MiB zones of 4 KiB blocks
+#define BENCH_ZNS_BLOCKS        (1ULL << 20)
+#define BENCH_ZNS_DELAY         20          // us a command takes
+#define BENCH_ZNS_MIN_GAIN      2.0         // appends over locked writes, most threads
+
+typedef struct _BENCH_ZNS_RUN {
+    PBENCH_DEVICE       Device;
+    BOOLEAN             Append;
+    volatile BOOLEAN    Stop;
+
+    //
+    // Appends: blocks handed out in order, so that a thread appends to
+    // the zone its block falls in and the zones fill one after another;
+    // where the device put each one, which must be where no other went.
+    //
+    volatile ULONGLONG  Claimed;
+    volatile UCHAR      *Written;
+    volatile ULONGLONG  Duplicates;
+
+    //
+    // Writes: the lock of the zone being filled, held across the write,
+    // and the write pointer the host keeps for it.
+    //
+    pthread_mutex_t     ZoneLock;
+    ULONGLONG           WritePointer;
+
+    volatile ULONGLONG  Errors;
+} BENCH_ZNS_RUN, *PBENCH_ZNS_RUN;
+
+typedef struct _BENCH_ZNS_THREAD {
+    ULONG               Index;
+    pthread_t           Thread;
+    PBENCH_ZNS_RUN      Run;
+    ULONGLONG           Completed;
+} BENCH_ZNS_THREAD, *PBENCH_ZNS_THREAD;
+
+static
+PVOID
+BenchZnsLoop(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Writes one 4 KiB block at a time on a handle of its own, each write
+    waited for: a Zone Append to the zone of the next block handed out,
+    or a write at the write pointer of the zone being filled, under its
+    lock.
+
+--*/
+{
+    PBENCH_ZNS_THREAD  thread = (PBENCH_ZNS_THREAD)Context;
+    PBENCH_ZNS_RUN     run = thread->Run;
+    PCIDRV_ZONE_APPEND append;
+    FILE_OBJECT        fileObject;
+    ULONG_PTR          offset;
+    ULONGLONG          block, zone;
+    PUCHAR             buffer;
+    PMDL               mdl = NULL;
+    NTSTATUS           status;
+
+    ShimBindThread(thread->Index % Options.Processors);
+
+    buffer = ExAllocatePoolWithTag(NonPagedPool, 4096, BENCH_POOL_TAG);
+    if (buffer != NULL) {
+        mdl = IoAllocateMdl(buffer, 4096, FALSE, FALSE, NULL);
+    }
+    if (mdl == NULL || !NT_SUCCESS(BenchOpen(run->Device, &fileObject))) {
+        __atomic_add_fetch(&run->Errors, 1, __ATOMIC_RELAXED);
+        goto Exit;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+    RtlZeroMemory(buffer, 4096);
+
+    while (!run->Stop) {
+
+        if (run->Append) {
+            block = __atomic_fetch_add(&run->Claimed, 1, __ATOMIC_RELAXED);
+            if (block >= BENCH_ZNS_BLOCKS) {
+                break;
+            }
+            zone = block - block % BENCH_ZNS_ZONE_BLOCKS;
+            append.Zone = zone << 12;
+            status = BenchSendDirectIoctl(run->Device, &fileObject, IOCTL_ZONE_APPEND,
+                                          &append, sizeof(append), mdl, &offset);
+            if (NT_SUCCESS(status) &&
+                (offset >= BENCH_ZNS_ZONE_BLOCKS ||
+                 __atomic_exchange_n(&run->Written[zone + offset], 1, __ATOMIC_RELAXED))) {
+                __atomic_add_fetch(&run->Duplicates, 1, __ATOMIC_RELAXED);
+            }
+        } else {
+            pthread_mutex_lock(&run->ZoneLock);
+            if (run->WritePointer >= BENCH_ZNS_BLOCKS) {
+                pthread_mutex_unlock(&run->ZoneLock);
+                break;
+            }
+            status = BenchSendWrite(run->Device, &fileObject, mdl, run->WritePointer << 12);
+            if (NT_SUCCESS(status)) {
+                run->WritePointer++;
+            }
+            pthread_mutex_unlock(&run->ZoneLock);
+        }
+
+        if (NT_SUCCESS(status)) {
+            thread->Completed++;
+        } else {
+            __atomic_add_fetch(&run->Errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    BenchClose(run->Device, &fileObject);
+
+Exit:
+    if (mdl != NULL) {
+        IoFreeMdl(mdl);
+    }
+    if (buffer != NULL) {
+        ExFreePoolWithTag(buffer, BENCH_POOL_TAG);
+    }
+
+    return NULL;
+}
+
+static
+BOOLEAN
+BenchRunZns(
+    __in  PBENCH_DEVICE  Device,
+    __in  PBENCH_ZNS_RUN Run,
+    __in  BOOLEAN        Append,
+    __in  ULONG          Threads,
+    __out double        *Iops
+    )
+/*++
+Routine Description:
+
+    Resets every zone, runs Threads threads of appends or of locked
+    writes for Options.Seconds, and checks what they wrote against the
+    write pointer the device reports: every block up to it written
+    exactly once.
+
+--*/
+{
+    PCIDRV_ZONE_REPORT_REQUEST request;
+    PCIDRV_ZONE_ACTION         action;
+    PPCIDRV_ZONE_REPORT        report = NULL;
+    PBENCH_ZNS_THREAD          threads;
+    FILE_OBJECT                fileObject;
+    ULONGLONG                  start, elapsed, completed = 0, end, i;
+    PMDL                       mdl = NULL;
+    NTSTATUS                   status;
+    BOOLEAN                    success = FALSE;
+
+    threads = ExAllocatePoolWithTag(NonPagedPool, Threads * sizeof(BENCH_ZNS_THREAD),
+                                    BENCH_POOL_TAG);
+    report = ExAllocatePoolWithTag(NonPagedPool, sizeof(PCIDRV_ZONE_REPORT), BENCH_POOL_TAG);
+    if (report != NULL) {
+        mdl = IoAllocateMdl(report, sizeof(PCIDRV_ZONE_REPORT), FALSE, FALSE, NULL);
+    }
+    if (threads == NULL || mdl == NULL) {
+        fprintf(stderr, "out of memory\n");
+        goto Exit;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+
+    status = BenchOpen(Device, &fileObject);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "zns: open failed 0x%x\n", status);
+        goto Exit;
+    }
+
+    RtlZeroMemory(&action, sizeof(action));
+    action.Action = PCIDRV_ZONE_RESET;
+    action.AllZones = TRUE;
+    status = BenchSendIoctl(Device, &fileObject, IOCTL_MANAGE_ZONES,
+                            &action, sizeof(action), 0);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "zns: zone reset failed 0x%x\n", status);
+        BenchClose(Device, &fileObject);
+        goto Exit;
+    }
+
+    Run->Device = Device;
+    Run->Append = Append;
+    Run->Stop = FALSE;
+    Run->Claimed = 0;
+    Run->Duplicates = 0;
+    Run->WritePointer = 0;
+    Run->Errors = 0;
+    RtlZeroMemory((PVOID)Run->Written, BENCH_ZNS_BLOCKS);
+
+    RtlZeroMemory(threads, Threads * sizeof(BENCH_ZNS_THREAD));
+    start = KeQueryInterruptTime();
+    for (i = 0; i < Threads; i++) {
+        threads[i].Index = (ULONG)i;
+        threads[i].Run = Run;
+        pthread_create(&threads[i].Thread, NULL, BenchZnsLoop, &threads[i]);
+    }
+
+    sleep(Options.Seconds);
+    Run->Stop = TRUE;
+
+    for (i = 0; i < Threads; i++) {
+        pthread_join(threads[i].Thread, NULL);
+        completed += threads[i].Completed;
+    }
+    elapsed = KeQueryInterruptTime() - start;
+    *Iops = completed * 1e7 / elapsed;
+
+    //
+    // Every block handed out was appended, or every write went in, so
+    // the blocks written end where the device says.
+    //
+    end = Append ? min(Run->Claimed, BENCH_ZNS_BLOCKS) : Run->WritePointer;
+
+    RtlZeroMemory(&request, sizeof(request));
+    request.Offset = (end - 1) << 12;
+    status = BenchSendDirectIoctl(Device, &fileObject, IOCTL_REPORT_ZONES,
+                                  &request, sizeof(request), mdl, NULL);
+    BenchClose(Device, &fileObject);
+
+    if (!NT_SUCCESS(status) || report->Zones == 0) {
+        fprintf(stderr, "zns: zone report failed 0x%x\n", status);
+        goto Exit;
+    }
+
+    for (i = 0; Append && i < end && Run->Written[i]; i++) {
+        ;
+    }
+
+    if (Run->Errors != 0 || Run->Duplicates != 0 || (Append && i != end) ||
+        completed != end || report->Descriptors[0].WritePointer != end) {
+        fprintf(stderr, "zns: %llu errors, %llu blocks written twice, %llu of %llu "
+                "written, write pointer %llu\n", Run->Errors, Run->Duplicates,
+                Append ? i : completed, end, report->Descriptors[0].WritePointer);
+        goto Exit;
+    }
+
+    success = TRUE;
+
+Exit:
+    if (mdl != NULL) {
+        IoFreeMdl(mdl);
+    }
+    if (report != NULL) {
+        ExFreePoolWithTag(report, BENCH_POOL_TAG);
+    }
+    if (threads != NULL) {
+        ExFreePoolWithTag(threads, BENCH_POOL_TAG);
+    }
+
+    return success;
+}
+
+BOOLEAN
+BenchZnsMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Writes into the zones of a zoned namespace from 1, 4 and 16 threads,
+    one synchronous 4 KiB write each, commands taking BENCH_ZNS_DELAY:
+    with Zone Append, which needs no coordination among the threads and
+    lets the device place the data, and with writes at a write pointer
+    the host keeps under a lock of the zone, held across each write so
+    that they reach the device in order. Appends should scale with the
+    threads and writes not at all; the mode fails if, at 16 threads,
+    appends are not BENCH_ZNS_MIN_GAIN times as fast, if any block is
+    written twice or left out, or if the device refused any.
+
+--*/
+{
+    static const ULONG Threads[] = { 1, 4, 16 };
+    BENCH_DEVICE       device;
+    BENCH_ZNS_RUN      run;
+    EMU_STATISTICS     statistics;
+    EMU_CONFIG         config;
+    double             appends[ARRAYSIZE(Threads)], writes[ARRAYSIZE(Threads)];
+    ULONG              i;
+    BOOLEAN            started, success;
+
+    BenchDefaultConfig(&config);
+    config.LbaShift = 12;
+    config.Blocks = BENCH_ZNS_BLOCKS;
+    config.ZoneBlocks = BENCH_ZNS_ZONE_BLOCKS;
+    config.CompletionDelay = BENCH_ZNS_DELAY;
+
+    RtlZeroMemory(&run, sizeof(run));
+    run.Written = ExAllocatePoolWithTag(NonPagedPool, BENCH_ZNS_BLOCKS, BENCH_POOL_TAG);
+    if (run.Written == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return FALSE;
+    }
+    pthread_mutex_init(&run.ZoneLock, NULL);
+
+    BenchClearParameterOverrides();
+    started = success = BenchSetUpDevice(&config, &device);
+
+    for (i = 0; success && i < ARRAYSIZE(Threads); i++) {
+        success = BenchRunZns(&device, &run, TRUE, Threads[i], &appends[i]) &&
+                  BenchRunZns(&device, &run, FALSE, Threads[i], &writes[i]);
+    }
+
+    if (started) {
+        EmuQueryStatistics(device.Controller, &statistics);
+        if (!BenchWaitForRundown(&device)) {
+            success = FALSE;
+        }
+        BenchRemoveDevice(&device);
+        if (statistics.ZoneErrors != 0) {
+            fprintf(stderr, "zns: the device refused %llu writes\n", statistics.ZoneErrors);
+            success = FALSE;
+        }
+    }
+
+    if (success) {
+        printf("%u processors, 4 KiB writes into %u MiB zones, one at a time per thread, "
+               "%u us per command\n", Options.Processors, BENCH_ZNS_ZONE_BLOCKS >> 8,
+               BENCH_ZNS_DELAY);
+        printf("  %-10s %14s %14s %10s\n", "threads", "append IOPS", "locked IOPS", "gain");
+        for (i = 0; i < ARRAYSIZE(Threads); i++) {
+            printf("  %-10u %14.0f %14.0f %9.2fx\n",
+                   Threads[i], appends[i], writes[i], appends[i] / writes[i]);
+        }
+        i = ARRAYSIZE(Threads) - 1;
+        if (appends[i] < BENCH_ZNS_MIN_GAIN * writes[i]) {
+            fprintf(stderr, "zns: appends %.0f IOPS, locked writes %.0f\n",
+                    appends[i], writes[i]);
+            success = FALSE;
+        }
+    }
+
+    pthread_mutex_destroy(&run.ZoneLock);
+    ExFreePoolWithTag((PVOID)run.Written, BENCH_POOL_TAG);
+
+    return success;
+}
+
+
+//
+// Controller memory buffer
+//
+
+#define BENCH_CMB_FETCH_COST    1000        // ns, a read across the bus
+#define BENCH_CMB_SIZE          (4 << 20)
+
+BOOLEAN
+BenchCmbMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Submit-to-completion latency of 4 KiB reads one at a time, with the
+    I/O submission queues in host memory, where the controller takes
+    BENCH_CMB_FETCH_COST to fetch each command, and in its memory
+    buffer, where it need not fetch them. The mode fails unless the
+    buffer takes at least half the fetch cost off the mean and no I/O
+    command is fetched from host memory with it.
+
+--*/
+{
+    BENCH_WORKLOAD workload;
+    BENCH_RESULT   result[2];
+    EMU_STATISTICS statistics[2];
+    EMU_CONFIG     config;
+    ULONG          threads = Options.Threads;
+    ULONG          i;
+    BOOLEAN        success = TRUE;
+
+    BenchDefaultConfig(&config);
+    config.FetchCost = BENCH_CMB_FETCH_COST;
+    BenchDefaultWorkload(&workload);
+    workload.BlockSize = 4096;
+    workload.QueueDepth = 1;
+    workload.WritePercent = 0;
+    Options.Threads = 1;
+
+    BenchClearParameterOverrides();
+    for (i = 0; success && i < 2; i++) {
+        config.CmbSize = i == 0 ? 0 : BENCH_CMB_SIZE;
+        success = BenchRunDevice(&config, &workload, &result[i], &statistics[i], NULL, NULL);
+    }
+
+    Options.Threads = threads;
+
+    if (!success) {
+        return FALSE;
+    }
+
+    printf("4 KiB reads, one thread, one at a time, %u ns to fetch a command from host memory\n",
+           BENCH_CMB_FETCH_COST);
+    printf("  %-22s %10s %10s %10s %10s %14s\n",
+           "submission queues", "IOPS", "mean us", "p50 us", "p99 us", "fetches per I/O");
+    for (i = 0; i < 2; i++) {
+        printf("  %-22s %10.0f %10.2f %10.1f %10.1f %14.3f\n",
+               i == 0 ? "host memory" : "controller memory", result[i].Iops,
+               result[i].MeanUs, result[i].P50Us, result[i].P99Us,
+               (double)statistics[i].HostFetches / result[i].Completed);
+    }
+
+    //
+    // The admin commands of the start and the stop are still fetched.
+    //
+    if (result[0].MeanUs - result[1].MeanUs < BENCH_CMB_FETCH_COST / 2000.0 ||
+        statistics[1].HostFetches * 100 > result[1].Completed) {
+        fprintf(stderr, "cmb: %.2f us against %.2f, %llu commands fetched from the host\n",
+                result[1].MeanUs, result[0].MeanUs, statistics[1].HostFetches);
+        success = FALSE;
+    }
+
+    return success;
+}
+
+
+//
+// Host memory buffer across D3
+//
+
+#define BENCH_HMB_SIZE          (8 << 20)
+#define BENCH_HMB_CYCLES        2           // trips to D3 and back
+
+typedef struct _BENCH_POWER_REQUEST {
+    KEVENT      Event;
+    NTSTATUS    Status;
+} BENCH_POWER_REQUEST, *PBENCH_POWER_REQUEST;
+
+static
+VOID
+BenchPowerComplete(
+    __in PDEVICE_OBJECT   DeviceObject,
+    __in UCHAR            MinorFunction,
+    __in POWER_STATE      PowerState,
+    __in PVOID            Context,
+    __in PIO_STATUS_BLOCK IoStatus
+    )
+{
+    PBENCH_POWER_REQUEST request = (PBENCH_POWER_REQUEST)Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(MinorFunction);
+    UNREFERENCED_PARAMETER(PowerState);
+
+    request->Status = IoStatus->Status;
+    KeSetEvent(&request->Event, IO_NO_INCREMENT, FALSE);
+}
+
+static
+NTSTATUS
+BenchSetDevicePower(
+    __in PBENCH_DEVICE      Device,
+    __in DEVICE_POWER_STATE State
+    )
+/*++
+Routine Description:
+
+    Sends a device set-power IRP down the stack, as the power policy
+    owner does, and waits for it.
+
+--*/
+{
+    BENCH_POWER_REQUEST request;
+    POWER_STATE         state;
+    NTSTATUS            status;
+
+    KeInitializeEvent(&request.Event, NotificationEvent, FALSE);
+    state.DeviceState = State;
+
+    status = PoRequestPowerIrp(Device->Pdo, IRP_MN_SET_POWER, state,
+                               BenchPowerComplete, &request, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    KeWaitForSingleObject(&request.Event, Executive, KernelMode, FALSE, NULL);
+
+    return request.Status;
+}
+
+static
+VOID
+BenchPrintHmbEvent(
+    __in ULONG          Index,
+    __in PEMU_HMB_EVENT Event
+    )
+{
+    if (Event->Flags == EMU_HMB_RESET) {
+        printf("  %2u  reset%s\n", Index, Event->Enabled ? " with the buffer enabled" : "");
+    } else if (Event->Flags & EMU_HMB_ENABLE) {
+        printf("  %2u  enable%s, %u pages in %u chunks%s: 0x%x\n", Index,
+               (Event->Flags & EMU_HMB_MEMORY_RETURN) ? " with memory return" : "",
+               Event->Pages, Event->Chunks, Event->Enabled ? ", enabled" : "",
+               Event->Status);
+    } else {
+        printf("  %2u  disable%s: 0x%x\n", Index,
+               Event->Enabled ? "" : ", not enabled", Event->Status);
+    }
+}
+
+BOOLEAN
+BenchHmbMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Starts a device whose controller asks for a BENCH_HMB_SIZE host
+    memory buffer, writes a block, and takes it to D3 and back
+    BENCH_HMB_CYCLES times, writing a block after each resume. The
+    controller checks every descriptor list it is given; the mode checks
+    the order the buffer went through: enabled once without Memory
+    Return, then on every trip disabled before the reset of the shutdown
+    and enabled again with Memory Return and the same chunks. Every
+    command must succeed.
+
+--*/
+{
+    EMU_HMB_EVENT events[EMU_MAX_HMB_EVENTS];
+    EMU_CONFIG    config;
+    BENCH_DEVICE  device;
+    FILE_OBJECT   fileObject;
+    PUCHAR        buffer;
+    PMDL          mdl = NULL;
+    ULONG         count, i, chunks = 0, enables = 0;
+    ULONG         next = EMU_HMB_ENABLE;    // what may come next
+    NTSTATUS      status = STATUS_SUCCESS;
+    BOOLEAN       success = TRUE;
+
+    BenchDefaultConfig(&config);
+    config.HmbSize = BENCH_HMB_SIZE;
+
+    buffer = ExAllocatePoolWithTag(NonPagedPool, 4096, BENCH_POOL_TAG);
+    if (buffer != NULL) {
+        mdl = IoAllocateMdl(buffer, 4096, FALSE, FALSE, NULL);
+    }
+    if (mdl == NULL) {
+        fprintf(stderr, "out of memory\n");
+        success = FALSE;
+        goto Exit;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+    RtlZeroMemory(buffer, 4096);
+
+    BenchClearParameterOverrides();
+    if (!BenchSetUpDevice(&config, &device)) {
+        success = FALSE;
+        goto Exit;
+    }
+
+    status = BenchOpen(&device, &fileObject);
+    if (NT_SUCCESS(status)) {
+        status = BenchSendWrite(&device, &fileObject, mdl, 0);
+        for (i = 0; NT_SUCCESS(status) && i < BENCH_HMB_CYCLES; i++) {
+            status = BenchSetDevicePower(&device, PowerDeviceD3);
+            if (NT_SUCCESS(status)) {
+                status = BenchSetDevicePower(&device, PowerDeviceD0);
+            }
+            if (NT_SUCCESS(status)) {
+                status = BenchSendWrite(&device, &fileObject, mdl, (i + 1) * 4096);
+            }
+        }
+        BenchClose(&device, &fileObject);
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "hmb: write or power transition failed 0x%x\n", status);
+        success = FALSE;
+    }
+
+    count = min(EmuQueryHostMemoryBuffer(device.Controller, events, EMU_MAX_HMB_EVENTS),
+                EMU_MAX_HMB_EVENTS);
+
+    if (!BenchWaitForRundown(&device)) {
+        success = FALSE;
+    }
+    BenchRemoveDevice(&device);
+
+    printf("%u KiB host memory buffer, %u trips to D3, what the controller saw:\n",
+           BENCH_HMB_SIZE >> 10, BENCH_HMB_CYCLES);
+    for (i = 0; i < count; i++) {
+        BenchPrintHmbEvent(i, &events[i]);
+    }
+
+    //
+    // Resets before the buffer is first given do not matter; from then
+    // on it goes enable, disable, reset, and is enabled at the end.
+    //
+    for (i = 0; success && i < count; i++) {
+        if (events[i].Flags == EMU_HMB_RESET && enables == 0 && !events[i].Enabled) {
+            continue;
+        }
+        if (events[i].Status != 0 || (events[i].Flags & ~EMU_HMB_MEMORY_RETURN) != next) {
+            success = FALSE;
+            break;
+        }
+        switch (next) {
+        case EMU_HMB_ENABLE:
+            if (enables == 0) {
+                chunks = events[i].Chunks;
+            }
+            success = !events[i].Enabled && events[i].Chunks == chunks &&
+                      events[i].Pages == BENCH_HMB_SIZE / 4096 &&
+                      ((events[i].Flags & EMU_HMB_MEMORY_RETURN) != 0) == (enables != 0);
+            enables++;
+            next = 0;
+            break;
+        case 0:
+            success = events[i].Enabled;
+            next = EMU_HMB_RESET;
+            break;
+        default:
+            success = !events[i].Enabled;
+            next = EMU_HMB_ENABLE;
+            break;
+        }
+    }
+
+    if (!success || enables != BENCH_HMB_CYCLES + 1 || next != 0) {
+        fprintf(stderr, "hmb: event %u out of order, %u enables\n", i, enables);
+        success = FALSE;
+    }
+
+Exit:
+    if (mdl != NULL) {
+        IoFreeMdl(mdl);
+    }
+    if (buffer != NULL) {
+        ExFreePoolWithTag(buffer, BENCH_POOL_TAG);
+    }
+
+    return success;
+}
+
+
+//
+// Shadow doorbells
+//
+
+#define BENCH_SHADOW_SERVICE_TIME   2000        // ns per command
+#define BENCH_SHADOW_DEPTHS         2
+
+static const ULONG BenchShadowDepths[BENCH_SHADOW_DEPTHS] = { 1, 32 };
+
+static
+VOID
+BenchQueryDoorbells(
+    __in PBENCH_DEVICE Device,
+    __in PVOID         Context
+    )
+{
+    PPCIDRV_DOORBELL_STATISTICS statistics = (PPCIDRV_DOORBELL_STATISTICS)Context;
+    FILE_OBJECT                 fileObject;
+
+    RtlZeroMemory(statistics, sizeof(PCIDRV_DOORBELL_STATISTICS));
+
+    if (NT_SUCCESS(BenchOpen(Device, &fileObject))) {
+        BenchSendIoctl(Device, &fileObject, IOCTL_GET_DOORBELL_STATISTICS,
+                       statistics, 0, sizeof(PCIDRV_DOORBELL_STATISTICS));
+        BenchClose(Device, &fileObject);
+    }
+}
+
+BOOLEAN
+BenchShadowMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Register writes per command of 4 KiB reads from one thread, one at
+    a time and BENCH_SHADOW_DEPTHS deep, on a controller that offers
+    shadow doorbells and fetches a command every
+    BENCH_SHADOW_SERVICE_TIME, with the driver told not to use them and
+    told to. The emulator counts every register write, start and stop
+    included; the driver counts its doorbell writes. The mode fails
+    unless the driver uses the shadows when told to, and only then, and
+    they save register writes at every depth.
+
+--*/
+{
+    PCIDRV_DOORBELL_STATISTICS doorbells[BENCH_SHADOW_DEPTHS][2];
+    EMU_STATISTICS             statistics[BENCH_SHADOW_DEPTHS][2];
+    BENCH_RESULT               result[BENCH_SHADOW_DEPTHS][2];
+    BENCH_WORKLOAD             workload;
+    EMU_CONFIG                 config;
+    ULONG                      threads = Options.Threads;
+    ULONG                      depth, shadows;
+    double                     writes[2];
+    BOOLEAN                    success = TRUE;
+
+    BenchDefaultConfig(&config);
+    config.ServiceTime = BENCH_SHADOW_SERVICE_TIME;
+    config.ShadowDoorbells = TRUE;
+    BenchDefaultWorkload(&workload);
+    workload.BlockSize = 4096;
+    workload.WritePercent = 0;
+    Options.Threads = 1;
+
+    printf("4 KiB reads, one thread, %u ns a command, register writes per I/O\n",
+           BENCH_SHADOW_SERVICE_TIME);
+    printf("  %5s %8s %10s %10s %12s %14s %14s\n",
+           "depth", "shadows", "IOPS", "mean us", "MMIO writes", "SQ doorbells", "CQ doorbells");
+
+    for (depth = 0; success && depth < BENCH_SHADOW_DEPTHS; depth++) {
+        workload.QueueDepth = BenchShadowDepths[depth];
+        for (shadows = 0; success && shadows < 2; shadows++) {
+            BenchClearParameterOverrides();
+            BenchOverrideParameter(L"ShadowDoorbells", shadows);
+            success = BenchRunDevice(&config, &workload, &result[depth][shadows],
+                                     &statistics[depth][shadows], BenchQueryDoorbells,
+                                     &doorbells[depth][shadows]);
+            if (!success) {
+                break;
+            }
+
+            //
+            // Per command submitted, the SQ doorbells; per head update,
+            // the CQ doorbells.
+            //
+            writes[shadows] = (double)statistics[depth][shadows].MmioWrites /
+                              result[depth][shadows].Completed;
+            printf("  %5u %8s %10.0f %10.2f %12.3f %14.3f %14.3f\n",
+                   workload.QueueDepth, shadows ? "on" : "off",
+                   result[depth][shadows].Iops, result[depth][shadows].MeanUs, writes[shadows],
+                   (double)doorbells[depth][shadows].SubmissionDoorbells /
+                       max(doorbells[depth][shadows].Submissions, 1),
+                   (double)doorbells[depth][shadows].CompletionDoorbells /
+                       max(doorbells[depth][shadows].CompletionUpdates, 1));
+
+            if (doorbells[depth][shadows].ShadowDoorbells != shadows) {
+                fprintf(stderr, "shadow: depth %u, shadow doorbells %s in the driver\n",
+                        workload.QueueDepth, shadows ? "not used" : "used");
+                success = FALSE;
+            }
+        }
+
+        if (success && writes[1] >= writes[0]) {
+            fprintf(stderr, "shadow: depth %u, %.3f register writes per I/O against %.3f\n",
+                    workload.QueueDepth, writes[1], writes[0]);
+            success = FALSE;
+        }
+    }
+
+    Options.Threads = threads;
+    BenchClearParameterOverrides();
+
+    return success;
+}
+
+
+//
+// Asynchronous event waiters
+//
+
+#define BENCH_EVENT_WAITERS     4
+#define BENCH_EVENT_DW0         0x00020101  // SMART / health, temperature, log page 2
+#define BENCH_EVENT_TIMEOUT     5           // s
+
+typedef struct _BENCH_EVENT_WAITER {
+    FILE_OBJECT         FileObject;
+    PIRP                Irp;
+    KEVENT              Event;
+    IO_STATUS_BLOCK     IoStatus;
+    PCIDRV_ASYNC_EVENT  AsyncEvent;
+    NTSTATUS            Sent;               // what IoCallDriver returned
+    BOOLEAN             Opened;
+} BENCH_EVENT_WAITER, *PBENCH_EVENT_WAITER;
+
+BOOLEAN
+BenchEventsMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Sends an IOCTL_WAIT_ASYNC_EVENT on each of BENCH_EVENT_WAITERS
+    handles, as that many monitoring tools would, cancels the first, and
+    has the controller report a SMART / health event. The mode fails
+    unless every request pends, the cancelled one comes back cancelled
+    and every other one with the event.
+
+--*/
+{
+    BENCH_EVENT_WAITER waiters[BENCH_EVENT_WAITERS];
+    PBENCH_EVENT_WAITER waiter;
+    PIO_STACK_LOCATION stack;
+    LARGE_INTEGER      timeout;
+    EMU_CONFIG         config;
+    BENCH_DEVICE       device;
+    NTSTATUS           expected;
+    ULONG              i;
+    BOOLEAN            success = TRUE;
+
+    BenchDefaultConfig(&config);
+    BenchClearParameterOverrides();
+    if (!BenchSetUpDevice(&config, &device)) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(waiters, sizeof(waiters));
+    for (i = 0; success && i < BENCH_EVENT_WAITERS; i++) {
+        waiter = &waiters[i];
+        KeInitializeEvent(&waiter->Event, NotificationEvent, FALSE);
+        waiter->Opened = NT_SUCCESS(BenchOpen(&device, &waiter->FileObject));
+        waiter->Irp = IoAllocateIrp(device.Fdo->StackSize, FALSE);
+        if (!waiter->Opened || waiter->Irp == NULL) {
+            fprintf(stderr, "events: waiter %u not set up\n", i);
+            success = FALSE;
+            break;
+        }
+        waiter->Irp->AssociatedIrp.SystemBuffer = &waiter->AsyncEvent;
+        waiter->Irp->UserEvent = &waiter->Event;
+        waiter->Irp->UserIosb = &waiter->IoStatus;
+        stack = IoGetNextIrpStackLocation(waiter->Irp);
+        stack->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+        stack->Parameters.DeviceIoControl.IoControlCode = IOCTL_WAIT_ASYNC_EVENT;
+        stack->Parameters.DeviceIoControl.OutputBufferLength = sizeof(PCIDRV_ASYNC_EVENT);
+        stack->FileObject = &waiter->FileObject;
+        waiter->Sent = IoCallDriver(device.Fdo, waiter->Irp);
+        if (waiter->Sent != STATUS_PENDING) {
+            fprintf(stderr, "events: waiter %u did not pend, 0x%x\n", i, waiter->Sent);
+            success = FALSE;
+        }
+    }
+
+    if (success) {
+        IoCancelIrp(waiters[0].Irp);
+        if (!EmuRaiseAsyncEvent(device.Controller, BENCH_EVENT_DW0)) {
+            fprintf(stderr, "events: no Asynchronous Event Request outstanding\n");
+            success = FALSE;
+        }
+    }
+
+    printf("%u waiters on IOCTL_WAIT_ASYNC_EVENT, the first cancelled, then event 0x%08x\n",
+           BENCH_EVENT_WAITERS, BENCH_EVENT_DW0);
+
+    //
+    // Whatever happened, every request sent has to come back before its
+    // IRP goes; the device going away cancels those still waiting.
+    //
+    timeout.QuadPart = -BENCH_EVENT_TIMEOUT * 10000000LL;
+    for (i = 0; i < BENCH_EVENT_WAITERS; i++) {
+        waiter = &waiters[i];
+        if (waiter->Irp == NULL || waiter->Sent != STATUS_PENDING) {
+            continue;
+        }
+        if (KeWaitForSingleObject(&waiter->Event, Executive, KernelMode, FALSE,
+                                  &timeout) == STATUS_TIMEOUT) {
+            fprintf(stderr, "events: waiter %u still waiting\n", i);
+            success = FALSE;
+            continue;
+        }
+        expected = i == 0 ? STATUS_CANCELLED : STATUS_SUCCESS;
+        printf("  %u  0x%08x, event %u type %u information %u log page 0x%x\n", i,
+               waiter->IoStatus.Status, waiter->AsyncEvent.AsyncEvents,
+               waiter->AsyncEvent.Type, waiter->AsyncEvent.Information,
+               waiter->AsyncEvent.LogPageId);
+        if (waiter->IoStatus.Status != expected ||
+            (i != 0 && (waiter->AsyncEvent.AsyncEvents != 1 ||
+                        waiter->AsyncEvent.Type != (BENCH_EVENT_DW0 & 0x7) ||
+                        waiter->AsyncEvent.LogPageId != (UCHAR)(BENCH_EVENT_DW0 >> 16)))) {
+            success = FALSE;
+        }
+    }
+
+    for (i = 0; i < BENCH_EVENT_WAITERS; i++) {
+        if (waiters[i].Opened) {
+            BenchClose(&device, &waiters[i].FileObject);
+        }
+    }
+
+    if (!BenchWaitForRundown(&device)) {
+        success = FALSE;
+    }
+    BenchRemoveDevice(&device);
+
+    for (i = 0; i < BENCH_EVENT_WAITERS; i++) {
+        waiter = &waiters[i];
+        if (waiter->Irp != NULL) {
+            if (waiter->Sent == STATUS_PENDING) {
+                KeWaitForSingleObject(&waiter->Event, Executive, KernelMode, FALSE, NULL);
+            }
+            IoFreeIrp(waiter->Irp);
+        }
+    }
+
+    return success;
+}
+
+
+//
+// Telemetry pull
+//
+
+#define BENCH_TELEMETRY_SIZE    (64 << 20)
+#define BENCH_TELEMETRY_PULLS   3
+#define BENCH_TELEMETRY_CREATE  0x1         // log specific: capture a new log
+#define BENCH_TELEMETRY_BLOCK   512
+
+static
+BOOLEAN
+BenchCheckTelemetry(
+    __in PULONG Log,
+    __in ULONG  Generation
+    )
+/*++
+Routine Description:
+
+    Whether a whole telemetry log read into Log is the one of capture
+    Generation: the header block gives the last block of every data
+    area, and each dword past it carries the generation and its index.
+
+--*/
+{
+    PUCHAR header = (PUCHAR)Log;
+    ULONG  lastBlock = BENCH_TELEMETRY_SIZE / BENCH_TELEMETRY_BLOCK - 1;
+    ULONG  i;
+
+    //
+    // Data areas 1 to 3 end at bytes 9:8, 11:10 and 13:12, area 4 at 19:16.
+    //
+    if (header[0] != PCIDRV_LOG_PAGE_TELEMETRY_HOST ||
+        *(PUSHORT)&header[8] != min(lastBlock, 0xFFFF) ||
+        *(PUSHORT)&header[10] != min(lastBlock, 0xFFFF) ||
+        *(PUSHORT)&header[12] != min(lastBlock, 0xFFFF) ||
+        *(PULONG)&header[16] != lastBlock) {
+        fprintf(stderr, "telemetry: bad header, log page 0x%x, last block %u\n",
+                header[0], *(PULONG)&header[16]);
+        return FALSE;
+    }
+
+    for (i = BENCH_TELEMETRY_BLOCK / sizeof(ULONG); i < BENCH_TELEMETRY_SIZE / sizeof(ULONG); i++) {
+        if (Log[i] != ((Generation & 0xFF) << 24 | (i & 0xFFFFFF))) {
+            fprintf(stderr, "telemetry: dword %u is 0x%08x in capture %u\n",
+                    i, Log[i], Generation);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+BenchTelemetryMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Times pulls of a BENCH_TELEMETRY_SIZE Telemetry Host-Initiated log
+    through IOCTL_READ_LOG_PAGE, each asking for a new capture, and
+    reports how long one takes, at what rate, and in how many Get Log
+    Page commands. The mode fails unless every pull returns the whole
+    log of its own capture.
+
+--*/
+{
+    PCIDRV_LOG_PAGE_READ read;
+    EMU_STATISTICS       statistics[2];
+    FILE_OBJECT          fileObject;
+    EMU_CONFIG           config;
+    BENCH_DEVICE         device;
+    ULONG_PTR            information;
+    ULONGLONG            start, elapsed;
+    NTSTATUS             status;
+    PULONG               log;
+    PMDL                 mdl = NULL;
+    ULONG                i;
+    BOOLEAN              opened;
+    BOOLEAN              success = TRUE;
+
+    log = ExAllocatePoolWithTag(NonPagedPool, BENCH_TELEMETRY_SIZE, BENCH_POOL_TAG);
+    if (log != NULL) {
+        mdl = IoAllocateMdl(log, BENCH_TELEMETRY_SIZE, FALSE, FALSE, NULL);
+    }
+    if (mdl == NULL) {
+        fprintf(stderr, "out of memory\n");
+        if (log != NULL) {
+            ExFreePoolWithTag(log, BENCH_POOL_TAG);
+        }
+        return FALSE;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+
+    BenchDefaultConfig(&config);
+    config.TelemetrySize = BENCH_TELEMETRY_SIZE;
+    BenchClearParameterOverrides();
+    if (!BenchSetUpDevice(&config, &device)) {
+        IoFreeMdl(mdl);
+        ExFreePoolWithTag(log, BENCH_POOL_TAG);
+        return FALSE;
+    }
+
+    printf("%u MiB Telemetry Host-Initiated log, a new capture each pull\n",
+           BENCH_TELEMETRY_SIZE >> 20);
+    printf("  %-5s %10s %10s %10s\n", "pull", "ms", "MiB/s", "commands");
+
+    opened = NT_SUCCESS(BenchOpen(&device, &fileObject));
+    if (!opened) {
+        fprintf(stderr, "telemetry: open failed\n");
+        success = FALSE;
+    }
+
+    for (i = 0; success && i < BENCH_TELEMETRY_PULLS; i++) {
+
+        RtlZeroMemory(&read, sizeof(read));
+        read.LogPageId = PCIDRV_LOG_PAGE_TELEMETRY_HOST;
+        read.LogSpecific = BENCH_TELEMETRY_CREATE;
+        RtlFillMemory(log, BENCH_TELEMETRY_SIZE, 0xA5);
+
+        EmuQueryStatistics(device.Controller, &statistics[0]);
+        start = KeQueryInterruptTime();
+        status = BenchSendDirectIoctl(&device, &fileObject, IOCTL_READ_LOG_PAGE,
+                                      &read, sizeof(read), mdl, &information);
+        elapsed = KeQueryInterruptTime() - start;
+        EmuQueryStatistics(device.Controller, &statistics[1]);
+
+        if (!NT_SUCCESS(status) || information != BENCH_TELEMETRY_SIZE) {
+            fprintf(stderr, "telemetry: pull %u, 0x%x, %llu bytes\n",
+                    i, status, (ULONGLONG)information);
+            success = FALSE;
+            break;
+        }
+
+        printf("  %-5u %10.1f %10.0f %10llu\n", i, elapsed / 1e4,
+               (BENCH_TELEMETRY_SIZE >> 20) / (elapsed / 1e7),
+               statistics[1].Commands - statistics[0].Commands);
+
+        success = BenchCheckTelemetry(log, i + 1);
+    }
+
+    if (opened) {
+        BenchClose(&device, &fileObject);
+    }
+
+    if (!BenchWaitForRundown(&device)) {
+        success = FALSE;
+    }
+    BenchRemoveDevice(&device);
+
+    IoFreeMdl(mdl);
+    ExFreePoolWithTag(log, BENCH_POOL_TAG);
+
+    return success;
+}
+
+
+//
+// Firmware download depth
+//
+
+#define BENCH_FIRMWARE_SIZE     (32 << 20)
+#define BENCH_FIRMWARE_DELAY    500         // us a Firmware Image Download takes
+#define BENCH_FIRMWARE_MIN_GAIN 2.0         // the default depth over one at a time
+
+BOOLEAN
+BenchFirmwareMode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Times IOCTL_UPDATE_FIRMWARE of a BENCH_FIRMWARE_SIZE image at
+    pipeline depths 1, the default and the largest, each Firmware Image
+    Download taking BENCH_FIRMWARE_DELAY to complete, and reports how
+    long each update takes, at what rate, and in how many commands. The
+    controller runs any number of downloads at once, so what depth buys
+    is the overlap of their delays. The mode fails unless every update
+    leaves its image whole in its slot and the default depth is
+    BENCH_FIRMWARE_MIN_GAIN times as fast as one at a time.
+
+--*/
+{
+    static const ULONG Depths[] = { 1, 0, HW_ADMIN_SLOTS_MAX };
+    PCIDRV_FIRMWARE_UPDATE update;
+    EMU_STATISTICS         statistics[2];
+    FILE_OBJECT            fileObject;
+    EMU_CONFIG             config;
+    BENCH_DEVICE           device;
+    ULONG_PTR              information;
+    ULONGLONG              start, elapsed[ARRAYSIZE(Depths)];
+    NTSTATUS               status;
+    PULONG                 image;
+    PMDL                   mdl = NULL;
+    ULONG                  i, j;
+    BOOLEAN                opened;
+    BOOLEAN                success = TRUE;
+
+    image = ExAllocatePoolWithTag(NonPagedPool, BENCH_FIRMWARE_SIZE, BENCH_POOL_TAG);
+    if (image != NULL) {
+        mdl = IoAllocateMdl(image, BENCH_FIRMWARE_SIZE, FALSE, FALSE, NULL);
+    }
+    if (mdl == NULL) {
+        fprintf(stderr, "out of memory\n");
+        if (image != NULL) {
+            ExFreePoolWithTag(image, BENCH_POOL_TAG);
+        }
+        return FALSE;
+    }
+    MmBuildMdlForNonPagedPool(mdl);
+
+    BenchDefaultConfig(&config);
+    config.FirmwareSize = BENCH_FIRMWARE_SIZE;
+    config.FirmwareDelay = BENCH_FIRMWARE_DELAY;
+    BenchClearParameterOverrides();
+    if (!BenchSetUpDevice(&config, &device)) {
+        IoFreeMdl(mdl);
+        ExFreePoolWithTag(image, BENCH_POOL_TAG);
+        return FALSE;
+    }
+
+    printf("%u MiB firmware image, %u us per Firmware Image Download\n",
+           BENCH_FIRMWARE_SIZE >> 20, BENCH_FIRMWARE_DELAY);
+    printf("  %-5s %10s %10s %10s\n", "depth", "ms", "MiB/s", "commands");
+
+    opened = NT_SUCCESS(BenchOpen(&device, &fileObject));
+    if (!opened) {
+        fprintf(stderr, "firmware: open failed\n");
+        success = FALSE;
+    }
+
+    for (i = 0; success && i < ARRAYSIZE(Depths); i++) {
+
+        //
+        // A different image each time, into the other slot, so that one
+        // left over from the last update cannot pass for this one.
+        //
+        for (j = 0; j < BENCH_FIRMWARE_SIZE / sizeof(ULONG); j++) {
+            image[j] = (j * 2654435761U) ^ (i << 28);
+        }
+
+        RtlZeroMemory(&update, sizeof(update));
+        update.Slot = 1 + i % 2;
+        update.CommitAction = PCIDRV_FIRMWARE_REPLACE;
+        update.PipelineDepth = Depths[i];
+
+        EmuQueryStatistics(device.Controller, &statistics[0]);
+        start = KeQueryInterruptTime();
+        status = BenchSendDirectIoctl(&device, &fileObject, IOCTL_UPDATE_FIRMWARE,
+                                      &update, sizeof(update), mdl, &information);
+        elapsed[i] = KeQueryInterruptTime() - start;
+        EmuQueryStatistics(device.Controller, &statistics[1]);
+
+        if (!NT_SUCCESS(status) ||
+            !EmuCompareFirmware(device.Controller, update.Slot, image, BENCH_FIRMWARE_SIZE)) {
+            fprintf(stderr, "firmware: depth %u, 0x%x, image %s\n", Depths[i], status,
+                    NT_SUCCESS(status) ? "not in its slot" : "not committed");
+            success = FALSE;
+            break;
+        }
+
+        printf("  %-5u %10.1f %10.0f %10llu\n",
+               Depths[i] != 0 ? Depths[i] : HW_FIRMWARE_SLOTS, elapsed[i] / 1e4,
+               (BENCH_FIRMWARE_SIZE >> 20) / (elapsed[i] / 1e7),
+               statistics[1].Commands - statistics[0].Commands);
+    }
+
+    if (success && elapsed[0] < BENCH_FIRMWARE_MIN_GAIN * elapsed[1]) {
+        fprintf(stderr, "firmware: depth %u takes %.1f ms against %.1f one at a time\n",
+                HW_FIRMWARE_SLOTS, elapsed[1] / 1e4, elapsed[0] / 1e4);
+        success = FALSE;
+    }
+
+    if (opened) {
+        BenchClose(&device, &fileObject);
+    }
+
+    if (!BenchWaitForRundown(&device)) {
+        success = FALSE;
+    }
+    BenchRemoveDevice(&device);
+
+    IoFreeMdl(mdl);
+    ExFreePoolWithTag(image, BENCH_POOL_TAG);
+
+    return success;
+}
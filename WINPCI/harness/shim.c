@@ -0,0 +1,2085 @@
+/*++
+
+Module Name:
+
+    shim.c
+
+Abstract:
+
+    The kernel services the driver core calls, on pthreads. A fixed set
+    of virtual processors stands in for the processors of the machine:
+    every thread that runs driver code is bound to one of them and keeps
+    its own IRQL, every virtual processor has a DPC queue and a thread
+    that drains it, and a timer thread fires the DPCs of timers. The
+    number of virtual processors does not depend on the host, so queue
+    ownership and DPC targeting behave as on a machine of that size even
+    when the host has fewer processors.
+
+    DPCs queued on the current processor at DISPATCH_LEVEL or above run
+    when its IRQL drops below DISPATCH_LEVEL, as in the kernel; DPCs for
+    another processor wake its DPC thread.
+
+    Memory is identity mapped: the physical address of a buffer is its
+    virtual address, which is what the emulated controller accesses.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <ntddk.h>
+#include <nvme.h>
+#include "harness.h"
+
+#define SHIM_SPINS_BEFORE_YIELD     1024
+#define SHIM_NO_PROCESSOR           ((ULONG)-1)
+#define SHIM_MUTANT_OBJECT          2           // DISPATCHER_HEADER.Type of a KMUTEX
+#define SHIM_LOOKASIDE_DEPTH        256
+#define SHIM_UNIX_EPOCH             116444736000000000LL    // 1970 in 100ns since 1601
+
+typedef struct _SHIM_PROCESSOR {
+    volatile LONG   DpcLock;
+    LIST_ENTRY      DpcQueue;
+    volatile LONG   DpcWake;        // futex the DPC thread sleeps on
+    volatile LONG   DpcThreadIdle;
+    volatile LONG   DpcActive;      // DPCs taken off the queue and still running
+    USHORT          Node;
+    pthread_t       DpcThread;
+} DECLSPEC_CACHEALIGN SHIM_PROCESSOR, *PSHIM_PROCESSOR;
+
+static SHIM_PROCESSOR   ShimProcessors[MAXIMUM_PROCESSORS];
+static ULONG            ShimProcessorCount;
+static ULONG            ShimNodeCount;
+static volatile LONG    ShimStopping;
+
+static __thread ULONG   ShimCurrentProcessor = SHIM_NO_PROCESSOR;
+static __thread KIRQL   ShimCurrentIrql = PASSIVE_LEVEL;
+static __thread HANDLE  ShimCurrentProcess = (HANDLE)4;
+
+static KSPIN_LOCK       ShimCancelLock;
+
+//
+// The node each contiguous allocation was placed on, for the emulated
+// controller to tell local from remote accesses.
+//
+typedef struct _SHIM_MEMORY_RANGE {
+    LIST_ENTRY      Link;
+    ULONG_PTR       Base;
+    SIZE_T          Length;
+    USHORT          Node;
+} SHIM_MEMORY_RANGE, *PSHIM_MEMORY_RANGE;
+
+static struct {
+    volatile LONG   Lock;
+    LIST_ENTRY      Ranges;
+} ShimMemory = {
+    .Ranges = { &ShimMemory.Ranges, &ShimMemory.Ranges },
+};
+
+static SHIM_STATISTICS  ShimCounters;        // updated atomically
+
+static struct {
+    volatile LONG   Lock;
+    LIST_ENTRY      Timers;         // KTIMER.TimerListEntry
+    volatile LONG   Sequence;       // futex, bumped when a timer is set
+    pthread_t       Thread;
+} ShimTimers;
+
+
+static
+LONG
+ShimFutexWait(
+    __in     volatile LONG         *Address,
+    __in     LONG                   Value,
+    __in_opt const struct timespec *Timeout
+    )
+{
+    return (LONG)syscall(SYS_futex, Address, FUTEX_WAIT_PRIVATE, Value, Timeout, NULL, 0);
+}
+
+static
+VOID
+ShimFutexWake(
+    __in volatile LONG *Address,
+    __in LONG           Count
+    )
+{
+    syscall(SYS_futex, Address, FUTEX_WAKE_PRIVATE, Count, NULL, NULL, 0);
+}
+
+static
+VOID
+ShimRelativeTimespec(
+    __in  LONGLONG         Interval,
+    __out struct timespec *Timespec
+    )
+/*++
+Routine Description:
+
+    Converts an interval in 100ns units to a relative timespec.
+
+--*/
+{
+    if (Interval < 0) {
+        Interval = 0;
+    }
+    Timespec->tv_sec = Interval / 10000000;
+    Timespec->tv_nsec = (Interval % 10000000) * 100;
+}
+
+
+VOID
+ShimAcquireRawLock(
+    __inout volatile LONG *Lock
+    )
+/*++
+Routine Description:
+
+    Test and test-and-set lock without any IRQL change, for the shim and
+    the emulated controller. Spinners yield the host processor now and
+    then: the holder may be a preempted thread that needs it.
+
+--*/
+{
+    ULONG spins = 0;
+
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(Lock, __ATOMIC_RELAXED) != 0) {
+            if (++spins % SHIM_SPINS_BEFORE_YIELD == 0) {
+                sched_yield();
+            } else {
+                YieldProcessor();
+            }
+        }
+    }
+}
+
+VOID
+ShimReleaseRawLock(
+    __inout volatile LONG *Lock
+    )
+{
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+
+//
+// Processors
+//
+
+static
+VOID
+ShimPinThread(
+    __in ULONG Processor
+    )
+/*++
+Routine Description:
+
+    Pins the calling thread to the host processor a virtual processor
+    maps to, so that the threads of one virtual processor share a cache.
+
+--*/
+{
+    cpu_set_t set;
+    long      hostProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (hostProcessors <= 0) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(Processor % (ULONG)hostProcessors, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+VOID
+ShimBindThread(
+    __in ULONG Processor
+    )
+/*++
+Routine Description:
+
+    Makes the calling thread run as the given virtual processor, at
+    PASSIVE_LEVEL.
+
+--*/
+{
+    ASSERT(Processor < ShimProcessorCount);
+
+    ShimCurrentProcessor = Processor;
+    ShimCurrentIrql = PASSIVE_LEVEL;
+    ShimPinThread(Processor);
+}
+
+ULONG
+KeQueryActiveProcessorCountEx(
+    USHORT GroupNumber
+    )
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    return ShimProcessorCount;
+}
+
+ULONG
+KeQueryMaximumProcessorCountEx(
+    USHORT GroupNumber
+    )
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    return ShimProcessorCount;
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+    PPROCESSOR_NUMBER ProcNumber
+    )
+{
+    ULONG processor = ShimCurrentProcessor != SHIM_NO_PROCESSOR ? ShimCurrentProcessor : 0;
+
+    if (ProcNumber != NULL) {
+        ProcNumber->Group = 0;
+        ProcNumber->Number = (UCHAR)processor;
+        ProcNumber->Reserved = 0;
+    }
+
+    return processor;
+}
+
+NTSTATUS
+KeGetProcessorNumberFromIndex(
+    ULONG             ProcIndex,
+    PPROCESSOR_NUMBER ProcNumber
+    )
+{
+    if (ProcIndex >= ShimProcessorCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ProcNumber->Group = 0;
+    ProcNumber->Number = (UCHAR)ProcIndex;
+    ProcNumber->Reserved = 0;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+KeQueryLogicalProcessorRelationship(
+    PPROCESSOR_NUMBER                        ProcessorNumber,
+    LOGICAL_PROCESSOR_RELATIONSHIP           RelationshipType,
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Information,
+    PULONG                                   Length
+    )
+/*++
+Routine Description:
+
+    Answers RelationNumaNode for one processor. The virtual processors
+    are split into ShimNodeCount nodes of consecutive indices.
+
+--*/
+{
+    USHORT node;
+    ULONG  i;
+
+    if (RelationshipType != RelationNumaNode || ProcessorNumber == NULL ||
+        ProcessorNumber->Number >= ShimProcessorCount) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (*Length < sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)) {
+        *Length = sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX);
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    node = ShimProcessors[ProcessorNumber->Number].Node;
+
+    RtlZeroMemory(Information, sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX));
+    Information->Relationship = RelationNumaNode;
+    Information->Size = sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX);
+    Information->NumaNode.NodeNumber = node;
+    for (i = 0; i < ShimProcessorCount; i++) {
+        if (ShimProcessors[i].Node == node) {
+            Information->NumaNode.GroupMask.Mask |= (KAFFINITY)1 << i;
+        }
+    }
+    *Length = sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX);
+
+    return STATUS_SUCCESS;
+}
+
+
+//
+// IRQL and DPCs
+//
+
+static
+VOID
+ShimRetireDpcs(
+    __in PSHIM_PROCESSOR Processor
+    )
+/*++
+Routine Description:
+
+    Runs the DPCs queued on a processor until its queue is empty. Called
+    at DISPATCH_LEVEL. A DPC may be queued again once it was taken off.
+
+--*/
+{
+    PKDPC              dpc;
+    PKDEFERRED_ROUTINE routine;
+    PVOID              context, argument1, argument2;
+
+    for (;;) {
+
+        ShimAcquireRawLock(&Processor->DpcLock);
+        if (IsListEmpty(&Processor->DpcQueue)) {
+            ShimReleaseRawLock(&Processor->DpcLock);
+            return;
+        }
+        dpc = CONTAINING_RECORD(RemoveHeadList(&Processor->DpcQueue), KDPC, DpcListEntry);
+        routine = dpc->DeferredRoutine;
+        context = dpc->DeferredContext;
+        argument1 = dpc->SystemArgument1;
+        argument2 = dpc->SystemArgument2;
+        dpc->DpcData = NULL;
+        __atomic_add_fetch(&Processor->DpcActive, 1, __ATOMIC_SEQ_CST);
+        ShimReleaseRawLock(&Processor->DpcLock);
+
+        routine(dpc, context, argument1, argument2);
+
+        __atomic_sub_fetch(&Processor->DpcActive, 1, __ATOMIC_SEQ_CST);
+
+        ASSERT(ShimCurrentIrql == DISPATCH_LEVEL);
+    }
+}
+
+KIRQL
+KeGetCurrentIrql(
+    VOID
+    )
+{
+    return ShimCurrentIrql;
+}
+
+VOID
+KeRaiseIrql(
+    KIRQL  NewIrql,
+    PKIRQL OldIrql
+    )
+{
+    ASSERT(NewIrql >= ShimCurrentIrql);
+
+    *OldIrql = ShimCurrentIrql;
+    ShimCurrentIrql = NewIrql;
+}
+
+VOID
+KeLowerIrql(
+    KIRQL NewIrql
+    )
+/*++
+Routine Description:
+
+    Lowers the IRQL; dropping below DISPATCH_LEVEL first drains the DPC
+    queue of the current processor. The queue is peeked at without its
+    lock: a DPC queued behind the peek by another thread wakes the DPC
+    thread instead.
+
+--*/
+{
+    PSHIM_PROCESSOR processor;
+
+    ASSERT(NewIrql <= ShimCurrentIrql);
+
+    if (ShimCurrentIrql >= DISPATCH_LEVEL && NewIrql < DISPATCH_LEVEL &&
+        ShimCurrentProcessor != SHIM_NO_PROCESSOR) {
+
+        processor = &ShimProcessors[ShimCurrentProcessor];
+        ShimCurrentIrql = DISPATCH_LEVEL;
+
+        if (*(PLIST_ENTRY volatile *)&processor->DpcQueue.Flink != &processor->DpcQueue) {
+            ShimRetireDpcs(processor);
+        }
+    }
+
+    ShimCurrentIrql = NewIrql;
+}
+
+VOID
+KeInitializeDpc(
+    PRKDPC             Dpc,
+    PKDEFERRED_ROUTINE DeferredRoutine,
+    PVOID              DeferredContext
+    )
+{
+    RtlZeroMemory(Dpc, sizeof(KDPC));
+    Dpc->Importance = MediumImportance;
+    Dpc->DeferredRoutine = DeferredRoutine;
+    Dpc->DeferredContext = DeferredContext;
+}
+
+NTSTATUS
+KeSetTargetProcessorDpcEx(
+    PKDPC             Dpc,
+    PPROCESSOR_NUMBER ProcNumber
+    )
+/*++
+Routine Description:
+
+    Targets a DPC at a processor. KDPC.Number holds the index plus one,
+    0 meaning the processor the DPC is queued from.
+
+--*/
+{
+    if (ProcNumber->Group != 0 || ProcNumber->Number >= ShimProcessorCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Dpc->Number = (USHORT)(ProcNumber->Number + 1);
+
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+ShimWakeProcessor(
+    __in PSHIM_PROCESSOR Processor
+    )
+/*++
+Routine Description:
+
+    Makes the DPC thread of a processor look at its queue. The store to
+    DpcWake and the load of DpcThreadIdle pair with the opposite order
+    in ShimDpcThread, so that one of the two sides always sees the other.
+
+--*/
+{
+    __atomic_store_n(&Processor->DpcWake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&Processor->DpcThreadIdle, __ATOMIC_SEQ_CST)) {
+        ShimFutexWake(&Processor->DpcWake, 1);
+    }
+}
+
+BOOLEAN
+KeInsertQueueDpc(
+    PRKDPC Dpc,
+    PVOID  SystemArgument1,
+    PVOID  SystemArgument2
+    )
+{
+    ULONG           target;
+    PSHIM_PROCESSOR processor;
+    KIRQL           oldIrql;
+
+    if (Dpc->Number != 0) {
+        target = Dpc->Number - 1u;
+    } else if (ShimCurrentProcessor != SHIM_NO_PROCESSOR) {
+        target = ShimCurrentProcessor;
+    } else {
+        target = 0;
+    }
+    processor = &ShimProcessors[target];
+
+    ShimAcquireRawLock(&processor->DpcLock);
+    if (Dpc->DpcData != NULL) {
+        ShimReleaseRawLock(&processor->DpcLock);
+        return FALSE;
+    }
+    Dpc->DpcData = processor;
+    Dpc->SystemArgument1 = SystemArgument1;
+    Dpc->SystemArgument2 = SystemArgument2;
+    if (Dpc->Importance == HighImportance) {
+        InsertHeadList(&processor->DpcQueue, &Dpc->DpcListEntry);
+    } else {
+        InsertTailList(&processor->DpcQueue, &Dpc->DpcListEntry);
+    }
+    ShimReleaseRawLock(&processor->DpcLock);
+
+    if (target != ShimCurrentProcessor) {
+        ShimWakeProcessor(processor);
+    } else if (ShimCurrentIrql < DISPATCH_LEVEL) {
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+        KeLowerIrql(oldIrql);
+    }
+
+    return TRUE;
+}
+
+static
+PVOID
+ShimDpcThread(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Drains the DPC queue of one processor for DPCs queued from others,
+    and sleeps while it is empty.
+
+--*/
+{
+    ULONG           index = (ULONG)(ULONG_PTR)Context;
+    PSHIM_PROCESSOR processor = &ShimProcessors[index];
+
+    ShimBindThread(index);
+    ShimCurrentIrql = DISPATCH_LEVEL;
+
+    while (!__atomic_load_n(&ShimStopping, __ATOMIC_ACQUIRE)) {
+
+        __atomic_store_n(&processor->DpcWake, 0, __ATOMIC_SEQ_CST);
+
+        ShimRetireDpcs(processor);
+
+        __atomic_store_n(&processor->DpcThreadIdle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&processor->DpcWake, __ATOMIC_SEQ_CST) == 0) {
+            ShimFutexWait(&processor->DpcWake, 0, NULL);
+        }
+        __atomic_store_n(&processor->DpcThreadIdle, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+VOID
+KeFlushQueuedDpcs(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Returns once every DPC queued before the call has run. Called at
+    PASSIVE_LEVEL, so the queue of the current processor is empty
+    already; the others are waited for until they are empty and none of
+    their DPCs is still running.
+
+--*/
+{
+    PSHIM_PROCESSOR processor;
+    ULONG           i;
+
+    ASSERT(ShimCurrentIrql == PASSIVE_LEVEL);
+
+    for (i = 0; i < ShimProcessorCount; i++) {
+
+        processor = &ShimProcessors[i];
+
+        for (;;) {
+            ShimAcquireRawLock(&processor->DpcLock);
+            if (IsListEmpty(&processor->DpcQueue) &&
+                __atomic_load_n(&processor->DpcActive, __ATOMIC_SEQ_CST) == 0) {
+                ShimReleaseRawLock(&processor->DpcLock);
+                break;
+            }
+            ShimReleaseRawLock(&processor->DpcLock);
+            ShimWakeProcessor(processor);
+            sched_yield();
+        }
+    }
+}
+
+
+//
+// Spin locks
+//
+
+VOID
+KeInitializeSpinLock(
+    PKSPIN_LOCK SpinLock
+    )
+{
+    *SpinLock = 0;
+}
+
+VOID
+KeAcquireSpinLockAtDpcLevel(
+    PKSPIN_LOCK SpinLock
+    )
+{
+    ULONG spins = 0;
+
+    ASSERT(ShimCurrentIrql >= DISPATCH_LEVEL);
+
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED) != 0) {
+            if (++spins % SHIM_SPINS_BEFORE_YIELD == 0) {
+                sched_yield();
+            } else {
+                YieldProcessor();
+            }
+        }
+    }
+}
+
+VOID
+KeReleaseSpinLockFromDpcLevel(
+    PKSPIN_LOCK SpinLock
+    )
+{
+    ASSERT(*SpinLock != 0);
+
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID
+KeAcquireSpinLock(
+    PKSPIN_LOCK SpinLock,
+    PKIRQL      OldIrql
+    )
+{
+    KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+    KeAcquireSpinLockAtDpcLevel(SpinLock);
+}
+
+VOID
+KeReleaseSpinLock(
+    PKSPIN_LOCK SpinLock,
+    KIRQL       NewIrql
+    )
+{
+    KeReleaseSpinLockFromDpcLevel(SpinLock);
+    KeLowerIrql(NewIrql);
+}
+
+
+//
+// Events and fast mutexes
+//
+
+VOID
+KeInitializeEvent(
+    PRKEVENT   Event,
+    EVENT_TYPE Type,
+    BOOLEAN    State
+    )
+{
+    RtlZeroMemory(Event, sizeof(KEVENT));
+    Event->Header.Type = (UCHAR)Type;
+    Event->Header.SignalState = State ? 1 : 0;
+    InitializeListHead(&Event->Header.WaitListHead);
+}
+
+LONG
+KeSetEvent(
+    PRKEVENT  Event,
+    KPRIORITY Increment,
+    BOOLEAN   Wait
+    )
+{
+    LONG previous;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    previous = __atomic_exchange_n(&Event->Header.SignalState, 1, __ATOMIC_SEQ_CST);
+    if (previous == 0) {
+        ShimFutexWake(&Event->Header.SignalState,
+                      Event->Header.Type == NotificationEvent ? INT_MAX : 1);
+    }
+
+    return previous;
+}
+
+VOID
+KeClearEvent(
+    PRKEVENT Event
+    )
+{
+    __atomic_store_n(&Event->Header.SignalState, 0, __ATOMIC_SEQ_CST);
+}
+
+LONG
+KeResetEvent(
+    PRKEVENT Event
+    )
+{
+    return __atomic_exchange_n(&Event->Header.SignalState, 0, __ATOMIC_SEQ_CST);
+}
+
+LONG
+KeReadStateEvent(
+    PRKEVENT Event
+    )
+{
+    return __atomic_load_n(&Event->Header.SignalState, __ATOMIC_SEQ_CST);
+}
+
+static
+VOID
+ShimWaitForMutex(
+    __inout PRKMUTEX Mutex
+    )
+/*++
+Routine Description:
+
+    Takes a mutex, which the owner may take again. SignalState is 0
+    when free, 1 when owned and 2 when owned with waiters, who sleep on
+    it, as for a fast mutex.
+
+--*/
+{
+    PVOID self = (PVOID)pthread_self();
+    LONG  count = 0;
+
+    if (__atomic_load_n(&Mutex->OwnerThread, __ATOMIC_RELAXED) == self) {
+        Mutex->RecursionCount++;
+        return;
+    }
+
+    if (!__atomic_compare_exchange_n(&Mutex->Header.SignalState, &count, 1,
+                                     FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (count != 2) {
+            count = __atomic_exchange_n(&Mutex->Header.SignalState, 2, __ATOMIC_ACQUIRE);
+        }
+        while (count != 0) {
+            ShimFutexWait(&Mutex->Header.SignalState, 2, NULL);
+            count = __atomic_exchange_n(&Mutex->Header.SignalState, 2, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    __atomic_store_n(&Mutex->OwnerThread, self, __ATOMIC_RELAXED);
+    Mutex->RecursionCount = 1;
+}
+
+NTSTATUS
+KeWaitForSingleObject(
+    PVOID           Object,
+    KWAIT_REASON    WaitReason,
+    KPROCESSOR_MODE WaitMode,
+    BOOLEAN         Alertable,
+    PLARGE_INTEGER  Timeout
+    )
+/*++
+Routine Description:
+
+    Waits for an event or a mutex. Only relative timeouts are supported,
+    and only for events; the driver takes its mutexes without one.
+
+--*/
+{
+    PRKEVENT        event = (PRKEVENT)Object;
+    ULONGLONG       deadline = 0;
+    LONG            expected;
+    struct timespec remaining;
+
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    ASSERT(Timeout == NULL || Timeout->QuadPart <= 0);
+    ASSERT(ShimCurrentIrql <= APC_LEVEL || (Timeout != NULL && Timeout->QuadPart == 0));
+
+    if (event->Header.Type == SHIM_MUTANT_OBJECT) {
+        ASSERT(Timeout == NULL);
+        ShimWaitForMutex((PRKMUTEX)Object);
+        return STATUS_SUCCESS;
+    }
+
+    if (Timeout != NULL) {
+        deadline = KeQueryInterruptTime() - Timeout->QuadPart;
+    }
+
+    for (;;) {
+
+        if (event->Header.Type == SynchronizationEvent) {
+            expected = 1;
+            if (__atomic_compare_exchange_n(&event->Header.SignalState, &expected, 0,
+                                            FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                return STATUS_SUCCESS;
+            }
+        } else if (__atomic_load_n(&event->Header.SignalState, __ATOMIC_SEQ_CST) != 0) {
+            return STATUS_SUCCESS;
+        }
+
+        if (Timeout != NULL) {
+            LONGLONG left = (LONGLONG)(deadline - KeQueryInterruptTime());
+            if (left <= 0) {
+                return STATUS_TIMEOUT;
+            }
+            ShimRelativeTimespec(left, &remaining);
+        }
+
+        ShimFutexWait(&event->Header.SignalState, 0, Timeout != NULL ? &remaining : NULL);
+    }
+}
+
+VOID
+KeInitializeMutex(
+    PRKMUTEX Mutex,
+    ULONG    Level
+    )
+{
+    UNREFERENCED_PARAMETER(Level);
+
+    RtlZeroMemory(Mutex, sizeof(KMUTEX));
+    Mutex->Header.Type = SHIM_MUTANT_OBJECT;
+    InitializeListHead(&Mutex->Header.WaitListHead);
+}
+
+LONG
+KeReleaseMutex(
+    PRKMUTEX Mutex,
+    BOOLEAN  Wait
+    )
+{
+    UNREFERENCED_PARAMETER(Wait);
+
+    ASSERT(Mutex->OwnerThread == (PVOID)pthread_self());
+
+    if (--Mutex->RecursionCount != 0) {
+        return 0;
+    }
+
+    __atomic_store_n(&Mutex->OwnerThread, NULL, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&Mutex->Header.SignalState, 0, __ATOMIC_RELEASE) == 2) {
+        ShimFutexWake(&Mutex->Header.SignalState, 1);
+    }
+
+    return 0;
+}
+
+VOID
+ExInitializeFastMutex(
+    PFAST_MUTEX FastMutex
+    )
+{
+    FastMutex->Count = 0;
+    FastMutex->Owner = NULL;
+    FastMutex->Contention = 0;
+    FastMutex->OldIrql = PASSIVE_LEVEL;
+}
+
+VOID
+ExAcquireFastMutex(
+    PFAST_MUTEX FastMutex
+    )
+/*++
+Routine Description:
+
+    Count is 0 when free, 1 when owned and 2 when owned with waiters,
+    who sleep on it.
+
+--*/
+{
+    KIRQL oldIrql;
+    LONG  count = 0;
+
+    KeRaiseIrql(APC_LEVEL, &oldIrql);
+
+    if (!__atomic_compare_exchange_n(&FastMutex->Count, &count, 1,
+                                     FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (count != 2) {
+            count = __atomic_exchange_n(&FastMutex->Count, 2, __ATOMIC_ACQUIRE);
+        }
+        while (count != 0) {
+            FastMutex->Contention++;
+            ShimFutexWait(&FastMutex->Count, 2, NULL);
+            count = __atomic_exchange_n(&FastMutex->Count, 2, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    FastMutex->Owner = (PVOID)pthread_self();
+    FastMutex->OldIrql = oldIrql;
+}
+
+VOID
+ExReleaseFastMutex(
+    PFAST_MUTEX FastMutex
+    )
+{
+    KIRQL oldIrql = (KIRQL)FastMutex->OldIrql;
+
+    ASSERT(FastMutex->Owner == (PVOID)pthread_self());
+
+    FastMutex->Owner = NULL;
+    if (__atomic_exchange_n(&FastMutex->Count, 0, __ATOMIC_RELEASE) == 2) {
+        ShimFutexWake(&FastMutex->Count, 1);
+    }
+
+    KeLowerIrql(oldIrql);
+}
+
+
+//
+// Rundown protection
+//
+
+//
+// Count holds two per reference, plus one once the rundown has begun.
+// The low dword doubles as the futex the rundown waits on.
+//
+
+VOID
+ExInitializeRundownProtection(
+    PEX_RUNDOWN_REF RunRef
+    )
+{
+    RunRef->Count = 0;
+}
+
+VOID
+ExReInitializeRundownProtection(
+    PEX_RUNDOWN_REF RunRef
+    )
+{
+    __atomic_store_n(&RunRef->Count, 0, __ATOMIC_RELEASE);
+}
+
+BOOLEAN
+ExAcquireRundownProtection(
+    PEX_RUNDOWN_REF RunRef
+    )
+{
+    ULONG_PTR count = __atomic_load_n(&RunRef->Count, __ATOMIC_RELAXED);
+
+    do {
+        if (count & 1) {
+            return FALSE;
+        }
+    } while (!__atomic_compare_exchange_n(&RunRef->Count, &count, count + 2,
+                                          TRUE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return TRUE;
+}
+
+VOID
+ExReleaseRundownProtection(
+    PEX_RUNDOWN_REF RunRef
+    )
+{
+    if (__atomic_sub_fetch(&RunRef->Count, 2, __ATOMIC_RELEASE) == 1) {
+        ShimFutexWake((volatile LONG *)&RunRef->Count, INT_MAX);
+    }
+}
+
+VOID
+ExWaitForRundownProtectionRelease(
+    PEX_RUNDOWN_REF RunRef
+    )
+{
+    ULONG_PTR count;
+
+    count = __atomic_or_fetch(&RunRef->Count, 1, __ATOMIC_ACQUIRE);
+    while (count != 1) {
+        ShimFutexWait((volatile LONG *)&RunRef->Count, (LONG)count, NULL);
+        count = __atomic_load_n(&RunRef->Count, __ATOMIC_ACQUIRE);
+    }
+}
+
+
+//
+// Time and timers
+//
+
+ULONGLONG
+KeQueryInterruptTime(
+    VOID
+    )
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (ULONGLONG)now.tv_sec * 10000000 + (ULONGLONG)now.tv_nsec / 100;
+}
+
+VOID
+KeQuerySystemTime(
+    PLARGE_INTEGER CurrentTime
+    )
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    CurrentTime->QuadPart = SHIM_UNIX_EPOCH +
+                            (LONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+}
+
+NTSTATUS
+KeDelayExecutionThread(
+    KPROCESSOR_MODE WaitMode,
+    BOOLEAN         Alertable,
+    PLARGE_INTEGER  Interval
+    )
+/*++
+Routine Description:
+
+    Sleeps for a relative interval.
+
+--*/
+{
+    struct timespec remaining;
+
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    ASSERT(Interval->QuadPart <= 0);
+    ASSERT(ShimCurrentIrql <= APC_LEVEL);
+
+    ShimRelativeTimespec(-Interval->QuadPart, &remaining);
+    while (nanosleep(&remaining, &remaining) != 0 && errno == EINTR) {
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+KeInitializeTimer(
+    PKTIMER Timer
+    )
+{
+    RtlZeroMemory(Timer, sizeof(KTIMER));
+    Timer->Header.Type = NotificationTimer;
+    InitializeListHead(&Timer->Header.WaitListHead);
+    InitializeListHead(&Timer->TimerListEntry);
+}
+
+VOID
+KeInitializeTimerEx(
+    PKTIMER    Timer,
+    TIMER_TYPE Type
+    )
+{
+    KeInitializeTimer(Timer);
+    Timer->Header.Type = (UCHAR)Type;
+}
+
+BOOLEAN
+KeSetTimerEx(
+    PKTIMER       Timer,
+    LARGE_INTEGER DueTime,
+    LONG          Period,
+    PKDPC         Dpc
+    )
+/*++
+Routine Description:
+
+    (Re)arms a timer. Only relative due times are supported.
+
+--*/
+{
+    BOOLEAN inserted;
+
+    ASSERT(DueTime.QuadPart <= 0);
+
+    ShimAcquireRawLock(&ShimTimers.Lock);
+
+    inserted = (BOOLEAN)!IsListEmpty(&Timer->TimerListEntry);
+    if (inserted) {
+        RemoveEntryList(&Timer->TimerListEntry);
+    }
+
+    Timer->DueTime.QuadPart = KeQueryInterruptTime() - DueTime.QuadPart;
+    Timer->Period = Period;
+    Timer->Dpc = Dpc;
+    Timer->Header.SignalState = 0;
+    InsertTailList(&ShimTimers.Timers, &Timer->TimerListEntry);
+
+    __atomic_add_fetch(&ShimTimers.Sequence, 1, __ATOMIC_SEQ_CST);
+
+    ShimReleaseRawLock(&ShimTimers.Lock);
+
+    ShimFutexWake(&ShimTimers.Sequence, 1);
+
+    return inserted;
+}
+
+BOOLEAN
+KeSetTimer(
+    PKTIMER       Timer,
+    LARGE_INTEGER DueTime,
+    PKDPC         Dpc
+    )
+{
+    return KeSetTimerEx(Timer, DueTime, 0, Dpc);
+}
+
+BOOLEAN
+KeCancelTimer(
+    PKTIMER Timer
+    )
+{
+    BOOLEAN inserted;
+
+    ShimAcquireRawLock(&ShimTimers.Lock);
+
+    inserted = (BOOLEAN)!IsListEmpty(&Timer->TimerListEntry);
+    if (inserted) {
+        RemoveEntryList(&Timer->TimerListEntry);
+        InitializeListHead(&Timer->TimerListEntry);
+    }
+
+    ShimReleaseRawLock(&ShimTimers.Lock);
+
+    return inserted;
+}
+
+static
+PVOID
+ShimTimerThread(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Fires expired timers, one at a time so that the DPC is queued
+    without the timer lock held, and sleeps until the next one is due
+    or a timer is set. The thread belongs to no processor: the DPCs it
+    queues run on the DPC thread of their target, processor 0 for an
+    untargeted one.
+
+--*/
+{
+    PLIST_ENTRY     entry;
+    PKTIMER         timer, expired;
+    PKDPC           dpc;
+    ULONGLONG       now, next;
+    LONG            sequence;
+    struct timespec timeout;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    while (!__atomic_load_n(&ShimStopping, __ATOMIC_ACQUIRE)) {
+
+        sequence = __atomic_load_n(&ShimTimers.Sequence, __ATOMIC_SEQ_CST);
+        now = KeQueryInterruptTime();
+        next = MAXULONGLONG;
+        expired = NULL;
+        dpc = NULL;
+
+        ShimAcquireRawLock(&ShimTimers.Lock);
+
+        for (entry = ShimTimers.Timers.Flink; entry != &ShimTimers.Timers; entry = entry->Flink) {
+            timer = CONTAINING_RECORD(entry, KTIMER, TimerListEntry);
+            if (timer->DueTime.QuadPart <= now) {
+                expired = timer;
+                break;
+            }
+            next = min(next, timer->DueTime.QuadPart);
+        }
+
+        if (expired != NULL) {
+            RemoveEntryList(&expired->TimerListEntry);
+            if (expired->Period != 0) {
+                expired->DueTime.QuadPart = now + (ULONGLONG)expired->Period * 10000;
+                InsertTailList(&ShimTimers.Timers, &expired->TimerListEntry);
+            } else {
+                InitializeListHead(&expired->TimerListEntry);
+            }
+            expired->Header.SignalState = 1;
+            dpc = expired->Dpc;
+        }
+
+        ShimReleaseRawLock(&ShimTimers.Lock);
+
+        if (expired != NULL) {
+            if (dpc != NULL) {
+                KeInsertQueueDpc(dpc, NULL, NULL);
+            }
+            continue;
+        }
+
+        if (next != MAXULONGLONG) {
+            ShimRelativeTimespec((LONGLONG)(next - now), &timeout);
+        }
+        ShimFutexWait(&ShimTimers.Sequence, sequence,
+                      next != MAXULONGLONG ? &timeout : NULL);
+    }
+
+    return NULL;
+}
+
+
+//
+// Memory
+//
+
+PVOID
+ExAllocatePoolWithTag(
+    POOL_TYPE PoolType,
+    SIZE_T    NumberOfBytes,
+    ULONG     Tag
+    )
+/*++
+Routine Description:
+
+    Pool allocations of a page or more are page aligned, as in the kernel.
+
+--*/
+{
+    PVOID buffer;
+
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+
+    __atomic_add_fetch(&ShimCounters.PoolAllocations, 1, __ATOMIC_RELAXED);
+
+    if (posix_memalign(&buffer,
+                       NumberOfBytes >= PAGE_SIZE ? PAGE_SIZE : MEMORY_ALLOCATION_ALIGNMENT,
+                       NumberOfBytes != 0 ? NumberOfBytes : 1) != 0) {
+        return NULL;
+    }
+
+    return buffer;
+}
+
+VOID
+ExFreePoolWithTag(
+    PVOID P,
+    ULONG Tag
+    )
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    free(P);
+}
+
+PVOID
+MmAllocateContiguousNodeMemory(
+    SIZE_T           NumberOfBytes,
+    PHYSICAL_ADDRESS LowestAcceptableAddress,
+    PHYSICAL_ADDRESS HighestAcceptableAddress,
+    PHYSICAL_ADDRESS BoundaryAddressMultiple,
+    ULONG            Protect,
+    NODE_REQUIREMENT PreferredNode
+    )
+/*++
+Routine Description:
+
+    Allocates page aligned memory and records the node it is placed on:
+    the preferred node, with or without MM_ANY_NODE_OK, or that of the
+    calling processor, as the memory manager picks, when any node will
+    do. A node always has memory to spare here.
+
+--*/
+{
+    PSHIM_MEMORY_RANGE range;
+    PVOID              buffer;
+
+    UNREFERENCED_PARAMETER(LowestAcceptableAddress);
+    UNREFERENCED_PARAMETER(HighestAcceptableAddress);
+    UNREFERENCED_PARAMETER(BoundaryAddressMultiple);
+    UNREFERENCED_PARAMETER(Protect);
+
+    range = malloc(sizeof(SHIM_MEMORY_RANGE));
+    if (range == NULL) {
+        return NULL;
+    }
+
+    if (posix_memalign(&buffer, PAGE_SIZE, ROUND_TO_PAGES(NumberOfBytes)) != 0) {
+        free(range);
+        return NULL;
+    }
+
+    range->Base = (ULONG_PTR)buffer;
+    range->Length = ROUND_TO_PAGES(NumberOfBytes);
+    range->Node = PreferredNode != MM_ANY_NODE_OK &&
+                  (PreferredNode & ~MM_ANY_NODE_OK) < ShimNodeCount ?
+                  (USHORT)(PreferredNode & ~MM_ANY_NODE_OK) : ShimQueryCurrentNode();
+
+    ShimAcquireRawLock(&ShimMemory.Lock);
+    InsertTailList(&ShimMemory.Ranges, &range->Link);
+    ShimReleaseRawLock(&ShimMemory.Lock);
+
+    return buffer;
+}
+
+VOID
+MmFreeContiguousMemory(
+    PVOID BaseAddress
+    )
+{
+    PSHIM_MEMORY_RANGE range;
+    PLIST_ENTRY        entry;
+
+    ShimAcquireRawLock(&ShimMemory.Lock);
+    for (entry = ShimMemory.Ranges.Flink; entry != &ShimMemory.Ranges; entry = entry->Flink) {
+        range = CONTAINING_RECORD(entry, SHIM_MEMORY_RANGE, Link);
+        if (range->Base == (ULONG_PTR)BaseAddress) {
+            RemoveEntryList(&range->Link);
+            free(range);
+            break;
+        }
+    }
+    ShimReleaseRawLock(&ShimMemory.Lock);
+
+    free(BaseAddress);
+}
+
+USHORT
+ShimQueryMemoryNode(
+    __in PVOID Address
+    )
+/*++
+Routine Description:
+
+    Tells which node contiguous memory was placed on, SHIM_NODE_NONE for
+    any other memory. A lookup walks all allocations, so callers do it
+    once, when they learn of the memory.
+
+--*/
+{
+    PSHIM_MEMORY_RANGE range;
+    PLIST_ENTRY        entry;
+    USHORT             node = SHIM_NODE_NONE;
+
+    ShimAcquireRawLock(&ShimMemory.Lock);
+    for (entry = ShimMemory.Ranges.Flink; entry != &ShimMemory.Ranges; entry = entry->Flink) {
+        range = CONTAINING_RECORD(entry, SHIM_MEMORY_RANGE, Link);
+        if ((ULONG_PTR)Address - range->Base < range->Length) {
+            node = range->Node;
+            break;
+        }
+    }
+    ShimReleaseRawLock(&ShimMemory.Lock);
+
+    return node;
+}
+
+USHORT
+ShimQueryCurrentNode(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Tells the node of the processor the calling thread is bound to, 0
+    for threads not bound to any.
+
+--*/
+{
+    if (ShimCurrentProcessor == SHIM_NO_PROCESSOR) {
+        return 0;
+    }
+
+    return ShimProcessors[ShimCurrentProcessor].Node;
+}
+
+VOID
+ShimQueryStatistics(
+    __out PSHIM_STATISTICS Statistics
+    )
+{
+    Statistics->PoolAllocations =
+        __atomic_load_n(&ShimCounters.PoolAllocations, __ATOMIC_RELAXED);
+    Statistics->IrpAllocations = __atomic_load_n(&ShimCounters.IrpAllocations, __ATOMIC_RELAXED);
+    Statistics->MdlAllocations = __atomic_load_n(&ShimCounters.MdlAllocations, __ATOMIC_RELAXED);
+    Statistics->Completions = __atomic_load_n(&ShimCounters.Completions, __ATOMIC_RELAXED);
+}
+
+PHYSICAL_ADDRESS
+MmGetPhysicalAddress(
+    PVOID BaseAddress
+    )
+{
+    PHYSICAL_ADDRESS physical;
+
+    physical.QuadPart = (LONGLONG)(ULONG_PTR)BaseAddress;
+
+    return physical;
+}
+
+VOID
+ExFreePool(
+    PVOID P
+    )
+{
+    free(P);
+}
+
+PVOID
+MmAllocateContiguousMemory(
+    SIZE_T           NumberOfBytes,
+    PHYSICAL_ADDRESS HighestAcceptableAddress
+    )
+{
+    PHYSICAL_ADDRESS zero;
+
+    zero.QuadPart = 0;
+
+    return MmAllocateContiguousNodeMemory(NumberOfBytes, zero, HighestAcceptableAddress,
+                                          zero, PAGE_READWRITE, MM_ANY_NODE_OK);
+}
+
+PVOID
+MmMapIoSpace(
+    PHYSICAL_ADDRESS    PhysicalAddress,
+    SIZE_T              NumberOfBytes,
+    MEMORY_CACHING_TYPE CacheType
+    )
+/*++
+Routine Description:
+
+    The BARs the bus driver of bench.c hands out are the register blocks
+    of emulated controllers, identity mapped like all other memory.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(NumberOfBytes);
+    UNREFERENCED_PARAMETER(CacheType);
+
+    return (PVOID)(ULONG_PTR)PhysicalAddress.QuadPart;
+}
+
+VOID
+MmUnmapIoSpace(
+    PVOID  BaseAddress,
+    SIZE_T NumberOfBytes
+    )
+{
+    UNREFERENCED_PARAMETER(BaseAddress);
+    UNREFERENCED_PARAMETER(NumberOfBytes);
+}
+
+PVOID
+MmLockPagableCodeSection(
+    PVOID AddressWithinSection
+    )
+/*++
+Routine Description:
+
+    Nothing is paged; the handle only has to be non-NULL.
+
+--*/
+{
+    return AddressWithinSection;
+}
+
+VOID
+MmUnlockPagableImageSection(
+    PVOID ImageSectionHandle
+    )
+{
+    UNREFERENCED_PARAMETER(ImageSectionHandle);
+}
+
+PMDL
+IoAllocateMdl(
+    PVOID   VirtualAddress,
+    ULONG   Length,
+    BOOLEAN SecondaryBuffer,
+    BOOLEAN ChargeQuota,
+    PIRP    Irp
+    )
+{
+    ULONG pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(VirtualAddress, Length);
+    PMDL  mdl;
+
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    __atomic_add_fetch(&ShimCounters.MdlAllocations, 1, __ATOMIC_RELAXED);
+
+    mdl = malloc(sizeof(MDL) + pages * sizeof(PFN_NUMBER));
+    if (mdl == NULL) {
+        return NULL;
+    }
+
+    mdl->Next = NULL;
+    mdl->Size = (CSHORT)(sizeof(MDL) + pages * sizeof(PFN_NUMBER));
+    mdl->MdlFlags = 0;
+    mdl->MappedSystemVa = NULL;
+    mdl->StartVa = PAGE_ALIGN(VirtualAddress);
+    mdl->ByteOffset = BYTE_OFFSET(VirtualAddress);
+    mdl->ByteCount = Length;
+
+    if (Irp != NULL && !SecondaryBuffer) {
+        Irp->MdlAddress = mdl;
+    }
+
+    return mdl;
+}
+
+VOID
+IoFreeMdl(
+    PMDL Mdl
+    )
+{
+    free(Mdl);
+}
+
+VOID
+MmBuildMdlForNonPagedPool(
+    PMDL MemoryDescriptorList
+    )
+{
+    PPFN_NUMBER pfns = MmGetMdlPfnArray(MemoryDescriptorList);
+    ULONG       pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(MemoryDescriptorList),
+                                                       MemoryDescriptorList->ByteCount);
+    ULONG       i;
+
+    for (i = 0; i < pages; i++) {
+        pfns[i] = ((ULONG_PTR)MemoryDescriptorList->StartVa >> PAGE_SHIFT) + i;
+    }
+
+    MemoryDescriptorList->MappedSystemVa = MmGetMdlVirtualAddress(MemoryDescriptorList);
+}
+
+VOID
+IoBuildPartialMdl(
+    PMDL  SourceMdl,
+    PMDL  TargetMdl,
+    PVOID VirtualAddress,
+    ULONG Length
+    )
+/*++
+Routine Description:
+
+    Describes part of the buffer of SourceMdl with TargetMdl, which must
+    be large enough for the pages it spans. A Length of 0 takes the rest
+    of the source buffer.
+
+--*/
+{
+    ULONG_PTR   offset = (PUCHAR)VirtualAddress - (PUCHAR)MmGetMdlVirtualAddress(SourceMdl);
+    PPFN_NUMBER source, target;
+    ULONG       first, pages, i;
+
+    if (Length == 0) {
+        Length = SourceMdl->ByteCount - (ULONG)offset;
+    }
+
+    ASSERT(offset + Length <= SourceMdl->ByteCount);
+
+    TargetMdl->StartVa = PAGE_ALIGN(VirtualAddress);
+    TargetMdl->ByteOffset = BYTE_OFFSET(VirtualAddress);
+    TargetMdl->ByteCount = Length;
+    TargetMdl->MappedSystemVa = SourceMdl->MappedSystemVa != NULL ?
+                                (PUCHAR)SourceMdl->MappedSystemVa + offset : NULL;
+
+    first = (ULONG)((SourceMdl->ByteOffset + offset) >> PAGE_SHIFT);
+    pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(VirtualAddress, Length);
+    source = MmGetMdlPfnArray(SourceMdl);
+    target = MmGetMdlPfnArray(TargetMdl);
+
+    ASSERT(sizeof(MDL) + pages * sizeof(PFN_NUMBER) <= (ULONG)(USHORT)TargetMdl->Size);
+
+    for (i = 0; i < pages; i++) {
+        target[i] = source[first + i];
+    }
+}
+
+VOID
+MmPrepareMdlForReuse(
+    PMDL Mdl
+    )
+{
+    Mdl->MappedSystemVa = NULL;
+}
+
+VOID
+KeFlushIoBuffers(
+    PMDL    Mdl,
+    BOOLEAN ReadOperation,
+    BOOLEAN DmaOperation
+    )
+{
+    //
+    // Coherent, as on x86 and x64.
+    //
+    UNREFERENCED_PARAMETER(Mdl);
+    UNREFERENCED_PARAMETER(ReadOperation);
+    UNREFERENCED_PARAMETER(DmaOperation);
+}
+
+
+//
+// IRPs
+//
+
+USHORT
+IoSizeOfIrp(
+    CCHAR StackSize
+    )
+{
+    return (USHORT)(sizeof(IRP) + StackSize * sizeof(IO_STACK_LOCATION));
+}
+
+VOID
+IoInitializeIrp(
+    PIRP   Irp,
+    USHORT PacketSize,
+    CCHAR  StackSize
+    )
+/*++
+Routine Description:
+
+    The stack locations follow the IRP; the current location starts one
+    past the last, so that the caller's IoGetNextIrpStackLocation is the
+    topmost one, as in the kernel.
+
+--*/
+{
+    RtlZeroMemory(Irp, PacketSize);
+    Irp->Size = PacketSize;
+    Irp->StackCount = StackSize;
+    Irp->CurrentLocation = (CHAR)(StackSize + 1);
+    Irp->PriorityHint = IoPriorityNormal;
+    InitializeListHead(&Irp->ThreadListEntry);
+    Irp->Tail.Overlay.CurrentStackLocation = (PIO_STACK_LOCATION)(Irp + 1) + StackSize;
+}
+
+PIRP
+IoAllocateIrp(
+    CCHAR   StackSize,
+    BOOLEAN ChargeQuota
+    )
+{
+    USHORT size = IoSizeOfIrp(StackSize);
+    PIRP   irp;
+
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    __atomic_add_fetch(&ShimCounters.IrpAllocations, 1, __ATOMIC_RELAXED);
+
+    irp = malloc(size);
+    if (irp != NULL) {
+        IoInitializeIrp(irp, size, StackSize);
+    }
+
+    return irp;
+}
+
+VOID
+IoReuseIrp(
+    PIRP     Irp,
+    NTSTATUS Status
+    )
+{
+    UCHAR allocationFlags = Irp->AllocationFlags;
+
+    IoInitializeIrp(Irp, Irp->Size, Irp->StackCount);
+    Irp->AllocationFlags = allocationFlags;
+    Irp->IoStatus.Status = Status;
+}
+
+VOID
+IoFreeIrp(
+    PIRP Irp
+    )
+{
+    free(Irp);
+}
+
+IO_PRIORITY_HINT
+IoGetIoPriorityHint(
+    PIRP Irp
+    )
+{
+    return Irp->PriorityHint;
+}
+
+NTSTATUS
+IoSetIoPriorityHint(
+    PIRP             Irp,
+    IO_PRIORITY_HINT PriorityHint
+    )
+{
+    if (PriorityHint >= MaxIoPriorityTypes) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Irp->PriorityHint = PriorityHint;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+IoCompleteRequest(
+    PIRP  Irp,
+    CCHAR PriorityBoost
+    )
+/*++
+Routine Description:
+
+    Walks the IRP back up its stack, calling the completion routine of
+    every location above the current one that asked for this status. A
+    routine that returns STATUS_MORE_PROCESSING_REQUIRED takes the IRP
+    back. Off the top, the IRP reports to its UserIosb and UserEvent,
+    and is freed if the shim built it.
+
+--*/
+{
+    PIO_STACK_LOCATION stack;
+    PDEVICE_OBJECT     deviceObject;
+    PKEVENT            event;
+    UCHAR              control;
+    NTSTATUS           status;
+
+    ASSERT(Irp->IoStatus.Status != STATUS_PENDING);
+    ASSERT(Irp->CancelRoutine == NULL);
+    ASSERT(Irp->CurrentLocation <= Irp->StackCount + 1);
+
+    __atomic_add_fetch(&ShimCounters.Completions, 1, __ATOMIC_RELAXED);
+
+    while (Irp->CurrentLocation <= Irp->StackCount) {
+
+        stack = IoGetCurrentIrpStackLocation(Irp);
+        control = stack->Control;
+        Irp->PendingReturned = (BOOLEAN)((control & SL_PENDING_RETURNED) != 0);
+
+        IoSkipCurrentIrpStackLocation(Irp);
+
+        if (stack->CompletionRoutine != NULL &&
+            ((NT_SUCCESS(Irp->IoStatus.Status) && (control & SL_INVOKE_ON_SUCCESS)) ||
+             (!NT_SUCCESS(Irp->IoStatus.Status) && (control & SL_INVOKE_ON_ERROR)) ||
+             (Irp->Cancel && (control & SL_INVOKE_ON_CANCEL)))) {
+
+            deviceObject = Irp->CurrentLocation <= Irp->StackCount ?
+                               IoGetCurrentIrpStackLocation(Irp)->DeviceObject : NULL;
+
+            status = stack->CompletionRoutine(deviceObject, Irp, stack->Context);
+            if (status == STATUS_MORE_PROCESSING_REQUIRED) {
+                return;
+            }
+
+        } else if (Irp->PendingReturned && Irp->CurrentLocation <= Irp->StackCount) {
+            IoMarkIrpPending(Irp);
+        }
+    }
+
+    event = Irp->UserEvent;
+
+    if (Irp->UserIosb != NULL) {
+        *Irp->UserIosb = Irp->IoStatus;
+    }
+
+    //
+    // An IRP of IoBuildSynchronousFsdRequest is the I/O manager's to free,
+    // before the waiter can go on.
+    //
+    if (Irp->AllocationFlags & SHIM_IRP_FREE_ON_COMPLETION) {
+        if (Irp->MdlAddress != NULL) {
+            IoFreeMdl(Irp->MdlAddress);
+            Irp->MdlAddress = NULL;
+        }
+        IoFreeIrp(Irp);
+    }
+
+    if (event != NULL) {
+        KeSetEvent(event, PriorityBoost, FALSE);
+    }
+}
+
+VOID
+IoAcquireCancelSpinLock(
+    PKIRQL Irql
+    )
+{
+    KeAcquireSpinLock(&ShimCancelLock, Irql);
+}
+
+VOID
+IoReleaseCancelSpinLock(
+    KIRQL Irql
+    )
+{
+    KeReleaseSpinLock(&ShimCancelLock, Irql);
+}
+
+BOOLEAN
+IoCancelIrp(
+    PIRP Irp
+    )
+{
+    PDRIVER_CANCEL routine;
+    KIRQL          irql;
+
+    IoAcquireCancelSpinLock(&irql);
+
+    Irp->Cancel = TRUE;
+
+    routine = IoSetCancelRoutine(Irp, NULL);
+    if (routine == NULL) {
+        IoReleaseCancelSpinLock(irql);
+        return FALSE;
+    }
+
+    Irp->CancelIrql = irql;
+    routine(IoGetCurrentIrpStackLocation(Irp)->DeviceObject, Irp);
+
+    return TRUE;
+}
+
+//
+// Lookaside lists
+//
+
+//
+// The list head of a lookaside list, in its SLIST_HEADER. A raw lock
+// guards it; the driver's pools are per processor, so it is hardly
+// ever contended.
+//
+typedef struct _SHIM_LOOKASIDE_HEAD {
+    PSLIST_ENTRY    Next;
+    volatile LONG   Lock;
+    USHORT          Depth;
+} SHIM_LOOKASIDE_HEAD, *PSHIM_LOOKASIDE_HEAD;
+
+C_ASSERT(sizeof(SHIM_LOOKASIDE_HEAD) <= sizeof(SLIST_HEADER));
+
+NTSTATUS
+ExInitializeLookasideListEx(
+    PLOOKASIDE_LIST_EX Lookaside,
+    PVOID              Allocate,
+    PVOID              Free,
+    POOL_TYPE          PoolType,
+    ULONG              Flags,
+    SIZE_T             Size,
+    ULONG              Tag,
+    USHORT             Depth
+    )
+{
+    UNREFERENCED_PARAMETER(Flags);
+    UNREFERENCED_PARAMETER(Depth);
+
+    ASSERT(Allocate == NULL && Free == NULL);
+    ASSERT(Size >= sizeof(SLIST_ENTRY));
+
+    RtlZeroMemory(Lookaside, sizeof(LOOKASIDE_LIST_EX));
+    Lookaside->L.Depth = SHIM_LOOKASIDE_DEPTH;
+    Lookaside->L.MaximumDepth = SHIM_LOOKASIDE_DEPTH;
+    Lookaside->L.Type = PoolType;
+    Lookaside->L.Tag = Tag;
+    Lookaside->L.Size = (ULONG)Size;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ExDeleteLookasideListEx(
+    PLOOKASIDE_LIST_EX Lookaside
+    )
+{
+    PSHIM_LOOKASIDE_HEAD head = (PSHIM_LOOKASIDE_HEAD)&Lookaside->L.ListHead;
+    PSLIST_ENTRY         entry;
+
+    while ((entry = head->Next) != NULL) {
+        head->Next = entry->Next;
+        ExFreePoolWithTag(entry, Lookaside->L.Tag);
+    }
+}
+
+PVOID
+ExAllocateFromLookasideListEx(
+    PLOOKASIDE_LIST_EX Lookaside
+    )
+{
+    PSHIM_LOOKASIDE_HEAD head = (PSHIM_LOOKASIDE_HEAD)&Lookaside->L.ListHead;
+    PSLIST_ENTRY         entry;
+
+    ShimAcquireRawLock(&head->Lock);
+    entry = head->Next;
+    if (entry != NULL) {
+        head->Next = entry->Next;
+        head->Depth--;
+    }
+    Lookaside->L.TotalAllocates++;
+    if (entry == NULL) {
+        Lookaside->L.AllocateMisses++;
+    }
+    ShimReleaseRawLock(&head->Lock);
+
+    if (entry == NULL) {
+        entry = ExAllocatePoolWithTag(Lookaside->L.Type, Lookaside->L.Size, Lookaside->L.Tag);
+    }
+
+    return entry;
+}
+
+VOID
+ExFreeToLookasideListEx(
+    PLOOKASIDE_LIST_EX Lookaside,
+    PVOID              Entry
+    )
+{
+    PSHIM_LOOKASIDE_HEAD head = (PSHIM_LOOKASIDE_HEAD)&Lookaside->L.ListHead;
+    PSLIST_ENTRY         entry = Entry;
+
+    ShimAcquireRawLock(&head->Lock);
+    Lookaside->L.TotalFrees++;
+    if (head->Depth < Lookaside->L.Depth) {
+        entry->Next = head->Next;
+        head->Next = entry;
+        head->Depth++;
+        entry = NULL;
+    } else {
+        Lookaside->L.FreeMisses++;
+    }
+    ShimReleaseRawLock(&head->Lock);
+
+    if (entry != NULL) {
+        ExFreePoolWithTag(entry, Lookaside->L.Tag);
+    }
+}
+
+
+//
+// Processes, ports and the rest
+//
+
+VOID
+ShimSetCurrentProcess(
+    __in HANDLE ProcessId
+    )
+/*++
+Routine Description:
+
+    Makes the calling thread issue its requests as the given process,
+    for the per-process accounting of the driver.
+
+--*/
+{
+    ShimCurrentProcess = ProcessId;
+}
+
+HANDLE
+PsGetCurrentProcessId(
+    VOID
+    )
+{
+    return ShimCurrentProcess;
+}
+
+LUID
+RtlConvertLongToLuid(
+    LONG Long
+    )
+{
+    LUID luid;
+
+    luid.LowPart = (ULONG)Long;
+    luid.HighPart = Long < 0 ? -1 : 0;
+
+    return luid;
+}
+
+BOOLEAN
+SeSinglePrivilegeCheck(
+    LUID            PrivilegeValue,
+    KPROCESSOR_MODE PreviousMode
+    )
+{
+    UNREFERENCED_PARAMETER(PrivilegeValue);
+    UNREFERENCED_PARAMETER(PreviousMode);
+
+    return TRUE;
+}
+
+CCHAR
+RtlFindMostSignificantBit(
+    ULONGLONG Set
+    )
+{
+    return Set != 0 ? (CCHAR)(63 - __builtin_clzll(Set)) : (CCHAR)-1;
+}
+
+ULONG
+READ_PORT_ULONG(
+    PULONG Port
+    )
+{
+    return *(volatile ULONG *)Port;
+}
+
+VOID
+WRITE_PORT_ULONG(
+    PULONG Port,
+    ULONG  Value
+    )
+{
+    *(volatile ULONG *)Port = Value;
+}
+
+
+//
+// Start and stop
+//
+
+VOID
+ShimInitialize(
+    __in ULONG Processors,
+    __in ULONG Nodes
+    )
+/*++
+Routine Description:
+
+    Sets up Processors virtual processors in Nodes nodes, starts their
+    DPC threads, the timer thread and the work item threads of shimio.c,
+    and binds the calling thread to processor 0.
+
+--*/
+{
+    PSHIM_PROCESSOR processor;
+    ULONG           i;
+
+    ASSERT(Processors != 0 && Processors <= MAXIMUM_PROCESSORS);
+    ASSERT(Nodes != 0 && Nodes <= Processors);
+
+    ShimProcessorCount = Processors;
+    ShimNodeCount = Nodes;
+    ShimStopping = 0;
+
+    KeInitializeSpinLock(&ShimCancelLock);
+
+    ShimTimers.Lock = 0;
+    ShimTimers.Sequence = 0;
+    InitializeListHead(&ShimTimers.Timers);
+
+    for (i = 0; i < Processors; i++) {
+        processor = &ShimProcessors[i];
+        processor->DpcLock = 0;
+        InitializeListHead(&processor->DpcQueue);
+        processor->DpcWake = 0;
+        processor->DpcThreadIdle = 0;
+        processor->Node = (USHORT)(i * Nodes / Processors);
+        pthread_create(&processor->DpcThread, NULL, ShimDpcThread, (PVOID)(ULONG_PTR)i);
+    }
+
+    pthread_create(&ShimTimers.Thread, NULL, ShimTimerThread, NULL);
+
+    ShimBindThread(0);
+
+    ShimStartWorkerThreads();
+}
+
+VOID
+ShimShutdown(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Stops the work item, DPC and timer threads, in that order since work
+    items may queue DPCs. Nothing may be queued any more.
+
+--*/
+{
+    ULONG i;
+
+    ShimStopWorkerThreads();
+
+    __atomic_store_n(&ShimStopping, 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&ShimTimers.Sequence, 1, __ATOMIC_SEQ_CST);
+    ShimFutexWake(&ShimTimers.Sequence, 1);
+    pthread_join(ShimTimers.Thread, NULL);
+
+    for (i = 0; i < ShimProcessorCount; i++) {
+        ShimWakeProcessor(&ShimProcessors[i]);
+        pthread_join(ShimProcessors[i].DpcThread, NULL);
+    }
+}
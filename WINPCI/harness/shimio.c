@@ -0,0 +1,1605 @@
+/*++
+
+Module Name:
+
+    shimio.c
+
+Abstract:
+
+    The I/O manager, PnP manager and configuration manager side of the
+    shim: device objects and their stacks, IRP routing, work item
+    threads, power IRP requests, the per-device registry keys with their
+    change notifications, and debug output. What the bus driver of
+    bench.c needs to stand in for the PCI bus, and nothing more.
+
+    Devices are not reference counted: a device object is freed when it
+    is deleted, which is when the driver is done with it.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <ntddk.h>
+#include <nvme.h>
+#include "harness.h"
+
+#define SHIM_WORKER_THREADS         8
+#define SHIM_MAX_NAME               64          // characters of a device or value name
+#define SHIM_MAX_VALUE_DATA         64
+#define SHIM_MAX_VALUES             64
+#define SHIM_DEBUG_BUFFER_SIZE      1024
+
+//
+// A value of a device key.
+//
+typedef struct _SHIM_VALUE {
+    WCHAR           Name[SHIM_MAX_NAME];
+    USHORT          NameLength;             // bytes
+    ULONG           Type;
+    ULONG           DataLength;
+    UCHAR           Data[SHIM_MAX_VALUE_DATA];
+} SHIM_VALUE, *PSHIM_VALUE;
+
+//
+// The device key of a device, with the handles open on it. The lock
+// guards the values and the handle list.
+//
+typedef struct _SHIM_KEY {
+    volatile LONG   Lock;
+    ULONG           ValueCount;
+    SHIM_VALUE      Values[SHIM_MAX_VALUES];
+    LIST_ENTRY      Handles;                // SHIM_KEY_HANDLE.Link
+} SHIM_KEY, *PSHIM_KEY;
+
+typedef struct _SHIM_KEY_HANDLE {
+    LIST_ENTRY          Link;
+    PSHIM_KEY           Key;
+    PWORK_QUEUE_ITEM    NotifyItem;         // armed change notification, if any
+    WORK_QUEUE_TYPE     NotifyQueue;
+    PIO_STATUS_BLOCK    NotifyIoStatus;
+} SHIM_KEY_HANDLE, *PSHIM_KEY_HANDLE;
+
+//
+// What the shim keeps in front of a device object. The extension of
+// the device follows, cache aligned.
+//
+typedef struct _SHIM_DEVICE {
+    LIST_ENTRY      Link;                   // ShimIo.Devices
+    PDEVICE_OBJECT  LowerDevice;            // the device this one is attached to
+    UNICODE_STRING  Name;
+    WCHAR           NameBuffer[SHIM_MAX_NAME];
+    USHORT          Node;
+    SHIM_KEY        Key;
+    DEVICE_OBJECT   Device;
+} SHIM_DEVICE, *PSHIM_DEVICE;
+
+#define SHIM_DEVICE_FROM_OBJECT(d)  CONTAINING_RECORD((d), SHIM_DEVICE, Device)
+
+typedef struct _IO_WORKITEM {
+    WORK_QUEUE_ITEM         Item;
+    PDEVICE_OBJECT          DeviceObject;
+    PIO_WORKITEM_ROUTINE    Routine;
+    PVOID                   Context;
+} IO_WORKITEM;
+
+//
+// A power IRP asked for with PoRequestPowerIrp. The IRP has one stack
+// location more than the target stack; the top one holds this.
+//
+typedef struct _SHIM_POWER_REQUEST {
+    PREQUEST_POWER_COMPLETE CompletionFunction;
+    PVOID                   Context;
+    UCHAR                   MinorFunction;
+    POWER_STATE             PowerState;
+} SHIM_POWER_REQUEST, *PSHIM_POWER_REQUEST;
+
+static struct {
+    volatile LONG   DeviceLock;             // Devices and the stack links
+    LIST_ENTRY      Devices;
+
+    volatile LONG   WorkLock;
+    LIST_ENTRY      WorkQueue;              // WORK_QUEUE_ITEM.List
+    volatile LONG   WorkSequence;           // futex, bumped when work is queued
+    volatile LONG   WorkStopping;
+    pthread_t       Workers[SHIM_WORKER_THREADS];
+    ULONG           WorkerCount;
+
+    volatile LONG   DebugOutput;
+    volatile LONG   InvalidatedStates;
+} ShimIo;
+
+
+static
+VOID
+ShimIoFutexWake(
+    __in volatile LONG *Address,
+    __in LONG           Count
+    )
+{
+    syscall(SYS_futex, Address, FUTEX_WAKE_PRIVATE, Count, NULL, NULL, 0);
+}
+
+static
+VOID
+ShimIoFutexWait(
+    __in volatile LONG *Address,
+    __in LONG           Value
+    )
+{
+    syscall(SYS_futex, Address, FUTEX_WAIT_PRIVATE, Value, NULL, NULL, 0);
+}
+
+
+//
+// Debug output and strings
+//
+
+static
+ULONG
+ShimWideLength(
+    __in_opt PCWSTR String
+    )
+{
+    ULONG length = 0;
+
+    if (String != NULL) {
+        while (String[length] != 0) {
+            length++;
+        }
+    }
+
+    return length;
+}
+
+static
+VOID
+ShimNarrowString(
+    __out PCHAR  Buffer,
+    __in  size_t Size,
+    __in  PCWSTR String,
+    __in  ULONG  Length
+    )
+/*++
+Routine Description:
+
+    Copies characters of a counted wide string, anything outside ASCII
+    as '?'.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < Length && i + 1 < Size; i++) {
+        Buffer[i] = String[i] < 0x80 ? (CHAR)String[i] : '?';
+    }
+    Buffer[i] = 0;
+}
+
+NTSTATUS
+RtlStringCbVPrintfA(
+    PCHAR   pszDest,
+    size_t  cbDest,
+    PCSTR   pszFormat,
+    va_list argList
+    )
+/*++
+Routine Description:
+
+    Formats like the kernel's printf family. Conversions go to the host
+    printf one at a time, with the size prefixes of the kernel (I64, I,
+    w) turned into host ones and wide strings narrowed first.
+
+Return Value:
+
+    STATUS_BUFFER_OVERFLOW if the output was truncated; it is always
+    terminated.
+
+--*/
+{
+    CHAR            spec[32];
+    CHAR            wide[256];
+    PCSTR           p = pszFormat;
+    size_t          used = 0;
+    size_t          specLength;
+    int             written;
+    int             width, precision;
+    BOOLEAN         haveWidth, havePrecision, isWide;
+    CHAR            size;                   // 0, 'h', 'l' (long long) or 'z'
+    PUNICODE_STRING unicode;
+    PCWSTR          string;
+
+    if (cbDest == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pszDest[0] = 0;
+
+    while (*p != 0) {
+
+        if (*p != '%') {
+            if (used + 1 < cbDest) {
+                pszDest[used] = *p;
+            }
+            used++;
+            p++;
+            continue;
+        }
+
+        p++;
+        if (*p == '%') {
+            if (used + 1 < cbDest) {
+                pszDest[used] = '%';
+            }
+            used++;
+            p++;
+            continue;
+        }
+
+        //
+        // Flags, width and precision carry over to the host as they are,
+        // with * resolved here.
+        //
+        specLength = 0;
+        spec[specLength++] = '%';
+        while (*p != 0 && strchr("-+ #0", *p) != NULL && specLength < 8) {
+            spec[specLength++] = *p++;
+        }
+
+        haveWidth = FALSE;
+        width = 0;
+        if (*p == '*') {
+            haveWidth = TRUE;
+            width = va_arg(argList, int);
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                haveWidth = TRUE;
+                width = width * 10 + (*p++ - '0');
+            }
+        }
+
+        havePrecision = FALSE;
+        precision = 0;
+        if (*p == '.') {
+            havePrecision = TRUE;
+            p++;
+            if (*p == '*') {
+                precision = va_arg(argList, int);
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9') {
+                    precision = precision * 10 + (*p++ - '0');
+                }
+            }
+        }
+
+        if (haveWidth) {
+            specLength += snprintf(spec + specLength, sizeof(spec) - specLength, "%d", width);
+        }
+        if (havePrecision) {
+            specLength += snprintf(spec + specLength, sizeof(spec) - specLength, ".%d", precision);
+        }
+
+        size = 0;
+        isWide = FALSE;
+        if (strncmp(p, "I64", 3) == 0) {
+            size = 'l';
+            p += 3;
+        } else if (strncmp(p, "I32", 3) == 0) {
+            p += 3;
+        } else if (*p == 'I') {
+            size = 'z';
+            p++;
+        } else if (strncmp(p, "ll", 2) == 0) {
+            size = 'l';
+            p += 2;
+        } else if (*p == 'l' || *p == 'w') {
+            isWide = TRUE;                  // a long is 32 bits, as in the kernel
+            p++;
+        } else if (*p == 'h') {
+            size = 'h';
+            p++;
+            if (*p == 'h') {
+                p++;
+            }
+        } else if (*p == 'z') {
+            size = 'z';
+            p++;
+        }
+
+        if (size == 'l') {
+            spec[specLength++] = 'l';
+            spec[specLength++] = 'l';
+        } else if (size == 'z') {
+            spec[specLength++] = 'z';
+        }
+
+        written = 0;
+
+        switch (*p) {
+
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            spec[specLength++] = *p;
+            spec[specLength] = 0;
+            if (size == 'l') {
+                written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                                   spec, va_arg(argList, long long));
+            } else if (size == 'z') {
+                written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                                   spec, va_arg(argList, size_t));
+            } else {
+                written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                                   spec, va_arg(argList, int));
+            }
+            break;
+
+        case 'c':
+        case 'p':
+            spec[specLength++] = *p;
+            spec[specLength] = 0;
+            if (*p == 'c') {
+                written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                                   spec, va_arg(argList, int));
+            } else {
+                written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                                   spec, va_arg(argList, PVOID));
+            }
+            break;
+
+        case 'Z':
+            //
+            // %wZ, a counted UNICODE_STRING.
+            //
+            unicode = va_arg(argList, PUNICODE_STRING);
+            if (unicode != NULL && unicode->Buffer != NULL) {
+                ShimNarrowString(wide, sizeof(wide), unicode->Buffer,
+                                 unicode->Length / sizeof(WCHAR));
+            } else {
+                strcpy(wide, "(null)");
+            }
+            spec[specLength++] = 's';
+            spec[specLength] = 0;
+            written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                               spec, wide);
+            break;
+
+        case 's':
+        case 'S':
+            spec[specLength++] = 's';
+            spec[specLength] = 0;
+            if (isWide || *p == 'S') {
+                string = va_arg(argList, PCWSTR);
+                if (string != NULL) {
+                    ShimNarrowString(wide, sizeof(wide), string, ShimWideLength(string));
+                } else {
+                    strcpy(wide, "(null)");
+                }
+                written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                                   spec, wide);
+            } else {
+                written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                                   spec, va_arg(argList, PCSTR));
+            }
+            break;
+
+        default:
+            //
+            // Not a conversion the driver uses; copied out as it is.
+            //
+            spec[specLength] = 0;
+            written = snprintf(pszDest + min(used, cbDest - 1), cbDest - min(used, cbDest - 1),
+                               "%s%c", spec, *p);
+            break;
+        }
+
+        if (*p != 0) {
+            p++;
+        }
+        if (written > 0) {
+            used += (size_t)written;
+        }
+    }
+
+    if (used >= cbDest) {
+        pszDest[cbDest - 1] = 0;
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    pszDest[used] = 0;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RtlStringCbPrintfA(
+    PCHAR  pszDest,
+    size_t cbDest,
+    PCSTR  pszFormat,
+    ...
+    )
+{
+    va_list  arguments;
+    NTSTATUS status;
+
+    va_start(arguments, pszFormat);
+    status = RtlStringCbVPrintfA(pszDest, cbDest, pszFormat, arguments);
+    va_end(arguments);
+
+    return status;
+}
+
+ULONG
+DbgPrint(
+    PCSTR Format,
+    ...
+    )
+/*++
+Routine Description:
+
+    Writes to stderr while debug output is on (bench -v).
+
+--*/
+{
+    CHAR    buffer[SHIM_DEBUG_BUFFER_SIZE];
+    va_list arguments;
+
+    if (!__atomic_load_n(&ShimIo.DebugOutput, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    va_start(arguments, Format);
+    RtlStringCbVPrintfA(buffer, sizeof(buffer), Format, arguments);
+    va_end(arguments);
+
+    fputs(buffer, stderr);
+
+    return 0;
+}
+
+VOID
+ShimSetDebugOutput(
+    __in BOOLEAN Enable
+    )
+{
+    __atomic_store_n(&ShimIo.DebugOutput, Enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+VOID
+RtlInitUnicodeString(
+    PUNICODE_STRING DestinationString,
+    PCWSTR          SourceString
+    )
+{
+    ULONG length = ShimWideLength(SourceString);
+
+    DestinationString->Buffer = (PWSTR)SourceString;
+    DestinationString->Length = (USHORT)(length * sizeof(WCHAR));
+    DestinationString->MaximumLength = SourceString != NULL ?
+                                       (USHORT)((length + 1) * sizeof(WCHAR)) : 0;
+}
+
+VOID
+RtlCopyUnicodeString(
+    PUNICODE_STRING  DestinationString,
+    PCUNICODE_STRING SourceString
+    )
+{
+    USHORT length;
+
+    if (SourceString == NULL) {
+        DestinationString->Length = 0;
+        return;
+    }
+
+    length = min(SourceString->Length, DestinationString->MaximumLength);
+    RtlCopyMemory(DestinationString->Buffer, SourceString->Buffer, length);
+    DestinationString->Length = length;
+    if (length + sizeof(WCHAR) <= DestinationString->MaximumLength) {
+        DestinationString->Buffer[length / sizeof(WCHAR)] = 0;
+    }
+}
+
+VOID
+RtlFreeUnicodeString(
+    PUNICODE_STRING UnicodeString
+    )
+{
+    if (UnicodeString->Buffer != NULL) {
+        ExFreePool(UnicodeString->Buffer);
+    }
+    UnicodeString->Buffer = NULL;
+    UnicodeString->Length = 0;
+    UnicodeString->MaximumLength = 0;
+}
+
+static
+WCHAR
+ShimUpcase(
+    __in WCHAR Character
+    )
+{
+    return Character >= 'a' && Character <= 'z' ? (WCHAR)(Character - 'a' + 'A') : Character;
+}
+
+BOOLEAN
+RtlEqualUnicodeString(
+    PCUNICODE_STRING String1,
+    PCUNICODE_STRING String2,
+    BOOLEAN          CaseInSensitive
+    )
+{
+    ULONG i;
+
+    if (String1->Length != String2->Length) {
+        return FALSE;
+    }
+
+    for (i = 0; i < String1->Length / sizeof(WCHAR); i++) {
+        if (CaseInSensitive ?
+            ShimUpcase(String1->Buffer[i]) != ShimUpcase(String2->Buffer[i]) :
+            String1->Buffer[i] != String2->Buffer[i]) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+//
+// Device objects and IRP routing
+//
+
+NTSTATUS
+IoCreateDevice(
+    PDRIVER_OBJECT  DriverObject,
+    ULONG           DeviceExtensionSize,
+    PUNICODE_STRING DeviceName,
+    ULONG           DeviceType,
+    ULONG           DeviceCharacteristics,
+    BOOLEAN         Exclusive,
+    PDEVICE_OBJECT *DeviceObject
+    )
+/*++
+Routine Description:
+
+    Creates a device object on the device list of its driver. A named
+    device can be looked up with ShimReferenceDeviceByName.
+
+--*/
+{
+    PSHIM_DEVICE shimDevice;
+    PLIST_ENTRY  entry;
+    SIZE_T       extensionOffset;
+
+    UNREFERENCED_PARAMETER(DeviceCharacteristics);
+    UNREFERENCED_PARAMETER(Exclusive);
+
+    if (DeviceName != NULL && DeviceName->Length > (SHIM_MAX_NAME - 1) * sizeof(WCHAR)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    extensionOffset = ALIGN_UP_BY(sizeof(SHIM_DEVICE), SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    shimDevice = ExAllocatePoolWithTag(NonPagedPool,
+                                       extensionOffset + DeviceExtensionSize,
+                                       'vDhS');
+    if (shimDevice == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(shimDevice, extensionOffset + DeviceExtensionSize);
+
+    shimDevice->Node = SHIM_NODE_NONE;
+    InitializeListHead(&shimDevice->Key.Handles);
+
+    shimDevice->Name.Buffer = shimDevice->NameBuffer;
+    shimDevice->Name.MaximumLength = sizeof(shimDevice->NameBuffer);
+    if (DeviceName != NULL) {
+        RtlCopyUnicodeString(&shimDevice->Name, DeviceName);
+    }
+
+    shimDevice->Device.Type = IO_TYPE_DEVICE;
+    shimDevice->Device.Size = (USHORT)sizeof(DEVICE_OBJECT);
+    shimDevice->Device.DriverObject = DriverObject;
+    shimDevice->Device.Flags = DO_DEVICE_INITIALIZING;
+    shimDevice->Device.DeviceExtension = DeviceExtensionSize != 0 ?
+                                         (PUCHAR)shimDevice + extensionOffset : NULL;
+    shimDevice->Device.DeviceType = DeviceType;
+    shimDevice->Device.StackSize = 1;
+
+    ShimAcquireRawLock(&ShimIo.DeviceLock);
+
+    if (DeviceName != NULL) {
+        for (entry = ShimIo.Devices.Flink; entry != &ShimIo.Devices; entry = entry->Flink) {
+            if (RtlEqualUnicodeString(&CONTAINING_RECORD(entry, SHIM_DEVICE, Link)->Name,
+                                      DeviceName, TRUE)) {
+                ShimReleaseRawLock(&ShimIo.DeviceLock);
+                ExFreePoolWithTag(shimDevice, 'vDhS');
+                return STATUS_OBJECT_NAME_COLLISION;
+            }
+        }
+    }
+
+    InsertTailList(&ShimIo.Devices, &shimDevice->Link);
+    shimDevice->Device.NextDevice = DriverObject->DeviceObject;
+    DriverObject->DeviceObject = &shimDevice->Device;
+
+    ShimReleaseRawLock(&ShimIo.DeviceLock);
+
+    *DeviceObject = &shimDevice->Device;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+IoDeleteDevice(
+    PDEVICE_OBJECT DeviceObject
+    )
+{
+    PSHIM_DEVICE    shimDevice = SHIM_DEVICE_FROM_OBJECT(DeviceObject);
+    PDEVICE_OBJECT *link;
+
+    ASSERT(DeviceObject->AttachedDevice == NULL);
+    ASSERT(IsListEmpty(&shimDevice->Key.Handles));
+
+    ShimAcquireRawLock(&ShimIo.DeviceLock);
+
+    RemoveEntryList(&shimDevice->Link);
+    for (link = &DeviceObject->DriverObject->DeviceObject; *link != NULL;
+         link = &(*link)->NextDevice) {
+        if (*link == DeviceObject) {
+            *link = DeviceObject->NextDevice;
+            break;
+        }
+    }
+
+    ShimReleaseRawLock(&ShimIo.DeviceLock);
+
+    ExFreePoolWithTag(shimDevice, 'vDhS');
+}
+
+PDEVICE_OBJECT
+ShimReferenceDeviceByName(
+    __in PCWSTR Name
+    )
+/*++
+Routine Description:
+
+    Finds a named device, as opening it by name would. Devices are not
+    reference counted; the caller must not use it past its removal.
+
+--*/
+{
+    UNICODE_STRING name;
+    PLIST_ENTRY    entry;
+    PSHIM_DEVICE   shimDevice;
+    PDEVICE_OBJECT device = NULL;
+
+    RtlInitUnicodeString(&name, Name);
+
+    ShimAcquireRawLock(&ShimIo.DeviceLock);
+    for (entry = ShimIo.Devices.Flink; entry != &ShimIo.Devices; entry = entry->Flink) {
+        shimDevice = CONTAINING_RECORD(entry, SHIM_DEVICE, Link);
+        if (RtlEqualUnicodeString(&shimDevice->Name, &name, TRUE)) {
+            device = &shimDevice->Device;
+            break;
+        }
+    }
+    ShimReleaseRawLock(&ShimIo.DeviceLock);
+
+    return device;
+}
+
+PDEVICE_OBJECT
+IoAttachDeviceToDeviceStack(
+    PDEVICE_OBJECT SourceDevice,
+    PDEVICE_OBJECT TargetDevice
+    )
+{
+    PDEVICE_OBJECT top;
+
+    ShimAcquireRawLock(&ShimIo.DeviceLock);
+
+    for (top = TargetDevice; top->AttachedDevice != NULL; top = top->AttachedDevice) {
+    }
+    top->AttachedDevice = SourceDevice;
+    SourceDevice->StackSize = (CCHAR)(top->StackSize + 1);
+    SHIM_DEVICE_FROM_OBJECT(SourceDevice)->LowerDevice = top;
+
+    ShimReleaseRawLock(&ShimIo.DeviceLock);
+
+    return top;
+}
+
+VOID
+IoDetachDevice(
+    PDEVICE_OBJECT TargetDevice
+    )
+{
+    ShimAcquireRawLock(&ShimIo.DeviceLock);
+
+    if (TargetDevice->AttachedDevice != NULL) {
+        SHIM_DEVICE_FROM_OBJECT(TargetDevice->AttachedDevice)->LowerDevice = NULL;
+        TargetDevice->AttachedDevice = NULL;
+    }
+
+    ShimReleaseRawLock(&ShimIo.DeviceLock);
+}
+
+PDEVICE_OBJECT
+IoGetAttachedDeviceReference(
+    PDEVICE_OBJECT DeviceObject
+    )
+{
+    PDEVICE_OBJECT top;
+
+    ShimAcquireRawLock(&ShimIo.DeviceLock);
+    for (top = DeviceObject; top->AttachedDevice != NULL; top = top->AttachedDevice) {
+    }
+    ShimReleaseRawLock(&ShimIo.DeviceLock);
+
+    return top;
+}
+
+VOID
+ObReferenceObject(
+    PVOID Object
+    )
+{
+    UNREFERENCED_PARAMETER(Object);
+}
+
+VOID
+ObDereferenceObject(
+    PVOID Object
+    )
+{
+    UNREFERENCED_PARAMETER(Object);
+}
+
+NTSTATUS
+IoCallDriver(
+    PDEVICE_OBJECT DeviceObject,
+    PIRP           Irp
+    )
+{
+    PIO_STACK_LOCATION stack;
+
+    IoSetNextIrpStackLocation(Irp);
+    ASSERT(Irp->CurrentLocation > 0);
+
+    stack = IoGetCurrentIrpStackLocation(Irp);
+    stack->DeviceObject = DeviceObject;
+
+    return DeviceObject->DriverObject->MajorFunction[stack->MajorFunction](DeviceObject, Irp);
+}
+
+PIRP
+IoBuildSynchronousFsdRequest(
+    ULONG            MajorFunction,
+    PDEVICE_OBJECT   DeviceObject,
+    PVOID            Buffer,
+    ULONG            Length,
+    PLARGE_INTEGER   StartingOffset,
+    PKEVENT          Event,
+    PIO_STATUS_BLOCK IoStatusBlock
+    )
+/*++
+Routine Description:
+
+    Builds an IRP that IoCompleteRequest frees once it has reported to
+    the IO_STATUS_BLOCK, before it sets the event. A read or write gets
+    an MDL for the buffer.
+
+--*/
+{
+    PIO_STACK_LOCATION stack;
+    PIRP               irp;
+
+    irp = IoAllocateIrp(DeviceObject->StackSize, FALSE);
+    if (irp == NULL) {
+        return NULL;
+    }
+
+    irp->AllocationFlags |= SHIM_IRP_FREE_ON_COMPLETION;
+    irp->UserEvent = Event;
+    irp->UserIosb = IoStatusBlock;
+
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = (UCHAR)MajorFunction;
+
+    if (MajorFunction == IRP_MJ_READ || MajorFunction == IRP_MJ_WRITE) {
+        if (Buffer != NULL && Length != 0) {
+            if (IoAllocateMdl(Buffer, Length, FALSE, FALSE, irp) == NULL) {
+                IoFreeIrp(irp);
+                return NULL;
+            }
+            MmBuildMdlForNonPagedPool(irp->MdlAddress);
+        }
+        stack->Parameters.Read.Length = Length;
+        if (StartingOffset != NULL) {
+            stack->Parameters.Read.ByteOffset = *StartingOffset;
+        }
+    }
+
+    return irp;
+}
+
+
+//
+// PnP notifications the bus has no use for
+//
+
+NTSTATUS
+IoCreateSymbolicLink(
+    PUNICODE_STRING SymbolicLinkName,
+    PUNICODE_STRING DeviceName
+    )
+{
+    UNREFERENCED_PARAMETER(SymbolicLinkName);
+    UNREFERENCED_PARAMETER(DeviceName);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+IoDeleteSymbolicLink(
+    PUNICODE_STRING SymbolicLinkName
+    )
+{
+    UNREFERENCED_PARAMETER(SymbolicLinkName);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+IoRegisterDeviceInterface(
+    PDEVICE_OBJECT  PhysicalDeviceObject,
+    const GUID     *InterfaceClassGuid,
+    PUNICODE_STRING ReferenceString,
+    PUNICODE_STRING SymbolicLinkName
+    )
+/*++
+Routine Description:
+
+    Hands out a link name the caller frees with RtlFreeUnicodeString.
+
+--*/
+{
+    static const WCHAR name[] = L"\\??\\SHIM#PCIDRV";
+
+    UNREFERENCED_PARAMETER(PhysicalDeviceObject);
+    UNREFERENCED_PARAMETER(InterfaceClassGuid);
+    UNREFERENCED_PARAMETER(ReferenceString);
+
+    SymbolicLinkName->Buffer = ExAllocatePoolWithTag(PagedPool, sizeof(name), 'nIhS');
+    if (SymbolicLinkName->Buffer == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlCopyMemory(SymbolicLinkName->Buffer, name, sizeof(name));
+    SymbolicLinkName->Length = sizeof(name) - sizeof(WCHAR);
+    SymbolicLinkName->MaximumLength = sizeof(name);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+IoSetDeviceInterfaceState(
+    PUNICODE_STRING SymbolicLinkName,
+    BOOLEAN         Enable
+    )
+{
+    UNREFERENCED_PARAMETER(SymbolicLinkName);
+    UNREFERENCED_PARAMETER(Enable);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+IoInvalidateDeviceState(
+    PDEVICE_OBJECT PhysicalDeviceObject
+    )
+/*++
+Routine Description:
+
+    Only counted; bench.c asks for the state itself when it matters.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(PhysicalDeviceObject);
+
+    __atomic_add_fetch(&ShimIo.InvalidatedStates, 1, __ATOMIC_RELAXED);
+}
+
+ULONG
+ShimQueryInvalidatedStates(
+    VOID
+    )
+{
+    return (ULONG)__atomic_load_n(&ShimIo.InvalidatedStates, __ATOMIC_RELAXED);
+}
+
+NTSTATUS
+IoGetDeviceNumaNode(
+    PDEVICE_OBJECT Pdo,
+    PUSHORT        NodeNumber
+    )
+{
+    USHORT node = SHIM_DEVICE_FROM_OBJECT(Pdo)->Node;
+
+    if (node == SHIM_NODE_NONE) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    *NodeNumber = node;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ShimSetDeviceNode(
+    __in PDEVICE_OBJECT Pdo,
+    __in USHORT         Node
+    )
+/*++
+Routine Description:
+
+    Sets the node IoGetDeviceNumaNode reports for a device, as the bus
+    would from the proximity of the slot.
+
+--*/
+{
+    SHIM_DEVICE_FROM_OBJECT(Pdo)->Node = Node;
+}
+
+
+//
+// Power
+//
+
+NTSTATUS
+PoSetPowerState(
+    PDEVICE_OBJECT   DeviceObject,
+    POWER_STATE_TYPE Type,
+    POWER_STATE      State
+    )
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Type);
+    UNREFERENCED_PARAMETER(State);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+PoStartNextPowerIrp(
+    PIRP Irp
+    )
+{
+    UNREFERENCED_PARAMETER(Irp);
+}
+
+NTSTATUS
+PoCallDriver(
+    PDEVICE_OBJECT DeviceObject,
+    PIRP           Irp
+    )
+{
+    return IoCallDriver(DeviceObject, Irp);
+}
+
+static
+NTSTATUS
+ShimPowerRequestComplete(
+    PDEVICE_OBJECT DeviceObject,
+    PIRP           Irp,
+    PVOID          Context
+    )
+{
+    PSHIM_POWER_REQUEST request = Context;
+
+    if (request->CompletionFunction != NULL) {
+        request->CompletionFunction(DeviceObject,
+                                    request->MinorFunction,
+                                    request->PowerState,
+                                    request->Context,
+                                    &Irp->IoStatus);
+    }
+
+    ExFreePoolWithTag(request, 'rPhS');
+    IoFreeIrp(Irp);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+NTSTATUS
+PoRequestPowerIrp(
+    PDEVICE_OBJECT          DeviceObject,
+    UCHAR                   MinorFunction,
+    POWER_STATE             PowerState,
+    PREQUEST_POWER_COMPLETE CompletionFunction,
+    PVOID                   Context,
+    PIRP                   *Irp
+    )
+/*++
+Routine Description:
+
+    Sends a device power IRP to the top of the stack of DeviceObject,
+    the PDO, and calls CompletionFunction when it has completed. Only
+    IRP_MN_SET_POWER and IRP_MN_QUERY_POWER are supported.
+
+--*/
+{
+    PSHIM_POWER_REQUEST request;
+    PIO_STACK_LOCATION  stack;
+    PDEVICE_OBJECT      top;
+    PIRP                irp;
+
+    if (MinorFunction != IRP_MN_SET_POWER && MinorFunction != IRP_MN_QUERY_POWER) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    top = IoGetAttachedDeviceReference(DeviceObject);
+
+    request = ExAllocatePoolWithTag(NonPagedPool, sizeof(SHIM_POWER_REQUEST), 'rPhS');
+    irp = IoAllocateIrp((CCHAR)(top->StackSize + 1), FALSE);
+    if (request == NULL || irp == NULL) {
+        if (request != NULL) {
+            ExFreePoolWithTag(request, 'rPhS');
+        }
+        if (irp != NULL) {
+            IoFreeIrp(irp);
+        }
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    request->CompletionFunction = CompletionFunction;
+    request->Context = Context;
+    request->MinorFunction = MinorFunction;
+    request->PowerState = PowerState;
+
+    //
+    // The extra location is the requester's: its device is what the
+    // completion function is called with.
+    //
+    IoSetNextIrpStackLocation(irp);
+    IoGetCurrentIrpStackLocation(irp)->DeviceObject = DeviceObject;
+
+    irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
+
+    stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_POWER;
+    stack->MinorFunction = MinorFunction;
+    stack->Parameters.Power.Type = DevicePowerState;
+    stack->Parameters.Power.State = PowerState;
+
+    IoSetCompletionRoutine(irp, ShimPowerRequestComplete, request, TRUE, TRUE, TRUE);
+
+    if (Irp != NULL) {
+        *Irp = irp;
+    }
+
+    IoCallDriver(top, irp);
+
+    return STATUS_PENDING;
+}
+
+
+//
+// Work items
+//
+
+VOID
+ExQueueWorkItem(
+    PWORK_QUEUE_ITEM WorkItem,
+    WORK_QUEUE_TYPE  QueueType
+    )
+/*++
+Routine Description:
+
+    Queues a work item to the worker threads. All queue types share
+    them.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(QueueType);
+
+    ShimAcquireRawLock(&ShimIo.WorkLock);
+    InsertTailList(&ShimIo.WorkQueue, &WorkItem->List);
+    __atomic_add_fetch(&ShimIo.WorkSequence, 1, __ATOMIC_SEQ_CST);
+    ShimReleaseRawLock(&ShimIo.WorkLock);
+
+    ShimIoFutexWake(&ShimIo.WorkSequence, 1);
+}
+
+static
+PVOID
+ShimWorkerThread(
+    __in PVOID Context
+    )
+/*++
+Routine Description:
+
+    Runs work items at PASSIVE_LEVEL, as one of the virtual processors.
+
+--*/
+{
+    PWORK_QUEUE_ITEM item;
+    LONG             sequence;
+
+    ShimBindThread((ULONG)(ULONG_PTR)Context % KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+
+    for (;;) {
+
+        sequence = __atomic_load_n(&ShimIo.WorkSequence, __ATOMIC_SEQ_CST);
+
+        ShimAcquireRawLock(&ShimIo.WorkLock);
+        item = NULL;
+        if (!IsListEmpty(&ShimIo.WorkQueue)) {
+            item = CONTAINING_RECORD(RemoveHeadList(&ShimIo.WorkQueue), WORK_QUEUE_ITEM, List);
+        }
+        ShimReleaseRawLock(&ShimIo.WorkLock);
+
+        if (item != NULL) {
+            ((WORKER_THREAD_ROUTINE *)item->WorkerRoutine)(item->Parameter);
+            ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+            continue;
+        }
+
+        if (__atomic_load_n(&ShimIo.WorkStopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        ShimIoFutexWait(&ShimIo.WorkSequence, sequence);
+    }
+
+    return NULL;
+}
+
+static
+VOID
+ShimRunIoWorkItem(
+    __in PVOID Parameter
+    )
+{
+    PIO_WORKITEM workItem = Parameter;
+
+    workItem->Routine(workItem->DeviceObject, workItem->Context);
+}
+
+PIO_WORKITEM
+IoAllocateWorkItem(
+    PDEVICE_OBJECT DeviceObject
+    )
+{
+    PIO_WORKITEM workItem;
+
+    workItem = ExAllocatePoolWithTag(NonPagedPool, sizeof(IO_WORKITEM), 'kWhS');
+    if (workItem != NULL) {
+        RtlZeroMemory(workItem, sizeof(IO_WORKITEM));
+        workItem->DeviceObject = DeviceObject;
+    }
+
+    return workItem;
+}
+
+VOID
+IoFreeWorkItem(
+    PIO_WORKITEM IoWorkItem
+    )
+{
+    ExFreePoolWithTag(IoWorkItem, 'kWhS');
+}
+
+VOID
+IoQueueWorkItem(
+    PIO_WORKITEM         IoWorkItem,
+    PIO_WORKITEM_ROUTINE WorkerRoutine,
+    WORK_QUEUE_TYPE      QueueType,
+    PVOID                Context
+    )
+{
+    IoWorkItem->Routine = WorkerRoutine;
+    IoWorkItem->Context = Context;
+    ExInitializeWorkItem(&IoWorkItem->Item, ShimRunIoWorkItem, IoWorkItem);
+
+    ExQueueWorkItem(&IoWorkItem->Item, QueueType);
+}
+
+
+//
+// Registry
+//
+
+static
+PSHIM_VALUE
+ShimFindValue(
+    __in PSHIM_KEY       Key,
+    __in PUNICODE_STRING Name
+    )
+{
+    UNICODE_STRING valueName;
+    ULONG          i;
+
+    for (i = 0; i < Key->ValueCount; i++) {
+        valueName.Buffer = Key->Values[i].Name;
+        valueName.Length = Key->Values[i].NameLength;
+        valueName.MaximumLength = sizeof(Key->Values[i].Name);
+        if (RtlEqualUnicodeString(&valueName, Name, TRUE)) {
+            return &Key->Values[i];
+        }
+    }
+
+    return NULL;
+}
+
+static
+NTSTATUS
+ShimQueryValue(
+    __in      PSHIM_VALUE                 Value,
+    __in      KEY_VALUE_INFORMATION_CLASS Class,
+    __out_opt PVOID                       Buffer,
+    __in      ULONG                       Length,
+    __out     PULONG                      ResultLength
+    )
+/*++
+Routine Description:
+
+    Fills in KEY_VALUE_FULL_INFORMATION or KEY_VALUE_PARTIAL_INFORMATION
+    for a value, with the key lock held.
+
+--*/
+{
+    PKEY_VALUE_FULL_INFORMATION    full = Buffer;
+    PKEY_VALUE_PARTIAL_INFORMATION partial = Buffer;
+    ULONG                          dataOffset;
+
+    switch (Class) {
+
+    case KeyValueFullInformation:
+        dataOffset = ALIGN_UP_BY(FIELD_OFFSET(KEY_VALUE_FULL_INFORMATION, Name) + Value->NameLength,
+                              sizeof(ULONG));
+        *ResultLength = dataOffset + Value->DataLength;
+        if (Length < *ResultLength) {
+            return Length < FIELD_OFFSET(KEY_VALUE_FULL_INFORMATION, Name) ?
+                   STATUS_BUFFER_TOO_SMALL : STATUS_BUFFER_OVERFLOW;
+        }
+        full->TitleIndex = 0;
+        full->Type = Value->Type;
+        full->DataOffset = dataOffset;
+        full->DataLength = Value->DataLength;
+        full->NameLength = Value->NameLength;
+        RtlCopyMemory(full->Name, Value->Name, Value->NameLength);
+        RtlCopyMemory((PUCHAR)full + dataOffset, Value->Data, Value->DataLength);
+        return STATUS_SUCCESS;
+
+    case KeyValuePartialInformation:
+        *ResultLength = FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + Value->DataLength;
+        if (Length < *ResultLength) {
+            return Length < FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) ?
+                   STATUS_BUFFER_TOO_SMALL : STATUS_BUFFER_OVERFLOW;
+        }
+        partial->TitleIndex = 0;
+        partial->Type = Value->Type;
+        partial->DataLength = Value->DataLength;
+        RtlCopyMemory(partial->Data, Value->Data, Value->DataLength);
+        return STATUS_SUCCESS;
+
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+}
+
+static
+VOID
+ShimFireNotification(
+    __in PSHIM_KEY_HANDLE Handle,
+    __in NTSTATUS         Status
+    )
+/*++
+Routine Description:
+
+    Completes an armed notification of a handle with the key lock held;
+    the work item is queued right away, which is safe since the worker
+    threads never take the key lock first.
+
+--*/
+{
+    PWORK_QUEUE_ITEM item = Handle->NotifyItem;
+
+    if (item == NULL) {
+        return;
+    }
+
+    Handle->NotifyItem = NULL;
+    Handle->NotifyIoStatus->Status = Status;
+    Handle->NotifyIoStatus->Information = 0;
+    ExQueueWorkItem(item, Handle->NotifyQueue);
+}
+
+NTSTATUS
+IoOpenDeviceRegistryKey(
+    PDEVICE_OBJECT DeviceObject,
+    ULONG          DevInstKeyType,
+    ACCESS_MASK    DesiredAccess,
+    PHANDLE        DevInstRegKey
+    )
+/*++
+Routine Description:
+
+    Opens the device key of a device. Every device has one, empty until
+    values are set in it; the driver key is not supported.
+
+--*/
+{
+    PSHIM_KEY        key = &SHIM_DEVICE_FROM_OBJECT(DeviceObject)->Key;
+    PSHIM_KEY_HANDLE handle;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+
+    if (DevInstKeyType != PLUGPLAY_REGKEY_DEVICE) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    handle = ExAllocatePoolWithTag(PagedPool, sizeof(SHIM_KEY_HANDLE), 'yKhS');
+    if (handle == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(handle, sizeof(SHIM_KEY_HANDLE));
+    handle->Key = key;
+
+    ShimAcquireRawLock(&key->Lock);
+    InsertTailList(&key->Handles, &handle->Link);
+    ShimReleaseRawLock(&key->Lock);
+
+    *DevInstRegKey = handle;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwClose(
+    HANDLE Handle
+    )
+/*++
+Routine Description:
+
+    Closes a key handle; an armed notification completes with
+    STATUS_NOTIFY_CLEANUP.
+
+--*/
+{
+    PSHIM_KEY_HANDLE handle = Handle;
+    PSHIM_KEY        key = handle->Key;
+
+    ShimAcquireRawLock(&key->Lock);
+    RemoveEntryList(&handle->Link);
+    ShimFireNotification(handle, STATUS_NOTIFY_CLEANUP);
+    ShimReleaseRawLock(&key->Lock);
+
+    ExFreePoolWithTag(handle, 'yKhS');
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwQueryValueKey(
+    HANDLE                      KeyHandle,
+    PUNICODE_STRING             ValueName,
+    KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+    PVOID                       KeyValueInformation,
+    ULONG                       Length,
+    PULONG                      ResultLength
+    )
+{
+    PSHIM_KEY   key = ((PSHIM_KEY_HANDLE)KeyHandle)->Key;
+    PSHIM_VALUE value;
+    NTSTATUS    status;
+
+    ShimAcquireRawLock(&key->Lock);
+
+    value = ShimFindValue(key, ValueName);
+    if (value == NULL) {
+        status = STATUS_OBJECT_NAME_NOT_FOUND;
+    } else {
+        status = ShimQueryValue(value, KeyValueInformationClass,
+                                KeyValueInformation, Length, ResultLength);
+    }
+
+    ShimReleaseRawLock(&key->Lock);
+
+    return status;
+}
+
+NTSTATUS
+ZwEnumerateValueKey(
+    HANDLE                      KeyHandle,
+    ULONG                       Index,
+    KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+    PVOID                       KeyValueInformation,
+    ULONG                       Length,
+    PULONG                      ResultLength
+    )
+{
+    PSHIM_KEY key = ((PSHIM_KEY_HANDLE)KeyHandle)->Key;
+    NTSTATUS  status;
+
+    ShimAcquireRawLock(&key->Lock);
+
+    if (Index >= key->ValueCount) {
+        status = STATUS_NO_MORE_ENTRIES;
+    } else {
+        status = ShimQueryValue(&key->Values[Index], KeyValueInformationClass,
+                                KeyValueInformation, Length, ResultLength);
+    }
+
+    ShimReleaseRawLock(&key->Lock);
+
+    return status;
+}
+
+NTSTATUS
+ZwSetValueKey(
+    HANDLE          KeyHandle,
+    PUNICODE_STRING ValueName,
+    ULONG           TitleIndex,
+    ULONG           Type,
+    PVOID           Data,
+    ULONG           DataSize
+    )
+/*++
+Routine Description:
+
+    Creates or replaces a value and completes the notifications armed on
+    any handle of the key.
+
+--*/
+{
+    PSHIM_KEY        key = ((PSHIM_KEY_HANDLE)KeyHandle)->Key;
+    PSHIM_VALUE      value;
+    PLIST_ENTRY      entry;
+
+    UNREFERENCED_PARAMETER(TitleIndex);
+
+    if (DataSize > SHIM_MAX_VALUE_DATA ||
+        ValueName->Length > (SHIM_MAX_NAME - 1) * sizeof(WCHAR)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ShimAcquireRawLock(&key->Lock);
+
+    value = ShimFindValue(key, ValueName);
+    if (value == NULL) {
+        if (key->ValueCount == SHIM_MAX_VALUES) {
+            ShimReleaseRawLock(&key->Lock);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        value = &key->Values[key->ValueCount++];
+        RtlCopyMemory(value->Name, ValueName->Buffer, ValueName->Length);
+        value->NameLength = ValueName->Length;
+    }
+
+    value->Type = Type;
+    value->DataLength = DataSize;
+    RtlCopyMemory(value->Data, Data, DataSize);
+
+    for (entry = key->Handles.Flink; entry != &key->Handles; entry = entry->Flink) {
+        ShimFireNotification(CONTAINING_RECORD(entry, SHIM_KEY_HANDLE, Link), STATUS_SUCCESS);
+    }
+
+    ShimReleaseRawLock(&key->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwNotifyChangeKey(
+    HANDLE           KeyHandle,
+    HANDLE           Event,
+    PVOID            ApcRoutine,
+    PVOID            ApcContext,
+    PIO_STATUS_BLOCK IoStatusBlock,
+    ULONG            CompletionFilter,
+    BOOLEAN          WatchTree,
+    PVOID            Buffer,
+    ULONG            BufferSize,
+    BOOLEAN          Asynchronous
+    )
+/*++
+Routine Description:
+
+    Arms a notification the kernel-mode way: ApcRoutine is the
+    WORK_QUEUE_ITEM to queue and ApcContext its WORK_QUEUE_TYPE.
+
+--*/
+{
+    PSHIM_KEY_HANDLE handle = KeyHandle;
+
+    UNREFERENCED_PARAMETER(CompletionFilter);
+    UNREFERENCED_PARAMETER(WatchTree);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(BufferSize);
+
+    if (Event != NULL || ApcRoutine == NULL || !Asynchronous) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ShimAcquireRawLock(&handle->Key->Lock);
+
+    if (handle->NotifyItem != NULL) {
+        ShimReleaseRawLock(&handle->Key->Lock);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    handle->NotifyItem = ApcRoutine;
+    handle->NotifyQueue = (WORK_QUEUE_TYPE)(ULONG_PTR)ApcContext;
+    handle->NotifyIoStatus = IoStatusBlock;
+    IoStatusBlock->Status = STATUS_PENDING;
+
+    ShimReleaseRawLock(&handle->Key->Lock);
+
+    return STATUS_PENDING;
+}
+
+
+//
+// Start and stop
+//
+
+VOID
+ShimStartWorkerThreads(
+    VOID
+    )
+{
+    ULONG i;
+
+    InitializeListHead(&ShimIo.Devices);
+    InitializeListHead(&ShimIo.WorkQueue);
+    ShimIo.WorkStopping = 0;
+
+    for (i = 0; i < SHIM_WORKER_THREADS; i++) {
+        pthread_create(&ShimIo.Workers[i], NULL, ShimWorkerThread, (PVOID)(ULONG_PTR)i);
+    }
+    ShimIo.WorkerCount = SHIM_WORKER_THREADS;
+}
+
+VOID
+ShimStopWorkerThreads(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Lets the worker threads finish the queued work and stops them.
+
+--*/
+{
+    ULONG i;
+
+    __atomic_store_n(&ShimIo.WorkStopping, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ShimIo.WorkSequence, 1, __ATOMIC_SEQ_CST);
+    ShimIoFutexWake(&ShimIo.WorkSequence, INT_MAX);
+
+    for (i = 0; i < ShimIo.WorkerCount; i++) {
+        pthread_join(ShimIo.Workers[i], NULL);
+    }
+    ShimIo.WorkerCount = 0;
+}